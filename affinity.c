@@ -0,0 +1,306 @@
+#include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEBUG
+#include "debug.h"
+#include "util.h"
+#include "affinity.h"
+
+#ifdef __linux__
+
+#define MAX_NODES 64
+
+typedef struct {
+	int cpu;
+	int smt;	/* Rank among core siblings, 0: first hardware thread */
+	int node;
+	int package;
+	int core;
+} cpu_info_t;
+
+/* Parse sysfs cpu list ("0-3,8,10-11") */
+static bool
+read_cpulist(char *name, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+	FILE *f = fopen(name, "r");
+	if (!f)  return false;
+	int a, b;
+	char sep = ',';
+	while (sep == ',' && fscanf(f, "%d", &a) == 1) {
+		b = a;
+		if (fscanf(f, "%c", &sep) == 1 && sep == '-')
+			if (fscanf(f, "%d%c", &b, &sep) < 1)  break;
+		for (int i = a; i <= b && i < CPU_SETSIZE; i++)
+			CPU_SET(i, set);
+	}
+	fclose(f);
+	return true;
+}
+
+static int
+read_topology(int cpu, char *what)
+{
+	char name[128];
+	snprintf(name, sizeof(name), "/sys/devices/system/cpu/cpu%i/topology/%s", cpu, what);
+	FILE *f = fopen(name, "r");
+	int v = -1;
+	if (!f)  return -1;
+	if (fscanf(f, "%d", &v) != 1)  v = -1;
+	fclose(f);
+	return v;
+}
+
+static int
+smt_rank(int cpu)
+{
+	char name[128];
+	snprintf(name, sizeof(name), "/sys/devices/system/cpu/cpu%i/topology/thread_siblings_list", cpu);
+	cpu_set_t siblings;
+	if (!read_cpulist(name, &siblings))  return 0;
+	int rank = 0;
+	for (int i = 0; i < cpu; i++)
+		rank += !!CPU_ISSET(i, &siblings);
+	return rank;
+}
+
+static int
+cpu_info_cmp(const void *p1, const void *p2)
+{
+	const cpu_info_t *a = (const cpu_info_t*)p1, *b = (const cpu_info_t*)p2;
+	if (a->smt != b->smt)          return a->smt - b->smt;
+	if (a->node != b->node)        return a->node - b->node;
+	if (a->package != b->package)  return a->package - b->package;
+	if (a->core != b->core)        return a->core - b->core;
+	return a->cpu - b->cpu;
+}
+
+int
+cpu_placement(int *cpus, int max, int node)
+{
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed))  return 0;
+
+	cpu_set_t nodes[MAX_NODES];
+	for (int i = 0; i < MAX_NODES; i++) {
+		char name[128];
+		snprintf(name, sizeof(name), "/sys/devices/system/node/node%i/cpulist", i);
+		read_cpulist(name, &nodes[i]);
+	}
+
+	cpu_info_t *info = cmalloc(CPU_SETSIZE * sizeof(cpu_info_t));
+	int n = 0;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &allowed))  continue;
+		cpu_info_t *c = &info[n];
+		c->cpu = cpu;
+		c->node = 0;
+		for (int i = 0; i < MAX_NODES; i++)
+			if (CPU_ISSET(cpu, &nodes[i]))  {  c->node = i;  break;  }
+		if (node >= 0 && c->node != node)  continue;
+		c->smt = smt_rank(cpu);
+		c->package = read_topology(cpu, "physical_package_id");
+		c->core = read_topology(cpu, "core_id");
+		n++;
+	}
+	qsort(info, n, sizeof(*info), cpu_info_cmp);
+
+	if (n > max)  n = max;
+	for (int i = 0; i < n; i++)
+		cpus[i] = info[i].cpu;
+	free(info);
+	return n;
+}
+
+/* Cpus we were allowed to run on at startup */
+static cpu_set_t allowed_cpus;
+
+static __attribute__((constructor)) void
+affinity_init(void)
+{
+	if (sched_getaffinity(0, sizeof(allowed_cpus), &allowed_cpus))
+		CPU_ZERO(&allowed_cpus);
+}
+
+bool
+thread_unpin(pthread_t thread)
+{
+	if (!CPU_COUNT(&allowed_cpus))  return false;
+	errno = pthread_setaffinity_np(thread, sizeof(allowed_cpus), &allowed_cpus);
+	if (errno && DEBUGL(2))  perror("pthread_setaffinity_np");
+	return !errno;
+}
+
+bool
+thread_spread(pthread_t thread, int n)
+{
+	return false;
+}
+
+bool
+thread_pin(pthread_t thread, int cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	errno = pthread_setaffinity_np(thread, sizeof(set), &set);
+	if (errno && DEBUGL(2))  perror("pthread_setaffinity_np");
+	return !errno;
+}
+
+#elif defined(_WIN32)
+
+#include <windows.h>
+
+/* Cpus are numbered group * GROUP_CPUS + number in group. Machines with
+ * more than 64 logical cpus have several processor groups, a thread only
+ * runs in one group so threads must be spread explicitly to use them all. */
+#define GROUP_CPUS ((int)sizeof(KAFFINITY) * 8)
+
+typedef struct {
+	int cpu;
+	int smt;	/* Rank among core siblings, 0: first hardware thread */
+	int node;
+	int group;
+	int core;
+} cpu_info_t;
+
+static int
+cpu_info_cmp(const void *p1, const void *p2)
+{
+	const cpu_info_t *a = (const cpu_info_t*)p1, *b = (const cpu_info_t*)p2;
+	if (a->smt != b->smt)      return a->smt - b->smt;
+	if (a->node != b->node)    return a->node - b->node;
+	if (a->group != b->group)  return a->group - b->group;
+	if (a->core != b->core)    return a->core - b->core;
+	return a->cpu - b->cpu;
+}
+
+int
+cpu_placement(int *cpus, int max, int node)
+{
+	DWORD len = 0;
+	GetLogicalProcessorInformationEx(RelationProcessorCore, NULL, &len);
+	if (GetLastError() != ERROR_INSUFFICIENT_BUFFER)  return 0;
+	char *buf = cmalloc(len);
+	if (!GetLogicalProcessorInformationEx(RelationProcessorCore, (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)buf, &len)) {
+		free(buf);
+		return 0;
+	}
+
+	int ncpus = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+	cpu_info_t *info = cmalloc(ncpus * sizeof(cpu_info_t));
+	int n = 0, core = 0;
+	for (DWORD off = 0; off < len; core++) {
+		SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *p = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)(buf + off);
+		off += p->Size;
+		int smt = 0;
+		for (int g = 0; g < p->Processor.GroupCount; g++) {
+			GROUP_AFFINITY *ga = &p->Processor.GroupMask[g];
+			for (int i = 0; i < GROUP_CPUS && n < ncpus; i++) {
+				if (!(ga->Mask & ((KAFFINITY)1 << i)))  continue;
+				PROCESSOR_NUMBER pn = { ga->Group, i, 0 };
+				USHORT nd;
+				if (!GetNumaProcessorNodeEx(&pn, &nd))  nd = 0;
+				int rank = smt++;
+				if (node >= 0 && nd != node)  continue;
+				cpu_info_t *c = &info[n++];
+				c->cpu = ga->Group * GROUP_CPUS + i;
+				c->smt = rank;
+				c->node = nd;
+				c->group = ga->Group;
+				c->core = core;
+			}
+		}
+	}
+	free(buf);
+	qsort(info, n, sizeof(*info), cpu_info_cmp);
+
+	if (n > max)  n = max;
+	for (int i = 0; i < n; i++)
+		cpus[i] = info[i].cpu;
+	free(info);
+	return n;
+}
+
+static bool
+thread_set_affinity(pthread_t thread, GROUP_AFFINITY *ga)
+{
+	HANDLE h = pthread_gethandle(thread);
+	bool ok = (h && SetThreadGroupAffinity(h, ga, NULL));
+	if (!ok && DEBUGL(2))  fprintf(stderr, "SetThreadGroupAffinity: error %lu\n", (unsigned long)GetLastError());
+	return ok;
+}
+
+static KAFFINITY
+group_mask(WORD group)
+{
+	int n = GetActiveProcessorCount(group);
+	return (n >= GROUP_CPUS ? ~(KAFFINITY)0 : ((KAFFINITY)1 << n) - 1);
+}
+
+/* Whole processor group the thread is in now: threads stay spread
+ * over groups once unpinned. */
+bool
+thread_unpin(pthread_t thread)
+{
+	HANDLE h = pthread_gethandle(thread);
+	GROUP_AFFINITY ga;
+	if (!h || !GetThreadGroupAffinity(h, &ga))  return false;
+	ga.Mask = group_mask(ga.Group);
+	return thread_set_affinity(thread, &ga);
+}
+
+bool
+thread_spread(pthread_t thread, int n)
+{
+	int groups = GetActiveProcessorGroupCount();
+	if (groups < 2)  return false;
+	GROUP_AFFINITY ga;
+	memset(&ga, 0, sizeof(ga));
+	ga.Group = n % groups;
+	ga.Mask = group_mask(ga.Group);
+	return thread_set_affinity(thread, &ga);
+}
+
+bool
+thread_pin(pthread_t thread, int cpu)
+{
+	GROUP_AFFINITY ga;
+	memset(&ga, 0, sizeof(ga));
+	ga.Group = cpu / GROUP_CPUS;
+	ga.Mask = (KAFFINITY)1 << (cpu % GROUP_CPUS);
+	return thread_set_affinity(thread, &ga);
+}
+
+#else
+
+int
+cpu_placement(int *cpus, int max, int node)
+{
+	return 0;
+}
+
+bool
+thread_pin(pthread_t thread, int cpu)
+{
+	return false;
+}
+
+bool
+thread_spread(pthread_t thread, int n)
+{
+	return false;
+}
+
+bool
+thread_unpin(pthread_t thread)
+{
+	return false;
+}
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef PACHI_AFFINITY_H
+#define PACHI_AFFINITY_H
+
+/* Thread placement on cpus (Linux and Windows, no-op elsewhere).
+ * Topology comes from sysfs on Linux, no libnuma / hwloc dependency.
+ * On Windows cpu numbers span processor groups: group * 64 + number
+ * (64-bit builds). */
+
+#include <stdbool.h>
+#include <pthread.h>
+
+/* Cpus we may run on, in placement order: one hardware thread per physical
+ * core first, SMT siblings only after every core got one. @node >= 0 keeps
+ * only cpus of this NUMA node. Returns number of cpus stored (at most @max),
+ * 0 if topology is unknown. */
+int cpu_placement(int *cpus, int max, int node);
+
+/* Pin @thread to @cpu. */
+bool thread_pin(pthread_t thread, int cpu);
+
+/* Let @thread run on all cpus we were allowed to use at startup. */
+bool thread_unpin(pthread_t thread);
+
+/* Several processor groups (Windows, more than 64 cpus): move unpinned
+ * worker @n to its share of groups, threads only run in the group they
+ * were started in otherwise. No-op elsewhere. */
+bool thread_spread(pthread_t thread, int n);
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef PACHI_BITBOARD_H
+#define PACHI_BITBOARD_H
+
+/* Bitboards: one bit per intersection, one word per row.
+ * Meant for whole-board set operations (flood fills, region
+ * reachability...) which are much cheaper this way than going
+ * through coords one by one. Row loops are simple enough for the
+ * compiler to vectorize. */
+
+#include <stdint.h>
+#include <string.h>
+#include "board.h"
+
+typedef uint32_t bitrow_t;
+
+typedef struct {
+	bitrow_t row[BOARD_MAX_SIZE];
+} bitboard_t;
+
+#define bitboard_x(c)  (coord_x(c) - 1)
+#define bitboard_y(c)  (coord_y(c) - 1)
+
+static inline void
+bitboard_clear(bitboard_t *bb)
+{
+	memset(bb, 0, sizeof(*bb));
+}
+
+static inline void
+bitboard_set(bitboard_t *bb, coord_t c)
+{
+	bb->row[bitboard_y(c)] |= (bitrow_t)1 << bitboard_x(c);
+}
+
+static inline bool
+bitboard_test(bitboard_t *bb, coord_t c)
+{
+	return (bb->row[bitboard_y(c)] >> bitboard_x(c)) & 1;
+}
+
+static inline bool
+bitboard_empty(bitboard_t *bb, int size)
+{
+	bitrow_t r = 0;
+	for (int y = 0; y < size; y++)
+		r |= bb->row[y];
+	return !r;
+}
+
+/* @dst = @src plus its 4-neighbors, restricted to @mask. */
+static inline void
+bitboard_dilate(bitboard_t *dst, bitboard_t *src, bitboard_t *mask, int size)
+{
+	bitrow_t edge = ((bitrow_t)1 << size) - 1;
+	for (int y = 0; y < size; y++) {
+		bitrow_t r = src->row[y];
+		r |= (r << 1) | (r >> 1);
+		if (y > 0)         r |= src->row[y - 1];
+		if (y < size - 1)  r |= src->row[y + 1];
+		dst->row[y] = r & edge & mask->row[y];
+	}
+}
+
+/* @dst = points next to @src ones (not @src itself). */
+static inline void
+bitboard_neighbors(bitboard_t *dst, bitboard_t *src, int size)
+{
+	bitrow_t edge = ((bitrow_t)1 << size) - 1;
+	for (int y = 0; y < size; y++) {
+		bitrow_t r = src->row[y];
+		r = (r << 1) | (r >> 1);
+		if (y > 0)         r |= src->row[y - 1];
+		if (y < size - 1)  r |= src->row[y + 1];
+		dst->row[y] = r & edge;
+	}
+}
+
+/* Grow @bb within @mask as far as it goes.
+ * Points of @bb outside @mask can seed the fill but don't stay. */
+static inline void
+bitboard_flood_fill(bitboard_t *bb, bitboard_t *mask, int size)
+{
+	bitboard_t next;
+	bitboard_dilate(&next, bb, mask, size);
+	do {
+		*bb = next;
+		bitboard_dilate(&next, bb, mask, size);
+	} while (memcmp(&next, bb, sizeof(bitrow_t) * size));
+}
+
+
+/* Legal moves for @color: free points that are not suicide or ko
+ * (same as board_is_valid_play_no_suicide()), eyes are legal.
+ * Meant to be computed once and shared by everyone rating moves
+ * for the same position. */
+void board_legal_moves(board_t *b, enum stone color, bitboard_t *legal);
+
+#endif
@@ -1,11 +1,15 @@
 #include <assert.h>
 #include <math.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 //#define DEBUG
 #include "board.h"
+#include "board_undo.h"
+#include "hashset.h"
+#include "bitboard.h"
 #include "debug.h"
 #include "fbook.h"
 #include "mq.h"
@@ -29,6 +33,12 @@
 static int  board_play_f(board_t *board, move_t *m, int f);
 static void board_addf(board_t *b, coord_t c);
 static void board_rmf(board_t *b, int f);
+static void board_eyes_forget(board_t *b, coord_t coord);
+
+#define eye_known(b, color, c)  (((b)->eyes[(color) - 1][(c) >> 6] >> ((c) & 63)) & 1)
+#define eye_set(b, color, c)    ((b)->eyes[(color) - 1][(c) >> 6] |= (uint64_t)1 << ((c) & 63))
+#define eye_forget(b, c)        do {  uint64_t m__ = ~((uint64_t)1 << ((c) & 63));  \
+					(b)->eyes[0][(c) >> 6] &= m__;  (b)->eyes[1][(c) >> 6] &= m__;  } while (0)
 
 
 static void
@@ -52,6 +62,7 @@ board_new(int size, char *fbookfile)
 	board_setup(b);
 	b->fbookfile = fbookfile;
 	b->rsize = size;
+	b->superko_set_owner = true;
 	board_clear(b);	
 	return b;
 }
@@ -64,20 +75,101 @@ board_delete(board_t **b)
 	*b = NULL;
 }
 
+/* Boards only use part of the maps (BOARD_MAX_COORDS is for 19x19) and
+ * free positions / capturable groups lists: copy / compare the parts in
+ * use only, much less than the whole struct on small boards. */
+#define board_head_size()          (offsetof(board_t, b))
+#define board_tail_size()          (sizeof(board_t) - offsetof(board_t, playout_board))
+#define foreach_board_part(board_, do_part) \
+	do { \
+		int n__ = board_max_coords(board_); \
+		do_part(0, board_head_size()); \
+		do_part(offsetof(board_t, b), n__ * sizeof((board_)->b[0])); \
+		do_part(offsetof(board_t, n), n__ * sizeof((board_)->n[0])); \
+		do_part(offsetof(board_t, g), n__ * sizeof((board_)->g[0])); \
+		do_part(offsetof(board_t, gi), n__ * sizeof((board_)->gi[0])); \
+		do_part(offsetof(board_t, p), n__ * sizeof((board_)->p[0])); \
+		BOARD_PAT3_PART(board_, do_part); \
+		do_part(offsetof(board_t, f), (board_)->flen * sizeof((board_)->f[0])); \
+		do_part(offsetof(board_t, flen), sizeof((board_)->flen)); \
+		do_part(offsetof(board_t, fmap), n__ * sizeof((board_)->fmap[0])); \
+		BOARD_C_PART(board_, do_part); \
+		do_part(offsetof(board_t, playout_board), board_tail_size()); \
+	} while (0)
+
+#ifdef BOARD_PAT3
+#define BOARD_PAT3_PART(board_, do_part)  do_part(offsetof(board_t, pat3), n__ * sizeof((board_)->pat3[0]))
+#else
+#define BOARD_PAT3_PART(board_, do_part)  ((void)0)
+#endif
+
+#ifdef WANT_BOARD_C
+#define BOARD_C_PART(board_, do_part)  do { \
+		do_part(offsetof(board_t, c), (board_)->clen * sizeof((board_)->c[0])); \
+		do_part(offsetof(board_t, clen), sizeof((board_)->clen)); \
+	} while (0)
+#else
+#define BOARD_C_PART(board_, do_part)  ((void)0)
+#endif
+
 int
 board_cmp(board_t *b1, board_t *b2)
 {
-	return memcmp(b1, b2, sizeof(board_t));
+	int r = 0;
+#define cmp_part(offset, size)  \
+	if (!r)  r = memcmp((char*)b1 + (offset), (char*)b2 + (offset), (size))
+	if (b1->flen != b2->flen)  return b1->flen - b2->flen;
+#ifdef WANT_BOARD_C
+	if (b1->clen != b2->clen)  return b1->clen - b2->clen;
+#endif
+	foreach_board_part(b1, cmp_part);
+#undef cmp_part
+	return r;
+}
+
+coord_t
+coord_transform(board_t *b, coord_t coord, int sym)
+{
+	int stride = board_stride(b);
+	int x = coord_x(coord);  int y = coord_y(coord);
+	if (sym & SYM_VMIRROR)  coord = coord_xy(x, stride - 1 - y);
+	x = coord_x(coord);  y = coord_y(coord);
+	if (sym & SYM_HMIRROR)  coord = coord_xy(stride - 1 - x, y);
+	x = coord_x(coord);  y = coord_y(coord);
+	if (sym & SYM_XYFLIP)   coord = coord_xy(y, x);
+	return coord;
+}
+
+int
+transform_inverse(board_t *b, int sym)
+{
+	coord_t p = coord_xy(1, 2);
+	for (int j = 0; j < 8; j++)
+		if (coord_transform(b, coord_transform(b, p, sym), j) == p)
+			return j;
+	assert(0);
+	return 0;
 }
 
 void
 board_copy(board_t *b2, board_t *b1)
 {
-	memcpy(b2, b1, sizeof(board_t));
+#define copy_part(offset, size)  \
+	memcpy((char*)b2 + (offset), (char*)b1 + (offset), (size))
+	foreach_board_part(b1, copy_part);
+#undef copy_part
+	/* Not compared by board_cmp(), it's just a cache. */
+	memcpy(b2->eyes, b1->eyes, sizeof(b1->eyes));
+	b2->eyes_n = b1->eyes_n;
+#ifdef WANT_BOARD_C
+	for (int i = 0; i < b2->clen; i++)
+		b2->cmap[b2->c[i]] = i;
+#endif
 
 	// XXX: Special semantics.
 	b2->fbook = NULL;
 	b2->ps = NULL;
+	b2->superko_set_owner = false;
 }
 
 void
@@ -85,6 +177,7 @@ board_done(board_t *board)
 {
 	if (board->fbook) fbook_done(board->fbook);
 	if (board->ps) free(board->ps);
+	if (board->superko_set_owner)  hashset_delete(&board->superko_set);
 }
 
 void
@@ -216,6 +309,7 @@ board_clear(board_t *board)
 	floating_t komi = board->komi;
 	char *fbookfile = board->fbookfile;
 	enum rules rules = board->rules;
+	bool superko_set = board->superko_set_owner;
 
 	board_done(board);
 
@@ -233,6 +327,12 @@ board_clear(board_t *board)
 	board->fbookfile = fbookfile;
 	board->rules = rules;
 
+	if (superko_set) {
+		board->superko_set = hashset_new(8);
+		board->superko_set_owner = true;
+		hashset_add(board->superko_set, board->hash);
+	}
+
 	if (board->fbookfile)
 		board->fbook = fbook_init(board->fbookfile, board);
 }
@@ -446,16 +546,33 @@ board_try_random_move(board_t *b, enum stone color, coord_t *coord, int f, ppr_p
 	return likely(board_play(b, &m) >= 0);
 }
 
+/* One-point eyes are never permitted (playout permits all start with
+ * board_permit()). Remember eyes we find so that next scans can skip
+ * them right away, in the endgame most free positions are eyes. */
+static inline bool
+board_try_random_move_noeye(board_t *b, enum stone color, coord_t *coord, int f, ppr_permit permit, void *permit_data)
+{
+	coord_t c = b->f[f];
+	if (eye_known(b, color, c))
+		return false;
+	if (unlikely(board_is_one_point_eye(b, c, color))) {
+		eye_set(b, color, c);
+		b->eyes_n++;
+		return false;
+	}
+	return board_try_random_move(b, color, coord, f, permit, permit_data);
+}
+
 void
 board_play_random(board_t *b, enum stone color, coord_t *coord, ppr_permit permit, void *permit_data)
 {
 	if (likely(b->flen)) {
 		int base = fast_random(b->flen), f;
 		for (f = base; f < b->flen; f++)
-			if (board_try_random_move(b, color, coord, f, permit, permit_data))
+			if (board_try_random_move_noeye(b, color, coord, f, permit, permit_data))
 				return;
 		for (f = 0; f < base; f++)
-			if (board_try_random_move(b, color, coord, f, permit, permit_data))
+			if (board_try_random_move_noeye(b, color, coord, f, permit, permit_data))
 				return;
 	}
 
@@ -500,67 +617,92 @@ board_eye_color(board_t *b, coord_t c)
 	return S_NONE;
 }
 
+int
+board_group_count_libs(board_t *b, group_t group)
+{
+	int libs = 0;
+	bool watermark[BOARD_MAX_COORDS] = { 0, };
+	foreach_in_group(b, group) {
+		foreach_neighbor(b, c, {
+			if (board_at(b, c) != S_NONE || watermark[c])
+				continue;
+			watermark[c] = true;
+			libs++;
+		});
+	} foreach_in_group_end;
+	return libs;
+}
+
+void
+board_legal_moves(board_t *b, enum stone color, bitboard_t *legal)
+{
+	int size = board_rsize(b);
+	bitboard_t empty, next_to_empty;
+	bitboard_clear(&empty);
+	foreach_free_point(b) {
+		bitboard_set(&empty, c);
+	} foreach_free_point_end;
+
+	/* Points with an empty neighbor are always legal, only check the others. */
+	bitboard_neighbors(&next_to_empty, &empty, size);
+	bitboard_clear(legal);
+	for (int y = 0; y < size; y++)
+		legal->row[y] = empty.row[y] & next_to_empty.row[y];
+
+	foreach_free_point(b) {
+		if (!bitboard_test(legal, c) && board_is_valid_play_no_suicide(b, color, c))
+			bitboard_set(legal, c);
+	} foreach_free_point_end;
+}
+
 floating_t
 board_fast_score(board_t *board)
 {
+	/* Stones are counted incrementally, only free points left to check
+	 * (few of them at the end of a playout, mostly eyes). */
 	int scores[S_MAX] = { 0, };
-	
-	foreach_point(board) {
-		enum stone color = board_at(board, c);
-		if (color == S_NONE && board->rules != RULES_STONES_ONLY)
-			color = board_eye_color(board, c);
-		scores[color]++;
-		// fprintf(stderr, "%d, %d ++%d = %d\n", coord_x(c), coord_y(c), color, scores[color]);
-	} foreach_point_end;
+	scores[S_BLACK] = board->stones[S_BLACK];
+	scores[S_WHITE] = board->stones[S_WHITE];
+
+	if (board->rules != RULES_STONES_ONLY)
+		foreach_free_point(board) {
+			scores[board_eye_color(board, c)]++;
+		} foreach_free_point_end;
 
 	return board_score(board, scores);
 }
 
-/* One flood-fill iteration.
- * Empty spots start with value -1 initially (unset). 
- * Returns true if next iteration is required. */
-static bool
-board_tromp_taylor_iter(board_t *board, int *ownermap)
+/* Tromp-Taylor flood fill: empty points which reach only one color
+ * are owned by that color, dame otherwise. */
+static void
+board_tromp_taylor_fill(board_t *board, int *ownermap)
 {
-	bool needs_update = false;
+	if (board->rules == RULES_STONES_ONLY) {
+		foreach_free_point(board) {  ownermap[c] = FO_DAME;  } foreach_free_point_end;
+		return;
+	}
+	
+	int size = board_rsize(board);
+	bitboard_t empty, reach[S_MAX];
+	bitboard_clear(&empty);
+	bitboard_clear(&reach[S_BLACK]);
+	bitboard_clear(&reach[S_WHITE]);
 	foreach_free_point(board) {
-		/* Ignore occupied and already-dame positions. */
-		assert(board_at(board, c) == S_NONE);
-		if (board->rules == RULES_STONES_ONLY)
-		    ownermap[c] = FO_DAME;
-		if (ownermap[c] == FO_DAME)
-			continue;
-		
-		/* Count neighbors. */
-		int nei[4] = {0};
-		foreach_neighbor(board, c, {
-			nei[ownermap[c]]++;
-		});
-		
-		/* If we have neighbors of both colors, or dame, we are dame too. */
-		if ((nei[S_BLACK] && nei[S_WHITE]) || nei[FO_DAME]) {
-			ownermap[c] = FO_DAME;
-			foreach_neighbor(board, c, {  /* Speed up the propagation. */
-				if (board_at(board, c) == S_NONE)
-					ownermap[c] = FO_DAME;
-			});
-			needs_update = true;
-			continue;
-		}
-		
-		/* If we have neighbors of one color, we are owned by that color, too. */
-		if (ownermap[c] == -1 && (nei[S_BLACK] || nei[S_WHITE])) {
-			int newowner = (nei[S_BLACK] ? S_BLACK : S_WHITE);
-			ownermap[c] = newowner;
-			foreach_neighbor(board, c, {  /* Speed up the propagation. */
-				if (board_at(board, c) == S_NONE && ownermap[c] == -1)
-					ownermap[c] = newowner;
-			});
-			needs_update = true;
-			continue;
-		}
+		bitboard_set(&empty, c);
+	} foreach_free_point_end;
+	foreach_point(board) {  /* Dead stones count as opponent's */
+		if (ownermap[c] == S_BLACK || ownermap[c] == S_WHITE)
+			bitboard_set(&reach[ownermap[c]], c);
+	} foreach_point_end;
+
+	bitboard_flood_fill(&reach[S_BLACK], &empty, size);
+	bitboard_flood_fill(&reach[S_WHITE], &empty, size);
+
+	foreach_free_point(board) {
+		bool black = bitboard_test(&reach[S_BLACK], c);
+		bool white = bitboard_test(&reach[S_WHITE], c);
+		ownermap[c] = (black == white ? FO_DAME : (black ? S_BLACK : S_WHITE));
 	} foreach_free_point_end;
-	return needs_update;
 }
 
 static int
@@ -660,8 +802,7 @@ board_official_score_details(board_t *b, move_queue_t *dead,
 	if (!s[S_BLACK] && !s[S_WHITE])
 		return b->komi;
 
-	while (board_tromp_taylor_iter(b, ownermap))
-		/* Flood-fill... */;
+	board_tromp_taylor_fill(b, ownermap);
 
 	int scores[S_MAX] = {0};
 	foreach_point(b) {
@@ -782,16 +923,10 @@ board_commit_move(board_t *b, move_t *m)
 	b->moves++;
 }
 
-/* Update board hash with given coordinate. */
-static void profiling_noinline
-board_hash_update(board_t *board, coord_t coord, enum stone color)
+/* Update pat3 of @coord neighbors after stone change at @coord. */
+static inline void
+board_pat3_update(board_t *board, coord_t coord)
 {
-	if (!playout_board(board)) {
-		board->hash ^= hash_at(coord, color);
-		if (DEBUGL(8))
-			fprintf(stderr, "board_hash_update(%d,%d,%d) ^ %" PRIhash " -> %" PRIhash "\n", color, coord_x(coord), coord_y(coord), hash_at(coord, color), board->hash);
-	}
-
 #if defined(BOARD_PAT3)
 	/* @color is not what we need in case of capture. */
 	static const int ataribits[8] = { -1, 0, -1, 1, 2, -1, 3, -1 };
@@ -818,6 +953,38 @@ board_hash_update(board_t *board, coord_t coord, enum stone color)
 #endif
 }
 
+/* Stones changed around @coord, known eyes there may not be eyes anymore. */
+static inline void
+board_eyes_forget(board_t *b, coord_t coord)
+{
+	if (likely(!b->eyes_n))  return;
+	eye_forget(b, coord);
+	foreach_8neighbor(b, coord) {
+		eye_forget(b, c);
+	} foreach_8neighbor_end;
+}
+
+/* Update board hash with given coordinate. */
+static void profiling_noinline
+board_hash_update(board_t *board, coord_t coord, enum stone color)
+{
+	if (!playout_board(board)) {
+		board->hash ^= hash_at(coord, color);
+		if (DEBUGL(8))
+			fprintf(stderr, "board_hash_update(%d,%d,%d) ^ %" PRIhash " -> %" PRIhash "\n", color, coord_x(coord), coord_y(coord), hash_at(coord, color), board->hash);
+	}
+
+	board_pat3_update(board, coord);
+}
+
+/* Update board hash with xor of several stone hashes (captures). */
+static inline void
+board_hash_update_bulk(board_t *board, hash_t h)
+{
+	if (!playout_board(board))
+		board->hash ^= h;
+}
+
 /* Commit current board hash to history. */
 static void profiling_noinline
 board_hash_commit(board_t *b)
@@ -834,6 +1001,18 @@ board_hash_commit(board_t *b)
 		}
 	}
 
+	if (b->superko_set) {
+		if (hashset_contains(b->superko_set, b->hash)) {
+			if (DEBUGL(5))  fprintf(stderr, "SUPERKO VIOLATION noted at %s\n", coord2sstr(last_move(b).coord));
+			b->superko_violation = true;
+			return;
+		}
+		if (b->superko_set_owner) {
+			hashset_add(b->superko_set, b->hash);
+			if (b->u)  b->u->superko_set_added = true;
+		}
+	}
+
 	int i = b->hash_history_next;
 	b->hash_history[i] = b->hash;
 	b->hash_history_next = (i+1) % BOARD_HASH_HISTORY;
@@ -888,6 +1067,7 @@ board_capturable_add(board_t *board, group_t group, coord_t lib)
 	/* Update the list of capturable groups. */
 	assert(group);
 	assert(board->clen < BOARD_MAX_GROUPS);
+	board->cmap[group] = board->clen;
 	board->c[board->clen++] = group;
 #endif
 }
@@ -906,13 +1086,14 @@ board_capturable_rm(board_t *board, group_t group, coord_t lib)
 
 #ifdef WANT_BOARD_C
 	/* Update the list of capturable groups. */
-	for (int i = 0; i < board->clen; i++)
-		if (unlikely(board->c[i] == group)) {
-			board->c[i] = board->c[--board->clen];
-			return;
-		}
-	fprintf(stderr, "rm of bad group %s\n", coord2sstr(group_base(group)));
-	assert(0);
+	int i = board->cmap[group];
+	if (unlikely(i >= board->clen || board->c[i] != group)) {
+		fprintf(stderr, "rm of bad group %s\n", coord2sstr(group_base(group)));
+		assert(0);
+	}
+	group_t last = board->c[--board->clen];
+	board->c[i] = last;
+	board->cmap[last] = i;
 #endif
 }
 
@@ -929,3 +1110,38 @@ board_play(board_t *b, move_t *m)
 
 	return board_play_(b, m);
 }
+
+/* Same code again, saving undo info this time. */
+#define FULL_BOARD_UNDO
+#include "board_play.h"
+
+int
+board_play_undoable(board_t *b, move_t *m, board_undo_t *u)
+{
+#ifdef BOARD_UNDO_CHECKS
+        assert(!b->quicked);
+#endif
+	board_undo_init(b, m, u);
+	u->full = true;
+	u->f = (is_pass(m->coord) ? -1 : b->fmap[m->coord]);
+	u->last_move_i = b->last_move_i;
+	u->last_move_slot = b->last_moves[last_move_nexti(b)];
+	u->hash = b->hash;
+	memcpy(u->stones, b->stones, sizeof(u->stones));
+	u->hash_history_next = b->hash_history_next;
+	u->hash_history_slot = b->hash_history[b->hash_history_next];
+	u->superko_violation = b->superko_violation;
+	u->superko_set_added = false;
+#ifdef DCNN_DARKFOREST
+	u->moveno = (is_pass(m->coord) ? 0 : b->moveno[m->coord]);
+#endif
+#ifdef WANT_BOARD_C
+	u->clen = b->clen;
+	memcpy(u->c, b->c, b->clen * sizeof(b->c[0]));
+#endif
+
+	b->u = u;
+	int r = board_play_undo_(b, m);
+	b->u = NULL;
+	return r;
+}
@@ -10,6 +10,7 @@
 #include "mq.h"
 
 struct ownermap;
+struct hashset;
 
 
 /**************************************************************************************/
@@ -19,8 +20,11 @@ struct ownermap;
 
 //#define BOARD_SIZE 9            /* Fixed board size, allows better optimization */
 
-//#define BOARD_PAT3              /* Incremental 3x3 pattern codes */
-                                  /* XXX faster without ?! */
+//#define BOARD_PAT3              /* Incremental 3x3 pattern codes (make BOARD_PAT3=1) */
+                                  /* XXX not faster than computing them in moggy so far */
+
+//#define BOARD_EXACT_LIBS        /* Exact liberty sets for groups, see group_info_t */
+                                  /* Bigger boards, but no more liberty refill scans. */
 
 //#define BOARD_HASH_COMPAT	  /* Enable to get same hashes as old Pachi versions. */
 
@@ -54,10 +58,13 @@ typedef struct {              /* Keep track of only up to GROUP_KEEP_LIBS. over
 #define GROUP_KEEP_LIBS  10   /* _Combination_ of these two values can make some difference in performance. */
 #define GROUP_REFILL_LIBS 5   /* Refill lib[] only when we hit this; this must be at least 2!
 			       * Moggy requires at least 3 - see below for semantic impact. */
-	int libs;             /* libs is only LOWER BOUND for the number of real liberties!!!	
+	int16_t libs;         /* libs is only LOWER BOUND for the number of real liberties!!!	
 			       * It denotes only number of items in lib[], thus you can rely
 			       * on it to store real liberties only up to <= GROUP_REFILL_LIBS. */
-	coord_t lib[GROUP_KEEP_LIBS];  
+	uint16_t lib[GROUP_KEEP_LIBS];  
+#ifdef BOARD_EXACT_LIBS
+	uint64_t libset[(BOARD_MAX_COORDS + 63) / 64];  /* All liberties, one bit per coord. */
+#endif
 } group_info_t;
 
 
@@ -130,6 +137,7 @@ typedef struct board {
 	int moves;
 	int captures[S_MAX];
 	int passes[S_MAX];
+FB_ONLY(int stones)[S_MAX];       /* Stones on the board by color, for board_fast_score() */
 	floating_t komi;
 	int handicap;
 	enum rules rules;
@@ -147,27 +155,34 @@ FB_ONLY(bool superko_violation);  /* Whether we tried to add a hash twice; board
 	/* The following structures are goban maps and are indexed by coord. The map 
 	 * is surrounded by a one-point margin from S_OFFBOARD stones in order to
 	 * speed up some internal loops. Some of the foreach iterators below might
-	 * include these points; you need to handle them yourselves, if you need to. */	
+	 * include these points; you need to handle them yourselves, if you need to.
+	 * Maps use compact types (coords fit in 16 bits) to keep boards small:
+	 * board_copy() cost and cache footprint matter a lot for playouts. */
 	
-	enum stone b[BOARD_MAX_COORDS];    /* Stones played on the board */
+	uint8_t b[BOARD_MAX_COORDS];       /* Stones played on the board (enum stone) */
 	neighbors_t n[BOARD_MAX_COORDS];   /* Neighboring colors; numbers of neighbors of index color */
 	
-	group_t g[BOARD_MAX_COORDS];       /* Group id the stones are part of; 0 == no group */	
+	uint16_t g[BOARD_MAX_COORDS];      /* Group id the stones are part of; 0 == no group */	
 	group_info_t gi[BOARD_MAX_COORDS]; /* Group information - indexed by gid (which is coord of base group stone) */
-	coord_t p[BOARD_MAX_COORDS];       /* Positions of next stones in the stone group; 0 == last stone */
+	uint16_t p[BOARD_MAX_COORDS];      /* Positions of next stones in the stone group; 0 == last stone */
 
 #ifdef BOARD_PAT3       
 FB_ONLY(hash3_t pat3)[BOARD_MAX_COORDS];   /* 3x3 pattern hash for each position; see pattern3.h for encoding
 					    * specification. The information is only valid for empty points. */
 #endif
 
-FB_ONLY(coord_t f)[BOARD_MAX_COORDS];      /* List of free positions - free position here is any valid move */
+FB_ONLY(uint16_t f)[BOARD_MAX_COORDS];     /* List of free positions - free position here is any valid move */
 FB_ONLY(int flen);                         /* including single-point eyes! */
-FB_ONLY(int fmap)[BOARD_MAX_COORDS];       /* Map free positions coords to their list index, for quick lookup. */
+FB_ONLY(uint16_t fmap)[BOARD_MAX_COORDS];  /* Map free positions coords to their list index, for quick lookup. */
+FB_ONLY(uint64_t eyes)[2][(BOARD_MAX_COORDS + 63) / 64];  /* Free positions known to be one-point eyes for black / white.
+					    * Cache for board_play_random(), only valid bits are set. */
+FB_ONLY(int eyes_n);                       /* Eyes found so far (some may be forgotten since) */
 
 #ifdef WANT_BOARD_C	
-FB_ONLY(group_t c)[BOARD_MAX_GROUPS];      /* List of capturable groups */
+FB_ONLY(uint16_t c)[BOARD_MAX_GROUPS];     /* List of capturable groups */
 FB_ONLY(int clen);
+FB_ONLY(uint16_t cmap)[BOARD_MAX_COORDS];  /* Map capturable groups to their list index, for O(1) removal.
+					    * Only valid for groups in c[], rebuilt on copy / undo. */
 #endif
 
 FB_ONLY(bool playout_board);
@@ -197,6 +212,11 @@ FB_ONLY(int moveno)[BOARD_MAX_COORDS];     /* Move number for each coord */
 	 
 	void *ps;                          /* Playout-specific state; persistent through board development,
 					    * initialized by play_random_game() and free()'d at board destroy time */
+
+	struct hashset *superko_set;       /* All positions of the game so far, for exact positional superko
+					    * (hash_history only covers last BOARD_HASH_HISTORY moves).
+					    * Board copies share it read-only, only owner adds positions. */
+	bool superko_set_owner;
 } board_t;
 
 
@@ -290,6 +310,14 @@ void board_print_target_move(board_t *b, FILE *f, coord_t target_move);
 /* Debugging: Compare 2 boards byte by byte. Don't use that for sorting =) */
 int board_cmp(board_t *b1, board_t *b2);
 
+/* Board symmetries: @sym (0-7) is a combination of these, applied in order. */
+#define SYM_VMIRROR     1
+#define SYM_HMIRROR     2
+#define SYM_XYFLIP      4
+coord_t coord_transform(board_t *b, coord_t coord, int sym);
+/* Symmetry undoing coord_transform(@sym) */
+int transform_inverse(board_t *b, int sym);
+
 /* Place given handicap on the board; coordinates are printed to f. */
 void board_handicap(board_t *b, int stones, move_queue_t *q);
 
@@ -316,6 +344,11 @@ static bool board_playing_ko_threat(board_t *b);
 /* Determine number of stones in a group, up to @max stones. */
 static int group_stone_count(board_t *b, group_t group, int max);
 
+/* Exact number of liberties of group. Cheap with BOARD_EXACT_LIBS,
+ * otherwise needs a group scan when it has more than GROUP_REFILL_LIBS. */
+static int board_group_exact_libs(board_t *b, group_t group);
+int board_group_count_libs(board_t *b, group_t group);
+
 /* Returns true if given coordinate has all neighbors of given color or the edge. */
 static bool board_is_eyelike(board_t *b, coord_t coord, enum stone eye_color);
 /* Returns true if given coordinate could be a false eye; this check makes
@@ -480,6 +513,28 @@ board_playing_ko_threat(board_t *b)
 }
 
 
+#ifdef BOARD_EXACT_LIBS
+#define libset_set(gi, c)   ((gi)->libset[(c) >> 6] |= (uint64_t)1 << ((c) & 63))
+#define libset_clr(gi, c)   ((gi)->libset[(c) >> 6] &= ~((uint64_t)1 << ((c) & 63)))
+#define libset_test(gi, c)  (((gi)->libset[(c) >> 6] >> ((c) & 63)) & 1)
+#endif
+
+static inline int
+board_group_exact_libs(board_t *b, group_t group)
+{
+	group_info_t *gi = &board_group_info(b, group);
+#ifdef BOARD_EXACT_LIBS
+	int n = 0;
+	for (int i = 0; i < (board_max_coords(b) + 63) / 64; i++)
+		n += __builtin_popcountll(gi->libset[i]);
+	return n;
+#else
+	if (gi->libs <= GROUP_REFILL_LIBS)
+		return gi->libs;
+	return board_group_count_libs(b, group);
+#endif
+}
+
 static inline int
 group_stone_count(board_t *b, group_t group, int max)
 {
@@ -1,5 +1,36 @@
 /* board_play() implementation */
 
+/* Quick boards always save undo info, full boards only in the
+ * board_play_undoable() copy (FULL_BOARD_UNDO, see board.c) so that
+ * regular board_play() doesn't pay for it. */
+#undef saving_undo
+#if defined(BOARD_UNDO) || defined(FULL_BOARD_UNDO)
+#define saving_undo(board)  1
+#else
+#define saving_undo(board)  0
+#endif
+
+#ifndef BOARD_UNDO
+#define undo_save_group_info  board_undo_save_group_info
+#define undo_save_suicide     board_undo_save_suicide
+#endif
+
+#ifdef FULL_BOARD_UNDO
+#define board_group_addlib           board_group_addlib_undo
+#define board_group_find_extra_libs  board_group_find_extra_libs_undo
+#define board_group_rmlib            board_group_rmlib_undo
+#define board_remove_stone           board_remove_stone_undo
+#define board_group_capture          board_group_capture_undo
+#define add_to_group                 add_to_group_undo
+#define merge_groups                 merge_groups_undo
+#define new_group                    new_group_undo
+#define play_one_neighbor            play_one_neighbor_undo
+#define board_play_outside           board_play_outside_undo
+#define board_play_in_eye            board_play_in_eye_undo
+#define board_play_f                 board_play_f_undo
+#define board_play_                  board_play_undo_
+#endif
+
 static void
 board_group_addlib(board_t *board, group_t group, coord_t coord)
 {
@@ -9,6 +40,9 @@ board_group_addlib(board_t *board, group_t group, coord_t coord)
 			board_group_info(board, group).libs, coord2sstr(coord));
 
 	group_info_t *gi = &board_group_info(board, group);
+#ifdef BOARD_EXACT_LIBS
+	libset_set(gi, coord);
+#endif
 	if (gi->libs < GROUP_KEEP_LIBS) {
 		for (int i = 0; i < GROUP_KEEP_LIBS; i++) {
 #if 0                   /* Seems extra branch just slows it down */
@@ -29,6 +63,20 @@ static void
 board_group_find_extra_libs(board_t *board, group_t group, group_info_t *gi, coord_t avoid)
 {
 	/* Add extra liberty from the board to our liberty list. */
+#ifdef BOARD_EXACT_LIBS
+	/* Liberty set has them all already, just pick new ones. */
+	for (int i = 0; i < (board_max_coords(board) + 63) / 64; i++)
+		for (uint64_t w = gi->libset[i]; w; w &= w - 1) {
+			coord_t c = i * 64 + __builtin_ctzll(w);
+			int j;
+			for (j = 0; j < gi->libs; j++)
+				if (gi->lib[j] == c)  break;
+			if (j < gi->libs)  continue;
+			gi->lib[gi->libs++] = c;
+			if (unlikely(gi->libs >= GROUP_KEEP_LIBS))
+				return;
+		}
+#else
 	unsigned char watermark[board_max_coords(board) / 8];
 	memset(watermark, 0, sizeof(watermark));
 #define watermark_get(c)	(watermark[c >> 3] & (1 << (c & 7)))
@@ -51,6 +99,7 @@ board_group_find_extra_libs(board_t *board, group_t group, group_info_t *gi, coo
 	} foreach_in_group_end;
 #undef watermark_get
 #undef watermark_set
+#endif
 }
 
 static void
@@ -62,6 +111,9 @@ board_group_rmlib(board_t *board, group_t group, coord_t coord)
 			board_group_info(board, group).libs, coord2sstr(coord));
 
 	group_info_t *gi = &board_group_info(board, group);
+#ifdef BOARD_EXACT_LIBS
+	libset_clr(gi, coord);
+#endif
 	for (int i = 0; i < GROUP_KEEP_LIBS; i++) {
 #if 0           /* Seems extra branch just slows it down */
 		if (!gi->lib[i]) break;
@@ -103,7 +155,8 @@ board_remove_stone(board_t *board, group_t group, coord_t c)
 	board_at(board, c) = S_NONE;
 	group_at(board, c) = 0;
 #ifdef FULL_BOARD
-	board_hash_update(board, c, color);
+	board->stones[color]--;
+	board_pat3_update(board, c);    /* Hash updated by caller */
 #endif
 
 	/* Increase liberties of surrounding groups */
@@ -116,11 +169,12 @@ board_remove_stone(board_t *board, group_t group, coord_t c)
 	});
 
 #ifdef FULL_BOARD	
-	/* board_hash_update() might have seen the freed up point as able
+	/* board_pat3_update() might have seen the freed up point as able
 	 * to capture another group in atari that only after the loop
 	 * above gained enough liberties. Reset pat3 again. */
 	board_pat3_reset(board, c);
 	board_addf(board, c);	
+	board_eyes_forget(board, c);
 #endif
 }
 
@@ -128,13 +182,25 @@ static int profiling_noinline
 board_group_capture(board_t *board, group_t group)
 {
 	int stones = 0;
+#ifdef FULL_BOARD
+	enum stone color = board_at(board, group_base(group));
+	hash_t h = 0;
+#endif
 
 	foreach_in_group(board, group) {
 		board->captures[stone_other(board_at(board, c))]++;
+#ifdef FULL_BOARD
+		h ^= hash_at(c, color);
+#endif
 		board_remove_stone(board, group, c);
 		stones++;
 	} foreach_in_group_end;
 
+#ifdef FULL_BOARD
+	/* Update hash for all captured stones at once. */
+	board_hash_update_bulk(board, h);
+#endif
+
 	group_info_t *gi = &board_group_info(board, group);
 	assert(gi->libs == 0);
 	memset(gi, 0, sizeof(*gi));
@@ -192,6 +258,11 @@ next_from_lib:;
 		}
 	}
 
+#ifdef BOARD_EXACT_LIBS
+	for (int i = 0; i < (board_max_coords(board) + 63) / 64; i++)
+		gi_to->libset[i] |= gi_from->libset[i];
+#endif
+
 #ifdef FULL_BOARD
 	board_pat3_fix(board, group_from, group_to);
 #endif
@@ -202,10 +273,10 @@ next_from_lib:;
 		group_at(board, c) = group_to;
 	} foreach_in_group_end;
 
-#ifdef BOARD_UNDO
-	board_undo_t *u = board->u;
-	u->merged[++u->nmerged_tmp].last = last_in_group;
-#endif
+	if (saving_undo(board)) {
+		board_undo_t *u = board->u;
+		u->merged[++u->nmerged_tmp].last = last_in_group;
+	}
 	groupnext_at(board, last_in_group) = groupnext_at(board, group_base(group_to));
 	groupnext_at(board, group_base(group_to)) = group_base(group_from);
 	memset(gi_from, 0, sizeof(group_info_t));
@@ -219,6 +290,10 @@ new_group(board_t *board, coord_t coord)
 	group_t group = coord;
 	group_info_t *gi = &board_group_info(board, group);
 	foreach_neighbor(board, coord, {
+#ifdef BOARD_EXACT_LIBS
+		if (board_at(board, c) == S_NONE)
+			libset_set(gi, c);
+#endif
 		if (board_at(board, c) == S_NONE)
 			/* board_group_addlib is ridiculously expensive for us */
 #if GROUP_KEEP_LIBS < 4
@@ -287,9 +362,8 @@ board_play_outside(board_t *board, move_t *m, int f)
 	enum stone other_color = stone_other(color);
 	group_t group = 0;
 
-#ifdef BOARD_UNDO	
-	undo_save_group_info(board, coord, color, board->u);
-#endif
+	if (saving_undo(board))
+		undo_save_group_info(board, coord, color, board->u);
 #ifdef FULL_BOARD	
 	board_rmf(board, f);
 #endif
@@ -304,7 +378,9 @@ board_play_outside(board_t *board, move_t *m, int f)
 
 	board_commit_move(board, m);
 #ifdef FULL_BOARD
+	board->stones[color]++;
 	board_hash_update(board, coord, color);
+	board_eyes_forget(board, coord);
 #endif
 	move_t ko = { pass, S_NONE };
 	board->ko = ko;
@@ -352,9 +428,8 @@ board_play_in_eye(board_t *board, move_t *m, int f)
 #ifdef FULL_BOARD
 	board_rmf(board, f);
 #endif
-#ifdef BOARD_UNDO
-	undo_save_group_info(board, coord, color, board->u);
-#endif
+	if (saving_undo(board))
+		undo_save_group_info(board, coord, color, board->u);
 
 	int ko_caps = 0;
 	coord_t cap_at = pass;
@@ -389,7 +464,9 @@ board_play_in_eye(board_t *board, move_t *m, int f)
 
 	board_commit_move(board, m);
 #ifdef FULL_BOARD
+	board->stones[color]++;
 	board_hash_update(board, coord, color);
+	board_eyes_forget(board, coord);
 	board_hash_commit(board);
 #endif
 	board->ko = ko;
@@ -408,9 +485,8 @@ board_play_f(board_t *board, move_t *m, int f)
 		 * suicide might fail.) */
 		group_t group = board_play_outside(board, m, f);
 		if (unlikely(board_group_captured(board, group))) {
-#ifdef BOARD_UNDO
-			undo_save_suicide(board, m->coord, m->color, board->u);
-#endif
+			if (saving_undo(board))
+				undo_save_suicide(board, m->coord, m->color, board->u);
 			board_group_capture(board, group);
 		}
 #ifdef FULL_BOARD
@@ -1,7 +1,13 @@
 
+#include <string.h>
+
 #include "board.h"
 #include "debug.h"
 #include "board_undo.h"
+#include "hashset.h"
+#ifdef BOARD_PAT3
+#include "pattern3.h"
+#endif
 
 #if 0
 #define profiling_noinline __attribute__((noinline))
@@ -29,6 +35,7 @@ undo_init(board_t *b, move_t *m, board_undo_t *u)
 	u->nmerged = u->nmerged_tmp = u->nenemies = 0;
 	for (int i = 0; i < 4; i++)
 		u->merged[i].group = u->enemies[i].group = 0;
+	u->full = false;
 }
 
 
@@ -62,6 +69,12 @@ undo_save_enemy(board_t *b, board_undo_t *u, group_t g)
 		coord_t *stones = u->enemies[i].stones = u->captures_end;
 		int j = 0;
 		foreach_in_group(b, g) {
+			if (u->full) {
+				u->captures_fmap[&stones[j] - u->captures] = b->fmap[c];
+#ifdef BOARD_PAT3
+				u->captures_pat3[&stones[j] - u->captures] = b->pat3[c];
+#endif
+			}
 			stones[j++] = c;
 		} foreach_in_group_end;
 		u->ncaptures += j;
@@ -110,6 +123,25 @@ board_commit_move(board_t *b, move_t *m)
 #define BOARD_UNDO
 #include "board_play.h"
 
+/* For board_play_undoable(), see board.c */
+void
+board_undo_init(board_t *b, move_t *m, board_undo_t *u)
+{
+	undo_init(b, m, u);
+}
+
+void
+board_undo_save_group_info(board_t *b, coord_t coord, enum stone color, board_undo_t *u)
+{
+	undo_save_group_info(b, coord, color, u);
+}
+
+void
+board_undo_save_suicide(board_t *b, coord_t coord, enum stone color, board_undo_t *u)
+{
+	undo_save_suicide(b, coord, color, u);
+}
+
 int
 board_quick_play(board_t *b, move_t *m, board_undo_t *u)
 {
@@ -307,6 +339,17 @@ board_undo_suicide(board_t *b, board_undo_t *u, move_t *m)
 
 }
 
+static inline void
+undo_stones(board_t *b, board_undo_t *u, move_t *m)
+{
+	if (likely(board_at(b, m->coord) == m->color))
+		board_undo_stone(b, u, m);
+	else if (board_at(b, m->coord) == S_NONE)
+		board_undo_suicide(b, u, m);
+	else
+		assert(0);	/* Anything else doesn't make sense */
+}
+
 void
 board_quick_undo(board_t *b, move_t *m, board_undo_t *u)
 {
@@ -326,12 +369,145 @@ board_quick_undo(board_t *b, move_t *m, board_undo_t *u)
 		return;
 	}
 
-	if (likely(board_at(b, m->coord) == m->color))
-		board_undo_stone(b, u, m);
-	else if (board_at(b, m->coord) == S_NONE)
-		board_undo_suicide(b, u, m);
-	else
-		assert(0);	/* Anything else doesn't make sense */
+	undo_stones(b, u, m);
+}
+
+
+/**********************************************************************************************/
+/* board_undo_move() implementation */
+
+#ifdef BOARD_PAT3
+/* pat3 of a point depends on its 8 neighbors and atari status of its
+ * 4 neighbors: points that may need update are around the move and
+ * captured stones, plus the liberty of any group getting in / out of
+ * atari. Groups whose liberties change are all next to these. */
+typedef struct {
+	move_queue_t q;
+	bool mark[BOARD_MAX_COORDS];
+} pat3_fix_t;
+
+static void
+pat3_fix_add(pat3_fix_t *fix, coord_t c)
+{
+	if (fix->mark[c])  return;
+	fix->mark[c] = true;
+	mq_add(&fix->q, c, 0);
+}
+
+static void
+pat3_atari_libs_around(board_t *b, coord_t coord, pat3_fix_t *fix)
+{
+	foreach_neighbor(b, coord, {
+		group_t g = group_at(b, c);
+		if (g && board_group_info(b, g).libs == 1)
+			pat3_fix_add(fix, board_group_info(b, g).lib[0]);
+	});
+}
+
+static void
+pat3_atari_libs(board_t *b, board_undo_t *u, move_t *m, pat3_fix_t *fix)
+{
+	pat3_atari_libs_around(b, m->coord, fix);
+	for (coord_t *s = u->captures; s < u->captures_end; s++)
+		if (*s)  pat3_atari_libs_around(b, *s, fix);
+}
+
+static void
+undo_pat3(board_t *b, board_undo_t *u, move_t *m, pat3_fix_t *fix)
+{
+	pat3_atari_libs(b, u, m, fix);
+	pat3_fix_add(fix, m->coord);
+	foreach_8neighbor(b, m->coord) {
+		pat3_fix_add(fix, c);
+	} foreach_8neighbor_end;
+	for (coord_t *s = u->captures; s < u->captures_end; s++) {
+		if (!*s)  continue;
+		foreach_8neighbor(b, *s) {
+			pat3_fix_add(fix, c);
+		} foreach_8neighbor_end;
+	}
+
+	/* Not valid for stones, but board_cmp() wants them back too. */
+	for (coord_t *s = u->captures; s < u->captures_end; s++)
+		if (*s)  b->pat3[*s] = u->captures_pat3[s - u->captures];
+
+	for (unsigned int i = 0; i < fix->q.moves; i++) {
+		coord_t c = fix->q.move[i];
+		if (board_at(b, c) == S_NONE)
+			b->pat3[c] = pattern3_hash(b, c);
+	}
+}
+#endif
+
+/* board_play() removed move from free positions list, then added back
+ * captured stones: undo in reverse order. */
+static void
+undo_free_positions(board_t *b, board_undo_t *u, move_t *m)
+{
+	b->flen -= u->ncaptures;
+	if (u->f < b->flen) {
+		coord_t moved = b->f[u->f];
+		b->fmap[moved] = b->flen;
+		b->f[b->flen++] = moved;
+		b->f[u->f] = m->coord;
+	} else  /* Move was last in the list */
+		b->f[b->flen++] = m->coord;
+	b->fmap[m->coord] = u->f;
+
+	/* Zero-terminated stone lists, one per captured group. */
+	for (coord_t *c = u->captures; c < u->captures_end; c++)
+		if (*c)  b->fmap[*c] = u->captures_fmap[c - u->captures];
+}
+
+void
+board_undo_move(board_t *b, move_t *m, board_undo_t *u)
+{
+	assert(u->full);
+	
+	b->last_moves[b->last_move_i] = u->last_move_slot;
+	b->last_move_i = u->last_move_i;
+	b->ko = u->ko;
+	b->last_ko = u->last_ko;
+	b->last_ko_age = u->last_ko_age;
+	b->moves--;
+
+	if (u->superko_set_added)
+		hashset_remove(b->superko_set, b->hash);
+	b->hash = u->hash;
+	memcpy(b->stones, u->stones, sizeof(b->stones));
+	b->hash_history_next = u->hash_history_next;
+	b->hash_history[u->hash_history_next] = u->hash_history_slot;
+	b->superko_violation = u->superko_violation;
+#ifdef WANT_BOARD_C
+	b->clen = u->clen;
+	memcpy(b->c, u->c, u->clen * sizeof(b->c[0]));
+	for (int i = 0; i < b->clen; i++)
+		b->cmap[b->c[i]] = i;
+#endif
+	
+	if (unlikely(is_pass(m->coord))) {
+		b->passes[m->color]--;
+		if (b->rules == RULES_SIMING)
+			b->captures[stone_other(m->color)]--;
+		return;
+	}
+
+#ifdef DCNN_DARKFOREST
+	b->moveno[m->coord] = u->moveno;
+#endif
+#ifdef BOARD_PAT3
+	pat3_fix_t fix;
+	mq_init(&fix.q);
+	memset(fix.mark, 0, sizeof(fix.mark));
+	pat3_atari_libs(b, u, m, &fix);
+#endif
+	undo_stones(b, u, m);
+	undo_free_positions(b, u, m);
+	memset(b->eyes, 0, sizeof(b->eyes));	/* Just a cache */
+	b->eyes_n = 0;
+#ifdef BOARD_PAT3
+	undo_pat3(b, u, m, &fix);
+#endif
 }
 
 
@@ -31,6 +31,25 @@ typedef struct board_undo {
 	coord_t      *captures_end;
 	undo_enemy_t enemies[4];
 	coord_t      captures[BOARD_MAX_COORDS];
+
+	/* Full board undo only (board_play_undoable()) */
+	bool     full;
+	int      f;				/* Free positions list index of move */
+	uint16_t captures_fmap[BOARD_MAX_COORDS];	/* fmap of captured stones */
+#ifdef BOARD_PAT3
+	hash3_t  captures_pat3[BOARD_MAX_COORDS];	/* pat3 of captured stones */
+#endif
+	int      last_move_i;
+	move_t   last_move_slot;
+	hash_t   hash;
+	int      stones[S_MAX];
+	hash_t   hash_history_slot;
+	int      hash_history_next;
+	bool     superko_violation;
+	bool     superko_set_added;		/* Position added to b->superko_set */
+	int      moveno;
+	int      clen;
+	uint16_t c[BOARD_MAX_GROUPS];
 } board_undo_t;
 
 
@@ -53,6 +72,22 @@ typedef struct board_undo {
 int  board_quick_play(board_t *board, move_t *m, board_undo_t *u);
 void board_quick_undo(board_t *b, move_t *m, board_undo_t *u);
 
+/* Full board version: everything board_play() maintains is saved and
+ * restored as well (free positions list, capturable groups, hash and
+ * history, pat3, last moves...), so search and tactics code can play and
+ * unplay moves on a board instead of copying it. Board is left exactly
+ * as it was after board_undo_move(). Slower than quick_play(), but much
+ * cheaper than a board_copy().
+ * Moves must be undone in reverse order, can't be mixed with
+ * quick_play() / quick_undo() in between. */
+int  board_play_undoable(board_t *b, move_t *m, board_undo_t *u);
+void board_undo_move(board_t *b, move_t *m, board_undo_t *u);
+
+/* For board_play_undoable() implementation. */
+void board_undo_init(board_t *b, move_t *m, board_undo_t *u);
+void board_undo_save_group_info(board_t *b, coord_t coord, enum stone color, board_undo_t *u);
+void board_undo_save_suicide(board_t *b, coord_t coord, enum stone color, board_undo_t *u);
+
 /* quick_play() + quick_undo() combo.
  * Body is executed only if move is valid (silently ignored otherwise).
  * Can break out in body, but definitely *NOT* return / jump around !
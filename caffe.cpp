@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,19 +16,46 @@ using namespace caffe;
 extern "C" {
 #include "debug.h"
 #include "util.h"
+#include "caffe.h"
 
-static shared_ptr<Net<float> > net;
-static int net_size = 0;		/* board size */
+/* Nets are created lazily for each batch size we get asked for so input
+ * blobs never need reshaping (net->Reshape() is not cheap). They all share
+ * trained weights with the first one. There can be several instances
+ * (one per thread / gpu), each with its own set of nets.
+ * Several models can be loaded at once (one per slot, see
+ * caffe_set_model()), everything else applies to current one. */
+
+#define CAFFE_MAX_INSTANCES 16
+#define CAFFE_MAX_SHAPES     4
+#define CAFFE_MAX_MODELS     4
+
+typedef struct {
+	int batch;			/* input blob batch size */
+	shared_ptr<Net<float> > net;
+	Blob<float> *input;		/* net->input_blobs()[0] */
+	Blob<float> *output;		/* net->output_blobs()[0] */
+	Blob<float> *value;		/* net->output_blobs()[1] if any: value head */
+} caffe_shape_t;
+
+typedef struct {
+	caffe_shape_t shapes[CAFFE_MAX_SHAPES];
+	int nshapes;
+	pthread_mutex_t mutex;
+} caffe_instance_t;
+
+typedef struct {
+	caffe_instance_t instances[CAFFE_MAX_INSTANCES];
+	char model_file[256];
+	int  net_size;			/* board size */
+	int  net_planes;
+} caffe_model_t;
+
+static caffe_model_t models[CAFFE_MAX_MODELS];
+static caffe_model_t *model = &models[0];
+static int ninstances = 1;
+static int next_instance = 0;		/* For assigning instances to threads */
+static __thread int thread_instance = -1;
 
-static int
-shape_size(const vector<int>& shape)
-{
-       int size = 1;
-       for (unsigned int i = 0; i < shape.size(); i++)
-               size *= shape[i];
-       return size;
-}
-	
 /* Make caffe quiet */
 void
 quiet_caffe(int argc, char *argv[])
@@ -40,17 +68,74 @@ quiet_caffe(int argc, char *argv[])
 bool
 caffe_ready()
 {
-	return (net != NULL);
+	return (model->instances[0].nshapes != 0);
+}
+
+/* Net has a value head: second output blob, one value per position
+ * in [-1, 1] (win = 1) for color to play. */
+bool
+caffe_has_value()
+{
+	return (caffe_ready() && model->instances[0].shapes[0].value);
+}
+
+/* Number of net instances to use, must be called before caffe_init() */
+void
+caffe_set_instances(int n)
+{
+	assert(!caffe_ready());
+	if (n < 1 || n > CAFFE_MAX_INSTANCES)
+		die("dcnn: invalid number of nets: %i (max %i)\n", n, CAFFE_MAX_INSTANCES);
+	ninstances = n;
+}
+
+/* Select model slot @n, other calls apply to that model. Models in other
+ * slots stay loaded. Not thread safe, no evaluation must be going on. */
+void
+caffe_set_model(int n)
+{
+	assert(n >= 0 && n < CAFFE_MAX_MODELS);
+	model = &models[n];
+}
+
+static void
+caffe_shape_reshape(caffe_shape_t *s, int batch, int size)
+{
+	const vector<int>& shape = s->input->shape();
+	if (shape[0] == batch && shape[2] == size && shape[3] == size)
+		return;
+	s->input->Reshape(batch, shape[1], size, size);
+	s->net->Reshape();   /* Forward the dimension change. */
+	s->batch = batch;
+}
+
+/* Create net for batch size @batch sharing weights with @base (if any). */
+static caffe_shape_t *
+caffe_shape_new(caffe_instance_t *inst, int batch, Net<float> *base)
+{
+	assert(inst->nshapes < CAFFE_MAX_SHAPES);
+	caffe_shape_t *s = &inst->shapes[inst->nshapes++];
+	s->net.reset(new Net<float>(model->model_file, TEST));
+	if (base)  s->net->ShareTrainedLayersWith(base);
+	s->input  = s->net->input_blobs()[0];
+	s->output = s->net->output_blobs()[0];
+	s->value  = (s->net->output_blobs().size() > 1 ? s->net->output_blobs()[1] : NULL);
+	s->batch  = s->input->shape(0);
+	model->net_planes = s->input->shape(1);
+	if (model->net_size)
+		caffe_shape_reshape(s, batch, model->net_size);
+	return s;
 }
 
 static int
-caffe_load(char *model, char *weights, int default_size)
+caffe_load(char *model_name, char *weights, int default_size)
 {
-	char model_file[256];    get_data_file(model_file, model);
-	char weights_file[256];  get_data_file(weights_file, weights);
-	if (!file_exists(model_file) || !file_exists(weights_file)) {
+	char weights_file[256];
+	get_data_file(model->model_file, model_name);
+	get_data_file(weights_file, weights);
+	if (!file_exists(model->model_file) || !file_exists(weights_file)) {
 		if (DEBUGL(1))  fprintf(stderr, "Loading dcnn files: %s, %s\n"
-					        "Couldn't find dcnn files, aborting.\n", model, weights);
+					        "Couldn't find dcnn files, aborting.\n", model_name, weights);
 #ifdef _WIN32
 		popup("ERROR: Couldn't find Pachi data files.\n");
 #endif
@@ -60,57 +145,113 @@ caffe_load(char *model, char *weights, int default_size)
 	Caffe::set_mode(Caffe::CPU);       
 	
 	/* Load the network. */
-	net.reset(new Net<float>(model_file, TEST));
-	net->CopyTrainedLayersFrom(weights_file);
-	net_size = default_size;
+	model->net_size = 0;
+	caffe_shape_t *s = caffe_shape_new(&model->instances[0], 1, NULL);
+	s->net->CopyTrainedLayersFrom(weights_file);
+	model->net_size = default_size;
+	caffe_shape_reshape(s, 1, model->net_size);
+
+	/* Other instances share weights with the first one. */
+	for (int i = 0; i < ninstances; i++) {
+		pthread_mutex_init(&model->instances[i].mutex, NULL);
+		if (i)  caffe_shape_new(&model->instances[i], 1, s->net.get());
+	}
 
 	return 1;
 }
 
 void
-caffe_init(int size, char *model, char *weights, char *name, int default_size)
+caffe_init(int size, char *model_name, char *weights, char *name, int default_size)
 {
-	if (net && net_size == size)  return;   /* Nothing to do. */
-	if (!net && !caffe_load(model, weights, default_size))    return;
+	if (caffe_ready() && model->net_size == size)  return;   /* Nothing to do. */
+	if (!caffe_ready() && !caffe_load(model_name, weights, default_size))    return;
 	
 	/* If network is fully convolutional it can handle any boardsize,
 	 * just need to resize the input layer. */
-	if (net_size != size) {
-		static const vector<int>& shape = net->input_blobs()[0]->shape();
-		net->input_blobs()[0]->Reshape(shape[0], shape[1], size, size);
-		net->Reshape();   /* Forward the dimension change. */
-		net_size = size;
+	if (model->net_size != size) {
+		model->net_size = size;
+		for (int i = 0; i < ninstances; i++)
+			for (int j = 0; j < model->instances[i].nshapes; j++) {
+				caffe_shape_t *s = &model->instances[i].shapes[j];
+				caffe_shape_reshape(s, s->batch, size);
+			}
 	}
 	
 	if (DEBUGL(1))
-		fprintf(stderr, "Loaded %s dcnn for %ix%i\n", name, size, size);
+		fprintf(stderr, "Loaded %s dcnn for %ix%i%s\n", name, size, size,
+			(ninstances > 1 ? ", multiple instances" : ""));
 }
 
 void
 caffe_done()
 {
-	net.reset();
-	net_size = 0;
+	for (int i = 0; i < ninstances; i++) {
+		caffe_instance_t *inst = &model->instances[i];
+		for (int j = 0; j < inst->nshapes; j++)
+			inst->shapes[j].net.reset();
+		if (inst->nshapes)
+			pthread_mutex_destroy(&inst->mutex);
+		inst->nshapes = 0;
+	}
+	model->net_size = 0;
 }
-	
+
+/* Net for batch size @n, creating it if needed. */
+static caffe_shape_t *
+caffe_get_shape(caffe_instance_t *inst, int n)
+{
+	for (int i = 0; i < inst->nshapes; i++)
+		if (inst->shapes[i].batch == n)
+			return &inst->shapes[i];
+
+	if (inst->nshapes < CAFFE_MAX_SHAPES)
+		return caffe_shape_new(inst, n, model->instances[0].shapes[0].net.get());
+
+	/* Out of slots, reshape last one. */
+	caffe_shape_t *s = &inst->shapes[inst->nshapes - 1];
+	caffe_shape_reshape(s, n, model->net_size);
+	return s;
+}
+
 void
-caffe_get_data(float *data, float *result, int size, int planes, int psize)
+caffe_get_data(float *data, float *result, float *value, int size, int planes, int psize)
 {
-	assert(net && net_size == size);
-	Blob<float> *blob = new Blob<float>(1, planes, psize, psize);
-	blob->set_cpu_data(data);
-	vector<Blob<float>*> bottom;
-	bottom.push_back(blob);
-	const vector<Blob<float>*>& rr = net->Forward(bottom);
-	assert(shape_size(rr[0]->shape()) >= size * size);
+	caffe_get_data_batch(data, result, value, 1, size, planes, psize);
+}
+
+/* Evaluate @n positions at once. @data holds @n input planes sets,
+ * @result gets @n size x size outputs, @value (if not NULL) @n win rates
+ * for color to play (-1 if net has no value head).
+ * Threads get assigned their own instance (round-robin) so evaluations
+ * can run in parallel with multiple instances. */
+void
+caffe_get_data_batch(float *data, float *result, float *value, int n, int size, int planes, int psize)
+{
+	assert(caffe_ready() && model->net_size == size && model->net_planes == planes);
+	if (thread_instance < 0)
+		thread_instance = __sync_fetch_and_add(&next_instance, 1) % ninstances;
+	caffe_instance_t *inst = &model->instances[thread_instance];
+
+	pthread_mutex_lock(&inst->mutex);
+	caffe_shape_t *s = caffe_get_shape(inst, n);
+	assert(s->input->count() == n * planes * psize * psize);
+	s->input->set_cpu_data(data);	/* No copy */
+	s->net->Forward();
 	
-	for (int i = 0; i < size * size; i++) {
-		result[i] = rr[0]->cpu_data()[i];
-		if (result[i] < 0.00001)
-			result[i] = 0.00001;
+	const float *out = s->output->cpu_data();
+	int out_size = s->output->count() / n;
+	assert(out_size >= size * size);
+	for (int k = 0; k < n; k++, out += out_size, result += size * size)
+		for (int i = 0; i < size * size; i++)
+			result[i] = (out[i] < 0.00001 ? 0.00001 : out[i]);
+
+	if (value) {
+		const float *v = (s->value ? s->value->cpu_data() : NULL);
+		int v_size = (s->value ? s->value->count() / n : 0);
+		for (int k = 0; k < n; k++)
+			value[k] = (v ? (v[k * v_size] + 1) / 2 : -1);
 	}
-	
-	delete blob;
+	pthread_mutex_unlock(&inst->mutex);
 }
 
 	
@@ -8,9 +8,13 @@ extern "C" {
 
 
 bool caffe_ready(void);
+bool caffe_has_value(void);
+void caffe_set_instances(int n);
+void caffe_set_model(int n);
 void caffe_init(int size, char *model, char *weights, char *name, int default_size);
 void caffe_done(void);
-void caffe_get_data(float *data, float *result, int size, int planes, int psize);
+void caffe_get_data(float *data, float *result, float *value, int size, int planes, int psize);
+void caffe_get_data_batch(float *data, float *result, float *value, int n, int size, int planes, int psize);
 
 #ifdef DCNN
 void quiet_caffe(int argc, char *argv[]);
@@ -1,5 +1,6 @@
 #define DEBUG
 #include <assert.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #include "debug.h"
@@ -8,9 +9,11 @@
 #include "uct/tree.h"
 #include "caffe.h"
 #include "dcnn.h"
+#include "metrics.h"
 #include "timeinfo.h"
 
-typedef void (*dcnn_evaluate_t)(board_t *b, enum stone color, float result[]);
+/* Fill dcnn input planes for @b, @color to play. */
+typedef void (*dcnn_planes_t)(board_t *b, enum stone color, float *data);
 typedef bool (*dcnn_supported_board_size_t)(board_t *b);
 
 typedef struct {
@@ -20,7 +23,8 @@ typedef struct {
 	char *weights_filename;
 	int  default_size;
 	dcnn_supported_board_size_t supported_board_size;
-	dcnn_evaluate_t             eval;
+	int  planes;
+	dcnn_planes_t               get_planes;
 	int  *global_var;
 } dcnn_t;
 
@@ -31,57 +35,141 @@ static bool board_15x15(board_t *b)        {  return (board_rsize(b) == 15);  }
 static bool board_13x13_and_up(board_t *b) {  return (board_rsize(b) >= 13);  }
 
 #ifdef DCNN_DETLEF
-static void detlef54_dcnn_eval(board_t *b, enum stone color, float result[]);
-static void detlef44_dcnn_eval(board_t *b, enum stone color, float result[]);
+static void detlef54_dcnn_planes(board_t *b, enum stone color, float *data);
+static void detlef44_dcnn_planes(board_t *b, enum stone color, float *data);
 #endif
 #ifdef DCNN_DARKFOREST
-static void darkforest_dcnn_eval(board_t *b, enum stone color, float result[]);
+static void darkforest_dcnn_planes(board_t *b, enum stone color, float *data);
+static void df_init(board_t *b);
 #endif
 
 int darkforest_dcnn = 0;
 
 static dcnn_t dcnns[] = {
 #ifdef DCNN_DETLEF
-{  "detlef",     "Detlef's 54%", "detlef54.prototxt",  "detlef54.trained", 19, board_13x13_and_up,   detlef54_dcnn_eval },
-{  "detlef54",   "Detlef's 54%", "detlef54.prototxt",  "detlef54.trained", 19, board_13x13_and_up,   detlef54_dcnn_eval },
-{  "detlef44",   "Detlef's 44%", "detlef44.prototxt",  "detlef44.trained", 19, board_19x19,          detlef44_dcnn_eval },
+{  "detlef",     "Detlef's 54%", "detlef54.prototxt",  "detlef54.trained", 19, board_13x13_and_up, 13, detlef54_dcnn_planes },
+{  "detlef54",   "Detlef's 54%", "detlef54.prototxt",  "detlef54.trained", 19, board_13x13_and_up, 13, detlef54_dcnn_planes },
+{  "detlef44",   "Detlef's 44%", "detlef44.prototxt",  "detlef44.trained", 19, board_19x19,         2, detlef44_dcnn_planes },
 #endif
 #ifdef DCNN_DARKFOREST
-{  "df",         "Darkforest",   "df2.prototxt",       "df2.trained",      19, board_19x19,          darkforest_dcnn_eval,  &darkforest_dcnn },
-{  "darkforest", "Darkforest",   "df2.prototxt",       "df2.trained",      19, board_19x19,          darkforest_dcnn_eval,  &darkforest_dcnn },
-{  "df",         "Darkforest",   "df2_15x15.prototxt", "df2.trained",      15, board_15x15,          darkforest_dcnn_eval,  &darkforest_dcnn },
-{  "darkforest", "Darkforest",   "df2_15x15.prototxt", "df2.trained",      15, board_15x15,          darkforest_dcnn_eval,  &darkforest_dcnn },
+{  "df",         "Darkforest",   "df2.prototxt",       "df2.trained",      19, board_19x19,        25, darkforest_dcnn_planes,  &darkforest_dcnn },
+{  "darkforest", "Darkforest",   "df2.prototxt",       "df2.trained",      19, board_19x19,        25, darkforest_dcnn_planes,  &darkforest_dcnn },
+{  "df",         "Darkforest",   "df2_15x15.prototxt", "df2.trained",      15, board_15x15,        25, darkforest_dcnn_planes,  &darkforest_dcnn },
+{  "darkforest", "Darkforest",   "df2_15x15.prototxt", "df2.trained",      15, board_15x15,        25, darkforest_dcnn_planes,  &darkforest_dcnn },
 #endif
 {  0, }
 };
 
-static dcnn_t *dcnn = NULL;
+/* Nets to load (--dcnn=name1,name2,...), strongest first.
+ * One is in use at a time, see dcnn_select(). */
+#define DCNN_MAX_NETS 4
+static dcnn_t *nets[DCNN_MAX_NETS];
+static bool    nets_ready[DCNN_MAX_NETS];
+static double  nets_latency[DCNN_MAX_NETS];	/* Seconds per evaluation (moving average) */
+static int     nnets = 0;
+static int     cur_net = 0;
+static dcnn_t *dcnn = NULL;			/* nets[cur_net] */
+
+
+/* Inference backends. All take fp32 inputs / outputs, reduced precision
+ * (if supported) is a backend internal matter. */
+
+typedef struct {
+	char *name;
+	bool (*ready)(void);
+	void (*init)(int size, char *model, char *weights, char *name, int default_size);
+	void (*done)(void);
+	bool (*has_value)(void);	/* Net has a value head */
+	void (*set_model)(int n);	/* Select model slot for following calls */
+	/* Evaluate @n positions at once, must be thread safe.
+	 * @value (may be NULL) gets win rates for color to play, -1 if no value head. */
+	void (*get_data_batch)(float *data, float *result, float *value, int n, int size, int planes, int psize);
+	int  precisions;		/* Supported precisions (bitmask) */
+} dcnn_backend_t;
+
+static dcnn_backend_t backends[] = {
+{  "caffe",  caffe_ready,  caffe_init,  caffe_done,  caffe_has_value,  caffe_set_model,  caffe_get_data_batch,  DCNN_FP32 },
+{  0, }
+};
+
+static dcnn_backend_t *backend = &backends[0];
+static int precision = DCNN_FP32;
+
+static char *precision_names[] = { "fp32", "fp16", "int8" };
+
+void
+set_dcnn_backend(char *name)
+{
+	for (int i = 0; backends[i].name; i++)
+		if (!strcmp(name, backends[i].name)) {  backend = &backends[i];  return;  }
+	die("Unknown dcnn backend '%s'\n", name);
+}
+
+void
+set_dcnn_precision(char *name)
+{
+	for (int i = 0; i < 3; i++)
+		if (!strcmp(name, precision_names[i])) {  precision = (1 << i);  return;  }
+	die("Unknown dcnn precision '%s'\n", name);
+}
 
 #define dcnn_supported_board_size(b) (dcnn->supported_board_size(b))
 
 /* Find dcnn entry for @name (can also be model/weights filename). */
-void
-set_dcnn(char *name)
+static dcnn_t *
+find_dcnn(char *name)
 {
 	for (int i = 0; dcnns[i].name; i++)
 		if (!strcmp(name, dcnns[i].name) ||
 		    !strcmp(name, dcnns[i].model_filename) ||
-		    !strcmp(name, dcnns[i].weights_filename)) {
-			dcnn = &dcnns[i];
-			if (dcnn->global_var)
-				*dcnn->global_var = 1;
-			return;
-		}
+		    !strcmp(name, dcnns[i].weights_filename))
+			return &dcnns[i];
 	
 	die("Unknown dcnn '%s'\n", name);
 }
 
+/* Make net @i current one. */
+static void
+dcnn_use(int i)
+{
+	cur_net = i;
+	dcnn = nets[i];
+	backend->set_model(i);
+}
+
+/* @name: comma separated list for several nets, strongest first. */
+void
+set_dcnn(char *name)
+{
+	char *names = strdup(name);
+	nnets = 0;
+	for (char *s = strtok(names, ","); s; s = strtok(NULL, ",")) {
+		if (nnets == DCNN_MAX_NETS)  die("dcnn: too many nets (max %i)\n", DCNN_MAX_NETS);
+		nets[nnets++] = find_dcnn(s);
+		/* Darkforest inputs need move history, also when not in use. */
+		if (nets[nnets - 1]->global_var)
+			*nets[nnets - 1]->global_var = 1;
+	}
+	free(names);
+	if (!nnets)  die("Unknown dcnn '%s'\n", name);
+	cur_net = 0;
+	dcnn = nets[0];
+}
+
 void
 list_dcnns()
 {
 	printf("Supported networks:\n");
 	for (int i = 0; dcnns[i].name; i++)
 		printf("  %-20s %s dcnn\n", dcnns[i].name, dcnns[i].full_name);
+
+	printf("\nBackends:\n");
+	for (int i = 0; backends[i].name; i++) {
+		printf("  %-20s", backends[i].name);
+		for (int j = 0; j < 3; j++)
+			if (backends[i].precisions & (1 << j))  printf(" %s", precision_names[j]);
+		printf("\n");
+	}
 }
 
 static int
@@ -93,10 +181,18 @@ find_dcnn_for_board(board_t *b)
 	return 0;
 }
 
+static void
+dcnn_set_default(void)
+{
+	if (nnets)  return;
+	nets[0] = dcnn = &dcnns[0];
+	nnets = 1;
+}
+
 int
 dcnn_default_board_size()
 {
-	if (!dcnn)  dcnn = &dcnns[0];
+	dcnn_set_default();
 	return dcnn->default_size;
 }
 
@@ -108,34 +204,427 @@ void require_dcnn(void)  {  dcnn_required = true;  }
 bool
 using_dcnn(board_t *b)
 {
-	bool r = dcnn_enabled && dcnn_supported_board_size(b) && caffe_ready();
+	bool r = dcnn_enabled && dcnn_supported_board_size(b) && backend->ready();
 	if (dcnn_required && !r)  die("dcnn required but not used, aborting.\n");
 	return r;
 }
 
+bool
+dcnn_has_value(void)
+{
+	return (backend->ready() && backend->has_value());
+}
+
+/********************************************************************************************************/
+/* Evaluation cache */
+
+/* LRU cache of net outputs keyed by position (+ side to move, last moves
+ * which are part of dcnn inputs). Symmetric positions hit as well.
+ * Darkforest also uses move history, key includes move number then. */
+
+typedef struct {
+	hash_t key;
+	float  value;		/* value head output */
+	int    prev, next;	/* lru list, most recent first */
+	int    hnext;		/* hash chain */
+} dcnn_cache_entry_t;
+
+static int dcnn_cache_entries = 1024;
+static volatile int dcnn_evals = 0;	/* Net evaluations (cache misses), for stats */
+
+static struct {
+	int    entries;
+	int    bsize;
+	dcnn_cache_entry_t *e;
+	float  *results;	/* [entries][bsize * bsize] */
+	int    *buckets;	/* [entries] */
+	int    used;
+	int    head, tail;
+	int    hits, misses;
+	pthread_mutex_t mutex;
+} cache = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+/* Set cache size (number of positions), 0 disables it. */
 void
-dcnn_init(board_t *b)
+dcnn_set_cache_size(int n)
+{
+	if (n < 0)  die("dcnn: invalid cache size %i\n", n);
+	dcnn_cache_entries = n;
+}
+
+/* Compute cache keys for the 8 symmetries of @b */
+static void
+dcnn_cache_keys(board_t *b, enum stone color, hash_t keys[8])
 {
-	if (!dcnn)  dcnn = &dcnns[0];
+	hash_t h = (color == S_BLACK ? 0x5fb9b10a4ca2d1c3ULL : 0);
+	h ^= (hash_t)cur_net * 0xc2b2ae3d27d4eb4fULL;	/* Several nets: keep their outputs apart */
+	if (darkforest_dcnn)  h ^= (hash_t)b->moves * 0x9e3779b97f4a7c15ULL;
+	for (int s = 0; s < 8; s++)
+		keys[s] = h;
+
+	foreach_point(b) {
+		enum stone bc = board_at(b, c);
+		if (bc != S_BLACK && bc != S_WHITE)  continue;
+		for (int s = 0; s < 8; s++)
+			keys[s] ^= hash_at(coord_transform(b, c, s), bc);
+	} foreach_point_end;
+
+	coord_t last[4] = { last_move(b).coord, last_move2(b).coord, last_move3(b).coord, last_move4(b).coord };
+	for (int i = 0; i < 4; i++) {
+		if (is_pass(last[i]) || is_resign(last[i]))  continue;
+		for (int s = 0; s < 8; s++)
+			keys[s] ^= hash_at(coord_transform(b, last[i], s), S_BLACK) * (2 * i + 3);
+	}
+}
+
+static void
+dcnn_cache_init(board_t *b)
+{
+	int size = board_rsize(b);
+	if (cache.entries == dcnn_cache_entries && cache.bsize == size)
+		return;
+
+	pthread_mutex_lock(&cache.mutex);
+	free(cache.e);  free(cache.results);  free(cache.buckets);
+	cache.e = NULL;  cache.results = NULL;  cache.buckets = NULL;
+	cache.entries = dcnn_cache_entries;
+	cache.bsize = size;
+	cache.used = cache.hits = cache.misses = 0;
+	cache.head = cache.tail = -1;
+	if (cache.entries) {
+		cache.e = cmalloc(cache.entries * sizeof(dcnn_cache_entry_t));
+		cache.results = cmalloc(cache.entries * size * size * sizeof(float));
+		cache.buckets = cmalloc(cache.entries * sizeof(int));
+		for (int i = 0; i < cache.entries; i++)
+			cache.buckets[i] = -1;
+	}
+	pthread_mutex_unlock(&cache.mutex);
+}
+
+static void
+dcnn_cache_unlink(int i)
+{
+	dcnn_cache_entry_t *e = &cache.e[i];
+	if (e->prev >= 0)  cache.e[e->prev].next = e->next;  else  cache.head = e->next;
+	if (e->next >= 0)  cache.e[e->next].prev = e->prev;  else  cache.tail = e->prev;
+}
+
+static void
+dcnn_cache_push_front(int i)
+{
+	dcnn_cache_entry_t *e = &cache.e[i];
+	e->prev = -1;  e->next = cache.head;
+	if (cache.head >= 0)  cache.e[cache.head].prev = i;
+	cache.head = i;
+	if (cache.tail < 0)  cache.tail = i;
+}
+
+static int
+dcnn_cache_find(hash_t key)
+{
+	for (int i = cache.buckets[key % cache.entries]; i >= 0; i = cache.e[i].hnext)
+		if (cache.e[i].key == key)
+			return i;
+	return -1;
+}
+
+/* Look up @b in the cache, fill @result and @value if found. */
+static bool
+dcnn_cache_get(board_t *b, hash_t keys[8], float result[], float *value)
+{
+	if (!cache.entries)  return false;
+	int size = board_rsize(b);
+	
+	pthread_mutex_lock(&cache.mutex);
+	for (int s = 0; s < 8; s++) {
+		int i = dcnn_cache_find(keys[s]);
+		if (i < 0)  continue;
+
+		/* Cached result is for board transformed by s. */
+		float *r = cache.results + i * size * size;
+		foreach_point(b) {
+			if (board_at(b, c) == S_OFFBOARD)  continue;
+			result[coord2dcnn_idx(c)] = r[coord2dcnn_idx(coord_transform(b, c, s))];
+		} foreach_point_end;
+		*value = cache.e[i].value;
+		dcnn_cache_unlink(i);
+		dcnn_cache_push_front(i);
+		cache.hits++;
+		pthread_mutex_unlock(&cache.mutex);
+		return true;
+	}
+	cache.misses++;
+	pthread_mutex_unlock(&cache.mutex);
+	return false;
+}
+
+static void
+dcnn_cache_put(hash_t key, float result[], float value)
+{
+	if (!cache.entries)  return;
+	int size = cache.bsize;
+	
+	pthread_mutex_lock(&cache.mutex);
+	if (dcnn_cache_find(key) >= 0) {  pthread_mutex_unlock(&cache.mutex);  return;  }
+
+	int i;
+	if (cache.used < cache.entries)
+		i = cache.used++;
+	else {  /* Evict least recently used */
+		i = cache.tail;
+		dcnn_cache_unlink(i);
+		int *p = &cache.buckets[cache.e[i].key % cache.entries];
+		while (*p != i)  p = &cache.e[*p].hnext;
+		*p = cache.e[i].hnext;
+	}
+
+	cache.e[i].key = key;
+	cache.e[i].value = value;
+	cache.e[i].hnext = cache.buckets[key % cache.entries];
+	cache.buckets[key % cache.entries] = i;
+	dcnn_cache_push_front(i);
+	memcpy(cache.results + i * size * size, result, size * size * sizeof(float));
+	pthread_mutex_unlock(&cache.mutex);
+}
+
+
+/* Symmetry ensemble: evaluate positions under this many symmetries */
+static int dcnn_symmetries = 1;
+
+static void dcnn_evaluate_symmetries(board_t *b, float *data, float result[], float *value, int n);
+
+/* Load net @i for board @b (if it can handle it). */
+static void
+dcnn_init_net(board_t *b, int i)
+{
+	dcnn_use(i);
 	if (dcnn_enabled && !dcnn_supported_board_size(b) && find_dcnn_for_board(b))
-		caffe_done();  /* Reload net */	
+		backend->done();  /* Reload net */	
+	nets[i] = dcnn;
 	if (dcnn_enabled && dcnn_supported_board_size(b))
-		caffe_init(board_rsize(b), dcnn->model_filename, dcnn->weights_filename, dcnn->full_name, dcnn->default_size);
-	if (dcnn_required && !caffe_ready())  die("dcnn required, aborting.\n");
+		backend->init(board_rsize(b), dcnn->model_filename, dcnn->weights_filename, dcnn->full_name, dcnn->default_size);
+	nets_ready[i] = (dcnn_enabled && dcnn_supported_board_size(b) && backend->ready());
+}
+
+/* Evaluation time for current net, as dcnn_evaluate_value() does it
+ * (first run is warmup). */
+static double
+dcnn_measure_latency(board_t *b)
+{
+	int size = board_rsize(b);
+	float data[dcnn->planes * size * size];
+	float result[size * size], value;
+	memset(data, 0, sizeof(data));
+	dcnn->get_planes(b, board_to_play(b), data);
+
+	double t = 0;
+	for (int k = 0; k < 2; k++) {
+		double time_start = time_now();
+		if (dcnn_symmetries > 1)
+			dcnn_evaluate_symmetries(b, data, result, &value, dcnn_symmetries);
+		else
+			backend->get_data_batch(data, result, &value, 1, size, dcnn->planes, size);
+		t = time_now() - time_start;
+	}
+	return t;
+}
+
+void
+dcnn_init(board_t *b)
+{
+	dcnn_set_default();
+	if (!(backend->precisions & precision))
+		die("dcnn: %s backend doesn't support %s\n", backend->name, precision_names[__builtin_ctz(precision)]);
+	for (int i = nnets - 1; i >= 0; i--)
+		dcnn_init_net(b, i);
+#ifdef DCNN_DARKFOREST
+	if (darkforest_dcnn)   df_init(b);
+#endif
+
+	/* Start with strongest net that can be used. */
+	int first = 0;
+	for (int i = nnets - 1; i >= 0; i--)
+		if (nets_ready[i])  first = i;
+	if (nnets > 1)
+		for (int i = nnets - 1; i >= 0; i--) {
+			dcnn_use(i);
+			if (!nets_ready[i])  continue;
+			nets_latency[i] = dcnn_measure_latency(b);
+			if (DEBUGL(2))  fprintf(stderr, "dcnn: %s: %.3fs per evaluation\n", dcnn->full_name, nets_latency[i]);
+		}
+	dcnn_use(first);
+
+	if (dcnn_required && !backend->ready())  die("dcnn required, aborting.\n");
+	if (backend->ready())  dcnn_cache_init(b);
+}
+
+void
+dcnn_set_symmetries(int n)
+{
+	if (n < 1 || n > 8)  die("dcnn: invalid number of symmetries %i (1-8)\n", n);
+	dcnn_symmetries = n;
+}
+
+/* Symmetry ensemble evaluation: input planes of @b under symmetries
+ * 1..n-1 are derived from @data (all planes are spatial), the whole lot
+ * goes through the net as one batch, outputs are transformed back and
+ * averaged. */
+static void
+dcnn_evaluate_symmetries(board_t *b, float *data, float result[], float *value, int n)
+{
+	int size = board_rsize(b), size2 = size * size;
+	int planes = dcnn->planes;
+	float *input = cmalloc(n * planes * size2 * sizeof(float));
+	float *out = cmalloc(n * size2 * sizeof(float));
+	float values[n];
+	int idx[n][size2];	/* dcnn index under symmetry s */
+
+	for (int s = 0; s < n; s++)
+		foreach_point(b) {
+			if (board_at(b, c) == S_OFFBOARD)  continue;
+			idx[s][coord2dcnn_idx(c)] = coord2dcnn_idx(coord_transform(b, c, s));
+		} foreach_point_end;
+
+	for (int s = 0; s < n; s++) {
+		float *in = input + s * planes * size2;
+		for (int p = 0; p < planes; p++)
+			for (int i = 0; i < size2; i++)
+				in[p * size2 + idx[s][i]] = data[p * size2 + i];
+	}
+
+	backend->get_data_batch(input, out, values, n, size, planes, size);
+
+	for (int i = 0; i < size2; i++) {
+		float sum = 0;
+		for (int s = 0; s < n; s++)
+			sum += out[s * size2 + idx[s][i]];
+		result[i] = sum / n;
+	}
+	float v = 0;
+	for (int s = 0; s < n; s++)
+		v += values[s];
+	*value = (values[0] < 0 ? -1 : v / n);
+
+	free(input);
+	free(out);
+}
+
+/* Evaluate @b, @color to play: policy in @result, win rate for @color
+ * in @value (-1 if net has no value head). */
+void
+dcnn_evaluate_value(board_t *b, enum stone color, float result[], float *value)
+{
+	hash_t keys[8];
+	dcnn_cache_keys(b, color, keys);
+	if (dcnn_cache_get(b, keys, result, value))
+		return;
+	
+	int size = board_rsize(b);
+	float data[dcnn->planes * size * size];
+	memset(data, 0, sizeof(data));
+	dcnn->get_planes(b, color, data);
+
+	double time_start = time_now();
+	if (dcnn_symmetries > 1)
+		dcnn_evaluate_symmetries(b, data, result, value, dcnn_symmetries);
+	else
+		backend->get_data_batch(data, result, value, 1, size, dcnn->planes, size);
+	double t = time_now() - time_start;
+	nets_latency[cur_net] = (nets_latency[cur_net] ? 0.9 * nets_latency[cur_net] + 0.1 * t : t);
+	__sync_fetch_and_add(&dcnn_evals, 1);
+	metric_add(METRIC_DCNN_EVALS, 1);
+	metric_add(METRIC_DCNN_BATCHES, 1);
+	metric_add(METRIC_DCNN_SECONDS, t);
+	dcnn_cache_put(keys[0], result, *value);
 }
 
 void
 dcnn_evaluate_quiet(board_t *b, enum stone color, float result[])
 {
-	dcnn->eval(b, color, result);
+	float value;
+	dcnn_evaluate_value(b, color, result, &value);
+}
+
+int
+dcnn_eval_count(void)
+{
+	return dcnn_evals;
+}
+
+double
+dcnn_latency(void)
+{
+	return nets_latency[cur_net];
 }
 
 void
 dcnn_evaluate(board_t *b, enum stone color, float result[])
 {
 	double time_start = time_now();	
-	dcnn->eval(b, color, result);
-	if (DEBUGL(2))  fprintf(stderr, "dcnn in %.2fs\n", time_now() - time_start);	
+	int hits = cache.hits;
+	dcnn_evaluate_quiet(b, color, result);
+	if (DEBUGL(2))  fprintf(stderr, "dcnn in %.2fs%s\n", time_now() - time_start,
+				(cache.hits != hits ? " (cached)" : ""));
+	if (DEBUGL(3) && cache.entries)
+		fprintf(stderr, "dcnn cache: %i/%i entries, %i hits, %i misses\n",
+			cache.used, cache.entries, cache.hits, cache.misses);
+}
+
+
+/* Many positions at once (policy server, see pachi-policy_batch):
+ * input planes are built in parallel, the net sees them in batches of
+ * DCNN_BATCH_MAX. No cache or symmetries, boards must be same size. */
+
+#define DCNN_BATCH_MAX 64
+
+typedef struct {
+	board_t **b;
+	enum stone *color;
+	float *data;
+	int n, threads, tid;
+} dcnn_planes_job_t;
+
+static void *
+dcnn_planes_thread(void *arg)
+{
+	dcnn_planes_job_t *j = arg;
+	int size2 = board_rsize(j->b[0]) * board_rsize(j->b[0]);
+	for (int i = j->tid; i < j->n; i += j->threads)
+		dcnn->get_planes(j->b[i], j->color[i], j->data + i * dcnn->planes * size2);
+	return NULL;
+}
+
+void
+dcnn_evaluate_batch(board_t **b, enum stone *color, float *results, int n)
+{
+	int size = board_rsize(b[0]), size2 = size * size;
+	float values[DCNN_BATCH_MAX];
+	float *data = cmalloc(DCNN_BATCH_MAX * dcnn->planes * size2 * sizeof(float));
+
+	for (int start = 0; start < n; start += DCNN_BATCH_MAX) {
+		int m = (n - start < DCNN_BATCH_MAX ? n - start : DCNN_BATCH_MAX);
+		memset(data, 0, m * dcnn->planes * size2 * sizeof(float));
+
+		int threads = get_nprocessors();
+		if (threads > m)  threads = m;
+		pthread_t ids[threads];
+		dcnn_planes_job_t jobs[threads];
+		for (int t = 0; t < threads; t++) {
+			jobs[t] = (dcnn_planes_job_t) { b + start, color + start, data, m, threads, t };
+			if (t)  pthread_create(&ids[t], NULL, dcnn_planes_thread, &jobs[t]);
+		}
+		dcnn_planes_thread(&jobs[0]);
+		for (int t = 1; t < threads; t++)
+			pthread_join(ids[t], NULL);
+
+		double time_start = time_now();
+		backend->get_data_batch(data, results + start * size2, values, m, size, dcnn->planes, size);
+		__sync_fetch_and_add(&dcnn_evals, m);
+		metric_add(METRIC_DCNN_EVALS, m);
+		metric_add(METRIC_DCNN_BATCHES, 1);
+		metric_add(METRIC_DCNN_SECONDS, time_now() - time_start);
+	}
+	free(data);
 }
 
 
@@ -148,13 +637,12 @@ dcnn_evaluate(board_t *b, enum stone color, float result[])
  * http://physik.de/CNNlast.tar.gz */
 
 static void
-detlef54_dcnn_eval(board_t *b, enum stone color, float result[])
+detlef54_dcnn_planes(board_t *b, enum stone color, float *data_)
 {
 	assert(dcnn_supported_board_size(b));
 
 	int size = board_rsize(b);
-	float data[13][size][size];
-	memset(data, 0, sizeof(data));
+	float (*data)[size][size] = (float (*)[size][size])data_;
 
 	for (int x = 0; x < size; x++)
 	for (int y = 0; y < size; y++) {
@@ -173,8 +661,6 @@ detlef54_dcnn_eval(board_t *b, enum stone color, float result[])
 		else if (c == last_move3(b).coord)   data[11][y][x] = 1.0;
 		else if (c == last_move4(b).coord)   data[12][y][x] = 1.0;
 	}
-
-	caffe_get_data((float*)data, result, size, 13, size);
 }
 
 
@@ -186,13 +672,12 @@ detlef54_dcnn_eval(board_t *b, enum stone color, float result[])
  * http://physik.de/net.tgz */
 
 static void
-detlef44_dcnn_eval(board_t *b, enum stone color, float result[])
+detlef44_dcnn_planes(board_t *b, enum stone color, float *data_)
 {
 	enum stone other_color = stone_other(color);
 
 	int size = board_rsize(b);
-	float data[2][size][size];
-	memset(data, 0, sizeof(data));
+	float (*data)[size][size] = (float (*)[size][size])data_;
 
 	for (int y = 0; y < size; y++)
 	for (int x = 0; x < size; x++) {
@@ -200,8 +685,6 @@ detlef44_dcnn_eval(board_t *b, enum stone color, float result[])
 		if (board_at(b, c) == color)        data[0][y][x] = 1;
 		if (board_at(b, c) == other_color)  data[1][y][x] = 1;			
 	}
-
-	caffe_get_data((float*)data, result, size, 2, size);
 }
 #endif /* DCNN_DETLEF */
 
@@ -249,22 +732,56 @@ df_get_distance_map(board_t *b, enum stone color, float *data)
 	df_distance_transform(data, size);
 }
 
+/* Position independent parts, set up once for given board size:
+ * history decay values and constant planes (border, position mask, rank). */
+#define DF_DECAY_MAX 256
+static float df_decay[DF_DECAY_MAX];
+static int   df_const_size = 0;
+static float df_const_planes[3][19][19];
+
+static void
+df_init(board_t *b)
+{
+	int size = board_rsize(b);
+	assert(size <= 19);
+	if (df_const_size == size)  return;
+	
+	for (int i = 0; i < DF_DECAY_MAX; i++)
+		df_decay[i] = exp(0.1 * -i);
+
+	memset(df_const_planes, 0, sizeof(df_const_planes));
+	for (int y = 0; y < size; y++)
+	for (int x = 0; x < size; x++) {
+		/* border */
+		if (!x || !y || x == size-1 || y == size-1)
+			df_const_planes[0][y][x] = 1.0;
+		
+		/* position mask - distance from corner */
+		float m = (float)(size+1) / 2;
+		df_const_planes[1][y][x] = expf(-0.5 * ((x-m)*(x-m) + (y-m)*(y-m)));
+
+		/* rank - set 9th plane for 9d */
+		df_const_planes[2][y][x] = 1.0;
+	}
+	df_const_size = size;
+}
+
 static float
 df_board_history_decay(board_t *b, coord_t coord, enum stone color)
 {
 	int v = 0;
 	if (board_at(b, coord) == color || board_at(b, coord) == S_NONE)
 		v = b->moveno[coord];
-	return exp(0.1 * (v - (b->moves+1)));
+	int d = b->moves + 1 - v;
+	return (d < DF_DECAY_MAX ? df_decay[d] : exp(0.1 * -d));
 }
 
 static void
-darkforest_dcnn_eval(board_t *b, enum stone color, float result[])
+darkforest_dcnn_planes(board_t *b, enum stone color, float *data_)
 {
 	enum stone other_color = stone_other(color);
 	int size = board_rsize(b);
-	float data[25][size][size];
-	memset(data, 0, sizeof(data));
+	float (*data)[size][size] = (float (*)[size][size])data_;
 	
 	float our_dist[size * size];
 	float opponent_dist[size * size];
@@ -309,12 +826,10 @@ darkforest_dcnn_eval(board_t *b, enum stone color, float result[])
 		data[11][y][x] = df_board_history_decay(b, c, other_color);
 
 		/* plane 12: border */
-		if (!x || !y || x == size-1 || y == size-1)
-			data[12][y][x] = 1.0;
+		data[12][y][x] = df_const_planes[0][y][x];
 		
 		/* plane 13: position mask - distance from corner */
-		float m = (float)(size+1) / 2;
-		data[13][y][x] = expf(-0.5 * ((x-m)*(x-m) + (y-m)*(y-m)));
+		data[13][y][x] = df_const_planes[1][y][x];
 
 		/* plane 14: closest color is ours */
 		data[14][y][x] = (our_dist[p] < opponent_dist[p]);
@@ -323,14 +838,231 @@ darkforest_dcnn_eval(board_t *b, enum stone color, float result[])
 		data[15][y][x] = (opponent_dist[p] < our_dist[p]);
 
 		/* planes 16-24: encode rank - set 9th plane for 9d */
-		data[24][y][x] = 1.0;
+		data[24][y][x] = df_const_planes[2][y][x];
 	}
-
-	caffe_get_data((float*)data, result, size, 25, size);
 }
 #endif /* DCNN_DARKFOREST */
 
 
+/********************************************************************************************************/
+/* Asynchronous batched evaluation */
+
+/* Search threads queue positions to evaluate (input planes are computed
+ * right away so we don't need to keep boards around), a dedicated thread
+ * runs them through the net in batches and hands results to the callback.
+ * Submitting never blocks: if queue is full request is dropped. */
+
+typedef struct {
+	dcnn_result_t callback;
+	void  *data;
+	int    arg;
+	hash_t key;		/* cache key */
+} dcnn_request_t;
+
+static struct {
+	bool  running;
+	bool  quit;
+	int   batch_size;
+	int   max_pending;
+	int   size;		/* board size */
+	int   psize;		/* input size of one request */
+	float *input;		/* pending requests input  [max_pending][psize] */
+	dcnn_request_t *req;	/* pending requests        [max_pending] */
+	int   pending;
+	int   busy;		/* requests being evaluated */
+	dcnn_result_t callback;
+	void *ctx;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;	/* new requests */
+	pthread_cond_t  idle;	/* queue drained */
+} queue = { .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER, .idle = PTHREAD_COND_INITIALIZER };
+
+static void *
+dcnn_queue_thread(void *arg)
+{
+	int n = queue.batch_size;
+	float *input  = cmalloc(n * queue.psize * sizeof(float));
+	float *result = cmalloc(n * queue.size * queue.size * sizeof(float));
+	float  value[n];
+	dcnn_request_t req[n];
+
+	pthread_mutex_lock(&queue.mutex);
+	while (1) {
+		while (!queue.pending && !queue.quit)
+			pthread_cond_wait(&queue.cond, &queue.mutex);
+		if (queue.quit)  break;
+
+		/* Take a batch. Requests pile up while net is busy. */
+		n = (queue.pending < queue.batch_size ? queue.pending : queue.batch_size);
+		memcpy(input, queue.input, n * queue.psize * sizeof(float));
+		memcpy(req, queue.req, n * sizeof(*req));
+		queue.pending -= n;
+		memmove(queue.input, queue.input + n * queue.psize, queue.pending * queue.psize * sizeof(float));
+		memmove(queue.req, queue.req + n, queue.pending * sizeof(*req));
+		queue.busy = n;
+		pthread_mutex_unlock(&queue.mutex);
+
+		double time_start = time_now();
+		backend->get_data_batch(input, result, value, n, queue.size, dcnn->planes, queue.size);
+		__sync_fetch_and_add(&dcnn_evals, n);
+		metric_add(METRIC_DCNN_EVALS, n);
+		metric_add(METRIC_DCNN_BATCHES, 1);
+		metric_add(METRIC_DCNN_SECONDS, time_now() - time_start);
+		for (int i = 0; i < n; i++) {
+			float *r = result + i * queue.size * queue.size;
+			dcnn_cache_put(req[i].key, r, value[i]);
+			req[i].callback(queue.ctx, req[i].data, req[i].arg, r, value[i]);
+		}
+
+		pthread_mutex_lock(&queue.mutex);
+		queue.busy = 0;
+		if (!queue.pending)
+			pthread_cond_broadcast(&queue.idle);
+	}
+	pthread_mutex_unlock(&queue.mutex);
+
+	free(input);
+	free(result);
+	return NULL;
+}
+
+/* Start evaluation thread for board @b, evaluating up to @batch_size
+ * positions at once. @callback gets called from there with results
+ * (unless request has its own, see dcnn_queue_submit_cb()). */
+void
+dcnn_queue_start(board_t *b, int batch_size, dcnn_result_t callback, void *ctx)
+{
+	dcnn_queue_stop();
+	assert(batch_size > 0 && dcnn);
+
+	queue.quit = false;
+	queue.batch_size = batch_size;
+	queue.max_pending = batch_size * 4;
+	queue.size = board_rsize(b);
+	queue.psize = dcnn->planes * queue.size * queue.size;
+	queue.input = cmalloc(queue.max_pending * queue.psize * sizeof(float));
+	queue.req = cmalloc(queue.max_pending * sizeof(dcnn_request_t));
+	queue.pending = queue.busy = 0;
+	queue.callback = callback;
+	queue.ctx = ctx;
+	pthread_create(&queue.thread, NULL, dcnn_queue_thread, NULL);
+	queue.running = true;
+}
+
+void
+dcnn_queue_stop(void)
+{
+	if (!queue.running)  return;
+
+	pthread_mutex_lock(&queue.mutex);
+	queue.quit = true;
+	pthread_cond_signal(&queue.cond);
+	pthread_mutex_unlock(&queue.mutex);
+	pthread_join(queue.thread, NULL);
+
+	free(queue.input);
+	free(queue.req);
+	queue.running = false;
+}
+
+/* Queue evaluation of @b, @color to play. Returns false if queue is full.
+ * Can be called by multiple threads in parallel. */
+bool
+dcnn_queue_submit(board_t *b, enum stone color, void *data, int arg)
+{
+	return dcnn_queue_submit_cb(b, color, queue.callback, data, arg);
+}
+
+/* Same with result going to @callback instead of queue's. */
+bool
+dcnn_queue_submit_cb(board_t *b, enum stone color, dcnn_result_t callback, void *data, int arg)
+{
+	assert(queue.running);
+	int size = board_rsize(b);
+
+	/* Cached: no need to queue anything. */
+	hash_t keys[8];
+	dcnn_cache_keys(b, color, keys);
+	float r[size * size], value;
+	if (dcnn_cache_get(b, keys, r, &value)) {
+		callback(queue.ctx, data, arg, r, value);
+		return true;
+	}
+	
+	float input[queue.psize];
+	memset(input, 0, sizeof(input));
+	assert(size == queue.size);
+	dcnn->get_planes(b, color, input);
+
+	pthread_mutex_lock(&queue.mutex);
+	bool ok = (queue.pending < queue.max_pending);
+	if (ok) {
+		memcpy(queue.input + queue.pending * queue.psize, input, sizeof(input));
+		queue.req[queue.pending].callback = callback;
+		queue.req[queue.pending].data = data;
+		queue.req[queue.pending].arg = arg;
+		queue.req[queue.pending].key = keys[0];
+		queue.pending++;
+		pthread_cond_signal(&queue.cond);
+	}
+	pthread_mutex_unlock(&queue.mutex);
+	return ok;
+}
+
+/* Wait until all queued requests have been processed. */
+void
+dcnn_queue_drain(void)
+{
+	if (!queue.running)  return;
+
+	pthread_mutex_lock(&queue.mutex);
+	while (queue.pending || queue.busy)
+		pthread_cond_wait(&queue.idle, &queue.mutex);
+	pthread_mutex_unlock(&queue.mutex);
+}
+
+bool
+dcnn_queue_running(void)
+{
+	return queue.running;
+}
+
+/* Net changed: input planes too. Pending requests get evaluated first. */
+static void
+dcnn_queue_restart(board_t *b)
+{
+	if (!queue.running)  return;
+	dcnn_queue_drain();
+	dcnn_queue_start(b, queue.batch_size, queue.callback, queue.ctx);
+}
+
+
+/********************************************************************************************************/
+/* Net selection */
+
+void
+dcnn_select(board_t *b, double budget)
+{
+	if (nnets < 2 || !dcnn_enabled)  return;
+
+	int best = -1, fastest = -1;
+	for (int i = 0; i < nnets; i++) {
+		if (!nets_ready[i] || !nets[i]->supported_board_size(b))  continue;
+		if (fastest < 0 || nets_latency[i] < nets_latency[fastest])  fastest = i;
+		if (best < 0 && (budget < 0 || nets_latency[i] <= budget))  best = i;
+	}
+	if (best < 0)  best = fastest;
+	if (best < 0 || best == cur_net)  return;
+
+	if (DEBUGL(2))  fprintf(stderr, "dcnn: using %s (%.3fs per evaluation, budget %.3fs)\n",
+				nets[best]->full_name, nets_latency[best], budget);
+	dcnn_queue_drain();
+	dcnn_use(best);
+	dcnn_queue_restart(b);
+}
+
+
 /********************************************************************************************************/
 
 void
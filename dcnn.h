@@ -6,22 +6,60 @@
 
 #define DCNN_BEST_N 20
 
-/* Choose which dcnn to load */
+/* Choose which dcnn to load. Several nets can be given (comma separated),
+ * strongest first: they all get loaded and dcnn_select() picks one. */
 void set_dcnn(char *name);
 void list_dcnns(void);
 int dcnn_default_board_size(void);
 
+/* Choose inference backend / precision */
+#define DCNN_FP32  1
+#define DCNN_FP16  2
+#define DCNN_INT8  4
+void set_dcnn_backend(char *name);
+void set_dcnn_precision(char *name);
+
+/* Evaluation cache size (positions), 0 to disable */
+void dcnn_set_cache_size(int n);
+
+/* Symmetry ensemble: average outputs over @n symmetries (1-8) of the
+ * position, evaluated in one batch. Queued evaluations aren't affected. */
+void dcnn_set_symmetries(int n);
+
 /* Ensure / disable dcnn */
 void require_dcnn(void);
 void disable_dcnn(void);
 
 void dcnn_evaluate(board_t *b, enum stone color, float result[]);
 void dcnn_evaluate_quiet(board_t *b, enum stone color, float result[]);
+void dcnn_evaluate_value(board_t *b, enum stone color, float result[], float *value);
+/* Evaluate @n positions @b (same size), @color[i] to play, in batches:
+ * policy for position i at @results + i * size * size. */
+void dcnn_evaluate_batch(board_t **b, enum stone *color, float *results, int n);
+bool dcnn_has_value(void);	/* Net has a value head */
+int  dcnn_eval_count(void);	/* Net evaluations so far */
+double dcnn_latency(void);	/* Seconds per evaluation for current net, 0 if not known yet */
 bool using_dcnn(board_t *b);
 void dcnn_init(board_t *b);
+
+/* Several nets loaded: use strongest one whose evaluation time fits
+ * @budget (seconds), or fastest one. @budget < 0: strongest.
+ * No evaluation must be going on. */
+void dcnn_select(board_t *b, double budget);
 void get_dcnn_best_moves(board_t *b, float *r, coord_t *best_c, float *best_r, int nbest);
 void print_dcnn_best_moves(board_t *b, coord_t *best_c, float *best_r, int nbest);
 
+/* Asynchronous batched evaluation:
+ * @callback gets called from evaluation thread with request @data, @arg,
+ * policy and win rate for color to play (-1 if net has no value head). */
+typedef void (*dcnn_result_t)(void *ctx, void *data, int arg, float result[], float value);
+void dcnn_queue_start(board_t *b, int batch_size, dcnn_result_t callback, void *ctx);
+void dcnn_queue_stop(void);
+bool dcnn_queue_submit(board_t *b, enum stone color, void *data, int arg);
+bool dcnn_queue_submit_cb(board_t *b, enum stone color, dcnn_result_t callback, void *data, int arg);
+void dcnn_queue_drain(void);
+bool dcnn_queue_running(void);
+
 /* Convert board coord to dcnn data index */
 static inline int coord2dcnn_idx(coord_t c);
 
@@ -47,6 +85,11 @@ coord2dcnn_idx(coord_t c)
 #define require_dcnn()  die("dcnn required but not compiled in, aborting.\n")
 #define using_dcnn(b)   0
 #define dcnn_init(b)    ((void)0)
+#define dcnn_select(b, budget)  ((void)(budget))
+#define dcnn_queue_drain()  ((void)0)
+#define dcnn_eval_count()   0
+#define dcnn_latency()      0
+#define dcnn_has_value()    0
 
 
 #endif
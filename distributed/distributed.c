@@ -40,14 +40,37 @@
 /* The master-slave protocol has fault tolerance. If a slave is
  * out of sync, the master sends it the appropriate command history. */
 
+/* Masters can be stacked: with the slave option, the distributed engine
+ * is itself a slave of another master (a sub-master). It forwards the
+ * genmoves commands to its own slaves and replies with their aggregated
+ * stats, as a single large slave would. Stats received from above are
+ * merged in what is sent to our slaves and vice versa, so each machine
+ * still gets the contributions of all others. This keeps network traffic
+ * and merge time bounded on the top master with many machines. */
+
+/* With dcnn_priors, the master asks all slaves for the dcnn policy at
+ * the root before each genmove and sends the best reply back to them as
+ * pachi-dcnn_priors. Slaves without dcnn (cpu-only machines) use it as
+ * root priors, so a few gpu machines are enough to guide the search of
+ * many cpu slaves. Deeper nodes only get the usual priors. */
+
 /* Pass me arguments like a=b,c=d,...
  * Supported arguments:
  * slave_port=SLAVE_PORT     slaves connect to this port; this parameter is mandatory.
  * max_slaves=MAX_SLAVES     default 24
  * shared_nodes=SHARED_NODES default 10K
- * stats_hbits=STATS_HBITS   default 21. 2^stats_bits = hash table size
+ * stats_hbits=STATS_HBITS   default 18. 2^stats_bits = initial hash table size
  * slaves_quit=0|1           quit gtp command also sent to slaves, default false.
  * proxy_port=PROXY_PORT     slaves optionally send their logs to this port.
+ * slave                     sub-master mode, run with -g to connect to our master.
+ * dcnn_priors=0|1           share root dcnn policy of slaves using dcnn with the
+ *                           others, default false.
+ * binary_root=0|1           slaves send root children stats of genmoves replies
+ *                           in binary instead of text, default true. Slaves
+ *                           which don't know about it just send text.
+ * stats_file=FILE           after each genmove, write cluster stats to FILE as json:
+ *                           per slave games/s, latency, traffic, resent and dropped
+ *                           commands, merge time, plus totals and hash occupancy.
  *    Warning: with proxy_port, the master stderr mixes the logs of all
  *    machines but you can separate them again:
  *      slave logs:  sed -n '/< .*:/s/.*< /< /p' logfile
@@ -64,9 +87,14 @@
  * If the master itself runs on a machine other than that running gogui,
  * gogui-twogtp, kgsGtp or cgosGtp, it can redirect its gtp port:
  *    pachi -e distributed -g 10000 slave_port=1234,proxy_port=1235
+ * With sub-masters, the top master runs as usual and each sub-master as:
+ *    pachi -e distributed -g masterhost:1234 slave_port=1236,slave
+ * with its slaves connecting to it:
+ *    pachi -e uct -g submasterhost:1236 slave
  */
 
 #include <assert.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -86,6 +114,7 @@
 #include "debug.h"
 #include "chat.h"
 #include "distributed/distributed.h"
+#include "distributed/encode.h"
 #include "distributed/merge.h"
 
 /* Internal engine state. */
@@ -101,6 +130,17 @@ typedef struct {
 	int slaves;
 	int threads;
 	bool undo_pending;
+	bool dcnn_priors;
+	bool binary_root;
+	bool transient_cmd;		/* last command gets overwritten by next one */
+	char *stats_file;
+
+	/* Sub-master only */
+	bool slave;
+	int parent_id;			/* gtp id of last genmoves from our master */
+	int search_id;			/* gtp id of genmoves our slaves are running */
+	slave_state_t *parent;		/* our master, as seen by merge */
+	void *parent_stats;		/* stats exchanged with our master */
 } distributed_t;
 
 /* Default number of simulations to perform per move.
@@ -194,6 +234,78 @@ distributed_undo_commit(distributed_t *dist, board_t *b, gtp_t *gtp)
 	}
 }
 
+/* Read binary args of size given by @size in the command into @buf,
+ * or discard them if @buf is NULL or too small.
+ * Return the size read, -1 if discarded. */
+static int
+read_bin_args(char *args, void *buf, int max_size)
+{
+	char *s = strchr(args, '@');
+	int size = (s ? atoi(s + 1) : 0);
+	if (!size)  return 0;
+	if (buf && size <= max_size)
+		return (fread(buf, 1, size, stdin) == (size_t)size ? size : -1);
+
+	while (size) {
+		char tmp[64*1024];
+		int len = (size < (int)sizeof(tmp) ? size : (int)sizeof(tmp));
+		len = fread(tmp, 1, len, stdin);
+		if (len <= 0) break;
+		size -= len;
+	}
+	return -1;
+}
+
+/* Sub-master: check we're in sync with our master, similar to
+ * uct/slave.c:uct_notify(). genmoves are never forwarded as is,
+ * the default handler calls distributed_genmoves() instead. */
+static enum parse_code
+distributed_notify_parent(distributed_t *dist, board_t *b, int id, char *cmd, char *args, gtp_t *gtp)
+{
+	if (move_number(id) != b->moves && !reply_disabled(id) && !is_reset(cmd)) {
+		read_bin_args(args, NULL, 0);
+		if (DEBUGL(0))  fprintf(stderr, "Out of sync, %d %s, move %d expected\n", id, cmd, b->moves);
+		gtp_error_printf(gtp, "Out of sync, %d %s, move %d expected\n", id, cmd, b->moves);
+		return P_OK;
+	}
+
+	if (is_repeated(cmd)) {
+		/* Old genmoves from command history, the move follows. */
+		if (reply_disabled(id)) {
+			read_bin_args(args, NULL, 0);
+			gtp->quiet = true;
+			return P_DONE_OK;
+		}
+		dist->parent_id = id;
+		return P_OK;
+	}
+	return (reply_disabled(id) ? P_NOREPLY : P_OK);
+}
+
+/* dcnn policy commands are only needed until the next command at the
+ * same move, overwrite them in the command history. Slave lock held. */
+static void
+dist_new_cmd(distributed_t *dist, board_t *b, const char *cmd, char *args)
+{
+	if (dist->transient_cmd)  update_cmd(b, cmd, args, true);
+	else                      new_cmd(b, cmd, args);
+	dist->transient_cmd = is_dcnn_policy(cmd);
+}
+
+/* Longest reply to pachi-dcnn_policy, slaves without dcnn reply nothing.
+ * Returns the policy part, NULL if no slave replied.
+ * The slave lock must be held. */
+static char *
+best_dcnn_policy(void)
+{
+	char *best = NULL;
+	for (int reply = 0; reply < reply_count; reply++)
+		if (!best || strlen(gtp_replies[reply]) > strlen(best))
+			best = gtp_replies[reply];
+	char *policy = (best ? strchr(best, ' ') : NULL); // skip "=id "
+	return (policy && !isspace(policy[1]) ? policy + 1 : NULL);
+}
+
 /* Dispatch a new gtp command to all slaves.
  * The slave lock must not be held upon entry and is released upon return.
  * args is empty or ends with '\n' */
@@ -205,6 +317,13 @@ distributed_notify(engine_t *e, board_t *b, int id, char *cmd, char *args, gtp_t
 	/* Pending undo ? Update board */
 	if (dist->undo_pending && strcasecmp(cmd, "undo"))
 		distributed_undo_commit(dist, b, gtp);
+
+	/* Sub-master: commands from our master. */
+	enum parse_code ok = P_OK;
+	if (dist->slave && id != -1) {
+		ok = distributed_notify_parent(dist, b, id, cmd, args, gtp);
+		if (gtp->error || ok == P_DONE_OK || is_repeated(cmd))  return ok;
+	}
 	
 	/* Commands that should not be sent to slaves.
 	 * time_left will be part of next pachi-genmoves,
@@ -212,6 +331,7 @@ distributed_notify(engine_t *e, board_t *b, int id, char *cmd, char *args, gtp_t
 	if ((!strcasecmp(cmd, "quit") && !dist->slaves_quit)
 	    || !strcasecmp(cmd, "pachi-gentbook")
 	    || !strcasecmp(cmd, "pachi-dumptbook")
+	    || !strcasecmp(cmd, "pachi-mergetbook")
 	    || !strcasecmp(cmd, "kgs-chat")
 	    || !strcasecmp(cmd, "time_left")
 
@@ -220,12 +340,21 @@ distributed_notify(engine_t *e, board_t *b, int id, char *cmd, char *args, gtp_t
 	    || !strcasecmp(cmd, "kgs-genmove_cleanup")
 	    || !strcasecmp(cmd, "final_score")
 	    || !strcasecmp(cmd, "final_status_list"))
-		return P_OK;
+		return ok;
 
 	protocol_lock();
 
-	// Create a new command to be sent by the slave threads.
-	new_cmd(b, cmd, args);
+	if (dist->search_id && !strcasecmp(cmd, "play")) {
+		/* Sub-master: our slaves commit to the move selected by our
+		 * master, overwriting the last "pachi-genmoves" in the command
+		 * history as distributed_genmove() does. */
+		clear_receive_queue();
+		update_cmd(b, cmd, args, true);
+	} else {
+		// Create a new command to be sent by the slave threads.
+		dist_new_cmd(dist, b, cmd, args);
+	}
+	dist->search_id = 0;
 
 	/* Wait for replies here. If we don't wait, we run the
 	 * risk of getting out of sync with most slaves and
@@ -235,6 +364,15 @@ distributed_notify(engine_t *e, board_t *b, int id, char *cmd, char *args, gtp_t
 	int min_slaves = active_slaves > 1 ? 3 * active_slaves / 4 : 1;
 	get_replies(time_now() + MAX_FAST_CMD_WAIT, min_slaves);
 
+	/* Sub-master: pass the best policy of our slaves up. */
+	if (dist->slave && !strcasecmp(cmd, "pachi-dcnn_policy")) {
+		char *policy = best_dcnn_policy();
+		if (reply_disabled(id))  gtp->quiet = true;
+		if (policy)  gtp_printf(gtp, "%s", policy);
+		protocol_unlock();
+		return P_DONE_OK;
+	}
+
 	protocol_unlock();
 
 	// At the beginning wait even more for late slaves.
@@ -245,7 +383,7 @@ distributed_notify(engine_t *e, board_t *b, int id, char *cmd, char *args, gtp_t
 	if (!strcasecmp(cmd, "pachi-setoption"))  return P_DONE_OK;   // XXX handle errors, changing options on distributed side ?
 	if (!strcasecmp(cmd, "pachi-getoption"))  {  gtp_error(gtp, "unimplemented"); return P_DONE_OK;  }  // XXX check replies from all slaves agree ?
 	
-	return P_OK;
+	return ok;
 }
 
 /* The playouts sent by slaves for the children of the root node
@@ -256,21 +394,91 @@ typedef struct {
 	floating_t value; // BLACK wins/playouts
 } large_stats_t;
 
+/* Stats of one genmoves reply, as parsed by select_best_move(). */
+typedef struct {
+	unsigned int serial;	/* reply_serial[] of parsed reply */
+	bool valid;
+	int played_own, playouts, threads, keep_looking;
+	int nmoves;
+	coord_t coord[BOARD_MAX_COORDS + 2];
+	move_stats_t stats[BOARD_MAX_COORDS + 2];
+} reply_stats_t;
+
+/* Parsed replies by slot, so that we only parse new ones. */
+static reply_stats_t *reply_stats;
+static int max_reply_slots;
+
+/* Sum of all parsed replies. Wins are playouts * value, from black's view.
+ * +2 for pass and resign */
+static struct {
+	int played_own, playouts, threads, keep_looking;
+	long playouts_by_move[BOARD_MAX_COORDS + 2];
+	double wins_by_move[BOARD_MAX_COORDS + 2];
+} replies_sum;
+
+/* Add (@sign = 1) or remove (@sign = -1) @r from replies_sum. */
 static void
-large_stats_add_result(large_stats_t *s, floating_t result, long playouts)
+replies_sum_add(reply_stats_t *r, int sign)
+{
+	if (!r->valid)  return;
+	replies_sum.played_own += sign * r->played_own;
+	replies_sum.playouts += sign * r->playouts;
+	replies_sum.threads += sign * r->threads;
+	replies_sum.keep_looking += sign * r->keep_looking;
+	for (int i = 0; i < r->nmoves; i++) {
+		int c = r->coord[i] + 2;
+		replies_sum.playouts_by_move[c] += sign * r->stats[i].playouts;
+		replies_sum.wins_by_move[c] += sign * (double)r->stats[i].playouts * r->stats[i].value;
+	}
+}
+
+/* Returns false if reply isn't a genmoves reply.
+ * Root stats are in @root if the slave sent them in binary. */
+static bool
+parse_genmoves_reply(board_t *b, char *r, root_stats_t *root, int root_count, reply_stats_t *rs)
 {
-	s->playouts += playouts;
-	s->value += (result - s->value) * playouts / s->playouts;
+	int id;
+	rs->nmoves = 0;
+	if (sscanf(r, "=%d %d %d %d %d", &id, &rs->played_own, &rs->playouts,
+		   &rs->threads, &rs->keep_looking) != 5)
+		return false;
+
+	for (int i = 0; i < root_count; i++) {
+		coord_t c = root[i].coord;
+		if (c < resign || c >= board_max_coords(b) || root[i].stats.playouts < 0)
+			return false;
+		rs->coord[rs->nmoves] = c;
+		rs->stats[rs->nmoves++] = root[i].stats;
+	}
+	if (root_count)  return true;
+
+	// Skip the rest of the firt line in particular @size
+	r = strchr(r, '\n');
+
+	char move[64];
+	move_stats_t s;
+	while (r && sscanf(++r, "%63s %d " PRIfloating, move, &s.playouts, &s.value) == 3) {
+		coord_t c = str2coord(move);
+		assert (c >= resign && c < board_max_coords(b) && s.playouts >= 0);
+		assert(rs->nmoves < BOARD_MAX_COORDS + 2);
+		rs->coord[rs->nmoves] = c;
+		rs->stats[rs->nmoves++] = s;
+		r = strchr(r, '\n');
+	}
+	return true;
 }
 
 /* genmoves returns "=id played_own total_playouts threads keep_looking @size"
  * then a list of lines "coord playouts value" with absolute counts for
- * children of the root node, then a binary array of incr_stats structs.
- * To simplify the code, we assume that master and slave have the same architecture
- * (store values identically).
+ * children of the root node, then an encoded array of incr_stats structs
+ * (see encode.h). With binary_root the root children come as an array
+ * of root_stats_t instead, received in root_replies[].
  * Return the move with most playouts, and additional stats.
  * keep_looking is set from a majority vote of the slaves seen so far for this
  * move but should not be trusted if too few slaves have been seen.
+ * We get called each time a slave replies: only replies which changed
+ * since last time are parsed, otherwise with many slaves we'd spend
+ * most of the time holding slave_lock here.
  * Keep this code in sync with uct/slave.c:report_stats().
  * slave_lock is held on entry and on return. */
 static coord_t
@@ -279,58 +487,51 @@ select_best_move(board_t *b, large_stats_t *stats, int *played,
 {
 	assert(reply_count > 0);
 
-	/* +2 for pass and resign */
-	memset(stats-2, 0, (board_max_coords(b)+2) * sizeof(*stats));
+	for (int slot = 0; slot < reply_count; slot++) {
+		reply_stats_t *rs = &reply_stats[slot];
+		if (rs->serial == reply_serial[slot])  continue;
+		replies_sum_add(rs, -1);
+		rs->serial = reply_serial[slot];
+		rs->valid = parse_genmoves_reply(b, gtp_replies[slot], root_replies[slot],
+						 root_replies_count[slot], rs);
+		replies_sum_add(rs, 1);
+	}
+	/* Slots beyond reply_count are from previous commands. */
+	for (int slot = reply_count; slot < max_reply_slots; slot++) {
+		replies_sum_add(&reply_stats[slot], -1);
+		reply_stats[slot].valid = false;
+	}
+
+	*played = replies_sum.played_own;
+	*total_playouts = replies_sum.playouts;
+	*total_threads = replies_sum.threads;
+	*keep_looking = replies_sum.keep_looking > reply_count / 2;
 
 	coord_t best_move = pass;
 	long best_playouts = 0;
-	*played = 0;
-	*total_playouts = 0;
-	*total_threads = 0;
-	int keep = 0;
-
-	for (int reply = 0; reply < reply_count; reply++) {
-		char *r = gtp_replies[reply];
-		int id, o, p, t, k;
-		if (sscanf(r, "=%d %d %d %d %d", &id, &o, &p, &t, &k) != 5) continue;
-		*played += o;
-		*total_playouts += p;
-		*total_threads += t;
-		keep += k;
-		// Skip the rest of the firt line in particular @size
-		r = strchr(r, '\n');
-
-		char move[64];
-		move_stats_t s;
-		while (r && sscanf(++r, "%63s %d " PRIfloating, move, &s.playouts, &s.value) == 3) {
-			coord_t c = str2coord(move);
-			assert (c >= resign && c < board_max_coords(b) && s.playouts >= 0);
-
-			large_stats_add_result(&stats[c], s.value, (long)s.playouts);
-
-			if (stats[c].playouts > best_playouts) {
-				best_playouts = stats[c].playouts;
-				best_move = c;
-			}
-			r = strchr(r, '\n');
+	for (coord_t c = resign; c < board_max_coords(b); c++) {
+		long playouts = replies_sum.playouts_by_move[c + 2];
+		stats[c].playouts = playouts / reply_count;
+		stats[c].value = (playouts ? replies_sum.wins_by_move[c + 2] / playouts : 0);
+		if (playouts > best_playouts) {
+			best_playouts = playouts;
+			best_move = c;
 		}
 	}
-	for (coord_t c = resign; c < board_max_coords(b); c++)
-		stats[c].playouts /= reply_count;
-	*keep_looking = keep > reply_count / 2;
 	return best_move;
 }
 
 /* Set the args for the genmoves command. If binary_args is set,
  * each slave thred will add the correct binary size when sending
- * (see get_binary_arg()). args must have CMDS_SIZE bytes and
+ * (see get_binary_arg()). With binary_root slaves are asked to send
+ * root stats in binary, see root_stats_t. args must have CMDS_SIZE bytes and
  * upon return ends with a single \n.
  * Keep this code in sync with uct/slave.c:uct_genmoves().
  * slave_lock is held on entry and on return but we don't
  * rely on the lock here. */
 static void
 genmoves_args(char *args, enum stone color, int played,
-	      time_info_t *ti, bool binary_args)
+	      time_info_t *ti, bool binary_root, bool binary_args)
 {
 	char *end = args + CMDS_SIZE;
 	char *s = args + snprintf(args, CMDS_SIZE, "%s %d", stone2str(color), played);
@@ -340,6 +541,8 @@ genmoves_args(char *args, enum stone color, int played,
 			      ti->main_time, ti->byoyomi_time,
 			      ti->byoyomi_periods, ti->byoyomi_stones);
 	}
+	if (binary_root)
+		s += snprintf(s, end - s, " +root");
 	s += snprintf(s, end - s, binary_args ? " @0\n" : "\n");
 }
 
@@ -349,6 +552,73 @@ genmoves_args(char *args, enum stone color, int played,
 #define MAX_MAINTIME_RATIO 3.0
 
 /* Regularly send genmoves command to the slaves, and select the best move. */
+/* Ask slaves for the root dcnn policy and send the best one to all
+ * slaves, see top of file. The genmoves command that follows overwrites
+ * both in the command history. The slave lock must be held. */
+static void
+share_dcnn_policy(distributed_t *dist, board_t *b, enum stone color)
+{
+	char args[BSIZE];
+	snprintf(args, sizeof(args), "%s\n", stone2str(color));
+	dist_new_cmd(dist, b, "pachi-dcnn_policy", args);
+	int min_slaves = active_slaves > 1 ? 3 * active_slaves / 4 : 1;
+	get_replies(time_now() + MAX_FAST_CMD_WAIT, min_slaves);
+
+	char *policy = best_dcnn_policy();
+	if (!policy)  return;
+
+	char *a = args, *end = args + sizeof(args);
+	a += snprintf(a, end - a, "%s", stone2str(color));
+	char coord[8];
+	float prob;
+	int n, moves = 0;
+	while (sscanf(policy, " %7s %f%n", coord, &prob, &n) == 2 && end - a > 32) {
+		a += snprintf(a, end - a, " %s %.4f", coord, prob);
+		policy += n;
+		moves++;
+	}
+	snprintf(a, end - a, "\n");
+
+	if (DEBUGL(3)) {
+		char buf[BSIZE];
+		snprintf(buf, sizeof(buf), "dcnn priors %d moves from %d replies\n", moves, reply_count);
+		logline(NULL, "* ", buf);
+	}
+	dist_new_cmd(dist, b, "pachi-dcnn_priors", args);
+	get_replies(time_now() + MAX_FAST_CMD_WAIT, min_slaves);
+}
+
+/* Write cluster stats for last genmove to dist->stats_file as json,
+ * replacing previous contents atomically. The slave lock must not be held. */
+static void
+write_stats_file(distributed_t *dist, board_t *b, enum stone color,
+		 int played, int playouts, double time, int total_hnodes)
+{
+	char tmp[strlen(dist->stats_file) + 8];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", dist->stats_file);
+	FILE *f = fopen(tmp, "w");
+	if (!f) {
+		if (DEBUGL(1))  perror(tmp);
+		return;
+	}
+
+	protocol_lock();
+	fprintf(f, "{\n  \"move\": %d, \"color\": \"%s\", \"time\": %.3f,\n"
+		"  \"slaves\": %d, \"threads\": %d, \"played_all\": %d, \"playouts\": %d, "
+		"\"games_per_s\": %.0f,\n  \"hash\": ",
+		b->moves, stone2str(color), time, dist->slaves, dist->threads,
+		played, playouts, played / (time + 0.000001));
+	merge_print_json(f, total_hnodes);
+	fprintf(f, ",\n  \"slave\": ");
+	print_slave_stats(f);
+	fprintf(f, "\n}\n");
+	protocol_unlock();
+
+	fclose(f);
+	if (rename(tmp, dist->stats_file) && DEBUGL(1))
+		perror(dist->stats_file);
+}
+
 static coord_t
 distributed_genmove(engine_t *e, board_t *b, time_info_t *ti,
 		    enum stone color, bool pass_all_alive)
@@ -383,9 +653,12 @@ distributed_genmove(engine_t *e, board_t *b, time_info_t *ti,
 	protocol_lock();
 	clear_receive_queue();
 
+	if (dist->dcnn_priors)
+		share_dcnn_policy(dist, b, color);
+
 	/* Send the first genmoves without stats. */
-	genmoves_args(args, color, 0, ti, false);
-	new_cmd(b, cmd, args);
+	genmoves_args(args, color, 0, ti, dist->binary_root, false);
+	dist_new_cmd(dist, b, cmd, args);
 
 	/* Loop until most slaves want to quit or time elapsed. */
 	int iterations;
@@ -424,7 +697,7 @@ distributed_genmove(engine_t *e, board_t *b, time_info_t *ti,
 		}
 		/* Send the command with the same gtp id, to avoid discarding
 		 * a reply to a previous genmoves at the same move. */
-		genmoves_args(args, color, played, ti, true);
+		genmoves_args(args, color, played, ti, dist->binary_root, true);
 		update_cmd(b, cmd, args, false);
 	}
 	int replies = reply_count;
@@ -460,13 +733,77 @@ distributed_genmove(engine_t *e, board_t *b, time_info_t *ti,
 			 (int)(played/time/threads), 1000*time/iterations);
 		logline(NULL, "* ", buf);
 	}
-	if (DEBUGL(4)) {
-		int total_hnodes = replies * (1 << dist->stats_hbits);
+	int total_hnodes = replies * (1 << dist->stats_hbits);
+	if (dist->stats_file)
+		write_stats_file(dist, b, color, played, playouts, now - first, total_hnodes);
+	if (DEBUGL(4))
 		merge_print_stats(total_hnodes);
-	}
 	return best;
 }
 
+/* Sub-master: genmoves from our master, see distributed_notify_parent().
+ * Start our slaves at the first genmoves of a move, then at each call
+ * pass the stats received from our master to our slaves and reply with
+ * what our slaves sent since last time, in the format of
+ * uct/slave.c:report_stats(). Counts are summed over our slaves except
+ * for the root children playouts, which are averaged to avoid overflows
+ * (they include contributions from all machines anyway).
+ * Keep this code in sync with uct/slave.c:uct_genmoves(). */
+static char *
+distributed_genmoves(engine_t *e, board_t *b, time_info_t *ti, enum stone color,
+		     char *args, bool pass_all_alive, void **stats_buf, int *stats_size)
+{
+	distributed_t *dist = (distributed_t*)e->data;
+	const char *cmd = pass_all_alive ? "pachi-genmoves_cleanup" : "pachi-genmoves";
+
+	/* Read stats from our master first, we must consume them anyway. */
+	int size = read_bin_args(args, dist->parent_stats, dist->parent->max_buf_size);
+	if (size < 0)  return NULL;
+
+	/* Forward time info from our master, with our own binary args. */
+	char fwd[CMDS_SIZE];
+	int len = snprintf(fwd, sizeof(fwd), "%s ", stone2str(color));
+	int n = strcspn(args, "@\n");
+	while (n > 0 && args[n - 1] == ' ')  n--;
+	snprintf(fwd + len, sizeof(fwd) - len, "%.*s%s", n, args,
+		 dist->search_id == dist->parent_id ? " @0\n" : "\n");
+
+	protocol_lock();
+	if (dist->search_id != dist->parent_id) {
+		/* First genmoves at this move, start our slaves. */
+		clear_receive_queue();
+		dist_new_cmd(dist, b, cmd, fwd);
+		dist->search_id = dist->parent_id;
+	} else
+		update_cmd(b, cmd, fwd, false);
+
+	if (size)  parent_insert_stats(dist->parent, dist->parent_stats, size);
+
+	get_replies(time_now() + MAX_GENMOVES_WAIT, 1);
+
+	large_stats_t stats_array[board_max_coords(b) + 2], *stats;
+	stats = &stats_array[2];
+	int played, playouts, threads;
+	bool keep_looking;
+	select_best_move(b, stats, &played, &playouts, &threads, &keep_looking);
+
+	*stats_size = parent_get_stats(dist->parent, dist->parent_stats);
+	*stats_buf = dist->parent_stats;
+	protocol_unlock();
+
+	static char reply[BOARD_MAX_COORDS * 32 + 64];
+	char *r = reply;
+	char *end = reply + sizeof(reply);
+	r += snprintf(r, end - r, "%d %d %d %d @%d", played, playouts,
+		      threads, keep_looking, *stats_size);
+	for (coord_t c = resign; c < board_max_coords(b); c++) {
+		if (!stats[c].playouts)  continue;
+		r += snprintf(r, end - r, "\n%s %d %.16f", coord2sstr(c),
+			      (int)stats[c].playouts, (double)stats[c].value);
+	}
+	return reply;
+}
+
 static char *
 distributed_chat(engine_t *e, board_t *b, bool opponent, char *from, char *cmd)
 {
@@ -549,6 +886,22 @@ distributed_setoption(engine_t *e, board_t *b, const char *optname, char *optval
 	else if (!strcasecmp(optname, "slaves_quit")) {  NEED_RESET
 		dist->slaves_quit = !optval || atoi(optval);
 	}
+	else if (!strcasecmp(optname, "slave")) {  NEED_RESET
+		/* Sub-master, slave of another distributed master. */
+		dist->slave = !optval || atoi(optval);
+	}
+	else if (!strcasecmp(optname, "stats_file") && optval) {
+		/* Write cluster stats as json after each genmove. */
+		dist->stats_file = strdup(optval);
+	}
+	else if (!strcasecmp(optname, "binary_root")) {
+		/* Root stats in genmoves replies sent in binary instead of text. */
+		dist->binary_root = !optval || atoi(optval);
+	}
+	else if (!strcasecmp(optname, "dcnn_priors")) {
+		/* Share root dcnn policy of slaves using dcnn with the others. */
+		dist->dcnn_priors = !optval || atoi(optval);
+	}
 	else
 		option_error("Distributed: Invalid engine argument %s or missing value\n", optname);
 
@@ -566,6 +919,7 @@ distributed_state_init(engine_t *e, board_t *b)
 	dist->stats_hbits = DEFAULT_STATS_HBITS;
 	dist->max_slaves = DEFAULT_MAX_SLAVES;
 	dist->shared_nodes = DEFAULT_SHARED_NODES;
+	dist->binary_root = true;
 
 	/* Process engine options. */
 	char *err;
@@ -574,13 +928,24 @@ distributed_state_init(engine_t *e, board_t *b)
 			die("%s", err);
 	
 	gtp_replies = calloc2(dist->max_slaves, char *);
+	reply_serial = calloc2(dist->max_slaves, unsigned int);
+	root_replies = calloc2(dist->max_slaves, root_stats_t *);
+	root_replies_count = calloc2(dist->max_slaves, int);
+	reply_stats = calloc2(dist->max_slaves, reply_stats_t);
+	max_reply_slots = dist->max_slaves;
 
 	if (!dist->slave_port)
 		die("distributed: missing slave_port\n");
 
-	merge_init(&default_sstate, dist->shared_nodes, dist->stats_hbits, dist->max_slaves);
+	/* Our master counts as one more slave for the merge. */
+	merge_init(&default_sstate, dist->shared_nodes, dist->stats_hbits, dist->max_slaves + dist->slave);
 	protocol_init(dist->slave_port, dist->proxy_port, dist->max_slaves);
 
+	if (dist->slave) {
+		dist->parent = parent_state_alloc(dist->max_slaves);
+		dist->parent_stats = cmalloc(incr_stats_max_encoded_size(dist->shared_nodes));
+	}
+
 	return dist;
 }
 
@@ -598,9 +963,11 @@ distributed_engine_init(engine_t *e, board_t *b)
 	// Keep the threads and the open socket connections:
 	e->keep_on_clear = true;
 	e->setoption = distributed_setoption;
-	distributed_state_init(e, b);
+	distributed_t *dist = distributed_state_init(e, b);
+	if (dist->slave)
+		e->genmoves = distributed_genmoves;
 
-	if (DEBUGL(2))  fprintf(stderr, "distributed: master node\n");
+	if (DEBUGL(2))  fprintf(stderr, "distributed: %s node\n", (dist->slave ? "sub-master" : "master"));
 	if (DEBUGL(2) && !DEBUGL(3))
 		fprintf(stderr,
 			"distributed: pachi-genmoves subcommands not logged\n"
@@ -2,9 +2,11 @@
 #define PACHI_DISTRIBUTED_DISTRIBUTED_H
 
 #include <limits.h>
+#include <string.h>
 
 #include "engine.h"
 #include "stats.h"
+#include "util.h"
 
 /* A coord path encodes coordinates from root child to a given node:
  * A1->B2->C3 is encoded as coord(A1)<<18 + coord(B2)<<9 + coord(C3)
@@ -33,24 +35,76 @@ typedef struct {
 	long occupied;
 } hash_counts_t;
 
+/* Generation tags of hash table entries, one byte per entry kept
+ * apart from the table. Entries of older generations are unused so
+ * clearing a table at each move is just bumping its generation, which
+ * makes large tables affordable. Tables also grow when they get more
+ * than half full (see hash_needs_grow()), stats_hbits is only the
+ * initial size. */
+typedef struct hash_gen {
+	unsigned char *gen;
+	unsigned char epoch;
+	int used;		/* live entries */
+} hash_gen_t;
+
+#define HASH_MAX_BITS 28
+
+#define hash_live(g, hash)  ((g)->gen[hash] == (g)->epoch)
+
+static inline void
+hash_gen_init(hash_gen_t *g, int hash_bits)
+{
+	g->gen = calloc2(1 << hash_bits, unsigned char);
+	g->epoch = 1;
+	g->used = 0;
+}
+
+/* Mark all entries unused. Tags are only cleared when the
+ * generation wraps around, once every 255 calls. */
+static inline void
+hash_gen_clear(hash_gen_t *g, int hash_bits)
+{
+	if (!++g->epoch) {
+		memset(g->gen, 0, 1 << hash_bits);
+		g->epoch = 1;
+	}
+	g->used = 0;
+}
+
+/* Entry @hash found unused by find_hash() gets used. */
+static inline void
+hash_gen_insert(hash_gen_t *g, int hash)
+{
+	g->gen[hash] = g->epoch;
+	g->used++;
+}
+
+/* Whether table must grow before inserting up to @incoming entries. */
+static inline bool
+hash_needs_grow(hash_gen_t *g, int hash_bits, int incoming)
+{
+	return (g->used + incoming > (1 << hash_bits) / 2 && hash_bits < HASH_MAX_BITS);
+}
+
 /* Find a hash table entry given its coord path from root.
  * Set found to false if the entry is empty.
- * Abort if the table gets too full (should never happen).
- * We use double hashing and coord_path = 0 for unused entries. */
-#define find_hash(hash, table, hash_bits, path, found, counts)	\
+ * Abort if the table gets too full (should never happen, tables grow).
+ * We use double hashing, unused entries have an old generation tag
+ * in gen or coord_path = 0. */
+#define find_hash(hash, table, hash_bits, path, found, counts, g)	\
 	do { \
 		if (DEBUG_MODE) counts.lookups++; \
 		int mask = hash_mask(hash_bits); \
 		int delta = (int)((path) >> (hash_bits)) | 1; \
 		hash = ((int)(path) ^ delta ^ (delta >> (hash_bits))) & mask; \
-		path_t cp = (table)[hash].coord_path; \
+		path_t cp = (hash_live(g, hash) ? (table)[hash].coord_path : 0); \
 		found = (cp == path); \
 		if (found | !cp) break; \
 		int tries = 1 << ((hash_bits)-2); \
 		do { \
 			if (DEBUG_MODE) counts.collisions++; \
 			hash = (hash + delta) & mask; \
-			cp = (table)[hash].coord_path; \
+			cp = (hash_live(g, hash) ? (table)[hash].coord_path : 0); \
 			found = (cp == path); \
 			if (found | !cp) break; \
 		} while (--tries); \
@@ -65,21 +119,36 @@ typedef struct {
 	move_stats_t incr;
 } incr_stats_t;
 
+/* Absolute stats of a root child. With the binary_root option slaves
+ * send them as an array in front of the binary stats of genmoves replies
+ * instead of "coord playouts value" text lines, which the master would
+ * have to parse for each slave every cycle. The reply line then has
+ * "#size" before "@size" for the byte size of this array. */
+typedef struct {
+	coord_t coord;
+	move_stats_t stats;
+} root_stats_t;
+
+/* Root children plus a forced pass, resign or book move. */
+#define ROOT_STATS_MAX_SIZE  ((BOARD_MAX_COORDS + 1) * (int)sizeof(root_stats_t))
+
 /* A slave machine updates at most 7 (19x19) or 9 (9x9) nodes for each
  * update of the root node. If we have at most 20 threads at 1500
  * games/s each, a slave machine can do at most 30K games/s. */
 
-/* At 30K games/s a slave can output 270K nodes/s or 4.2 MB/s. The master
- * with a 100 MB/s network can thus support at most 24 slaves. */
+/* At 30K games/s a slave can output 270K nodes/s or 4.2 MB/s raw, about
+ * 1.4 MB/s encoded (see encode.h). The master with a 100 MB/s network
+ * could thus support about 70 slaves, but merge time grows with the
+ * number of slaves too (see merge.c), we stay conservative. */
 #define DEFAULT_MAX_SLAVES 24
 
 /* In a 30s move at 270K nodes/s a slave can send and receive at most
  * 8.1M nodes so at worst 23 bits are needed for the hash table in the
  * slave and for the per-slave hash table in the master. However the
  * same nodes are often sent so in practice 21 bits are sufficient.
- * Larger hash tables are not desirable because it would take too much
- * time to clear them at each move in the master. For the default
- * shared_levels=1, 18 bits are enough. */
+ * Tables grow as needed and clearing them is cheap (see hash_gen_t),
+ * this is only the initial size. For the default shared_levels=1,
+ * 18 bits are enough. */
 #define DEFAULT_STATS_HBITS 18
 
 /* If we select a cycle of at most 40ms, a slave machine can update at
@@ -0,0 +1,102 @@
+#include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+
+#include "distributed/encode.h"
+
+#define VALUE_SCALE 65535
+
+static inline unsigned char *
+put_varint(unsigned char *p, uint64_t x)
+{
+	while (x >= 0x80) {
+		*p++ = (x & 0x7f) | 0x80;
+		x >>= 7;
+	}
+	*p++ = x;
+	return p;
+}
+
+/* Returns NULL if we'd go past @end. */
+static inline unsigned char *
+get_varint(unsigned char *p, unsigned char *end, uint64_t *x)
+{
+	*x = 0;
+	for (int shift = 0; p < end && shift < 64; shift += 7) {
+		*x |= (uint64_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+	}
+	return NULL;
+}
+
+int
+incr_stats_encode(incr_stats_t *stats, int nodes, unsigned char *buf)
+{
+	if (!nodes)  return 0;
+	unsigned char *p = put_varint(buf, nodes);
+	path_t prev = 0;
+	for (int i = 0; i < nodes; i++) {
+		assert(stats[i].coord_path > prev && stats[i].incr.playouts > 0);
+		p = put_varint(p, stats[i].coord_path - prev);
+		p = put_varint(p, stats[i].incr.playouts);
+		prev = stats[i].coord_path;
+
+		floating_t value = stats[i].incr.value;
+		/* Increments can be a bit off with virtual loss. */
+		if (value < 0)  value = 0;
+		if (value > 1)  value = 1;
+		unsigned int v = lrint(value * VALUE_SCALE);
+		*p++ = v & 0xff;
+		*p++ = v >> 8;
+	}
+	return p - buf;
+}
+
+int
+incr_stats_encoded_nodes(unsigned char *buf, int size)
+{
+	uint64_t nodes;
+	if (!get_varint(buf, buf + size, &nodes) || nodes > INT_MAX / sizeof(incr_stats_t))
+		return -1;
+	return nodes;
+}
+
+int
+incr_stats_decode(unsigned char *buf, int size, incr_stats_t *stats, int max_nodes)
+{
+	int nodes = incr_stats_encoded_nodes(buf, size);
+	if (nodes < 0 || nodes > max_nodes)
+		return -1;
+
+	/* Decoding in place: move encoded data to the end of the decoded
+	 * area first. Encoded nodes are never larger than decoded ones so
+	 * we never overwrite data not read yet. */
+	unsigned char *p = buf;
+	int decoded_size = nodes * sizeof(incr_stats_t);
+	if ((void*)stats == (void*)buf && decoded_size > size) {
+		p = buf + decoded_size - size;
+		memmove(p, buf, size);
+	}
+	unsigned char *end = p + size;
+
+	uint64_t x;
+	p = get_varint(p, end, &x);	/* Node count */
+	path_t path = 0;
+	for (int i = 0; i < nodes; i++) {
+		incr_stats_t s;
+		uint64_t playouts;
+		if (!(p = get_varint(p, end, &x)) || !x || x > (uint64_t)(PATH_T_MAX - path))
+			return -1;
+		path += x;
+		if (!(p = get_varint(p, end, &playouts)) || !playouts || playouts > INT_MAX || end - p < 2)
+			return -1;
+		s.coord_path = path;
+		s.incr.playouts = playouts;
+		s.incr.value = (floating_t)(p[0] | p[1] << 8) / VALUE_SCALE;
+		p += 2;
+		stats[i] = s;
+	}
+	return (p == end ? nodes : -1);
+}
@@ -0,0 +1,30 @@
+#ifndef PACHI_DISTRIBUTED_ENCODE_H
+#define PACHI_DISTRIBUTED_ENCODE_H
+
+/* Compact wire format for incr_stats_t arrays exchanged between master
+ * and slaves. Arrays are always sorted by increasing coord path, so we
+ * send the node count, then for each node the coord path delta from the
+ * previous one and playouts as varints, and value quantized to 16 bits
+ * (exact to 1e-5, well below playout noise). Typical node takes 5 bytes
+ * instead of 16, an encoded node is never larger than a raw one. */
+
+#include "distributed/distributed.h"
+
+/* Bytes needed to encode @nodes nodes at worst. */
+#define incr_stats_max_encoded_size(nodes)  (5 + (nodes) * (int)sizeof(incr_stats_t))
+
+/* Encode @nodes stats from @stats into @buf, which must hold
+ * incr_stats_max_encoded_size(nodes) bytes. Returns encoded size,
+ * 0 if there's nothing to send. */
+int incr_stats_encode(incr_stats_t *stats, int nodes, unsigned char *buf);
+
+/* Number of nodes in encoded buffer, -1 if it's garbage. */
+int incr_stats_encoded_nodes(unsigned char *buf, int size);
+
+/* Decode @size bytes from @buf into @stats, which can hold @max_nodes.
+ * @stats may be the same buffer as @buf (decodes in place, @buf must
+ * be large enough for the decoded nodes then).
+ * Returns number of nodes, -1 if buffer is garbage. */
+int incr_stats_decode(unsigned char *buf, int size, incr_stats_t *stats, int max_nodes);
+
+#endif
@@ -13,11 +13,15 @@
 #include "debug.h"
 #include "timeinfo.h"
 #include "distributed/distributed.h"
+#include "distributed/encode.h"
 #include "distributed/merge.h"
 
 /* We merge together debug stats for all hash tables. */
 static hash_counts_t h_counts;
 
+/* Most nodes a slave may send in one reply. */
+static int max_nodes;
+
 /* Display and reset hash statistics. For debugging only. */
 void
 merge_print_stats(int total_hnodes)
@@ -34,6 +38,16 @@ merge_print_stats(int total_hnodes)
 	if (DEBUG_MODE) h_counts.occupied = 0;
 }
 
+/* Print hash table counts as json object to @f. */
+void
+merge_print_json(FILE *f, int total_hnodes)
+{
+	fprintf(f, "{ \"occupied\": %ld, \"occupancy\": %.4f, \"inserts\": %ld, "
+		"\"lookups\": %ld, \"collisions\": %ld }",
+		h_counts.occupied, (double)h_counts.occupied / total_hnodes,
+		h_counts.inserts, h_counts.lookups, h_counts.collisions);
+}
+
 /* We maintain counts per bucket to avoid sorting large arrays.
  * All nodes with n updates since last send go to bucket n.
  * We have at most max_merged_nodes = (max_slaves-1) * shared_nodes
@@ -53,12 +67,13 @@ stats_tally(incr_stats_t *s, slave_state_t *sstate, int *bucket_count)
 	int h;
 	bool found;
 	incr_stats_t *stats_htable = sstate->stats_htable;
-	find_hash(h, stats_htable, sstate->stats_hbits, s->coord_path, found, h_counts);
+	find_hash(h, stats_htable, sstate->stats_hbits, s->coord_path, found, h_counts, &sstate->stats_gen);
 	if (found) {
 		assert(stats_htable[h].incr.playouts > 0);
 		stats_add_result(&stats_htable[h].incr, s->incr.value, s->incr.playouts);
 	} else {
 		stats_htable[h] = *s;
+		hash_gen_insert(&sstate->stats_gen, h);
 		if (DEBUG_MODE) h_counts.inserts++, h_counts.occupied++;
 	}
 
@@ -100,20 +115,17 @@ filter_buffers(slave_state_t *sstate, incr_stats_t **next,
 	return size / sizeof(incr_stats_t);
 }
 
-/* Return the minimum coord path of next[min..max].
- * This implementation is optimized for small values of max - min,
- * which is the case if slaves are not too much behind.
- * A heap (priority queue) could be used otherwise.
+/* Return the minimum coord path of next[active[0..n-1]].
  * The returned value might be come from a buffer that has
  * been invalidated, the caller must check for this; in this
  * case the returned value is < the correct value. */
 static inline path_t
-min_coord(incr_stats_t **next, int min, int max)
+min_coord(incr_stats_t **next, int *active, int n)
 {
-	path_t min_c = next[min]->coord_path;
-	for (int q = min + 1; q <= max; q++) {
-		if (next[q]->coord_path < min_c)
-			min_c = next[q]->coord_path;
+	path_t min_c = INT64_MAX;
+	for (int i = 0; i < n; i++) {
+		if (next[active[i]]->coord_path < min_c)
+			min_c = next[active[i]]->coord_path;
 	}
 	return min_c;
 }
@@ -125,6 +137,11 @@ min_coord(incr_stats_t **next, int min, int max)
  * The input buffers end with a terminator value INT64_MAX.
  * Return the number of updated hash table entries. */
 
+/* Only buffers not yet exhausted are scanned (active[] list), and
+ * the minimum coord for the next iteration is found while summing
+ * the current one, so each iteration reads each buffer only once.
+ * Slave threads merge concurrently, each for its own slave. */
+
 /* The slave lock is not held on either entry or exit of this function,
  * so receive_queue entries may be invalidated while we scan them.
  * The receive queue might grow while we scan it but we ignore
@@ -142,6 +159,12 @@ merge_new_stats(slave_state_t *sstate, int min, int max,
 	incr_stats_t **next = next_ - min;
 	*nodes_read = filter_buffers(sstate, next, &min, max);
 
+	/* Buffers with something left to merge. */
+	int active[max - min + 1];
+	int nactive = 0;
+	for (int q = min; q <= max; q++)
+		if (next[q] != &terminator)  active[nactive++] = q;
+
 	/* prev_min_c is only used for debugging. */
 	path_t prev_min_c = 0;
 
@@ -150,47 +173,60 @@ merge_new_stats(slave_state_t *sstate, int min, int max,
 	 * invalidated, or at least one is valid and we are at the
 	 * end of all valid buffers. In both cases we're done. */
 	int merge_count = 0;
-	path_t min_c;
-	while ((min_c = min_coord(next, min, max)) != INT64_MAX) {
+	path_t min_c = min_coord(next, active, nactive);
+	while (min_c != INT64_MAX) {
 
 		incr_stats_t sum = { min_c, move_stats(0.0, 0) };
-		for (int q = min; q <= max; q++) {
+		path_t next_min_c = INT64_MAX;
+		for (int i = 0; i < nactive; i++) {
+			int q = active[i];
 			incr_stats_t s = *(next[q]);
 
 			/* If s.coord_path != min_c, we must skip s.coord_path for now.
 			 * If min_c is invalid, a future iteration will get a stable
-			 * value since the call of min_coord(), so at some point we will
-			 * get s.coord_path == min_c and we will not loop forever. */
-			 if (s.coord_path != min_c) continue;
-
-			/* We check the buffer validity after s.coord has been checked
-			 * to avoid a race condition, and also to avoid multiple useless
-			 * checks for the same coord_path. */
-			if (unlikely(!receive_queue[q])) {
-				next[q] = &terminator;
-				continue;
+			 * value since it was read, so at some point we will get
+			 * s.coord_path == min_c and we will not loop forever. */
+			if (s.coord_path == min_c) {
+				/* We check the buffer validity after s.coord has been checked
+				 * to avoid a race condition, and also to avoid multiple useless
+				 * checks for the same coord_path. */
+				if (unlikely(!receive_queue[q])) {
+					next[q] = &terminator;
+					active[i--] = active[--nactive];
+					continue;
+				}
+
+				/* Stop if we have a new move. If queue_age is incremented
+				 * after this check, the merged output will be discarded. */
+				if (unlikely(queue_age > last_queue_age)) return 0;
+
+				/* s.coord_path is valid here, so min_c is valid too.
+				 * (An invalid min_c would be < s.coord_path.) */
+				assert(min_c > prev_min_c);
+
+				assert(s.coord_path && s.incr.playouts);
+				stats_add_result(&sum.incr, s.incr.value, s.incr.playouts);
+				s.coord_path = (++next[q])->coord_path;
 			}
 
-			/* Stop if we have a new move. If queue_age is incremented
-			 * after this check, the merged output will be discarded. */
-			if (unlikely(queue_age > last_queue_age)) return 0;
-
-			/* s.coord_path is valid here, so min_c is valid too.
-			 * (An invalid min_c would be < s.coord_path.) */
-			assert(min_c > prev_min_c);
-
-			assert(s.coord_path && s.incr.playouts);
-			stats_add_result(&sum.incr, s.incr.value, s.incr.playouts);
-			next[q]++;
+			/* Valid buffers are never modified, so we only get
+			 * INT64_MAX at the end (or from an invalid buffer). */
+			if (s.coord_path == INT64_MAX) {
+				active[i--] = active[--nactive];
+				continue;
+			}
+			if (s.coord_path < next_min_c)
+				next_min_c = s.coord_path;
 		}
-		/* All the buffers containing min_c may have been invalidated
-		 * so sum may still be zero. But in this case the next[q] which
-		 * contained min_c have been reset to &terminator so we will
-		 * not loop forever. */
+		min_c = next_min_c;
+
+		/* All the buffers containing the coord may have been invalidated
+		 * so sum may still be zero. But in this case they have been
+		 * removed from active[] so we will not loop forever. */
 		if (!sum.incr.playouts) continue;
 
-		assert(min_c > prev_min_c);
-		if (DEBUG_MODE) prev_min_c = min_c;
+		assert(sum.coord_path > prev_min_c);
+		if (DEBUG_MODE) prev_min_c = sum.coord_path;
 
 		/* At this point sum contains only valid increments,
 		 * so we can add it to the hash table. */
@@ -237,6 +273,7 @@ output_stats(incr_stats_t *buf, slave_state_t *sstate,
 		 * just clear the playouts but clearing the entry
 		 * leads to fewer collisions later.) */
 		stats_htable[h].coord_path = 0;
+		sstate->stats_gen.used--;
 		if (DEBUG_MODE) h_counts.occupied--;
 	} 
 	/* The slave expects increments sorted by coord path
@@ -244,13 +281,46 @@ output_stats(incr_stats_t *buf, slave_state_t *sstate,
 	return out_count;
 }
 
+/* Double the hash table size, keeping entries in use.
+ * The slave lock is not held on either entry or exit of this function. */
+static void
+grow_stats_htable(slave_state_t *sstate)
+{
+	int old_bits = sstate->stats_hbits;
+	incr_stats_t *old = sstate->stats_htable;
+	hash_gen_t old_gen = sstate->stats_gen;
+
+	sstate->stats_hbits++;
+	sstate->stats_htable = cmalloc((1 << sstate->stats_hbits) * sizeof(incr_stats_t));
+	hash_gen_init(&sstate->stats_gen, sstate->stats_hbits);
+	for (int i = 0; i < (1 << old_bits); i++) {
+		if (!hash_live(&old_gen, i) || !old[i].coord_path) continue;
+		int h;
+		bool found;
+		find_hash(h, sstate->stats_htable, sstate->stats_hbits, old[i].coord_path,
+			  found, h_counts, &sstate->stats_gen);
+		assert(!found);
+		sstate->stats_htable[h] = old[i];
+		hash_gen_insert(&sstate->stats_gen, h);
+	}
+	free(old);
+	free(old_gen.gen);
+
+	if (DEBUGL(3)) {
+		char b[1024];
+		snprintf(b, sizeof(b), "stats hash table grown to %d bits, %d used\n",
+			 sstate->stats_hbits, sstate->stats_gen.used);
+		logline(&sstate->client, "= ", b);
+	}
+}
+
 /* Get all incremental stats received from other slaves since the
- * last send. Store in buf the stats with largest playout increments.
- * Return the byte size of the resulting buffer. The caller must
- * check that the result is still valid.
+ * last send. Store in buf the stats with largest playout increments
+ * (encoded, see encode.h). Return the byte size of the resulting
+ * buffer. The caller must check that the result is still valid.
  * The slave lock is held on both entry and exit of this function. */
 static int
-get_new_stats(incr_stats_t *buf, slave_state_t *sstate, int cmd_id)
+get_new_stats(unsigned char *buf, slave_state_t *sstate, int cmd_id)
 {
 	/* Process all valid buffers in receive_queue[min..max] */
 	int min = sstate->last_processed + 1;
@@ -260,20 +330,29 @@ get_new_stats(incr_stats_t *buf, slave_state_t *sstate, int cmd_id)
 	sstate->last_processed = max;
 	int last_queue_age = queue_age;
 
-	/* It takes time to clear the hash table and merge the stats
+	/* At most that many new hash table entries. */
+	int incoming = 0;
+	for (int q = min; q <= max; q++)
+		if (receive_queue[q])  incoming += receive_queue[q]->size / sizeof(incr_stats_t);
+	if (incoming > sstate->max_merged_nodes)  incoming = sstate->max_merged_nodes;
+
+	/* It takes time to grow the hash table and merge the stats
 	 * so do this unlocked. */
 	protocol_unlock();
 
 	double start = time_now();
-	double clear_time = 0;
+	double grow_time = 0;
 
 	/* Clear the hash table at a new move; the old paths in
 	 * the hash table are now meaningless. */
 	if (cmd_id != sstate->stats_id) {
-		memset(sstate->stats_htable, 0, 
-		       (1 << sstate->stats_hbits) * sizeof(sstate->stats_htable[0]));
+		hash_gen_clear(&sstate->stats_gen, sstate->stats_hbits);
 		sstate->stats_id = cmd_id;
-		clear_time = time_now() - start;
+	}
+	if (hash_needs_grow(&sstate->stats_gen, sstate->stats_hbits, incoming)) {
+		do grow_stats_htable(sstate);
+		while (hash_needs_grow(&sstate->stats_gen, sstate->stats_hbits, incoming));
+		grow_time = time_now() - start;
 	}
 
 	/* Set the bucket counts and update the hash table stats. */
@@ -288,21 +367,22 @@ get_new_stats(incr_stats_t *buf, slave_state_t *sstate, int cmd_id)
 		for (int q = min; q <= max; q++) missed += !receive_queue[q];
 
 	/* Put the best increments in the output buffer. */
-	int output_nodes = output_stats(buf, sstate, bucket_count, merge_count);
+	int output_nodes = output_stats(sstate->output, sstate, bucket_count, merge_count);
+	int size = incr_stats_encode(sstate->output, output_nodes, buf);
 
 	if (DEBUGVV(3)) {
 		char b[1024];
 		snprintf(b, sizeof(b), "merged %d..%d missed %d %d/%d nodes,"
-			 " output %d/%d nodes in %.3fms (clear %.3fms)\n",
+			 " output %d/%d nodes (%d bytes) in %.3fms (grow %.3fms)\n",
 			 min, max, missed, merge_count, nodes_read, output_nodes,
-			 sstate->max_buf_size / (int)sizeof(*buf),
-			 (time_now() - start)*1000, clear_time*1000);
+			 max_nodes, size,
+			 (time_now() - start)*1000, grow_time*1000);
 		logline(&sstate->client, "= ", b);
 	}
 
 	protocol_lock();
 
-	return output_nodes * sizeof(*buf);
+	return size;
 }
 
 /* Allocate the buffers in the merge specific part of the slave sate,
@@ -311,17 +391,22 @@ static void
 merge_state_alloc(slave_state_t *sstate)
 {
 	sstate->stats_htable = calloc2(1 << sstate->stats_hbits, incr_stats_t);
+	hash_gen_init(&sstate->stats_gen, sstate->stats_hbits);
 	sstate->merged = calloc2(sstate->max_merged_nodes, int);
+	sstate->output = calloc2(max_nodes, incr_stats_t);
 	sstate->max_buf_size -= sizeof(incr_stats_t);
 }
 
-/* Append a terminator value to make merge_new_stats() more
- * efficient. merge_state_alloc() has reserved enough space. */
-static void
+/* Decode stats received from the slave (in place), and append
+ * a terminator value to make merge_new_stats() more efficient.
+ * merge_state_alloc() has reserved enough space. */
+static int
 merge_insert_hook(incr_stats_t *buf, int size)
 {
-	int nodes = size / sizeof(*buf);
+	int nodes = incr_stats_decode((unsigned char *)buf, size, buf, max_nodes);
+	if (nodes < 0)  return -1;
 	buf[nodes].coord_path = INT64_MAX;
+	return nodes * sizeof(*buf);
 }
 
 /* Initiliaze merge-related fields of the default slave state. */
@@ -331,6 +416,7 @@ merge_init(slave_state_t *sstate, int shared_nodes, int stats_hbits, int max_sla
 	/* See merge_state_alloc() for shared_nodes + 1 */
 	sstate->max_buf_size = (shared_nodes + 1) * sizeof(incr_stats_t);
 	sstate->stats_hbits = stats_hbits;
+	max_nodes = shared_nodes;
 
 	sstate->insert_hook = (buffer_hook)merge_insert_hook;
 	sstate->alloc_hook = merge_state_alloc;
@@ -4,6 +4,7 @@
 #include "distributed/protocol.h"
 
 void merge_print_stats(int total_hnodes);
+void merge_print_json(FILE *f, int total_hnodes);
 void merge_init(slave_state_t *sstate, int shared_nodes, int stats_hbits, int max_slaves);
 
 #endif
@@ -56,8 +56,30 @@ int reply_count = 0;
 
 /* All replies to latest gtp command are in gtp_replies[0..reply_count-1]. */
 char **gtp_replies;
+unsigned int *reply_serial;
+root_stats_t **root_replies;
+int *root_replies_count;
 
 
+/* Reply times of each slave thread, to avoid waiting for slow slaves,
+ * and traffic counts since the slave connected (see print_slave_stats()). */
+typedef struct {
+	bool connected;
+	double sent;		/* time current command was sent, 0 if none */
+	double latency;		/* moving average of reply times */
+	long replies, resends;
+	long dropped;		/* commands obsolete before we could send them */
+	long bytes_in, bytes_out;
+	double merge_time;	/* time spent merging stats sent to this slave */
+	int played;		/* games in last genmoves reply */
+	double played_time;	/* and when we got it */
+	double games_per_s;	/* moving average */
+} slave_timing_t;
+
+static slave_timing_t *slave_timing;
+static struct in_addr *slave_clients;
+static int max_slave_threads;
+
 buf_state_t **receive_queue;
 int queue_length = 0;
 int queue_age = 0;
@@ -146,22 +168,34 @@ proxy_thread(void *arg)
  * contains "@size", a binary reply of size bytes follows the
  * empty line. @size is not standard gtp, it is only used
  * internally by Pachi for the genmoves command; it must be the
- * last parameter on the line.
- * *bin_size is the maximum size upon entry, actual size on return.
+ * last parameter on the line. If it is preceded by "#root_size"
+ * the binary reply starts with root_size bytes of root stats
+ * (binary_root option), read into root which must have
+ * ROOT_STATS_MAX_SIZE bytes.
+ * *bin_size is the maximum size upon entry, actual size on return
+ * (without the root stats, their size goes in *root_size).
  * slave_lock is not held on either entry or exit of this function. */
 static int
-get_reply(FILE *f, struct in_addr client, char *reply, void *bin_reply, int *bin_size)
+get_reply(FILE *f, struct in_addr client, char *reply, void *bin_reply, int *bin_size,
+	  root_stats_t *root, int *root_size)
 {
 	double start = time_now();
 
 	int reply_id = -1;
 	*reply = '\0';
+	*root_size = 0;
 	if (!fgets(reply, CMDS_SIZE, f)) return -1;
 
 	/* Check for binary reply. */
 	char *s = strchr(reply, '@');
 	int size = 0;
 	if (s) size = atoi(s+1);
+	char *h = strchr(reply, '#');
+	*root_size = (h && s ? atoi(h+1) : 0);
+	if (*root_size < 0 || *root_size > ROOT_STATS_MAX_SIZE || *root_size > size
+	    || *root_size % sizeof(root_stats_t))
+		return -1;
+	size -= *root_size;
 	assert(size <= *bin_size);
 	*bin_size = size;
 
@@ -180,6 +214,8 @@ get_reply(FILE *f, struct in_addr client, char *reply, void *bin_reply, int *bin
 	if (*line != '\n') return -1;
 
 	/* Read the binary reply if any. */
+	if (*root_size && fread(root, 1, *root_size, f) != (size_t)*root_size)
+		return -1;
 	int len;
 	while (size && (len = fread(bin_reply, 1, size, f)) > 0) {
 		bin_reply = (char *)bin_reply + len;
@@ -200,15 +236,20 @@ get_reply(FILE *f, struct in_addr client, char *reply, void *bin_reply, int *bin
  * If *bin_size > 0, send bin_buf after the gtp command.
  * Return any binary reply in bin_buf and set its size in bin_size.
  * bin_buf is private to the slave and need not be copied.
+ * Binary root stats of the reply go in root, see get_reply().
  * Return the gtp command id, or -1 if error.
  * slave_lock is held on both entry and exit of this function. */
 static int
 send_command(char *to_send, void *bin_buf, int *bin_size,
-	     FILE *f, slave_state_t *sstate, char *buf)
+	     FILE *f, slave_state_t *sstate, char *buf,
+	     root_stats_t *root, int *root_size)
 {
 	assert(to_send && gtp_cmd && bin_buf && bin_size);
 	strncpy(buf, to_send, CMDS_SIZE);
 	bool resend = to_send != gtp_cmd;
+	slave_timing_t *timing = &slave_timing[sstate->thread_id];
+	timing->sent = time_now();
+	int sent_bin_size = *bin_size;
 
 	pthread_mutex_unlock(&slave_lock);
 
@@ -242,9 +283,19 @@ send_command(char *to_send, void *bin_buf, int *bin_size,
 
 	/* Reuse the buffers for the reply. */
 	*bin_size = sstate->max_buf_size;
-	int reply_id = get_reply(f, sstate->client, buf, bin_buf, bin_size);
+	int reply_id = get_reply(f, sstate->client, buf, bin_buf, bin_size, root, root_size);
 
 	pthread_mutex_lock(&slave_lock);
+	/* History resends are slow, don't count them. */
+	if (!resend) {
+		double t = time_now() - timing->sent;
+		timing->latency = (timing->latency ? 0.9 * timing->latency + 0.1 * t : t);
+	}
+	timing->sent = 0;
+	timing->resends += resend;
+	timing->replies += (reply_id != -1);
+	timing->bytes_out += strlen(to_send) + sent_bin_size;
+	timing->bytes_in += strlen(buf) + *root_size + *bin_size;
 	return reply_id;
 }
 
@@ -319,7 +370,8 @@ get_free_buf(slave_state_t *sstate)
 }
 
 /* Insert a buffer in the receive queue. It should be the most
- * recent buffer allocated by the calling thread.
+ * recent buffer allocated by the calling thread. The insert hook
+ * may rewrite the buffer, it returns the new size (< 0 if invalid).
  * slave_lock is held on both entry and exit of this function. */
 static void
 insert_buf(slave_state_t *sstate, void *buf, int size)
@@ -331,7 +383,11 @@ insert_buf(slave_state_t *sstate, void *buf, int size)
 
 	/* Update the buffer if necessary before making it
 	 * available to other threads. */
-	if (sstate->insert_hook) sstate->insert_hook(buf, size);
+	if (sstate->insert_hook) size = sstate->insert_hook(buf, size);
+	if (size < 0) {
+		logline(&sstate->client, "? ", "bad binary reply, ignored\n");
+		return;
+	}
 
 	if (DEBUGVV(7)) {
 		char b[1024];
@@ -346,6 +402,41 @@ insert_buf(slave_state_t *sstate, void *buf, int size)
 	queue_length++;
 }
 
+/* A sub-master (distributed engine running as slave of another master)
+ * handles its own master like one more slave, with its own thread id:
+ * stats received from above get merged in what we send to our slaves,
+ * and stats from our slaves get merged in what we send above.
+ * This state is used only by the main thread. */
+slave_state_t *
+parent_state_alloc(int thread_id)
+{
+	slave_state_t *sstate = malloc2(slave_state_t);
+	*sstate = default_sstate;
+	sstate->thread_id = thread_id;
+	slave_state_alloc(sstate);
+	return sstate;
+}
+
+/* Insert stats received from our master in the receive queue.
+ * slave_lock is held on both entry and exit of this function. */
+void
+parent_insert_stats(slave_state_t *sstate, void *stats, int size)
+{
+	void *buf = get_free_buf(sstate);
+	assert(size <= sstate->max_buf_size);
+	memcpy(buf, stats, size);
+	insert_buf(sstate, buf, size);
+}
+
+/* Save in buf the stats from our slaves to be sent to our master,
+ * buf must have max_buf_size bytes. Return the byte size.
+ * slave_lock is held on both entry and exit of this function. */
+int
+parent_get_stats(slave_state_t *sstate, void *buf)
+{
+	return sstate->args_hook(buf, sstate, atoi(gtp_cmd));
+}
+
 /* Clear the receive queue. The buffer pointers do not have to be cleared
  * here, this is done as each buffer is recycled.
  * slave_lock is held on both entry and exit of this function. */
@@ -362,13 +453,32 @@ clear_receive_queue(void)
 	queue_age++;
 }
 
+/* Update games/s of a slave from its genmoves reply
+ * "=id played playouts threads keep_looking @size".
+ * slave_lock is held on both entry and exit of this function. */
+static void
+update_games_per_s(slave_timing_t *t, char *reply)
+{
+	char *s = strchr(reply, ' ');
+	int played = (s ? atoi(s + 1) : 0);
+	double now = time_now();
+	/* Games only increase within a move. */
+	if (t->played_time && played > t->played) {
+		double rate = (played - t->played) / (now - t->played_time);
+		t->games_per_s = (t->games_per_s ? 0.9 * t->games_per_s + 0.1 * rate : rate);
+	}
+	t->played = played;
+	t->played_time = now;
+}
+
 /* Process the reply received from a slave machine.
- * Copy the ascii part to reply_buf and insert the binary part
- * (if any) in the receive queue.
+ * Copy the ascii part to reply_buf, the root stats to root_buf
+ * and insert the binary part (if any) in the receive queue.
  * Return false if ok, true if the slave is out of sync.
  * slave_lock is held on both entry and exit of this function. */
 static bool
 process_reply(int reply_id, char *reply, char *reply_buf,
+	      root_stats_t *root, int root_size, root_stats_t *root_buf,
 	      void *bin_reply, int bin_size, int *last_reply_id,
 	      int *reply_slot, slave_state_t *sstate)
 {
@@ -392,7 +502,13 @@ process_reply(int reply_id, char *reply, char *reply_buf,
 	strncpy(reply_buf, reply, CMDS_SIZE);
 	if (reply_id != *last_reply_id)
 		*reply_slot = reply_count++;
+	if (strchr(reply, '@'))
+		update_games_per_s(&slave_timing[sstate->thread_id], reply);
 	gtp_replies[*reply_slot] = reply_buf;
+	memcpy(root_buf, root, root_size);
+	root_replies[*reply_slot] = root_buf;
+	root_replies_count[*reply_slot] = root_size / sizeof(root_stats_t);
+	reply_serial[*reply_slot]++;
 
 	if (bin_size) insert_buf(sstate, bin_reply, bin_size);
 
@@ -421,7 +537,9 @@ get_binary_arg(slave_state_t *sstate, char *cmd, int cmd_size, int *bin_size)
 	char *s = strchr(cmd, '@');
 	if (!s || !sstate->args_hook) return buf;
 
+	double start = time_now();
 	int size = sstate->args_hook(buf, sstate, cmd_id);
+	slave_timing[sstate->thread_id].merge_time += time_now() - start;
 
 	/* Check that the command is still valid. */
 	if (atoi(gtp_cmd) != cmd_id) return NULL;
@@ -441,7 +559,8 @@ get_binary_arg(slave_state_t *sstate, char *cmd, int cmd_size, int *bin_size)
  * Returns when the connection with the slave machine is cut.
  * slave_lock is held on both entry and exit of this function. */
 static void
-slave_loop(FILE *f, char *reply_buf, slave_state_t *sstate, bool resend)
+slave_loop(FILE *f, char *reply_buf, root_stats_t *root_buf,
+	   slave_state_t *sstate, bool resend)
 {
 	char *to_send;
 	int last_cmd_count = 0;
@@ -467,19 +586,21 @@ slave_loop(FILE *f, char *reply_buf, slave_state_t *sstate, bool resend)
 					       &bin_size);
 		/* Check that the command is still valid. */
 		resend = true;
-		if (!bin_buf) continue;
+		if (!bin_buf) {  slave_timing[sstate->thread_id].dropped++;  continue;  }
 
 		/* Send the command and get the reply, which always ends with \n\n
 		 * The slave machine sends "=id reply" or "?id reply"
 		 * with id == cmd_id if it is in sync. */
 		last_cmd_count = cmd_count;
 		char buf[CMDS_SIZE];
+		root_stats_t root[BOARD_MAX_COORDS + 1];
+		int root_size;
 		int reply_id = send_command(to_send, bin_buf, &bin_size, f,
-					    sstate, buf);
+					    sstate, buf, root, &root_size);
 		if (reply_id == -1) return;
 
-		resend = process_reply(reply_id, buf, reply_buf, bin_buf, bin_size,
-				       &last_reply_id, &reply_slot, sstate);
+		resend = process_reply(reply_id, buf, reply_buf, root, root_size, root_buf,
+				       bin_buf, bin_size, &last_reply_id, &reply_slot, sstate);
 	}
 }
 
@@ -516,6 +637,7 @@ slave_thread(void *arg)
 
 	assert(sstate.slave_sock >= 0);
 	char reply_buf[CMDS_SIZE];
+	root_stats_t root_buf[BOARD_MAX_COORDS + 1];
 	bool resend = false;
 
 	for (;;) {
@@ -535,10 +657,13 @@ slave_thread(void *arg)
 
 		pthread_mutex_lock(&slave_lock);
 		active_slaves++;
-		slave_loop(f, reply_buf, &sstate, resend);
+		slave_timing[sstate.thread_id] = (slave_timing_t){ .connected = true };
+		slave_clients[sstate.thread_id] = client;
+		slave_loop(f, reply_buf, root_buf, &sstate, resend);
 
 		assert(active_slaves > 0);
 		active_slaves--;
+		slave_timing[sstate.thread_id].connected = false;
 		// Unblock main thread if it was waiting for this slave.
 		pthread_cond_signal(&reply_cond);
 		pthread_mutex_unlock(&slave_lock);
@@ -619,9 +744,81 @@ new_cmd(board_t *b, const char *cmd, char *args)
 	update_cmd(b, cmd, args, true);
 }
 
+/* A slave is slow if its average reply time, or the time it has been
+ * working on the current command, is SLOW_SLAVE_RATIO times above the
+ * median of all slaves (and at least MIN_SLOW_LATENCY seconds).
+ * A machine which is overloaded or has network trouble then doesn't
+ * make everybody wait. */
+#define SLOW_SLAVE_RATIO 4
+#define MIN_SLOW_LATENCY 0.2
+
+static int
+dcmp(const void *p1, const void *p2)
+{
+	double d = *(double *)p1 - *(double *)p2;
+	return (d > 0) - (d < 0);
+}
+
+/* Return the number of slow slaves.
+ * slave_lock is held on entry and on return. */
+static int
+slow_slaves(double now)
+{
+	double latency[max_slave_threads];
+	int n = 0;
+	for (int id = 0; id < max_slave_threads; id++)
+		if (slave_timing[id].connected && slave_timing[id].latency)
+			latency[n++] = slave_timing[id].latency;
+	if (n < 2) return 0;
+
+	qsort(latency, n, sizeof(latency[0]), dcmp);
+	double limit = SLOW_SLAVE_RATIO * latency[n / 2];
+	if (limit < MIN_SLOW_LATENCY)  limit = MIN_SLOW_LATENCY;
+
+	int slow = 0;
+	for (int id = 0; id < max_slave_threads; id++) {
+		slave_timing_t *t = &slave_timing[id];
+		if (!t->connected) continue;
+		double pending = (t->sent ? now - t->sent : 0);
+		slow += (t->latency > limit || pending > limit);
+	}
+	return slow;
+}
+
+/* Print stats of connected slaves to @f as a json array.
+ * slave_lock is held on entry and on return. */
+void
+print_slave_stats(FILE *f)
+{
+	double now = time_now();
+	bool first = true;
+	fprintf(f, "[");
+	for (int id = 0; id < max_slave_threads; id++) {
+		slave_timing_t *t = &slave_timing[id];
+		if (!t->connected) continue;
+		char addr[INET_ADDRSTRLEN];
+#ifdef _WIN32
+		strcpy(addr, inet_ntoa(slave_clients[id]));
+#else
+		inet_ntop(AF_INET, &slave_clients[id], addr, sizeof(addr));
+#endif
+		fprintf(f, "%s\n    { \"id\": %d, \"addr\": \"%s\", \"games_per_s\": %.0f, "
+			"\"latency_ms\": %.2f, \"pending_ms\": %.2f, \"replies\": %ld, "
+			"\"resends\": %ld, \"dropped\": %ld, \"bytes_in\": %ld, "
+			"\"bytes_out\": %ld, \"merge_time\": %.3f }",
+			(first ? "" : ","), id, addr, t->games_per_s,
+			t->latency * 1000, (t->sent ? now - t->sent : 0) * 1000,
+			t->replies, t->resends, t->dropped, t->bytes_in, t->bytes_out,
+			t->merge_time);
+		first = false;
+	}
+	fprintf(f, " ]");
+}
+
 /* Wait for at least one new reply. Return when at least
- * min_replies slaves have already replied, or when the
- * given absolute time is passed.
+ * min_replies slaves have already replied (not counting slow
+ * slaves, see slow_slaves()), or when the given absolute time
+ * is passed.
  * The replies are returned in gtp_replies[0..reply_count-1]
  * slave_lock is held on entry and on return. */
 void
@@ -639,14 +836,16 @@ get_replies(double time_limit, int min_replies)
 		}
 		if (reply_count == 0) continue;
 		if (reply_count >= min_replies || reply_count >= active_slaves) return;
-		if (time_now() >= time_limit) break;
+		double now = time_now();
+		if (reply_count >= active_slaves - slow_slaves(now)) return;
+		if (now >= time_limit) break;
 	}
 	if (DEBUGL(1)) {
 		char buf[1024];
 		snprintf(buf, sizeof(buf),
-			 "get_replies timeout %.3f >= %.3f, replies %d < min %d, active %d\n",
+			 "get_replies timeout %.3f >= %.3f, replies %d < min %d, active %d slow %d\n",
 			 time_now() - start_time, time_limit - start_time,
-			 reply_count, min_replies, active_slaves);
+			 reply_count, min_replies, active_slaves, slow_slaves(time_now()));
 		logline(NULL, "? ", buf);
 	}
 	assert(reply_count > 0);
@@ -664,9 +863,14 @@ protocol_init(char *slave_port, char *proxy_port, int max_slaves)
 {
 	start_time = time_now();
 
-	queue_max_length = max_slaves * MAX_GENMOVES_PER_SLAVE;
+	/* One more for our own master if we are a sub-master. */
+	queue_max_length = (max_slaves + 1) * MAX_GENMOVES_PER_SLAVE;
 	receive_queue = calloc2(queue_max_length, buf_state_t*);
 
+	max_slave_threads = max_slaves;
+	slave_timing = calloc2(max_slaves, slave_timing_t);
+	slave_clients = calloc2(max_slaves, struct in_addr);
+
 	default_sstate.slave_sock = port_listen(slave_port, max_slaves);
 	default_sstate.last_processed = -1;
 
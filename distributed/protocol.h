@@ -21,7 +21,7 @@
 
 typedef struct slave_state slave_state_t;
 
-typedef void (*buffer_hook)(void *buf, int size);
+typedef int (*buffer_hook)(void *buf, int size);
 typedef void (*state_alloc_hook)(struct slave_state *sstate);
 typedef int (*getargs_hook)(void *buf, struct slave_state *sstate, int cmd_id);
 
@@ -58,11 +58,15 @@ struct slave_state {
 	/* Hash table of incremental stats. */
 	incr_stats_t *stats_htable;
 	int stats_hbits;
+	hash_gen_t stats_gen;
 	int stats_id;
 
 	/* Hash indices updated by stats merge. */
 	int *merged;
 	int max_merged_nodes;
+
+	/* Stats to be sent, before encoding. */
+	incr_stats_t *output;
 };
 extern slave_state_t default_sstate;
 
@@ -75,10 +79,21 @@ void clear_receive_queue(void);
 void update_cmd(board_t *b, const char *cmd, char *args, bool new_id);
 void new_cmd(board_t *b, const char *cmd, char *args);
 void get_replies(double time_limit, int min_replies);
+void print_slave_stats(FILE *f);
+
+slave_state_t *parent_state_alloc(int thread_id);
+void parent_insert_stats(slave_state_t *sstate, void *stats, int size);
+int parent_get_stats(slave_state_t *sstate, void *buf);
 void protocol_init(char *slave_port, char *proxy_port, int max_slaves);
 
 extern int reply_count;
 extern char **gtp_replies;
+/* Incremented each time gtp_replies[slot] gets a new reply. */
+extern unsigned int *reply_serial;
+/* Binary root stats of each reply, root_replies_count[slot] is
+ * 0 for text replies (see root_stats_t). */
+extern root_stats_t **root_replies;
+extern int *root_replies_count;
 extern int active_slaves;
 
 /* All binary buffers received from all slaves in current move are in
@@ -43,6 +43,7 @@ typedef bool (*engine_setoption_t)(engine_t *e, board_t *b, const char *optname,
 typedef enum parse_code (*engine_notify_t)(engine_t *e, board_t *b, int id, char *cmd, char *args, gtp_t *gtp);
 typedef void (*engine_board_print_t)(engine_t *e, board_t *b, FILE *f);
 typedef char *(*engine_notify_play_t)(engine_t *e, board_t *b, move_t *m, char *enginearg, bool *print_board);
+typedef bool (*engine_undo_t)(engine_t *e, board_t *b);
 typedef char *(*engine_chat_t)(engine_t *e, board_t *b, bool in_game, char *from, char *cmd);
 typedef coord_t (*engine_genmove_t)(engine_t *e, board_t *b, time_info_t *ti, enum stone color, bool pass_all_alive);
 typedef char *(*engine_genmoves_t)(engine_t *e, board_t *b, time_info_t *ti, enum stone color,
@@ -78,6 +79,9 @@ struct engine {
 	engine_notify_t          notify;
 	engine_board_print_t     board_print;
 	engine_notify_play_t     notify_play;
+	engine_undo_t            undo;		    /* Last move was undone, @b: position after undo.
+						     * Return false if engine can't follow, it gets reset
+						     * and game replayed then. */
 	engine_chat_t            chat;
 
 	engine_genmove_t         genmove;           /* Generate a move. If pass_all_alive is true, <pass> shall be generated only */
@@ -86,7 +90,8 @@ struct engine {
 	engine_genmoves_t        genmoves;	    /* Used by distributed engine */
 	engine_best_moves_t      best_moves;	    /* List best moves for current position.
 						     * Call engine_best_move() for data to be initialized correctly. */
-	engine_analyze_t         analyze;	    /* Tell engine to start pondering for the sake of frontend running Pachi. */
+	engine_analyze_t         analyze;	    /* Tell engine to start pondering for the sake of frontend running Pachi.
+						     * @start: 1 start, 0 stop, -1 stop output but keep searching. */
 
 	engine_evaluate_t        evaluate;	    /* Evaluate feasibility of player @color playing at all free moves. Will
 						     * simulate each move from b->f[i] for time @ti, then set
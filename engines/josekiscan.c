@@ -16,8 +16,9 @@ typedef struct {
 	int debug_level;
 	
 	board_t *b[16]; // boards with reversed color, mirrored and rotated
-	josekipat_t *prev[16];
+	uint32_t prev[16];
 	int next_flags;
+	joseki_dict_t *jd;  // dictionary we're filling, global one if NULL
 } josekiscan_t;
 
 #define board_captures(b)  (b->captures[S_BLACK] + b->captures[S_WHITE])
@@ -27,10 +28,11 @@ static char *
 josekiscan_play(engine_t *e, board_t *board, move_t *m, char *move_tags, bool *board_print)
 {
 	josekiscan_t *j = (josekiscan_t*)e->data;
+	joseki_dict_t *jd = (j->jd ? j->jd : joseki_dict);
 
 	if (!board->moves) {
 		/* New game, reset state. */
-		assert(board_rsize(board) == joseki_dict->bsize);
+		assert(board_rsize(board) == jd->bsize);
 		
 		for (int i = 0; i < 16; i++) {
 			board_resize(j->b[i], board_rsize(board));
@@ -78,8 +80,8 @@ josekiscan_play(engine_t *e, board_t *board, move_t *m, char *move_tags, bool *b
 		if (i & 8) color = stone_other(color);
 
 		/* add new pattern */
-		if (setup_stones)  j->prev[i] = NULL;
-		else               j->prev[i] = joseki_add(joseki_dict, b, coord, color, j->prev[i], flags);
+		if (setup_stones)  j->prev[i] = 0;
+		else               j->prev[i] = joseki_add(jd, b, coord, color, j->prev[i], flags);
 
 		int captures = board_captures(b);
 		move_t m2 = move(coord, color);
@@ -87,7 +89,7 @@ josekiscan_play(engine_t *e, board_t *board, move_t *m, char *move_tags, bool *b
 
 		/* update prev pattern if stones were captured, board configuration changed ! */
 		if (board_captures(b) != captures && !setup_stones)
-			j->prev[i] = joseki_add(joseki_dict, b, coord, color, NULL, flags);
+			j->prev[i] = joseki_add(jd, b, coord, color, 0, flags);
 	}
 
 	return NULL;
@@ -100,13 +102,15 @@ josekiscan_genmove(engine_t *e, board_t *b, time_info_t *ti, enum stone color, b
 }
 
 static josekiscan_t *
-josekiscan_state_init(engine_t *e)
+josekiscan_state_init(engine_t *e, board_t *b)
 {
 	options_t *options = &e->options;
 	josekiscan_t *j = calloc2(1, josekiscan_t);
 
+	/* Same size as @b if we have it: board statics don't change then,
+	 * parallel loading relies on it. */
 	for (int i = 0; i < 16; i++)
-		j->b[i] = board_new(19, NULL);
+		j->b[i] = board_new((b ? board_rsize(b) : 19), NULL);
 
 	j->debug_level = 1;
 
@@ -136,10 +140,17 @@ josekiscan_done(engine_t *e)
 		board_delete(&j->b[i]);
 }
 
+void
+josekiscan_set_dict(engine_t *e, joseki_dict_t *jd)
+{
+	josekiscan_t *j = (josekiscan_t*)e->data;
+	j->jd = jd;
+}
+
 void
 josekiscan_engine_init(engine_t *e, board_t *b)
 {
-	josekiscan_t *j = josekiscan_state_init(e);
+	josekiscan_t *j = josekiscan_state_init(e, b);
 	e->name = "Josekiscan";
 	e->comment = "You cannot play Pachi with this engine, it is intended for special development use - scanning of joseki sequences fed to it within the GTP stream.";
 	e->genmove = josekiscan_genmove;
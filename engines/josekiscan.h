@@ -2,7 +2,11 @@
 #define PACHI_ENGINE_JOSEKISCAN_H
 
 #include "engine.h"
+#include "../joseki.h"
 
 void josekiscan_engine_init(engine_t *e, board_t *b);
 
+/* Record patterns into @jd instead of global joseki_dict. */
+void josekiscan_set_dict(engine_t *e, joseki_dict_t *jd);
+
 #endif
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,8 +11,10 @@
 #include "../joseki.h"
 #include "playout/moggy.h"
 #include "playout/light.h"
+#include "playout/pattern.h"
 #include "engines/montecarlo.h"
 #include "playout.h"
+#include "random.h"
 #include "timeinfo.h"
 
 
@@ -28,6 +31,7 @@
  * games=MC_GAMES		number of random games to play
  * gamelen=MC_GAMELEN		maximal length of played random game
  * playout={light,moggy}[:playout_params]
+ * threads=THREADS		number of threads playing games (default: number of cores)
  */
 
 
@@ -43,15 +47,38 @@ typedef struct {
 	int gamelen;
 	floating_t resign_ratio;
 	int loss_threshold;
+	int threads;
 	playout_policy_t *playout;
 } montecarlo_t;
 
-/* Per-move playout statistics. */
+/* Per-move playout statistics.
+ * Shared by all threads, updated with atomic adds. */
 typedef struct {
 	int games;
 	int wins;
 } move_stat_t;
 
+/* Search state shared by all threads: games get claimed one at a time
+ * from @played, there's no other synchronization. */
+typedef struct {
+	montecarlo_t *mc;
+	board_t *b;
+	enum stone color;
+	int games;		/* Games to play */
+	move_stat_t *moves;	/* [0] is pass */
+	int played;		/* Games claimed so far */
+	int superko, good_games, losses;
+	bool superko_loop;
+	volatile bool stop;
+	unsigned long seed;
+} mc_search_t;
+
+typedef struct {
+	mc_search_t *s;
+	int tid;
+	pthread_t thread;
+} mc_worker_t;
+
 
 /* FIXME: Cutoff rule for simulations. Currently we are so fast that this
  * simply does not matter; even 100000 simulations are fast enough to
@@ -95,40 +122,19 @@ board_stats_print(board_t *board, move_stat_t *moves, FILE *f)
 }
 
 
-static coord_t
-montecarlo_genmove(engine_t *e, board_t *b, time_info_t *ti, enum stone color, bool pass_all_alive)
+static void
+montecarlo_playouts(mc_search_t *s)
 {
-	montecarlo_t *mc = (montecarlo_t*)e->data;
-
-	if (ti->dim == TD_WALLTIME) {
-		fprintf(stderr, "Warning: TD_WALLTIME time mode not supported, resetting to defaults.\n");
-		ti->type = TT_NULL;
-	}
-	if (ti->type == TT_NULL) {
-		ti->type = TT_MOVE;
-		ti->dim = TD_GAMES;
-		ti->games = MC_GAMES;
-		ti->games_max = 0;
-	}
-	time_stop_t stop;
-	time_stop_conditions(ti, b, 20, 40, 3.0, &stop);
-
-	/* resign when the hope for win vanishes */
-	coord_t top_coord = resign;
-	floating_t top_ratio = mc->resign_ratio;
-
-	/* We use [0] for pass. Normally, this is an inaccessible corner
-	 * of board margin. */
-	move_stat_t moves[board_max_coords(b)];
-	memset(moves, 0, sizeof(moves));
+	montecarlo_t *mc = s->mc;
+	enum stone color = s->color;
 
-	int losses = 0;
-	int i, superko = 0, good_games = 0;
-	for (i = 0; i < stop.desired.playouts; i++) {
-		assert(!b->superko_violation);
+	while (!s->stop) {
+		int i = __sync_fetch_and_add(&s->played, 1);
+		if (i >= s->games)  break;
+		assert(!s->b->superko_violation);
 
 		board_t b2;
-		board_copy(&b2, b);
+		board_copy(&b2, s->b);
 
 		coord_t coord;
 		board_play_random(&b2, color, &coord, NULL, NULL);
@@ -138,8 +144,9 @@ montecarlo_genmove(engine_t *e, board_t *b, time_info_t *ti, enum stone color, b
 			 * unfortunately still consider this in playouts.) */
 			if (DEBUGL(4)) {
 				fprintf(stderr, "SUICIDE DETECTED at %d,%d:\n", coord_x(coord), coord_y(coord));
-				board_print(b, stderr);
+				board_print(s->b, stderr);
 			}
+			board_done(&b2);
 			continue;
 		}
 
@@ -154,16 +161,15 @@ montecarlo_genmove(engine_t *e, board_t *b, time_info_t *ti, enum stone color, b
 		if (result == 0) {
 			/* Superko. We just ignore this playout.
 			 * And play again. */
-			if (unlikely(superko > 2 * stop.desired.playouts)) {
+			if (unlikely(__sync_fetch_and_add(&s->superko, 1) > 2 * s->games)) {
 				/* Uhh. Triple ko, or something? */
-				if (MCDEBUGL(0))
-					fprintf(stderr, "SUPERKO LOOP. I will pass. Did we hit triple ko?\n");
-				goto pass_wins;
+				s->superko_loop = s->stop = true;
+				break;
 			}
 			/* This playout didn't count; we should not
 			 * disadvantage moves that lead to a superko.
 			 * And it is supposed to be rare. */
-			i--, superko++;
+			__sync_fetch_and_sub(&s->played, 1);
 			continue;
 		}
 
@@ -172,20 +178,89 @@ montecarlo_genmove(engine_t *e, board_t *b, time_info_t *ti, enum stone color, b
 
 		int pos = is_pass(coord) ? 0 : coord;
 
-		good_games++;
-		moves[pos].games++;
+		__sync_fetch_and_add(&s->good_games, 1);
+		__sync_fetch_and_add(&s->moves[pos].games, 1);
 
-		losses += result > 0;
-		moves[pos].wins += 1 - (result > 0);
+		if (result > 0)  __sync_fetch_and_add(&s->losses, 1);
+		else             __sync_fetch_and_add(&s->moves[pos].wins, 1);
 
-		if (unlikely(!losses && i == mc->loss_threshold)) {
+		if (unlikely(!s->losses && i == mc->loss_threshold)) {
 			/* We played out many games and didn't lose once yet.
 			 * This game is over. */
-			break;
+			s->stop = true;
 		}
 	}
+}
+
+static void *
+montecarlo_worker(void *data)
+{
+	mc_worker_t *w = (mc_worker_t*)data;
+	fast_srandom_stream(w->s->seed, w->tid);
+	montecarlo_playouts(w->s);
+	return NULL;
+}
+
+/* Play games in mc->threads threads, single-threaded runs
+ * in the calling thread (same random sequence as before). */
+static void
+montecarlo_search(mc_search_t *s)
+{
+	int threads = s->mc->threads;
+	if (threads <= 1) {
+		montecarlo_playouts(s);
+		return;
+	}
+
+	s->seed = fast_random64();
+	mc_worker_t workers[threads];
+	for (int i = 0; i < threads; i++) {
+		workers[i] = (mc_worker_t) { s, i };
+		pthread_create(&workers[i].thread, NULL, montecarlo_worker, &workers[i]);
+	}
+	for (int i = 0; i < threads; i++)
+		pthread_join(workers[i].thread, NULL);
+}
+
+static coord_t
+montecarlo_genmove(engine_t *e, board_t *b, time_info_t *ti, enum stone color, bool pass_all_alive)
+{
+	montecarlo_t *mc = (montecarlo_t*)e->data;
+
+	if (ti->dim == TD_WALLTIME) {
+		fprintf(stderr, "Warning: TD_WALLTIME time mode not supported, resetting to defaults.\n");
+		ti->type = TT_NULL;
+	}
+	if (ti->type == TT_NULL) {
+		ti->type = TT_MOVE;
+		ti->dim = TD_GAMES;
+		ti->games = MC_GAMES;
+		ti->games_max = 0;
+	}
+	time_stop_t stop;
+	time_stop_conditions(ti, b, 20, 40, 3.0, &stop);
+
+	/* resign when the hope for win vanishes */
+	coord_t top_coord = resign;
+	floating_t top_ratio = mc->resign_ratio;
+
+	/* We use [0] for pass. Normally, this is an inaccessible corner
+	 * of board margin. */
+	move_stat_t moves[board_max_coords(b)];
+	memset(moves, 0, sizeof(moves));
+
+	mc_search_t s = { mc, b, color, stop.desired.playouts, moves, };
+	montecarlo_search(&s);
+	int i = (s.played < s.games ? s.played : s.games);
+	int superko = s.superko;
+
+	if (s.superko_loop) {
+		if (MCDEBUGL(0))
+			fprintf(stderr, "SUPERKO LOOP. I will pass. Did we hit triple ko?\n");
+		goto pass_wins;
+	}
 
-	if (!good_games) {
+	if (!s.good_games) {
 		/* No moves to try??? */
 		if (MCDEBUGL(0)) {
 			fprintf(stderr, "OUT OF MOVES! I will pass. But how did this happen?\n");
@@ -250,6 +325,13 @@ montecarlo_setoption(engine_t *e, board_t *b, const char *optname, char *optval,
 	else if (!strcasecmp(optname, "gamelen") && optval) {
 		mc->gamelen = atoi(optval);
 	}
+	else if (!strcasecmp(optname, "threads") && optval) {
+		/* Play games in that many threads, each with
+		 * its own board. Default: 1 thread per core. */
+		mc->threads = atoi(optval);
+		if (mc->threads < 1)
+			option_error("MonteCarlo: Invalid threads value %s\n", optval);
+	}
 	else if (!strcasecmp(optname, "playout") && optval) {  NEED_RESET
 		char *playoutarg = strchr(optval, ':');
 		if (playoutarg)
@@ -258,6 +340,8 @@ montecarlo_setoption(engine_t *e, board_t *b, const char *optname, char *optval,
 			mc->playout = playout_moggy_init(playoutarg, b);
 		else if (!strcasecmp(optval, "light"))
 			mc->playout = playout_light_init(playoutarg, b);
+		else if (!strcasecmp(optval, "pattern"))
+			mc->playout = playout_pattern_init(playoutarg, b);
 		else
 			option_error("MonteCarlo: Invalid playout policy %s\n", optval);
 	}
@@ -276,6 +360,7 @@ montecarlo_state_init(engine_t *e, board_t *b)
 
 	mc->debug_level = 1;
 	mc->gamelen = MC_GAMELEN;
+	mc->threads = get_default_threads();
 	joseki_load(board_rsize(b));
 
 	/* Process engine options. */
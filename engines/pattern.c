@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -13,12 +14,27 @@
 #include "random.h"
 
 
+/* Low latency mode: moves below this (relative to best) may get approximate
+ * ratings, expensive readers are skipped for them. */
+#define LOW_LATENCY_MIN_PROB	0.01
+/* Low latency mode default for mcowner_cache. */
+#define LOW_LATENCY_MCOWNER_CACHE  4
+
 /* Internal engine state. */
 typedef struct {
 	int debug_level;
 	pattern_config_t pc;
+	bool mcowner;		/* Ownermap playouts, unknown ownermap otherwise */
 	bool mcowner_fast;
+	int  mcowner_cache;	/* Reuse ownermap for that many moves, -1: not set */
+	bool low_latency;
+	int  top_k;		/* Sample among top k moves, 1: best move */
+	floating_t temperature;
 	int  matched_locally;
+
+	ownermap_t ownermap;	/* Last ownermap and move number it's for */
+	int  ownermap_moves;	/* -1 if none */
+	int  ownermap_size;
 } pattern_engine_t;
 
 pattern_config_t*
@@ -36,20 +52,83 @@ pattern_engine_matched_locally(engine_t *e)
 	return pp->matched_locally;
 }
 
+/* Ownermap for mcowner feature: fresh one, the one from a few moves
+ * ago (mcowner_cache) or unknown ownermap if playouts are disabled.
+ * Without playouts atari / cut / net features see owners as unknown too. */
+static ownermap_t *
+pattern_engine_ownermap(pattern_engine_t *pp, board_t *b, enum stone color)
+{
+	ownermap_t *o = &pp->ownermap;
+	if (!pp->mcowner) {
+		if (pp->ownermap_moves < 0) {
+			ownermap_init(o);
+			o->playouts = GJ_MINGAMES;
+			pp->ownermap_moves = 0;
+		}
+		return o;
+	}
+
+	int age = b->moves - pp->ownermap_moves;
+	if (pp->mcowner_cache && pp->ownermap_moves >= 0 && pp->ownermap_size == board_rsize(b) &&
+	    age >= 0 && age <= pp->mcowner_cache)
+		return o;
+
+	if (pp->mcowner_fast)  mcowner_playouts_fast(b, color, o);
+	else                   mcowner_playouts(b, color, o);
+	pp->ownermap_moves = b->moves;
+	pp->ownermap_size = board_rsize(b);
+	return o;
+}
+
+/* Move to play from pattern ratings: best one, or with top_k sampled
+ * among the k best with probability proportional to prob^(1/temperature). */
+static coord_t
+pattern_engine_pick(pattern_engine_t *pp, board_t *b, floating_t *probs)
+{
+	int k = pp->top_k;
+	coord_t best_c[k];
+	float best_r[k];
+	get_pattern_best_moves(b, probs, best_c, best_r, k);
+	if (k == 1 || is_pass(best_c[0]))
+		return best_c[0];
+
+	floating_t w[k], total = 0;
+	for (int i = 0; i < k; i++) {
+		w[i] = (is_pass(best_c[i]) ? 0 : pow(best_r[i], 1 / pp->temperature));
+		total += w[i];
+	}
+	floating_t r = fast_frandom() * total;
+	for (int i = 0; i < k; i++) {
+		if (r < w[i])  return best_c[i];
+		r -= w[i];
+	}
+	return best_c[0];
+}
+
+/* Low latency genmove: no pattern saved, no best moves printed,
+ * expensive readers skipped for bad moves. */
+static coord_t
+pattern_engine_genmove_fast(pattern_engine_t *pp, board_t *b, enum stone color)
+{
+	floating_t probs[b->flen];
+	ownermap_t *ownermap = pattern_engine_ownermap(pp, b, color);
+	pp->matched_locally = -1;  // Invalidate
+	pattern_rate_moves_fast(&pp->pc, b, color, probs, ownermap, LOW_LATENCY_MIN_PROB, NULL);
+	return pattern_engine_pick(pp, b, probs);
+}
+
 static void
 debug_pattern_best_moves(pattern_engine_t *pp, board_t *b, enum stone color,
 			 coord_t *best_c, int nbest)
 {
-	ownermap_t ownermap;
-	if (pp->mcowner_fast)  mcowner_playouts_fast(b, color, &ownermap);
-	else                   mcowner_playouts(b, color, &ownermap);
-	bool locally = pattern_matching_locally(&pp->pc, b, color, &ownermap);
+	ownermap_t *ownermap = pattern_engine_ownermap(pp, b, color);
+	bool locally = pattern_matching_locally(&pp->pc, b, color, ownermap);
 	
 	fprintf(stderr, "\n");
 	for (int i = 0; i < nbest; i++) {
 		move_t m = move(best_c[i], color);
 		pattern_t p;
-		pattern_match(&pp->pc, &p, b, &m, &ownermap, locally);
+		pattern_match(&pp->pc, &p, b, &m, ownermap, locally);
 
 		strbuf(buf, 512);
 		dump_gammas(buf, &pp->pc, &p);
@@ -63,14 +142,14 @@ static coord_t
 pattern_engine_genmove(engine_t *e, board_t *b, time_info_t *ti, enum stone color, bool pass_all_alive)
 {
 	pattern_engine_t *pp = (pattern_engine_t*)e->data;
+	if (pp->low_latency)
+		return pattern_engine_genmove_fast(pp, b, color);
 
 	pattern_t pats[b->flen];
 	floating_t probs[b->flen];
-	ownermap_t ownermap;
-	if (pp->mcowner_fast)  mcowner_playouts_fast(b, color, &ownermap);
-	else		       mcowner_playouts(b, color, &ownermap);
+	ownermap_t *ownermap = pattern_engine_ownermap(pp, b, color);
 	pp->matched_locally = -1;  // Invalidate
-	pattern_rate_moves(&pp->pc, b, color, pats, probs, &ownermap);
+	pattern_rate_moves(&pp->pc, b, color, pats, probs, ownermap);
 
 	float best_r[20];
 	coord_t best_c[20];
@@ -89,6 +168,8 @@ pattern_engine_genmove(engine_t *e, board_t *b, time_info_t *ti, enum stone colo
 			best = f;
 	}
 
+	if (pp->top_k > 1)
+		return pattern_engine_pick(pp, b, probs);
 	return b->f[best];
 }
 
@@ -99,11 +180,9 @@ pattern_engine_best_moves(engine_t *e, board_t *b, time_info_t *ti, enum stone c
 	pattern_engine_t *pp = (pattern_engine_t*)e->data;
 
 	floating_t probs[b->flen];
-	ownermap_t ownermap;
-	if (pp->mcowner_fast)  mcowner_playouts_fast(b, color, &ownermap);
-	else		       mcowner_playouts(b, color, &ownermap);
-	pp->matched_locally = pattern_matching_locally(&pp->pc, b, color, &ownermap);
-	pattern_rate_moves_fast(&pp->pc, b, color, probs, &ownermap);
+	ownermap_t *ownermap = pattern_engine_ownermap(pp, b, color);
+	pp->matched_locally = pattern_matching_locally(&pp->pc, b, color, ownermap);
+	pattern_rate_moves_fast(&pp->pc, b, color, probs, ownermap, 0, NULL);
 
 	get_pattern_best_moves(b, probs, best_c, best_r, nbest);
 	print_pattern_best_moves(b, best_c, best_r, nbest);
@@ -115,11 +194,9 @@ pattern_engine_evaluate(engine_t *e, board_t *b, time_info_t *ti, floating_t *va
 	pattern_engine_t *pp = (pattern_engine_t*)e->data;
 
 	pattern_t pats[b->flen];
-	ownermap_t ownermap;
-	if (pp->mcowner_fast)  mcowner_playouts_fast(b, color, &ownermap);
-	else                   mcowner_playouts(b, color, &ownermap);
+	ownermap_t *ownermap = pattern_engine_ownermap(pp, b, color);
 	pp->matched_locally = -1;  // Invalidate
-	pattern_rate_moves(&pp->pc, b, color, pats, vals, &ownermap);
+	pattern_rate_moves(&pp->pc, b, color, pats, vals, ownermap);
 
 #if 0
 	// unused variable 'total' in above call to pattern_rate_moves()
@@ -160,6 +237,41 @@ pattern_engine_setoption(engine_t *e, board_t *b, const char *optname, char *opt
 		 * See also MM_MINGAMES. */
 		pp->mcowner_fast = atoi(optval);
 	}
+	else if (!strcasecmp(optname, "mcowner") && optval) {
+		/* mcowner=0: No ownermap playouts at all, mcowner feature
+		 * (and atari / cut / net ownermap checks) see all points as
+		 * unknown. Fastest, weakest. Default: mcowner=1 */
+		pp->mcowner = atoi(optval);
+	}
+	else if (!strcasecmp(optname, "mcowner_cache") && optval) {
+		/* Reuse ownermap for that many moves after it's computed
+		 * instead of running playouts every move. Ownermap doesn't
+		 * change much from one move to the next.
+		 * Default: 0 (low_latency: 4) */
+		pp->mcowner_cache = atoi(optval);
+		if (pp->mcowner_cache < 0)
+			option_error("pattern: Invalid mcowner_cache value %s\n", optval);
+	}
+	else if (!strcasecmp(optname, "low_latency")) {
+		/* Low latency genmove for bulk bot play: pattern readers
+		 * skipped for bad moves, no best moves printed, ownermap
+		 * reused a few moves (see mcowner_cache). */
+		pp->low_latency = (!optval || atoi(optval));
+	}
+	else if (!strcasecmp(optname, "top_k") && optval) {
+		/* Play one of the k best moves, picked with probability
+		 * proportional to prob^(1/temperature). Default: 1 (best move) */
+		pp->top_k = atoi(optval);
+		if (pp->top_k < 1 || pp->top_k > 20)
+			option_error("pattern: Invalid top_k value %s\n", optval);
+	}
+	else if (!strcasecmp(optname, "temperature") && optval) {
+		/* top_k sampling temperature: higher plays more varied
+		 * moves, lower sticks to the best one. Default: 1.0 */
+		pp->temperature = atof(optval);
+		if (pp->temperature <= 0)
+			option_error("pattern: Invalid temperature value %s\n", optval);
+	}
 	else if (!strcasecmp(optname, "patterns") && optval) {  NEED_RESET
 		patterns_init(&pp->pc, optval, false, true);
 	}
@@ -180,7 +292,12 @@ pattern_engine_state_init(engine_t *e, board_t *b)
 
 	pp->debug_level = debug_level;
 	pp->matched_locally = -1;  /* Invalid */
+	pp->mcowner = true;
 	pp->mcowner_fast = true;
+	pp->mcowner_cache = -1;
+	pp->top_k = 1;
+	pp->temperature = 1.0;
+	pp->ownermap_moves = -1;
 
 	/* Process engine options. */
 	for (int i = 0; i < options->n; i++) {
@@ -193,6 +310,8 @@ pattern_engine_state_init(engine_t *e, board_t *b)
 
 	if (!pat_setup)
 		patterns_init(&pp->pc, NULL, false, true);
+	if (pp->mcowner_cache < 0)
+		pp->mcowner_cache = (pp->low_latency ? LOW_LATENCY_MCOWNER_CACHE : 0);
 	
 	if (!using_patterns())
 		die("Missing spatial dictionary / probtable, aborting.\n");
@@ -1,6 +1,10 @@
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "board.h"
 #include "debug.h"
@@ -20,10 +24,43 @@
  * - gen_spat_dict=0: generate output for mm tool
  *       each move is pattern matched into team of features which can be fed
  *       into mm tool to compute gammas.
- */
+ *
+ * With threads=N moves are queued and scanned by N worker threads, each
+ * with its own board copy. Output goes to a file then (output=FILE).
+ * In gen_spat_dict mode each worker has its own dictionary and counts,
+ * merged into the main dictionary when done.
+ *
+ * mm output is text by default, with binary option compact binary records
+ * are written instead (mm tool reads both):
+ *   header   same as text, except first line is "!B <gammas> <width>"
+ *   records  uint16 nteams, then nteams teams, first one is the winner.
+ *   team     uint8 n, then n gamma numbers of <width> bytes.
+ * Host byte order. */
 
-/* Internal engine state. */
+typedef struct patternscan patternscan_t;
+
+/* Scanning thread state. */
+typedef struct {
+	patternscan_t *ps;
+	int tid;
+	pthread_t thread;
+	strbuf_t buf;
+	int teams;			/* Teams in current record (binary output) */
+
+	/* gen_spat_dict: spatials found and their counts. */
+	spatial_dict_t *dict;
+	unsigned int nscounts;
+	int *scounts;
+} patternscan_worker_t;
+
+/* Move waiting to be scanned. */
 typedef struct {
+	board_t b;
+	move_t m;
+} patternscan_job_t;
+
+/* Internal engine state. */
+struct patternscan {
 	int debug_level;
 
 	pattern_config_t pc;
@@ -38,14 +75,34 @@ typedef struct {
 
 	unsigned int feature2mm[FEAT_MAX];  /* gamma number feature starts from */
 	unsigned int *spatial2mm;	    /* 0-based spatial index by dist for each spatial */
-	strbuf_t buf;
+
+	/* Output */
+	char *output;			/* Write records there instead of gtp replies */
+	FILE *out;
+	bool binary;
+	int gamma_width;		/* Bytes per gamma number in binary records */
+	pthread_mutex_t out_mutex;
+
+	/* Workers, workers[0] scans in main thread if threads=0 */
+	int threads;
+	patternscan_worker_t *workers;
+	unsigned long seed;
+
+	/* Pending moves (threads) */
+	patternscan_job_t *jobs;
+	int max_jobs, first_job, pending, busy;
+	bool quit;
+	pthread_mutex_t mutex;
+	pthread_cond_t more;		/* new job */
+	pthread_cond_t room;		/* job taken */
+	pthread_cond_t idle;		/* all done */
 
 	/* Book-keeping of spatial occurence count. */
 	int gameno;
 	unsigned int nscounts;
 	int *scounts;
 	//int *sgameno;
-} patternscan_t;
+};
 
 /* Visualize spatials ? */
 //#define DEBUG_GENSPATIAL 1
@@ -60,8 +117,8 @@ typedef struct {
 static patternscan_t *global_ps = 0;
 static feature_info_t *features = pattern_features;
 
-static void
-mm_print_feature(patternscan_t *ps, strbuf_t *buf, feature_t *f)
+static int
+mm_number(patternscan_t *ps, feature_t *f)
 {
 	int mm_number = ps->feature2mm[f->id];
 	assert(f->id >= 0 && f->id < FEAT_MAX);
@@ -71,23 +128,48 @@ mm_print_feature(patternscan_t *ps, strbuf_t *buf, feature_t *f)
 		spatial_t *s = &spat_dict->spatials[f->payload];
 		int spatial_id = s - spat_dict->spatials;
 		assert(s->dist == features[f->id].spatial);
-		mm_number += ps->spatial2mm[spatial_id];
-		sbprintf(buf, "%i", mm_number);
-#ifdef DEBUG_MM
-		sbprintf(buf, "(%s:%i=%i)", features[f->id].name, mm_number, f->payload);
-#endif
-		return;
+		return mm_number + ps->spatial2mm[spatial_id];
 	}
 
 	/* Regular feature */	
 	assert(f->payload < feature_payloads(f->id));  /* Sanity check, payloads are 0-based */
-	mm_number += f->payload;
-	sbprintf(buf, "%i", mm_number);
+	return mm_number + f->payload;
+}
+
+static void
+mm_print_feature(patternscan_t *ps, strbuf_t *buf, feature_t *f)
+{
+	sbprintf(buf, "%i", mm_number(ps, f));
 #ifdef DEBUG_MM
-	sbprintf(buf, "(%s:%i)", features[f->id].name, f->payload);
+	if (f->id >= FEAT_SPATIAL)
+		sbprintf(buf, "(%s:%i=%i)", features[f->id].name, mm_number(ps, f), f->payload);
+	else
+		sbprintf(buf, "(%s:%i)", features[f->id].name, f->payload);
 #endif
 }
 
+static void
+sbwrite(strbuf_t *buf, void *data, int len)
+{
+	if (buf->remaining < len)  die("patternscan: buffer overflow\n");
+	memcpy(buf->cur, data, len);
+	buf->cur += len;
+	buf->remaining -= len;
+}
+
+static void
+mm_write_pattern(patternscan_t *ps, strbuf_t *buf, pattern_t *p)
+{
+	uint8_t n = p->n;
+	sbwrite(buf, &n, 1);
+	for (int i = 0; i < p->n; i++) {
+		uint32_t number = mm_number(ps, &p->f[i]);
+		uint16_t number16 = number;
+		if (ps->gamma_width == 2)  sbwrite(buf, &number16, 2);
+		else			   sbwrite(buf, &number, 4);
+	}
+}
+
 static void
 mm_print_pattern(patternscan_t *ps, strbuf_t *buf, pattern_t *p)
 {
@@ -105,19 +187,20 @@ mm_gammas(patternscan_t *ps)
 }
 
 static void
-mm_header(patternscan_t *ps)
+mm_header(patternscan_t *ps, FILE *f)
 {
 	/* Number of gammas */
-	printf("! %i\n", mm_gammas(ps));
+	if (ps->binary)  fprintf(f, "!B %i %i\n", mm_gammas(ps), ps->gamma_width);
+	else		 fprintf(f, "! %i\n", mm_gammas(ps));
 
 	/* Number of features */
-	printf("%i\n", FEAT_MAX);
+	fprintf(f, "%i\n", FEAT_MAX);
 
 	/* Number of gammas for each feature */
 	for (int i = 0; i < FEAT_MAX; i++)
-		printf("%i %s\n", feature_payloads(i), features[i].name);
+		fprintf(f, "%i %s\n", feature_payloads(i), features[i].name);
 	
-	printf("!\n");
+	fprintf(f, "!\n");
 }
 
 static void
@@ -182,21 +265,22 @@ patternscan_mm_init(patternscan_t *ps)
 	}
 
 	/* mm header */
-	mm_header(ps);
+	ps->gamma_width = (mm_gammas(ps) <= 65536 ? 2 : 4);
+	mm_header(ps, (ps->out ? ps->out : stdout));
 	
 	/* write mm-pachi.table: feature to mm mapping */
 	mm_table(ps);
 }
 
 
-typedef void (*process_func_t)(patternscan_t *ps, board_t *b, move_t *m,
-			       strbuf_t *buf, bool game_move, void *data);
+typedef void (*process_func_t)(patternscan_worker_t *w, board_t *b, move_t *m,
+			       bool game_move, void *data);
 
 static void
-process_pattern(patternscan_t *ps, board_t *b, move_t *m,
+process_pattern(patternscan_worker_t *w, board_t *b, move_t *m,
 		bool game_move, process_func_t callback, void *data)
 {
-	callback(ps, b, m, &ps->buf, game_move, data);
+	callback(w, b, m, game_move, data);
 
 	/* Go through other moves as well */
 	if (game_move) {
@@ -204,21 +288,33 @@ process_pattern(patternscan_t *ps, board_t *b, move_t *m,
 			move_t m2 = move(c, m->color);
 			if (c == m->coord)                                           continue;
 			if (!board_is_valid_play_no_suicide(b, m2.color, m2.coord))  continue;
-			process_pattern(ps, b, &m2, false, callback, data);
+			process_pattern(w, b, &m2, false, callback, data);
 		} foreach_free_point_end;
 	}
 }
 
 static void
-mm_process_move(patternscan_t *ps, board_t *b, move_t *m, strbuf_t *buf,
+mm_process_move(patternscan_worker_t *w, board_t *b, move_t *m,
 		bool game_move, void *data)
 {
+	patternscan_t *ps = w->ps;
+	strbuf_t *buf = &w->buf;
 	ownermap_t *ownermap = (ownermap_t*)data;
 	
 	/* Now, match the pattern. */
 	pattern_t p;
 	pattern_match(&ps->pc, &p, b, m, ownermap, true);
 
+	if (ps->binary) {
+		if (game_move) {
+			uint16_t teams = 0;	/* Filled in when record is complete */
+			sbwrite(buf, &teams, 2);
+		}
+		mm_write_pattern(ps, buf, &p);
+		w->teams++;
+		return;
+	}
+
 	if (game_move) {
 		sbprintf(buf, "#\n");
 		mm_print_pattern(ps, buf, &p);
@@ -229,9 +325,12 @@ mm_process_move(patternscan_t *ps, board_t *b, move_t *m, strbuf_t *buf,
 
 /* Store the spatial configuration in dictionary if applicable. */
 static void
-genspatial_process_move(patternscan_t *ps, board_t *b, move_t *m, strbuf_t *buf,
+genspatial_process_move(patternscan_worker_t *w, board_t *b, move_t *m,
 			bool game_move, void *data)
 {
+	patternscan_t *ps = w->ps;
+	spatial_dict_t *dict = w->dict;
+
 	if (is_pass(m->coord))  return;
 	if (!game_move) return;		/* Only save patterns from played moves */
 
@@ -249,34 +348,196 @@ genspatial_process_move(patternscan_t *ps, board_t *b, move_t *m, strbuf_t *buf,
 	int dmax = s.dist;
 	for (int d = ps->pc.spat_min; d <= dmax; d++) {
 		s.dist = d;
-		unsigned int sid = spatial_dict_add(spat_dict, &s);
+		unsigned int sid = spatial_dict_add(dict, &s);
 #define SCOUNTS_ALLOC 1048576 // Allocate space in 1M*4 blocks.
-		if (sid >= ps->nscounts) {
+		if (sid >= w->nscounts) {
 			int newnsc = (sid / SCOUNTS_ALLOC + 1) * SCOUNTS_ALLOC;
-			ps->scounts = (int*)realloc(ps->scounts, newnsc * sizeof(*ps->scounts));
-			memset(&ps->scounts[ps->nscounts], 0, (newnsc - ps->nscounts) * sizeof(*ps->scounts));
+			w->scounts = (int*)realloc(w->scounts, newnsc * sizeof(*w->scounts));
+			memset(&w->scounts[w->nscounts], 0, (newnsc - w->nscounts) * sizeof(*w->scounts));
 			//ps->sgameno = realloc(ps->sgameno, newnsc * sizeof(*ps->sgameno));
 			//memset(&ps->sgameno[ps->nscounts], 0, (newnsc - ps->nscounts) * sizeof(*ps->sgameno));
-			ps->nscounts = newnsc;
+			w->nscounts = newnsc;
 		}
 		
 		/* Show stats from time to time */
 		if (ps->debug_level > 1 && !fast_random(65536) && !fast_random(32))
-			fprintf(stderr, "%d spatials\n", spat_dict->nspatials);
+			fprintf(stderr, "%d spatials\n", dict->nspatials);
 			
 		/* Global pattern count (including multiple hits per game) */
-		ps->scounts[sid]++;
+		w->scounts[sid]++;
 			
 #ifdef DEBUG_GENSPATIAL
-		fprintf(stderr, "id=%u d=%i hits=%i %s\n\n", sid, s.dist, ps->scounts[sid], spatial2str(&s));
+		fprintf(stderr, "id=%u d=%i hits=%i %s\n\n", sid, s.dist, w->scounts[sid], spatial2str(&s));
 		spatial_print(b, &s, stderr, m);
 #endif
-			
-		static int gameno = 0;
-		if (ps->gameno > gameno + 5) {
-			gameno = ps->gameno;
-			fprintf(stderr, "\t\t\tgames: %-15i spatials stored: %u\n", gameno, spat_dict->nspatials);
+	}
+}
+
+/* Scan move @m on @b. Returns record (gtp reply) if there's no output file. */
+static char *
+scan_move(patternscan_worker_t *w, board_t *b, move_t *m)
+{
+	patternscan_t *ps = w->ps;
+
+	/* Reset string buffer */
+	strbuf_init(&w->buf, w->buf.str, PATTERNSCAN_BUF_LEN);
+	w->teams = 0;
+
+	/* Process patterns for this move. */
+	if (ps->gen_spat_dict)
+		process_pattern(w, b, m, true, genspatial_process_move, NULL);
+	else {
+		ownermap_t ownermap;
+		if (ps->mcowner_fast)  mcowner_playouts_fast(b, m->color, &ownermap);
+		else		       mcowner_playouts(b, m->color, &ownermap); /* slooow */
+		process_pattern(w, b, m, true, mm_process_move, &ownermap);
+	}
+
+	if (ps->binary) {
+		uint16_t teams = w->teams;
+		memcpy(w->buf.str, &teams, 2);
+	}
+
+	if (!ps->out)  return w->buf.str;
+
+	size_t len = w->buf.cur - w->buf.str;
+	pthread_mutex_lock(&ps->out_mutex);
+	if (fwrite(w->buf.str, 1, len, ps->out) != len)
+		die("patternscan: %s: write failed\n", ps->output);
+	pthread_mutex_unlock(&ps->out_mutex);
+	return NULL;
+}
+
+static void *
+patternscan_worker(void *arg)
+{
+	patternscan_worker_t *w = (patternscan_worker_t*)arg;
+	patternscan_t *ps = w->ps;
+	board_t *b = malloc2(board_t);
+	fast_srandom_stream(ps->seed, w->tid + 1);
+
+	pthread_mutex_lock(&ps->mutex);
+	while (1) {
+		while (!ps->pending && !ps->quit)
+			pthread_cond_wait(&ps->more, &ps->mutex);
+		if (!ps->pending)  break;
+
+		patternscan_job_t *job = &ps->jobs[ps->first_job];
+		board_copy(b, &job->b);
+		move_t m = job->m;
+		ps->first_job = (ps->first_job + 1) % ps->max_jobs;
+		ps->pending--;
+		ps->busy++;
+		pthread_cond_signal(&ps->room);
+		pthread_mutex_unlock(&ps->mutex);
+
+		scan_move(w, b, &m);
+		board_done(b);
+
+		pthread_mutex_lock(&ps->mutex);
+		ps->busy--;
+		if (!ps->pending && !ps->busy)
+			pthread_cond_broadcast(&ps->idle);
+	}
+	pthread_mutex_unlock(&ps->mutex);
+
+	free(b);
+	return NULL;
+}
+
+/* Queue move for scanning, waits if workers are behind. */
+static void
+queue_move(patternscan_t *ps, board_t *b, move_t *m)
+{
+	pthread_mutex_lock(&ps->mutex);
+	while (ps->pending == ps->max_jobs)
+		pthread_cond_wait(&ps->room, &ps->mutex);
+
+	patternscan_job_t *job = &ps->jobs[(ps->first_job + ps->pending) % ps->max_jobs];
+	board_copy(&job->b, b);
+	job->b.superko_set = NULL;	/* Main board's, still changing */
+	job->m = *m;
+	ps->pending++;
+	pthread_cond_signal(&ps->more);
+	pthread_mutex_unlock(&ps->mutex);
+}
+
+static void
+workers_init(patternscan_t *ps)
+{
+	int n = (ps->threads ? ps->threads : 1);
+	ps->workers = calloc2(n, patternscan_worker_t);
+	for (int i = 0; i < n; i++) {
+		patternscan_worker_t *w = &ps->workers[i];
+		w->ps = ps;
+		w->tid = i;
+		strbuf_init_alloc(&w->buf, PATTERNSCAN_BUF_LEN);
+		if (ps->gen_spat_dict)
+			w->dict = (ps->threads ? spatial_dict_new(17, true) : spat_dict);
+	}
+	if (!ps->threads)  return;
+
+	ps->seed = fast_getseed();
+	ps->max_jobs = 2 * ps->threads;
+	ps->jobs = calloc2(ps->max_jobs, patternscan_job_t);
+	pthread_mutex_init(&ps->mutex, NULL);
+	pthread_cond_init(&ps->more, NULL);
+	pthread_cond_init(&ps->room, NULL);
+	pthread_cond_init(&ps->idle, NULL);
+	for (int i = 0; i < n; i++)
+		pthread_create(&ps->workers[i].thread, NULL, patternscan_worker, &ps->workers[i]);
+}
+
+/* Let workers finish pending moves and stop them. */
+static void
+workers_stop(patternscan_t *ps)
+{
+	if (!ps->threads)  return;
+
+	pthread_mutex_lock(&ps->mutex);
+	ps->quit = true;
+	pthread_cond_broadcast(&ps->more);
+	pthread_mutex_unlock(&ps->mutex);
+	for (int i = 0; i < ps->threads; i++)
+		pthread_join(ps->workers[i].thread, NULL);
+	free(ps->jobs);  ps->jobs = NULL;
+}
+
+/* gen_spat_dict: spatials stored so far (before merging with threads). */
+static unsigned int
+spatials_stored(patternscan_t *ps)
+{
+	if (!ps->threads)  return spat_dict->nspatials;
+	unsigned int n = 0;
+	for (int i = 0; i < ps->threads; i++)
+		n += ps->workers[i].dict->nspatials - 1;
+	return n;
+}
+
+/* gen_spat_dict: merge workers' spatials and counts into spat_dict. */
+static void
+genspatial_merge(patternscan_t *ps)
+{
+	if (!ps->threads) {
+		ps->scounts = ps->workers[0].scounts;  ps->workers[0].scounts = NULL;
+		ps->nscounts = ps->workers[0].nscounts;
+		return;
+	}
+
+	for (int i = 0; i < ps->threads; i++) {
+		patternscan_worker_t *w = &ps->workers[i];
+		for (unsigned int id = 1; id < w->dict->nspatials; id++) {
+			unsigned int sid = spatial_dict_add(spat_dict, &w->dict->spatials[id]);
+			if (sid >= ps->nscounts) {
+				int newnsc = (sid / SCOUNTS_ALLOC + 1) * SCOUNTS_ALLOC;
+				ps->scounts = (int*)realloc(ps->scounts, newnsc * sizeof(*ps->scounts));
+				memset(&ps->scounts[ps->nscounts], 0, (newnsc - ps->nscounts) * sizeof(*ps->scounts));
+				ps->nscounts = newnsc;
+			}
+			ps->scounts[sid] += w->scounts[id];
 		}
+		spatial_dict_delete(w->dict);  w->dict = NULL;
+		free(w->scounts);  w->scounts = NULL;
 	}
 }
 
@@ -290,8 +551,11 @@ patternscan_play(engine_t *e, board_t *b, move_t *m, char *enginearg, bool *boar
 	/* Deal with broken game records that sometimes get fed in. */
 	assert(board_at(b, m->coord) == S_NONE);
 
-	if (b->moves == (b->handicap ? b->handicap * 2 : 1))
+	if (b->moves == (b->handicap ? b->handicap * 2 : 1)) {
 		ps->gameno++;
+		if (ps->gen_spat_dict && !(ps->gameno % 5))
+			fprintf(stderr, "\t\t\tgames: %-15i spatials stored: %u\n", ps->gameno, spatials_stored(ps));
+	}
 
 	if (!(m->color & ps->color_mask))
 		return NULL;
@@ -300,20 +564,11 @@ patternscan_play(engine_t *e, board_t *b, move_t *m, char *enginearg, bool *boar
 	if (enginearg && *enginearg == '0')
 		return NULL;
 
-	/* Reset string buffer */
-	strbuf_init(&ps->buf, ps->buf.str, PATTERNSCAN_BUF_LEN);
-
-	/* Process patterns for this move. */
-	if (ps->gen_spat_dict)
-		process_pattern(ps, b, m, true, genspatial_process_move, NULL);
-	else {
-		ownermap_t ownermap;
-		if (ps->mcowner_fast)  mcowner_playouts_fast(b, m->color, &ownermap);
-		else		       mcowner_playouts(b, m->color, &ownermap); /* slooow */
-		process_pattern(ps, b, m, true, mm_process_move, &ownermap);
+	if (ps->threads) {
+		queue_move(ps, b, m);
+		return NULL;
 	}
-
-	return ps->buf.str;
+	return scan_move(&ps->workers[0], b, m);
 }
 
 static coord_t
@@ -380,11 +635,27 @@ patternscan_done(engine_t *e)
 {
 	patternscan_t *ps = (patternscan_t*)e->data;
 	
-	if (ps->gen_spat_dict)
+	workers_stop(ps);
+	if (ps->gen_spat_dict) {
+		genspatial_merge(ps);
 		genspatial_done(ps);
+	}
+	if (ps->out) {
+		if (fclose(ps->out))  die("patternscan: %s: write failed\n", ps->output);
+		ps->out = NULL;
+	}
 
+	int n = (ps->threads ? ps->threads : 1);
+	for (int i = 0; i < n; i++) {
+		patternscan_worker_t *w = &ps->workers[i];
+		if (w->dict && w->dict != spat_dict)  spatial_dict_delete(w->dict);
+		free(w->scounts);
+		free(w->buf.str);
+	}
+	free(ps->workers);     ps->workers = NULL;
+	free(ps->scounts);     ps->scounts = NULL;
 	free(ps->spatial2mm);  ps->spatial2mm = NULL;	
-	free(ps->buf.str);     ps->buf.str = NULL;
+	free(ps->output);      ps->output = NULL;
 }
 
 #define NEED_RESET   ENGINE_SETOPTION_NEED_RESET
@@ -437,6 +708,23 @@ patternscan_setoption(engine_t *e, board_t *b, const char *optname, char *optval
 		 * Default: mcowner_fast=1 */
 		ps->mcowner_fast = atoi(optval);
 	}
+	else if (!strcasecmp(optname, "threads") && optval) {
+		/* Scan moves in that many worker threads.
+		 * Records are written to output file then,
+		 * in no particular order. */
+		ps->threads = atoi(optval);
+	}
+	else if (!strcasecmp(optname, "output") && optval) {
+		/* Write mm records to this file instead of
+		 * gtp replies. */
+		free(ps->output);
+		ps->output = strdup(optval);
+	}
+	else if (!strcasecmp(optname, "binary")) {
+		/* Write compact binary mm records instead of
+		 * text. Needs output file, default mm-input.bin */
+		ps->binary = !optval || atoi(optval);
+	}
 	else if (!strcasecmp(optname, "patterns") && optval) {  NEED_RESET
 		patterns_init(&ps->pc, optval, ps->gen_spat_dict, false);
 	}
@@ -480,8 +768,17 @@ patternscan_state_init(engine_t *e, board_t *b)
 	ps->loaded_spatials = spat_dict->nspatials;
 	ps->gameno = 1;
 	
-	if (!ps->gen_spat_dict)    patternscan_mm_init(ps);
-	strbuf_init_alloc(&ps->buf, PATTERNSCAN_BUF_LEN);
+	if (!ps->gen_spat_dict) {
+		if (!ps->output && (ps->binary || ps->threads))
+			ps->output = strdup(ps->binary ? "mm-input.bin" : "mm-input.dat");
+		if (ps->output) {
+			ps->out = fopen(ps->output, "wb");
+			if (!ps->out)  die("patternscan: %s: %s\n", ps->output, strerror(errno));
+		}
+		pthread_mutex_init(&ps->out_mutex, NULL);
+		patternscan_mm_init(ps);
+	}
+	workers_init(ps);
 	return ps;
 }
 
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -8,9 +9,11 @@
 #include "engine.h"
 #include "move.h"
 #include "playout.h"
+#include "random.h"
 #include "../joseki.h"
 #include "playout/light.h"
 #include "playout/moggy.h"
+#include "playout/pattern.h"
 #include "engines/replay.h"
 
 /* Internal engine state. */
@@ -18,9 +21,27 @@ typedef struct {
 	int debug_level;
 	int runs;
 	int no_suicide;
+	int threads;
 	playout_policy_t *playout;
 } replay_t;
 
+/* Sampling state shared by all threads: runs get claimed one at a time
+ * from @done, counts in @played are updated with atomic adds. */
+typedef struct {
+	replay_t *r;
+	board_t *b;
+	enum stone color;
+	int *played;
+	int done;
+	unsigned long seed;
+} replay_sample_t;
+
+typedef struct {
+	replay_sample_t *s;
+	int tid;
+	pthread_t thread;
+} replay_worker_t;
+
 static void
 suicide_stats(int suicide)
 {
@@ -31,39 +52,69 @@ suicide_stats(int suicide)
 		fprintf(stderr, "Suicides: %i/%i (%i%%)\n", suicides, total, suicides * 100 / total);
 }
 
-coord_t
-replay_sample_moves(engine_t *e, board_t *b, enum stone color, 
-		    int *played, int *pmost_played)
+static void
+replay_sample_runs(replay_sample_t *s)
 {
-	replay_t *r = (replay_t*)e->data;
+	replay_t *r = s->r;
 	playout_policy_t *policy = r->playout;
 	playout_setup_t setup;	        memset(&setup, 0, sizeof(setup));
-	move_t m = move(pass, color);
-	int most_played = 0;
-	
-	/* Find out what moves policy plays most in this situation */
-        for (int i = 0; i < r->runs; i++) {
+
+	while (__sync_fetch_and_add(&s->done, 1) < r->runs) {
 		board_t b2;
-		board_copy(&b2, b);
+		board_copy(&b2, s->b);
 		
 		if (policy->setboard)
 			policy->setboard(policy, &b2);
 		
 		if (DEBUGL(4))  fprintf(stderr, "---------------------------------\n");		
-		coord_t c = playout_play_move(&setup, &b2, color, r->playout);		
+		coord_t c = playout_play_move(&setup, &b2, s->color, r->playout);		
 		assert(!is_resign(c));
 		if (DEBUGL(4))  fprintf(stderr, "-> %s\n", coord2sstr(c));
 		
-		played[c]++;
-		if (played[c] > most_played) {
-			most_played++;  m.coord = c;
-		}
-
+		__sync_fetch_and_add(&s->played[c], 1);
 		board_done(&b2);
 	}
+}
+
+static void *
+replay_worker(void *data)
+{
+	replay_worker_t *w = (replay_worker_t*)data;
+	fast_srandom_stream(w->s->seed, w->tid);
+	replay_sample_runs(w->s);
+	return NULL;
+}
+
+coord_t
+replay_sample_moves(engine_t *e, board_t *b, enum stone color, 
+		    int *played, int *pmost_played)
+{
+	replay_t *r = (replay_t*)e->data;
+	replay_sample_t s = { r, b, color, played, 0 };
+	
+	/* Find out what moves policy plays most in this situation */
+	if (r->threads <= 1)
+		replay_sample_runs(&s);
+	else {
+		s.seed = fast_random64();
+		replay_worker_t workers[r->threads];
+		for (int i = 0; i < r->threads; i++) {
+			workers[i] = (replay_worker_t) { &s, i };
+			pthread_create(&workers[i].thread, NULL, replay_worker, &workers[i]);
+		}
+		for (int i = 0; i < r->threads; i++)
+			pthread_join(workers[i].thread, NULL);
+	}
+
+	coord_t best = pass;
+	int most_played = 0;
+	for (coord_t c = pass; c < board_max_coords(b); c++)
+		if (played[c] > most_played) {
+			most_played = played[c];  best = c;
+		}
 	
 	*pmost_played = most_played;
-	return m.coord;
+	return best;
 }
 
 static coord_t
@@ -155,6 +206,13 @@ replay_setoption(engine_t *e, board_t *b, const char *optname, char *optval,
 		 *         use runs=1 for raw playout policy */
 		r->runs = atoi(optval);
 	}
+	else if (!strcasecmp(optname, "threads") && optval) {
+		/* threads=n  sample runs in that many threads,
+		 *            default: 1 thread per core */
+		r->threads = atoi(optval);
+		if (r->threads < 1)
+			option_error("Replay: Invalid threads value %s\n", optval);
+	}
 	else if (!strcasecmp(optname, "no_suicide")) {
 		/* ensure engine doesn't allow group suicides
 		 * (off by default) */
@@ -168,6 +226,8 @@ replay_setoption(engine_t *e, board_t *b, const char *optname, char *optval,
 			r->playout = playout_moggy_init(playoutarg, b);
 		else if (!strcasecmp(optval, "light"))
 			r->playout = playout_light_init(playoutarg, b);
+		else if (!strcasecmp(optval, "pattern"))
+			r->playout = playout_pattern_init(playoutarg, b);
 		else
 			option_error("Replay: Invalid playout policy %s\n", optval);
 	}
@@ -187,6 +247,7 @@ replay_state_init(engine_t *e, board_t *b)
 	r->debug_level = 1;
 	r->runs = 1000;
 	r->no_suicide = 0;
+	r->threads = get_default_threads();
 	joseki_load(board_rsize(b));
 
 	/* Process engine options. */
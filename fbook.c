@@ -1,7 +1,11 @@
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 #define DEBUG
 
@@ -11,19 +15,58 @@
 #include "random.h"
 
 
-#define HASH_VMIRROR     1
-#define HASH_HMIRROR     2
-#define HASH_XYFLIP      4
+static hash_t
+check_hash(coord_t coord, enum stone color)
+{
+	hash_t h = (hash_t)(coord * 2 + color - 1) * 0x9e3779b97f4a7c15ULL;
+	return h ^ (h >> 31);
+}
+
+/* Position hashes under each symmetry, returns canonical one. */
+static int
+fbook_hashes(board_t *b, hash_t hash[8], hash_t check[8])
+{
+	for (int i = 0; i < 8; i++)
+		hash[i] = check[i] = 0;
+	foreach_point(b) {
+		enum stone color = board_at(b, c);
+		if (color != S_BLACK && color != S_WHITE)
+			continue;
+		for (int i = 0; i < 8; i++) {
+			coord_t t = coord_transform(b, c, i);
+			hash[i]  ^= hash_at(t, color);
+			check[i] ^= check_hash(t, color);
+		}
+	} foreach_point_end;
+
+	int best = 0;
+	for (int i = 1; i < 8; i++)
+		if (hash[i] < hash[best])
+			best = i;
+	return best;
+}
+
+static fbook_entry_t *
+fbook_find(fbook_t *fbook, hash_t hash, hash_t check)
+{
+	uint32_t mask = (1 << fbook->hash_bits) - 1;
+	for (uint32_t i = hash & mask; fbook->entries[i].n; i = (i + 1) & mask)
+		if (fbook->entries[i].hash == hash &&
+		    fbook->entries[i].check == check)
+			return &fbook->entries[i];
+	return NULL;
+}
 
 static coord_t
-coord_transform(board_t *b, coord_t coord, int i)
+fbook_pick(fbook_t *fbook, fbook_entry_t *e)
 {
-	int stride = board_stride(b);
-	int x = coord_x(coord);  int y = coord_y(coord);	
-	if (i & HASH_VMIRROR)  coord = coord_xy(x, stride - 1 - y);
-	if (i & HASH_HMIRROR)  coord = coord_xy(stride - 1 - x, y);
-	if (i & HASH_XYFLIP)   coord = coord_xy(y, x);
-	return coord;
+	float r = fast_frandom();
+	for (uint32_t i = e->first; i < e->first + e->n - 1; i++) {
+		r -= fbook->moves[i].weight;
+		if (r < 0)
+			return fbook->moves[i].coord;
+	}
+	return fbook->moves[e->first + e->n - 1].coord;
 }
 
 /* Check if we can make a move along the fbook right away.
@@ -33,61 +76,73 @@ fbook_check(board_t *board)
 {
 	if (!board->fbook) return pass;
 
-	hash_t hi = board->hash;
+	hash_t hash[8], check[8];
+	int i = fbook_hashes(board, hash, check);
+	fbook_entry_t *e = fbook_find(board->fbook, hash[i], check[i]);
 	coord_t cf = pass;
-	while (!is_pass(board->fbook->moves[hi & fbook_hash_mask])) {
-		if (board->fbook->hashes[hi & fbook_hash_mask] == board->hash) {
-			cf = board->fbook->moves[hi & fbook_hash_mask];
-			break;
-		}
-		hi++;
+	if (e) {
+		cf = fbook_pick(board->fbook, e);
+		if (!is_pass(cf))
+			cf = coord_transform(board, cf, transform_inverse(board, i));
 	}
+
 	if (!is_pass(cf)) {
 		if (DEBUGL(1))
-			fprintf(stderr, "fbook match %" PRIhash ":%" PRIhash "\n", board->hash, board->hash & fbook_hash_mask);
+			fprintf(stderr, "fbook match %" PRIhash ":%" PRIhash "\n", board->hash, hash[i]);
 	} else {
 		/* No match, also prevent further fbook usage
 		 * until the next clear_board. */
 		if (DEBUGL(4))
-			fprintf(stderr, "fbook out %" PRIhash ":%" PRIhash "\n", board->hash, board->hash & fbook_hash_mask);
+			fprintf(stderr, "fbook out %" PRIhash ":%" PRIhash "\n", board->hash, hash[i]);
 		fbook_done(board->fbook);
 		board->fbook = NULL;
 	}
 	return cf;
 }
 
-static fbook_t *fbcache;
 
-fbook_t *
-fbook_init(char *filename, board_t *b)
+/********************************************************************************************/
+/* Text book */
+
+static int
+count_lines(FILE *f)
 {
-	if (fbcache && fbcache->bsize == board_rsize(b)
-	    && fbcache->handicap == b->handicap)
-		return fbcache;
+	int n = 0;
+	char linebuf[1024];
+	while (fgets(linebuf, sizeof(linebuf), f))
+		n++;
+	rewind(f);
+	return n;
+}
 
-	FILE *f = fopen_data_file(filename, "r");
-	if (!f) {
-		perror(filename);
-		return NULL;
+static void
+fbook_add_move(fbook_t *fbook, unsigned int *alloc, coord_t coord, float weight)
+{
+	if (fbook->nmoves == *alloc) {
+		*alloc = (*alloc ? *alloc * 2 : 1024);
+		fbook->moves = crealloc(fbook->moves, *alloc * sizeof(fbook_move_t));
 	}
+	fbook->moves[fbook->nmoves].coord = coord;
+	fbook->moves[fbook->nmoves++].weight = weight;
+}
 
+/* Replay book lines for @bsize / @handicap. Board statics are set up
+ * for @bsize while we're at it. */
+static fbook_t *
+fbook_parse(FILE *f, int bsize, int handicap)
+{
 	fbook_t *fbook = calloc2(1, fbook_t);
-	fbook->bsize = board_rsize(b);
-	fbook->handicap = b->handicap;
-	/* We do not set handicap=1 in case of too low komi on purpose;
-	 * we want to go with the no-handicap fbook for now. */
-	for (int i = 0; i < 1<<fbook_hash_bits; i++)
-		fbook->moves[i] = pass;
+	fbook->bsize = bsize;
+	fbook->handicap = handicap;
+	for (fbook->hash_bits = 8; (1 << fbook->hash_bits) < 2 * count_lines(f); fbook->hash_bits++)
+		;
+	fbook->entries = calloc2(1 << fbook->hash_bits, fbook_entry_t);
+	uint32_t mask = (1 << fbook->hash_bits) - 1;
+	unsigned int alloc = 0;
 
-	if (DEBUGL(1))
-		fprintf(stderr, "Loading opening fbook %s...\n", filename);
+	/* Scratch board where we lay out the sequence. */
+	board_t *bs = board_new(fbook->bsize, NULL);
 
-	/* Scratch board where we lay out the sequence;
-	 * one for each transposition. */
-	board_t *bs[8];
-	for (int i = 0; i < 8; i++)
-		bs[i] = board_new(fbook->bsize, NULL);
-	
 	char linebuf[1024];
 	while (fgets(linebuf, sizeof(linebuf), f)) {
 		char *line = linebuf;
@@ -108,20 +163,14 @@ fbook_init(char *filename, board_t *b)
 			continue;
 		while (isspace(*line)) line++;
 
-		for (int i = 0; i < 8; i++) {
-			board_clear(bs[i]);
-			last_move(bs[i]).color = S_WHITE;
-		}
+		board_clear(bs);
+		last_move(bs).color = S_WHITE;
 
 		while (*line != '|') {
 			coord_t c = str2coord(line);
-
-			for (int i = 0; i < 8; i++) {
-				coord_t coord = coord_transform(b, c, i);
-				move_t m = move(coord, stone_other(last_move(bs[i]).color));
-				int ret = board_play(bs[i], &m);
-				assert(ret >= 0);
-			}
+			move_t m = move(c, stone_other(last_move(bs).color));
+			int ret = board_play(bs, &m);
+			assert(ret >= 0);
 
 			while (!isspace(*line)) line++;
 			while (isspace(*line)) line++;
@@ -130,63 +179,311 @@ fbook_init(char *filename, board_t *b)
 		line++;
 		while (isspace(*line)) line++;
 
+		hash_t hash[8], check[8];
+		int t = fbook_hashes(bs, hash, check);
+		uint32_t i = hash[t] & mask;
+		while (fbook->entries[i].n &&
+		       (fbook->entries[i].hash != hash[t] || fbook->entries[i].check != check[t]))
+			i = (i + 1) & mask;
+		fbook_entry_t *e = &fbook->entries[i];
+		if (!e->n)  fbook->positions++;
+		/* Later lines override earlier ones. */
+		e->hash = hash[t];
+		e->check = check[t];
+		e->first = fbook->nmoves;
+		e->n = 0;
+
 		/* In case of multiple candidates, pick one with
 		 * exponentially decreasing likelihood. */
-		while (strchr(line, ' ') && fast_random(2)) {
+		float weight = 1.0;
+		while (*line) {
+			bool last = !strchr(line, ' ');
+			weight = (last ? weight : weight / 2);
+			fbook_add_move(fbook, &alloc, coord_transform(bs, str2coord(line), t), weight);
+			e->n++;
+			if (last)  break;
 			line = strchr(line, ' ');
 			while (isspace(*line)) line++;
-			// fprintf(stderr, "<%s> skip to %s\n", linebuf, line);
 		}
+		if (!e->n)  die("fbook: no move in line '%s'\n", linebuf);
+	}
 
-		coord_t c = str2coord(line);
-		for (int i = 0; i < 8; i++) {
-			coord_t coord = coord_transform(b, c, i);
-#if 0
-			char conflict = is_pass(fbook->moves[bs[i]->hash & fbook_hash_mask]) ? '+' : 'C';
-			if (conflict == 'C')
-				for (int j = 0; j < i; j++)
-					if (bs[i]->hash == bs[j]->hash)
-						conflict = '+';
-			if (conflict == 'C') {
-				hash_t hi = bs[i]->hash;
-				while (!is_pass(fbook->moves[hi & fbook_hash_mask]) && fbook->hashes[hi & fbook_hash_mask] != bs[i]->hash)
-					hi++;
-				if (fbook->hashes[hi & fbook_hash_mask] == bs[i]->hash)
-					hi = 'c';
-			}
-			fprintf(stderr, "%c %" PRIhash ":%" PRIhash " (<%d> %s)\n", conflict,
-			        bs[i]->hash & fbook_hash_mask, bs[i]->hash, i, linebuf);
+	board_delete(&bs);
+	rewind(f);
+	return fbook;
+}
+
+
+/********************************************************************************************/
+/* Compiled book */
+
+/* File format: header, section table, then entries[] and moves[] of
+ * each section as they are in memory, aligned on FBOOK_DB_ALIGN bytes.
+ * One section per board size / handicap found in the text book. */
+
+#define FBOOK_DB_MAGIC    0x4b4f4f4248434150ULL	/* "PACHBOOK" */
+#define FBOOK_DB_VERSION  2	/* 2: all 8 symmetries */
+#define FBOOK_DB_ALIGN    64
+#define FBOOK_DB_LAYOUT   (sizeof(fbook_entry_t) | sizeof(fbook_move_t) << 8)
+#define FBOOK_DB_SECTIONS 64
+
+typedef struct {
+	uint32_t bsize, handicap;
+	uint32_t hash_bits;
+	uint32_t positions;
+	uint32_t nmoves;
+	hash_t   zobrist;		/* Board hashes must match too */
+	uint64_t entries, moves;	/* Section offsets */
+} fbook_db_section_t;
+
+typedef struct {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t layout;
+	uint64_t checksum;		/* Of text book it was compiled from */
+	uint64_t size;
+	uint32_t nsections;
+	fbook_db_section_t sections[FBOOK_DB_SECTIONS];
+} fbook_db_header_t;
+
+static void  *db_map = NULL;
+static size_t db_size = 0;
+
+/* Board hashes for current board size. */
+static hash_t
+zobrist_fingerprint(void)
+{
+	hash_t h = 0;
+	for (coord_t c = 0; c < board_statics.max_coords; c++)
+		h = (h * 31) ^ hash_at(c, S_BLACK) ^ (hash_at(c, S_WHITE) << 1);
+	return h;
+}
+
+/* FNV-1a of text book. */
+static uint64_t
+fbook_checksum(FILE *f)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	unsigned char buf[65536];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		for (size_t i = 0; i < n; i++)
+			h = (h ^ buf[i]) * 0x100000001b3ULL;
+	rewind(f);
+	return h;
+}
+
+static void
+db_filename(char *buf, size_t len, char *filename)
+{
+	snprintf(buf, len, "%s.bin", filename);
+}
+
+static void *
+map_file(FILE *f, size_t size)
+{
+	if (fseek(f, 0, SEEK_END) || (size_t)ftell(f) < size)
+		return NULL;
+#ifndef _WIN32
+	void *p = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(f), 0);
+	return (p == MAP_FAILED ? NULL : p);
+#else
+	void *p = cmalloc(size);
+	rewind(f);
+	if (fread(p, 1, size, f) != size) {  free(p);  return NULL;  }
+	return p;
 #endif
-			hash_t hi = bs[i]->hash;
-			while (!is_pass(fbook->moves[hi & fbook_hash_mask]) && fbook->hashes[hi & fbook_hash_mask] != bs[i]->hash)
-				hi++;
-			fbook->moves[hi & fbook_hash_mask] = coord;
-			fbook->hashes[hi & fbook_hash_mask] = bs[i]->hash;
-			fbook->movecnt++;
-		}
+}
+
+/* Map compiled book if there's an up-to-date one (stays mapped). */
+static fbook_db_header_t *
+fbook_db_map(char *filename, uint64_t checksum)
+{
+	if (db_map)  return db_map;
+
+	char name[1024];  db_filename(name, sizeof(name), filename);
+	FILE *f = fopen_data_file(name, "rb");
+	if (!f)  return NULL;
+
+	fbook_db_header_t h;
+	if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != FBOOK_DB_MAGIC ||
+	    h.version != FBOOK_DB_VERSION || h.layout != FBOOK_DB_LAYOUT) {
+		if (DEBUGL(1))  fprintf(stderr, "%s: incompatible opening book, ignoring.\n", name);
+		fclose(f);
+		return NULL;
+	}
+	if (h.checksum != checksum) {
+		if (DEBUGL(1))  fprintf(stderr, "%s: out of date, ignoring (run 'pachi --compile-fbook %s').\n", name, filename);
+		fclose(f);
+		return NULL;
 	}
 
-	for (int i = 0; i < 8; i++)
-		board_delete(&bs[i]);
+	db_map = map_file(f, h.size);
+	fclose(f);
+	if (!db_map) {
+		if (DEBUGL(1))  fprintf(stderr, "%s: couldn't map opening book, ignoring.\n", name);
+		return NULL;
+	}
+	db_size = h.size;
+	return db_map;
+}
+
+/* Book for @bsize / @handicap from compiled book, empty one if it has none.
+ * Board statics must be set up for @bsize. */
+static fbook_t *
+fbook_db_load(fbook_db_header_t *h, int bsize, int handicap)
+{
+	fbook_db_section_t *s = NULL;
+	for (unsigned int i = 0; i < h->nsections; i++)
+		if (h->sections[i].bsize == (uint32_t)bsize && h->sections[i].handicap == (uint32_t)handicap)
+			s = &h->sections[i];
+	if (s && s->zobrist != zobrist_fingerprint()) {
+		if (DEBUGL(1))  fprintf(stderr, "fbook: compiled book has different board hashes, ignoring.\n");
+		return NULL;
+	}
+
+	fbook_t *fbook = calloc2(1, fbook_t);
+	fbook->bsize = bsize;
+	fbook->handicap = handicap;
+	fbook->mapped = true;
+	if (s) {
+		fbook->positions = s->positions;
+		fbook->hash_bits = s->hash_bits;
+		fbook->nmoves = s->nmoves;
+		fbook->entries = (fbook_entry_t*)((char*)h + s->entries);
+		fbook->moves = (fbook_move_t*)((char*)h + s->moves);
+	}
+	return fbook;
+}
+
+static uint64_t
+section(uint64_t *offset, size_t size)
+{
+	uint64_t start = (*offset + FBOOK_DB_ALIGN - 1) & ~(uint64_t)(FBOOK_DB_ALIGN - 1);
+	*offset = start + size;
+	return start;
+}
+
+static void
+write_section(FILE *f, char *name, uint64_t offset, void *data, size_t size)
+{
+	static const char zeros[FBOOK_DB_ALIGN] = { 0, };
+	long pos = ftell(f);
+	assert(pos >= 0 && (uint64_t)pos <= offset && offset - pos < FBOOK_DB_ALIGN);
+	if (fwrite(zeros, 1, offset - pos, f) != offset - pos ||
+	    fwrite(data, 1, size, f) != size)
+		die("%s: write failed\n", name);
+}
+
+void
+fbook_compile(char *filename)
+{
+	FILE *f = fopen_data_file(filename, "r");
+	if (!f)  die("%s: %s\n", filename, strerror(errno));
+
+	fbook_db_header_t h = { 0, };
+	h.magic = FBOOK_DB_MAGIC;
+	h.version = FBOOK_DB_VERSION;
+	h.layout = FBOOK_DB_LAYOUT;
+	h.checksum = fbook_checksum(f);
+
+	/* Board sizes / handicaps in there. */
+	char linebuf[1024];
+	while (fgets(linebuf, sizeof(linebuf), f)) {
+		char *line = linebuf;
+		int bsize = strtol(line, &line, 10);
+		int handi = (*line == '/' ? strtol(line + 1, &line, 10) : 0);
+		if (bsize < 2 || bsize > BOARD_MAX_SIZE)
+			continue;
+		unsigned int i;
+		for (i = 0; i < h.nsections; i++)
+			if (h.sections[i].bsize == (uint32_t)bsize && h.sections[i].handicap == (uint32_t)handi)
+				break;
+		if (i < h.nsections)  continue;
+		if (h.nsections == FBOOK_DB_SECTIONS)  die("%s: too many board sizes / handicaps\n", filename);
+		h.sections[h.nsections].bsize = bsize;
+		h.sections[h.nsections++].handicap = handi;
+	}
+	rewind(f);
 
+	fbook_t *books[FBOOK_DB_SECTIONS];
+	h.size = sizeof(h);
+	for (unsigned int i = 0; i < h.nsections; i++) {
+		fbook_db_section_t *s = &h.sections[i];
+		fbook_t *fbook = books[i] = fbook_parse(f, s->bsize, s->handicap);
+		s->hash_bits = fbook->hash_bits;
+		s->positions = fbook->positions;
+		s->nmoves = fbook->nmoves;
+		s->zobrist = zobrist_fingerprint();
+		s->entries = section(&h.size, (1 << fbook->hash_bits) * sizeof(fbook_entry_t));
+		s->moves = section(&h.size, fbook->nmoves * sizeof(fbook_move_t));
+	}
 	fclose(f);
 
-	if (!fbook->movecnt) {
-		/* Empty book is not worth the hassle. */
-		fbook_done(fbook);
+	char name[1024];  db_filename(name, sizeof(name), filename);
+	FILE *out = fopen(name, "wb");
+	if (!out)  die("%s: %s\n", name, strerror(errno));
+	write_section(out, name, 0, &h, sizeof(h));
+	int positions = 0;
+	for (unsigned int i = 0; i < h.nsections; i++) {
+		fbook_db_section_t *s = &h.sections[i];
+		write_section(out, name, s->entries, books[i]->entries, (1 << s->hash_bits) * sizeof(fbook_entry_t));
+		write_section(out, name, s->moves, books[i]->moves, s->nmoves * sizeof(fbook_move_t));
+		positions += s->positions;
+		fbook_done(books[i]);
+	}
+	fclose(out);
+
+	fprintf(stderr, "Wrote %s: %d positions, %d board sizes / handicaps (%.1fMb)\n",
+		name, positions, h.nsections, (double)h.size / (1024 * 1024));
+}
+
+
+/********************************************************************************************/
+
+static fbook_t *fbcache;
+
+fbook_t *
+fbook_init(char *filename, board_t *b)
+{
+	if (fbcache && fbcache->bsize == board_rsize(b)
+	    && fbcache->handicap == b->handicap)
+		return (fbcache->positions ? fbcache : NULL);
+
+	FILE *f = fopen_data_file(filename, "r");
+	if (!f) {
+		perror(filename);
 		return NULL;
 	}
 
+	/* We do not set handicap=1 in case of too low komi on purpose;
+	 * we want to go with the no-handicap fbook for now. */
+	fbook_db_header_t *h = fbook_db_map(filename, fbook_checksum(f));
+	fbook_t *fbook = (h ? fbook_db_load(h, board_rsize(b), b->handicap) : NULL);
+	if (!fbook) {
+		if (DEBUGL(1))
+			fprintf(stderr, "Loading opening fbook %s...\n", filename);
+		fbook = fbook_parse(f, board_rsize(b), b->handicap);
+	}
+	fclose(f);
+
+	/* Keep empty books too, so we don't look again
+	 * until board size changes. */
 	fbook_t *fbold = fbcache;
 	fbcache = fbook;
 	if (fbold)
 		fbook_done(fbold);
 
-	return fbook;
+	return (fbook->positions ? fbook : NULL);
 }
 
 void fbook_done(fbook_t *fbook)
 {
-	if (fbook != fbcache)
-		free(fbook);
+	if (fbook == fbcache)
+		return;
+	if (!fbook->mapped) {
+		free(fbook->entries);
+		free(fbook->moves);
+	}
+	free(fbook);
 }
@@ -6,21 +6,41 @@
 /* Opening book (fbook as in "forcing book" since the move is just
  * played unconditionally if found, or possibly "fuseki book"). */
 
+/* Positions are stored once, in canonical orientation (the symmetry
+ * with lowest hash), along with a second hash to detect collisions.
+ * Each position has a run of candidate moves in moves[]. */
+typedef struct {
+	hash_t   hash;		/* canonical position hash */
+	hash_t   check;		/* second hash, collision check */
+	uint32_t first;		/* candidates: moves[first .. first + n] */
+	uint32_t n;		/* 0: empty slot */
+} fbook_entry_t;
+
+typedef struct {
+	coord_t coord;		/* in canonical orientation */
+	float   weight;		/* probability of picking this one */
+} fbook_move_t;
+
 typedef struct fbook {
 	int bsize;
 	int handicap;
 
-	int movecnt;
-
-#define fbook_hash_bits 20 // 12M w/ 32-bit coord_t
-#define fbook_hash_mask ((1 << fbook_hash_bits) - 1)
-	/* pass == no move in this position */
-	coord_t moves[1<<fbook_hash_bits];
-	hash_t hashes[1<<fbook_hash_bits];
+	unsigned int positions;
+	unsigned int hash_bits;
+	fbook_entry_t *entries;
+	fbook_move_t  *moves;
+	unsigned int nmoves;
+	bool mapped;		/* entries / moves live in compiled book */
 } fbook_t;
 
 coord_t  fbook_check(board_t *board);
 fbook_t* fbook_init(char *filename, board_t *b);
 void     fbook_done(fbook_t *fbook);
 
+/* Compile text book @filename into @filename.bin which gets mmap()ed
+ * instead of replaying the text book whenever board size changes.
+ * Compiled book records a checksum of the text book, it's ignored if
+ * that changed since. */
+void     fbook_compile(char *filename);
+
 #endif
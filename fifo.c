@@ -16,13 +16,20 @@
 #include "debug.h"
 #include "fifo.h"
 
-/* Fifo queue to coordinate multiple pachi instances so that only one runs at
- * a time. Having multiple multi-threaded pachis fight for cpu is not a good
- * idea. Either run each one single threaded or use this.
+/* Core broker to coordinate multiple pachi instances on the same host.
+ * Having multiple multi-threaded pachis fight for cpu is not a good idea,
+ * running them one at a time wastes cores when one search can't use them
+ * all. Instead each instance tells what it's doing (thinking, pondering,
+ * idle) and how many threads it'd like, and gets a share of the cores:
+ * - thinking instances first, fair shares capped by demand (at least 1),
+ * - pondering instances get what's left (at least 1),
+ * - idle instances get nothing.
+ * Grants are recomputed for everyone whenever an instance changes demand,
+ * searches check theirs as they go (extra threads wait, see uct_playouts()).
  *
  * Implemented using shared memory segment + simple robust mutex:
  * - dead-lock free, handles instances disappearing with the lock
- * - ordering not guaranteed but almost 100% fifo in practice
+ * - dead instances are dropped next time grants are computed
  *
  * If your system uses systemd beware !
  * systemd regularly cleans up what it thinks of as "stale" entries in
@@ -32,15 +39,8 @@
  * Edit /etc/systemd/logind.conf and uncomment
  *     RemoveIPC=n
  *
- * For reference:
- * - Real ticket-lock style implementation would give 100% guaranteed fifo
- *   order but not worth the extra complexity imo.
- * - Semaphore looks nice for this on the surface (just what we need, no need
- *   for shm) but doesn't handle processes disappearing with the token
- *   -> timeout and it's a mess...
- * - flock(): easy, may be ok for 2 tasks. Order completely unreliable 
- *   (not fifo at all) as soon as you have 3 instances or more.
- * - same for open(O_EXCL) */
+ * Instances pinning their threads (uct "pin_threads") also claim cpus here
+ * so that they get disjoint cpu sets. */
 
 
 /* Handle running pachi as different users ?
@@ -86,26 +86,21 @@ mutex_unlock(pthread_mutex_t *mutex)
 	fail("pthread_mutex_unlock");
 }
 
-static int
-ticket_lock(ticket_lock_t *ticket)
-{
-	if (!mutex_lock(&ticket->mutex))  /* Mutex owner died, recover... */
-		if (DEBUGL(2)) fprintf(stderr, "fifo: kicking stale instance\n");
-	return 0;
-}
-
-static void
-ticket_unlock(ticket_lock_t *ticket, int me)
-{
-	mutex_unlock(&ticket->mutex);
-}
-
-
 /***************************************************************************************************/
 /* Shared memory */
 
-#define SHM_NAME    "pachi_fifo"
-#define SHM_MAGIC   ((int)0xf1f0c0de)
+#define SHM_NAME    "pachi_fifo3"
+#define SHM_MAGIC   ((int)0xf1f0c0e0)
+
+#define FIFO_MAX_CPUS       1024
+#define FIFO_MAX_INSTANCES  64
+
+typedef struct {
+	pid_t pid;		/* 0: free slot */
+	int   demand;		/* enum fifo_demand */
+	int   want;		/* Threads we'd like */
+	int   granted;		/* Cores we may use */
+} fifo_slot_t;
 
 typedef struct {
 	unsigned int size;
@@ -113,8 +108,13 @@ typedef struct {
 	int          ready;
 	int          timestamp;
 	
-	/* sched stuff */
-	ticket_lock_t queue;
+	/* sched stuff, lock protects everything below */
+	ticket_lock_t lock;
+	int         ncpus;
+	fifo_slot_t slots[FIFO_MAX_INSTANCES];
+
+	/* Cpu claims: owner pid by cpu, 0 if free */
+	pid_t cpu_owner[FIFO_MAX_CPUS];
 } sched_shm_t;
 
 static unsigned int shm_size = sizeof(sched_shm_t);
@@ -144,7 +144,8 @@ create_shm()
 	shm->ready = 0;
 	shm->timestamp = time(NULL);
        
-	ticket_init(&shm->queue);
+	ticket_init(&shm->lock);
+	shm->ncpus = get_nprocessors();
 
 	shm->ready = 1;
 	if (DEBUGL(2)) fprintf(stderr, "Fifo: created shared memory, id: %i\n", shm->timestamp);
@@ -175,22 +176,157 @@ attach_shm()
 
 /***************************************************************************************************/
 
+static fifo_slot_t *me = NULL;
+
+static bool
+pid_alive(pid_t pid)
+{
+	return (pid && (kill(pid, 0) == 0 || errno == EPERM));
+}
+
+/* Hand out @demand instances' shares from @free cores: one core at a time
+ * to each instance still short of what it wants. */
+static void
+share_cores(int demand, int *free, int min)
+{
+	bool more = true;
+	while (*free > 0 && more) {
+		more = false;
+		for (int i = 0; i < FIFO_MAX_INSTANCES && *free > 0; i++) {
+			fifo_slot_t *s = &shm->slots[i];
+			if (!s->pid || s->demand != demand || s->granted >= s->want)  continue;
+			s->granted++;  (*free)--;
+			more = true;
+		}
+	}
+
+	for (int i = 0; i < FIFO_MAX_INSTANCES; i++) {
+		fifo_slot_t *s = &shm->slots[i];
+		if (s->pid && s->demand == demand && s->granted < min)
+			s->granted = min;
+	}
+}
+
+/* Recompute everyone's grant. Must hold shm lock. */
+static void
+compute_grants(void)
+{
+	for (int i = 0; i < FIFO_MAX_INSTANCES; i++) {
+		fifo_slot_t *s = &shm->slots[i];
+		if (s->pid && !pid_alive(s->pid))  /* Instance disappeared */
+			memset(s, 0, sizeof(*s));
+		s->granted = 0;
+	}
+
+	int free = shm->ncpus;
+	share_cores(FIFO_THINK,  &free, 1);
+	share_cores(FIFO_PONDER, &free, 1);
+}
+
+/* Take a free slot for this process. */
+static void
+fifo_register(void)
+{
+	mutex_lock(&shm->lock.mutex);
+	compute_grants();  /* Drop dead instances */
+	for (int i = 0; i < FIFO_MAX_INSTANCES && !me; i++)
+		if (!shm->slots[i].pid)
+			me = &shm->slots[i];
+	if (!me)  die("fifo: too many pachi instances (max %i)\n", FIFO_MAX_INSTANCES);
+	me->pid = getpid();
+	me->demand = FIFO_IDLE;
+	mutex_unlock(&shm->lock.mutex);
+}
+
+static void
+fifo_done(void)
+{
+	fifo_release_cpus();
+	mutex_lock(&shm->lock.mutex);
+	memset(me, 0, sizeof(*me));
+	compute_grants();
+	mutex_unlock(&shm->lock.mutex);
+}
+
 void
 fifo_init(void)
 {
 	if (!attach_shm())
 		create_shm();
+
+	fifo_register();
+	atexit(fifo_done);
+}
+
+/* Forked child: get a slot of our own, parent keeps its. */
+void
+fifo_fork_child(void)
+{
+	if (!shm)  return;
+	me = NULL;
+	fifo_register();
 }
 
 int
-fifo_task_queue(void)
+fifo_cores_request(enum fifo_demand demand, int want)
 {
-	return ticket_lock(&shm->queue);
+	mutex_lock(&shm->lock.mutex);
+	me->demand = demand;
+	me->want = want;
+	compute_grants();
+	int granted = me->granted;
+	mutex_unlock(&shm->lock.mutex);
+
+	if (DEBUGL(3) && demand != FIFO_IDLE)
+		fprintf(stderr, "fifo: %i cores granted (%i wanted)\n", granted, want);
+	return granted;
+}
+
+int
+fifo_cores_granted(void)
+{
+	return *(volatile int*)&me->granted;
+}
+
+
+/***************************************************************************************************/
+/* Cpu claims */
+
+int
+fifo_claim_cpus(int *cpus, int n, int want)
+{
+	pid_t pid = getpid();
+	int claimed = 0;
+
+	fifo_release_cpus();
+	mutex_lock(&shm->lock.mutex);
+	for (int i = 0; i < n && claimed < want; i++) {
+		int cpu = cpus[i];
+		if (cpu < 0 || cpu >= FIFO_MAX_CPUS)  continue;
+		if (pid_alive(shm->cpu_owner[cpu]))  continue;
+		shm->cpu_owner[cpu] = pid;
+		cpus[claimed++] = cpu;
+	}
+	mutex_unlock(&shm->lock.mutex);
+
+	if (claimed < want) {  /* Not enough cpus left, share them. */
+		if (DEBUGL(2))  fprintf(stderr, "fifo: only %i free cpus (%i wanted)\n", claimed, want);
+		fifo_release_cpus();
+		return 0;
+	}
+
+	if (DEBUGL(2))  fprintf(stderr, "fifo: claimed %i cpus\n", claimed);
+	return claimed;
 }
 
 void
-fifo_task_done(int ticket)
+fifo_release_cpus(void)
 {
-	ticket_unlock(&shm->queue, ticket);
+	pid_t pid = getpid();
+	mutex_lock(&shm->lock.mutex);
+	for (int i = 0; i < FIFO_MAX_CPUS; i++)
+		if (shm->cpu_owner[i] == pid)
+			shm->cpu_owner[i] = 0;
+	mutex_unlock(&shm->lock.mutex);
 }
 
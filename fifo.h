@@ -1,14 +1,40 @@
 #ifndef PACHI_FIFO_H
 #define PACHI_FIFO_H
 
+#include <limits.h>
+
+enum fifo_demand {
+	FIFO_IDLE,
+	FIFO_PONDER,
+	FIFO_THINK,
+};
+
 #ifdef PACHI_FIFO
 
 void fifo_init(void);
-int  fifo_task_queue(void);
-void fifo_task_done(int ticket);
+/* Forked instance (--games): register as a new instance. */
+void fifo_fork_child(void);
+
+/* Tell core broker what we're doing and how many threads we'd like.
+ * Returns number of cores granted (at least 1 unless idle). */
+int  fifo_cores_request(enum fifo_demand demand, int want);
+/* Cores currently granted, changes as other instances come and go. */
+int  fifo_cores_granted(void);
+
+/* Claim @want cpus among @cpus (in order of preference) for this instance.
+ * Cpus claimed by running instances are skipped. Returns number of cpus
+ * claimed (stored at start of @cpus), 0 if fewer than @want were free:
+ * then nothing is claimed and cpus are shared. */
+int  fifo_claim_cpus(int *cpus, int n, int want);
+void fifo_release_cpus(void);
 
 #else
 #define fifo_init() ((void)0)
+#define fifo_fork_child() ((void)0)
+static inline int fifo_cores_request(enum fifo_demand demand, int want)  {  return want;  }
+#define fifo_cores_granted()  (INT_MAX)
+#define fifo_claim_cpus(cpus, n, want)  (0)
+#define fifo_release_cpus()  ((void)0)
 #endif /* FIFO */
 
 #endif /* PACHI_FIFO_H */
@@ -693,7 +693,7 @@ cmd_gogui_show_spatial(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
 	spatial_t s;
 	spatial_from_board(pc, &s, b, &m);
 	s.dist = spatial_dist;
-	spatial_t *s2 = spatial_dict_lookup(spat_dict, s.dist, spatial_hash(0, &s));
+	spatial_t *s2 = spatial_dict_find(spat_dict, &s);
 	if (s2)	printf("TEXT matches s%i:%i\n", spatial_dist, spatial_id(s2, spat_dict));
 	else	printf("TEXT unknown s%i spatial\n", spatial_dist);
 
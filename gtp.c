@@ -1,6 +1,7 @@
 #define DEBUG
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -19,10 +20,15 @@
 #include "version.h"
 #include "timeinfo.h"
 #include "ownermap.h"
+#include "dcnn.h"
 #include "gogui.h"
 #include "t-predict/predict.h"
+#include "t-predict/review.h"
 #include "t-unit/test.h"
-#include "fifo.h"
+#include "perfstats.h"
+#include "sgf.h"
+#include "tactics/selfatari.h"
+#include "tactics/seki.h"
 
 /* Sleep 5 seconds after a game ends to give time to kill the program. */
 #define GAME_OVER_SLEEP 5
@@ -70,7 +76,7 @@ gtp_flush(gtp_t *gtp)
 	gtp->flushed = true;
 	
 	putchar('\n');
-	fflush(stdout);		/* in network mode stdout is not line-buffered */
+	fflush(stdout);		/* stdout is fully buffered */
 }
 
 /* Output one line, end-of-line \n added automatically. */
@@ -131,8 +137,9 @@ gtp_error_printf(gtp_t *gtp, const char *format, ...)
 #define gtp_prefix  dont_call_gtp_prefix
 
 
-/* List of public gtp commands. The internal command pachi-genmoves is not exported,
- * it should only be used between master and slaves of the distributed engine.
+/* List of public gtp commands. The internal commands pachi-genmoves and pachi-dcnn_*
+ * are not exported, they should only be used between master and slaves of the
+ * distributed engine.
  * kgs-chat command enabled only if --kgs-chat passed (makes kgsgtp-3.5.20+ crash).
  * For now only uct engine supports gogui-analyze_commands. */
 static char*
@@ -143,6 +150,7 @@ known_commands(gtp_t *gtp)
 	for (int i = 0; commands[i].cmd; i++) {
 		char *cmd = commands[i].cmd;
 		if (str_prefix("pachi-genmoves", cmd))           continue;
+		if (str_prefix("pachi-dcnn_", cmd))              continue;
 		if (!strcmp("kgs-chat", cmd) && !gtp->kgs_chat)  continue;
 		sbprintf(buf, "%s\n", commands[i].cmd);
 	}
@@ -382,6 +390,41 @@ cmd_play(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
 	return P_OK;
 }
 
+/* gogui-play_sequence <color> <coord> [<color> <coord> ...]
+ * Play several moves in one command (GoGui uses it to setup positions,
+ * handy for replaying games too). Engine's notify() only sees one
+ * command for the whole sequence (distributed engine sends it to slaves
+ * in one go), notify_play() still gets each move. Stops at first
+ * illegal move, moves before that are played. */
+static enum parse_code
+cmd_gogui_play_sequence(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
+{
+	char *arg;
+	gtp_arg(arg);
+	move_t m;
+	do {
+		m.color = str2stone(arg);
+		gtp_arg(arg);
+		m.coord = str2coord(arg);
+
+		bool print = false;
+		if (e->notify_play)
+			e->notify_play(e, b, &m, "", &print);
+		if (gtp_board_play(gtp, b, &m) < 0) {
+			if (DEBUGL(0))  fprintf(stderr, "! ILLEGAL MOVE %s %s\n", stone2str(m.color), coord2sstr(m.coord));
+			gtp_error(gtp, "illegal move");
+			return P_OK;
+		}
+		gtp_arg_optional(arg);
+	} while (*arg);
+
+	time_start_timer(&ti[stone_other(m.color)]);
+
+	if (DEBUGL(4) && debug_boardprint)
+		engine_board_print(e, b, stderr);
+	return P_OK;
+}
+
 static enum parse_code
 cmd_pachi_predict(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
 {
@@ -402,6 +445,63 @@ cmd_pachi_predict(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
 	return P_OK;
 }
 
+/* pachi-predict-stats [file]: show prediction stats so far, or save
+ * them to file for pachi-predict-merge (parallel predict runs). */
+static enum parse_code
+cmd_pachi_predict_stats(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
+{
+	char *filename = NULL;
+	gtp_arg_optional(filename);
+	if (*filename) {
+		if (!predict_stats_save(filename))
+			gtp_error(gtp, "couldn't save stats");
+		return P_OK;
+	}
+
+	char *str = predict_stats_report();
+	gtp_reply(gtp, str);
+	free(str);
+	return P_OK;
+}
+
+/* pachi-predict-merge file...: combined stats of parallel predict runs */
+static enum parse_code
+cmd_pachi_predict_merge(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
+{
+	char *files[256];
+	int n = 0;
+	for (; *gtp->next && n < 256; n++)
+		gtp_arg(files[n]);
+	if (!n)  {  gtp_error(gtp, "argument missing");  return P_OK;  }
+
+	char *str = predict_stats_merge(files, n);
+	if (!str)  {  gtp_error(gtp, "error merging stats");  return P_OK;  }
+	gtp_reply(gtp, str);
+	free(str);
+	return P_OK;
+}
+
+/* pachi-review <color> <coord>: game review, see t-predict/review.c */
+static enum parse_code
+cmd_pachi_review(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
+{
+	move_t m;
+	char *arg;
+	gtp_arg(arg);
+	m.color = str2stone(arg);
+	gtp_arg(arg);
+	m.coord = str2coord(arg);
+
+	char *str = review_move(b, e, ti, &m);
+
+	/* Add to gtp move history. */
+	gtp_add_move(gtp, &m);
+	
+	gtp_reply(gtp, str);
+	free(str);
+	return P_OK;
+}
+
 static coord_t
 genmove(board_t *b, enum stone color, engine_t *e, time_info_t *ti, gtp_t *gtp, engine_genmove_t genmove_func)
 {
@@ -411,23 +511,12 @@ genmove(board_t *b, enum stone color, engine_t *e, time_info_t *ti, gtp_t *gtp,
 	if (!ti[color].timer_start)    /* First game move. */
 		time_start_timer(&ti[color]);
 	
-#ifdef PACHI_FIFO   /* Coordinate between multiple Pachi instances. */
-	double time_wait = time_now();
-	int ticket = fifo_task_queue();
-	double time_start = time_now();
-#endif
-
 	time_info_t *ti_genmove = time_info_genmove(b, ti, color);
 	coord_t c = (b->fbook ? fbook_check(b) : pass);
 	bool pass_all_alive = !strcasecmp(gtp->cmd, "kgs-genmove_cleanup");
 	if (is_pass(c))
 		c = genmove_func(e, b, ti_genmove, color, pass_all_alive);
 
-#ifdef PACHI_FIFO	
-	if (DEBUGL(2)) fprintf(stderr, "fifo: genmove in %0.2fs  (waited %0.1fs)\n", time_now() - time_start, time_start - time_wait);
-	fifo_task_done(ticket);
-#endif
-
 	if (!is_resign(c)) {
 		move_t m = move(c, color);
 		if (gtp_board_play(gtp, b, &m) < 0)
@@ -521,6 +610,138 @@ cmd_pachi_genmoves(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
 	return P_OK;
 }
 
+/* Distributed engine: dcnn best moves at the root, "coord prob" on each line.
+ * Slaves without dcnn reply nothing. */
+static enum parse_code
+cmd_pachi_dcnn_policy(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
+{
+	char *arg;
+	gtp_arg(arg);
+#ifdef DCNN
+	if (!using_dcnn(b))  return P_OK;
+	
+	enum stone color = str2stone(arg);
+	float   r[19 * 19];
+	coord_t best_c[DCNN_BEST_N];
+	float   best_r[DCNN_BEST_N];
+	dcnn_evaluate_quiet(b, color, r);
+	get_dcnn_best_moves(b, r, best_c, best_r, DCNN_BEST_N);
+	for (int i = 0; i < DCNN_BEST_N; i++)
+		if (!is_pass(best_c[i]))
+			gtp_printf(gtp, "%s %.4f\n", coord2sstr(best_c[i]), best_r[i]);
+#endif
+	return P_OK;
+}
+
+#ifdef DCNN
+/* Set up position for pachi-policy_batch from args up to ';'.
+ * Returns color to play or S_NONE if position is bad. */
+static enum stone
+gtp_dcnn_batch_position(gtp_t *gtp, board_t *b)
+{
+	int size = board_rsize(b);
+	enum stone color = S_BLACK;
+	while (1) {
+		char *arg;
+		gtp_arg_optional(arg);
+		if (!*arg || !strcmp(arg, ";"))  break;
+		if (!strcasecmp(arg, "b") || !strcasecmp(arg, "black"))  {  color = S_BLACK;  continue;  }
+		if (!strcasecmp(arg, "w") || !strcasecmp(arg, "white"))  {  color = S_WHITE;  continue;  }
+
+		if ((int)strlen(arg) == size * size) {  /* Compact board: blacks first, no captures then */
+			for (int k = 0; k < 2; k++)
+				for (int i = 0; i < size * size; i++) {
+					char ch = toupper(arg[i]);
+					if (!strchr(".XO", ch))  return S_NONE;
+					if (ch != "XO"[k])  continue;
+					move_t m = move(coord_xy(i % size + 1, size - i / size), (k ? S_WHITE : S_BLACK));
+					if (board_play(b, &m) < 0)  return S_NONE;
+				}
+			continue;
+		}
+
+		int x = tolower(arg[0]) - 'a' - (tolower(arg[0]) > 'i') + 1, y = atoi(arg + 1);
+		bool is_move = (isalpha(arg[0]) && tolower(arg[0]) != 'i' && x <= size && y >= 1 && y <= size);
+		if (!is_move && strcasecmp(arg, "pass"))  return S_NONE;
+		move_t m = move((is_move ? coord_xy(x, y) : pass), color);
+		if (board_play(b, &m) < 0)  return S_NONE;
+		color = stone_other(color);
+	}
+	return color;
+}
+#endif
+
+/* Policy for many positions in one go (dcnn policy server):
+ *   pachi-policy_batch N pos1 ; pos2 ; ...
+ * Position is a move list from empty board, colors alternate starting with
+ * black, "b" / "w" sets color of next move (or color to play at the end).
+ * Or a compact board: size*size chars '.' 'X' 'O' in rows from the top,
+ * followed by color to play. Board size, komi as current board.
+ * Reply: one line per position, "i move prob move prob ..." for top N moves.
+ * Positions are evaluated as one batch, see dcnn_evaluate_batch(). */
+static enum parse_code
+cmd_pachi_policy_batch(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
+{
+	char *arg;
+	gtp_arg(arg);
+#ifdef DCNN
+	int nbest = atoi(arg);
+	if (nbest < 1 || nbest > board_rsize(b) * board_rsize(b))  {  gtp_error(gtp, "bad N");  return P_OK;  }
+	if (!using_dcnn(b))  {  gtp_error(gtp, "dcnn not available");  return P_OK;  }
+
+	int n = 0, alloc = 16;
+	board_t **boards = cmalloc(alloc * sizeof(board_t*));
+	enum stone *colors = cmalloc(alloc * sizeof(enum stone));
+	while (*gtp->next) {
+		if (n == alloc) {
+			alloc *= 2;
+			boards = crealloc(boards, alloc * sizeof(board_t*));
+			colors = crealloc(colors, alloc * sizeof(enum stone));
+		}
+		board_t *b2 = boards[n] = board_new(board_rsize(b), NULL);
+		b2->komi = b->komi;  b2->rules = b->rules;
+		colors[n++] = gtp_dcnn_batch_position(gtp, b2);
+		if (colors[n - 1] == S_NONE) {
+			gtp_error_printf(gtp, "bad position %i\n", n - 1);
+			break;
+		}
+	}
+
+	int size2 = board_rsize(b) * board_rsize(b);
+	if (!gtp->error && n) {
+		float *r = cmalloc(n * size2 * sizeof(float));
+		dcnn_evaluate_batch(boards, colors, r, n);
+		coord_t best_c[nbest];
+		float   best_r[nbest];
+		for (int i = 0; i < n; i++) {
+			get_dcnn_best_moves(boards[i], r + i * size2, best_c, best_r, nbest);
+			strbuf(buf, 4096);
+			sbprintf(buf, "%i", i);
+			for (int j = 0; j < nbest && !is_pass(best_c[j]); j++)
+				sbprintf(buf, " %s %.4f", coord2sstr(best_c[j]), best_r[j]);
+			gtp_printf(gtp, "%s\n", buf->str);
+		}
+		free(r);
+	}
+
+	for (int i = 0; i < n; i++)
+		board_delete(&boards[i]);
+	free(boards);
+	free(colors);
+#else
+	gtp_error(gtp, "dcnn not compiled in");
+#endif
+	return P_OK;
+}
+
+/* Distributed engine: root priors from the master, only used by uct slaves
+ * (see uct/slave.c:uct_notify()). */
+static enum parse_code
+cmd_pachi_dcnn_priors(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
+{
+	return P_OK;
+}
+
 static void
 gtp_reset_engine(gtp_t *gtp, board_t *b, engine_t *e, time_info_t *ti)
 {
@@ -564,10 +785,41 @@ stop_analyzing(gtp_t *gtp, board_t *b, engine_t *e)
 {
 	gtp->analyze_running = false;
 	e->analyze(e, b, S_BLACK, 0);
+	if (gtp->analyze_paused) {  gtp->analyze_paused = false;  return;  }
 	printf("\n");  /* end of lz-analyze output */
 	fflush(stdout);
 }
 
+/* Query received while analyzing: lz-analyze output must end here but
+ * we keep searching in the background, frontends usually restart
+ * lz-analyze right after and get the same tree back. */
+static void
+pause_analyzing(gtp_t *gtp, board_t *b, engine_t *e)
+{
+	if (gtp->analyze_paused)  return;
+	gtp->analyze_paused = true;
+	e->analyze(e, b, S_BLACK, -1);
+	printf("\n");  /* end of lz-analyze output */
+	fflush(stdout);
+}
+
+/* Commands that only look at the current state. They are answered while
+ * background search (pondering, lz-analyze) keeps running, and engines
+ * answer from the live tree when they can (see uct_best_moves()). */
+static bool
+gtp_is_query(char *cmd)
+{
+	static char *queries[] = {
+		"protocol_version", "name", "echo", "version", "list_commands",
+		"known_command", "showboard", "pachi-score_est", "score_est",
+		"pachi-getoption", "gogui-analyze_commands", "gogui-influence",
+		"gogui-score_est", "gogui-best_moves", "gogui-winrates", 0
+	};
+	for (int i = 0; queries[i]; i++)
+		if (!strcasecmp(cmd, queries[i]))  return true;
+	return false;
+}
+
 /* Start pondering and output stats for the sake of frontend running Pachi.
  * Stop processing when we receive some other command.
  * Similar to Leela-Zero's lz-analyze so we can feed data to Lizzie / Sabaki.
@@ -596,6 +848,7 @@ cmd_lz_analyze(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
 	gtp_printf(gtp, "");   /* just "= \n" output, last newline will be sent when we stop analyzing */
 	gtp_set_analyze_mode(gtp, b, e, ti, true);
 	gtp->analyze_running = true;
+	gtp->analyze_paused = false;
 	e->analyze(e, b, color, 1);
 	
 	return P_OK;
@@ -683,6 +936,28 @@ cmd_pachi_score_est(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
 	return P_OK;
 }
 
+#ifdef PERFSTATS
+/* Show hot path profiling counters (all searches since last reset).
+ * With "reset" arg, start counting from zero again. */
+static enum parse_code
+cmd_pachi_perfstats(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
+{
+	char *arg;
+	gtp_arg_optional(arg);
+	if (!strcmp(arg, "reset")) {
+		perfstats_reset();
+		return P_OK;
+	}
+
+	perfstats_t stats;
+	perfstats_get(&stats);
+	strbuf(buf, 8192);
+	perfstats_print(buf, &stats);
+	gtp_printf(gtp, "%s", buf->str);
+	return P_OK;
+}
+#endif
+
 static enum parse_code
 cmd_pachi_setoption(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
 {
@@ -763,14 +1038,23 @@ cmd_final_status_list_alive(char *arg, board_t *b, engine_t *e, gtp_t *gtp)
 static int
 cmd_final_status_list_seki(char *arg, board_t *b, engine_t *e, gtp_t *gtp)
 {
+	/* Local sekis we can tell right away, others from ownermap. */
+	bool seki[BOARD_MAX_COORDS];
+	memset(seki, 0, sizeof(seki));
+	int found = seki_find(b, seki);
+
 	ownermap_t *ownermap = engine_ownermap(e, b);
-	if (!ownermap) {  gtp_error(gtp, "no ownermap");  return -1;  }
+	if (!ownermap && !found) {  gtp_error(gtp, "no ownermap");  return -1;  }
 	int printed = 0;
 
 	move_queue_t sekis;  mq_init(&sekis);
 	foreach_point(b) {
 		if (board_at(b, c) == S_OFFBOARD)  continue;
-		if (ownermap_judge_point(ownermap, c, 0.80) != PJ_SEKI)  continue;
+		if (seki[c] && group_at(b, c)) {
+			mq_add(&sekis, group_at(b, c), 0);
+			mq_nodup(&sekis);
+		}
+		if (!ownermap || ownermap_judge_point(ownermap, c, 0.80) != PJ_SEKI)  continue;
 
 		foreach_neighbor(b, c, {
 			group_t g = group_at(b, c);
@@ -827,7 +1111,282 @@ cmd_final_status_list(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
 	return P_OK;
 }
 
-/* Handle undo at the gtp level. */
+/* pachi-setup_moves <color> <coord> [<color> <coord> ...]
+ * Setup game from scratch with given moves (board size, komi and handicap
+ * are kept). For frontends syncing position or reconnecting, which would
+ * otherwise send clear_board and one play per move.
+ * If current game is a prefix of the list only the new moves are played
+ * (engine keeps its state, search tree is reused). Otherwise moves go on
+ * the board directly and engine is reset once at the end instead of being
+ * notified of each move, except for engines that keep their state across
+ * games (scanning engines, distributed engine). */
+static enum parse_code
+cmd_pachi_setup_moves(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
+{
+	int max = sizeof(gtp->move) / sizeof(gtp->move[0]);
+	move_t *moves = calloc2(max, move_t);
+	int n = 0;
+
+	char *arg;
+	gtp_arg_optional(arg);
+	while (*arg) {
+		if (n == max) {  gtp_error(gtp, "too many moves");  goto done;  }
+		moves[n].color = str2stone(arg);
+		gtp_arg_optional(arg);
+		if (!*arg) {  gtp_error(gtp, "argument missing");  goto done;  }
+		moves[n++].coord = str2coord(arg);
+		gtp_arg_optional(arg);
+	}
+
+	/* Continuation of current game ? */
+	bool prefix = (n >= gtp->moves);
+	for (int i = 0; prefix && i < gtp->moves; i++)
+		prefix = (moves[i].coord == gtp->move[i].coord &&
+			  moves[i].color == gtp->move[i].color);
+
+	if (!prefix) {
+		int handicap = b->handicap;
+		board_clear(b);
+		b->handicap = handicap;
+		gtp->moves = 0;
+	}
+
+	bool notify = (prefix || e->keep_on_clear);
+	for (int i = gtp->moves; i < n; i++) {
+		bool print = false;
+		if (notify && e->notify_play)
+			e->notify_play(e, b, &moves[i], "", &print);
+		if (gtp_board_play(gtp, b, &moves[i]) < 0) {
+			if (DEBUGL(0))  fprintf(stderr, "! ILLEGAL MOVE %s %s\n",
+						stone2str(moves[i].color), coord2sstr(moves[i].coord));
+			gtp_error(gtp, "illegal move");
+			break;
+		}
+	}
+
+	if (!notify)
+		gtp_reset_engine(gtp, b, e, ti);
+	if (DEBUGL(4) && debug_boardprint)
+		engine_board_print(e, b, stderr);
+ done:
+	free(moves);
+	return P_OK;
+}
+
+/* Play sgf move, engine gets notified if @notify (reply printed if @reply).
+ * Returns error message or NULL. */
+static char *
+gtp_sgf_play(gtp_t *gtp, board_t *b, engine_t *e, move_t *m, bool notify, bool reply)
+{
+	if (gtp->moves == (int)(sizeof(gtp->move) / sizeof(gtp->move[0])))
+		return "game too long";
+	if (!board_is_valid_move(b, m))
+		return "illegal move";
+
+	bool print = false;
+	char *str = (notify && e->notify_play ? e->notify_play(e, b, m, "", &print) : NULL);
+	if (reply && str && *str)
+		gtp_printf(gtp, "%s\n", str);
+	if (gtp_board_play(gtp, b, m) < 0)
+		return "illegal move";
+	return NULL;
+}
+
+/* Setup new game from sgf game @g: board size, rules, komi, setup stones
+ * and handicap (given as setup stones or first black moves, like sgf2gtp).
+ * @moves_start is set to first move after handicap stones.
+ * Returns error message or NULL. */
+static char *
+gtp_sgf_setup(gtp_t *gtp, board_t *b, engine_t *e, sgf_game_t *g, bool notify, bool reply, int *moves_start)
+{
+#ifdef BOARD_SIZE
+	if (g->size != BOARD_SIZE)  return "board size not supported";
+#endif
+	if (g->size != board_rsize(b))
+		board_resize(b, g->size);
+	board_clear(b);
+	gtp->played_games++;
+	gtp->moves = 0;
+
+	if (!pachi_options()->forced_rules) {
+		char *rules = (*g->rules ? g->rules : "chinese");
+		if (!board_set_rules(b, rules)) {
+			if (DEBUGL(2))  fprintf(stderr, "sgf: unknown rules '%s', using chinese\n", rules);
+			board_set_rules(b, "chinese");
+		}
+	}
+	if (g->has_komi)
+		b->komi = g->komi;
+
+	int handicap = g->handicap;
+	for (int i = 0; i < g->nsetup; i++) {
+		move_t m = sgf_move(&g->setup[i], g->size);
+		char *err = gtp_sgf_play(gtp, b, e, &m, notify, reply);
+		if (err)  return err;
+		if (handicap && m.color == S_BLACK) {  handicap--;  b->handicap++;  }
+	}
+
+	int i = 0;
+	for (; handicap && i < g->nmoves; i++, handicap--) {
+		move_t m = sgf_move(&g->moves[i], g->size);
+		if (m.color != S_BLACK || is_pass(m.coord))  break;
+		char *err = gtp_sgf_play(gtp, b, e, &m, notify, reply);
+		if (err)  return err;
+		b->handicap++;
+	}
+	*moves_start = i;
+	return NULL;
+}
+
+/* loadsgf <file> [<move_number>]
+ * Load first game in sgf file, position before move <move_number> is
+ * played (whole game by default). Replies color to play.
+ * Engine is reset once at the end, except for engines that keep their
+ * state across games (notified of each move then). */
+static enum parse_code
+cmd_loadsgf(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
+{
+	char *filename, *arg;
+	gtp_arg(filename);
+	gtp_arg_optional(arg);
+	int move_number = (*arg ? atoi(arg) : INT_MAX);
+
+	FILE *f = fopen(filename, "r");
+	if (!f) {  gtp_error(gtp, "cannot open file");  return P_OK;  }
+
+	sgf_game_t g;  sgf_game_init(&g);
+	bool error = false;
+	if (!sgf_read_game(f, &g, &error) || error) {
+		gtp_error(gtp, "cannot load file");
+		goto done;
+	}
+
+	bool notify = e->keep_on_clear;
+	int start;
+	char *err = gtp_sgf_setup(gtp, b, e, &g, notify, false, &start);
+	for (int i = start; !err && i < g.nmoves && i < move_number - 1; i++) {
+		move_t m = sgf_move(&g.moves[i], g.size);
+		err = gtp_sgf_play(gtp, b, e, &m, notify, false);
+	}
+
+	if (!notify)
+		gtp_reset_engine(gtp, b, e, ti);
+	if (err)  gtp_error(gtp, err);
+	else      gtp_reply(gtp, stone2str(board_to_play(b)));
+	if (DEBUGL(3) && debug_boardprint)
+		engine_board_print(e, b, stderr);
+ done:
+	sgf_game_done(&g);
+	fclose(f);
+	return P_OK;
+}
+
+/* Iterate over games [first, first + count) of sgf collection, calling
+ * @play_game for each. Malformed games are skipped. Game index is used
+ * to get to @first quickly. */
+typedef void (*gtp_sgf_game_t)(gtp_t *gtp, board_t *b, engine_t *e, time_info_t *ti, sgf_game_t *g);
+
+static enum parse_code
+gtp_sgf_games(gtp_t *gtp, board_t *b, engine_t *e, time_info_t *ti, gtp_sgf_game_t play_game)
+{
+	char *filename, *arg;
+	gtp_arg(filename);
+	gtp_arg_optional(arg);
+	int first = (*arg ? atoi(arg) : 0);
+	gtp_arg_optional(arg);
+	int count = (*arg ? atoi(arg) : INT_MAX);
+
+	FILE *f = fopen(filename, "r");
+	if (!f) {  gtp_error(gtp, "cannot open file");  return P_OK;  }
+	if (first) {
+		sgf_index_t *idx = sgf_index(filename);
+		bool found = (idx && sgf_seek_game(f, idx, first));
+		sgf_index_free(idx);
+		if (!found) {  gtp_error(gtp, "no such game");  fclose(f);  return P_OK;  }
+	}
+
+	sgf_game_t g;  sgf_game_init(&g);
+	bool error;
+	for (int n = first; n - first < count && sgf_read_game(f, &g, &error); n++) {
+		if (error) {
+			if (DEBUGL(1))  fprintf(stderr, "%s: game %i: malformed, skipping\n", filename, n);
+			continue;
+		}
+		play_game(gtp, b, e, ti, &g);
+	}
+	sgf_game_done(&g);
+	fclose(f);
+
+	/* Replies, if any, printed as we go. */
+	gtp_reply(gtp, "");
+	return P_OK;
+}
+
+static void
+gtp_sgf_replay_game(gtp_t *gtp, board_t *b, engine_t *e, time_info_t *ti, sgf_game_t *g)
+{
+	int start;
+	char *err = gtp_sgf_setup(gtp, b, e, g, e->keep_on_clear, true, &start);
+	if (!e->keep_on_clear)
+		gtp_reset_engine(gtp, b, e, ti);
+
+	for (int i = start; !err && i < g->nmoves; i++) {
+		move_t m = sgf_move(&g->moves[i], g->size);
+		err = gtp_sgf_play(gtp, b, e, &m, true, true);
+	}
+	if (err && DEBUGL(1))
+		fprintf(stderr, "game %i: %s, stopping there\n", gtp->played_games, err);
+}
+
+/* pachi-sgf-replay <file> [<first> [<count>]]
+ * Replay games in sgf collection, engine notified of every move (for
+ * scanning engines, patternscan / josekiscan). Engine replies printed
+ * one per line. Games counted from 0. */
+static enum parse_code
+cmd_pachi_sgf_replay(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
+{
+	return gtp_sgf_games(gtp, b, e, ti, gtp_sgf_replay_game);
+}
+
+static void
+gtp_sgf_predict_game(gtp_t *gtp, board_t *b, engine_t *e, time_info_t *ti, sgf_game_t *g)
+{
+	if (g->handicap > 1)  return;
+
+	int start;
+	char *err = gtp_sgf_setup(gtp, b, e, g, e->keep_on_clear, false, &start);
+	if (!e->keep_on_clear)
+		gtp_reset_engine(gtp, b, e, ti);
+
+	for (int i = start; !err && i < g->nmoves; i++) {
+		move_t m = sgf_move(&g->moves[i], g->size);
+		if (gtp->moves == (int)(sizeof(gtp->move) / sizeof(gtp->move[0])))  err = "game too long";
+		else if (!board_is_valid_move(b, &m))                             err = "illegal move";
+		if (err)  break;
+
+		char *str = predict_move(b, e, ti, &m, gtp->played_games);
+		gtp_add_move(gtp, &m);
+		if (str)  gtp_printf(gtp, "%s\n", str);
+		free(str);
+	}
+	if (err && DEBUGL(1))
+		fprintf(stderr, "game %i: %s, stopping there\n", gtp->played_games, err);
+}
+
+/* pachi-sgf-predict <file> [<first> [<count>]]
+ * pachi-predict on every move of even games in sgf collection
+ * (handicap games are skipped, like t-predict does). */
+static enum parse_code
+cmd_pachi_sgf_predict(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
+{
+	return gtp_sgf_games(gtp, b, e, ti, gtp_sgf_predict_game);
+}
+
+static void replay_board(gtp_t *gtp, board_t *b, engine_t *e);
+
+/* Handle undo at the gtp level.
+ * Engines that support it follow the undo (uct re-roots its tree),
+ * otherwise engine gets reset and game replayed. */
 static enum parse_code
 cmd_undo(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
 {
@@ -841,6 +1400,11 @@ cmd_undo(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
 	if (!gtp->moves) {  gtp_error(gtp, "no moves to undo");  return P_OK;  }
 	if (b->moves == b->handicap) {  gtp_error(gtp, "can't undo handicap");  return P_OK;  }
 	gtp->moves--;
+
+	if (e->undo && !gtp->undo_pending) {
+		replay_board(gtp, b, NULL);
+		if (e->undo(e, b))  return P_OK;
+	}
 	
 	/* Send a play command to engine so it stops pondering (if it was pondering).  */
 	move_t m = move(pass, board_to_play(b));  bool print;
@@ -853,29 +1417,41 @@ cmd_undo(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
 	return P_OK;
 }
 
+/* Reset board and replay game from gtp move history.
+ * Engine gets notified of moves if @e is set. */
 static void
-undo_reload_engine(gtp_t *gtp, board_t *b, engine_t *e, time_info_t *ti)
+replay_board(gtp_t *gtp, board_t *b, engine_t *e)
 {
-	if (DEBUGL(3)) fprintf(stderr, "reloading engine after undo(s).\n");
-	
-	gtp->undo_pending = false;
-
-	gtp_reset_engine(gtp, b, e, ti);
-	
-	/* Reset board */
 	int handicap = b->handicap;
 	board_clear(b);
 	b->handicap = handicap;
 
 	for (int i = 0; i < gtp->moves; i++) {
 		bool print;
-		if (e->notify_play)
+		if (e && e->notify_play)
 			e->notify_play(e, b, &gtp->move[i], "", &print);
 		int r = board_play(b, &gtp->move[i]);
 		assert(r >= 0);
 	}
 }
 
+/* Reset engine and board, and replay game from gtp move history. */
+static void
+replay_game(gtp_t *gtp, board_t *b, engine_t *e, time_info_t *ti)
+{
+	gtp_reset_engine(gtp, b, e, ti);
+	replay_board(gtp, b, e);
+}
+
+static void
+undo_reload_engine(gtp_t *gtp, board_t *b, engine_t *e, time_info_t *ti)
+{
+	if (DEBUGL(3)) fprintf(stderr, "reloading engine after undo(s).\n");
+	
+	gtp->undo_pending = false;
+	replay_game(gtp, b, e, ti);
+}
+
 static enum parse_code
 cmd_showboard(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
 {
@@ -891,15 +1467,43 @@ static enum parse_code
 cmd_pachi_gentbook(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
 {
 	/* Board must be initialized properly, as if for genmove;
-	 * makes sense only as 'uct_gentbook b'. */
-	char *arg;
+	 * makes sense only as 'uct_gentbook b'.
+	 * With a filename, saves the subtree of current position there
+	 * to be merged into the tbook later (see pachi-mergetbook). */
+	char *arg, *filename;
 	gtp_arg(arg);
+	gtp_arg_optional(filename);
 	enum stone color = str2stone(arg);
-	if (!uct_gentbook(e, b, &ti[color], color))
+
+	coord_t path[gtp->moves + 1];
+	for (int i = 0; i < gtp->moves; i++) {
+		if (gtp->move[i].color != (i % 2 ? S_WHITE : S_BLACK)) {
+			gtp_error(gtp, "tbook moves must alternate, black first");
+			return P_OK;
+		}
+		path[i] = gtp->move[i].coord;
+	}
+	if (!uct_gentbook(e, b, &ti[color], color, (*filename ? filename : NULL), path, gtp->moves))
 		gtp_error(gtp, "error generating tbook");
 	return P_OK;
 }
 
+/* Merge tbooks made by pachi-gentbook workers into the tbook. */
+static enum parse_code
+cmd_pachi_mergetbook(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
+{
+	char *files[256];
+	int n = 0;
+	for (; *gtp->next && n < 256; n++)
+		gtp_arg(files[n]);
+	if (!n)  {  gtp_error(gtp, "argument missing");  return P_OK;  }
+	if (e->id != E_UCT) {  gtp_error(gtp, "not supported by this engine");  return P_OK;  }
+
+	if (!uct_mergetbook(e, b, files, n))
+		gtp_error(gtp, "error merging tbooks");
+	return P_OK;
+}
+
 static enum parse_code
 cmd_pachi_dumptbook(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
 {
@@ -910,6 +1514,117 @@ cmd_pachi_dumptbook(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
 	return P_OK;
 }
 
+/* Custom commands for saving / restoring search tree along with the game,
+ * so that a restarted pachi can resume where it left off. */
+
+#define SNAPSHOT_MAGIC		"PACHISNP"
+#define SNAPSHOT_VERSION	1
+
+typedef struct {
+	char magic[8];
+	int32_t version;
+	int32_t size;
+	int32_t handicap;
+	int32_t moves;
+	double komi;
+} game_snapshot_header_t;
+
+static enum parse_code
+cmd_pachi_savetree(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
+{
+	char *filename;
+	gtp_arg(filename);
+	if (e->id != E_UCT) {  gtp_error(gtp, "not supported by this engine");  return P_OK;  }
+	
+	FILE *f = fopen(filename, "wb");
+	if (!f) {  gtp_error(gtp, "couldn't open file");  return P_OK;  }
+
+	game_snapshot_header_t h;  memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+	h.version = SNAPSHOT_VERSION;
+	h.size = board_rsize(b);
+	h.handicap = b->handicap;
+	h.moves = gtp->moves;
+	h.komi = b->komi;
+	bool ok = (fwrite(&h, sizeof(h), 1, f) == 1);
+	for (int i = 0; ok && i < gtp->moves; i++) {
+		int32_t m[2] = { gtp->move[i].coord, gtp->move[i].color };
+		ok = (fwrite(m, sizeof(m), 1, f) == 1);
+	}
+	if (ok && !uct_savetree(e, b, f))
+		gtp_error(gtp, "no search tree");
+	else if (!ok)
+		gtp_error(gtp, "write error");
+	fclose(f);
+	return P_OK;
+}
+
+static enum parse_code
+cmd_pachi_loadtree(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
+{
+	char *filename;
+	gtp_arg(filename);
+	if (e->id != E_UCT) {  gtp_error(gtp, "not supported by this engine");  return P_OK;  }
+
+	FILE *f = fopen(filename, "rb");
+	if (!f) {  gtp_error(gtp, "couldn't open file");  return P_OK;  }
+
+	game_snapshot_header_t h;
+	if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) ||
+	    h.version != SNAPSHOT_VERSION || h.size < 1 || h.size > BOARD_MAX_SIZE ||
+	    h.moves < 0 || h.moves > (int)(sizeof(gtp->move) / sizeof(gtp->move[0]))) {
+		gtp_error(gtp, "bad snapshot");
+		fclose(f);
+		return P_OK;
+	}
+#ifdef BOARD_SIZE
+	if (h.size != BOARD_SIZE) {
+		gtp_error_printf(gtp, "This Pachi only plays on %ix%i.\n", BOARD_SIZE, BOARD_SIZE);
+		fclose(f);
+		return P_OK;
+	}
+#endif
+
+	move_t moves[h.moves > 0 ? h.moves : 1];
+	for (int i = 0; i < h.moves; i++) {
+		int32_t m[2];
+		if (fread(m, sizeof(m), 1, f) != 1) {
+			gtp_error(gtp, "truncated snapshot");
+			fclose(f);
+			return P_OK;
+		}
+		move_t mv = move(m[0], m[1]);
+		moves[i] = mv;
+	}
+
+	/* Restore game, then tree on top of it. */
+	if (board_rsize(b) != h.size)
+		board_resize(b, h.size);
+	b->komi = h.komi;
+	b->handicap = h.handicap;
+	gtp->moves = h.moves;
+	memcpy(gtp->move, moves, h.moves * sizeof(move_t));
+	gtp->undo_pending = false;
+	replay_game(gtp, b, e, ti);
+	
+	if (!uct_loadtree(e, b, f))
+		gtp_error(gtp, "couldn't restore search tree (game restored)");
+	fclose(f);
+	return P_OK;
+}
+
+/* Search tree shape stats: nodes per depth, branching, visits spread ... */
+static enum parse_code
+cmd_pachi_tree_shape(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
+{
+	if (e->id != E_UCT) {  gtp_error(gtp, "not supported by this engine");  return P_OK;  }
+
+	strbuf(buf, 2048);
+	if (!uct_tree_shape(e, buf)) {  gtp_error(gtp, "no search tree");  return P_OK;  }
+	gtp_printf(gtp, "%s", buf->str);
+	return P_OK;
+}
+
 static enum parse_code
 cmd_pachi_evaluate(board_t *b, engine_t *e, time_info_t *ti, gtp_t *gtp)
 {
@@ -1056,6 +1771,7 @@ static gtp_command_t gtp_commands[] =
 	{ "final_status_list",      cmd_final_status_list },
 	{ "undo",                   cmd_undo },
 	{ "showboard",              cmd_showboard },   	/* ogs */
+	{ "loadsgf",                cmd_loadsgf },
 
 	{ "kgs-game_over",          cmd_kgs_game_over },
 	{ "kgs-rules",              cmd_kgs_rules },
@@ -1064,16 +1780,32 @@ static gtp_command_t gtp_commands[] =
 	{ "kgs-chat",               cmd_kgs_chat },
 
 	{ "pachi-predict",          cmd_pachi_predict },
+	{ "pachi-predict-stats",    cmd_pachi_predict_stats },
+	{ "pachi-predict-merge",    cmd_pachi_predict_merge },
+	{ "pachi-setup_moves",      cmd_pachi_setup_moves },
+	{ "pachi-sgf-replay",       cmd_pachi_sgf_replay },
+	{ "pachi-sgf-predict",      cmd_pachi_sgf_predict },
+	{ "pachi-review",           cmd_pachi_review },
 	{ "pachi-tunit",            cmd_pachi_tunit },
 	{ "pachi-genmoves",         cmd_pachi_genmoves },
 	{ "pachi-genmoves_cleanup", cmd_pachi_genmoves },
+	{ "pachi-dcnn_policy",      cmd_pachi_dcnn_policy },
+	{ "pachi-dcnn_priors",      cmd_pachi_dcnn_priors },
+	{ "pachi-policy_batch",     cmd_pachi_policy_batch },
 	{ "pachi-gentbook",         cmd_pachi_gentbook },
 	{ "pachi-dumptbook",        cmd_pachi_dumptbook },
+	{ "pachi-mergetbook",       cmd_pachi_mergetbook },
+	{ "pachi-savetree",         cmd_pachi_savetree },
+	{ "pachi-loadtree",         cmd_pachi_loadtree },
+	{ "pachi-tree_shape",       cmd_pachi_tree_shape },
 	{ "pachi-evaluate",         cmd_pachi_evaluate },
 	{ "pachi-result",           cmd_pachi_result },
 	{ "pachi-score_est",        cmd_pachi_score_est },
 	{ "pachi-setoption",	    cmd_pachi_setoption },  /* Set/change engine option */
 	{ "pachi-getoption",	    cmd_pachi_getoption },  /* Get engine option(s) */
+#ifdef PERFSTATS
+	{ "pachi-perfstats",        cmd_pachi_perfstats },
+#endif
 
 	{ "lz-analyze",             cmd_lz_analyze },         /* Lizzie, Sabaki, etc */
 	{ "lz-genmove_analyze",     cmd_lz_genmove_analyze },
@@ -1085,6 +1817,7 @@ static gtp_command_t gtp_commands[] =
 
 	{ "gogui-analyze_commands", cmd_gogui_analyze_commands },
 	{ "gogui-livegfx",          cmd_gogui_livegfx },
+	{ "gogui-play_sequence",    cmd_gogui_play_sequence },
 	{ "gogui-influence",        cmd_gogui_influence },
 	{ "gogui-score_est",        cmd_gogui_score_est },
 	{ "gogui-final_score",      cmd_gogui_final_score },
@@ -1168,8 +1901,10 @@ gtp_parse(gtp_t *gtp, board_t *b, engine_t *e, time_info_t *ti, char *buf)
 	if (!*gtp->cmd)
 		return P_OK;
 
-	if (gtp->analyze_running && strcasecmp(gtp->cmd, "lz-analyze"))
-		stop_analyzing(gtp, b, e);
+	if (gtp->analyze_running && strcasecmp(gtp->cmd, "lz-analyze")) {
+		if (gtp_is_query(gtp->cmd))  pause_analyzing(gtp, b, e);
+		else                         stop_analyzing(gtp, b, e);
+	}
 	if (gtp->analyze_mode && strstr(gtp->cmd, "genmove"))
 		gtp_set_analyze_mode(gtp, b, e, ti, false);
 	
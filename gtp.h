@@ -33,6 +33,7 @@ typedef struct
 	bool    undo_pending;
 	bool    analyze_mode;         /* analyze mode / genmove mode */
 	bool    analyze_running;
+	bool    analyze_paused;       /* lz-analyze output ended by a query, search still running */
 
 	/* Single cmd scope: */
 	char *cmd;
@@ -85,6 +86,7 @@ void gtp_error_printf(gtp_t *gtp, const char *format, ...)
 #define is_gamestart(cmd) (!strcasecmp((cmd), "boardsize"))
 #define is_reset(cmd) (is_gamestart(cmd) || !strcasecmp((cmd), "clear_board") || !strcasecmp((cmd), "kgs-rules"))
 #define is_repeated(cmd) (strstr((cmd), "pachi-genmoves"))
+#define is_dcnn_policy(cmd) (strstr((cmd), "pachi-dcnn_"))
 
 
 #endif
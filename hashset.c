@@ -0,0 +1,109 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "board.h"
+#include "hashset.h"
+#include "util.h"
+
+#define hashset_mask(s)       (((hash_t)1 << (s)->bits) - 1)
+#define hashset_slot(s, h)    ((h) & hashset_mask(s))
+#define hashset_next(s, i)    (((i) + 1) & hashset_mask(s))
+
+hashset_t *
+hashset_new(int bits)
+{
+	hashset_t *s = calloc2(1, hashset_t);
+	s->bits = bits;
+	s->keys = calloc2((size_t)1 << bits, hash_t);
+	return s;
+}
+
+void
+hashset_delete(hashset_t **s)
+{
+	if (!*s)  return;
+	free((*s)->keys);
+	free(*s);
+	*s = NULL;
+}
+
+void
+hashset_clear(hashset_t *s)
+{
+	memset(s->keys, 0, sizeof(hash_t) << s->bits);
+	s->n = 0;
+	s->zero = false;
+}
+
+static void
+hashset_grow(hashset_t *s)
+{
+	hash_t *old = s->keys;
+	int old_size = 1 << s->bits;
+	s->bits++;
+	s->keys = calloc2((size_t)1 << s->bits, hash_t);
+	for (int i = 0; i < old_size; i++) {
+		if (!old[i])  continue;
+		hash_t j = hashset_slot(s, old[i]);
+		while (s->keys[j])
+			j = hashset_next(s, j);
+		s->keys[j] = old[i];
+	}
+	free(old);
+}
+
+bool
+hashset_add(hashset_t *s, hash_t h)
+{
+	if (!h) {
+		if (s->zero)  return false;
+		return (s->zero = true);
+	}
+
+	/* Keep load factor under 1/2, probe sequences stay short. */
+	if (2 * (s->n + 1) > (1 << s->bits))
+		hashset_grow(s);
+
+	hash_t i = hashset_slot(s, h);
+	for (; s->keys[i]; i = hashset_next(s, i))
+		if (s->keys[i] == h)
+			return false;
+	s->keys[i] = h;
+	s->n++;
+	return true;
+}
+
+bool
+hashset_contains(hashset_t *s, hash_t h)
+{
+	if (!h)  return s->zero;
+	for (hash_t i = hashset_slot(s, h); s->keys[i]; i = hashset_next(s, i))
+		if (s->keys[i] == h)
+			return true;
+	return false;
+}
+
+/* Backward shift deletion: no tombstones needed with linear probing. */
+void
+hashset_remove(hashset_t *s, hash_t h)
+{
+	if (!h) {  s->zero = false;  return;  }
+	
+	hash_t i = hashset_slot(s, h);
+	for (; s->keys[i] != h; i = hashset_next(s, i))
+		if (!s->keys[i])  return;
+	s->keys[i] = 0;
+	s->n--;
+
+	/* Move back following entries which can't be reached anymore. */
+	for (hash_t j = hashset_next(s, i); s->keys[j]; j = hashset_next(s, j)) {
+		hash_t home = hashset_slot(s, s->keys[j]);
+		/* Entry can stay if its home is cyclically in (i, j]. */
+		if ((i < j) ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+		s->keys[i] = s->keys[j];
+		s->keys[j] = 0;
+		i = j;
+	}
+}
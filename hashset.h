@@ -0,0 +1,26 @@
+#ifndef PACHI_HASHSET_H
+#define PACHI_HASHSET_H
+
+/* Set of position hashes: open addressing, linear probing.
+ * Grows as needed, so it can hold all positions of a game
+ * (positional superko) or be used as a generic position cache. */
+
+#include "board.h"
+
+typedef struct hashset {
+	hash_t *keys;      /* 0 == empty slot */
+	int bits;
+	int n;
+	bool zero;         /* Hash 0 is in the set (can't be stored in keys[]) */
+} hashset_t;
+
+hashset_t *hashset_new(int bits);
+void hashset_delete(hashset_t **s);
+void hashset_clear(hashset_t *s);
+
+/* Returns false if @h was already there. */
+bool hashset_add(hashset_t *s, hash_t h);
+bool hashset_contains(hashset_t *s, hash_t h);
+void hashset_remove(hashset_t *s, hash_t h);
+
+#endif
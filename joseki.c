@@ -1,6 +1,16 @@
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #define DEBUG
 #include "board.h"
@@ -16,8 +26,10 @@
 
 static bool joseki_enabled = true;
 static bool joseki_required = false;
+static bool joseki_shared = false;
 void disable_joseki()  {  joseki_enabled = false;  }
 void require_joseki()  {  joseki_required = true;  }
+void share_joseki()    {  joseki_shared = true;  }
 
 
 joseki_dict_t *joseki_dict = NULL;
@@ -33,24 +45,41 @@ using_joseki(board_t *b)
 }
 
 static joseki_dict_t *
-joseki_init(int bsize)
+joseki_init(int bsize, bool recording)
 {
 	joseki_dict_t *jd = calloc2(1, joseki_dict_t);
 	jd->bsize = bsize;
+	jd->recording = recording;
+	if (!recording)  jd->hash = calloc2(1 << joseki_hash_bits, uint32_t);
+	jd->alloc = 1024;
+	jd->pats = calloc2(jd->alloc, josekipat_t);
+	jd->npats = 1;		/* id 0 is null pattern */
 	return jd;
 }
 
-static josekipat_t *
-joseki_pattern_new(board_t *b, coord_t coord, enum stone color, josekipat_t *prev, int flags)
+/* Append pattern @p1 as is. Invalidates pattern pointers. */
+static uint32_t
+joseki_pattern_append(joseki_dict_t *jd, josekipat_t *p1)
 {
-	josekipat_t *p = calloc2(1, josekipat_t);
-	p->coord = coord;
-	p->color = color;
-	p->flags = flags;
-	if (flags & JOSEKI_FLAGS_3X3)  p->h = joseki_3x3_spatial_hash(b, coord, color);
-	else			       p->h = joseki_spatial_hash(b, coord, color);
-	p->prev = prev;
-	return p;
+	assert(!jd->shm && !jd->keys);
+	if (jd->npats == jd->alloc) {
+		jd->alloc *= 2;
+		jd->pats = crealloc(jd->pats, jd->alloc * sizeof(josekipat_t));
+	}
+	jd->pats[jd->npats] = *p1;
+	return jd->npats++;
+}
+
+/* Add new pattern from prototype @p1 (see joseki_add()).
+ * Invalidates pattern pointers. */
+static uint32_t
+joseki_pattern_new(joseki_dict_t *jd, josekipat_t *p1)
+{
+	uint32_t id = joseki_pattern_append(jd, p1);
+	josekipat_t *p = &jd->pats[id];
+	if (p->flags & JOSEKI_FLAGS_3X3)  p->h = p->h3;
+	p->next = 0;
+	return id;
 }
 
 static uint32_t
@@ -77,7 +106,7 @@ flags_match(josekipat_t *p1, josekipat_t *p2)
 
 /* Same logic as joseki_prev_matches() */
 static int
-same_prevs(josekipat_t *prev1, josekipat_t *prev2)
+same_prevs(joseki_dict_t *jd, josekipat_t *prev1, josekipat_t *prev2)
 {
 	if ((prev1 != NULL) != (prev2 != NULL))  return false;
 	if (!prev1 && !prev2)                    return true;
@@ -85,105 +114,313 @@ same_prevs(josekipat_t *prev1, josekipat_t *prev2)
 	/* Don't care about IGNORE / LATER flags. */
 	if ((prev1->flags & JOSEKI_FLAGS_3X3) != (prev2->flags & JOSEKI_FLAGS_3X3))  return false;
 	if ((prev1->flags & JOSEKI_FLAGS_3X3))
-		return same_prevs(prev1->prev, prev2->prev);
+		return same_prevs(jd, joseki_prev(jd, prev1), joseki_prev(jd, prev2));
 	return true;
 }
 
-static bool joseki_prev_matches(board_t *b, josekipat_t *prev);
+typedef struct joseki_hashes joseki_hashes_t;
+static bool joseki_prev_matches(joseki_dict_t *jd, board_t *b, josekipat_t *prev, joseki_hashes_t *cache);
+
+/* Lookups for prototype @p1, @b is only used for sanity checks (can be NULL). */
 
 static josekipat_t*
-joseki_lookup_regular_prev(joseki_dict_t *jd, board_t *b, coord_t coord, enum stone color,
-			   josekipat_t *prev, int flags)
+joseki_lookup_regular_prev(joseki_dict_t *jd, board_t *b, josekipat_t *p1)
 {
-	hash_t h = joseki_spatial_hash(b, coord, color);
-	uint32_t kh = joseki_dict_hash(h, coord);
-	josekipat_t p1 = josekipat(coord, color, h, prev, flags);
-	for (josekipat_t *p = jd->hash[kh]; p; p = p->next) {
-		if (!joseki_dict_equal(&p1, p))  continue;
-		if (!flags_match(&p1, p))        continue;
-		if (!same_prevs(p->prev, prev))  continue;
-		assert(joseki_prev_matches(b, p->prev));
+	uint32_t kh = joseki_dict_hash(p1->h, p1->coord);
+	for (josekipat_t *p = joseki_pat(jd, jd->hash[kh]); p; p = joseki_next(jd, p)) {
+		if (!joseki_dict_equal(p1, p))  continue;
+		if (!flags_match(p1, p))        continue;
+		if (!same_prevs(jd, joseki_prev(jd, p), joseki_pat(jd, p1->prev)))  continue;
+		assert(!b || joseki_prev_matches(jd, b, joseki_prev(jd, p), NULL));
 		return p;
 	}
 	return NULL;
 }
 
 static josekipat_t*
-joseki_lookup_3x3_prev(joseki_dict_t *jd, board_t *b, coord_t coord, enum stone color,
-		       josekipat_t *prev, int flags)
+joseki_lookup_3x3_prev(joseki_dict_t *jd, board_t *b, josekipat_t *p1)
 {
-	hash_t h = joseki_3x3_spatial_hash(b, coord, color);
-	josekipat_t p1 = josekipat(coord, color, h, prev, flags);
-	for (josekipat_t *p = jd->pat_3x3[color]; p; p = p->next) {
-		if (!joseki_dict_equal(&p1, p))        continue;
-		if (!flags_match(&p1, p))              continue;
-		if (!same_prevs(p->prev, prev))        continue;
-		assert(joseki_prev_matches(b, p->prev));
+	josekipat_t p3 = *p1;  p3.h = p1->h3;
+	for (josekipat_t *p = joseki_pat(jd, jd->pat_3x3[p1->color]); p; p = joseki_next(jd, p)) {
+		if (!joseki_dict_equal(&p3, p))        continue;
+		if (!flags_match(&p3, p))              continue;
+		if (!same_prevs(jd, joseki_prev(jd, p), joseki_pat(jd, p1->prev)))  continue;
+		assert(!b || joseki_prev_matches(jd, b, joseki_prev(jd, p), NULL));
 		return p;
 	}
 	return NULL;
 }
 
 static josekipat_t*
-joseki_lookup_ignored_prev(joseki_dict_t *jd, board_t *b, coord_t coord, enum stone color, josekipat_t *prev)
+joseki_lookup_ignored_prev(joseki_dict_t *jd, board_t *b, josekipat_t *p1)
 {
-	hash_t h  = joseki_spatial_hash(b, coord, color);
-	hash_t h3 = joseki_3x3_spatial_hash(b, coord, color);
-
-	josekipat_t p1 = josekipat(coord, color, h,  prev, 0);
-	josekipat_t p2 = josekipat(coord, color, h3, prev, 0);
-	for (josekipat_t *p = jd->ignored; p; p = p->next) {
+	josekipat_t p3 = *p1;  p3.h = p1->h3;
+	for (josekipat_t *p = joseki_pat(jd, jd->ignored); p; p = joseki_next(jd, p)) {
 		// should check flags and compare only one ...
-		if (!joseki_dict_equal(&p1, p) && !joseki_dict_equal(&p2, p))  continue;
-		if (!same_prevs(p->prev, prev))        continue;
-		assert(joseki_prev_matches(b, p->prev));
+		if (!joseki_dict_equal(p1, p) && !joseki_dict_equal(&p3, p))  continue;
+		if (!same_prevs(jd, joseki_prev(jd, p), joseki_pat(jd, p1->prev)))  continue;
+		assert(!b || joseki_prev_matches(jd, b, joseki_prev(jd, p), NULL));
 		return p;
 	}
 	return NULL;
 }
 
-static josekipat_t *
-joseki_add_ignored(joseki_dict_t *jd, board_t *b, coord_t coord, enum stone color, josekipat_t *prev, int flags)
+static uint32_t
+joseki_add_ignored(joseki_dict_t *jd, board_t *b, josekipat_t *p1)
 {
-	josekipat_t *p = joseki_lookup_ignored_prev(jd, b, coord, color, prev);
-	if (p)  return p;
+	josekipat_t *p = joseki_lookup_ignored_prev(jd, b, p1);
+	if (p)  return joseki_id(jd, p);
 
-	p = joseki_pattern_new(b, coord, color, prev, flags);
-	p->next = jd->ignored;
-	jd->ignored = p;
-	return p;
+	uint32_t id = joseki_pattern_new(jd, p1);
+	jd->pats[id].next = jd->ignored;
+	jd->ignored = id;
+	return id;
 }
 
-static josekipat_t *
-joseki_add_3x3(joseki_dict_t *jd, board_t *b, coord_t coord, enum stone color, josekipat_t *prev, int flags)
+static uint32_t
+joseki_add_3x3(joseki_dict_t *jd, board_t *b, josekipat_t *p1)
 {
-	assert(!is_pass(coord));
-	if (!prev)  die("joseki: [ %s %s ] adding 3x3 match with no previous move, this is bad.\n",
-			coord2sstr(last_move(b).coord), coord2sstr(coord));
-	josekipat_t *p = joseki_lookup_3x3_prev(jd, b, coord, color, prev, flags);
-	if (p)  return p;
+	josekipat_t *p = joseki_lookup_3x3_prev(jd, b, p1);
+	if (p)  return joseki_id(jd, p);
+
+	uint32_t id = joseki_pattern_new(jd, p1);
+	jd->pats[id].next = jd->pat_3x3[p1->color];
+	jd->pat_3x3[p1->color] = id;
+	return id;
+}
 
-	p = joseki_pattern_new(b, coord, color, prev, flags);
-	p->next = jd->pat_3x3[color];
-	jd->pat_3x3[color] = p;
-	return p;
+static uint32_t
+joseki_add_regular(joseki_dict_t *jd, board_t *b, josekipat_t *p1)
+{
+	josekipat_t *p = joseki_lookup_regular_prev(jd, b, p1);
+	if (p)  return joseki_id(jd, p);
+	
+	uint32_t id = joseki_pattern_new(jd, p1);
+	uint32_t kh = joseki_dict_hash(jd->pats[id].h, p1->coord);
+	jd->pats[id].next = jd->hash[kh];
+	jd->hash[kh] = id;
+	return id;
 }
 
-josekipat_t *
-joseki_add(joseki_dict_t *jd, board_t *b, coord_t coord, enum stone color, josekipat_t *prev, int flags)
+/* Add pattern prototype, returns pattern id. */
+static uint32_t
+joseki_add_pattern(joseki_dict_t *jd, board_t *b, josekipat_t *p1)
 {
 	/* Pattern can be both ignored and 3x3 */
-	if (flags & JOSEKI_FLAGS_IGNORE)  return joseki_add_ignored(jd, b, coord, color, prev, flags);
-	if (flags & JOSEKI_FLAGS_3X3)     return joseki_add_3x3(jd, b, coord, color, prev, flags);
+	if (p1->flags & JOSEKI_FLAGS_IGNORE)  return joseki_add_ignored(jd, b, p1);
+	if (p1->flags & JOSEKI_FLAGS_3X3)     return joseki_add_3x3(jd, b, p1);
+	return joseki_add_regular(jd, b, p1);
+}
 
-	josekipat_t *p = joseki_lookup_regular_prev(jd, b, coord, color, prev, flags);
-	if (p)  return p;
-	
-	p = joseki_pattern_new(b, coord, color, prev, flags);
-	uint32_t kh = joseki_dict_hash(p->h, coord);
-	p->next = jd->hash[kh];
-	jd->hash[kh] = p;
-	return p;
+/* Pattern prototype: h is the full hash unless it's a 3x3 only pattern
+ * (ignored patterns need both), stored pattern gets the one it uses.
+ * Recording dictionaries (parallel loading) just keep them in order,
+ * they get added to the real dictionary later. */
+uint32_t
+joseki_add(joseki_dict_t *jd, board_t *b, coord_t coord, enum stone color, uint32_t prev, int flags)
+{
+	bool only_3x3 = ((flags & JOSEKI_FLAGS_3X3) && !(flags & JOSEKI_FLAGS_IGNORE));
+	if (only_3x3)  assert(!is_pass(coord));
+	if (only_3x3 && !prev)
+		die("joseki: [ %s %s ] adding 3x3 match with no previous move, this is bad.\n",
+		    coord2sstr(last_move(b).coord), coord2sstr(coord));
+
+	josekipat_t p1 = josekipat(coord, color, 0, prev, flags);
+	p1.h3 = joseki_3x3_spatial_hash(b, coord, color);
+	p1.h = (only_3x3 ? p1.h3 : joseki_spatial_hash(b, coord, color));
+
+	if (jd->recording)  return joseki_pattern_append(jd, &p1);
+	return joseki_add_pattern(jd, b, &p1);
+}
+
+/* Add patterns recorded in @rec, in order, as if they had been added to
+ * @jd directly. */
+static void
+joseki_merge(joseki_dict_t *jd, joseki_dict_t *rec)
+{
+	uint32_t *id = cmalloc(rec->npats * sizeof(uint32_t));
+	id[0] = 0;
+	for (unsigned int i = 1; i < rec->npats; i++) {
+		josekipat_t p1 = rec->pats[i];
+		assert(p1.prev < i);
+		p1.prev = id[p1.prev];
+		id[i] = joseki_add_pattern(jd, NULL, &p1);
+	}
+	free(id);
+}
+
+/********************************************************************************************/
+/* Compiled index */
+
+static uint32_t
+joseki_key_hash(int kind, coord_t coord, enum stone color, hash_t h)
+{
+	return ((uint32_t)(h >> 32) ^ (uint32_t)h ^ ((uint32_t)coord * 0x9e3779b1) ^ (kind << 2 | color));
+}
+
+static joseki_key_t *
+joseki_key_find(joseki_dict_t *jd, int kind, coord_t coord, enum stone color, hash_t h)
+{
+	uint32_t mask = (1 << jd->key_bits) - 1;
+	for (uint32_t i = joseki_key_hash(kind, coord, color, h) & mask; jd->keys[i].kind; i = (i + 1) & mask) {
+		joseki_key_t *k = &jd->keys[i];
+		if (k->h == h && k->coord == coord && k->color == color && k->kind == kind)
+			return k;
+	}
+	return NULL;
+}
+
+#define foreach_key_pattern(jd, k) \
+	for (uint32_t _i = (k)->first; _i < (k)->first + (k)->n; _i++) { \
+		josekipat_t *p = &(jd)->pats[(jd)->seq[_i]];
+#define foreach_key_pattern_end  }
+
+#define foreach_joseki_reply(jd, id) \
+	for (uint32_t _j = (jd)->replies_start[id]; _j < (jd)->replies_start[(id) + 1]; _j++) { \
+		josekipat_t *p = &(jd)->pats[(jd)->replies[_j]];
+#define foreach_joseki_reply_end  }
+
+typedef struct {
+	joseki_key_t k;
+	uint32_t id;
+} joseki_key_entry_t;
+
+static joseki_key_entry_t
+key_entry(int kind, josekipat_t *p, hash_t h, uint32_t id)
+{
+	joseki_key_entry_t e = { { h, p->coord, p->color, (uint8_t)kind, 0, 0 }, id };
+	return e;
+}
+
+static int
+key_entry_cmp(const void *p1, const void *p2)
+{
+	const joseki_key_entry_t *e1 = p1, *e2 = p2;
+	if (e1->k.kind  != e2->k.kind)   return (e1->k.kind  < e2->k.kind  ? -1 : 1);
+	if (e1->k.coord != e2->k.coord)  return (e1->k.coord < e2->k.coord ? -1 : 1);
+	if (e1->k.color != e2->k.color)  return (e1->k.color < e2->k.color ? -1 : 1);
+	if (e1->k.h     != e2->k.h)      return (e1->k.h     < e2->k.h     ? -1 : 1);
+	/* Newest first, same order as while loading. */
+	return (e1->id > e2->id ? -1 : (e1->id < e2->id));
+}
+
+static bool
+key_entry_same(joseki_key_entry_t *e1, joseki_key_entry_t *e2)
+{
+	return (e1->k.kind == e2->k.kind && e1->k.coord == e2->k.coord &&
+		e1->k.color == e2->k.color && e1->k.h == e2->k.h);
+}
+
+/* Moves which can be prev of a reply, see joseki_list_replies() */
+static bool
+joseki_reply_prev(josekipat_t *p)
+{
+	return !(p->flags & JOSEKI_FLAGS_3X3);
+}
+
+static bool
+joseki_has_replies(joseki_dict_t *jd, josekipat_t *p)
+{
+	uint32_t id = joseki_id(jd, p);
+	return (joseki_reply_prev(p) && jd->replies_start[id] != jd->replies_start[id + 1]);
+}
+
+static uint32_t
+prev_fingerprint(coord_t coord, enum stone color, hash_t h3)
+{
+	return (joseki_key_hash(JK_NONE, coord, color, h3) | 1);
+}
+
+/* Could last move have joseki replies ? False positives are possible. */
+static bool
+joseki_prev_filter(joseki_dict_t *jd, coord_t coord, enum stone color, hash_t h3)
+{
+	uint32_t mask = (1 << jd->prev_filter_bits) - 1;
+	uint32_t fp = prev_fingerprint(coord, color, h3);
+	for (uint32_t i = fp & mask; jd->prev_filter[i]; i = (i + 1) & mask)
+		if (jd->prev_filter[i] == fp)  return true;
+	return false;
+}
+
+/* Build index once all patterns are in. Loading structures go away. */
+static void
+joseki_compile(joseki_dict_t *jd)
+{
+	/* Replies, grouped by prev. */
+	jd->replies_start = calloc2(jd->npats + 1, uint32_t);
+	for (uint32_t id = 1; id < jd->npats; id++) {
+		josekipat_t *p = &jd->pats[id];
+		if (p->prev && !(p->flags & JOSEKI_FLAGS_IGNORE))
+			jd->replies_start[p->prev + 1]++;
+	}
+	for (uint32_t id = 1; id <= jd->npats; id++)
+		jd->replies_start[id] += jd->replies_start[id - 1];
+	uint32_t *fill = cmalloc(jd->npats * sizeof(uint32_t));
+	memcpy(fill, jd->replies_start, jd->npats * sizeof(uint32_t));
+	jd->replies = cmalloc((jd->replies_start[jd->npats] + 1) * sizeof(uint32_t));
+	for (uint32_t id = jd->npats - 1; id > 0; id--) {
+		josekipat_t *p = &jd->pats[id];
+		if (p->prev && !(p->flags & JOSEKI_FLAGS_IGNORE))
+			jd->replies[fill[p->prev]++] = id;
+	}
+	free(fill);
+
+	/* Keys: one entry per pattern, plus quick keys. */
+	unsigned int n = 0;
+	joseki_key_entry_t *e = cmalloc(2 * jd->npats * sizeof(*e));
+	for (uint32_t id = 1; id < jd->npats; id++) {
+		josekipat_t *p = &jd->pats[id];
+		int kind = ((p->flags & JOSEKI_FLAGS_IGNORE) ? JK_IGNORED :
+			    (p->flags & JOSEKI_FLAGS_3X3)    ? JK_3X3 : JK_FULL);
+		e[n++] = key_entry(kind, p, p->h, id);
+		if (kind == JK_FULL)  e[n++] = key_entry(JK_QUICK, p, p->h3, 0);
+	}
+	qsort(e, n, sizeof(*e), key_entry_cmp);
+
+	unsigned int nkeys = 0;
+	for (unsigned int i = 0; i < n; i++)
+		nkeys += (!i || !key_entry_same(&e[i - 1], &e[i]));
+	for (jd->key_bits = 8; (1U << jd->key_bits) < 2 * nkeys; jd->key_bits++)
+		;
+	uint32_t mask = (1 << jd->key_bits) - 1;
+	jd->keys = calloc2(1 << jd->key_bits, joseki_key_t);
+	jd->seq = cmalloc(n * sizeof(uint32_t));
+	jd->nseq = 0;
+
+	joseki_key_t *k = NULL;
+	for (unsigned int i = 0; i < n; i++) {
+		if (!i || !key_entry_same(&e[i - 1], &e[i])) {
+			uint32_t h = joseki_key_hash(e[i].k.kind, e[i].k.coord, e[i].k.color, e[i].k.h) & mask;
+			while (jd->keys[h].kind)  h = (h + 1) & mask;
+			k = &jd->keys[h];
+			*k = e[i].k;
+			k->first = jd->nseq;
+		}
+		if (e[i].id) {  jd->seq[jd->nseq++] = e[i].id;  k->n++;  }
+	}
+	free(e);
+
+	/* Prev filter */
+	unsigned int nprevs = 0;
+	for (uint32_t id = 1; id < jd->npats; id++)
+		nprevs += (joseki_has_replies(jd, &jd->pats[id]));
+	for (jd->prev_filter_bits = 8; (1U << jd->prev_filter_bits) < 2 * nprevs; jd->prev_filter_bits++)
+		;
+	mask = (1 << jd->prev_filter_bits) - 1;
+	jd->prev_filter = calloc2(1 << jd->prev_filter_bits, uint32_t);
+	for (uint32_t id = 1; id < jd->npats; id++) {
+		josekipat_t *p = &jd->pats[id];
+		if (!joseki_has_replies(jd, p))  continue;
+		uint32_t fp = prev_fingerprint(p->coord, p->color, p->h3);
+		uint32_t i = fp & mask;
+		while (jd->prev_filter[i] && jd->prev_filter[i] != fp)  i = (i + 1) & mask;
+		jd->prev_filter[i] = fp;
+	}
+
+	free(jd->hash);
+	jd->hash = NULL;
+	memset(jd->pat_3x3, 0, sizeof(jd->pat_3x3));
+	jd->ignored = 0;
 }
 
 static void
@@ -194,22 +431,26 @@ joseki_stats(joseki_dict_t *jd)
 	forall_3x3_joseki_patterns(jd)     {  relaxed++; if (p->flags & JOSEKI_FLAGS_LATER)  later++;  }
 	forall_ignored_joseki_patterns(jd) {  ignored++; if (p->flags & JOSEKI_FLAGS_LATER)  later++;  }
 
-	/* hashtable stats */
-	unsigned int worst = 0, entries = 0, empty = 0, buckets = (1 << joseki_hash_bits);
-	for (unsigned int i = 0; i < buckets; i++) {
-		unsigned int n = 0;
-		for (josekipat_t *p = jd->hash[i]; p; p = p->next)  n++;
-		worst = MAX(worst, n);
-		if (!n)  empty++;
-		entries += n;
+	/* index stats */
+	unsigned int size = (1 << jd->key_bits), mask = size - 1;
+	unsigned int keys = 0, probes = 0, worst = 0;
+	for (unsigned int i = 0; i < size; i++) {
+		joseki_key_t *k = &jd->keys[i];
+		if (!k->kind)  continue;
+		keys++;
+		worst = MAX(worst, k->n);
+		uint32_t h = joseki_key_hash(k->kind, k->coord, k->color, k->h) & mask;
+		probes += ((i - h) & mask) + 1;
 	}
 
-	unsigned int memht = buckets * sizeof(void*);
-	unsigned int mem = memht + (normal + relaxed + ignored) * sizeof(josekipat_t);
-	fprintf(stderr, "Joseki dict: %-5i moves,  3x3: %-5i  ignored: %-5i  later: %-5i   %.1fMb total\n", normal, relaxed, ignored, later, (float)mem / (1024*1024));
-	fprintf(stderr, "       hash: %-5i entries, empty %2i%%, avg len %.1f, worst %2i,         %.1fMb\n",
-		entries, empty * 100 / buckets,
-		(float)entries / (buckets - empty), worst, (float)memht / (1024*1024));
+	size_t memidx = size * sizeof(joseki_key_t) + jd->nseq * sizeof(uint32_t) +
+		        (jd->npats + 1 + jd->replies_start[jd->npats]) * sizeof(uint32_t) +
+			(1 << jd->prev_filter_bits) * sizeof(uint32_t);
+	size_t mem = memidx + jd->npats * sizeof(josekipat_t);
+	fprintf(stderr, "Joseki dict: %-5i moves,  3x3: %-5i  ignored: %-5i  later: %-5i   %.1fMb total%s\n", normal, relaxed, ignored, later, (float)mem / (1024*1024),
+		(jd->shm ? " (shared)" : ""));
+	fprintf(stderr, "      index: %-5i keys, fill %2i%%, avg probes %.2f, worst run %2i,   %.1fMb\n",
+		keys, keys * 100 / size, (float)probes / keys, worst, (float)memidx / (1024*1024));
 }
 
 static char *abcd = "abcdefghjklmnopqrstuvwxyz";
@@ -247,15 +488,478 @@ skip_sequence(char *buf, int len, FILE *f, int *lineno)
 			return;
 }
 
-/* Load joseki database.
+
+/********************************************************************************************/
+/* Dictionary images */
+
+/* Dictionary image: header, then patterns and compiled index as they are
+ * in memory. Patterns and compiled index refer to each other by index so
+ * the image doesn't depend on where it's mapped. Image records a checksum
+ * of joseki19.gtp and spatial hashes, out of date images don't get used.
+ * Images are checked fully before use so a bad one can't send lookups
+ * out of bounds. Used for shared dictionaries and compiled joseki file. */
+
+#define JOSEKI_SHM_MAGIC   0x4b45534f4a484350ULL	/* "PCHJOSEK" */
+#define JOSEKI_SHM_LAYOUT  (sizeof(josekipat_t) | sizeof(joseki_key_t) << 8 | 2 << 16)
+#define JOSEKI_SHM_ALIGN   64
+#define JOSEKI_SHM_STALE   60	/* Give up on unfinished segments after that many seconds */
+#define JOSEKI_SHM_MAX_BITS 28	/* Sanity limit for hash table sizes */
+
+typedef struct {
+	uint64_t magic;
+	uint32_t layout;
+	uint32_t bsize;
+	uint64_t checksum;
+	uint64_t size;
+	uint64_t pats, keys, seq;		/* Section offsets */
+	uint64_t replies_start, replies, prev_filter;
+	uint32_t npats;
+	uint32_t key_bits;
+	uint32_t nseq;
+	uint32_t prev_filter_bits;
+	volatile uint32_t ready;
+} joseki_shm_t;
+
+/* FNV-1a of joseki file and spatial hashes. */
+static uint64_t
+joseki_checksum(FILE *f)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	unsigned char buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		for (size_t i = 0; i < n; i++)
+			h = (h ^ buf[i]) * 0x100000001b3ULL;
+	rewind(f);
+
+	for (int i = 0; i < MAX_PATTERN_AREA; i++)
+		for (int s = 0; s < S_MAX; s++)
+			h = (h ^ pthashes[0][i][s]) * 0x100000001b3ULL;
+	return h;
+}
+
+static uint64_t
+shm_section(uint64_t *offset, size_t size)
+{
+	uint64_t start = (*offset + JOSEKI_SHM_ALIGN - 1) & ~(uint64_t)(JOSEKI_SHM_ALIGN - 1);
+	*offset = start + size;
+	return start;
+}
+
+/* Is section at @offset with @n items of @size within image ? */
+static bool
+shm_section_ok(joseki_shm_t *h, uint64_t offset, uint64_t n, size_t size)
+{
+	return (offset >= sizeof(*h) && offset <= h->size && !(offset % JOSEKI_SHM_ALIGN) &&
+		n <= (h->size - offset) / size);
+}
+
+/* Check every index in the image so lookups can't go out of bounds. */
+static bool
+joseki_shm_check(joseki_shm_t *h)
+{
+	if (h->npats < 1 || h->npats == UINT32_MAX ||
+	    h->key_bits > JOSEKI_SHM_MAX_BITS || h->prev_filter_bits > JOSEKI_SHM_MAX_BITS)
+		return false;
+	if (!shm_section_ok(h, h->pats, h->npats, sizeof(josekipat_t)) ||
+	    !shm_section_ok(h, h->keys, 1 << h->key_bits, sizeof(joseki_key_t)) ||
+	    !shm_section_ok(h, h->seq, h->nseq, sizeof(uint32_t)) ||
+	    !shm_section_ok(h, h->replies_start, h->npats + 1, sizeof(uint32_t)) ||
+	    !shm_section_ok(h, h->prev_filter, 1 << h->prev_filter_bits, sizeof(uint32_t)))
+		return false;
+
+	char *base = (char*)h;
+	josekipat_t *pats = (josekipat_t*)(base + h->pats);
+	for (uint32_t i = 0; i < h->npats; i++)
+		if (pats[i].prev >= h->npats || pats[i].coord < pass || pats[i].coord >= BOARD_MAX_COORDS ||
+		    (pats[i].color != S_BLACK && pats[i].color != S_WHITE && i))
+			return false;
+
+	/* Probing must end on an empty slot. */
+	joseki_key_t *keys = (joseki_key_t*)(base + h->keys);
+	bool empty = false;
+	for (uint32_t i = 0; i < (1U << h->key_bits); i++) {
+		if (!keys[i].kind) {  empty = true;  continue;  }
+		if (keys[i].first > h->nseq || keys[i].n > h->nseq - keys[i].first)
+			return false;
+	}
+	uint32_t *seq = (uint32_t*)(base + h->seq);
+	for (uint32_t i = 0; i < h->nseq; i++)
+		if (!seq[i] || seq[i] >= h->npats)  return false;
+
+	uint32_t *start = (uint32_t*)(base + h->replies_start);
+	for (uint32_t i = 0; i < h->npats; i++)
+		if (start[i] > start[i + 1])  return false;
+	uint32_t nreplies = start[h->npats];
+	if (start[0] || !shm_section_ok(h, h->replies, nreplies, sizeof(uint32_t)))
+		return false;
+	uint32_t *replies = (uint32_t*)(base + h->replies);
+	for (uint32_t i = 0; i < nreplies; i++)
+		if (!replies[i] || replies[i] >= h->npats)  return false;
+
+	uint32_t *filter = (uint32_t*)(base + h->prev_filter);
+	bool filter_empty = false;
+	for (uint32_t i = 0; i < (1U << h->prev_filter_bits) && !filter_empty; i++)
+		filter_empty = !filter[i];
+	return (empty && filter_empty);
+}
+
+/* Is finished image @h a good dictionary for @bsize ? @size: bytes mapped. */
+static bool
+joseki_image_valid(joseki_shm_t *h, uint64_t size, int bsize, uint64_t checksum)
+{
+	return (h->magic == JOSEKI_SHM_MAGIC && h->layout == JOSEKI_SHM_LAYOUT &&
+		h->size <= size && h->bsize == (uint32_t)bsize &&
+		h->checksum == checksum && joseki_shm_check(h));
+}
+
+/* Image header for @jd, with section offsets. */
+static void
+joseki_image_header(joseki_dict_t *jd, uint64_t checksum, joseki_shm_t *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->size = sizeof(*h);
+	h->pats = shm_section(&h->size, jd->npats * sizeof(josekipat_t));
+	h->keys = shm_section(&h->size, (1 << jd->key_bits) * sizeof(joseki_key_t));
+	h->seq  = shm_section(&h->size, jd->nseq * sizeof(uint32_t));
+	h->replies_start = shm_section(&h->size, (jd->npats + 1) * sizeof(uint32_t));
+	h->replies = shm_section(&h->size, jd->replies_start[jd->npats] * sizeof(uint32_t));
+	h->prev_filter = shm_section(&h->size, (1 << jd->prev_filter_bits) * sizeof(uint32_t));
+
+	h->magic = JOSEKI_SHM_MAGIC;
+	h->layout = JOSEKI_SHM_LAYOUT;
+	h->bsize = jd->bsize;
+	h->checksum = checksum;
+	h->npats = jd->npats;
+	h->key_bits = jd->key_bits;
+	h->nseq = jd->nseq;
+	h->prev_filter_bits = jd->prev_filter_bits;
+}
+
+/* Copy image with header @h to @map (zeroed, h->size bytes). */
+static void
+joseki_image_write(joseki_dict_t *jd, joseki_shm_t *h, char *map)
+{
+	memcpy(map, h, sizeof(*h));
+	memcpy(map + h->pats, jd->pats, jd->npats * sizeof(josekipat_t));
+	memcpy(map + h->keys, jd->keys, (1 << jd->key_bits) * sizeof(joseki_key_t));
+	memcpy(map + h->seq,  jd->seq,  jd->nseq * sizeof(uint32_t));
+	memcpy(map + h->replies_start, jd->replies_start, (jd->npats + 1) * sizeof(uint32_t));
+	memcpy(map + h->replies, jd->replies, jd->replies_start[jd->npats] * sizeof(uint32_t));
+	memcpy(map + h->prev_filter, jd->prev_filter, (1 << jd->prev_filter_bits) * sizeof(uint32_t));
+}
+
+/* Dictionary using image @h in place. Caller sets shm fields. */
+static joseki_dict_t *
+joseki_image_dict(joseki_shm_t *h, int bsize)
+{
+	char *base = (char*)h;
+	joseki_dict_t *jd = calloc2(1, joseki_dict_t);
+	jd->bsize = bsize;
+	jd->pats = (josekipat_t*)(base + h->pats);
+	jd->npats = jd->alloc = h->npats;
+	jd->keys = (joseki_key_t*)(base + h->keys);
+	jd->key_bits = h->key_bits;
+	jd->seq = (uint32_t*)(base + h->seq);
+	jd->nseq = h->nseq;
+	jd->replies_start = (uint32_t*)(base + h->replies_start);
+	jd->replies = (uint32_t*)(base + h->replies);
+	jd->prev_filter = (uint32_t*)(base + h->prev_filter);
+	jd->prev_filter_bits = h->prev_filter_bits;
+	return jd;
+}
+
+
+/********************************************************************************************/
+/* Shared dictionary */
+
+/* With --shared-joseki first Pachi process to load joseki for some board
+ * size publishes the dictionary image in a posix shared memory segment,
+ * later processes just map it read-only instead of loading it themselves.
+ * Segment name includes image layout so different builds don't fight
+ * over it. Only segments owned by us are used. Segments stay around
+ * until reboot, remove /dev/shm/pachi_joseki* to reclaim them. */
+
+#ifndef _WIN32
+
+static void
+joseki_shm_name(char *name, int bsize)
+{
+	sprintf(name, "/pachi_joseki%i_%x", bsize, (unsigned int)JOSEKI_SHM_LAYOUT);
+}
+
+/* Map shared dictionary for @bsize if there's a valid one. */
+static joseki_dict_t *
+joseki_shm_attach(int bsize, uint64_t checksum)
+{
+	char name[64];  joseki_shm_name(name, bsize);
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)  return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) || st.st_uid != geteuid()) {  close(fd);  return NULL;  }
+	void *map = MAP_FAILED;
+	if ((size_t)st.st_size >= sizeof(joseki_shm_t))
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	joseki_shm_t *h = (map != MAP_FAILED ? map : NULL);
+	bool ready = (h && h->ready);
+	bool valid = (ready && h->size == (uint64_t)st.st_size &&
+		      joseki_image_valid(h, st.st_size, bsize, checksum));
+	if (!valid || !ready) {
+		/* Out of date, or publisher died half-way: make room for a new one. */
+		if (ready || time(NULL) - st.st_mtime > JOSEKI_SHM_STALE) {
+			if (DEBUGL(2))  fprintf(stderr, "joseki: removing stale shared dictionary %s\n", name);
+			shm_unlink(name);
+		}
+		if (h)  munmap(map, st.st_size);
+		return NULL;
+	}
+
+	joseki_dict_t *jd = joseki_image_dict(h, bsize);
+	jd->shm = map;
+	jd->shm_size = st.st_size;
+	return jd;
+}
+
+/* Copy dictionary to shared memory, unless someone else is doing it. */
+static void
+joseki_shm_publish(joseki_dict_t *jd, uint64_t checksum)
+{
+	char name[64];  joseki_shm_name(name, jd->bsize);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)  return;
+
+	joseki_shm_t h;
+	joseki_image_header(jd, checksum, &h);
+	void *map = MAP_FAILED;
+	if (!ftruncate(fd, h.size))
+		map = mmap(NULL, h.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {  shm_unlink(name);  return;  }
+
+	joseki_image_write(jd, &h, map);
+	__sync_synchronize();
+	((joseki_shm_t*)map)->ready = 1;
+	munmap(map, h.size);
+	if (DEBUGL(2))  fprintf(stderr, "joseki: published shared dictionary %s\n", name);
+}
+
+#else   /* _WIN32 */
+
+static joseki_dict_t *joseki_shm_attach(int bsize, uint64_t checksum)    {  return NULL;  }
+static void           joseki_shm_publish(joseki_dict_t *jd, uint64_t checksum)  {  }
+
+#endif
+
+
+/********************************************************************************************/
+/* Compiled dictionary */
+
+/* 'pachi --compile-joseki' writes dictionary images for all board sizes
+ * to joseki19.bin, which gets mapped at startup instead of replaying
+ * joseki19.gtp as long as it's up to date (same checksum). */
+
+#define JOSEKI_DB_MAGIC    0x42444b534f4a4350ULL	/* "PCJOSKDB" */
+#define JOSEKI_MIN_SIZE    13
+#define JOSEKI_DB_SIZES    (19 - JOSEKI_MIN_SIZE + 1)
+
+typedef struct {
+	uint64_t magic;
+	uint32_t layout;
+	uint32_t sizes;
+	uint64_t checksum;
+	uint64_t size;
+	uint64_t images[JOSEKI_DB_SIZES];	/* Image offset for each board size */
+} joseki_db_header_t;
+
+const char *joseki_db_filename = "joseki19.bin";
+
+#ifndef _WIN32
+
+/* Map compiled dictionary for @bsize if it's up to date. */
+static joseki_dict_t *
+joseki_db_attach(int bsize, uint64_t checksum)
+{
+	FILE *f = fopen_data_file(joseki_db_filename, "rb");
+	if (!f)  return NULL;
+
+	joseki_db_header_t h;
+	struct stat st;
+	bool ok = (fread(&h, sizeof(h), 1, f) == 1 && !fstat(fileno(f), &st) &&
+		   h.magic == JOSEKI_DB_MAGIC && h.layout == JOSEKI_SHM_LAYOUT &&
+		   h.sizes == JOSEKI_DB_SIZES && h.size == (uint64_t)st.st_size);
+	if (!ok || h.checksum != checksum) {
+		if (DEBUGL(1))  fprintf(stderr, "%s: %s, ignoring (run 'pachi --compile-joseki').\n", joseki_db_filename,
+					(ok ? "out of date" : "incompatible joseki database"));
+		fclose(f);
+		return NULL;
+	}
+
+	void *map = mmap(NULL, h.size, PROT_READ, MAP_SHARED, fileno(f), 0);
+	fclose(f);
+	if (map == MAP_FAILED)  return NULL;
+
+	uint64_t offset = h.images[bsize - JOSEKI_MIN_SIZE];
+	joseki_shm_t *img = (joseki_shm_t*)((char*)map + offset);
+	if (offset < sizeof(h) || offset % JOSEKI_SHM_ALIGN || offset > h.size - sizeof(*img) ||
+	    !joseki_image_valid(img, h.size - offset, bsize, checksum)) {
+		if (DEBUGL(1))  fprintf(stderr, "%s: bad joseki database, ignoring.\n", joseki_db_filename);
+		munmap(map, h.size);
+		return NULL;
+	}
+
+	joseki_dict_t *jd = joseki_image_dict(img, bsize);
+	jd->shm = map;
+	jd->shm_size = h.size;
+	return jd;
+}
+
+#else   /* _WIN32 */
+
+static joseki_dict_t *joseki_db_attach(int bsize, uint64_t checksum)    {  return NULL;  }
+
+#endif
+
+static void
+joseki_dict_free(joseki_dict_t *jd)
+{
+#ifndef _WIN32
+	if (jd->shm)  munmap(jd->shm, jd->shm_size);
+#endif
+	if (!jd->shm) {
+		free(jd->hash);
+		free(jd->pats);
+		free(jd->keys);
+		free(jd->seq);
+		free(jd->replies_start);
+		free(jd->replies);
+		free(jd->prev_filter);
+	}
+	free(jd);
+}
+
+
+/********************************************************************************************/
+/* Loading */
+
+/* joseki19.gtp gets split in chunks of whole sequences which are replayed
+ * in parallel, each thread with its own recording dictionary. Recorded
+ * patterns are then added to the dictionary in file order: same dictionary
+ * as replaying the file in one go, but hashing (the expensive part) is
+ * done in parallel. */
+
+#define JOSEKI_SCAN_MIN_LINES   500	/* Don't bother with less per thread */
+#define JOSEKI_SCAN_MAX_THREADS 16
+
+typedef struct {
+	const char *fname;
+	char **lines;
+	int *lineno;
+	int n;
+	board_t *b;
+	engine_t e;
+	joseki_dict_t *jd;
+	int variations;
+} joseki_scan_t;
+
+static void *
+joseki_scan_thread(void *data)
+{
+	joseki_scan_t *s = (joseki_scan_t*)data;
+	time_info_t ti[S_MAX];
+	ti[S_BLACK] = ti_none;
+	ti[S_WHITE] = ti_none;
+	gtp_t gtp;  gtp_init(&gtp);
+	for (int i = 0; i < s->n; i++) {
+		gtp.quiet = true;
+		enum parse_code c = gtp_parse(&gtp, s->b, &s->e, ti, s->lines[i]);  /* quiet */
+		/* TODO check gtp command didn't gtp_error() also, will still return P_OK on error ... */
+		if (c != P_OK && c != P_ENGINE_RESET)
+			die("%s:%i  gtp command '%s' failed, aborting.\n", s->fname, s->lineno[i], s->lines[i]);
+	}
+	s->variations = gtp.played_games;
+	return NULL;
+}
+
+/* Load joseki sequences from @f for @bsize, returns compiled dictionary.
  * For board sizes between 13x13 and 19x19 try to convert coordinates. */
+static joseki_dict_t *
+joseki_scan(FILE *f, const char *fname, int bsize, int *variations)
+{
+	int n = 0, alloc = 1024;
+	char **lines = cmalloc(alloc * sizeof(char*));
+	int *lineno = cmalloc(alloc * sizeof(int));
+	char buf[4096];
+	for (int l = 1; fgets(buf, 4096, f); l++) {
+		if (bsize != 19 && convert_coords(bsize, buf) < 0)
+			skip_sequence(buf, 4096, f, &l);
+		if (n == alloc) {
+			alloc *= 2;
+			lines = crealloc(lines, alloc * sizeof(char*));
+			lineno = crealloc(lineno, alloc * sizeof(int));
+		}
+		lines[n] = strdup(buf);
+		lineno[n++] = l;
+	}
+
+	int threads = MIN(get_nprocessors(), JOSEKI_SCAN_MAX_THREADS);
+	threads = MIN(threads, n / JOSEKI_SCAN_MIN_LINES);
+	threads = MAX(threads, 1);
+
+	/* Boards and engines set up here: board statics and cache get
+	 * initialized before threads start using them. */
+	joseki_scan_t scans[threads];
+	int start = 0;
+	for (int t = 0; t < threads; t++) {
+		joseki_scan_t *s = &scans[t];
+		int end = (t == threads - 1 ? n : (long)n * (t + 1) / threads);
+		while (end < n && !str_prefix("clear_board", lines[end]))  end++;
+		s->fname = fname;
+		s->lines = lines + start;
+		s->lineno = lineno + start;
+		s->n = end - start;
+		s->jd = joseki_init(bsize, true);
+		s->b = board_new(bsize, NULL);
+		engine_init(&s->e, E_JOSEKISCAN, NULL, s->b);
+		josekiscan_set_dict(&s->e, s->jd);
+		start = end;
+	}
+
+	pthread_t tids[threads];
+	for (int t = 1; t < threads; t++)
+		pthread_create(&tids[t], NULL, joseki_scan_thread, &scans[t]);
+	joseki_scan_thread(&scans[0]);
+
+	joseki_dict_t *jd = joseki_init(bsize, false);
+	*variations = 0;
+	for (int t = 0; t < threads; t++) {
+		joseki_scan_t *s = &scans[t];
+		if (t)  pthread_join(tids[t], NULL);
+		joseki_merge(jd, s->jd);
+		*variations += s->variations;
+		joseki_dict_free(s->jd);
+		engine_done(&s->e);
+		board_delete(&s->b);
+	}
+	for (int i = 0; i < n; i++)
+		free(lines[i]);
+	free(lines);
+	free(lineno);
+
+	joseki_compile(jd);
+	return jd;
+}
+
+/* Load joseki database. */
 void
 joseki_load(int bsize)
 {
 	if (!joseki_enabled)  return;
 	if (joseki_dict && joseki_dict->bsize != bsize)  joseki_done();
 	if (joseki_dict && joseki_dict->bsize == bsize)  return;
-	if (joseki_dict || bsize < 13)  return;  /* no joseki below 13x13 */
+	if (joseki_dict || bsize < JOSEKI_MIN_SIZE)  return;  /* no joseki below 13x13 */
 
 	char fname[1024];
 	snprintf(fname, 1024, "joseki19.gtp");
@@ -266,54 +970,98 @@ joseki_load(int bsize)
 		return;  
 	}
 
-	joseki_dict = joseki_init(bsize);
+	uint64_t checksum = joseki_checksum(f);
+	if (joseki_shared) {
+		joseki_dict = joseki_shm_attach(bsize, checksum);
+		if (joseki_dict) {
+			if (DEBUGL(2))  fprintf(stderr, "Loaded joseki dictionary for %ix%i (shared).\n", bsize, bsize);
+			if (DEBUGL(3))  joseki_stats(joseki_dict);
+			fclose(f);
+			return;
+		}
+	}
 
-	DEBUG_QUIET();
-	board_t *b = board_new(bsize, NULL);
-	engine_t e;  engine_init(&e, E_JOSEKISCAN, NULL, NULL);
-	time_info_t ti[S_MAX];
-	ti[S_BLACK] = ti_none;
-	ti[S_WHITE] = ti_none;
-	char buf[4096];
-	gtp_t gtp;  gtp_init(&gtp);
-	for (int lineno = 1; fgets(buf, 4096, f); lineno++) {
-		if (bsize != 19 && convert_coords(bsize, buf) < 0)
-			skip_sequence(buf, 4096, f, &lineno);
+	int variations = 0;
+	joseki_dict = joseki_db_attach(bsize, checksum);
+	bool compiled = (joseki_dict != NULL);
+	if (!compiled) {
+		/* Quiet only if there's something to hide: patterns may be loading
+		 * in parallel and print at lower levels. */
+		bool quiet = DEBUGL(2);
+		if (quiet)  DEBUG_QUIET();
+		joseki_dict = joseki_scan(f, fname, bsize, &variations);
+		if (quiet)  DEBUG_QUIET_END();
+	}
 
-		gtp.quiet = true;
-		enum parse_code c = gtp_parse(&gtp, b, &e, ti, buf);  /* quiet */
-		/* TODO check gtp command didn't gtp_error() also, will still return P_OK on error ... */
-		if (c != P_OK && c != P_ENGINE_RESET)
-			die("%s:%i  gtp command '%s' failed, aborting.\n", fname, lineno, buf);		
+	/* Switch to shared copy once published, saves memory here too. */
+	if (joseki_shared) {
+		joseki_shm_publish(joseki_dict, checksum);
+		joseki_dict_t *jd = joseki_shm_attach(bsize, checksum);
+		if (jd) {  joseki_dict_free(joseki_dict);  joseki_dict = jd;  }
 	}
-	engine_done(&e);
-	board_delete(&b);
-	DEBUG_QUIET_END();
-	int variations = gtp.played_games;
 	
-	if (DEBUGL(2))  fprintf(stderr, "Loaded joseki dictionary for %ix%i (%i variations).\n", bsize, bsize, variations);
+	if (DEBUGL(2) && compiled)   fprintf(stderr, "Loaded joseki dictionary for %ix%i (compiled).\n", bsize, bsize);
+	if (DEBUGL(2) && !compiled)  fprintf(stderr, "Loaded joseki dictionary for %ix%i (%i variations).\n", bsize, bsize, variations);
 	if (DEBUGL(3))  joseki_stats(joseki_dict);
 	fclose(f);
 }
 
+void
+joseki_db_compile(const char *filename)
+{
+	char fname[1024];
+	snprintf(fname, 1024, "joseki19.gtp");
+	FILE *f = fopen_data_file(fname, "r");
+	if (!f)  die("%s: %s\n", fname, strerror(errno));
+
+	joseki_db_header_t h = { 0, };
+	h.magic = JOSEKI_DB_MAGIC;
+	h.layout = JOSEKI_SHM_LAYOUT;
+	h.sizes = JOSEKI_DB_SIZES;
+	h.checksum = joseki_checksum(f);
+	h.size = sizeof(h);
+
+	joseki_dict_t *dicts[JOSEKI_DB_SIZES];
+	joseki_shm_t images[JOSEKI_DB_SIZES];
+	for (int i = 0; i < JOSEKI_DB_SIZES; i++) {
+		int variations;
+		dicts[i] = joseki_scan(f, fname, JOSEKI_MIN_SIZE + i, &variations);
+		rewind(f);
+		joseki_image_header(dicts[i], h.checksum, &images[i]);
+		images[i].ready = 1;
+		h.images[i] = shm_section(&h.size, images[i].size);
+	}
+	fclose(f);
+
+	char *map = calloc2(h.size, char);
+	memcpy(map, &h, sizeof(h));
+	for (int i = 0; i < JOSEKI_DB_SIZES; i++) {
+		joseki_image_write(dicts[i], &images[i], map + h.images[i]);
+		joseki_dict_free(dicts[i]);
+	}
+
+	f = fopen(filename, "wb");
+	if (!f || fwrite(map, 1, h.size, f) != h.size || fclose(f))
+		die("%s: write failed\n", filename);
+	free(map);
+
+	fprintf(stderr, "Wrote %s: %ix%i - 19x19 (%.1fMb)\n",
+		filename, JOSEKI_MIN_SIZE, JOSEKI_MIN_SIZE, (double)h.size / (1024 * 1024));
+}
+
 void
 joseki_done()
 {
 	if (!joseki_dict) return;
 	
-	josekipat_t *prev = NULL;
-	forall_joseki_patterns(joseki_dict)         {  free(prev);  prev = p;  }
-	forall_3x3_joseki_patterns(joseki_dict)     {  free(prev);  prev = p;  }
-	forall_ignored_joseki_patterns(joseki_dict) {  free(prev);  prev = p;  }
-	free(prev);
-	free(joseki_dict);
+	joseki_dict_free(joseki_dict);
 	joseki_dict = NULL;
 }
 
 static float
-joseki_rating(board_t *b, josekipat_t *p)
+joseki_rating(joseki_dict_t *jd, board_t *b, josekipat_t *p)
 {
-	coord_t prev = (p->prev ? p->prev->coord : pass);
+	coord_t prev = (p->prev ? joseki_prev(jd, p)->coord : pass);
 	coord_t last = last_move(b).coord;
 	if (b->moves < 4)		     return 0.2; /* Play corners first */
 	if (p->flags & JOSEKI_FLAGS_LATER)   return 0.2; /* Low prio */
@@ -322,42 +1070,67 @@ joseki_rating(board_t *b, josekipat_t *p)
 	return 0.2;
 }
 
+/* Spatial hashes of prev moves, many candidates share the same prevs.
+ * Only valid while the board doesn't change. */
+struct joseki_hashes {
+	uint8_t done[BOARD_MAX_COORDS];		/* bit 0: full hash, bit 1: 3x3 hash */
+	hash_t  h[BOARD_MAX_COORDS];
+	hash_t  h3[BOARD_MAX_COORDS];
+};
+
+static hash_t
+prev_hash(board_t *b, josekipat_t *prev, joseki_hashes_t *cache)
+{
+	coord_t c = prev->coord;
+	bool is_3x3 = (prev->flags & JOSEKI_FLAGS_3X3);
+	if (!cache)  return (is_3x3 ? joseki_3x3_spatial_hash(b, c, prev->color) :
+				      joseki_spatial_hash(b, c, prev->color));
+
+	/* prev->color is board color here, fine to key by coord. */
+	int bit = (is_3x3 ? 2 : 1);
+	hash_t *h = (is_3x3 ? &cache->h3[c] : &cache->h[c]);
+	if (!(cache->done[c] & bit)) {
+		*h = (is_3x3 ? joseki_3x3_spatial_hash(b, c, prev->color) :
+			       joseki_spatial_hash(b, c, prev->color));
+		cache->done[c] |= bit;
+	}
+	return *h;
+}
+
 static bool
-joseki_prev_matches(board_t *b, josekipat_t *prev)
+joseki_prev_matches(joseki_dict_t *jd, board_t *b, josekipat_t *prev, joseki_hashes_t *cache)
 {
 	if (!prev)  return true;
 	if (board_at(b, prev->coord) != prev->color)  return false;
 	
 	/* If 3x3 prev, continue until we have a full match ...*/
 	if (prev->flags & JOSEKI_FLAGS_3X3) {
-		if (prev->h != joseki_3x3_spatial_hash(b, prev->coord, prev->color))  return false;
+		if (prev->h != prev_hash(b, prev, cache))  return false;
 		
 		/* hack, won't work if there are captures ... */
 		enum stone tmp = board_at(b, prev->coord);  board_at(b, prev->coord) = S_NONE;
-		bool r = joseki_prev_matches(b, prev->prev);
+		bool r = joseki_prev_matches(jd, b, joseki_prev(jd, prev), NULL);
 		board_at(b, prev->coord) = tmp;
 		return r;
 	}
 	
-	return (prev->h == joseki_spatial_hash(b, prev->coord, prev->color));
+	return (prev->h == prev_hash(b, prev, cache));
 }
 
 /* XXX can be several matches for one move in case multiple prev moves lead here.
  * we only return first match, however prefer strong matches over weak matches
  * and last move matches above all else. */ 
 static josekipat_t*
-joseki_lookup_regular(joseki_dict_t *jd, board_t *b, coord_t coord, enum stone color)
+joseki_lookup_regular(joseki_dict_t *jd, board_t *b, coord_t coord, enum stone color, joseki_hashes_t *cache)
 {
-	/* TODO we already computed hashes for spatial patterns, reuse instead ? */
 	hash_t h = joseki_spatial_hash(b, coord, color);
-	uint32_t kh = joseki_dict_hash(h, coord);
+	joseki_key_t *k = joseki_key_find(jd, JK_FULL, coord, color, h);
+	if (!k)  return NULL;
 
 	josekipat_t *match_low = NULL, *match_prev = NULL, *match_any = NULL;
-	josekipat_t p1 = josekipat(coord, color, h, NULL, 0);
-	for (josekipat_t *p = jd->hash[kh]; p; p = p->next) {
-		josekipat_t *prev = p->prev;
-		if (!joseki_dict_equal(&p1, p))     continue;
-		if (!joseki_prev_matches(b, prev))  continue;
+	foreach_key_pattern(jd, k) {
+		josekipat_t *prev = joseki_prev(jd, p);
+		if (!joseki_prev_matches(jd, b, prev, cache))  continue;
 		
 		if (!prev)  {  match_any = p;  continue;  }		/* weak match: no previous move */
 		
@@ -367,7 +1140,7 @@ joseki_lookup_regular(joseki_dict_t *jd, board_t *b, coord_t coord, enum stone c
 		if (prev->coord == last_move(b).coord &&
 		    prev->color == last_move(b).color)
 			return p;					/* last move match */
-	}
+	} foreach_key_pattern_end;
 
 	return (match_prev ? match_prev : (match_low ? match_low : match_any));
 }
@@ -377,12 +1150,13 @@ josekipat_t*
 joseki_lookup_3x3(joseki_dict_t *jd, board_t *b, coord_t coord, enum stone color)
 {
 	hash_t h = joseki_3x3_spatial_hash(b, coord, color);
-	josekipat_t p1 = josekipat(coord, color, h, NULL, 0);
+	joseki_key_t *k = joseki_key_find(jd, JK_3X3, coord, color, h);
+	if (!k)  return NULL;
+
 	josekipat_t *match_low = NULL, *match_prev = NULL;
-	for (josekipat_t *p = jd->pat_3x3[color]; p; p = p->next) {
-		josekipat_t *prev = p->prev;
-		if (!joseki_dict_equal(&p1, p))     continue;
-		if (!joseki_prev_matches(b, prev))  continue;
+	foreach_key_pattern(jd, k) {
+		josekipat_t *prev = joseki_prev(jd, p);
+		if (!joseki_prev_matches(jd, b, prev, NULL))  continue;
 		
 		/* no weak matches for 3x3 */
 
@@ -392,48 +1166,41 @@ joseki_lookup_3x3(joseki_dict_t *jd, board_t *b, coord_t coord, enum stone color
 		if (prev->coord == last_move(b).coord &&
 		    prev->color == last_move(b).color)
 			return p;					/* last move match */
-	}
+	} foreach_key_pattern_end;
 	return (match_prev ? match_prev : match_low);
 }
 
 josekipat_t*
 joseki_lookup_ignored(joseki_dict_t *jd, board_t *b, coord_t coord, enum stone color)
 {
-	hash_t h  = joseki_spatial_hash(b, coord, color);
-	hash_t h3 = joseki_3x3_spatial_hash(b, coord, color);
+	hash_t h[2] = {  joseki_spatial_hash(b, coord, color),
+			 joseki_3x3_spatial_hash(b, coord, color)  };
 
-	josekipat_t p1 = josekipat(coord, color, h,  NULL, 0);
-	josekipat_t p2 = josekipat(coord, color, h3, NULL, 0);
-	for (josekipat_t *p = jd->ignored; p; p = p->next) {
-		// should check flags and compare only one ...
-		if (!joseki_dict_equal(&p1, p) && !joseki_dict_equal(&p2, p))  continue;
-		if (joseki_prev_matches(b, p->prev))  return p;
+	for (int i = 0; i < 2; i++) {
+		joseki_key_t *k = joseki_key_find(jd, JK_IGNORED, coord, color, h[i]);
+		if (!k)  continue;
+		foreach_key_pattern(jd, k) {
+			// should check flags and compare only one ...
+			if (joseki_prev_matches(jd, b, joseki_prev(jd, p), NULL))  return p;
+		} foreach_key_pattern_end;
 	}
 	return NULL;
 }
 
-static int
-append_3x3_matches(joseki_dict_t *jd, board_t *b, enum stone color,
-		   coord_t *coords, float *ratings, int matches)
+/* Best rating of 3x3 patterns matching here, 0 if none. */
+static float
+joseki_3x3_rating(joseki_dict_t *jd, board_t *b, coord_t coord, enum stone color, hash_t h3,
+		  joseki_hashes_t *cache)
 {
-	for (josekipat_t *p = jd->pat_3x3[color]; p; p = p->next) {
-		if (board_at(b, p->coord) != S_NONE)  continue;
-		if (p->h != joseki_3x3_spatial_hash(b, p->coord, color))  continue;
-		if (!joseki_prev_matches(b, p->prev))  continue;
-		
-		float rating = joseki_rating(b, p);
-		for (int i = 0; i < matches; i++) {
-			if (coords[i] != p->coord)  continue;
-			ratings[i] = MAX(ratings[i], rating);
-			goto done;
-		}
-
-		coords[matches] = p->coord;
-		ratings[matches++] = rating;
-	done:	continue;
-	}
+	joseki_key_t *k = joseki_key_find(jd, JK_3X3, coord, color, h3);
+	if (!k)  return 0;
 
-	return matches;
+	float rating = 0;
+	foreach_key_pattern(jd, k) {
+		if (!joseki_prev_matches(jd, b, joseki_prev(jd, p), cache))  continue;
+		rating = MAX(rating, joseki_rating(jd, b, p));
+	} foreach_key_pattern_end;
+	return rating;
 }
 
 int
@@ -441,17 +1208,63 @@ joseki_list_moves(joseki_dict_t *jd, board_t *b, enum stone color,
                   coord_t *coords, float *ratings)
 {
 	assert(using_joseki(b));
+	joseki_hashes_t cache;
+	memset(cache.done, 0, sizeof(cache.done));
 	int matches = 0;
 	
 	foreach_free_point(b) {
-		josekipat_t *p = joseki_lookup_regular(jd, b, c, color);
-		if (!p)  continue;
+		/* Cheap 3x3 hash first, full hash only if some pattern could match. */
+		hash_t h3 = joseki_3x3_spatial_hash(b, c, color);
+		float rating = 0;
+		if (joseki_key_find(jd, JK_QUICK, c, color, h3)) {
+			josekipat_t *p = joseki_lookup_regular(jd, b, c, color, &cache);
+			if (p)  rating = joseki_rating(jd, b, p);
+		}
+		rating = MAX(rating, joseki_3x3_rating(jd, b, c, color, h3, &cache));
+		if (!rating)  continue;
 		
 		coords[matches] = c;
-		ratings[matches++] = joseki_rating(b, p);
+		ratings[matches++] = rating;
 	} foreach_free_point_end;
 
-	return append_3x3_matches(jd, b, color, coords, ratings, matches);
+	return matches;
+}
+
+/* Patterns following last move directly: only one hash to check when there
+ * are none, the usual case outside of joseki. Weak matches and interrupted
+ * joseki are left out. */
+int
+joseki_list_replies(joseki_dict_t *jd, board_t *b, enum stone color, coord_t *coords)
+{
+	move_t last = last_move(b);
+	if (is_pass(last.coord) || is_resign(last.coord))  return 0;
+	if (!joseki_prev_filter(jd, last.coord, last.color,
+				joseki_3x3_spatial_hash(b, last.coord, last.color)))
+		return 0;
+
+	int n = 0;
+	hash_t h = joseki_spatial_hash(b, last.coord, last.color);
+	int kinds[2] = { JK_FULL, JK_IGNORED };
+	for (int i = 0; i < 2; i++) {
+		joseki_key_t *k = joseki_key_find(jd, kinds[i], last.coord, last.color, h);
+		if (!k)  continue;
+		foreach_key_pattern(jd, k) {
+			if (!joseki_reply_prev(p))  continue;
+			uint32_t prev = joseki_id(jd, p);
+			foreach_joseki_reply(jd, prev) {
+				if (p->color != color || board_at(b, p->coord) != S_NONE)  continue;
+				hash_t ph = ((p->flags & JOSEKI_FLAGS_3X3) ? joseki_3x3_spatial_hash(b, p->coord, color) :
+									     joseki_spatial_hash(b, p->coord, color));
+				if (p->h != ph)  continue;
+				
+				for (int j = 0; j < n; j++)
+					if (coords[j] == p->coord)  goto next;
+				coords[n++] = p->coord;
+			next:	continue;
+			} foreach_joseki_reply_end;
+		} foreach_key_pattern_end;
+	}
+	return n;
 }
 
 void
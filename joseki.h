@@ -14,44 +14,110 @@
 #define JOSEKI_FLAGS_3X3     (1 << 1)
 #define JOSEKI_FLAGS_LATER   (1 << 2)
 
+/* Patterns live in one array and are linked by index (0: none) so that
+ * the dictionary can be shared between processes, see joseki.c */
 typedef struct josekipat {
-	short   coord;
-	uint8_t color;
-	uint8_t flags;
-	hash_t  h;	/* full hash */
-	struct josekipat *prev;
+	short    coord;
+	uint8_t  color;
+	uint8_t  flags;
+	hash_t   h;	/* full hash */
+	hash_t   h3;	/* 3x3 hash, for quick rejection */
+	uint32_t prev;	/* previous move */
 	
-	struct josekipat *next;  /* next hash table entry */
+	uint32_t next;  /* next hash table entry (while loading) */
 } josekipat_t;
 
 #define josekipat(coord, color, h, prev, flags) \
-	{  (short)(coord), (color), (uint8_t)(flags), (h), (prev)  }
+	{  (short)(coord), (color), (uint8_t)(flags), (h), 0, (prev)  }
 
-#define joseki_hash_bits 18  /* 1Mb w/ 32-bit pointers */
+#define joseki_hash_bits 18  /* 1Mb */
 #define joseki_hash_mask ((1 << joseki_hash_bits) - 1)
 
+/* Compiled index, built once dictionary is loaded. Patterns with the same
+ * key (kind, coord, color, hash) are stored as one run in seq[] so finding
+ * matches for a move is a single probe. Quick keys mark 3x3 hashes of
+ * regular patterns, most candidates get rejected without computing the
+ * full hash. Replies to each pattern are stored as one run in replies[],
+ * prev_filter[] has 3x3 hash fingerprints of patterns with replies so that
+ * playouts can skip moves outside of joseki without leaving the cache. */
+enum joseki_key_kind {
+	JK_NONE = 0,
+	JK_FULL,		/* regular patterns */
+	JK_3X3,			/* 3x3 only patterns */
+	JK_IGNORED,		/* ignored patterns, full or 3x3 hash */
+	JK_QUICK,		/* 3x3 hash of regular patterns, no run */
+};
+
+typedef struct {
+	hash_t   h;
+	short    coord;
+	uint8_t  color;
+	uint8_t  kind;
+	uint32_t first;		/* run in seq[] */
+	uint32_t n;
+} joseki_key_t;
+
 /* The joseki dictionary for given board size. */
 typedef struct {
 	int bsize;
-	josekipat_t *hash[1 << joseki_hash_bits];  /* regular patterns hashtable */
-	josekipat_t *pat_3x3[S_MAX];               /* 3x3 only patterns */
-	josekipat_t *ignored;                      /* ignored patterns (linked list) */
+	uint32_t *hash;                  /* regular patterns hashtable (while loading) */
+	uint32_t pat_3x3[S_MAX];         /* 3x3 only patterns (while loading) */
+	uint32_t ignored;                /* ignored patterns (while loading) */
+	bool recording;                  /* just record patterns, see joseki_add() */
+	josekipat_t *pats;               /* all patterns, pats[0] unused */
+	unsigned int npats;
+	unsigned int alloc;
+
+	joseki_key_t *keys;              /* compiled index */
+	unsigned int key_bits;
+	uint32_t *seq;                   /* pattern runs, see joseki_key_t */
+	unsigned int nseq;
+	uint32_t *replies_start;         /* replies to pattern i: replies[start[i] .. start[i+1]] */
+	uint32_t *replies;
+	uint32_t *prev_filter;
+	unsigned int prev_filter_bits;
+
+	void *shm;                       /* shared image we're using, if any */
+	size_t shm_size;
 } joseki_dict_t;
 
+static inline josekipat_t *
+joseki_pat(joseki_dict_t *jd, uint32_t i)
+{
+	return (i ? &jd->pats[i] : NULL);
+}
+
+#define joseki_prev(jd, p)  joseki_pat((jd), (p)->prev)
+#define joseki_next(jd, p)  joseki_pat((jd), (p)->next)
+#define joseki_id(jd, p)    ((p) ? (uint32_t)((p) - (jd)->pats) : 0)
+
 extern joseki_dict_t *joseki_dict;
 
 /* Enable / disable joseki component */
 void disable_joseki();
 void require_joseki();
 
+/* Share joseki dictionary with other Pachi processes (posix shared memory). */
+void share_joseki();
+
 bool using_joseki(board_t *b);
 void joseki_load(int bsize);
 void joseki_done();
-josekipat_t *joseki_add(joseki_dict_t *jd, board_t *b, coord_t coord, enum stone color, josekipat_t *prev, int flags);
+
+/* Compiled joseki database: dictionaries for all board sizes, mapped at
+ * startup instead of replaying joseki19.gtp if it's up to date.
+ * Generate with 'pachi --compile-joseki'. */
+extern const char *joseki_db_filename;
+void joseki_db_compile(const char *filename);
+/* Returns pattern id, use as @prev for next move. Pattern pointers
+ * don't survive additions. */
+uint32_t joseki_add(joseki_dict_t *jd, board_t *b, coord_t coord, enum stone color, uint32_t prev, int flags);
 josekipat_t *joseki_lookup(joseki_dict_t *jd, board_t *b, coord_t coord, enum stone color);
 josekipat_t *joseki_lookup_ignored(joseki_dict_t *jd, board_t *b, coord_t coord, enum stone color);
 josekipat_t *joseki_lookup_3x3(joseki_dict_t *jd, board_t *b, coord_t coord, enum stone color);
 int  joseki_list_moves(joseki_dict_t *jd, board_t *b, enum stone color, coord_t *coords, float *ratings);
+/* Only joseki answers to last move, cheap enough for playouts. */
+int  joseki_list_replies(joseki_dict_t *jd, board_t *b, enum stone color, coord_t *coords);
 void joseki_rate_moves(joseki_dict_t *jd, board_t *b, enum stone color, float *map);
 void get_joseki_best_moves(board_t *b, coord_t *coords, float *ratings, int matches, coord_t *best_c, float *best_r, int nbest);
 void print_joseki_best_moves(board_t *b, coord_t *best_c, float *best_r, int nbest);
@@ -60,16 +126,18 @@ void print_joseki_moves(joseki_dict_t *jd, board_t *b, enum stone color);
 
 
 /* Iterate over all dictionary patterns. */
+#define forall_joseki_patterns_flags(jd, mask_, flags_) \
+	for (josekipat_t *p = (jd)->pats + 1; p < (jd)->pats + (jd)->npats; p++) \
+		if ((p->flags & (mask_)) == (flags_))
+
 #define forall_joseki_patterns(jd) \
-	for (unsigned int id = 0; id < (1 << joseki_hash_bits); id++) \
-		for (josekipat_t *p = (jd)->hash[id]; p; p = p->next)
+	forall_joseki_patterns_flags(jd, JOSEKI_FLAGS_IGNORE | JOSEKI_FLAGS_3X3, 0)
 
 #define forall_3x3_joseki_patterns(jd) \
-	for (int _color = S_BLACK; _color <= S_WHITE; _color++) \
-		for (josekipat_t *p = jd->pat_3x3[_color]; p; p = p->next)
+	forall_joseki_patterns_flags(jd, JOSEKI_FLAGS_IGNORE | JOSEKI_FLAGS_3X3, JOSEKI_FLAGS_3X3)
 
 #define forall_ignored_joseki_patterns(jd) \
-	for (josekipat_t *p = (jd)->ignored; p; p = p->next)
+	forall_joseki_patterns_flags(jd, JOSEKI_FLAGS_IGNORE, JOSEKI_FLAGS_IGNORE)
 
 
 #endif
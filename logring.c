@@ -0,0 +1,231 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "timeinfo.h"
+#include "logring.h"
+
+/* Each logging thread owns a ring, it's the only one writing entries and
+ * moving head. The drain thread (or log_flush() caller, serialized by
+ * drain_mutex) is the only one moving tail. */
+
+#define LOG_RINGS		256	/* Max threads logging at once */
+#define LOG_RING_SIZE		512	/* Entries per ring */
+#define LOG_ENTRY_LEN		240	/* Longer messages take several entries */
+#define LOG_MSG_MAX		4096	/* Longer messages get truncated */
+#define LOG_DRAIN_INTERVAL	0.01
+
+typedef struct {
+	double   time;
+	uint16_t len;
+	bool     cont;			/* Continues previous entry */
+	char     text[LOG_ENTRY_LEN];
+} log_entry_t;
+
+typedef struct {
+	volatile unsigned int head;	/* Next entry to write (owner) */
+	volatile unsigned int tail;	/* Next entry to drain (drain) */
+	volatile int in_use;		/* Owner thread still around */
+	volatile unsigned int dropped;	/* Messages lost, ring was full */
+	unsigned int dropped_shown;
+	int id;
+	log_entry_t entries[LOG_RING_SIZE];
+} log_ring_t;
+
+static bool log_async = false;
+static double log_start_time;
+static log_ring_t *rings[LOG_RINGS];
+static volatile int nrings = 0;
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static __thread log_ring_t *thread_ring = NULL;
+static __thread bool thread_no_ring = false;
+
+bool
+log_async_enabled(void)
+{
+	return log_async;
+}
+
+/* Thread exit: ring can be reused once drained. */
+static void
+log_ring_release(void *data)
+{
+	log_ring_t *r = (log_ring_t*)data;
+	r->in_use = false;
+}
+
+static log_ring_t *
+log_ring_get(void)
+{
+	if (thread_ring || thread_no_ring)  return thread_ring;
+
+	pthread_mutex_lock(&ring_mutex);
+	log_ring_t *r = NULL;
+	for (int i = 0; i < nrings && !r; i++)
+		if (!rings[i]->in_use && rings[i]->head == rings[i]->tail)
+			r = rings[i];
+	if (!r && nrings < LOG_RINGS) {
+		r = calloc2(1, log_ring_t);
+		r->id = nrings;
+		rings[nrings] = r;
+		__sync_synchronize();
+		nrings++;
+	}
+	if (r) {
+		r->in_use = true;
+		pthread_setspecific(ring_key, r);
+	}
+	pthread_mutex_unlock(&ring_mutex);
+
+	thread_ring = r;
+	thread_no_ring = !r;	/* Too many threads, log synchronously */
+	return r;
+}
+
+void
+log_printf(const char *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	log_ring_t *r = (log_async ? log_ring_get() : NULL);
+	if (!r) {
+		vfprintf(stderr, format, ap);
+		va_end(ap);
+		return;
+	}
+
+	char buf[LOG_MSG_MAX];
+	int len = vsnprintf(buf, sizeof(buf), format, ap);
+	va_end(ap);
+	if (len <= 0)  return;
+	if (len >= LOG_MSG_MAX)  len = LOG_MSG_MAX - 1;
+
+	unsigned int n = (len + LOG_ENTRY_LEN - 1) / LOG_ENTRY_LEN;
+	unsigned int head = r->head;
+	if (head - r->tail + n > LOG_RING_SIZE) {
+		__sync_fetch_and_add(&r->dropped, 1);
+		return;
+	}
+
+	double t = time_now();
+	for (unsigned int i = 0; i < n; i++) {
+		log_entry_t *e = &r->entries[(head + i) % LOG_RING_SIZE];
+		int l = (i < n - 1 ? LOG_ENTRY_LEN : len - i * LOG_ENTRY_LEN);
+		e->time = t;
+		e->cont = (i > 0);
+		e->len = l;
+		memcpy(e->text, buf + i * LOG_ENTRY_LEN, l);
+	}
+	__sync_synchronize();	/* Entries written before drain can see them */
+	r->head = head + n;
+}
+
+/* Write out pending messages, oldest first. drain_mutex must be held. */
+static void
+log_drain(void)
+{
+	int n = nrings;
+	unsigned int heads[LOG_RINGS];
+	for (int i = 0; i < n; i++)
+		heads[i] = rings[i]->head;
+	__sync_synchronize();	/* See entries up to these heads */
+
+	while (1) {
+		int oldest = -1;
+		for (int i = 0; i < n; i++) {
+			log_ring_t *r = rings[i];
+			if (r->tail == heads[i])  continue;
+			if (oldest < 0 || r->entries[r->tail % LOG_RING_SIZE].time <
+					  rings[oldest]->entries[rings[oldest]->tail % LOG_RING_SIZE].time)
+				oldest = i;
+		}
+		if (oldest < 0)  break;
+
+		log_ring_t *r = rings[oldest];
+		unsigned int tail = r->tail;
+		log_entry_t *e = &r->entries[tail % LOG_RING_SIZE];
+		fprintf(stderr, "[%12.6f t%i] ", e->time - log_start_time, r->id);
+		do {
+			fwrite(e->text, 1, e->len, stderr);
+			e = &r->entries[++tail % LOG_RING_SIZE];
+		} while (tail != heads[oldest] && e->cont);
+		__sync_synchronize();	/* Done reading before owner reuses entries */
+		r->tail = tail;
+	}
+
+	for (int i = 0; i < n; i++) {
+		log_ring_t *r = rings[i];
+		unsigned int dropped = r->dropped;
+		if (dropped == r->dropped_shown)  continue;
+		fprintf(stderr, "[log: t%i: %u messages dropped]\n", r->id, dropped - r->dropped_shown);
+		r->dropped_shown = dropped;
+	}
+	fflush(stderr);
+}
+
+void
+log_flush(void)
+{
+	if (!log_async)  return;
+	pthread_mutex_lock(&drain_mutex);
+	log_drain();
+	pthread_mutex_unlock(&drain_mutex);
+}
+
+static void *
+log_drain_thread(void *data)
+{
+	while (1) {
+		time_sleep(LOG_DRAIN_INTERVAL);
+		log_flush();
+	}
+	return NULL;
+}
+
+static void
+log_drain_thread_start(void)
+{
+	pthread_t thread;
+	pthread_create(&thread, NULL, log_drain_thread, NULL);
+	pthread_detach(thread);
+}
+
+/* Forked child: other threads' rings are parent's business, and we
+ * need our own drain thread. */
+static void
+log_atfork_child(void)
+{
+	pthread_mutex_init(&ring_mutex, NULL);
+	pthread_mutex_init(&drain_mutex, NULL);
+	for (int i = 0; i < nrings; i++) {
+		log_ring_t *r = rings[i];
+		if (r == thread_ring)  continue;
+		r->tail = r->head;
+		r->in_use = false;
+	}
+	log_drain_thread_start();
+}
+
+static void
+log_atexit(void)
+{
+	log_flush();
+}
+
+void
+log_async_start(void)
+{
+	if (log_async)  return;
+	log_start_time = time_now();
+	pthread_key_create(&ring_key, log_ring_release);
+	pthread_atfork(NULL, NULL, log_atfork_child);
+	atexit(log_atexit);
+	log_async = true;
+	log_drain_thread_start();
+}
@@ -0,0 +1,31 @@
+#ifndef PACHI_LOGRING_H
+#define PACHI_LOGRING_H
+
+/* Asynchronous logging for hot paths (search threads).
+ * By default log_printf() is just fprintf(stderr, ...). With async logging
+ * enabled (--log-async) each thread writes messages into its own lock-free
+ * ring buffer instead, and a background thread drains them to stderr with
+ * timestamp and thread id:
+ *
+ *   [   12.345678 t3] message
+ *
+ * Threads never block on stdio then. If a ring fills up messages get dropped
+ * (and counted) rather than stalling the thread. Messages should be whole
+ * lines, long ones get split over several ring entries.
+ * Async messages can get out of order with respect to plain fprintf() output
+ * still pending, use log_flush() where that matters. */
+
+#include <stdbool.h>
+
+/* Start async logging: background thread, flushes at exit. */
+void log_async_start(void);
+bool log_async_enabled(void);
+
+/* Log message, see above. */
+void log_printf(const char *format, ...)
+	__attribute__ ((format (printf, 1, 2)));
+
+/* Write out all pending async messages now. */
+void log_flush(void);
+
+#endif
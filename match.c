@@ -0,0 +1,242 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <sys/wait.h>
+#endif
+
+#define DEBUG
+
+#include "board.h"
+#include "debug.h"
+#include "engine.h"
+#include "match.h"
+#include "random.h"
+#include "timeinfo.h"
+
+/* Game over if it goes on for that long, scored as is. */
+#define match_max_moves(b)  (3 * board_rsize(b) * board_rsize(b))
+
+/* Fast scoring for finished games (see uct scoring_time option). */
+#define MATCH_SCORER_ARGS  "scoring_time=0.5"
+
+static char *engine_names[] = { "A", "B" };
+
+typedef struct {
+	engine_t    e;
+	time_info_t ti[S_MAX];
+} match_player_t;
+
+/* Engine args with per-game thread budget: cpus get split among jobs. */
+static char *
+match_engine_args(int id, char *args, int jobs)
+{
+	if (strstr(args, "pondering"))
+		die("--match: pondering not supported, engines share the cpus\n");
+
+	static_strbuf(buf, 1024);
+	sbprintf(buf, "%s", args);
+	if ((id == E_UCT || id == E_MONTECARLO || id == E_REPLAY) && !strstr(args, "threads=")) {
+		int threads = MAX(get_nprocessors() / jobs, 1);
+		sbprintf(buf, "%sthreads=%i", (*args ? "," : ""), threads);
+	}
+	return strdup(buf->str);
+}
+
+static coord_t
+match_genmove(board_t *b, match_player_t *p, enum stone color)
+{
+	time_info_t *ti = p->ti;
+	if (!ti[color].timer_start)
+		time_start_timer(&ti[color]);
+
+	time_info_t *ti_genmove = time_info_genmove(b, ti, color);
+	coord_t c = p->e.genmove(&p->e, b, ti_genmove, color, false);
+
+	if (ti[color].type != TT_NULL && ti[color].dim == TD_WALLTIME)
+		time_sub(&ti[color], time_now() - ti[color].timer_start, true);
+	return c;
+}
+
+/* Play game @n, returns result (sgf style). */
+static char *
+match_game(board_t *b, match_player_t *players, engine_t *scorer, time_info_t *ti, int n, int *moves)
+{
+	int black = n % 2;	/* A plays black in even games */
+	board_clear(b);
+	for (int i = 0; i < 2; i++) {
+		engine_reset(&players[i].e, b);
+		players[i].ti[S_BLACK] = players[i].ti[S_WHITE] = *ti;
+	}
+
+	static char result[32];
+	enum stone color = S_BLACK;
+	int passes = 0;
+	for (*moves = 0; *moves < match_max_moves(b) && passes < 2; (*moves)++, color = stone_other(color)) {
+		match_player_t *p = &players[(color == S_BLACK ? black : !black)];
+		match_player_t *opponent = &players[(color == S_BLACK ? !black : black)];
+		coord_t c = match_genmove(b, p, color);
+		if (is_resign(c)) {
+			sprintf(result, "%c+R", (color == S_BLACK ? 'W' : 'B'));
+			return result;
+		}
+
+		move_t m = move(c, color);
+		bool print = false;
+		if (opponent->e.notify_play)
+			opponent->e.notify_play(&opponent->e, b, &m, "", &print);
+		if (board_play(b, &m) < 0) {
+			if (DEBUGL(0))  fprintf(stderr, "match: game %i: %s played illegal move %s\n",
+						n, engine_names[p - players], coord2sstr(c));
+			sprintf(result, "%c+F", (color == S_BLACK ? 'W' : 'B'));
+			return result;
+		}
+		passes = (is_pass(c) ? passes + 1 : 0);
+	}
+
+	move_queue_t dead;
+	engine_dead_groups(scorer, NULL, b, &dead);
+	strcpy(result, board_official_score_str(b, &dead));
+	return result;
+}
+
+/* Append result line, single write so parallel jobs don't mix lines. */
+static void
+match_save_result(char *file, int n, char *result, int moves, double time)
+{
+	char line[256];
+	int black = n % 2;
+	int len = snprintf(line, sizeof(line), "game %i black %s white %s result %s moves %i time %.1f\n",
+			   n, engine_names[black], engine_names[!black], result, moves, time);
+	int fd = open(file, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (fd < 0 || write(fd, line, len) != len)
+		fail(file);
+	close(fd);
+	if (DEBUGL(1))  fprintf(stderr, "match: %s", line);
+}
+
+/* Games already played, and their winner (A: 0, B: 1, -1 jigo).
+ * Returns number of results found. */
+static int
+match_load_results(match_t *m, bool *done, int *winner)
+{
+	FILE *f = fopen(m->file, "r");
+	if (!f)  return 0;
+
+	int found = 0;
+	char line[256];
+	while (fgets(line, sizeof(line), f)) {
+		int n;  char black[8], white[8], result[32];
+		if (sscanf(line, "game %i black %7s white %7s result %31s", &n, black, white, result) != 4)
+			continue;
+		if (n < 0 || n >= m->games || done[n])
+			continue;
+		done[n] = true;  found++;
+		if      (result[0] == 'B')  winner[n] = (n % 2);
+		else if (result[0] == 'W')  winner[n] = !(n % 2);
+		else                        winner[n] = -1;
+	}
+	fclose(f);
+	return found;
+}
+
+static void
+match_summary(match_t *m)
+{
+	bool done[m->games];  memset(done, 0, sizeof(done));
+	int winner[m->games];
+	int games = match_load_results(m, done, winner);
+	int wins[2] = { 0, 0 }, jigo = 0;
+	for (int i = 0; i < m->games; i++) {
+		if (!done[i])             continue;
+		if (winner[i] < 0)        jigo++;
+		else                      wins[winner[i]]++;
+	}
+	if (!games)  return;
+
+	/* Jigo counts as half a win */
+	double p = (wins[0] + 0.5 * jigo) / games;
+	double err = 1.96 * sqrt(p * (1 - p) / games);
+	printf("match: %i games  A %i  B %i  jigo %i\n", games, wins[0], wins[1], jigo);
+	printf("match: A winrate %.1f%% +- %.1f%%\n", p * 100, err * 100);
+}
+
+/* Play games @job, @job + jobs, ... not done yet. */
+static void
+match_job(match_t *m, board_t *b, match_player_t *players, engine_t *scorer, time_info_t *ti, bool *done, int job)
+{
+	for (int n = job; n < m->games; n += m->jobs) {
+		if (done[n])  continue;
+		double start = time_now();
+		int moves;
+		char *result = match_game(b, players, scorer, ti, n, &moves);
+		match_save_result(m->file, n, result, moves, time_now() - start);
+	}
+}
+
+int
+pachi_match(match_t *m, time_info_t *ti)
+{
+	if (ti->type == TT_NULL)  die("--match: needs time settings (-t)\n");
+	if (m->jobs < 1 || m->games < 1)  die("--match: bad games / jobs count\n");
+#ifdef _WIN32
+	if (m->jobs > 1)  die("--match-jobs: not supported on windows\n");
+#endif
+#ifdef DISTRIBUTED
+	if (m->id[0] == E_DISTRIBUTED || m->id[1] == E_DISTRIBUTED)
+		die("--match: not supported with distributed engine\n");
+#endif
+
+	bool done[m->games];  memset(done, 0, sizeof(done));
+	int winner[m->games];
+	int found = match_load_results(m, done, winner);
+	if (found && DEBUGL(1))  fprintf(stderr, "match: %i games already played, resuming\n", found);
+
+	/* Load everything before forking so that jobs share it. */
+	board_t *b = board_new(m->size, NULL);
+	b->komi = 7.5;
+	match_player_t players[2];
+	for (int i = 0; i < 2; i++) {
+		char *args = match_engine_args(m->id[i], m->args[i], m->jobs);
+		if (DEBUGL(1))  fprintf(stderr, "match: engine %s: %s\n", engine_names[i], args);
+		engine_init(&players[i].e, m->id[i], args, b);
+		free(args);
+	}
+	char *scorer_args = match_engine_args(E_UCT, MATCH_SCORER_ARGS, m->jobs);
+	engine_t scorer;  engine_init(&scorer, E_UCT, scorer_args, b);
+	free(scorer_args);
+
+	if (m->jobs == 1)
+		match_job(m, b, players, &scorer, ti, done, 0);
+#ifndef _WIN32
+	else {
+		fflush(stdout);  fflush(stderr);
+		for (int job = 0; job < m->jobs; job++) {
+			pid_t pid = fork();
+			if (pid < 0)  fail("fork");
+			if (pid)  continue;
+			fast_srandom(fast_random(65536) ^ getpid());  /* Jobs must not play the same games. */
+			match_job(m, b, players, &scorer, ti, done, job);
+			fflush(stdout);  fflush(stderr);
+			_exit(0);
+		}
+
+		int failed = 0, status;
+		while (wait(&status) > 0)
+			if (!WIFEXITED(status) || WEXITSTATUS(status))
+				failed++;
+		if (failed)  die("match: %i jobs failed\n", failed);
+	}
+#endif
+
+	match_summary(m);
+	engine_done(&scorer);
+	for (int i = 0; i < 2; i++)
+		engine_done(&players[i].e);
+	board_delete(&b);
+	return 0;
+}
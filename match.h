@@ -0,0 +1,26 @@
+#ifndef PACHI_MATCH_H
+#define PACHI_MATCH_H
+
+#include "engine.h"
+#include "timeinfo.h"
+
+/* Built-in match between two engine configurations (A: main engine,
+ * B: opponent), for strength testing without twogtp and gtp pipes.
+ * Games run in @jobs worker processes forked after engines are loaded,
+ * so dictionaries, patterns, dcnn ... are shared (copy on write).
+ * One result line per game appended to @file as soon as it ends. */
+typedef struct {
+	char *file;
+	int   games;
+	int   jobs;
+	int   size;
+	int   id[2];		/* engine ids for A, B */
+	char *args[2];		/* engine args for A, B */
+} match_t;
+
+/* Play match, @ti: time settings for both engines. Games already in
+ * results file are skipped (resume interrupted match).
+ * Returns 0 on success. */
+int pachi_match(match_t *m, time_info_t *ti);
+
+#endif
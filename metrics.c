@@ -0,0 +1,89 @@
+#include <pthread.h>
+#include <stdio.h>
+
+#include "metrics.h"
+
+typedef struct {
+	char *name;
+	char *type;
+	char *help;
+} metric_info_t;
+
+static metric_info_t metric_info[METRIC_MAX] = {
+	[METRIC_GTP_COMMANDS]           = { "pachi_gtp_commands_total",          "counter", "Gtp commands handled" },
+	[METRIC_GTP_SECONDS]            = { "pachi_gtp_command_seconds_total",   "counter", "Time spent handling gtp commands" },
+	[METRIC_GTP_SECONDS_MAX]        = { "pachi_gtp_command_seconds_max",     "gauge",   "Slowest gtp command, genmoves excluded" },
+	[METRIC_GENMOVES]               = { "pachi_genmoves_total",              "counter", "Moves generated" },
+	[METRIC_GENMOVE_SECONDS]        = { "pachi_genmove_seconds_total",       "counter", "Time spent generating moves" },
+	[METRIC_PLAYOUTS]               = { "pachi_playouts_total",              "counter", "Uct playouts" },
+	[METRIC_PLAYOUTS_RATE]          = { "pachi_playouts_per_second",         "gauge",   "Playouts per second, last search" },
+	[METRIC_ROOT_PLAYOUTS]          = { "pachi_root_playouts",               "gauge",   "Root playouts after last search (reused tree included)" },
+	[METRIC_SEARCH_SECONDS]         = { "pachi_search_seconds_total",        "counter", "Time spent in uct search (pondering excluded)" },
+	[METRIC_TREE_BYTES]             = { "pachi_tree_bytes",                  "gauge",   "Search tree memory in use" },
+	[METRIC_TREE_MAX_BYTES]         = { "pachi_tree_max_bytes",              "gauge",   "Search tree memory limit" },
+	[METRIC_TREE_GC]                = { "pachi_tree_gc_total",               "counter", "Tree garbage collections" },
+	[METRIC_TREE_GC_SECONDS]        = { "pachi_tree_gc_seconds_total",       "counter", "Time spent in tree garbage collection" },
+	[METRIC_TREE_GC_SECONDS_MAX]    = { "pachi_tree_gc_seconds_max",         "gauge",   "Longest tree garbage collection" },
+	[METRIC_TREE_REALLOCS]          = { "pachi_tree_reallocs_total",         "counter", "Tree memory reallocations (or growths)" },
+	[METRIC_DCNN_EVALS]             = { "pachi_dcnn_evals_total",            "counter", "Dcnn evaluations (cache misses)" },
+	[METRIC_DCNN_BATCHES]           = { "pachi_dcnn_batches_total",          "counter", "Dcnn net calls" },
+	[METRIC_DCNN_SECONDS]           = { "pachi_dcnn_seconds_total",          "counter", "Time spent in dcnn net calls" },
+	[METRIC_PONDER_MOVES]           = { "pachi_pondering_moves_total",       "counter", "Opponent moves played while pondering" },
+	[METRIC_PONDER_HITS]            = { "pachi_pondering_hits_total",        "counter", "Opponent moves found in pondering tree" },
+	[METRIC_PONDER_PLAYOUTS]        = { "pachi_pondering_playouts_total",    "counter", "Playouts in pondering trees" },
+	[METRIC_PONDER_REUSED_PLAYOUTS] = { "pachi_pondering_reused_playouts_total", "counter", "Pondering playouts kept after opponent move" },
+};
+
+static double metric_values[METRIC_MAX];
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void
+metric_add(enum metric m, double val)
+{
+	pthread_mutex_lock(&metrics_mutex);
+	metric_values[m] += val;
+	pthread_mutex_unlock(&metrics_mutex);
+}
+
+void
+metric_set(enum metric m, double val)
+{
+	pthread_mutex_lock(&metrics_mutex);
+	metric_values[m] = val;
+	pthread_mutex_unlock(&metrics_mutex);
+}
+
+void
+metric_max(enum metric m, double val)
+{
+	pthread_mutex_lock(&metrics_mutex);
+	if (val > metric_values[m])
+		metric_values[m] = val;
+	pthread_mutex_unlock(&metrics_mutex);
+}
+
+double
+metric_get(enum metric m)
+{
+	pthread_mutex_lock(&metrics_mutex);
+	double val = metric_values[m];
+	pthread_mutex_unlock(&metrics_mutex);
+	return val;
+}
+
+void
+metrics_print(strbuf_t *buf)
+{
+	double values[METRIC_MAX];
+	pthread_mutex_lock(&metrics_mutex);
+	for (int m = 0; m < METRIC_MAX; m++)
+		values[m] = metric_values[m];
+	pthread_mutex_unlock(&metrics_mutex);
+
+	for (int m = 0; m < METRIC_MAX; m++) {
+		metric_info_t *info = &metric_info[m];
+		sbprintf(buf, "# HELP %s %s\n", info->name, info->help);
+		sbprintf(buf, "# TYPE %s %s\n", info->name, info->type);
+		sbprintf(buf, "%s %.9g\n", info->name, values[m]);
+	}
+}
@@ -0,0 +1,47 @@
+#ifndef PACHI_METRICS_H
+#define PACHI_METRICS_H
+
+/* Runtime metrics for monitoring: counters and gauges updated by gtp,
+ * uct search, tree gc, dcnn ... and served in Prometheus text format
+ * by the metrics listener (--metrics-port, see network.c).
+ * Updates are a few per move (dcnn evals aside), cheap enough to be
+ * always on. */
+
+#include "util.h"
+
+enum metric {
+	METRIC_GTP_COMMANDS,
+	METRIC_GTP_SECONDS,
+	METRIC_GTP_SECONDS_MAX,		/* Slowest command, genmoves excluded */
+	METRIC_GENMOVES,
+	METRIC_GENMOVE_SECONDS,
+	METRIC_PLAYOUTS,
+	METRIC_PLAYOUTS_RATE,		/* Last search */
+	METRIC_ROOT_PLAYOUTS,		/* Last search, reused playouts included */
+	METRIC_SEARCH_SECONDS,
+	METRIC_TREE_BYTES,
+	METRIC_TREE_MAX_BYTES,
+	METRIC_TREE_GC,
+	METRIC_TREE_GC_SECONDS,
+	METRIC_TREE_GC_SECONDS_MAX,
+	METRIC_TREE_REALLOCS,
+	METRIC_DCNN_EVALS,
+	METRIC_DCNN_BATCHES,		/* Net calls, evals / batches = batch size */
+	METRIC_DCNN_SECONDS,
+	METRIC_PONDER_MOVES,		/* Opponent moves played while pondering */
+	METRIC_PONDER_HITS,		/* ... that were in the tree */
+	METRIC_PONDER_PLAYOUTS,
+	METRIC_PONDER_REUSED_PLAYOUTS,
+	METRIC_MAX,
+};
+
+void metric_add(enum metric m, double val);
+void metric_set(enum metric m, double val);
+/* Gauge only goes up: set if @val is larger. */
+void metric_max(enum metric m, double val);
+double metric_get(enum metric m);
+
+/* Append all metrics to @buf, Prometheus text exposition format. */
+void metrics_print(strbuf_t *buf);
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef PACHI_MGQ_H
+#define PACHI_MGQ_H
+
+/* Move gamma queues: candidate moves with fixed-point weights, used to
+ * pick a move at random according to the weights (pattern gammas...).
+ *
+ * Running sum is kept as moves get added so picking is just one scan of
+ * the prefix sums, and a coord bitmap makes duplicate checks O(1).
+ * Capacity is fixed and small: that's what playout policies need
+ * (neighbors of last moves), for more use a move_queue_t. */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "board.h"
+#include "fixp.h"
+#include "random.h"
+
+#define MGQL 64
+
+typedef struct {
+	unsigned int moves;
+	fixp_t       total;
+	fixp_t       sum[MGQL];	   /* Prefix sums: sum[i] = gamma[0] + ... + gamma[i] */
+	coord_t      move[MGQL];
+	uint64_t     has[(BOARD_MAX_COORDS + 63) / 64];
+} __attribute__((aligned(64))) move_gamma_queue_t;
+
+static inline void
+mgq_init(move_gamma_queue_t *q)
+{
+	q->moves = 0;
+	q->total = 0;
+	memset(q->has, 0, sizeof(q->has));
+}
+
+static inline bool
+mgq_has(move_gamma_queue_t *q, coord_t c)
+{
+	return q->has[c / 64] & (1ULL << (c % 64));
+}
+
+/* Add move @c with weight @gamma. Doesn't check for duplicates,
+ * use mgq_has() for that. */
+static inline void
+mgq_add(move_gamma_queue_t *q, coord_t c, fixp_t gamma)
+{
+	assert(q->moves < MGQL);
+	assert(!is_pass(c));
+	q->has[c / 64] |= (1ULL << (c % 64));
+	q->total += gamma;
+	q->sum[q->moves] = q->total;
+	q->move[q->moves++] = c;
+}
+
+static inline fixp_t
+mgq_gamma(move_gamma_queue_t *q, unsigned int i)
+{
+	return (i ? q->sum[i] - q->sum[i - 1] : q->sum[0]);
+}
+
+/* Pick a move according to the weights, pass if there's nothing to pick. */
+static inline coord_t
+mgq_pick(move_gamma_queue_t *q)
+{
+	if (!q->total)  return pass;
+
+	/* Index of first prefix sum above stab = number of sums below it. */
+	fixp_t stab = fast_irandom(q->total);
+	unsigned int i = 0;
+	for (unsigned int j = 0; j < q->moves; j++)
+		i += (q->sum[j] <= stab);
+	assert(i < q->moves);
+	return q->move[i];
+}
+
+static inline void
+mgq_print(move_gamma_queue_t *q, char *label)
+{
+	fprintf(stderr, "%s candidate moves: ", label);
+	for (unsigned int i = 0; i < q->moves; i++)
+		fprintf(stderr, "%s(%.3f) ", coord2sstr(q->move[i]), fixp_to_double(mgq_gamma(q, i)));
+	fprintf(stderr, "\n");
+}
+
+#endif
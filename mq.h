@@ -7,7 +7,6 @@
  * fact that coord_t == group_t). */
 
 #include <assert.h>
-#include "fixp.h"
 #include "move.h"
 #include "random.h"
 
@@ -43,16 +42,7 @@ static int  mq_print(char *label, move_queue_t *q);
 static void mq_print_line(char *label, move_queue_t *q);
 
 
-/* Variations of the above that allow move weighting. */
-/* XXX: The "kinds of move queue" issue (it's even worse in some other
- * branches) is one of the few good arguments for C++ in Pachi...
- * At least rewrite it to be less hacky and maybe make a move_gamma_queue
- * that encapsulates move_queue. */
-
-static coord_t mq_gamma_pick(move_queue_t *q, fixp_t *gammas);
-static void mq_gamma_add(move_queue_t *q, fixp_t *gammas, coord_t c, fixp_t gamma, unsigned char tag);
-static void mq_gamma_print(move_queue_t *q, fixp_t *gammas, char *label);
-
+/* See mgq.h for weighted move queues. */
 
 static inline void
 mq_init(move_queue_t *q)
@@ -121,40 +111,4 @@ mq_print_line(char *label, move_queue_t *q)
 	fprintf(stderr, "\n");
 }
 
-static inline coord_t
-mq_gamma_pick(move_queue_t *q, fixp_t *gammas)
-{
-	if (!q->moves)  return pass;
-
-	fixp_t total = 0;
-	for (unsigned int i = 0; i < q->moves; i++)
-		total += gammas[i];
-	if (!total)     return pass;
-
-	fixp_t stab = fast_irandom(total);
-	for (unsigned int i = 0; i < q->moves; i++) {
-		if (stab < gammas[i])
-			return q->move[i];
-		stab -= gammas[i];
-	}
-	assert(0);
-	return pass;
-}
-
-static inline void
-mq_gamma_add(move_queue_t *q, fixp_t *gammas, coord_t c, fixp_t gamma, unsigned char tag)
-{
-	mq_add(q, c, tag);
-	gammas[q->moves - 1] = gamma;
-}
-
-static inline void
-mq_gamma_print(move_queue_t *q, fixp_t *gammas, char *label)
-{
-	fprintf(stderr, "%s candidate moves: ", label);
-	for (unsigned int i = 0; i < q->moves; i++)
-		fprintf(stderr, "%s(%.3f) ", coord2sstr(q->move[i]), fixp_to_double(gammas[i]));
-	fprintf(stderr, "\n");
-}
-
 #endif
@@ -10,6 +10,10 @@
 #include <errno.h>
 #include <pthread.h>
 #include <sys/types.h>
+#ifndef _WIN32
+#include <sys/time.h>
+#include <sys/wait.h>
+#endif
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -18,9 +22,11 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #endif
 
 #include "debug.h"
+#include "metrics.h"
 #include "network.h"
 #include "util.h"
 
@@ -68,6 +74,22 @@ is_private(struct in_addr *in)
 	    || (ntohl(in->s_addr)) == 127 * 256 * 256 * 256 + 1;
 }
 
+/* Send keepalive probes after 10s of silence, so that a dead peer
+ * (machine down, network cut) is detected in about 40s instead of
+ * hours. gtp peers in distributed mode exchange commands constantly. */
+static void
+set_keepalive(int fd)
+{
+	int val = 1;
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (void *)&val, sizeof(val));
+#ifdef TCP_KEEPIDLE
+	int idle = 10, interval = 10, count = 3;
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+#endif
+}
+
 /* Waits for a connection on the given socket, and returns the file descriptor.
  * Updates the client address if it is not null.
  * WARNING: the connection is not authenticated. As a weak security measure,
@@ -86,6 +108,7 @@ open_server_connection(int socket, struct in_addr *client)
 		if (is_private(&client_addr.sin_addr)) {
 			if (client)
 				*client = client_addr.sin_addr;
+			set_keepalive(fd);
 			return fd;
 		}
 		else if (DEBUGL(2))  fprintf(stderr, "connection from address not in private ip range, rejecting\n");
@@ -121,6 +144,7 @@ open_client_connection(char *port_name)
 		close(sock);
 		return -1;
 	}
+	set_keepalive(sock);
 	return sock;
 }
 
@@ -231,6 +255,102 @@ open_gtp_connection(int *socket, char *port)
 		fprintf(stderr, "gtp connection opened\n");
 }
 
+/* Multi-game server: accept gtp connections on the given port and fork
+ * one process per game, at most max_games at a time. Returns in each game
+ * process, with stdin & stdout redirected to its connection; the server
+ * process never returns. Everything loaded before (patterns, joseki,
+ * dcnn, ...) is shared by all games until they write to it (copy on
+ * write), so memory cost of a game is mostly its search tree. */
+void
+network_serve_games(char *gtp_port, int max_games)
+{
+#ifdef _WIN32
+	die("--games: not supported on windows\n");
+#else
+	if (strchr(gtp_port, ':'))
+		die("--games: gtp port must not have a hostname\n");
+	int sock = port_listen(gtp_port, MAX_CONNEXIONS);
+	int games = 0;
+	for (;;) {
+		while (games && waitpid(-1, NULL, (games < max_games ? WNOHANG : 0)) > 0)
+			games--;
+
+		struct in_addr client;
+		int conn = open_server_connection(sock, &client);
+		pid_t pid = fork();
+		if (pid < 0)  fail("fork");
+		if (!pid) {
+			close(sock);
+			for (int d = STDIN; d <= STDOUT; d++)
+				if (dup2(conn, d) < 0)
+					fail("dup2");
+			close(conn);
+			if (DEBUGL(0))  fprintf(stderr, "gtp connection opened, game pid %d\n", getpid());
+			return;
+		}
+		close(conn);
+		games++;
+		if (DEBUGL(2))  fprintf(stderr, "games: started %d, %d running\n", pid, games);
+	}
+#endif
+}
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* Send it all, scraper going away mustn't kill us (SIGPIPE). */
+static bool
+send_all(int fd, char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n <= 0)  return false;
+		buf += n;  len -= n;
+	}
+	return true;
+}
+
+/* Metrics listener: answer each connection (http request from a
+ * monitoring scraper) with current metrics and close it. */
+static void * __attribute__((noreturn))
+metrics_thread(void *arg)
+{
+	int sock = *(int*)arg;
+	for (;;) {
+		int conn = open_server_connection(sock, NULL);
+#ifndef _WIN32
+		struct timeval timeout = { 1, 0 };  /* Don't hang on silent clients */
+		setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+#endif
+		char req[BSIZE];
+		if (read(conn, req, sizeof(req)) > 0) {  /* Request itself doesn't matter */
+			strbuf(buf, 16384);
+			metrics_print(buf);
+			char header[256];
+			int len = snprintf(header, sizeof(header),
+					   "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+					   "Content-Length: %i\r\n\r\n", (int)strlen(buf->str));
+			if (send_all(conn, header, len))
+				send_all(conn, buf->str, strlen(buf->str));
+		}
+		close(conn);
+	}
+}
+
+/* Serve metrics on the given port (no hostname), from a background thread. */
+void
+open_metrics_port(char *port)
+{
+	if (strchr(port, ':'))
+		die("--metrics-port: port must not have a hostname\n");
+	static int sock;
+	sock = port_listen(port, MAX_CONNEXIONS);
+	pthread_t thread;
+	pthread_create(&thread, NULL, metrics_thread, &sock);
+	pthread_detach(thread);
+}
+
 void
 network_init(char *gtp_port)
 {
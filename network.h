@@ -13,7 +13,9 @@ void network_init(char* gtp_port);
 int port_listen(char *port, int max_connections);
 int open_server_connection(int socket, struct in_addr *client);
 void open_log_port(char *port);
+void open_metrics_port(char *port);
 void open_gtp_connection(int *socket, char *port);
+void network_serve_games(char *gtp_port, int max_games);
 
 #else
 
@@ -21,7 +23,9 @@ void open_gtp_connection(int *socket, char *port);
 #define port_listen(port, max_conn)        die("network code not compiled in, enable NETWORK in Makefile\n");
 #define open_server_connection(s, c)       die("network code not compiled in, enable NETWORK in Makefile\n");
 #define open_log_port(port)                die("network code not compiled in, enable NETWORK in Makefile\n");
+#define open_metrics_port(port)            die("network code not compiled in, enable NETWORK in Makefile\n");
 #define open_gtp_connection(socket, port)  die("network code not compiled in, enable NETWORK in Makefile\n");
+#define network_serve_games(port, games)   die("network code not compiled in, enable NETWORK in Makefile\n");
 
 #endif /* NETWORK */
 
@@ -8,7 +8,9 @@
 #include "move.h"
 #include "mq.h"
 #include "tactics/1lib.h"
+#include "tactics/benson.h"
 #include "tactics/selfatari.h"
+#include "tactics/seki.h"
 #include "ownermap.h"
 
 void
@@ -56,6 +58,29 @@ ownermap_fill(ownermap_t *ownermap, board_t *b)
 	} foreach_point_end;
 }
 
+void
+ownermap_fill_owners(ownermap_t *ownermap, board_t *b, enum stone *owners)
+{
+	ownermap->playouts++;
+	foreach_point(b) {
+		if (board_at(b, c) == S_OFFBOARD)  continue;
+		ownermap->map[c][owners[c]]++;
+	} foreach_point_end;
+}
+
+/* Add @src playouts to @dest. Can be done by multiple threads in parallel. */
+void
+ownermap_merge(ownermap_t *dest, ownermap_t *src)
+{
+	for (int c = 0; c < BOARD_MAX_COORDS; c++)
+		for (int i = 0; i < S_MAX; i++)
+			if (src->map[c][i])
+				__sync_fetch_and_add(&dest->map[c][i], src->map[c][i]);
+	/* Playouts last, map must be complete by then. */
+	__sync_synchronize();
+	__sync_fetch_and_add(&dest->playouts, src->playouts);
+}
+
 float
 ownermap_estimate_point(ownermap_t *ownermap, coord_t c)
 {
@@ -90,6 +115,40 @@ ownermap_color(ownermap_t *ownermap, coord_t c, floating_t thres)
 	return colors[pj];
 }
 
+int
+ownermap_settled(board_t *b, ownermap_t *ownermap, floating_t thres, bitboard_t *settled)
+{
+	bitboard_clear(settled);
+	if (ownermap->playouts < GJ_MINGAMES)  return 0;
+
+	int n = 0;
+	foreach_point(b) {
+		if (board_at(b, c) == S_OFFBOARD)  continue;
+		enum point_judgement pj = ownermap_judge_point(ownermap, c, thres);
+		if (pj != PJ_BLACK && pj != PJ_WHITE)  continue;
+		bitboard_set(settled, c);
+		n++;
+	} foreach_point_end;
+	return n;
+}
+
+bool
+ownermap_settled_quiet(board_t *b, coord_t c)
+{
+	if (!is_pass(b->ko.coord))  return false;
+
+	coord_t last = last_move(b).coord;
+	if (!is_pass(last) && !is_resign(last) &&
+	    abs(coord_x(c) - coord_x(last)) <= 1 && abs(coord_y(c) - coord_y(last)) <= 1)
+		return false;
+
+	foreach_neighbor(b, c, {
+		group_t g = group_at(b, c);
+		if (g && board_group_info(b, g).libs <= 2)  return false;
+	});
+	return true;
+}
+
 void
 ownermap_judge_groups(board_t *b, ownermap_t *ownermap, group_judgement_t *judge)
 {
@@ -136,12 +195,55 @@ groups_of_status(board_t *b, group_judgement_t *judge, enum gj_state s, move_que
 	} foreach_point_end;
 }
 
+/* No need to guess for pass-alive groups, and opponent stones in their
+ * territory: ownermap can be noisy there if the playouts wander. */
+static void
+benson_judge_groups(board_t *b, group_judgement_t *judge)
+{
+	for (enum stone color = S_BLACK; color <= S_WHITE; color++) {
+		bool safe[BOARD_MAX_COORDS];
+		memset(safe, 0, sizeof(safe));
+		if (!benson_safe_area(b, color, safe))  continue;
+
+		foreach_point(b) {
+			group_t g = group_at(b, c);
+			if (!g || !safe[c])  continue;
+			judge->gs[g] = (board_at(b, c) == color ? GS_ALIVE : GS_DEAD);
+		} foreach_point_end;
+	}
+}
+
+/* Groups in local seki are alive, whatever playouts did with them. */
+static void
+seki_judge_groups(board_t *b, group_judgement_t *judge)
+{
+	bool seki[BOARD_MAX_COORDS];
+	memset(seki, 0, sizeof(seki));
+	if (!seki_find(b, seki))  return;
+
+	foreach_point(b) {
+		group_t g = group_at(b, c);
+		if (!g || !seki[c])  continue;
+		judge->gs[g] = GS_ALIVE;
+	} foreach_point_end;
+}
+
+void
+static_judge_groups(board_t *b, group_judgement_t *judge)
+{
+	memset(judge->gs, GS_NONE, board_max_coords(b) * sizeof(judge->gs[0]));
+	benson_judge_groups(b, judge);
+	seki_judge_groups(b, judge);
+}
+
 void
 ownermap_dead_groups(board_t *b, ownermap_t *ownermap, move_queue_t *dead, move_queue_t *unclear)
 {
 	enum gj_state gs_array[board_max_coords(b)];
 	group_judgement_t gj = { 0.67, gs_array };
 	ownermap_judge_groups(b, ownermap, &gj);
+	benson_judge_groups(b, &gj);
+	seki_judge_groups(b, &gj);
 	if (dead)     {  dead->moves = 0;     groups_of_status(b, &gj, GS_DEAD, dead);  }
 	if (unclear)  {  unclear->moves = 0;  groups_of_status(b, &gj, GS_UNKNOWN, unclear);  }
 }
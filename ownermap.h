@@ -5,6 +5,7 @@
  * information from the map. */
 
 #include <signal.h> // sig_atomic_t
+#include "bitboard.h"
 #include "mq.h"
 
 /* How many games to consider at minimum before judging groups. */
@@ -35,7 +36,9 @@ typedef struct {
 
 typedef struct ownermap {
 	/* Map of final owners of all intersections on the board. */
-	/* This may be shared between multiple threads! */
+	/* This may be shared between multiple threads! Better fill a
+	 * private map and ownermap_merge() it from time to time then,
+	 * see uct_playouts(). */
 	/* XXX: We assume sig_atomic_t is thread-atomic. This may not
 	 * be true in pathological cases. */
 	sig_atomic_t playouts;
@@ -47,6 +50,9 @@ typedef struct ownermap {
 void ownermap_init(ownermap_t *ownermap);
 void board_print_ownermap(board_t *b, FILE *f, ownermap_t *ownermap);
 void ownermap_fill(ownermap_t *ownermap, board_t *b);
+/* Same, with owner of each point given in @owners. */
+void ownermap_fill_owners(ownermap_t *ownermap, board_t *b, enum stone *owners);
+void ownermap_merge(ownermap_t *dest, ownermap_t *src);
 
 /* Coord ownermap status: dame / black / white / unclear */
 enum point_judgement ownermap_judge_point(ownermap_t *ownermap, coord_t c, floating_t thres);
@@ -55,10 +61,21 @@ enum stone ownermap_color(ownermap_t *ownermap, coord_t c, floating_t thres);
 /* Coord's status from 1.0 (black) to 0.0 (white) */
 float ownermap_estimate_point(ownermap_t *ownermap, coord_t c);
 
+/* Points owned by one color with this threshold (seki / dame not included).
+ * Returns number of points found. */
+int ownermap_settled(board_t *b, ownermap_t *ownermap, floating_t thres, bitboard_t *settled);
+/* Settled point @c of current position safe to leave alone ?
+ * Not if there's a ko going on (threats get played in settled areas),
+ * next to last move or to a group short of liberties. */
+bool ownermap_settled_quiet(board_t *b, coord_t c);
+
 /* Find dead / unclear groups. */
 void ownermap_dead_groups(board_t *b, ownermap_t *ownermap, move_queue_t *dead, move_queue_t *unclear);
 /* Estimate status of stones on board based on ownermap stats. */
 void ownermap_judge_groups(board_t *b, ownermap_t *ownermap, group_judgement_t *judge);
+/* Status of groups that doesn't need playouts (pass-alive, local seki),
+ * others are GS_NONE. */
+void static_judge_groups(board_t *b, group_judgement_t *judge);
 /* Add groups of given status to mq. */
 void groups_of_status(board_t *b, group_judgement_t *judge, enum gj_state s, move_queue_t *mq);
 
@@ -8,6 +8,7 @@
 #include <unistd.h>
 
 #include "board.h"
+#include "fbook.h"
 #include "pachi.h"
 #include "debug.h"
 #include "engine.h"
@@ -20,6 +21,7 @@
 #include "engines/joseki.h"
 #include "engines/dcnn.h"
 #include "t-unit/test.h"
+#include "t-unit/bench.h"
 #include "uct/uct.h"
 #include "distributed/distributed.h"
 #include "gtp.h"
@@ -35,7 +37,13 @@
 #include "pattern.h"
 #include "patternsp.h"
 #include "patternprob.h"
+#include "patterndb.h"
 #include "joseki.h"
+#include "match.h"
+#include "logring.h"
+#include "metrics.h"
+#include "session.h"
+#include "tactics/nakade.h"
 
 /* Main options */
 static pachi_options_t main_options = { 0, };
@@ -48,7 +56,8 @@ int   saved_debug_level;
 bool  debug_boardprint = true;
 long  verbose_logs = 0;
 
-static void main_loop(gtp_t *gtp, board_t *b, engine_t *e, time_info_t *ti, time_info_t *ti_default, char *gtp_port);
+static void main_loop(gtp_t *gtp, board_t *b, engine_t *e, time_info_t *ti, time_info_t *ti_default, char *gtp_port,
+		      session_replay_t *replay);
 
 typedef struct {
 	int		id;
@@ -100,10 +109,30 @@ supported_engines(bool show_all)
 	return buf->str;
 }
 
+/* --match: opponent is "[ENGINE:]ARGS", same engine as ours by default. */
+static int
+pachi_match_main(match_t *m, enum engine_id id, char *args, char *opponent, time_info_t *ti)
+{
+	m->id[0] = m->id[1] = id;
+	m->args[0] = args;
+	m->args[1] = (opponent ? opponent : "");
+
+	char *colon = (opponent ? strchr(opponent, ':') : NULL);
+	if (colon) {
+		*colon = 0;
+		enum engine_id opponent_id = engine_name_to_id(opponent);
+		if (opponent_id != E_MAX) {  m->id[1] = opponent_id;  m->args[1] = colon + 1;  }
+		else                      *colon = ':';
+	}
+	return pachi_match(m, ti);
+}
+
 static void
 pachi_init(int argc, char *argv[])
 {
-	setlinebuf(stdout);
+	/* gtp replies are flushed once complete (gtp_flush()),
+	 * a single write per reply instead of one per line. */
+	setvbuf(stdout, NULL, _IOFBF, 65536);
 	setlinebuf(stderr);
 	
 	pachi_exe = argv[0];
@@ -112,6 +141,8 @@ pachi_init(int argc, char *argv[])
 	/* Check engine list is sane. */
 	for (int i = 0; i < E_MAX; i++)
 		assert(engines[i].name && engines[i].id == i);
+
+	nakade_init();
 };
 
 void
@@ -160,14 +191,27 @@ usage(char *arg)
 	fprintf(stderr, "Usage: pachi [OPTIONS] [ENGINE_ARGS...]\n\n");
 	fprintf(stderr,
 		"Options: \n"
+                "      --bench FILE                  run search benchmark, results in FILE \n"
+                "      --bench-baseline FILE         compare benchmark with FILE, fail if 25%% slower \n"
+                "      --bench-threads N             --bench: thread scaling with 1, 2, 4 ... N threads \n"
                 "      --compile-flags               show pachi's compile flags \n"
+                "      --compile-patterns            compile mm patterns into patterns_mm.bin for fast loading \n"
+                "      --compile-joseki              compile joseki19.gtp into joseki19.bin for fast loading \n"
+                "      --compile-fbook FBOOKFILE     compile opening book into FBOOKFILE.bin for fast loading \n"
 		"  -e, --engine ENGINE               select engine (default uct). Supported engines: \n");
 	fprintf(stderr,
 		"                                    %s \n", supported_engines(false));
 	fprintf(stderr,
 		"  -h, --help                        show usage \n"
+		"      --match FILE                  play match against --match-opponent, results in FILE \n"
+		"      --match-opponent ARGS         opponent engine: [ENGINE:]ARGS (default: same engine) \n"
+		"      --match-games N               number of games (default 100) \n"
+		"      --match-jobs N                games played in parallel, cpus split among them \n"
+		"      --match-size N                board size (default 19) \n"
 		"  -s, --seed RANDOM_SEED            set random seed \n"
 		"  -u, --unit-test FILE              run unit tests \n"
+		"      --unit-bench N                run each unit test N more times, show timings \n"
+		"      --unit-baseline FILE          compare timings with FILE, fail if 25%% slower \n"
 		"  -v, --version                     show version \n"
 		"      --version=VERSION             version to return to gtp frontend \n"
 		"      --name=NAME                   name to return to gtp frontend \n"
@@ -192,21 +236,41 @@ usage(char *arg)
 		"  -g, --gtp-port [HOST:]GTP_PORT    read gtp commands from network instead of stdin. \n"
 		"                                    listen on given port if HOST not given, otherwise \n"
 		"                                    connect to remote host. \n"
+		"      --games N                     with -g GTP_PORT, serve up to N games at once, \n"
+		"                                    one process per game forked from a fully \n"
+		"                                    loaded one (patterns, joseki, dcnn ... shared) \n"
 		"  -l, --log-port [HOST:]LOG_PORT    log to remote host instead of stderr \n"
+		"      --metrics-port PORT           serve runtime metrics on PORT (prometheus \n"
+		"                                    text format over http) \n"
 #endif
 		"  -o  --log-file FILE               log to FILE instead of stderr \n"
+		"      --log-async                   search threads log asynchronously \n"
+		"                                    (timestamps, thread ids, never block) \n"
+		"      --record FILE                 record gtp session: commands, timings, seed \n"
+		"      --replay FILE                 replay recorded session instead of reading stdin \n"
+		"                                    (fixed playouts), show timing differences \n"
 		"      --verbose-caffe               enable caffe logging \n"
 		" \n"
 		"Engine components: \n"
 		"      --dcnn,     --nodcnn          dcnn required / disabled \n"
 		"      --patterns, --nopatterns      mm patterns required / disabled \n"
 		"      --joseki,   --nojoseki        joseki engine required / disabled \n"
+#ifndef _WIN32
+		"      --shared-joseki               share joseki dictionary with other pachi processes \n"
+#endif
 		" \n"
 #ifdef DCNN
 		"Deep learning: \n"
 		"      --dcnn=name                   choose which dcnn to load (default detlef) \n"
 		"      --dcnn=file                   \n"
+		"      --dcnn=name1,name2...         load several nets, strongest first: chosen each \n"
+		"                                    move from time left (see uct dcnn_select) \n"
 		"      --list-dcnns                  show supported networks \n"
+		"      --dcnn-nets N                 load N net instances (parallel evaluation) \n"
+		"      --dcnn-cache N                cache N evaluations (default 1024, 0: off) \n"
+		"      --dcnn-symmetries N           average dcnn outputs over N board symmetries (1-8) \n"
+		"      --dcnn-backend NAME           inference backend (default caffe) \n"
+		"      --dcnn-precision PREC         fp32, fp16 or int8 if backend supports it \n"
 		" \n"
 #endif
 		"Time settings: \n"
@@ -274,19 +338,58 @@ show_version(FILE *s)
 #define OPT_ACCURATE_SCORING  271
 #define OPT_KGS_CHAT	      272
 #define OPT_SMART_PASS        273
+#define OPT_DCNN_NETS         274
+#define OPT_DCNN_CACHE        275
+#define OPT_DCNN_BACKEND      276
+#define OPT_DCNN_PRECISION    277
+#define OPT_COMPILE_PATTERNS  278
+#define OPT_SHARED_JOSEKI     279
+#define OPT_UNIT_BENCH        280
+#define OPT_UNIT_BASELINE     281
+#define OPT_GAMES             282
+#define OPT_COMPILE_FBOOK     283
+#define OPT_BENCH             284
+#define OPT_BENCH_BASELINE    285
+#define OPT_BENCH_THREADS     286
+#define OPT_DCNN_SYMMETRIES   287
+#define OPT_MATCH             288
+#define OPT_MATCH_OPPONENT    289
+#define OPT_MATCH_GAMES       290
+#define OPT_MATCH_JOBS        291
+#define OPT_MATCH_SIZE        292
+#define OPT_LOG_ASYNC         293
+#define OPT_METRICS_PORT      294
+#define OPT_RECORD            295
+#define OPT_REPLAY            296
+#define OPT_COMPILE_JOSEKI    297
 
 static struct option longopts[] = {
+	{ "bench",              required_argument, 0, OPT_BENCH },
+	{ "bench-baseline",     required_argument, 0, OPT_BENCH_BASELINE },
+	{ "bench-threads",      required_argument, 0, OPT_BENCH_THREADS },
 	{ "chatfile",           required_argument, 0, 'c' },
 	{ "compile-flags",      no_argument,       0, OPT_COMPILE_FLAGS },
+	{ "compile-patterns",   no_argument,       0, OPT_COMPILE_PATTERNS },
+	{ "compile-fbook",      required_argument, 0, OPT_COMPILE_FBOOK },
+	{ "compile-joseki",     no_argument,       0, OPT_COMPILE_JOSEKI },
 	{ "debug-level",        required_argument, 0, 'd' },
 	{ "dcnn",               optional_argument, 0, OPT_DCNN },
+#ifdef DCNN
+	{ "dcnn-nets",          required_argument, 0, OPT_DCNN_NETS },
+	{ "dcnn-cache",         required_argument, 0, OPT_DCNN_CACHE },
+	{ "dcnn-symmetries",    required_argument, 0, OPT_DCNN_SYMMETRIES },
+	{ "dcnn-backend",       required_argument, 0, OPT_DCNN_BACKEND },
+	{ "dcnn-precision",     required_argument, 0, OPT_DCNN_PRECISION },
+#endif
 	{ "engine",             required_argument, 0, 'e' },
 	{ "fbook",              required_argument, 0, 'f' },
 	{ "fuseki-time",        required_argument, 0, OPT_FUSEKI_TIME },
 	{ "fuseki",             required_argument, 0, OPT_FUSEKI },
 #ifdef NETWORK
+	{ "games",              required_argument, 0, OPT_GAMES },
 	{ "gtp-port",           required_argument, 0, 'g' },
 	{ "log-port",           required_argument, 0, 'l' },
+	{ "metrics-port",       required_argument, 0, OPT_METRICS_PORT },
 #endif
 	{ "guess-unclear",      no_argument,       0, OPT_SMART_PASS },
 	{ "help",               no_argument,       0, 'h' },
@@ -296,7 +399,13 @@ static struct option longopts[] = {
 #ifdef DCNN
 	{ "list-dcnns",         no_argument,       0, OPT_LIST_DCNNS },
 #endif
+	{ "log-async",          no_argument,       0, OPT_LOG_ASYNC },
 	{ "log-file",           required_argument, 0, 'o' },
+	{ "match",              required_argument, 0, OPT_MATCH },
+	{ "match-games",        required_argument, 0, OPT_MATCH_GAMES },
+	{ "match-jobs",         required_argument, 0, OPT_MATCH_JOBS },
+	{ "match-opponent",     required_argument, 0, OPT_MATCH_OPPONENT },
+	{ "match-size",         required_argument, 0, OPT_MATCH_SIZE },
 	{ "name",               required_argument, 0, OPT_NAME },
 	{ "nodcnn",             no_argument,       0, OPT_NODCNN },
 	{ "noundo",             no_argument,       0, OPT_NOUNDO },
@@ -304,10 +413,17 @@ static struct option longopts[] = {
 	{ "nopassfirst",        no_argument,       0, OPT_NOPASSFIRST },
 	{ "nopatterns",         no_argument,       0, OPT_NOPATTERNS },
 	{ "patterns",           no_argument,       0, OPT_PATTERNS },
+	{ "record",             required_argument, 0, OPT_RECORD },
+	{ "replay",             required_argument, 0, OPT_REPLAY },
 	{ "rules",              required_argument, 0, 'r' },
 	{ "seed",               required_argument, 0, 's' },
+#ifndef _WIN32
+	{ "shared-joseki",      no_argument,       0, OPT_SHARED_JOSEKI },
+#endif
 	{ "smart-pass",         no_argument,       0, OPT_SMART_PASS },
 	{ "time",               required_argument, 0, 't' },
+	{ "unit-baseline",      required_argument, 0, OPT_UNIT_BASELINE },
+	{ "unit-bench",         required_argument, 0, OPT_UNIT_BENCH },
 	{ "unit-test",          required_argument, 0, 'u' },
 	{ "verbose-caffe",      no_argument,       0, OPT_VERBOSE_CAFFE },
 	{ "version",            optional_argument, 0, 'v' },
@@ -326,12 +442,23 @@ int main(int argc, char *argv[])
 	time_info_t ti_default = ti_none;
 	int  seed = time(NULL) ^ getpid();
 	char *testfile = NULL;
+	char *benchfile = NULL;
+	char *bench_baseline = NULL;
+	int   bench_threads = 0;
 	char *gtp_port = NULL;
+	int   max_games = 0;
 	char *log_port = NULL;
+	char *metrics_port = NULL;
+	char *record_file = NULL;
+	char *replay_file = NULL;
+	bool  seed_set = false;
 	char *chatfile = NULL;
 	char *fbookfile = NULL;
 	FILE *file = NULL;
 	bool verbose_caffe = false;
+	bool compile_joseki = false;	/* Needs gtp, done once options are parsed */
+	match_t match = { NULL, 100, 1, 19, };
+	char *match_opponent = NULL;
 
 	pachi_init(argc, argv);
 	
@@ -348,6 +475,15 @@ int main(int argc, char *argv[])
 				printf("CFLAGS:\n%s\n\n", PACHI_CFLAGS);
 				printf("Command:\n%s\n", PACHI_CC1);
 				exit(0);
+			case OPT_COMPILE_PATTERNS:
+				pattern_db_compile(pattern_db_filename);
+				exit(0);
+			case OPT_COMPILE_FBOOK:
+				fbook_compile(optarg);
+				exit(0);
+			case OPT_COMPILE_JOSEKI:
+				compile_joseki = true;
+				break;
 			case 'e':
 				engine_id = engine_name_to_id(optarg);
 				if (engine_id == E_MAX)
@@ -363,6 +499,23 @@ int main(int argc, char *argv[])
 				if (optarg)  set_dcnn(optarg);
 				require_dcnn();
 				break;
+#ifdef DCNN
+			case OPT_DCNN_NETS:
+				caffe_set_instances(atoi(optarg));
+				break;
+			case OPT_DCNN_CACHE:
+				dcnn_set_cache_size(atoi(optarg));
+				break;
+			case OPT_DCNN_SYMMETRIES:
+				dcnn_set_symmetries(atoi(optarg));
+				break;
+			case OPT_DCNN_BACKEND:
+				set_dcnn_backend(optarg);
+				break;
+			case OPT_DCNN_PRECISION:
+				set_dcnn_precision(optarg);
+				break;
+#endif
 			case 'f':
 				fbookfile = strdup(optarg);
 				break;
@@ -370,6 +523,10 @@ int main(int argc, char *argv[])
 			case 'g':
 				gtp_port = strdup(optarg);
 				break;
+			case OPT_GAMES:
+				max_games = atoi(optarg);
+				if (max_games < 1)  die("%s: Invalid --games argument %s\n", argv[0], optarg);
+				break;
 #endif
 			case OPT_SMART_PASS:
 				options->guess_unclear_groups = true;
@@ -392,6 +549,9 @@ int main(int argc, char *argv[])
 			case 'l':
 				log_port = strdup(optarg);
 				break;
+			case OPT_METRICS_PORT:
+				metrics_port = strdup(optarg);
+				break;
 #endif
 #ifdef DCNN
 			case OPT_LIST_DCNNS:
@@ -404,6 +564,33 @@ int main(int argc, char *argv[])
 				if (!freopen(optarg, "w", stderr))  fail("freopen()");
 				setlinebuf(stderr);
 				break;
+			case OPT_LOG_ASYNC:
+				log_async_start();
+				break;
+			case OPT_RECORD:
+				record_file = strdup(optarg);
+				break;
+			case OPT_REPLAY:
+				replay_file = strdup(optarg);
+				break;
+			case OPT_MATCH:
+				match.file = strdup(optarg);
+				break;
+			case OPT_MATCH_GAMES:
+				match.games = atoi(optarg);
+				if (match.games < 1)  die("--match-games: bad games count %s\n", optarg);
+				break;
+			case OPT_MATCH_JOBS:
+				match.jobs = atoi(optarg);
+				if (match.jobs < 1)  die("--match-jobs: bad jobs count %s\n", optarg);
+				break;
+			case OPT_MATCH_OPPONENT:
+				match_opponent = strdup(optarg);
+				break;
+			case OPT_MATCH_SIZE:
+				match.size = atoi(optarg);
+				if (match.size < 1 || match.size > BOARD_MAX_SIZE)  die("--match-size: bad board size %s\n", optarg);
+				break;
 			case OPT_NODCNN:
 				disable_dcnn();
 				break;
@@ -422,6 +609,9 @@ int main(int argc, char *argv[])
 			case OPT_PATTERNS:
 				require_patterns();
 				break;
+			case OPT_SHARED_JOSEKI:
+				share_joseki();
+				break;
 			case 'r':
 				options->forced_rules = board_parse_rules(optarg);
 				if (options->forced_rules == RULES_INVALID)
@@ -429,6 +619,7 @@ int main(int argc, char *argv[])
 				break;
 			case 's':
 				seed = atoi(optarg);
+				seed_set = true;
 				break;
 			case 't':
 				/* Time settings to follow; if specified,
@@ -459,6 +650,22 @@ int main(int argc, char *argv[])
 			case 'u':
 				testfile = strdup(optarg);
 				break;
+			case OPT_UNIT_BENCH:
+				set_unit_bench(atoi(optarg));
+				break;
+			case OPT_UNIT_BASELINE:
+				set_unit_baseline(strdup(optarg));
+				break;
+			case OPT_BENCH:
+				benchfile = strdup(optarg);
+				break;
+			case OPT_BENCH_BASELINE:
+				bench_baseline = strdup(optarg);
+				break;
+			case OPT_BENCH_THREADS:
+				bench_threads = atoi(optarg);
+				if (bench_threads < 1)  die("--bench-threads: bad thread count %s\n", optarg);
+				break;
 			case OPT_VERBOSE_CAFFE:
 				verbose_caffe = true;
 				break;
@@ -475,10 +682,22 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	session_replay_t replay_session;
+	session_replay_t *replay = NULL;
+	if (replay_file) {
+		if (gtp_port)  die("--replay: can't use with -g\n");
+		replay = &replay_session;
+		session_replay_start(replay, replay_file);
+		if (!seed_set)  seed = replay->seed;
+	}
+	if (record_file)  session_record_start(record_file, seed, argc, argv);
+
 	fast_srandom(seed);
 	
 	if (!verbose_caffe)      quiet_caffe(argc, argv);
 	if (log_port)            open_log_port(log_port);
+	gtp_internal_init(gtp);
+	if (compile_joseki) {    joseki_db_compile(joseki_db_filename);  return 0;  }
 	if (testfile)		 return unit_test(testfile);
 	if (DEBUGL(0))           show_version(stderr);
 	if (getenv("DATA_DIR"))
@@ -491,7 +710,6 @@ int main(int argc, char *argv[])
 		b->rules = options->forced_rules;
 		if (DEBUGL(1))  fprintf(stderr, "Rules: %s\n", rules2str(b->rules));
 	}
-	gtp_internal_init(gtp);
 
 	time_info_t ti[S_MAX];
 	ti[S_BLACK] = ti_default;
@@ -504,22 +722,41 @@ int main(int argc, char *argv[])
 	for (int i = optind; i < argc; i++)
 		sbprintf(buf, "%s%s", (i == optind ? "" : ","), argv[i]);
 	char *engine_args = buf->str;
+	if (benchfile && bench_threads)  return pachi_bench_threads(benchfile, bench_baseline, bench_threads, engine_args);
+	if (benchfile)           return pachi_bench(benchfile, bench_baseline, engine_args);
+	if (match.file)          return pachi_match_main(&match, engine_id, engine_args, match_opponent, &ti_default);
 	
+	if (max_games && !gtp_port)  die("--games needs -g GTP_PORT\n");
+	if (max_games && metrics_port)  die("--metrics-port: not supported with --games, game processes don't share metrics\n");
+#ifdef DISTRIBUTED
+	if (max_games && engine_id == E_DISTRIBUTED)  die("--games: not supported with distributed engine\n");
+#endif
+
 	engine_t e;  engine_init(&e, engine_id, engine_args, b);
-	network_init(gtp_port);
+	if (metrics_port)  open_metrics_port(metrics_port);
+	if (!max_games)  network_init(gtp_port);
+	else {
+		network_serve_games(gtp_port, max_games);
+		fast_srandom(seed ^ getpid());  /* Games must not play the same moves. */
+		fifo_fork_child();		/* Each game is an instance for the core broker. */
+	}
 
 	while (1) {
-		main_loop(gtp, b, &e, ti, &ti_default, gtp_port);
-		if (!gtp_port)  break;
+		main_loop(gtp, b, &e, ti, &ti_default, gtp_port, replay);
+		if (!gtp_port || max_games)  break;
 		network_init(gtp_port);
 	}
 
+	if (replay)  session_replay_done(replay);
 	engine_done(&e);
 	board_delete(&b);
 	chat_done();
 	free(testfile);
 	free(gtp_port);
 	free(log_port);
+	free(metrics_port);
+	free(record_file);
+	free(replay_file);
 	free(chatfile);
 	free(fbookfile);
 	return 0;
@@ -538,14 +775,43 @@ log_gtp_input(char *cmd)
 	if (DEBUGL(1))  fprintf(stderr, "IN: %s", cmd);
 }
 
+/* Gtp command took @elapsed seconds. */
+static void
+gtp_metrics(gtp_t *gtp, double elapsed)
+{
+	if (!*gtp->cmd)  return;
+	metric_add(METRIC_GTP_COMMANDS, 1);
+	metric_add(METRIC_GTP_SECONDS, elapsed);
+	if (strstr(gtp->cmd, "genmove")) {
+		metric_add(METRIC_GENMOVES, 1);
+		metric_add(METRIC_GENMOVE_SECONDS, elapsed);
+	} else
+		metric_max(METRIC_GTP_SECONDS_MAX, elapsed);
+}
+
 static void
-main_loop(gtp_t *gtp, board_t *b, engine_t *e, time_info_t *ti, time_info_t *ti_default, char *gtp_port)
+main_loop(gtp_t *gtp, board_t *b, engine_t *e, time_info_t *ti, time_info_t *ti_default, char *gtp_port,
+	  session_replay_t *replay)
 {
 	char buf[4096];
-	while (fgets(buf, 4096, stdin)) {
+	while (replay ? session_replay_next(replay, buf, sizeof(buf)) : fgets(buf, 4096, stdin)) {
 		log_gtp_input(buf);
 
+		/* Replay: searches get the playouts they had. */
+		time_info_t ti_saved[S_MAX];
+		memcpy(ti_saved, ti, sizeof(ti_saved));
+		bool fixed = (replay && session_replay_ti(replay, &ti[S_BLACK]));
+		if (fixed)  ti[S_WHITE] = ti[S_BLACK];
+
+		char line[4096];  strcpy(line, buf);	/* gtp_parse() modifies buf */
+		double playouts = metric_get(METRIC_PLAYOUTS);
+		double time_start = time_now();
 		enum parse_code c = gtp_parse(gtp, b, e, ti, buf);
+		double elapsed = time_now() - time_start;
+		gtp_metrics(gtp, elapsed);
+		session_command(replay, line, elapsed, metric_get(METRIC_PLAYOUTS) - playouts, metric_get(METRIC_ROOT_PLAYOUTS));
+		if (fixed)
+			memcpy(ti, ti_saved, sizeof(ti_saved));
 
 		/* The gtp command is a weak identity check,
 		 * close the connection with a wrong peer. */
@@ -566,4 +832,5 @@ pachi_done()
 	joseki_done();
 	prob_dict_done();
 	spatial_dict_done();
+	pattern_db_done();
 }
@@ -2,14 +2,17 @@
 #include <assert.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "board.h"
 #include "debug.h"
 #include "pattern.h"
 #include "patternsp.h"
 #include "patternprob.h"
+#include "patterndb.h"
 #include "tactics/ladder.h"
 #include "tactics/selfatari.h"
 #include "tactics/1lib.h"
@@ -223,7 +226,8 @@ patterns_init(pattern_config_t *pc, char *arg, bool create, bool load_prob)
 		}
 	}
 
-	/* Load spatial dictionary */
+	/* Load spatial dictionary, compiled one if we can. */
+	if (!spat_dict && !create)  pattern_db_load(load_prob && !pdict_file);
 	if (!spat_dict)  spatial_dict_init(pc, create);
 	if (!spat_dict)  return;
 
@@ -900,21 +904,24 @@ pattern_match_spatial_outer(pattern_config_t *pc,
 			(f++, p->n++);
 	}
 #else  
-	/* We record all spatial patterns black-to-play; simply
-	 * reverse all colors if we are white-to-play. */
-	static enum stone bt_black[4] = { S_NONE, S_BLACK, S_WHITE, S_OFFBOARD };
-	static enum stone bt_white[4] = { S_NONE, S_WHITE, S_BLACK, S_OFFBOARD };
-	enum stone *bt = m->color == S_WHITE ? bt_white : bt_black;
-	int cx = coord_x(m->coord), cy = coord_y(m->coord);
+	uint8_t points[MAX_PATTERN_AREA];
+	spatial_points_from_board(b, m->coord, m->color, pc->spat_max, points);
 
+	/* Compute hashes for all distances first so that lookups
+	 * can be in flight together. */
+	hash_t hashes[MAX_PATTERN_DIST + 1];
 	for (unsigned int d = BOARD_SPATHASH_MAXD + 1; d <= pc->spat_max; d++) {
 		/* Recompute missing outer circles: Go through all points in given distance. */
-		for (unsigned int j = ptind[d]; j < ptind[d + 1]; j++) {
-			ptcoords_at(x, y, cx, cy, j);
-			h ^= pthashes[0][j][bt[board_atxy(b, x, y)]];
-		}
-		if (d < pc->spat_min)	continue;			
-		spatial_t *s = spatial_dict_lookup(spat_dict, d, h);
+		for (unsigned int j = ptind[d]; j < ptind[d + 1]; j++)
+			h ^= pthashes[0][j][points[j]];
+		hashes[d] = h;
+		if (d >= pc->spat_min)
+			spatial_dict_prefetch(spat_dict, h);
+	}
+
+	unsigned int dmin = MAX(pc->spat_min, BOARD_SPATHASH_MAXD + 1);
+	for (unsigned int d = dmin; d <= pc->spat_max; d++) {
+		spatial_t *s = spatial_dict_lookup(spat_dict, d, hashes[d]);
 		if (!s)			continue;
 		
 		/* Record spatial feature, one per distance. */
@@ -951,6 +958,105 @@ pattern_match_spatial(pattern_config_t *pc,
 	return f;
 }
 
+/* Incremental spatial matching:
+ * Spatial features only depend on stones within spat_max of the move, so
+ * between successive positions rated by a thread (parent / child node,
+ * next genmove ...) most points keep the same ones. We cache them per
+ * thread and only forget them around stones that changed.
+ * Other features depend on things which can change anywhere (liberties
+ * of big groups, ladders, last moves, ownermap) and are always matched. */
+
+#define PATTERN_CACHE_SPATIALS  (MAX_PATTERN_DIST - 2)	/* FEAT_SPATIAL3 .. FEAT_SPATIAL10 */
+#define PATTERN_CACHE_INVALID   0xff
+
+/* Give up and start over if that many stones changed since last time. */
+#define PATTERN_CACHE_MAX_CHANGES 40
+
+typedef struct {
+	int stride;				/* 0: cache disabled */
+	unsigned int spat_min, spat_max;
+	spatial_dict_t *dict;
+	uint8_t b[BOARD_MAX_COORDS];		/* Stones spatials are for */
+	unsigned char n[BOARD_MAX_COORDS];	/* Number of spatial features matched, PATTERN_CACHE_INVALID if not yet */
+	feature_t spatials[BOARD_MAX_COORDS][PATTERN_CACHE_SPATIALS];
+} pattern_cache_t;
+
+/* One for each color to play, spatials are different. */
+static __thread pattern_cache_t pattern_cache[2];
+
+static void
+pattern_cache_forget_around(pattern_cache_t *c, coord_t coord, int stride)
+{
+	int cx = coord_x(coord), cy = coord_y(coord);
+	for (unsigned int j = 0; j < ptind[c->spat_max + 1]; j++) {
+		int x = cx + ptcoords[j].x, y = cy + ptcoords[j].y;
+		if (x < 0 || x >= stride || y < 0 || y >= stride)  continue;
+		c->n[y * stride + x] = PATTERN_CACHE_INVALID;
+	}
+}
+
+void
+pattern_cache_update(pattern_config_t *pc, board_t *b, enum stone color)
+{
+	pattern_cache_t *c = &pattern_cache[color - 1];
+	int stride = board_stride(b);
+
+	/* Nothing to cache without outer spatials. */
+	bool usable = (pc->spat_max > BOARD_SPATHASH_MAXD && pc->spat_min >= 3 && spat_dict);
+	if (!usable) {  c->stride = 0;  return;  }
+
+	if (c->stride != stride || c->dict != spat_dict ||
+	    c->spat_min != pc->spat_min || c->spat_max != pc->spat_max)
+		goto reset;
+
+	coord_t changed[PATTERN_CACHE_MAX_CHANGES];
+	int nchanged = 0;
+	for (coord_t i = 0; i < stride * stride; i++) {
+		if (c->b[i] == board_at(b, i))  continue;
+		if (nchanged == PATTERN_CACHE_MAX_CHANGES)  goto reset;
+		changed[nchanged++] = i;
+	}
+	for (int i = 0; i < nchanged; i++) {
+		pattern_cache_forget_around(c, changed[i], stride);
+		c->b[changed[i]] = board_at(b, changed[i]);
+	}
+	return;
+
+ reset:
+	c->stride = stride;
+	c->dict = spat_dict;
+	c->spat_min = pc->spat_min;
+	c->spat_max = pc->spat_max;
+	memcpy(c->b, b->b, stride * stride * sizeof(*c->b));
+	memset(c->n, PATTERN_CACHE_INVALID, sizeof(c->n));
+}
+
+static feature_t *
+pattern_match_spatial_cached(pattern_config_t *pc,
+			     pattern_t *p, feature_t *f,
+			     board_t *b, move_t *m)
+{
+	pattern_cache_t *c = &pattern_cache[m->color - 1];
+	if (!c->stride)  return pattern_match_spatial(pc, p, f, b, m);
+	assert(c->stride == board_stride(b));
+
+	feature_t *cached = c->spatials[m->coord];
+	int n = c->n[m->coord];
+	if (n == PATTERN_CACHE_INVALID) {
+		feature_t *orig_f = f;
+		f = pattern_match_spatial(pc, p, f, b, m);
+		n = f - orig_f;
+		assert(n >= 1 && n <= PATTERN_CACHE_SPATIALS);
+		memcpy(cached, orig_f, n * sizeof(*f));
+		c->n[m->coord] = n;
+		return f;
+	}
+
+	memcpy(f, cached, n * sizeof(*f));
+	p->n += n;
+	return f + n;
+}
+
 static int
 pattern_match_mcowner(board_t *b, move_t *m, ownermap_t *o)
 {
@@ -963,9 +1069,12 @@ static void
 mcowner_playouts_(board_t *b, enum stone color, ownermap_t *ownermap, int playouts)
 {
 	static playout_policy_t *policy = NULL;
+	static pthread_mutex_t policy_mutex = PTHREAD_MUTEX_INITIALIZER;
 	playout_setup_t setup = playout_setup(MAX_GAMELEN, 0);
 	
+	pthread_mutex_lock(&policy_mutex);	/* patternscan threads */
 	if (!policy)  policy = playout_moggy_init(NULL, b);
+	pthread_mutex_unlock(&policy_mutex);
 	ownermap_init(ownermap);
 	
 	for (int i = 0; i < playouts; i++)  {
@@ -993,9 +1102,12 @@ mcowner_playouts_fast(board_t *b, enum stone color, ownermap_t *ownermap)
 
 /* Keep track of features hits stats ? */
 #ifdef PATTERN_FEATURE_STATS
+#include "timeinfo.h"
 
 static int feature_stats[FEAT_MAX][20] = { { 0, }, };
 static int stats_board_positions = 0;
+static int feature_calls[FEAT_MAX] = { 0, };
+static double feature_time[FEAT_MAX] = { 0, };	/* Time spent matching feature */
 void pattern_stats_new_position() {  stats_board_positions++;  }
 
 static void
@@ -1013,6 +1125,8 @@ dump_feature_stats(pattern_config_t *pc)
 		if (i >= FEAT_SPATIAL) continue; // For now ...
 		
 		/* Regular feature */
+		fprintf(file, "  %-20s  calls: %-10i cost: %.2fus\n", features[i].name, feature_calls[i],
+			(feature_calls[i] ? feature_time[i] * 1000000 / feature_calls[i] : 0));
 		for (int j = 0; j < feature_payloads(i); j++) {
 			f.payload = j;
 			fprintf(file, "  %-20s: %i\n", feature2sstr(&f), feature_stats[i][j]);
@@ -1037,6 +1151,19 @@ add_feature_stats(pattern_t *pattern)
 #endif /* PATTERN_FEATURE_STATS */
 
 
+#ifdef PATTERN_FEATURE_STATS
+#define check_feature(result, feature_id)  do { \
+	double time_start_ = time_now(); \
+	p = (result); \
+	feature_time[feature_id] += time_now() - time_start_; \
+	feature_calls[feature_id]++; \
+	if (p != -1) { \
+		f->id = feature_id; \
+		f->payload = p; \
+		f++;  pattern->n++; \
+	} \
+} while (0)
+#else
 #define check_feature(result, feature_id)  do { \
 	p = (result); \
 	if (p != -1) { \
@@ -1045,6 +1172,7 @@ add_feature_stats(pattern_t *pattern)
 		f++;  pattern->n++; \
 	} \
 } while (0)
+#endif
 
 
 /* For testing purposes: no prioritized features, check every feature. */
@@ -1076,56 +1204,144 @@ pattern_match_vanilla(pattern_config_t *pc, pattern_t *pattern, board_t *b,
 	pattern_match_spatial(pc, pattern, f, b, m);
 
 #ifdef PATTERN_FEATURE_STATS
-	add_feature_stats(p);
+	add_feature_stats(pattern);
 #endif
 }
 
+/* Can any tactical feature (atari ... selfatari) match here ?
+ * They all need some group around short of liberties, a move that
+ * would be, or ko. So if neighbor groups have 4+ libs, diagonal
+ * opponent groups 3+ and the new group would have 3+ libs only
+ * border, distance, mcowner and spatial features can match. */
+static bool
+tactical_move(board_t *b, move_t *m)
+{
+	enum stone other_color = stone_other(m->color);
+	if (m->coord == b->last_ko.coord)  return true;
+
+	int libs = immediate_liberty_count(b, m->coord);
+	if (libs < 2)  return true;
+
+	bool own_neighbor = false;
+	foreach_neighbor(b, m->coord, {
+		enum stone s = board_at(b, c);
+		if (s != S_BLACK && s != S_WHITE)  continue;
+		if (board_group_info(b, group_at(b, c)).libs < 4)  return true;
+		if (s == m->color)  own_neighbor = true;
+	});
+	if (!own_neighbor && libs < 3)  return true;
+
+	foreach_diag_neighbor(b, m->coord) {
+		if (board_at(b, c) == other_color &&
+		    board_group_info(b, group_at(b, c)).libs < 3)  return true;
+	} foreach_diag_neighbor_end;
+	return false;
+}
+
 /* TODO: We should match pretty much all of these features incrementally. */
-static void
+/* Readers matched last when there's a cutoff, cheapest first so they can
+ * tighten the bound before selfatari (see PATTERN_FEATURE_STATS costs).
+ * Happens to be the usual order too. */
+static enum feature_id deferred_readers[] = { FEAT_NET, FEAT_DEFENCE, FEAT_SELFATARI };
+
+/* Match readers we skipped earlier, unless even their best gammas can't
+ * bring pattern gamma up to @cutoff. Features go in at @at, so pattern
+ * is the same as without cutoff. Returns false if pattern was cut off. */
+static bool
+pattern_match_deferred(pattern_config_t *pc, pattern_t *pattern, feature_t *at,
+		       board_t *b, move_t *m, ownermap_t *ownermap, bool atari_ladder,
+		       floating_t cutoff)
+{
+	int nreaders = sizeof(deferred_readers) / sizeof(*deferred_readers);
+	floating_t bound = pattern_gamma(pc, pattern);
+	for (int i = 0; i < nreaders; i++)
+		bound *= prob_dict->max_gamma[deferred_readers[i]];
+
+	feature_t found[nreaders];
+	int n = 0;
+	bool complete = true;
+	for (int i = 0; i < nreaders; i++) {
+		if (bound < cutoff) {  complete = false;  break;  }
+
+		enum feature_id id = deferred_readers[i];
+		int p = -1;
+		if      (id == FEAT_NET)			p = pattern_match_net(b, m, ownermap);
+		else if (id == FEAT_DEFENCE)			p = pattern_match_defence(b, m);
+		else if (id == FEAT_SELFATARI && !atari_ladder)	p = pattern_match_selfatari(b, m);
+
+		/* Tighten bound with what we found. */
+		bound /= prob_dict->max_gamma[id];
+		if (p == -1)  continue;
+		found[n].id = id;
+		found[n].payload = p;
+		bound *= feature_gamma(pc, &found[n++]);
+	}
+
+	memmove(at + n, at, (pattern->f + pattern->n - at) * sizeof(*at));
+	memcpy(at, found, n * sizeof(*at));
+	pattern->n += n;
+	return complete;
+}
+
+static bool
 pattern_match_internal(pattern_config_t *pc, pattern_t *pattern, board_t *b,
-		       move_t *m, ownermap_t *ownermap, bool locally)
+		       move_t *m, ownermap_t *ownermap, bool locally, bool cached,
+		       floating_t cutoff)
 {
 #ifdef PATTERN_FEATURE_STATS
 	dump_feature_stats(pc);
 #endif
 
 	feature_t *f = &pattern->f[0];
+	feature_t *deferred = NULL;
+	bool atari_ladder = false;
 	int p;  /* payload */
 	pattern->n = 0;
 	assert(!is_pass(m->coord));   assert(!is_resign(m->coord));
 
 
+	/* Quiet move, skip expensive checks. */
+	if (!tactical_move(b, m))  goto other_features;
+
 	/***********************************************************************************/
 	/* Prioritized features, don't let others pull them down. */
 	
 	check_feature(pattern_match_atari(b, m, ownermap), FEAT_ATARI);
-	bool atari_ladder = (p == PF_ATARI_LADDER);
-	{       if (p == PF_ATARI_LADDER_BIG)  return;  /* don't let selfatari kick-in ... */
-		if (p == PF_ATARI_SNAPBACK)    return;  
-		if (p == PF_ATARI_AND_CAP)     return;
-		if (p == PF_ATARI_KO)          return;  /* don't let selfatari kick-in, fine as ko-threats */
+	atari_ladder = (p == PF_ATARI_LADDER);
+	{       if (p == PF_ATARI_LADDER_BIG)  return true;  /* don't let selfatari kick-in ... */
+		if (p == PF_ATARI_SNAPBACK)    return true;  
+		if (p == PF_ATARI_AND_CAP)     return true;
+		if (p == PF_ATARI_KO)          return true;  /* don't let selfatari kick-in, fine as ko-threats */
 	}
 
 	check_feature(pattern_match_double_snapback(b, m), FEAT_DOUBLE_SNAPBACK);
-	{	if (p == 0)  return;  }
+	{	if (p == 0)  return true;  }
 	
 	check_feature(pattern_match_capture(b, m), FEAT_CAPTURE); {
-		if (p == PF_CAPTURE_TAKE_KO)  return;  /* don't care about distance etc */
-		if (p == PF_CAPTURE_END_KO)   return;
+		if (p == PF_CAPTURE_TAKE_KO)  return true;  /* don't care about distance etc */
+		if (p == PF_CAPTURE_END_KO)   return true;
 	}
 
 	check_feature(pattern_match_aescape(b, m), FEAT_AESCAPE);
-	{	if (p == PF_AESCAPE_FILL_KO)  return;  }
+	{	if (p == PF_AESCAPE_FILL_KO)  return true;  }
 
 	check_feature(pattern_match_cut(b, m, ownermap), FEAT_CUT);
-	{	if (p == PF_CUT_DANGEROUS)  return;  }
+	{	if (p == PF_CUT_DANGEROUS)  return true;  }
 
 	/***********************************************************************************/
 	/* Other features */
 
+	/* With a cutoff expensive readers come last, maybe we don't need them. */
+	if (cutoff > 0) {
+		deferred = f;
+		goto other_features;
+	}
+
 	check_feature(pattern_match_net(b, m, ownermap), FEAT_NET);
 	check_feature(pattern_match_defence(b, m), FEAT_DEFENCE);
 	if (!atari_ladder)  check_feature(pattern_match_selfatari(b, m), FEAT_SELFATARI);
+
+ other_features:
 	check_feature(pattern_match_border(b, m, pc), FEAT_BORDER);
 	if (locally) {
 		check_feature(pattern_match_distance(b, m), FEAT_DISTANCE);
@@ -1133,14 +1349,19 @@ pattern_match_internal(pattern_config_t *pc, pattern_t *pattern, board_t *b,
 	}
 	check_feature(pattern_match_mcowner(b, m, ownermap), FEAT_MCOWNER);
 
-	f = pattern_match_spatial(pc, pattern, f, b, m);
+	if (cached)  f = pattern_match_spatial_cached(pc, pattern, f, b, m);
+	else         f = pattern_match_spatial(pc, pattern, f, b, m);
+
+	if (deferred)
+		return pattern_match_deferred(pc, pattern, deferred, b, m, ownermap, atari_ladder, cutoff);
+	return true;
 }
 
 void
 pattern_match(pattern_config_t *pc, pattern_t *p, board_t *b,
 	      move_t *m, ownermap_t *ownermap, bool locally)
 {
-	pattern_match_internal(pc, p, b, m, ownermap, locally);
+	pattern_match_internal(pc, p, b, m, ownermap, locally, false, 0);
 	
 	/* Debugging */
 	//if (pattern_has_feature(p, FEAT_ATARI, PF_ATARI_AND_CAP))  show_move(b, m, "atari_and_cap");
@@ -1152,6 +1373,18 @@ pattern_match(pattern_config_t *pc, pattern_t *p, board_t *b,
 #endif	
 }
 
+bool
+pattern_match_cached(pattern_config_t *pc, pattern_t *p, board_t *b,
+		     move_t *m, ownermap_t *ownermap, bool locally, floating_t cutoff)
+{
+	bool complete = pattern_match_internal(pc, p, b, m, ownermap, locally, true, cutoff);
+
+#ifdef PATTERN_FEATURE_STATS
+	if (complete)  add_feature_stats(p);
+#endif	
+	return complete;
+}
+
 
 /* Return feature payload name if it has one. */
 static char*
@@ -187,6 +187,15 @@ static bool pattern_eq(pattern_t *p1, pattern_t *p2);
 /* Initialize p and fill it with features matched by the given board move. 
  * @locally: Looking for local moves ? Distance features disabled if false. */
 void pattern_match(pattern_config_t *pc, pattern_t *p, board_t *b, move_t *m, ownermap_t *ownermap, bool locally);
+/* Incremental version for rating all moves of a position: spatial features are
+ * cached per thread and only re-matched where stones changed since last time.
+ * Call pattern_cache_update() with the board first, then pattern_match_cached()
+ * for its moves. Same results as pattern_match().
+ * If @cutoff > 0 expensive readers (net, defence, selfatari) are matched last
+ * and skipped if pattern gamma can't reach @cutoff whatever they find: returns
+ * false then, pattern is incomplete but its gamma is below @cutoff. Needs gammas. */
+void pattern_cache_update(pattern_config_t *pc, board_t *b, enum stone color);
+bool pattern_match_cached(pattern_config_t *pc, pattern_t *p, board_t *b, move_t *m, ownermap_t *ownermap, bool locally, floating_t cutoff);
 /* For testing purposes: no prioritized features, check every feature. */
 void pattern_match_vanilla(pattern_config_t *pc, pattern_t *p, board_t *b, move_t *m, ownermap_t *ownermap);
 
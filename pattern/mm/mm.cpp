@@ -11,33 +11,108 @@
 #include <iomanip>
 #include <sstream>
 #include <vector>
-#include <map>
 #include <cmath>
+#include <ctime>
 #include <fstream>
+#include <thread>
+#include <cstring>
+#include <cstdint>
 #include <assert.h>
 
 const double PriorVictories = 1.0;
 const double PriorGames = 2.0;
 const double PriorOpponentGamma = 1.0;
 
+int Threads = 1;
+const char *CheckpointFile = "mm-checkpoint.dat";
+const int CheckpointInterval = 60; // seconds
+
+/////////////////////////////////////////////////////////////////////////////
+// Run f(Begin, End, Thread) over [0, n) split between threads
+/////////////////////////////////////////////////////////////////////////////
+template<class F> void Parallel(int n, F f)
+{
+ std::vector<std::thread> vThread;
+ for (int t = 0; t < Threads; t++)
+  vThread.push_back(std::thread(f, (int)((int64_t)n * t / Threads),
+                                   (int)((int64_t)n * (t + 1) / Threads), t));
+ for (int t = 0; t < Threads; t++)
+  vThread[t].join();
+}
+
 /////////////////////////////////////////////////////////////////////////////
-// One "team": product of gammas
+// Game collection, stored as sparse incidence tables:
+//
+// - team t: gamma numbers vIndex[vTeamStart[t] .. vTeamStart[t + 1])
+// - game g: winner team vWinner[g],
+//           participants teams vGameBegin[g] .. vGameEnd[g]
+// - feature f: occurrences vOcc[vOccStart[f] .. vOccStart[f + 1]),
+//           (participant team, gamma) pairs with a gamma of feature f,
+//           in game order. vOccGames[] has the games they are in.
+//
+// Product of gammas of each participant team and sum of these for each
+// game are kept up to date, so one MM iteration only has to go over
+// occurrences of the feature it updates.
 /////////////////////////////////////////////////////////////////////////////
-class CTeam
+struct COccurrence
 {
- private: ///////////////////////////////////////////////////////////////////
-  static std::vector<int> vi;
-  int Index;
-  int Size;
+ int Team;
+ int Index;
+};
 
+class CGameCollection
+{
  public: ////////////////////////////////////////////////////////////////////
-  CTeam(): Index(vi.size()), Size(0) {}
-  int GetSize() const {return Size;}
-  int GetIndex(int i) const {return vi[Index+i];}
-  void Append(int i) {vi.push_back(i); Size++;}
+  std::vector<int> vIndex;
+  std::vector<int> vTeamStart;
+  std::vector<int> vTeamGame;
+  std::vector<int> vWinner;
+  std::vector<int> vGameBegin;
+  std::vector<int> vGameEnd;
+
+  std::vector<COccurrence> vOcc;
+  std::vector<int> vOccStart;
+  std::vector<int> vOccGames;
+  std::vector<int> vOccGamesStart;
+
+  std::vector<double> vTeamGamma;
+  std::vector<double> vGameDen;
+
+  std::vector<double> vGamma;
+  std::vector<int> vFeatureIndex;
+  std::vector<std::string> vFeatureName;
+  std::vector<int> vGammaFeature;
+  std::vector<double> vVictories;
+  std::vector<int> vParticipations;
+  std::vector<int> vPresences;
+
+  CGameCollection(): vTeamStart(1, 0) {}
+
+  int Games() const {return vWinner.size();}
+  int Teams() const {return vTeamStart.size() - 1;}
+  int AddTeam(const std::vector<int> &v);
+
+  void BuildIndex();
+  void ComputeVictories();
+  void ComputeDen();
+  void MM(int Feature);
+  double LogLikelihood() const;
+
+  double GetTeamGamma(int Team) const
+  {
+   double Result = 1.0;
+   for (int i = vTeamStart[Team]; i < vTeamStart[Team + 1]; i++)
+    Result *= vGamma[vIndex[i]];
+   return Result;
+  }
 };
 
-std::vector<int> CTeam::vi;
+int CGameCollection::AddTeam(const std::vector<int> &v)
+{
+ vIndex.insert(vIndex.end(), v.begin(), v.end());
+ vTeamStart.push_back(vIndex.size());
+ return Teams() - 1;
+}
 
 int
 gamma_to_feature(int gamma, std::vector<int> &vFeatureIndex)
@@ -52,10 +127,10 @@ gamma_to_feature(int gamma, std::vector<int> &vFeatureIndex)
 /////////////////////////////////////////////////////////////////////////////
 // Read a team
 /////////////////////////////////////////////////////////////////////////////
-CTeam ReadTeam(std::string &s, std::vector<int> &vFeatureIndex, int Gammas)
+std::vector<int> ReadTeam(std::string &s, std::vector<int> &vFeatureIndex, int Gammas)
 {
  std::istringstream in(s);
- CTeam team;
+ std::vector<int> team;
  int Index;
  while(1)
  {
@@ -67,14 +142,14 @@ CTeam ReadTeam(std::string &s, std::vector<int> &vFeatureIndex, int Gammas)
   }
   if (in) {
 	  int feature = gamma_to_feature(Index, vFeatureIndex);
-	  for (int i = team.GetSize(); --i >= 0;) {
-		  if (feature == gamma_to_feature(team.GetIndex(i), vFeatureIndex)) {
+	  for (int i = team.size(); --i >= 0;) {
+		  if (feature == gamma_to_feature(team[i], vFeatureIndex)) {
 			  std::cerr << '\n' << s << '\n';
-			  fprintf(stderr, "%i and %i are same feature !\n", Index, team.GetIndex(i));
+			  fprintf(stderr, "%i and %i are same feature !\n", Index, team[i]);
 			  assert(0);
 		  }
 	  }
-	  team.Append(Index);
+	  team.push_back(Index);
   }
   else
    break;
@@ -83,60 +158,104 @@ CTeam ReadTeam(std::string &s, std::vector<int> &vFeatureIndex, int Gammas)
 }
 
 /////////////////////////////////////////////////////////////////////////////
-// One "Game": One winner team out of several participants
+// Build occurrence tables
 /////////////////////////////////////////////////////////////////////////////
-class CGame
+void CGameCollection::BuildIndex()
 {
- public: ////////////////////////////////////////////////////////////////////
-  CTeam Winner;
-  std::vector<CTeam> vParticipants;
-};
+ const int Features = vFeatureName.size();
+
+ vGammaFeature.resize(vGamma.size());
+ for (int f = 0; f < Features; f++)
+  for (int i = vFeatureIndex[f]; i < vFeatureIndex[f + 1]; i++)
+   vGammaFeature[i] = f;
+
+ vTeamGame.assign(Teams(), -1);
+ for (int g = 0; g < Games(); g++)
+  for (int t = vGameBegin[g]; t < vGameEnd[g]; t++)
+   vTeamGame[t] = g;
+
+ //
+ // Count, then fill in game order
+ //
+ vOccStart.assign(Features + 1, 0);
+ vOccGamesStart.assign(Features + 1, 0);
+ std::vector<int> vLastGame(Features, -1);
+ for (int g = 0; g < Games(); g++)
+  for (int t = vGameBegin[g]; t < vGameEnd[g]; t++)
+   for (int i = vTeamStart[t]; i < vTeamStart[t + 1]; i++)
+   {
+    int f = vGammaFeature[vIndex[i]];
+    vOccStart[f + 1]++;
+    if (vLastGame[f] != g)
+     vOccGamesStart[f + 1]++;
+    vLastGame[f] = g;
+   }
+ for (int f = 0; f < Features; f++)
+ {
+  vOccStart[f + 1] += vOccStart[f];
+  vOccGamesStart[f + 1] += vOccGamesStart[f];
+ }
+
+ vOcc.resize(vOccStart[Features]);
+ vOccGames.resize(vOccGamesStart[Features]);
+ std::vector<int> vOccNext(vOccStart.begin(), vOccStart.end() - 1);
+ std::vector<int> vGamesNext(vOccGamesStart.begin(), vOccGamesStart.end() - 1);
+ vLastGame.assign(Features, -1);
+ for (int g = 0; g < Games(); g++)
+  for (int t = vGameBegin[g]; t < vGameEnd[g]; t++)
+   for (int i = vTeamStart[t]; i < vTeamStart[t + 1]; i++)
+   {
+    int f = vGammaFeature[vIndex[i]];
+    COccurrence &occ = vOcc[vOccNext[f]++];
+    occ.Team = t;
+    occ.Index = vIndex[i];
+    if (vLastGame[f] != g)
+     vOccGames[vGamesNext[f]++] = g;
+    vLastGame[f] = g;
+   }
+}
 
 /////////////////////////////////////////////////////////////////////////////
-// Game Collection:
+// Compute team gammas and denominator of each game from scratch
 /////////////////////////////////////////////////////////////////////////////
-class CGameCollection
+void CGameCollection::ComputeDen()
 {
- public: ////////////////////////////////////////////////////////////////////
-  std::vector<CGame> vgame;
-  std::vector<double> vGamma;
-  std::vector<int> vFeatureIndex;
-  std::vector<std::string> vFeatureName;
-  std::vector<double> vVictories;
-  std::vector<int> vParticipations;
-  std::vector<int> vPresences;
-
-  void ComputeVictories();
-  void MM(int Feature);
-  double LogLikelihood() const;
+ vTeamGamma.resize(Teams());
+ vGameDen.resize(Games());
 
-  double GetTeamGamma(const CTeam &team) const
+ Parallel(Games(), [&](int Begin, int End, int t)
+ {
+  for (int g = Begin; g < End; g++)
   {
-   double Result = 1.0;
-   for (int i = team.GetSize(); --i >= 0;)
-    Result *= vGamma[team.GetIndex(i)];
-   return Result;
+   double Den = 0.0;
+   for (int Team = vGameBegin[g]; Team < vGameEnd[g]; Team++)
+    Den += (vTeamGamma[Team] = GetTeamGamma(Team));
+   vGameDen[g] = Den;
   }
-};
+ });
+}
 
 /////////////////////////////////////////////////////////////////////////////
 // Compute log likelihood
 /////////////////////////////////////////////////////////////////////////////
 double CGameCollection::LogLikelihood() const
 {
- double L = 0;
+ std::vector<double> vL(Threads);
 
- for (int i = vgame.size(); --i >= 0;)
+ Parallel(Games(), [&](int Begin, int End, int t)
  {
-  const CGame &game = vgame[i];
-  double Opponents = 0; 
-  const std::vector<CTeam> &v = game.vParticipants;
-  for (int j = v.size(); --j >= 0;)
-   Opponents += GetTeamGamma(v[j]);
-  L += std::log(GetTeamGamma(game.Winner));
-  L -= std::log(Opponents);
- }
+  double L = 0;
+  for (int g = End; --g >= Begin;)
+  {
+   L += std::log(GetTeamGamma(vWinner[g]));
+   L -= std::log(vGameDen[g]);
+  }
+  vL[t] = L;
+ });
 
+ double L = 0;
+ for (int t = 0; t < Threads; t++)
+  L += vL[t];
  return L;
 }
 
@@ -145,44 +264,27 @@ double CGameCollection::LogLikelihood() const
 /////////////////////////////////////////////////////////////////////////////
 void CGameCollection::ComputeVictories()
 {
- vVictories.resize(vGamma.size());
- vParticipations.resize(vGamma.size());
- vPresences.resize(vGamma.size());
+ vVictories.assign(vGamma.size(), 0);
+ vParticipations.assign(vGamma.size(), 0);
+ vPresences.assign(vGamma.size(), 0);
+ std::vector<int> vLastGame(vGamma.size(), -1);
 
- for (int i = vVictories.size(); --i >= 0;)
+ for (int g = Games(); --g >= 0;)
  {
-  vVictories[i] = 0;
-  vParticipations[i] = 0;
-  vPresences[i] = 0;
- }
+  int w = vWinner[g];
+  for (int i = vTeamStart[w]; i < vTeamStart[w + 1]; i++)
+   vVictories[vIndex[i]]++;
 
- for (int i = vgame.size(); --i >= 0;)
- {
-  const CTeam &Winner = vgame[i].Winner;
-  for (int j = Winner.GetSize(); --j >= 0;)
-   vVictories[Winner.GetIndex(j)]++;
-
-  int tParticipations[vGamma.size()];
-  for (int j = vGamma.size(); --j >= 0;)
-   tParticipations[j] = 0;
-
-  for (int k = vgame[i].vParticipants.size(); --k >= 0;)
-   for (int j = vgame[i].vParticipants[k].GetSize(); --j >= 0;)
+  for (int t = vGameBegin[g]; t < vGameEnd[g]; t++)
+   for (int i = vTeamStart[t]; i < vTeamStart[t + 1]; i++)
    {
-    int Index = vgame[i].vParticipants[k].GetIndex(j);
+    int Index = vIndex[i];
     vParticipations[Index]++;
-    tParticipations[Index]++;
+    if (vLastGame[Index] != g)
+     vPresences[Index]++;
+    vLastGame[Index] = g;
    }
-
-  for (int i = vGamma.size(); --i >= 0;)
-   if (tParticipations[i])
-    vPresences[i]++;
  }
-
-#if 0
- for (int i = vGamma.size(); --i >= 0;)
-  std::cerr << i << ' ' << vVictories[i] << '\n';
-#endif
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -195,68 +297,37 @@ void CGameCollection::MM(int Feature)
  //
  int Max = vFeatureIndex[Feature + 1];
  int Min = vFeatureIndex[Feature];
+ const COccurrence *pOcc = &vOcc[vOccStart[Feature]];
+ int Occurrences = vOccStart[Feature + 1] - vOccStart[Feature];
 
  //
- // Compute denominator for each gamma
+ // Compute denominator for each gamma:
+ // gammas of teammates over strength of all participants
+ // (each thread sums its share of the occurrences)
  //
- std::vector<double> vDen(vGamma.size());
- for (int i = vDen.size(); --i >= 0;)
-  vDen[i] = 0.0;
+ std::vector<std::vector<double> > vvDen(Threads);
+ std::vector<double> vMul(Occurrences);
 
- //
- // Main loop over games
- //
- std::map<int,double> tMul;
- for (int i = vgame.size(); --i >= 0;)
+ Parallel(Occurrences, [&](int Begin, int End, int t)
  {
-  //double tMul[vGamma.size()];
-  //{
-  // for (int i = vGamma.size(); --i >= 0;)
-  //  tMul[i] = 0.0;
-  //}
-  tMul.clear();
-
-  double Den = 0.0;
-
-  std::vector<CTeam> &v = vgame[i].vParticipants;
-  for (int i = v.size(); --i >= 0;)
+  std::vector<double> &vDen = vvDen[t];
+  vDen.assign(Max - Min, 0.0);
+  for (int j = Begin; j < End; j++)
   {
-   const CTeam &team = v[i];
-
+   const COccurrence &occ = pOcc[j];
    double Product = 1.0;
-   int FeatureIndex = -1;
-
-   for (int i = 0; i < team.GetSize(); i++)
-   {
-    int Index = team.GetIndex(i);
-    if (Index >= Min && Index < Max)
-     FeatureIndex = Index;
-    else
-     Product *= vGamma[Index];
-   }
-
-   if (FeatureIndex >= 0)
-   {
-    //tMul[FeatureIndex] += Product;
-    if (tMul.count(FeatureIndex))
-    	tMul[FeatureIndex] += Product;
-    else
-	tMul[FeatureIndex]=Product;
-    
-    Product *= vGamma[FeatureIndex];
-   }
-
-   Den += Product;
+   for (int i = vTeamStart[occ.Team]; i < vTeamStart[occ.Team + 1]; i++)
+    if (vIndex[i] != occ.Index)
+     Product *= vGamma[vIndex[i]];
+   vMul[j] = Product;
+   vDen[occ.Index - Min] += Product / vGameDen[vTeamGame[occ.Team]];
   }
+ });
 
-  //for (int i = Max; --i >= Min;)
-  // vDen[i] += tMul[i] / Den;
-  for (std::map<int,double>::iterator it=tMul.begin();it!=tMul.end();++it)
-  {
-   int key=it->first;
-   vDen[key]+=it->second / Den;
-  }
- }
+ std::vector<double> vDen(Max - Min, 0.0);
+ for (int t = 0; t < Threads; t++)
+  for (int i = Max - Min; --i >= 0;)
+   vDen[i] += vvDen[t][i];
 
  //
  // Update Gammas
@@ -264,9 +335,82 @@ void CGameCollection::MM(int Feature)
  for (int i = Max; --i >= Min;)
  {
   double NewGamma = (vVictories[i] + PriorVictories) /
-                    (vDen[i] + PriorGames / (vGamma[i] + PriorOpponentGamma));
+                    (vDen[i - Min] + PriorGames / (vGamma[i] + PriorOpponentGamma));
   vGamma[i] = NewGamma;
  }
+
+ //
+ // Update teams which have this feature, then their games
+ //
+ Parallel(Occurrences, [&](int Begin, int End, int t)
+ {
+  for (int j = Begin; j < End; j++)
+   vTeamGamma[pOcc[j].Team] = vMul[j] * vGamma[pOcc[j].Index];
+ });
+
+ const int *pGames = &vOccGames[vOccGamesStart[Feature]];
+ Parallel(vOccGamesStart[Feature + 1] - vOccGamesStart[Feature],
+          [&](int Begin, int End, int t)
+ {
+  for (int j = Begin; j < End; j++)
+  {
+   int g = pGames[j];
+   double Den = 0.0;
+   for (int Team = vGameBegin[g]; Team < vGameEnd[g]; Team++)
+    Den += vTeamGamma[Team];
+   vGameDen[g] = Den;
+  }
+ });
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Read binary records (pachi patternscan "binary" option):
+// uint16 teams, then teams, first one is the winner.
+// Team: uint8 size, then size gamma numbers of Width bytes.
+/////////////////////////////////////////////////////////////////////////////
+void ReadBinaryGames(CGameCollection &gcol, std::istream &in, int Width, int Gammas)
+{
+ std::vector<char> vBuffer((std::istreambuf_iterator<char>(in)),
+                           std::istreambuf_iterator<char>());
+ const unsigned char *p = (const unsigned char *)vBuffer.data();
+ const unsigned char *pEnd = p + vBuffer.size();
+ gcol.vIndex.reserve(vBuffer.size() / Width);
+ std::vector<int> team;
+
+ while (p < pEnd)
+ {
+  uint16_t Teams;
+  memcpy(&Teams, p, 2); p += 2;
+  int Begin = gcol.Teams();
+
+  for (int t = 0; t < Teams; t++)
+  {
+   assert(p < pEnd);
+   int Size = *p++;
+   team.clear();
+   for (int j = 0; j < Size; j++)
+   {
+    uint32_t Index = 0;
+    if (Width == 2) {uint16_t i16; memcpy(&i16, p, 2); Index = i16;}
+    else            memcpy(&Index, p, 4);
+    p += Width;
+    if (Index >= (uint32_t)Gammas) {
+     fprintf(stderr, "invalid gamma: %u\n", Index);
+     assert(0);
+    }
+    team.push_back(Index);
+   }
+   gcol.AddTeam(team);
+  }
+  assert(p <= pEnd);
+
+  gcol.vWinner.push_back(Begin);
+  gcol.vGameBegin.push_back(Begin);
+  gcol.vGameEnd.push_back(gcol.Teams());
+  if (!(gcol.Games() % 100000))
+   std::cerr << '.';
+ }
+ std::cerr << '\n';
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -276,8 +420,11 @@ void ReadGameCollection(CGameCollection &gcol, std::istream &in)
 {
  //
  // Read number of gammas in the first line
+ // ("! Gammas", or "!B Gammas Width" for binary records)
  //
  int MaxGamma;
+ bool fBinary;
+ int Width = 0;
  {
   std::string sLine;
   std::getline(in, sLine);
@@ -285,6 +432,10 @@ void ReadGameCollection(CGameCollection &gcol, std::istream &in)
   std::string s;
   int Gammas = 0;
   is >> s >> Gammas;
+  fBinary = (s == "!B");
+  if (fBinary)
+   is >> Width;
+  assert(!fBinary || Width == 2 || Width == 4);
   MaxGamma = Gammas;
   gcol.vGamma.resize(Gammas);
   for (int i = Gammas; --i >= 0;)
@@ -311,11 +462,21 @@ void ReadGameCollection(CGameCollection &gcol, std::istream &in)
  }
 
  //
- // Main loop over games
+ // Binary records follow end of header
  //
  std::string sLine;
  std::getline(in, sLine);
+ if (fBinary)
+ {
+  std::getline(in, sLine);
+  assert(sLine == "!");
+  ReadBinaryGames(gcol, in, Width, MaxGamma);
+  return;
+ }
 
+ //
+ // Main loop over games
+ //
  while(in)
  {
   //
@@ -323,13 +484,12 @@ void ReadGameCollection(CGameCollection &gcol, std::istream &in)
   //
   if (sLine == "#")
   {
-   CGame game;
-
    //
    // Winner
    //
    std::getline(in, sLine);
-   game.Winner = ReadTeam(sLine, gcol.vFeatureIndex, MaxGamma);
+   gcol.vWinner.push_back(gcol.AddTeam(ReadTeam(sLine, gcol.vFeatureIndex, MaxGamma)));
+   gcol.vGameBegin.push_back(gcol.Teams());
 
    //
    // Participants
@@ -337,12 +497,11 @@ void ReadGameCollection(CGameCollection &gcol, std::istream &in)
    std::getline(in, sLine);
    while (sLine[0] != '#' && sLine[0] != '!' && in)
    {
-    CTeam team = ReadTeam(sLine, gcol.vFeatureIndex, MaxGamma);
-    game.vParticipants.push_back(team);
+    gcol.AddTeam(ReadTeam(sLine, gcol.vFeatureIndex, MaxGamma));
     std::getline(in, sLine);
    }
 
-   gcol.vgame.push_back(game);
+   gcol.vGameEnd.push_back(gcol.Teams());
   }
   else
   {
@@ -373,24 +532,98 @@ void WriteRatings(const CGameCollection &gcol,
  }
 }
 
+/////////////////////////////////////////////////////////////////////////////
+// Checkpoint: pass, deltas and gammas, at full precision.
+/////////////////////////////////////////////////////////////////////////////
+void WriteCheckpoint(const CGameCollection &gcol, int k, const double *tDelta)
+{
+ std::string sTmp = std::string(CheckpointFile) + ".tmp";
+ {
+  std::ofstream ofs(sTmp.c_str());
+  ofs << std::setprecision(17);
+  ofs << "mm-checkpoint " << gcol.vGamma.size() << ' ' << gcol.vFeatureName.size() << ' ' << k << '\n';
+  for (unsigned i = 0; i < gcol.vFeatureName.size(); i++)
+   ofs << tDelta[i] << '\n';
+  for (unsigned i = 0; i < gcol.vGamma.size(); i++)
+   ofs << gcol.vGamma[i] << '\n';
+  if (!ofs)
+  {
+   std::cerr << "couldn't write " << sTmp << '\n';
+   return;
+  }
+ }
+ rename(sTmp.c_str(), CheckpointFile);
+}
+
+bool ReadCheckpoint(CGameCollection &gcol, int &k, double *tDelta)
+{
+ std::ifstream ifs(CheckpointFile);
+ std::string s;
+ unsigned Gammas = 0, Features = 0;
+ ifs >> s >> Gammas >> Features >> k;
+ if (!ifs || s != "mm-checkpoint" ||
+     Gammas != gcol.vGamma.size() || Features != gcol.vFeatureName.size())
+  return false;
+ for (unsigned i = 0; i < Features; i++)
+  ifs >> tDelta[i];
+ for (unsigned i = 0; i < Gammas; i++)
+  ifs >> gcol.vGamma[i];
+ return (bool)ifs;
+}
+
 /////////////////////////////////////////////////////////////////////////////
 // main function
 /////////////////////////////////////////////////////////////////////////////
-int main()
+int main(int argc, char **argv)
 {
+ Threads = std::thread::hardware_concurrency();
+ bool fResume = false;
+ for (int i = 1; i < argc; i++)
+ {
+  if (!strcmp(argv[i], "-t") && i + 1 < argc)
+   Threads = atoi(argv[++i]);
+  else if (!strcmp(argv[i], "-c") && i + 1 < argc)
+   CheckpointFile = argv[++i];
+  else if (!strcmp(argv[i], "-r"))
+   fResume = true;
+  else
+  {
+   std::cerr << "usage: mm [-t threads] [-c checkpoint] [-r] < mm-input.dat\n";
+   return 1;
+  }
+ }
+ if (Threads < 1)
+  Threads = 1;
+
  CGameCollection gcol;
  ReadGameCollection(gcol, std::cin);
+ gcol.BuildIndex();
  gcol.ComputeVictories();
- std::cerr << "Games = " << gcol.vgame.size() << '\n';
- double LogLikelihood = gcol.LogLikelihood() / gcol.vgame.size();
+ std::cerr << "Games = " << gcol.Games() << '\n';
 
  const int Features = gcol.vFeatureName.size();
  double tDelta[Features];
 
- for (int k = 2; --k >= 0;)
+ int kStart = 1;
+ if (fResume)
  {
-  for (int i = Features; --i >= 0;)
-   tDelta[i] = 10.0;
+  if (!ReadCheckpoint(gcol, kStart, tDelta))
+  {
+   std::cerr << "can't resume from " << CheckpointFile << '\n';
+   return 1;
+  }
+  std::cerr << "Resuming from " << CheckpointFile << '\n';
+ }
+
+ gcol.ComputeDen();
+ double LogLikelihood = gcol.LogLikelihood() / gcol.Games();
+ time_t LastCheckpoint = time(NULL);
+
+ for (int k = kStart + 1; --k >= 0;)
+ {
+  if (!fResume || k != kStart)
+   for (int i = Features; --i >= 0;)
+    tDelta[i] = 10.0;
 
   while(1)
   {
@@ -404,7 +637,7 @@ int main()
      MaxDelta = tDelta[Feature = j];
    if (MaxDelta < 0.0001)
     break;
-   
+
    //
    // Run one MM iteration over this feature
    //
@@ -412,11 +645,17 @@ int main()
    std::cerr << std::setw(9) << LogLikelihood << ' ';
    std::cerr << std::setw(9) << std::exp(-LogLikelihood) << ' ';
    gcol.MM(Feature);
-   double NewLogLikelihood = gcol.LogLikelihood() / gcol.vgame.size();
+   double NewLogLikelihood = gcol.LogLikelihood() / gcol.Games();
    double Delta = NewLogLikelihood - LogLikelihood;
    tDelta[Feature] = Delta;
    std::cerr << std::setw(9) << Delta << '\n';
    LogLikelihood = NewLogLikelihood;
+
+   if (time(NULL) - LastCheckpoint >= CheckpointInterval)
+   {
+    WriteCheckpoint(gcol, k, tDelta);
+    LastCheckpoint = time(NULL);
+   }
   }
  }
 
@@ -426,6 +665,7 @@ int main()
   std::ofstream ofs("mm-with-freq.dat");
   WriteRatings(gcol, ofs, 1);
  }
- 
+ remove(CheckpointFile);
+
  return 0;
 }
@@ -0,0 +1,225 @@
+#define DEBUG
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "debug.h"
+#include "pattern.h"
+#include "patternsp.h"
+#include "patternprob.h"
+#include "patterndb.h"
+
+/* Database file format:
+ * header, then spat_dict->spatials[], spat_dict->hashtable[],
+ * prob_dict->index[] and prob_dict->gammas[] as they are in memory,
+ * each section aligned on PATTERN_DB_ALIGN bytes. */
+
+#define PATTERN_DB_MAGIC   0x4244504948434150ULL	/* "PACHIPDB" */
+#define PATTERN_DB_VERSION 2
+#define PATTERN_DB_ALIGN   64
+
+/* Sizes of what we store, different build can't use it. */
+#define PATTERN_DB_LAYOUT  (sizeof(spatial_t) | sizeof(spatial_entry_t) << 8 | \
+			    sizeof(pattern_prob_t) << 16 | MAX_PATTERN_DIST << 24)
+
+typedef struct {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t layout;
+	hash_t   pthashes;		/* Spatial hashes must match too */
+	uint64_t checksum;		/* Of text dictionaries it was compiled from */
+	uint32_t nspatials;
+	uint32_t nspatials_by_dist[MAX_PATTERN_DIST + 1];
+	uint32_t hash_mask;
+	uint32_t ngammas;
+	uint64_t spatials, hashtable, index, gammas;	/* Section offsets */
+	uint64_t size;
+} pattern_db_header_t;
+
+const char *pattern_db_filename = "patterns_mm.bin";
+
+static void  *db_map = NULL;
+static size_t db_size = 0;
+static bool   compiling = false;
+
+static hash_t
+pthashes_fingerprint(void)
+{
+	hash_t h = 0;
+	for (int r = 0; r < PTH__ROTATIONS; r++)
+		for (int i = 0; i < MAX_PATTERN_AREA; i++)
+			for (int s = 0; s < S_MAX; s++)
+				h = (h * 31) ^ pthashes[r][i][s];
+	return h;
+}
+
+/* FNV-1a of text dictionaries. False if they can't be found. */
+static bool
+text_dicts_checksum(uint64_t *checksum)
+{
+	const char *files[] = { spatial_dict_filename, prob_dict_filename };
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (unsigned int i = 0; i < sizeof(files) / sizeof(*files); i++) {
+		FILE *f = fopen_data_file(files[i], "rb");
+		if (!f)  return false;
+		unsigned char buf[65536];
+		size_t n;
+		while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+			for (size_t j = 0; j < n; j++)
+				h = (h ^ buf[j]) * 0x100000001b3ULL;
+		fclose(f);
+	}
+	*checksum = h;
+	return true;
+}
+
+static void *
+map_file(FILE *f, size_t size)
+{
+	if (fseek(f, 0, SEEK_END) || (size_t)ftell(f) < size)
+		return NULL;
+#ifndef _WIN32
+	void *p = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(f), 0);
+	return (p == MAP_FAILED ? NULL : p);
+#else
+	void *p = cmalloc(size);
+	rewind(f);
+	if (fread(p, 1, size, f) != size) {  free(p);  return NULL;  }
+	return p;
+#endif
+}
+
+bool
+pattern_db_load(bool load_prob)
+{
+	assert(!spat_dict && !db_map);
+	if (compiling)  return false;
+
+	FILE *f = fopen_data_file(pattern_db_filename, "rb");
+	if (!f)  return false;
+
+	pattern_db_header_t h;
+	uint64_t checksum;
+	if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != PATTERN_DB_MAGIC ||
+	    h.version != PATTERN_DB_VERSION || h.layout != PATTERN_DB_LAYOUT ||
+	    h.pthashes != pthashes_fingerprint()) {
+		if (DEBUGL(1))  fprintf(stderr, "%s: incompatible pattern database, ignoring.\n", pattern_db_filename);
+		fclose(f);
+		return false;
+	}
+	if (text_dicts_checksum(&checksum) && checksum != h.checksum) {
+		if (DEBUGL(1))  fprintf(stderr, "%s: out of date, ignoring (run 'pachi --compile-patterns').\n", pattern_db_filename);
+		fclose(f);
+		return false;
+	}
+
+	char *p = map_file(f, h.size);
+	fclose(f);
+	if (!p) {
+		if (DEBUGL(1))  fprintf(stderr, "%s: couldn't map pattern database, ignoring.\n", pattern_db_filename);
+		return false;
+	}
+	db_map = p;  db_size = h.size;
+
+	spat_dict = calloc2(1, spatial_dict_t);
+	spat_dict->nspatials = h.nspatials;
+	memcpy(spat_dict->nspatials_by_dist, h.nspatials_by_dist, sizeof(h.nspatials_by_dist));
+	spat_dict->spatials = (spatial_t*)(p + h.spatials);
+	spat_dict->hash_mask = h.hash_mask;
+	spat_dict->hashtable = (spatial_entry_t*)(p + h.hashtable);
+	spat_dict->compiled = true;
+	if (DEBUGL(1))  fprintf(stderr, "Loaded spatial dictionary of %d patterns (compiled).\n", h.nspatials);
+
+	if (load_prob) {
+		prob_dict = calloc2(1, prob_dict_t);
+		prob_dict->index = (unsigned int*)(p + h.index);
+		prob_dict->gammas = (pattern_prob_t*)(p + h.gammas);
+		prob_dict->ngammas = h.ngammas;
+		prob_dict->compiled = true;
+		prob_dict_init_table();
+		if (DEBUGL(1))  fprintf(stderr, "Loaded %d gammas (compiled).\n", h.ngammas);
+	}
+	return true;
+}
+
+static uint64_t
+section(uint64_t *offset, size_t size)
+{
+	uint64_t start = (*offset + PATTERN_DB_ALIGN - 1) & ~(uint64_t)(PATTERN_DB_ALIGN - 1);
+	*offset = start + size;
+	return start;
+}
+
+static void
+write_section(FILE *f, uint64_t offset, void *data, size_t size)
+{
+	static const char zeros[PATTERN_DB_ALIGN] = { 0, };
+	long pos = ftell(f);
+	assert(pos >= 0 && (uint64_t)pos <= offset && offset - pos < PATTERN_DB_ALIGN);
+	if (fwrite(zeros, 1, offset - pos, f) != offset - pos ||
+	    fwrite(data, 1, size, f) != size)
+		die("%s: write failed\n", pattern_db_filename);
+}
+
+void
+pattern_db_compile(const char *filename)
+{
+	compiling = true;
+	pattern_config_t pc;
+	patterns_init(&pc, NULL, false, true);
+	compiling = false;
+
+	pattern_db_header_t h = { 0, };
+	if (!spat_dict || !prob_dict || !text_dicts_checksum(&h.checksum))
+		die("Couldn't load %s / %s, can't compile patterns.\n", spatial_dict_filename, prob_dict_filename);
+
+	h.magic = PATTERN_DB_MAGIC;
+	h.version = PATTERN_DB_VERSION;
+	h.layout = PATTERN_DB_LAYOUT;
+	h.pthashes = pthashes_fingerprint();
+	h.nspatials = spat_dict->nspatials;
+	memcpy(h.nspatials_by_dist, spat_dict->nspatials_by_dist, sizeof(h.nspatials_by_dist));
+	h.hash_mask = spat_dict->hash_mask;
+	h.ngammas = prob_dict->ngammas;
+
+	size_t spatials_size  = spat_dict->nspatials * sizeof(spatial_t);
+	size_t hashtable_size = (spat_dict->hash_mask + 1) * sizeof(spatial_entry_t);
+	size_t index_size     = (spat_dict->nspatials + 2) * sizeof(unsigned int);
+	size_t gammas_size    = prob_dict->ngammas * sizeof(pattern_prob_t);
+	h.size = sizeof(h);
+	h.spatials  = section(&h.size, spatials_size);
+	h.hashtable = section(&h.size, hashtable_size);
+	h.index     = section(&h.size, index_size);
+	h.gammas    = section(&h.size, gammas_size);
+
+	FILE *f = fopen(filename, "wb");
+	if (!f)  die("%s: %s\n", filename, strerror(errno));
+	write_section(f, 0, &h, sizeof(h));
+	write_section(f, h.spatials, spat_dict->spatials, spatials_size);
+	write_section(f, h.hashtable, spat_dict->hashtable, hashtable_size);
+	write_section(f, h.index, prob_dict->index, index_size);
+	write_section(f, h.gammas, prob_dict->gammas, gammas_size);
+	fclose(f);
+
+	fprintf(stderr, "Wrote %s: %d spatials, %d gammas (%.1fMb)\n",
+		filename, h.nspatials, h.ngammas, (double)h.size / (1024 * 1024));
+}
+
+void
+pattern_db_done(void)
+{
+	if (!db_map)  return;
+	assert(!spat_dict && !prob_dict);
+#ifndef _WIN32
+	munmap(db_map, db_size);
+#else
+	free(db_map);
+#endif
+	db_map = NULL;
+	db_size = 0;
+}
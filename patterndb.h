@@ -0,0 +1,28 @@
+#ifndef PACHI_PATTERNDB_H
+#define PACHI_PATTERNDB_H
+
+/* Compiled pattern database: prehashed binary image of the spatial and
+ * gamma dictionaries (patterns_mm.spat / patterns_mm.gamma) which can be
+ * mmap()ed directly instead of parsing the text files at startup.
+ * All rotations are already in the spatial hashtable, gammas sorted by
+ * spatial. Image is mapped read-only so it's shared between all Pachi
+ * processes on the host.
+ *
+ * Generate with 'pachi --compile-patterns'. The image records a checksum
+ * of the text files, it is ignored if they changed since. */
+
+#include "pattern.h"
+
+extern const char *pattern_db_filename;
+
+/* Load spatial dictionary (and gammas if @load_prob) from compiled
+ * database if there's an up-to-date one. Returns false if not. */
+bool pattern_db_load(bool load_prob);
+
+/* Compile text dictionaries into @filename. */
+void pattern_db_compile(const char *filename);
+
+/* Unmap database, dictionaries must be freed already. */
+void pattern_db_done(void);
+
+#endif
@@ -3,6 +3,7 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "board.h"
 #include "debug.h"
@@ -10,50 +11,124 @@
 #include "patternsp.h"
 #include "patternprob.h"
 #include "engine.h"
+#include "tactics/memo.h"
 
 prob_dict_t    *prob_dict = NULL;
 
+const char *prob_dict_filename = "patterns_mm.gamma";
+
 void
 prob_dict_init(char *filename, pattern_config_t *pc)
 {
 	assert(!prob_dict);
-	if (!filename)  filename = "patterns_mm.gamma";
+	if (!filename)  filename = (char*)prob_dict_filename;
 	FILE *f = fopen_data_file(filename, "r");
 	if (!f) {
 		if (DEBUGL(1))  fprintf(stderr, "%s not found, will not use mm patterns.\n", filename);
 		return;
 	}
 
-	prob_dict = calloc2(1, prob_dict_t);
-	prob_dict->table = calloc2(spat_dict->nspatials + 1, pattern_prob_t*);
-
-	int i = 0;
+	/* Read all gammas, then sort them by spatial. */
+	unsigned int n = 0, alloc = 0;
+	pattern_prob_t *probs = NULL;
+	uint32_t *spis = NULL;
 	char sbuf[1024];
 	while (fgets(sbuf, sizeof(sbuf), f)) {
-		pattern_prob_t *pb = calloc2(1, pattern_prob_t);
-		//int c, o;
-
 		char *buf = sbuf;
 		if (buf[0] == '#') continue;
 		while (isspace(*buf)) buf++;
 		float gamma = strtof(buf, &buf);
-		pb->gamma = gamma;
 		while (isspace(*buf)) buf++;
-		str2pattern(buf, &pb->p);
-		assert(pb->p.n == 1);				/* One gamma per feature, please ! */
+		pattern_t p;
+		str2pattern(buf, &p);
+		assert(p.n == 1);				/* One gamma per feature, please ! */
 
-		uint32_t spi = feature2spatial(pc, &pb->p.f[0]);
+		uint32_t spi = feature2spatial(pc, &p.f[0]);
 		assert(spi <= spat_dict->nspatials);		/* Bad patterns.spat / patterns.prob ? */
-		if (feature_has_gamma(pc, &pb->p.f[0]))
-			die("%s: multiple gammas for feature %s\n", filename, pattern2sstr(&pb->p));
-		pb->next = prob_dict->table[spi];
-		prob_dict->table[spi] = pb;
+		if (n == alloc) {
+			alloc = (alloc ? alloc * 2 : 1024);
+			probs = realloc(probs, alloc * sizeof(*probs));
+			spis = realloc(spis, alloc * sizeof(*spis));
+		}
+		probs[n].f = p.f[0];
+		probs[n].gamma = gamma;
+		spis[n++] = spi;
+	}
+	fclose(f);
 
-		i++;
+	prob_dict = calloc2(1, prob_dict_t);
+	prob_dict->index = calloc2(spat_dict->nspatials + 2, unsigned int);
+	prob_dict->gammas = calloc2(n, pattern_prob_t);
+	prob_dict->ngammas = n;
+	unsigned int *index = prob_dict->index;
+	for (unsigned int i = 0; i < n; i++)
+		index[spis[i] + 1]++;
+	for (unsigned int spi = 0; spi <= spat_dict->nspatials; spi++)
+		index[spi + 1] += index[spi];
+
+	unsigned int *pos = calloc2(spat_dict->nspatials + 1, unsigned int);
+	memcpy(pos, index, (spat_dict->nspatials + 1) * sizeof(*pos));
+	for (unsigned int i = 0; i < n; i++) {
+		feature_t *feat = &probs[i].f;
+		for (unsigned int j = index[spis[i]]; j < pos[spis[i]]; j++)
+			if (feature_eq(feat, &prob_dict->gammas[j].f))
+				die("%s: multiple gammas for feature %s\n", filename, feature2sstr(feat));
+		prob_dict->gammas[pos[spis[i]]++] = probs[i];
 	}
 
-	fclose(f);
-	if (DEBUGL(1))  fprintf(stderr, "Loaded %d gammas.\n", i);
+	free(pos);
+	free(probs);
+	free(spis);
+	prob_dict_init_table();
+	if (DEBUGL(1))  fprintf(stderr, "Loaded %d gammas.\n", n);
+}
+
+void
+prob_dict_init_table()
+{
+	prob_dict_t *pd = prob_dict;
+	unsigned int nspatials = spat_dict->nspatials;
+
+	/* Non-spatial features: as many payloads as we have gammas for. */
+	memset(pd->payloads, 0, sizeof(pd->payloads));
+	for (unsigned int i = pd->index[nspatials]; i < pd->index[nspatials + 1]; i++) {
+		feature_t *f = &pd->gammas[i].f;
+		assert(f->id < FEAT_SPATIAL);
+		if (f->payload >= pd->payloads[f->id])
+			pd->payloads[f->id] = f->payload + 1;
+	}
+
+	unsigned int size = 0;
+	for (int id = 0; id < FEAT_SPATIAL; id++) {
+		pd->offset[id] = size;
+		size += pd->payloads[id];
+	}
+	for (int id = FEAT_SPATIAL; id < FEAT_MAX; id++) {
+		pd->offset[id] = size;
+		pd->payloads[id] = nspatials;
+	}
+	size += nspatials;
+
+	pd->table = cmalloc(size * sizeof(float));
+	for (unsigned int i = 0; i < size; i++)
+		pd->table[i] = NAN;
+	for (unsigned int i = 0; i < pd->ngammas; i++) {
+		feature_t *f = &pd->gammas[i].f;
+		if (f->id >= FEAT_SPATIAL &&
+		    spat_dict->spatials[f->payload].dist != f->id - FEAT_SPATIAL3 + 3)
+			die("%s: wrong spatial size for feature %s\n", prob_dict_filename, feature2sstr(f));
+		pd->table[pd->offset[f->id] + f->payload] = pd->gammas[i].gamma;
+	}
+
+	/* Best gamma each feature can contribute, for pattern_match_cached() cutoff. */
+	for (int id = 0; id < FEAT_MAX; id++) {
+		pd->max_gamma[id] = 1;
+		for (unsigned int j = 0; j < pd->payloads[id]; j++) {
+			float gamma = pd->table[pd->offset[id] + j];
+			if (!isnan(gamma) && gamma > pd->max_gamma[id])
+				pd->max_gamma[id] = gamma;
+		}
+	}
 }
 
 void
@@ -61,8 +136,10 @@ prob_dict_done()
 {
 	if (!prob_dict)  return;
 
-	for (unsigned int id = 0; id < spat_dict->nspatials; id++)
-		free(prob_dict->table[id]);
+	if (!prob_dict->compiled) {
+		free(prob_dict->index);
+		free(prob_dict->gammas);
+	}
 	free(prob_dict->table);
 	free(prob_dict);
 	prob_dict = NULL;
@@ -83,17 +160,23 @@ rescale_probs(board_t *b, floating_t *probs, floating_t max)
 	return total;
 }
 
+/* Needs pattern_cache_update() first.
+ * If gamma is below @cutoff it may be approximate (still below @cutoff),
+ * @complete is false then. */
 static floating_t
 pattern_rate_move(pattern_config_t *pc,
 		  board_t *b, move_t *m,
-		  pattern_t *pat, ownermap_t *ownermap, bool locally)
+		  pattern_t *pat, ownermap_t *ownermap, bool locally,
+		  floating_t cutoff, bool *complete, bitboard_t *legal)
 {
 	floating_t prob = NAN;
+	*complete = true;
 
 	if (is_pass(m->coord))	return prob;
-	if (!board_is_valid_play_no_suicide(b, m->color, m->coord)) return prob;
+	if (legal ? !bitboard_test(legal, m->coord) :
+		    !board_is_valid_play_no_suicide(b, m->color, m->coord))  return prob;
 
-	pattern_match(pc, pat, b, m, ownermap, locally);
+	*complete = pattern_match_cached(pc, pat, b, m, ownermap, locally, cutoff);
 	prob = pattern_gamma(pc, pat);
 	
 	//if (DEBUGL(5)) {
@@ -123,34 +206,53 @@ pattern_rate_move_vanilla(pattern_config_t *pc,
 	return prob;
 }
 
+/* Moves whose gamma is below @min_prob times best gamma so far may get
+ * approximate ratings (still below that), complete[] is false for them. */
 static floating_t
 pattern_max_rating(pattern_config_t *pc,
 		   board_t *b, enum stone color,
 		   pattern_t *pats, floating_t *probs,
-		   ownermap_t *ownermap, bool locally)
+		   ownermap_t *ownermap, bool locally,
+		   floating_t min_prob, bool *complete, bitboard_t *legal)
 {
+	pattern_cache_update(pc, b, color);
+
 	floating_t max = -10000000;
 	for (int f = 0; f < b->flen; f++) {
 		move_t m = move(b->f[f], color);
-		probs[f] = pattern_rate_move(pc, b, &m, &pats[f], ownermap, locally);
+		floating_t cutoff = (max > 0 ? min_prob * max : 0);
+		probs[f] = pattern_rate_move(pc, b, &m, &pats[f], ownermap, locally, cutoff, &complete[f], legal);
 		if (!isnan(probs[f])) {  max = MAX(probs[f], max);  }
 	}
 
 	return max;
 }
 
+/* Same as pattern_max_rating() with locally = false:
+ * Only difference is distance features, just drop them.
+ * Incomplete patterns could get above cutoff now, match them again. */
 static floating_t
-pattern_max_rating_fast(pattern_config_t *pc,
-			board_t *b, enum stone color,
-			floating_t *probs,
-			ownermap_t *ownermap, bool locally)
+pattern_max_rating_nonlocal(pattern_config_t *pc, board_t *b, enum stone color,
+			    pattern_t *pats, floating_t *probs,
+			    ownermap_t *ownermap, bool *complete)
 {
 	floating_t max = -10000000;
 	for (int f = 0; f < b->flen; f++) {
-		move_t m = move(b->f[f], color);
-		pattern_t pat;
-		probs[f] = pattern_rate_move(pc, b, &m, &pat, ownermap, locally);
-		if (!isnan(probs[f])) {  max = MAX(probs[f], max);  }
+		if (isnan(probs[f]))  continue;
+		if (!complete[f]) {
+			move_t m = move(b->f[f], color);
+			probs[f] = pattern_rate_move(pc, b, &m, &pats[f], ownermap, false, 0, &complete[f], NULL);
+			max = MAX(probs[f], max);
+			continue;
+		}
+		pattern_t *p = &pats[f];
+		int n = 0;
+		for (int i = 0; i < p->n; i++)
+			if (p->f[i].id != FEAT_DISTANCE && p->f[i].id != FEAT_DISTANCE2)
+				p->f[n++] = p->f[i];
+		p->n = n;
+		probs[f] = pattern_gamma(pc, p);
+		max = MAX(probs[f], max);
 	}
 
 	return max;
@@ -159,47 +261,49 @@ pattern_max_rating_fast(pattern_config_t *pc,
 #define LOW_PATTERN_RATING 6.0
 
 /* Save patterns for each move as well. */
-floating_t
-pattern_rate_moves(pattern_config_t *pc,
-		   board_t *b, enum stone color,
-		   pattern_t *pats, floating_t *probs,
-		   ownermap_t *ownermap)
+static floating_t
+pattern_rate_moves_(pattern_config_t *pc,
+		    board_t *b, enum stone color,
+		    pattern_t *pats, floating_t *probs,
+		    ownermap_t *ownermap, floating_t min_prob, bitboard_t *legal)
 {
 #ifdef PATTERN_FEATURE_STATS
 	pattern_stats_new_position();
 #endif
+	bool complete[b->flen];
+	bool memo = tactics_memo_start(b);	/* Share ladder / selfatari reading between moves */
 
 	/* Try local moves first. */
-	floating_t max = pattern_max_rating(pc, b, color, pats, probs, ownermap, true);
+	floating_t max = pattern_max_rating(pc, b, color, pats, probs, ownermap, true, min_prob, complete, legal);
 
 	/* Nothing big matches ? Try again ignoring distance so we get good tenuki moves. */
 	if (max < LOW_PATTERN_RATING)
-		max = pattern_max_rating(pc, b, color, pats, probs, ownermap, false);
+		max = pattern_max_rating_nonlocal(pc, b, color, pats, probs, ownermap, complete);
+	tactics_memo_stop(memo);
 	
+	/* Normal thing to do here would be to normalize probabilities based on total sum.
+	 * But we use max instead in order to get values like pre-mm pattern code so things
+	 * remain the same from prior code point of view. */
 	return rescale_probs(b, probs, max);
 }
 
+floating_t
+pattern_rate_moves(pattern_config_t *pc,
+		   board_t *b, enum stone color,
+		   pattern_t *pats, floating_t *probs,
+		   ownermap_t *ownermap)
+{
+	return pattern_rate_moves_(pc, b, color, pats, probs, ownermap, 0, NULL);
+}
+
 floating_t
 pattern_rate_moves_fast(pattern_config_t *pc,
 			board_t *b, enum stone color,
 			floating_t *probs,
-			ownermap_t *ownermap)
+			ownermap_t *ownermap, floating_t min_prob, bitboard_t *legal)
 {
-#ifdef PATTERN_FEATURE_STATS
-	pattern_stats_new_position();
-#endif
-
-	/* Try local moves first. */
-	floating_t max = pattern_max_rating_fast(pc, b, color, probs, ownermap, true);
-
-	/* Nothing big matches ? Try again ignoring distance so we get good tenuki moves. */
-	if (max < LOW_PATTERN_RATING)
-		max = pattern_max_rating_fast(pc, b, color, probs, ownermap, false);
-	
-	/* Normal thing to do here would be to normalize probabilities based on total sum.
-	 * But we use max instead in order to get values like pre-mm pattern code so things
-	 * remain the same from prior code point of view. */
-	return rescale_probs(b, probs, max);
+	pattern_t pats[b->flen];
+	return pattern_rate_moves_(pc, b, color, pats, probs, ownermap, min_prob, legal);
 }
 
 /* For testing purposes: no prioritized features, check every feature. */
@@ -229,8 +333,10 @@ pattern_matching_locally(pattern_config_t *pc,
 			 board_t *b, enum stone color,
 			 ownermap_t *ownermap)
 {
+	pattern_t pats[b->flen];
 	floating_t probs[b->flen];
-	floating_t max = pattern_max_rating_fast(pc, b, color, probs, ownermap, true);
+	bool complete[b->flen];
+	floating_t max = pattern_max_rating(pc, b, color, pats, probs, ownermap, true, 0, complete, NULL);
 	return (max >= LOW_PATTERN_RATING);
 }
 
@@ -253,11 +359,8 @@ dump_gammas(strbuf_t *buf, pattern_config_t *pc, pattern_t *p)
 bool
 feature_has_gamma(pattern_config_t *pc, feature_t *f)
 {
-	uint32_t spi = feature2spatial(pc, f);
-	for (pattern_prob_t *pb = prob_dict->table[spi]; pb; pb = pb->next)
-		if (feature_eq(f, &pb->p.f[0]))
-			return true;
-	return false;
+	return (f->payload < prob_dict->payloads[f->id] &&
+		!isnan(prob_dict->table[prob_dict->offset[f->id] + f->payload]));
 }
 
 void
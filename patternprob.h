@@ -5,6 +5,7 @@
 
 #include <math.h>
 
+#include "bitboard.h"
 #include "board.h"
 #include "move.h"
 #include "pattern.h"
@@ -14,23 +15,40 @@
  * of the pattern being played. */
 
 /* The table primary key is the pattern spatial (most distinctive
- * feature); within a single primary key chain, the entries are
- * unsorted (for now). */
+ * feature); gammas are stored grouped by spatial, within a single
+ * spatial the entries are unsorted (for now). */
 
-typedef struct pattern_prob {
-	pattern_t p;
-	floating_t gamma;
-	struct pattern_prob *next;
+typedef struct {
+	feature_t f;
+	float gamma;
 } pattern_prob_t;
 
 typedef struct {
-	pattern_prob_t **table; /* [pc->spat_dict->nspatials + 1] */
+	/* Gammas for spatial id i are gammas[index[i]] .. gammas[index[i+1] - 1].
+	 * Non-spatial features are filed under id nspatials. */
+	unsigned int *index;	/* [spat_dict->nspatials + 2] */
+	pattern_prob_t *gammas;
+	unsigned int ngammas;
+
+	/* Loaded from compiled pattern database: read-only, memory
+	 * belongs to the database. */
+	bool compiled;
+
+	/* Flat lookup table built from the above: gamma of feature (id, payload)
+	 * is table[offset[id] + payload] if payload < payloads[id], NAN if there's
+	 * none. Spatial features all share the same range, indexed by spatial id. */
+	unsigned int offset[FEAT_MAX];
+	unsigned int payloads[FEAT_MAX];
+	float *table;
+	float max_gamma[FEAT_MAX];	/* Highest gamma of each feature, at least 1 */
 } prob_dict_t;
 
 /* The patterns probability dictionary */
 extern prob_dict_t *prob_dict;
 
 
+extern const char *prob_dict_filename;
+
 /* Initialize the prob_dict data structure from a given file (pass NULL
  * to use default filename). */
 void prob_dict_init(char *filename, pattern_config_t *pc);
@@ -38,16 +56,25 @@ void prob_dict_init(char *filename, pattern_config_t *pc);
 /* Free patterns probability dictionary. */
 void prob_dict_done();
 
+/* Build prob_dict lookup table, for dictionary loaders. */
+void prob_dict_init_table();
+
 /* Return probability associated with given pattern. */
 static inline floating_t pattern_gamma(pattern_config_t *pc, pattern_t *p);
 
 /* Evaluate patterns for all available moves. Stores found patterns to pats[b->flen]
  * and NON-normalized probability of each pattern to probs[b->flen].
- * Returns the sum of all probabilities that can be used for normalization. */
+ * Returns the sum of all probabilities that can be used for normalization.
+ * Moves with probability below @min_prob (probs are relative to best move)
+ * may get approximate values below @min_prob: expensive readers are skipped
+ * when they can't bring them above. Use 0 to get exact values everywhere.
+ * @legal: legal moves from board_legal_moves() if caller has them, NULL
+ * to check each move. */
 floating_t pattern_rate_moves_fast(pattern_config_t *pc,
 				   board_t *b, enum stone color,
 				   floating_t *probs,
-				   ownermap_t *ownermap);
+				   ownermap_t *ownermap, floating_t min_prob,
+				   bitboard_t *legal);
 /* Save pattern for each move as well. */
 floating_t pattern_rate_moves(pattern_config_t *pc,
 			      board_t *b, enum stone color,
@@ -89,12 +116,12 @@ static uint32_t feature2spatial(pattern_config_t *pc, feature_t *f);
 static inline floating_t
 feature_gamma(pattern_config_t *pc, feature_t *f)
 {
-	uint32_t spi = feature2spatial(pc, f);
-	for (pattern_prob_t *pb = prob_dict->table[spi]; pb; pb = pb->next)
-		if (feature_eq(f, &pb->p.f[0]))
-			return pb->gamma;
+	if (likely(f->payload < prob_dict->payloads[f->id])) {
+		float gamma = prob_dict->table[prob_dict->offset[f->id] + f->payload];
+		if (likely(!isnan(gamma)))
+			return gamma;
+	}
 	die("no gamma for feature (%s) !\n", feature2sstr(f));
-	//return NAN; // XXX: We assume quiet NAN existence
 }
 
 static inline floating_t
@@ -76,6 +76,10 @@ ptcoords_init(void)
 /* Zobrist hashes used for points in patterns. */
 hash_t pthashes[PTH__ROTATIONS][MAX_PATTERN_AREA][S_MAX];
 
+/* Same, with hashes for all rotations of a point next to each other
+ * so that all rotations can be hashed at once (vectorizes nicely). */
+static hash_t pthashes_rot[MAX_PATTERN_AREA][S_MAX][PTH__ROTATIONS];
+
 static void
 pthashes_init(void)
 {
@@ -127,6 +131,8 @@ pthashes_init(void)
 			pthashes[r][i][S_BLACK] = pthboard[bi][S_BLACK];
 			pthashes[r][i][S_WHITE] = pthboard[bi][S_WHITE];
 			pthashes[r][i][S_OFFBOARD] = pthboard[bi][S_OFFBOARD];
+			for (int c = 0; c < S_MAX; c++)
+				pthashes_rot[i][c][r] = pthashes[r][i][c];
 		}
 	}
 }
@@ -152,6 +158,56 @@ spatial_hash(unsigned int rotation, spatial_t *s)
 	return h;
 }
 
+void
+spatial_hashes(spatial_t *s, hash_t *hashes)
+{
+	hash_t h[PTH__ROTATIONS] = { 0, };
+	for (unsigned int i = 0; i < ptind[s->dist + 1]; i++) {
+		hash_t *ph = pthashes_rot[i][spatial_point_at(*s, i)];
+		for (int r = 0; r < PTH__ROTATIONS; r++)
+			h[r] ^= ph[r];
+	}
+	memcpy(hashes, h, sizeof(h));
+}
+
+hash_t
+spatial_canonical_hash(spatial_t *s)
+{
+	hash_t hashes[PTH__ROTATIONS];
+	spatial_hashes(s, hashes);
+	hash_t h = hashes[0];
+	for (int r = 1; r < PTH__ROTATIONS; r++)
+		if (hashes[r] < h)  h = hashes[r];
+	return h;
+}
+
+void
+spatial_points_from_board(board_t *b, coord_t coord, enum stone color,
+			  unsigned int d, uint8_t points[MAX_PATTERN_AREA])
+{
+	/* We record all spatial patterns black-to-play; simply
+	 * reverse all colors if we are white-to-play. */
+	static const uint8_t bt_black[4] = { S_NONE, S_BLACK, S_WHITE, S_OFFBOARD };
+	static const uint8_t bt_white[4] = { S_NONE, S_WHITE, S_BLACK, S_OFFBOARD };
+	const uint8_t *bt = (color == S_WHITE ? bt_white : bt_black);
+	unsigned int n = ptind[d + 1];
+
+	/* Points up to distance d are within d/2 lines of the center.
+	 * If that's all on the board (border included) no clamping needed. */
+	int stride = board_stride(b), r = d / 2;
+	int cx = coord_x(coord), cy = coord_y(coord);
+	if (cx >= r && cx < stride - r && cy >= r && cy < stride - r) {
+		for (unsigned int j = 0; j < n; j++)
+			points[j] = bt[board_at(b, coord + ptcoords[j].y * stride + ptcoords[j].x)];
+		return;
+	}
+
+	for (unsigned int j = 0; j < n; j++) {
+		ptcoords_at(x, y, cx, cy, j);
+		points[j] = bt[board_atxy(b, x, y)];
+	}
+}
+
 /* compute spatial hash from board, ignoring center stone */
 hash_t
 outer_spatial_hash_from_board_rot_d(board_t *b, coord_t coord, enum stone color,
@@ -161,18 +217,11 @@ outer_spatial_hash_from_board_rot_d(board_t *b, coord_t coord, enum stone color,
 	assert(d+1 < sizeof(ptind) / sizeof(*ptind));
 
 	if (is_pass(coord) || is_resign(coord))  return 0;
-	
-	/* We record all spatial patterns black-to-play; simply
-	 * reverse all colors if we are white-to-play. */
-	static enum stone bt_black[4] = { S_NONE, S_BLACK, S_WHITE, S_OFFBOARD };
-	static enum stone bt_white[4] = { S_NONE, S_WHITE, S_BLACK, S_OFFBOARD };
-	enum stone (*bt)[4] = color == S_WHITE ? &bt_white : &bt_black;
 
-	int cx = coord_x(coord), cy = coord_y(coord);
-	for (unsigned int i = ptind[2]; i < ptind[d + 1]; i++) {
-		ptcoords_at(x, y, cx, cy, i);
-		h ^= pthashes[rot][i][(*bt)[board_atxy(b, x, y)]];
-	}
+	uint8_t points[MAX_PATTERN_AREA];
+	spatial_points_from_board(b, coord, color, d, points);
+	for (unsigned int i = ptind[2]; i < ptind[d + 1]; i++)
+		h ^= pthashes[rot][i][points[i]];
 	return h;
 }
 
@@ -229,18 +278,12 @@ spatial_from_board(pattern_config_t *pc, spatial_t *s,
 {
 	assert(pc->spat_min > 0);
 
-	/* We record all spatial patterns black-to-play; simply
-	 * reverse all colors if we are white-to-play. */
-	static enum stone bt_black[4] = { S_NONE, S_BLACK, S_WHITE, S_OFFBOARD };
-	static enum stone bt_white[4] = { S_NONE, S_WHITE, S_BLACK, S_OFFBOARD };
-	enum stone (*bt)[4] = m->color == S_WHITE ? &bt_white : &bt_black;
+	uint8_t points[MAX_PATTERN_AREA];
+	spatial_points_from_board(b, m->coord, m->color, pc->spat_max, points);
 
 	memset(s, 0, sizeof(*s));
-	int cx = coord_x(m->coord), cy = coord_y(m->coord);
-	for (unsigned int j = 0; j < ptind[pc->spat_max + 1]; j++) {
-		ptcoords_at(x, y, cx, cy, j);
-		s->points[j / 4] |= (*bt)[board_atxy(b, x, y)] << ((j % 4) * 2);
-	}
+	for (unsigned int j = 0; j < ptind[pc->spat_max + 1]; j++)
+		s->points[j / 4] |= points[j] << ((j % 4) * 2);
 	s->dist = pc->spat_max;
 }
 
@@ -256,15 +299,14 @@ spatial_equal(spatial_t *s1, spatial_t *s2)
 	/* We could create complex transposition tables, but it seems most
 	 * foolproof to just check if the sets of rotation hashes are the
 	 * same for both. */
-	hash_t s1r[PTH__ROTATIONS];
-	for (unsigned int r = 0; r < PTH__ROTATIONS; r++)
-		s1r[r] = spatial_hash(r, s1);
+	hash_t s1r[PTH__ROTATIONS], s2r[PTH__ROTATIONS];
+	spatial_hashes(s1, s1r);
+	spatial_hashes(s2, s2r);
 	for (unsigned int r = 0; r < PTH__ROTATIONS; r++) {
-		hash_t s2r = spatial_hash(r, s2);
 		for (unsigned int p = 0; p < PTH__ROTATIONS; p++)
-			if (s2r == s1r[p])
+			if (s2r[r] == s1r[p])
 				goto found_rot;
-		/* Rotation hash s2r does not correspond to s1r. */
+		/* Rotation hash s2r[r] does not correspond to s1r. */
 		return false;
 found_rot:;
 	}
@@ -280,20 +322,6 @@ found_rot:;
 
 spatial_dict_t *spat_dict = NULL;
 
-/* Spatial dict hashtable hash function. @h: spatial hash */
-static unsigned int
-spatial_dict_hash(hash_t h) {  return h & spatial_hash_mask;  }
-
-spatial_t*
-spatial_dict_lookup(spatial_dict_t *dict, int dist, hash_t hash)
-{
-	spatial_entry_t *e = dict->hashtable[spatial_dict_hash(hash)];
-	for (; e ; e = e->next)
-		if (e->hash == hash && spatial(e->id, dict)->dist == dist)
-			return spatial(e->id, dict);
-	return NULL;
-}
-
 #ifndef GENSPATIAL	
 #define SPATIALS_ALLOC 1024		/* Allocate space in 1024 blocks. */
 #else	
@@ -312,33 +340,68 @@ spatial_dict_addc(spatial_dict_t *d, spatial_t *s)
 
 /* Add to hashtable */
 static void
-spatial_dict_addh(spatial_dict_t *dict, hash_t spatial_hash, unsigned int id)
+spatial_dict_addh(spatial_dict_t *dict, hash_t spatial_hash, unsigned int id, unsigned int dist)
 {
-	spatial_entry_t *e = malloc2(spatial_entry_t);
-	e->hash = spatial_hash;
-	e->id = id;
-	e->next = NULL;
-
-	uint32_t h = spatial_dict_hash(spatial_hash);
-	e->next = dict->hashtable[h];
-	dict->hashtable[h] = e;
+	unsigned int i = spatial_hash & dict->hash_mask;
+	for (; dict->hashtable[i].id; i = (i + 1) & dict->hash_mask)
+		if (dict->hashtable[i].hash == spatial_hash && dict->hashtable[i].id == id)
+			return;		/* Symmetric pattern, rotation already there. */
+	dict->hashtable[i].hash = spatial_hash;
+	dict->hashtable[i].id = id;
+	dict->hashtable[i].dist = dist;
+}
+
+static void
+spatial_dict_addall(spatial_dict_t *dict, spatial_t *s, unsigned int id)
+{
+	if (dict->canonical) {
+		spatial_dict_addh(dict, spatial_canonical_hash(s), id, s->dist);
+		return;
+	}
+
+	hash_t hashes[PTH__ROTATIONS];
+	spatial_hashes(s, hashes);
+	for (unsigned int r = 0; r < PTH__ROTATIONS; r++)
+		spatial_dict_addh(dict, hashes[r], id, s->dist);
+}
+
+/* Double hashtable size once it gets half full. */
+static void
+spatial_dict_grow(spatial_dict_t *dict)
+{
+	unsigned int size = 2 * (dict->hash_mask + 1);
+	free(dict->hashtable);
+	dict->hash_mask = size - 1;
+	dict->hashtable = calloc2(size, spatial_entry_t);
+	for (unsigned int id = 1; id < dict->nspatials; id++)
+		spatial_dict_addall(dict, &dict->spatials[id], id);
+}
+
+spatial_t *
+spatial_dict_find(spatial_dict_t *dict, spatial_t *s)
+{
+	hash_t h = (dict->canonical ? spatial_canonical_hash(s) : spatial_hash(0, s));
+	return spatial_dict_lookup(dict, s->dist, h);
 }
 
 unsigned int
 spatial_dict_add(spatial_dict_t *dict, spatial_t *s)
 {
-	spatial_t *s2 = spatial_dict_lookup(dict, s->dist, spatial_hash(0, s));
+	spatial_t *s2 = spatial_dict_find(dict, s);
 	if (s2) {
 		assert(spatial_equal(s, s2));	/* Sanity check */
 		return spatial_id(s2, dict);	/* Already have */
 	}
 
 	/* Add to collection */
+	assert(!dict->compiled);
 	unsigned int id = spatial_dict_addc(dict, s);
+	unsigned int entries = (dict->canonical ? 1 : PTH__ROTATIONS);
+	if (2 * dict->nspatials * entries > dict->hash_mask + 1)
+		spatial_dict_grow(dict);
 
-	/* Add rotations to hashtable */
-	for (unsigned int r = 0; r < PTH__ROTATIONS; r++)
-		spatial_dict_addh(dict, spatial_hash(r, s), id);
+	/* Add rotations (or canonical one) to hashtable */
+	spatial_dict_addall(dict, s, id);
 	return id;
 }
 
@@ -404,55 +467,31 @@ spatial_dict_load(spatial_dict_t *dict, FILE *f)
 static void
 spatial_dict_hashstats(spatial_dict_t *dict)
 {
-	/* m hash size, n number of patterns; is zobrist universal hash?
-	 *
-	 * Not so rigorous analysis, but it should give a good approximation:
-	 * Probability of empty bucket is (1-1/m)^n ~ e^(-n/m)
-	 * Probability of non-empty bucket is 1-e^(-n/m)
-	 * Expected number of non-empty buckets is m*(1-e^(-n/m))
-	 * Number of collisions is n-m*(1-e^(-n/m)). */
-
-	/* The result: Reality matches these expectations pretty well!
-	 *
-	 * Actual:
-	 * 	Loaded spatial dictionary of 1064482 patterns.
-	 * 	(Spatial dictionary hash: 513997 collisions (incl. repetitions), 11.88% (7970033/67108864) fill rate).
-	 *
-	 * Theoretical:
-	 * 	m = 2^26
-	 * 	n <= 8*1064482 (some patterns may have some identical rotations)
-	 * 	n = 513997+7970033 = 8484030 should be the correct number
-	 * 	n-m*(1-e^(-n/m)) = 514381
-	 *
-	 * To verify, make sure to turn patternprob off (e.g. use
-	 * -e patternscan), since it will insert a pattern multiple times,
-	 * multiplying the reported number of collisions. */
-
-	int stats[10] = { 0, };
-	unsigned int max = 0, entries = 0, empty = 0;
-	for (unsigned int i = 0; i <= spatial_hash_mask; i++) {
-		unsigned int n = 0;
-		for (spatial_entry_t *e = dict->hashtable[i]; e; e = e->next)  n++;
-		entries += n;
+	/* Linear probing: expected probes for a hit ~ (1 + 1/(1-a)) / 2,
+	 * for a miss ~ (1 + 1/(1-a)^2) / 2 with load factor a.
+	 * Most lookups are misses (larger spatials not in dictionary). */
+
+	unsigned int buckets = dict->hash_mask + 1;
+	unsigned int entries = 0, probes = 0, max = 0;
+	for (unsigned int i = 0; i < buckets; i++) {
+		spatial_entry_t *e = &dict->hashtable[i];
+		if (!e->id)  continue;
+		unsigned int n = ((i - e->hash) & dict->hash_mask) + 1;
+		entries++;
+		probes += n;
 		max = MAX(max, n);
-		if (!n)      empty++;
-		if (n < 10)  stats[n]++;
 	}
 
-	unsigned int buckets = (sizeof(dict->hashtable) / sizeof(dict->hashtable[0]));
-	unsigned int htmem = sizeof(dict->hashtable);
-	unsigned int mem = htmem + dict->nspatials * sizeof(spatial_t) + entries * sizeof(spatial_entry_t);
-	fprintf(stderr, "Spatial hash: %i entries, empty %.1f%%, avg len %.1f,   %.1fMb (%.1fMb total)\n",
+	unsigned int htmem = buckets * sizeof(spatial_entry_t);
+	unsigned int mem = htmem + dict->nspatials * sizeof(spatial_t);
+	fprintf(stderr, "Spatial hash: %i entries, fill %.1f%%, avg probes %.2f,   %.1fMb (%.1fMb total)\n",
 			entries,
-			(float)empty * 100 / buckets,
-			(float)entries / (buckets - empty),
+			(float)entries * 100 / buckets,
+			(entries ? (float)probes / entries : 0),
 			(float)htmem / (1024*1024), (float)mem / (1024*1024));
 
-	if (DEBUGL(4)) {
-		for (int i = 0; i < 10; i++)
-			fprintf(stderr, "\t%i entries: %i (%i%%)\n", i, stats[i], stats[i] * 100 / (1 << spatial_hash_bits));
-		fprintf(stderr, "\tworst case: %i entries\n", max);
-	}
+	if (DEBUGL(4))
+		fprintf(stderr, "\tworst case: %i probes\n", max);
 }
 
 void
@@ -495,6 +534,41 @@ spatial_dict_index_by_dist(pattern_config_t *pc)
 
 const char *spatial_dict_filename = "patterns_mm.spat";
 
+/* Number of spatials in dictionary file. */
+static unsigned int
+spatial_dict_count(FILE *f)
+{
+	char buf[1024];
+	unsigned int n = 0;
+	while (fgets(buf, sizeof(buf), f))
+		if (buf[0] != '#')  n++;
+	rewind(f);
+	return n;
+}
+
+spatial_dict_t *
+spatial_dict_new(unsigned int hash_bits, bool canonical)
+{
+	spatial_dict_t *dict = calloc2(1, spatial_dict_t);
+	dict->canonical = canonical;
+	dict->hash_mask = (1U << hash_bits) - 1;
+	dict->hashtable = calloc2(1U << hash_bits, spatial_entry_t);
+	/* Dummy record for index 0 so ids start at 1. */
+	spatial_t dummy = { 0, };
+	spatial_dict_addc(dict, &dummy);
+	return dict;
+}
+
+void
+spatial_dict_delete(spatial_dict_t *dict)
+{
+	if (!dict->compiled) {
+		free(dict->spatials);
+		free(dict->hashtable);
+	}
+	free(dict);
+}
+
 void
 spatial_dict_init(pattern_config_t *pc, bool create)
 {
@@ -505,11 +579,15 @@ spatial_dict_init(pattern_config_t *pc, bool create)
 		return;
 	}
 
-	spat_dict = calloc2(1, spatial_dict_t);
-	/* Dummy record for index 0 so ids start at 1. */
-	spatial_t dummy = { 0, };
-	spatial_dict_addc(spat_dict, &dummy);
+	/* Hashtable at most half full with all rotations of all spatials.
+	 * Dictionary we're building only needs canonical ones. */
+	unsigned int bits = spatial_hash_bits;
+	if (!create) {
+		unsigned int n = spatial_dict_count(f) * PTH__ROTATIONS;
+		for (bits = 10; (1U << bits) < 2 * n; bits++) ;
+	}
 
+	spat_dict = spatial_dict_new(bits, create);
 	if (f) {
 		spatial_dict_load(spat_dict, f);
 		spatial_dict_index_by_dist(pc);
@@ -521,16 +599,6 @@ void
 spatial_dict_done()
 {
 	if (!spat_dict)  return;
-	
-	free(spat_dict->spatials);
-	
-	spatial_entry_t *next = NULL;
-	for (unsigned int id = 0; id <= spatial_hash_mask; id++)
-		for (spatial_entry_t *e = spat_dict->hashtable[id]; e ; e = next) {
-			next = e->next;
-			free(e);
-		}
-
-	free(spat_dict);
+	spatial_dict_delete(spat_dict);
 	spat_dict = NULL;
 }
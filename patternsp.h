@@ -81,17 +81,19 @@ typedef struct {
 
 /* Spatial dictionary - collection of stone configurations. */
 
+/* Initial hashtable size when spatials get added on the fly (gen_spat_dict),
+ * grows when half full. When loading a dictionary it's sized after number of
+ * spatials instead. */
 #ifndef GENSPATIAL
-#define spatial_hash_bits 20 // 4Mb array
+#define spatial_hash_bits 20 // 16Mb array
 #else
-#define spatial_hash_bits 26 // ~256Mb, need large dict when scanning spatials
+#define spatial_hash_bits 22 // 64Mb, need large dict when scanning spatials (canonical, see below)
 #endif
-#define spatial_hash_mask ((1 << spatial_hash_bits) - 1)
 
-typedef struct spatial_entry {
+typedef struct {
 	hash_t hash;			/* full hash */
-	unsigned int id;		/* spatial record index */
-	struct spatial_entry *next;	/* next entry with same hash */
+	unsigned int id;		/* spatial record index, 0 if slot is free */
+	unsigned char dist;		/* spatial(id)->dist, saves a cache miss */
 } spatial_entry_t;
 
 typedef struct {
@@ -103,8 +105,20 @@ typedef struct {
 	unsigned int     nspatials_by_dist[MAX_PATTERN_DIST+1];
 
 	/* Hashed access (all isomorphous configurations are also hashed)
-	 * Maps to spatials[] indices. Hash function: zobrist hashing with fixed values. */
-	spatial_entry_t* hashtable[1 << spatial_hash_bits];
+	 * Maps to spatials[] indices. Hash function: zobrist hashing with fixed values.
+	 * Open addressing with linear probing, kept at most half full. */
+	unsigned int hash_mask;
+	spatial_entry_t *hashtable;	/* [hash_mask + 1] */
+
+	/* Only canonical rotation is hashed (spatial_canonical_hash()),
+	 * rotation gets resolved at lookup. 8x smaller hashtable but lookups
+	 * need all rotation hashes: for dictionaries we build (gen_spat_dict),
+	 * not for matching on the board. */
+	bool canonical;
+
+	/* Loaded from compiled pattern database: read-only, memory
+	 * belongs to the database. */
+	bool compiled;
 } spatial_dict_t;
 
 extern spatial_dict_t *spat_dict;
@@ -120,6 +134,15 @@ void spatial_from_board(pattern_config_t *pc, spatial_t *s, board_t *b, move_t *
 
 /* Compute hash of given spatial pattern. */
 hash_t spatial_hash(unsigned int rotation, spatial_t *s);
+/* Same, for all rotations at once: @hashes[PTH__ROTATIONS] */
+void spatial_hashes(spatial_t *s, hash_t *hashes);
+/* Smallest of the rotation hashes, same for all isomorphous spatials. */
+hash_t spatial_canonical_hash(spatial_t *s);
+
+/* Get stones around @coord up to distance @d in ptcoords[] order,
+ * colors reversed if @color is white (spatials are black-to-play). */
+void spatial_points_from_board(board_t *b, coord_t coord, enum stone color,
+			       unsigned int d, uint8_t points[MAX_PATTERN_AREA]);
 
 /* Compute spatial hash from board, ignoring center stone */
 hash_t outer_spatial_hash_from_board(board_t *b, coord_t coord, enum stone color);
@@ -162,8 +185,21 @@ void spatial_dict_init(pattern_config_t *pc, bool create);
 /* Free spatial dictionary. */
 void spatial_dict_done();
 
-/* Lookup spatial pattern (resolves collisions). */
-spatial_t *spatial_dict_lookup(spatial_dict_t *dict, int dist, hash_t spatial_hash);
+/* Create empty dictionary, not tied to spat_dict. Hashtable starts with
+ * 2^@hash_bits entries and grows as needed. @canonical: see spatial_dict_t. */
+spatial_dict_t *spatial_dict_new(unsigned int hash_bits, bool canonical);
+void spatial_dict_delete(spatial_dict_t *dict);
+
+/* Lookup spatial pattern (resolves collisions). @spatial_hash is rotation 0
+ * hash, or canonical hash for canonical dictionaries. */
+static spatial_t *spatial_dict_lookup(spatial_dict_t *dict, int dist, hash_t spatial_hash);
+
+/* Lookup spatial record @s, any dictionary. */
+spatial_t *spatial_dict_find(spatial_dict_t *dict, spatial_t *s);
+
+/* Start fetching hashtable slot for lookup we're going to do soon.
+ * Issue these for all hashes first when doing several lookups. */
+static void spatial_dict_prefetch(spatial_dict_t *dict, hash_t spatial_hash);
 
 /* Store specified spatial pattern in the dictionary if it is not known yet.
  * Returns spatial id. */
@@ -176,4 +212,22 @@ void spatial_dict_writeinfo(spatial_dict_t *dict, FILE *f);
 /* Append specified spatial pattern to the given file. */
 void spatial_write(spatial_dict_t *dict, spatial_t *s, unsigned int id, FILE *f);
 
+
+static inline spatial_t *
+spatial_dict_lookup(spatial_dict_t *dict, int dist, hash_t hash)
+{
+	for (unsigned int i = hash & dict->hash_mask; dict->hashtable[i].id; i = (i + 1) & dict->hash_mask) {
+		spatial_entry_t *e = &dict->hashtable[i];
+		if (e->hash == hash && e->dist == dist)
+			return spatial(e->id, dict);
+	}
+	return NULL;
+}
+
+static inline void
+spatial_dict_prefetch(spatial_dict_t *dict, hash_t hash)
+{
+	__builtin_prefetch(&dict->hashtable[hash & dict->hash_mask]);
+}
+
 #endif
@@ -0,0 +1,254 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "util.h"
+#include "perfstats.h"
+
+/* Each thread doing playouts gets its own counters, chained in a global
+ * list so they can be summed up. Search threads are persistent, so this
+ * doesn't grow over time. Blocks of threads that exit are kept around,
+ * their counts still matter. */
+
+__thread perfstats_t *perfstats_local = NULL;
+
+static perfstats_t *perfstats_list = NULL;
+static pthread_mutex_t perfstats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* What we had at last reset. */
+static perfstats_t perfstats_base;
+
+int perf_fuseki_end = 20;
+int perf_yose_start = 40;
+
+void
+perfstats_set_game_phases(int fuseki_end, int yose_start)
+{
+	perf_fuseki_end = fuseki_end;
+	perf_yose_start = yose_start;
+}
+
+static char *phase_names[PERF_PHASE_MAX] = {
+	[PERF_DESCENT]  = "descent",
+	[PERF_EXPAND]   = "expand",
+	[PERF_PLAYOUT]  = "playout",
+	[PERF_BACKPROP] = "backprop",
+};
+
+static char *heuristic_names[PERF_SOURCE_MAX] = {
+	[PERF_KO]            = "ko",
+	[PERF_LATARI]        = "local_atari",
+	[PERF_LADDER]        = "local_ladder",
+	[PERF_L2LIB_CAPTURE] = "local_2lib_capture",
+	[PERF_L2LIB]         = "local_2lib",
+	[PERF_LNLIB]         = "local_nlib",
+	[PERF_EYEFIX]        = "eye_fix",
+	[PERF_NAKADE]        = "nakade",
+	[PERF_PATTERN]       = "pattern",
+	[PERF_GATARI]        = "global_atari",
+	[PERF_JOSEKI]        = "joseki",
+	[PERF_FILLBOARD]     = "fillboard",
+	[PERF_POLICY]        = "(policy)",
+	[PERF_RANDOM]        = "(random)",
+};
+
+static char *game_phase_names[PERF_GAME_PHASE_MAX] = {
+	[PERF_FUSEKI] = "fuseki",
+	[PERF_MIDDLE] = "middle",
+	[PERF_YOSE]   = "yose",
+};
+
+perfstats_t *
+perfstats_thread_new(void)
+{
+	perfstats_t *s = calloc2(1, perfstats_t);
+	pthread_mutex_lock(&perfstats_mutex);
+	s->next = perfstats_list;
+	perfstats_list = s;
+	pthread_mutex_unlock(&perfstats_mutex);
+	return s;
+}
+
+static void
+perfstats_sum(perfstats_t *total)
+{
+	memset(total, 0, sizeof(*total));
+	pthread_mutex_lock(&perfstats_mutex);
+	for (perfstats_t *s = perfstats_list; s; s = s->next) {
+		for (int p = 0; p < PERF_PHASE_MAX; p++) {
+			total->phase[p].calls += s->phase[p].calls;
+			total->phase[p].cycles += s->phase[p].cycles;
+			for (int i = 0; i < PERF_HIST_BUCKETS; i++)
+				total->phase[p].hist[i] += s->phase[p].hist[i];
+		}
+		for (int h = 0; h < PERF_HEURISTIC_MAX; h++) {
+			total->heuristic[h].calls += s->heuristic[h].calls;
+			total->heuristic[h].hits += s->heuristic[h].hits;
+			total->heuristic[h].cycles += s->heuristic[h].cycles;
+		}
+		for (int gp = 0; gp < PERF_GAME_PHASE_MAX; gp++) {
+			total->game_phase[gp].moves += s->game_phase[gp].moves;
+			total->game_phase[gp].cycles += s->game_phase[gp].cycles;
+			for (int i = 0; i < PERF_SOURCE_MAX; i++)
+				total->game_phase[gp].source[i] += s->game_phase[gp].source[i];
+		}
+		total->playout_len.playouts += s->playout_len.playouts;
+		total->playout_len.moves += s->playout_len.moves;
+		for (int i = 0; i < PERF_LEN_BUCKETS; i++)
+			total->playout_len.hist[i] += s->playout_len.hist[i];
+	}
+	pthread_mutex_unlock(&perfstats_mutex);
+}
+
+void
+perfstats_sub(perfstats_t *s, perfstats_t *base)
+{
+	for (int p = 0; p < PERF_PHASE_MAX; p++) {
+		s->phase[p].calls -= base->phase[p].calls;
+		s->phase[p].cycles -= base->phase[p].cycles;
+		for (int i = 0; i < PERF_HIST_BUCKETS; i++)
+			s->phase[p].hist[i] -= base->phase[p].hist[i];
+	}
+	for (int h = 0; h < PERF_HEURISTIC_MAX; h++) {
+		s->heuristic[h].calls -= base->heuristic[h].calls;
+		s->heuristic[h].hits -= base->heuristic[h].hits;
+		s->heuristic[h].cycles -= base->heuristic[h].cycles;
+	}
+	for (int gp = 0; gp < PERF_GAME_PHASE_MAX; gp++) {
+		s->game_phase[gp].moves -= base->game_phase[gp].moves;
+		s->game_phase[gp].cycles -= base->game_phase[gp].cycles;
+		for (int i = 0; i < PERF_SOURCE_MAX; i++)
+			s->game_phase[gp].source[i] -= base->game_phase[gp].source[i];
+	}
+	s->playout_len.playouts -= base->playout_len.playouts;
+	s->playout_len.moves -= base->playout_len.moves;
+	for (int i = 0; i < PERF_LEN_BUCKETS; i++)
+		s->playout_len.hist[i] -= base->playout_len.hist[i];
+}
+
+void
+perfstats_get(perfstats_t *total)
+{
+	perfstats_sum(total);
+	perfstats_sub(total, &perfstats_base);
+}
+
+/* Counters only ever go up, so just remember where we are. */
+void
+perfstats_reset(void)
+{
+	perfstats_sum(&perfstats_base);
+}
+
+/* Approximate percentile from histogram (bucket lower bound). */
+static uint64_t
+perf_phase_percentile(perf_phase_t *ph, int percent)
+{
+	if (!ph->calls)  return 0;
+	uint64_t want = ph->calls * percent / 100;
+	uint64_t n = 0;
+	for (int i = 0; i < PERF_HIST_BUCKETS; i++) {
+		n += ph->hist[i];
+		if (n > want)  return (uint64_t)1 << i;
+	}
+	return (uint64_t)1 << (PERF_HIST_BUCKETS - 1);
+}
+
+/* Approximate playout length percentile (bucket lower bound). */
+static int
+perf_playout_len_percentile(perf_playout_len_t *l, int percent)
+{
+	if (!l->playouts)  return 0;
+	uint64_t want = l->playouts * percent / 100;
+	uint64_t n = 0;
+	for (int i = 0; i < PERF_LEN_BUCKETS; i++) {
+		n += l->hist[i];
+		if (n > want)  return i * PERF_LEN_BUCKET;
+	}
+	return (PERF_LEN_BUCKETS - 1) * PERF_LEN_BUCKET;
+}
+
+static void
+perfstats_print_playouts(strbuf_t *buf, perfstats_t *s)
+{
+	perf_playout_len_t *l = &s->playout_len;
+	if (!l->playouts)  return;
+
+	sbprintf(buf, "playout length: avg %.1f  p10 %d  p50 %d  p90 %d  (%d moves buckets)\n",
+		 (double)l->moves / l->playouts,
+		 perf_playout_len_percentile(l, 10), perf_playout_len_percentile(l, 50),
+		 perf_playout_len_percentile(l, 90), PERF_LEN_BUCKET);
+
+	/* Moves by game phase, and where they came from (% of phase moves) */
+	sbprintf(buf, "%-18s", "game phase");
+	for (int gp = 0; gp < PERF_GAME_PHASE_MAX; gp++)
+		sbprintf(buf, " %10s", game_phase_names[gp]);
+	sbprintf(buf, "\n%-18s", "moves");
+	for (int gp = 0; gp < PERF_GAME_PHASE_MAX; gp++)
+		sbprintf(buf, " %10llu", (unsigned long long)s->game_phase[gp].moves);
+	sbprintf(buf, "\n%-18s", "cycles/move");
+	for (int gp = 0; gp < PERF_GAME_PHASE_MAX; gp++) {
+		perf_game_phase_t *g = &s->game_phase[gp];
+		sbprintf(buf, " %10llu", (unsigned long long)(g->moves ? g->cycles / g->moves : 0));
+	}
+	sbprintf(buf, "\n");
+	for (int i = 0; i < PERF_SOURCE_MAX; i++) {
+		uint64_t n = 0;
+		for (int gp = 0; gp < PERF_GAME_PHASE_MAX; gp++)
+			n += s->game_phase[gp].source[i];
+		if (!n)  continue;
+		sbprintf(buf, "%-18s", heuristic_names[i]);
+		for (int gp = 0; gp < PERF_GAME_PHASE_MAX; gp++) {
+			perf_game_phase_t *g = &s->game_phase[gp];
+			sbprintf(buf, " %9.1f%%", (g->moves ? g->source[i] * 100.0 / g->moves : 0.0));
+		}
+		sbprintf(buf, "\n");
+	}
+}
+
+void
+perfstats_print(strbuf_t *buf, perfstats_t *s)
+{
+	uint64_t total = 0;
+	for (int p = 0; p < PERF_PHASE_MAX; p++)
+		total += s->phase[p].cycles;
+
+	sbprintf(buf, "%-10s %12s %10s %5s %10s %10s %10s %10s\n",
+		 "phase", "calls", "Mcycles", "%", "avg", "p50", "p90", "p99");
+	for (int p = 0; p < PERF_PHASE_MAX; p++) {
+		perf_phase_t *ph = &s->phase[p];
+		sbprintf(buf, "%-10s %12llu %10llu %5.1f %10llu %10llu %10llu %10llu\n",
+			 phase_names[p], (unsigned long long)ph->calls,
+			 (unsigned long long)(ph->cycles / 1000000),
+			 (total ? ph->cycles * 100.0 / total : 0.0),
+			 (unsigned long long)(ph->calls ? ph->cycles / ph->calls : 0),
+			 (unsigned long long)perf_phase_percentile(ph, 50),
+			 (unsigned long long)perf_phase_percentile(ph, 90),
+			 (unsigned long long)perf_phase_percentile(ph, 99));
+	}
+
+	sbprintf(buf, "%-18s %12s %12s %5s %10s %10s\n",
+		 "heuristic", "calls", "hits", "hit%", "avg", "Mcycles");
+	for (int h = 0; h < PERF_HEURISTIC_MAX; h++) {
+		perf_heuristic_t *hs = &s->heuristic[h];
+		if (!hs->calls)  continue;
+		sbprintf(buf, "%-18s %12llu %12llu %5.1f %10llu %10llu\n",
+			 heuristic_names[h], (unsigned long long)hs->calls,
+			 (unsigned long long)hs->hits, hs->hits * 100.0 / hs->calls,
+			 (unsigned long long)(hs->cycles / hs->calls),
+			 (unsigned long long)(hs->cycles / 1000000));
+	}
+
+	perfstats_print_playouts(buf, s);
+}
+
+void
+perfstats_fprint(FILE *f, perfstats_t *s)
+{
+	strbuf(buf, 8192);
+	perfstats_print(buf, s);
+	fputs(buf->str, f);
+}
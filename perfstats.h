@@ -0,0 +1,216 @@
+#ifndef PACHI_PERFSTATS_H
+#define PACHI_PERFSTATS_H
+
+/* Hot path profiler: per-thread cycle counters for the main phases of
+ * a uct playout and for individual moggy heuristics, plus playout
+ * telemetry: length histogram and for each game phase time per move and
+ * which heuristic came up with the moves played.
+ * Build with PERFSTATS=1 to enable, compiles to nothing otherwise.
+ * See 'pachi-perfstats' gtp command and uct_search() summary. */
+
+enum perf_phase {
+	PERF_DESCENT,		/* Tree descent (excluding node expansion) */
+	PERF_EXPAND,		/* tree_expand_node() */
+	PERF_PLAYOUT,		/* playout_play_game() */
+	PERF_BACKPROP,		/* Recording playout result in the tree */
+	PERF_PHASE_MAX,
+};
+
+enum perf_heuristic {
+	PERF_KO,
+	PERF_LATARI,
+	PERF_LADDER,
+	PERF_L2LIB_CAPTURE,
+	PERF_L2LIB,
+	PERF_LNLIB,
+	PERF_EYEFIX,
+	PERF_NAKADE,
+	PERF_PATTERN,
+	PERF_GATARI,
+	PERF_JOSEKI,
+	PERF_FILLBOARD,
+	PERF_HEURISTIC_MAX,
+};
+
+/* Where playout moves come from, besides the heuristics above. */
+#define PERF_POLICY	PERF_HEURISTIC_MAX		/* Policy move, heuristic not tracked */
+#define PERF_RANDOM	(PERF_HEURISTIC_MAX + 1)	/* No policy move, played random one */
+#define PERF_SOURCE_MAX	(PERF_HEURISTIC_MAX + 2)
+
+/* Game phase of playout moves, same split as time allocation
+ * (fuseki_end / yose_start uct options). */
+enum perf_game_phase {
+	PERF_FUSEKI,
+	PERF_MIDDLE,
+	PERF_YOSE,
+	PERF_GAME_PHASE_MAX,
+};
+
+#ifdef PERFSTATS
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "util.h"
+
+/* Histogram of cycles per call, bucket i counts calls taking [2^i, 2^(i+1)) */
+#define PERF_HIST_BUCKETS 40
+
+typedef struct {
+	uint64_t calls;
+	uint64_t cycles;
+	uint64_t hist[PERF_HIST_BUCKETS];
+} perf_phase_t;
+
+typedef struct {
+	uint64_t calls;
+	uint64_t hits;		/* Heuristic came up with a move */
+	uint64_t cycles;
+} perf_heuristic_t;
+
+typedef struct {
+	uint64_t moves;
+	uint64_t cycles;	/* In playout_play_move() */
+	uint64_t source[PERF_SOURCE_MAX];
+} perf_game_phase_t;
+
+/* Playout length histogram, bucket i counts playouts of
+ * [i * PERF_LEN_BUCKET, (i+1) * PERF_LEN_BUCKET) moves. */
+#define PERF_LEN_BUCKET 16
+#define PERF_LEN_BUCKETS 32
+
+typedef struct {
+	uint64_t playouts;
+	uint64_t moves;
+	uint64_t hist[PERF_LEN_BUCKETS];
+} perf_playout_len_t;
+
+typedef struct perfstats {
+	perf_phase_t       phase[PERF_PHASE_MAX];
+	perf_heuristic_t   heuristic[PERF_HEURISTIC_MAX];
+	perf_game_phase_t  game_phase[PERF_GAME_PHASE_MAX];
+	perf_playout_len_t playout_len;
+	int                source;	/* Source of move being chosen */
+	struct perfstats  *next;
+} perfstats_t;
+
+/* Game phase boundaries, in percent of board size (moves). */
+extern int perf_fuseki_end, perf_yose_start;
+void perfstats_set_game_phases(int fuseki_end, int yose_start);
+
+/* Current thread's counters, allocated on first use.
+ * Only the owning thread writes to them, no locking needed. */
+extern __thread perfstats_t *perfstats_local;
+perfstats_t *perfstats_thread_new(void);
+
+static inline perfstats_t *
+perfstats_thread(void)
+{
+	if (unlikely(!perfstats_local))
+		perfstats_local = perfstats_thread_new();
+	return perfstats_local;
+}
+
+static inline uint64_t
+perf_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static inline void
+perf_phase_add(enum perf_phase p, uint64_t cycles)
+{
+	perf_phase_t *ph = &perfstats_thread()->phase[p];
+	ph->calls++;
+	ph->cycles += cycles;
+	int bucket = (cycles ? 63 - __builtin_clzll(cycles) : 0);
+	if (bucket >= PERF_HIST_BUCKETS)  bucket = PERF_HIST_BUCKETS - 1;
+	ph->hist[bucket]++;
+}
+
+static inline void
+perf_heuristic_add(enum perf_heuristic h, uint64_t cycles, bool hit)
+{
+	perf_heuristic_t *hs = &perfstats_thread()->heuristic[h];
+	hs->calls++;
+	hs->hits += hit;
+	hs->cycles += cycles;
+	if (hit)  perfstats_local->source = h;
+}
+
+static inline uint64_t
+perf_move_begin(void)
+{
+	perfstats_thread()->source = PERF_POLICY;
+	return perf_ticks();
+}
+
+static inline void
+perf_move_add(int moves, int size2, uint64_t cycles)
+{
+	perfstats_t *s = perfstats_thread();
+	enum perf_game_phase gp = (moves * 100 < perf_fuseki_end * size2 ? PERF_FUSEKI :
+				   moves * 100 < perf_yose_start * size2 ? PERF_MIDDLE : PERF_YOSE);
+	perf_game_phase_t *g = &s->game_phase[gp];
+	g->moves++;
+	g->cycles += cycles;
+	g->source[s->source]++;
+}
+
+static inline void
+perf_playout_len_add(int moves)
+{
+	perf_playout_len_t *l = &perfstats_thread()->playout_len;
+	l->playouts++;
+	l->moves += moves;
+	int bucket = moves / PERF_LEN_BUCKET;
+	if (bucket >= PERF_LEN_BUCKETS)  bucket = PERF_LEN_BUCKETS - 1;
+	l->hist[bucket]++;
+}
+
+/* Sum of all threads' counters since last reset. Can be called while
+ * search is running, numbers will just be slightly off. */
+void perfstats_get(perfstats_t *total);
+/* @s -= @base */
+void perfstats_sub(perfstats_t *s, perfstats_t *base);
+/* Start counting from zero again. */
+void perfstats_reset(void);
+void perfstats_print(strbuf_t *buf, perfstats_t *s);
+void perfstats_fprint(FILE *f, perfstats_t *s);
+
+#define perf_start(t)			uint64_t perf_t0_##t = perf_ticks()
+#define perf_phase(p, t)		perf_phase_add((p), perf_ticks() - perf_t0_##t)
+#define perf_heuristic(h, t, hit)	perf_heuristic_add((h), perf_ticks() - perf_t0_##t, (hit))
+
+/* Playout move. Source is PERF_POLICY unless a heuristic hits or
+ * perf_random_move() is called before perf_move(). */
+#define perf_move_start(t)		uint64_t perf_t0_##t = perf_move_begin()
+#define perf_random_move()		(perfstats_thread()->source = PERF_RANDOM)
+#define perf_move(b, t)			perf_move_add((b)->moves - 1, board_rsize2(b), perf_ticks() - perf_t0_##t)
+#define perf_playout_start(b)		int perf_moves0 = (b)->moves
+#define perf_playout_end(b)		perf_playout_len_add((b)->moves - perf_moves0)
+
+#else
+
+#define perf_start(t)			((void)0)
+#define perf_phase(p, t)		((void)0)
+#define perf_heuristic(h, t, hit)	((void)0)
+#define perf_move_start(t)		((void)0)
+#define perf_random_move()		((void)0)
+#define perf_move(b, t)			((void)0)
+#define perf_playout_start(b)		((void)0)
+#define perf_playout_end(b)		((void)0)
+
+#endif /* PERFSTATS */
+
+#endif /* PACHI_PERFSTATS_H */
@@ -10,7 +10,13 @@
 #include "engine.h"
 #include "move.h"
 #include "ownermap.h"
+#include "perfstats.h"
 #include "playout.h"
+#include "random.h"
+#include "tactics/benson.h"
+#include "tactics/memo.h"
+#include "tactics/selfatari.h"
+#include "tactics/seki.h"
 
 /* Whether to set global debug level to the same as the playout
  * has, in case it is different. This can make sure e.g. tactical
@@ -20,6 +26,17 @@
 
 #define PLDEBUGL(n) DEBUGL_(policy->debug_level, n)
 
+/* Settled area of current playout (see playout_cutoff()),
+ * moves there are not permitted. */
+static __thread enum stone *playout_settled = NULL;
+
+/* Ownermap settled points (playout_setup_t settled), main phase only:
+ * most randomly picked moves there get rejected. */
+static __thread bitboard_t *playout_owned = NULL;
+
+/* Chance in 8 that a random move in ownermap settled area is rejected. */
+#define PLAYOUT_OWNED_REJECT 6
+
 
 /* Full permit logic, ie m->coord may get changed to an alternative move */
 static bool
@@ -27,6 +44,11 @@ playout_permit_move(playout_policy_t *p, board_t *b, move_t *m, bool alt, bool r
 {
 	coord_t coord = m->coord;
 	if (coord == pass) return false;
+	if (playout_settled && playout_settled[coord] != S_NONE)
+		return false;
+	if (rnd && playout_owned && bitboard_test(playout_owned, coord) &&
+	    fast_random(8) < PLAYOUT_OWNED_REJECT && ownermap_settled_quiet(b, coord))
+		return false;
 
 	if (!board_permit(b, m, NULL) ||
 	    (p->permit && !p->permit(p, b, m, alt, rnd)))
@@ -68,8 +90,13 @@ playout_play_move(playout_setup_t *setup,
 		  playout_policy_t *policy)
 {
 	coord_t coord = pass;
+	perf_move_start(move);
+
+	/* Cache tactical queries until move is played
+	 * (b->moves changes then, cache becomes invalid). */
+	tactics_memo_start(b);
 	
-	if (is_pass(coord)) {
+	if (policy->choose) {
 		coord = policy->choose(policy, setup, b, color);
 		coord = playout_check_move(policy, b, coord, color);
 		// fprintf(stderr, "policy: %s\n", coord2sstr(coord));
@@ -77,11 +104,16 @@ playout_play_move(playout_setup_t *setup,
 
 	if (is_pass(coord)) {
 	play_random:
+		perf_random_move();
 		/* Defer to uniformly random move choice. */
 		/* This must never happen if the policy is tracking
 		 * internal board state, obviously. */
 		assert(!policy->setboard || policy->setboard_randomok);
-		board_play_random(b, color, &coord, random_permit_handler, policy);
+		/* No permit hook (light playouts): plain board_permit() will do,
+		 * saves a couple indirections per candidate move. */
+		if (policy->permit || playout_settled || playout_owned)
+			board_play_random(b, color, &coord, random_permit_handler, policy);
+		else	board_play_random(b, color, &coord, NULL, NULL);
 
 	} else {
 		move_t m = move(coord, color);
@@ -94,6 +126,7 @@ playout_play_move(playout_setup_t *setup,
 		}
 	}
 
+	perf_move(b, move);
 	return coord;
 }
 
@@ -168,6 +201,97 @@ fill_bent_four(board_t *b, enum stone color, coord_t *other, coord_t *kill)
 	return pass;
 }
 
+typedef struct {
+	int	    next;	/* Next check at this move */
+	bool	    decided;
+	bool	    settled;	/* Some area settled already */
+	enum stone  owners[BOARD_MAX_COORDS];	/* Settled points: owner, S_OFFBOARD if seki dame, S_NONE otherwise */
+} playout_cutoff_t;
+
+/* Static evaluation for early playout termination: find pass-alive groups
+ * and their territory (Benson) for the side ahead. If that's enough to win
+ * even if the opponent gets everything else, playing on won't change the
+ * result. Otherwise returns how many points are missing, and remembers
+ * that area as settled: it stays pass-alive as long as no one plays
+ * inside, so we stop playing there (all moves inside are wasted, either
+ * filling own territory or getting captured).
+ * Local sekis get settled as well: playing there only breaks them, and
+ * their dame can't be counted for the opponent. */
+static int
+playout_result_decided(board_t *b, playout_cutoff_t *co)
+{
+	enum stone color = (board_fast_score(b) < 0 ? S_BLACK : S_WHITE);
+	enum stone other = stone_other(color);
+	bool safe[BOARD_MAX_COORDS], seki[BOARD_MAX_COORDS];
+	memset(safe, 0, sizeof(safe));
+	memset(seki, 0, sizeof(seki));
+	int scores[S_MAX];
+	scores[color] = benson_safe_area(b, color, safe);
+	scores[other] = board_rsize2(b) - scores[color];
+
+	if (!co->settled)  memset(co->owners, 0, sizeof(co->owners));
+	foreach_point(b) {
+		if (!safe[c])  continue;
+		co->owners[c] = color;
+		co->settled = true;
+	} foreach_point_end;
+
+	if (seki_find(b, seki))
+		foreach_point(b) {
+			if (!seki[c] || safe[c])  continue;
+			enum stone s = board_at(b, c);
+			co->owners[c] = (s == S_NONE ? S_OFFBOARD : s);
+			co->settled = true;
+			if (s == color)  {  scores[color]++;  scores[other]--;  }
+			if (s == S_NONE)  scores[other]--;
+		} foreach_point_end;
+	if (co->settled)  playout_settled = co->owners;
+
+	floating_t score = board_score(b, scores);
+	if (color == S_BLACK ? score >= 0 : score <= 0)
+		return fabs(score) / 2 + 1;  /* Each safe point gained counts twice */
+	return 0;
+}
+
+/* Final owners: settled area, then as board_fast_score() would. */
+static floating_t
+playout_settled_score(board_t *b, playout_cutoff_t *co)
+{
+	int scores[S_MAX] = { 0, };
+	foreach_point(b) {
+		if (board_at(b, c) == S_OFFBOARD)  continue;
+		enum stone owner = co->owners[c];
+		if (owner == S_NONE) {
+			enum stone s = board_at(b, c);
+			owner = (s == S_NONE ? board_eye_color(b, c) : s);
+		}
+		else if (owner == S_OFFBOARD)
+			owner = S_NONE;		/* Seki dame */
+		co->owners[c] = owner;
+		scores[owner]++;
+	} foreach_point_end;
+	return board_score(b, scores);
+}
+
+/* Benson only finds anything once the board is mostly filled, and is
+ * too expensive to run every move: start late, then wait according to
+ * how far we were from a decided result (a move rarely secures more
+ * than a couple of points). */
+static bool
+playout_cutoff(playout_setup_t *setup, board_t *b, playout_cutoff_t *co)
+{
+	if (b->moves < co->next || b->flen * 4 >= board_rsize2(b))
+		return false;
+	if (b->rules == RULES_JAPANESE || b->rules == RULES_STONES_ONLY)
+		return false;	/* Score depends on more than area */
+
+	int missing = playout_result_decided(b, co);
+	if (!missing)
+		return (co->decided = true);
+	co->next = b->moves + (missing / 2 > setup->cutoff ? missing / 2 : setup->cutoff);
+	return false;
+}
+
 #define random_game_loop_stuff  \
 		if (PLDEBUGL(7)) { \
 			fprintf(stderr, "%s %s\n", stone2str(color), coord2sstr(coord)); \
@@ -177,14 +301,14 @@ fill_bent_four(board_t *b, enum stone color, coord_t *other, coord_t *kill)
 		if (unlikely(is_pass(coord)))  passes++; \
 		else                           passes = 0; \
 \
-		if (amafmap) { \
-			assert(amafmap->gamelen < MAX_GAMELEN); \
-			amafmap->is_ko_capture[amafmap->gamelen] = board_playing_ko_threat(b); \
-			amafmap->game[amafmap->gamelen++] = coord; \
-		} \
+		if (amafmap) \
+			amafmap_record(amafmap, coord, board_playing_ko_threat(b)); \
 \
 		if (setup->mercymin && abs(b->captures[S_BLACK] - b->captures[S_WHITE]) > setup->mercymin) \
 			break; \
+\
+		if (setup->cutoff && playout_cutoff(setup, b, &cutoff)) \
+			break; \
 \
 		color = stone_other(color);
 
@@ -214,12 +338,18 @@ playout_play_game(playout_setup_t *setup,
 
 	enum stone color = starting_color;
 	int passes = is_pass(last_move(b).coord) && b->moves > 0;
+	playout_cutoff_t cutoff;  /* owners[] left uninitialized until something is settled */
+	cutoff.next = 0;  cutoff.decided = cutoff.settled = false;
+	perf_playout_start(b);
 
 	/* Play until both sides pass, or we hit threshold. */
+	playout_owned = setup->settled;
 	while (gamelen-- > 0 && passes < 2) {
 		coord_t coord = playout_play_move(setup, b, color, policy);		
 		random_game_loop_stuff
 	}	
+	/* Settled areas may be left unfilled, next phase takes care of it. */
+	playout_owned = NULL;
 
 	int bent4_moves = -2;
 	coord_t bent4_other = pass;
@@ -229,7 +359,7 @@ playout_play_game(playout_setup_t *setup,
 	 * FIXME bent-four code really belongs in moggy but needs to be handled here.
 	 *       Add some hooks and move this to moggy.c ... */
 	passes = 0;
-	while (gamelen-- > 0 && passes < 2) {
+	while (!cutoff.decided && gamelen-- > 0 && passes < 2) {
 		coord_t coord;
 		
 		/* Kill bent-four group after filling. */
@@ -261,7 +391,11 @@ playout_play_game(playout_setup_t *setup,
 		last_move(b).color = stone_other(starting_color);
 	}
 	
-	floating_t score = board_fast_score(b);
+	tactics_memo_stop(true);
+	perf_playout_end(b);
+
+	playout_settled = NULL;
+	floating_t score = (cutoff.settled ? playout_settled_score(b, &cutoff) : board_fast_score(b));
 	int result = (starting_color == S_WHITE ? score * 2 : - (score * 2));
 
 	if (DEBUGL(6)) {
@@ -269,7 +403,10 @@ playout_play_game(playout_setup_t *setup,
 		if (DEBUGL(7))  board_print(b, stderr);
 	}
 
-	if (ownermap)  ownermap_fill(ownermap, b);
+	if (ownermap) {
+		if (cutoff.settled)  ownermap_fill_owners(ownermap, b, cutoff.owners);
+		else                 ownermap_fill(ownermap, b);
+	}
 
 #ifdef DEBUGL_BY_PLAYOUT
 	debug_level = debug_level_orig;
@@ -3,6 +3,10 @@
 
 #define MAX_GAMELEN 600
 
+#include <assert.h>
+#include <limits.h>
+#include <string.h>
+
 #include "board.h"
 #include "ownermap.h"
 
@@ -44,7 +48,8 @@ typedef void (*playoutp_done)(playout_policy_t *playout_policy);
 struct playout_policy {
 	int debug_level;
 	/* We call setboard when we start new playout.
-	 * We call choose when we ask policy about next move.
+	 * We call choose when we ask policy about next move (optional,
+	 * random moves only if not set).
 	 * We call assess when we ask policy about how good given move is.
 	 * We call permit when we ask policy if we can make a randomly chosen move. */
 	playoutp_setboard setboard;
@@ -70,9 +75,18 @@ struct playout_setup {
 	/* Minimal difference between captures to terminate the playout.
 	 * 0 means don't check. */
 	int mercymin;
+	/* Check every @cutoff moves if the result is decided already
+	 * (Benson-safe areas) and score right away. 0 means don't check. */
+	int cutoff;
+	/* Ownermap from previous playouts if we have a meaningful one,
+	 * for policies which need ownership info. May be NULL. */
+	ownermap_t *ownermap;
+	/* Points settled according to ownermap (see settled_prune uct option),
+	 * randomly picked moves there are mostly rejected. May be NULL. */
+	bitboard_t *settled;
 };
 
-#define playout_setup(gamelen, mercymin)  { gamelen, mercymin }
+#define playout_setup(gamelen, mercymin)  { gamelen, mercymin, 0, NULL, NULL }
 
 typedef struct {
 	/* We keep record of the game so that we can
@@ -86,8 +100,60 @@ typedef struct {
 	/* Our current position in the game sequence; in AMAF, we search
 	 * the range [game_baselen, gamelen[ */
 	int game_baselen;
+	/* Index of first move at each coord (+1 for pass) since game_baselen,
+	 * kept up-to-date as moves get recorded so AMAF update doesn't have
+	 * to scan the game. Only valid if coord's bit is set in first_set. */
+	uint64_t first_set[(BOARD_MAX_COORDS + 1 + 63) / 64];
+	uint16_t first_move[BOARD_MAX_COORDS + 1];
 } playout_amafmap_t;
 
+static inline void
+amafmap_init(playout_amafmap_t *map)
+{
+	map->gamelen = map->game_baselen = 0;
+	memset(map->first_set, 0, sizeof(map->first_set));
+}
+
+/* Moves recorded from now on are part of the AMAF range. */
+static inline void
+amafmap_start(playout_amafmap_t *map)
+{
+	map->game_baselen = map->gamelen;
+	memset(map->first_set, 0, sizeof(map->first_set));
+}
+
+static inline bool
+amafmap_played(playout_amafmap_t *map, coord_t c)
+{
+	int i = c + 1;
+	return map->first_set[i / 64] & (1ULL << (i % 64));
+}
+
+/* Index of first move at @c since game_baselen, INT_MAX if not played. */
+static inline int
+amafmap_first_move(playout_amafmap_t *map, coord_t c)
+{
+	return (amafmap_played(map, c) ? map->first_move[c + 1] : INT_MAX);
+}
+
+static inline void
+amafmap_set_first_move(playout_amafmap_t *map, coord_t c, int move)
+{
+	int i = c + 1;
+	map->first_set[i / 64] |= (1ULL << (i % 64));
+	map->first_move[i] = move;
+}
+
+static inline void
+amafmap_record(playout_amafmap_t *map, coord_t c, bool is_ko_capture)
+{
+	assert(map->gamelen < MAX_GAMELEN);
+	if (!amafmap_played(map, c))
+		amafmap_set_first_move(map, c, map->gamelen);
+	map->is_ko_capture[map->gamelen] = is_ko_capture;
+	map->game[map->gamelen++] = c;
+}
+
 
 /* >0: starting_color wins,
  * <0: starting_color loses; returned number is DOUBLE the score difference.
@@ -10,8 +10,10 @@
 #include "board.h"
 #include "debug.h"
 #include "joseki.h"
+#include "mgq.h"
 #include "mq.h"
 #include "pattern3.h"
+#include "perfstats.h"
 #include "playout.h"
 #include "playout/moggy.h"
 #include "random.h"
@@ -22,20 +24,23 @@
 #include "tactics/nakade.h"
 #include "tactics/selfatari.h"
 #include "tactics/seki.h"
+#include "tactics/semeai.h"
 #include "uct/prior.h"
 
 #define PLDEBUGL(n) DEBUGL_(p->debug_level, n)
 
-/* Use joseki moves in moggy ? */
-//#define MOGGY_JOSEKI 1
-
 /* In case "seqchoose" move picker is enabled (i.e. no "fullchoose"
  * parameter passed), we stochastically apply fixed set of decision
  * rules in given order.
  *
  * In "fullchoose" mode, we instead build a move queue of variously
  * tagged candidates, then consider a probability distribution over
- * them and pick a move from that. */
+ * them and pick a move from that.
+ *
+ * "pipeline" mode is seqchoose with the rule list compiled at init:
+ * rules that can never fire are dropped, rules that always fire don't
+ * roll dice, and local rules look at a summary of groups around last
+ * move first so that they only run when they may find something. */
 
 /* Move queue tags. Some may be even undesirable - these moves then
  * receive a penalty; penalty tags should be used only when it is
@@ -58,6 +63,28 @@ enum mq_tag {
 
 /* Note that the context can be shared by multiple threads! */
 
+/* What local rules need to know about groups around last move,
+ * gathered once per move. Bit n set if some group has n libs (capped). */
+typedef struct {
+	int lastlibs;		/* Last move's group libs */
+	int libs4;		/* Any color group, last move and 4-neighbors */
+	int ownlibs8;		/* Groups of player to move, 8-neighbors */
+} moggy_local_t;
+
+#define MOGGY_LIBS_CAP 7
+#define moggy_libs_bit(libs)  (1 << ((libs) < MOGGY_LIBS_CAP ? (libs) : MOGGY_LIBS_CAP))
+
+typedef coord_t (*moggy_rule_t)(playout_policy_t *p, board_t *b, enum stone to_play, moggy_local_t *l);
+
+typedef struct {
+	moggy_rule_t rule;
+	unsigned int rate;	/* Always applies if >= 100 */
+	bool local;		/* Needs last move */
+	int perf;		/* perfstats heuristic id */
+} moggy_pipeline_rule_t;
+
+#define MOGGY_PIPELINE_MAX 16
+
 typedef struct {
 	unsigned int lcapturerate, atarirate, nlibrate, ladderrate, capturerate, patternrate, korate, josekirate, nakaderate, eyefixrate;
 	unsigned int selfatarirate, eyefillrate, alwaysccaprate;
@@ -88,6 +115,8 @@ typedef struct {
 
 	/* nlib settings: */
 	int nlib_count;
+	/* Read out capturing races of nlib groups, node budget (0: off). */
+	int semeai_budget;
 
 	pattern3s_t patterns;
 
@@ -97,6 +126,10 @@ typedef struct {
 	/* XXX: Tune. */
 	bool fullchoose;
 	double mq_prob[MQ_MAX], tenuki_prob;
+
+	/* "pipeline" mode rules, in order. */
+	moggy_pipeline_rule_t pipeline[MOGGY_PIPELINE_MAX];
+	int pipeline_n;
 } moggy_policy_t;
 
 /* Per simulation state (moggy_policy is shared by all threads) */
@@ -208,58 +241,58 @@ test_pattern3_here(playout_policy_t *p, board_t *b, move_t *m, bool middle_ladde
 }
 
 static void
-apply_pattern_here(playout_policy_t *p, board_t *b, coord_t c, enum stone color, move_queue_t *q, fixp_t *gammas)
+apply_pattern_here(playout_policy_t *p, board_t *b, coord_t c, enum stone color, move_gamma_queue_t *q)
 {
 	moggy_policy_t *pp = (moggy_policy_t*)p->data;
 	move_t m2 = move(c, color);
 	fixp_t gamma;
 	if (board_is_valid_move(b, &m2) && test_pattern3_here(p, b, &m2, pp->middle_ladder, &gamma)) {
-		mq_gamma_add(q, gammas, c, gamma, 1<<MQ_PAT3);
+		mgq_add(q, c, gamma);
 	}
 }
 
 /* Check if we match any pattern around given move (with the other color to play). */
 static void
-apply_pattern(playout_policy_t *p, board_t *b, move_t *m, move_t *mm, move_queue_t *q, fixp_t *gammas)
+apply_pattern(playout_policy_t *p, board_t *b, move_t *m, move_t *mm, move_gamma_queue_t *q)
 {
 	/* Suicides do not make any patterns and confuse us. */
 	if (board_at(b, m->coord) == S_NONE || board_at(b, m->coord) == S_OFFBOARD)
 		return;
 
 	foreach_8neighbor(b, m->coord) {
-		apply_pattern_here(p, b, c, stone_other(m->color), q, gammas);
+		apply_pattern_here(p, b, c, stone_other(m->color), q);
 	} foreach_8neighbor_end;
 
 	if (mm) { /* Second move for pattern searching */
 		foreach_8neighbor(b, mm->coord) {
 			if (coord_is_8adjecent(m->coord, c))
 				continue;
-			apply_pattern_here(p, b, c, stone_other(m->color), q, gammas);
+			apply_pattern_here(p, b, c, stone_other(m->color), q);
 		} foreach_8neighbor_end;
 	}
 
 	if (PLDEBUGL(5))
-		mq_gamma_print(q, gammas, "Pattern");
+		mgq_print(q, "Pattern");
 }
 
-#ifdef MOGGY_JOSEKI
+/* Joseki answers to last move. */
 static void
 joseki_check(playout_policy_t *p, board_t *b, enum stone to_play, move_queue_t *q)
 {
-	moggy_policy_t *pp = (moggy_policy_t*)p->data;
-	if (!joseki_dict)
+	if (!using_joseki(b))
 		return;
 
-	foreach_joseki_move(joseki_dict, b, to_play) {
-		if (!board_is_valid_play(b, to_play, c))
+	coord_t coords[BOARD_MAX_COORDS];
+	int n = joseki_list_replies(joseki_dict, b, to_play, coords);
+	for (int i = 0; i < n; i++) {
+		if (!board_is_valid_play(b, to_play, coords[i]))
 			continue;
-		mq_add(q, c, 1<<MQ_JOSEKI);
-	} foreach_joseki_move_end;
+		mq_add(q, coords[i], 1<<MQ_JOSEKI);
+	}
 
 	if (q->moves > 0 && PLDEBUGL(5))
 		mq_print_line("Joseki", q);
 }
-#endif /* MOGGY_JOSEKI */
 
 static void
 global_atari_check(playout_policy_t *p, board_t *b, enum stone to_play, move_queue_t *q)
@@ -460,6 +493,8 @@ local_nlib_check(playout_policy_t *p, board_t *b, move_t *m, move_queue_t *q)
 		if (board_group_info(b, g).libs < 3 || board_group_info(b, g).libs > pp->nlib_count)
 			continue;
 		group_nlib_defense_check(b, g, color, q, 1<<MQ_LNLIB);
+		if (pp->semeai_budget)
+			group_semeai_check(b, g, color, q, 1<<MQ_LNLIB, pp->semeai_budget);
 		group2 = g; // prevent trivial repeated checks
 	} foreach_8neighbor_end;
 
@@ -611,8 +646,11 @@ playout_moggy_seqchoose(playout_policy_t *p, playout_setup_t *s, board_t *b, enu
 	if (!is_pass(b->last_ko.coord) && is_pass(b->ko.coord)
 	    && b->moves - b->last_ko_age < pp->koage
 	    && pp->korate > fast_random(100)) {
-		if (board_is_valid_play(b, to_play, b->last_ko.coord)
-		    && !is_bad_selfatari(b, to_play, b->last_ko.coord))
+		perf_start(h);
+		bool ok = (board_is_valid_play(b, to_play, b->last_ko.coord) &&
+			   !is_bad_selfatari(b, to_play, b->last_ko.coord));
+		perf_heuristic(PERF_KO, h, ok);
+		if (ok)
 			return b->last_ko.coord;
 	}
 
@@ -621,15 +659,20 @@ playout_moggy_seqchoose(playout_policy_t *p, playout_setup_t *s, board_t *b, enu
 		/* Local group in atari? */
 		if (true) {  // pp->lcapturerate check in local_atari_check()
 			move_queue_t q;  mq_init(&q);
-			if (local_atari_check(p, b, &last_move(b), &q) && 
-			    q.moves > 0)
+			perf_start(h);
+			bool found = (local_atari_check(p, b, &last_move(b), &q) &&
+				      q.moves > 0);
+			perf_heuristic(PERF_LATARI, h, found);
+			if (found)
 				return mq_pick(&q);
 		}
 
 		/* Local group trying to escape ladder? */
 		if (pp->ladderrate > fast_random(100)) {
 			move_queue_t q;  mq_init(&q);
+			perf_start(h);
 			local_ladder_check(p, b, &last_move(b), &q);
+			perf_heuristic(PERF_LADDER, h, q.moves > 0);
 			if (q.moves > 0)
 				return mq_pick(&q);
 		}
@@ -641,7 +684,9 @@ playout_moggy_seqchoose(playout_policy_t *p, playout_setup_t *s, board_t *b, enu
 			move_queue_t q;  mq_init(&q);
 			move_t m = move(ps->last_selfatari[other_color], other_color);			
 			ps->last_selfatari[other_color] = 0;  /* Clear */
+			perf_start(h);
 			local_2lib_capture_check(p, b, &m, &q);
+			perf_heuristic(PERF_L2LIB_CAPTURE, h, q.moves > 0);
 			if (q.moves > 0)
 				return mq_pick(&q);
 		}
@@ -649,7 +694,9 @@ playout_moggy_seqchoose(playout_policy_t *p, playout_setup_t *s, board_t *b, enu
 		/* Local group can be PUT in atari? */
 		if (pp->atarirate > fast_random(100)) {
 			move_queue_t q;  mq_init(&q);
+			perf_start(h);
 			local_2lib_check(p, b, &last_move(b), &q);
+			perf_heuristic(PERF_L2LIB, h, q.moves > 0);
 			if (q.moves > 0)
 				return mq_pick(&q);
 		}
@@ -657,7 +704,9 @@ playout_moggy_seqchoose(playout_policy_t *p, playout_setup_t *s, board_t *b, enu
 		/* Local group reduced some of our groups to 3 libs? */
 		if (pp->nlibrate > fast_random(100)) {
 			move_queue_t q;  mq_init(&q);
+			perf_start(h);
 			local_nlib_check(p, b, &last_move(b), &q);
+			perf_heuristic(PERF_LNLIB, h, q.moves > 0);
 			if (q.moves > 0)
 				return mq_pick(&q);
 		}
@@ -665,7 +714,9 @@ playout_moggy_seqchoose(playout_policy_t *p, playout_setup_t *s, board_t *b, enu
 		/* Some other semeai-ish shape checks */
 		if (pp->eyefixrate > fast_random(100)) {
 			move_queue_t q;  mq_init(&q);
+			perf_start(h);
 			eye_fix_check(p, b, &last_move(b), to_play, &q);
+			perf_heuristic(PERF_EYEFIX, h, q.moves > 0);
 			if (q.moves > 0)
 				return mq_pick(&q);
 		}
@@ -673,20 +724,23 @@ playout_moggy_seqchoose(playout_policy_t *p, playout_setup_t *s, board_t *b, enu
 		/* Nakade check */
 		if (pp->nakaderate > fast_random(100)
 		    && immediate_liberty_count(b, last_move(b).coord) > 0) {
+			perf_start(h);
 			coord_t nakade = nakade_check(p, b, &last_move(b), to_play);
+			perf_heuristic(PERF_NAKADE, h, !is_pass(nakade));
 			if (!is_pass(nakade))
 				return nakade;
 		}
 
 		/* Check for patterns we know */
 		if (pp->patternrate > fast_random(100)) {
-			move_queue_t q;  mq_init(&q);
-			fixp_t gammas[MQL];
+			move_gamma_queue_t q;  mgq_init(&q);
+			perf_start(h);
 			apply_pattern(p, b, &last_move(b),
 			                  pp->pattern2 && last_move2(b).coord >= 0 ? &last_move2(b) : NULL,
-					  &q, gammas);
+					  &q);
+			perf_heuristic(PERF_PATTERN, h, q.moves > 0);
 			if (q.moves > 0)
-				return mq_gamma_pick(&q, gammas);
+				return mgq_pick(&q);
 		}
 	}
 
@@ -695,24 +749,28 @@ playout_moggy_seqchoose(playout_policy_t *p, playout_setup_t *s, board_t *b, enu
 	/* Any groups in atari? */
 	if (pp->capturerate > fast_random(100)) {
 		move_queue_t q;  mq_init(&q);
+		perf_start(h);
 		global_atari_check(p, b, to_play, &q);
+		perf_heuristic(PERF_GATARI, h, q.moves > 0);
 		if (q.moves > 0)
 			return mq_pick(&q);
 	}
 
-#ifdef MOGGY_JOSEKI
 	/* Joseki moves? */
 	if (pp->josekirate > fast_random(100)) {
 		move_queue_t q;  mq_init(&q);
+		perf_start(h);
 		joseki_check(p, b, to_play, &q);
+		perf_heuristic(PERF_JOSEKI, h, q.moves > 0);
 		if (q.moves > 0)
 			return mq_pick(&q);
 	}
-#endif
 
 	/* Fill board */
 	if (pp->fillboardtries > 0) {
+		perf_start(h);
 		coord_t c = fillboard_check(p, b);
+		perf_heuristic(PERF_FILLBOARD, h, !is_pass(c));
 		if (!is_pass(c))
 			return c;
 	}
@@ -720,6 +778,206 @@ playout_moggy_seqchoose(playout_policy_t *p, playout_setup_t *s, board_t *b, enu
 	return pass;
 }
 
+/* Pipeline rules: same as seqchoose rules above, dice already rolled. */
+
+static coord_t
+pipeline_ko(playout_policy_t *p, board_t *b, enum stone to_play, moggy_local_t *l)
+{
+	moggy_policy_t *pp = (moggy_policy_t*)p->data;
+	if (is_pass(b->last_ko.coord) || !is_pass(b->ko.coord) ||
+	    b->moves - b->last_ko_age >= pp->koage)
+		return pass;
+	if (board_is_valid_play(b, to_play, b->last_ko.coord)
+	    && !is_bad_selfatari(b, to_play, b->last_ko.coord))
+		return b->last_ko.coord;
+	return pass;
+}
+
+static coord_t
+pipeline_latari(playout_policy_t *p, board_t *b, enum stone to_play, moggy_local_t *l)
+{
+	if (!(l->libs4 & moggy_libs_bit(1)))
+		return pass;
+	move_queue_t q;  mq_init(&q);
+	if (local_atari_check(p, b, &last_move(b), &q) && q.moves > 0)
+		return mq_pick(&q);
+	return pass;
+}
+
+static coord_t
+pipeline_ladder(playout_policy_t *p, board_t *b, enum stone to_play, moggy_local_t *l)
+{
+	if (l->lastlibs != 2)
+		return pass;
+	move_queue_t q;  mq_init(&q);
+	local_ladder_check(p, b, &last_move(b), &q);
+	return (q.moves > 0 ? mq_pick(&q) : pass);
+}
+
+static coord_t
+pipeline_2lib_capture(playout_policy_t *p, board_t *b, enum stone to_play, moggy_local_t *l)
+{
+	moggy_state_t *ps = (moggy_state_t*)b->ps;
+	enum stone other_color = stone_other(to_play);
+	if (!ps->last_selfatari[other_color])
+		return pass;
+	move_queue_t q;  mq_init(&q);
+	move_t m = move(ps->last_selfatari[other_color], other_color);
+	ps->last_selfatari[other_color] = 0;  /* Clear */
+	local_2lib_capture_check(p, b, &m, &q);
+	return (q.moves > 0 ? mq_pick(&q) : pass);
+}
+
+static coord_t
+pipeline_2lib(playout_policy_t *p, board_t *b, enum stone to_play, moggy_local_t *l)
+{
+	if (!(l->libs4 & moggy_libs_bit(2)))
+		return pass;
+	move_queue_t q;  mq_init(&q);
+	local_2lib_check(p, b, &last_move(b), &q);
+	return (q.moves > 0 ? mq_pick(&q) : pass);
+}
+
+static coord_t
+pipeline_nlib(playout_policy_t *p, board_t *b, enum stone to_play, moggy_local_t *l)
+{
+	moggy_policy_t *pp = (moggy_policy_t*)p->data;
+	/* Groups with 3 .. nlib_count libs ? */
+	if (pp->nlib_count < 3)
+		return pass;
+	int mask = (moggy_libs_bit(pp->nlib_count) << 1) - moggy_libs_bit(3);
+	if (!(l->ownlibs8 & mask))
+		return pass;
+	move_queue_t q;  mq_init(&q);
+	local_nlib_check(p, b, &last_move(b), &q);
+	return (q.moves > 0 ? mq_pick(&q) : pass);
+}
+
+static coord_t
+pipeline_eyefix(playout_policy_t *p, board_t *b, enum stone to_play, moggy_local_t *l)
+{
+	move_queue_t q;  mq_init(&q);
+	eye_fix_check(p, b, &last_move(b), to_play, &q);
+	return (q.moves > 0 ? mq_pick(&q) : pass);
+}
+
+static coord_t
+pipeline_nakade(playout_policy_t *p, board_t *b, enum stone to_play, moggy_local_t *l)
+{
+	if (!immediate_liberty_count(b, last_move(b).coord))
+		return pass;
+	return nakade_check(p, b, &last_move(b), to_play);
+}
+
+static coord_t
+pipeline_pattern(playout_policy_t *p, board_t *b, enum stone to_play, moggy_local_t *l)
+{
+	moggy_policy_t *pp = (moggy_policy_t*)p->data;
+	move_gamma_queue_t q;  mgq_init(&q);
+	apply_pattern(p, b, &last_move(b),
+		      pp->pattern2 && last_move2(b).coord >= 0 ? &last_move2(b) : NULL,
+		      &q);
+	return mgq_pick(&q);
+}
+
+static coord_t
+pipeline_gatari(playout_policy_t *p, board_t *b, enum stone to_play, moggy_local_t *l)
+{
+	move_queue_t q;  mq_init(&q);
+	global_atari_check(p, b, to_play, &q);
+	return (q.moves > 0 ? mq_pick(&q) : pass);
+}
+
+static coord_t
+pipeline_joseki(playout_policy_t *p, board_t *b, enum stone to_play, moggy_local_t *l)
+{
+	move_queue_t q;  mq_init(&q);
+	joseki_check(p, b, to_play, &q);
+	return (q.moves > 0 ? mq_pick(&q) : pass);
+}
+
+static coord_t
+pipeline_fillboard(playout_policy_t *p, board_t *b, enum stone to_play, moggy_local_t *l)
+{
+	return fillboard_check(p, b);
+}
+
+static void
+moggy_local_init(board_t *b, enum stone to_play, moggy_local_t *l)
+{
+	coord_t coord = last_move(b).coord;
+	group_t last = group_at(b, coord);
+	l->lastlibs = board_group_info(b, last).libs;
+	l->libs4 = (last ? moggy_libs_bit(l->lastlibs) : 0);
+	l->ownlibs8 = 0;
+
+	foreach_neighbor(b, coord, {
+		group_t g = group_at(b, c);
+		if (g)  l->libs4 |= moggy_libs_bit(board_group_info(b, g).libs);
+	});
+	foreach_8neighbor(b, coord) {
+		group_t g = group_at(b, c);
+		if (g && board_at(b, c) == to_play)
+			l->ownlibs8 |= moggy_libs_bit(board_group_info(b, g).libs);
+	} foreach_8neighbor_end;
+}
+
+static coord_t
+playout_moggy_pipelinechoose(playout_policy_t *p, playout_setup_t *s, board_t *b, enum stone to_play)
+{
+	moggy_policy_t *pp = (moggy_policy_t*)p->data;
+
+	if (PLDEBUGL(5))
+		board_print(b, stderr);
+
+	bool local = !is_pass(last_move(b).coord);
+	moggy_local_t l;
+	if (local)  moggy_local_init(b, to_play, &l);
+
+	for (int i = 0; i < pp->pipeline_n; i++) {
+		moggy_pipeline_rule_t *r = &pp->pipeline[i];
+		if (r->local && !local)
+			continue;
+		if (r->rate < 100 && r->rate <= fast_random(100))
+			continue;
+		perf_start(h);
+		coord_t c = r->rule(p, b, to_play, &l);
+		perf_heuristic(r->perf, h, !is_pass(c));
+		if (!is_pass(c))
+			return c;
+	}
+
+	return pass;
+}
+
+/* Compile seqchoose rules for pipeline mode. */
+static void
+moggy_pipeline_init(moggy_policy_t *pp)
+{
+	unsigned int fillboard = (pp->fillboardtries > 0 ? 100 : 0);
+	moggy_pipeline_rule_t rules[] = {
+		{ pipeline_ko,           pp->korate,       false, PERF_KO },
+		{ pipeline_latari,       100,              true,  PERF_LATARI },  /* lcapturerate check in local_atari_check() */
+		{ pipeline_ladder,       pp->ladderrate,   true,  PERF_LADDER },
+		{ pipeline_2lib_capture, pp->atarirate,    true,  PERF_L2LIB_CAPTURE },
+		{ pipeline_2lib,         pp->atarirate,    true,  PERF_L2LIB },
+		{ pipeline_nlib,         pp->nlibrate,     true,  PERF_LNLIB },
+		{ pipeline_eyefix,       pp->eyefixrate,   true,  PERF_EYEFIX },
+		{ pipeline_nakade,       pp->nakaderate,   true,  PERF_NAKADE },
+		{ pipeline_pattern,      pp->patternrate,  true,  PERF_PATTERN },
+		{ pipeline_gatari,       pp->capturerate,  false, PERF_GATARI },
+		{ pipeline_joseki,       pp->josekirate,   false, PERF_JOSEKI },
+		{ pipeline_fillboard,    fillboard,        false, PERF_FILLBOARD },
+	};
+	int n = sizeof(rules) / sizeof(rules[0]);
+	assert(n <= MOGGY_PIPELINE_MAX);
+
+	pp->pipeline_n = 0;
+	for (int i = 0; i < n; i++)
+		if (rules[i].rate > 0)
+			pp->pipeline[pp->pipeline_n++] = rules[i];
+}
+
 /* Pick a move from queue q, giving different likelihoods to moves
  * based on their tags. */
 static coord_t
@@ -826,11 +1084,13 @@ playout_moggy_fullchoose(playout_policy_t *p, playout_setup_t *s, board_t *b, en
 
 		/* Check for patterns we know */
 		if (pp->patternrate > 0) {
-			fixp_t gammas[MQL];
+			move_gamma_queue_t gq;  mgq_init(&gq);
 			apply_pattern(p, b, &last_move(b),
 					pp->pattern2 && last_move2(b).coord >= 0 ? &last_move2(b) : NULL,
-					&q, gammas);
+					&gq);
 			/* FIXME: Use the gammas. */
+			for (unsigned int i = 0; i < gq.moves; i++)
+				mq_add(&q, gq.move[i], 1<<MQ_PAT3);
 		}
 	}
 
@@ -840,11 +1100,9 @@ playout_moggy_fullchoose(playout_policy_t *p, playout_setup_t *s, board_t *b, en
 	if (pp->capturerate > 0)
 		global_atari_check(p, b, to_play, &q);
 
-#ifdef MOGGY_JOSEKI
 	/* Joseki moves? */
 	if (pp->josekirate > 0)
 		joseki_check(p, b, to_play, &q);
-#endif
 
 #if 0
 	/* Average length of the queue is 1.4 move. */
@@ -1011,23 +1269,27 @@ playout_moggy_assess_one(playout_policy_t *p, prior_map_t *map, coord_t coord, i
 	return;
 }
 
+/* Single pass over the board: endangered groups at their group head,
+ * candidate moves at free points. Tactical queries are cached for the
+ * whole pass so groups and moves touching the same liberties share
+ * selfatari / ladder results instead of reading them out again. */
 static void
 playout_moggy_assess(playout_policy_t *p, prior_map_t *map, int games)
 {
 	moggy_policy_t *pp = (moggy_policy_t*)p->data;
-
-	/* First, go through all endangered groups. */
-	for (group_t g = 1; g < board_max_coords(map->b); g++)
-		if (group_at(map->b, g) == g)
-			playout_moggy_assess_group(p, map, g, games);
-
-	/* Then, assess individual moves. */
-	if (!pp->patternrate && !pp->selfatarirate)
-		return;
-	foreach_free_point(map->b) {
-		if (map->consider[c])
+	board_t *b = map->b;
+	bool moves = (pp->patternrate || pp->selfatarirate);
+
+	bool memo = tactics_memo_start(b);
+	foreach_point(b) {
+		enum stone s = board_at(b, c);
+		if (s == S_BLACK || s == S_WHITE) {
+			if (group_at(b, c) == c)
+				playout_moggy_assess_group(p, map, c, games);
+		} else if (s == S_NONE && moves && map->consider[c])
 			playout_moggy_assess_one(p, map, c, games);
-	} foreach_free_point_end;
+	} foreach_point_end;
+	tactics_memo_stop(memo);
 }
 
 
@@ -1270,8 +1532,12 @@ playout_moggy_init(char *arg, board_t *b)
 				pp->atari_def_no_hopeless = optval && *optval == '0' ? false : true;
 			} else if (!strcasecmp(optname, "nlib_count") && optval) {
 				pp->nlib_count = atoi(optval);
+			} else if (!strcasecmp(optname, "semeai_budget") && optval) {
+				pp->semeai_budget = atoi(optval);
 			} else if (!strcasecmp(optname, "middle_ladder")) {
 				pp->middle_ladder = optval && *optval == '0' ? false : true;
+			} else if (!strcasecmp(optname, "pipeline")) {
+				p->choose = optval && *optval == '0' ? playout_moggy_seqchoose : playout_moggy_pipelinechoose;
 			} else if (!strcasecmp(optname, "fullchoose")) {
 				pp->fullchoose = true;
 				p->choose = optval && *optval == '0' ? playout_moggy_seqchoose : playout_moggy_fullchoose;
@@ -1310,6 +1576,7 @@ playout_moggy_init(char *arg, board_t *b)
 	if (pp->alwaysccaprate == -1U) pp->alwaysccaprate = rate;
 
 	pattern3s_init(&pp->patterns, moggy_patterns_src, moggy_patterns_src_n);
+	moggy_pipeline_init(pp);
 
 	return p;
 }
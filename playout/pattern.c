@@ -0,0 +1,180 @@
+/* Playout policy picking moves according to mm pattern gammas
+ * (patterns_mm.gamma): much richer than moggy's 3x3 patterns, but also
+ * a lot more expensive so we only look around the last move.
+ *
+ * Each move the empty 8-neighbors of the last move get rated for the
+ * player to move (pattern_match() in local mode) and the next move is
+ * drawn with probability proportional to the gammas. Ratings we made
+ * on our previous turn are kept and stay candidates unless the point
+ * got played or is next to our own last move (pattern around it changed);
+ * so only the neighbors of the last move need matching each time.
+ * If there's nothing to pick (or for a tenuki) we return pass and a
+ * uniformly random move gets played instead. */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEBUG
+#include "board.h"
+#include "debug.h"
+#include "mgq.h"
+#include "playout.h"
+#include "playout/pattern.h"
+#include "../pattern.h"
+#include "patternsp.h"
+#include "patternprob.h"
+#include "random.h"
+
+
+#define PLDEBUGL(n) DEBUGL_(p->debug_level, n)
+
+typedef struct {
+	pattern_config_t pc;
+	/* Percentage of moves played randomly even if we have candidates. */
+	unsigned int tenukirate;
+	/* Used when we don't have a real ownermap: no playouts
+	 * played yet, everything looks unsettled. */
+	ownermap_t unknown_ownermap;
+} pattern_policy_t;
+
+/* Cached ratings, per color. */
+typedef struct {
+	int        rated[S_MAX][BOARD_MAX_COORDS];	/* b->moves at rating time, -1 if none */
+	floating_t gamma[S_MAX][BOARD_MAX_COORDS];
+} pattern_state_t;
+
+
+static void
+playout_pattern_setboard(playout_policy_t *p, board_t *b)
+{
+	if (b->ps)
+		return;
+	pattern_state_t *ps = malloc2(pattern_state_t);
+	memset(ps->rated, -1, sizeof(ps->rated));
+	b->ps = ps;
+}
+
+static ownermap_t *
+policy_ownermap(pattern_policy_t *pp, playout_setup_t *setup)
+{
+	ownermap_t *o = setup->ownermap;
+	/* mcowner feature needs enough playouts to be meaningful. */
+	if (!o || o->playouts < GJ_MINGAMES)
+		return &pp->unknown_ownermap;
+	return o;
+}
+
+static coord_t
+playout_pattern_choose(playout_policy_t *p, playout_setup_t *s, board_t *b, enum stone to_play)
+{
+	pattern_policy_t *pp = (pattern_policy_t*)p->data;
+	pattern_state_t *ps = (pattern_state_t*)b->ps;
+	coord_t last = last_move(b).coord;
+	coord_t last2 = last_move2(b).coord;
+
+	if (is_pass(last) || board_at(b, last) == S_NONE)  /* pass or suicide */
+		return pass;
+	if (pp->tenukirate && fast_random(100) < pp->tenukirate)
+		return pass;
+
+	ownermap_t *ownermap = policy_ownermap(pp, s);
+	coord_t cands[16];
+	floating_t gammas[16];
+	int n = 0;
+	floating_t max = 0;
+
+	/* Rate neighbors of last move. */
+	foreach_8neighbor(b, last) {
+		if (board_at(b, c) != S_NONE)  continue;
+		ps->rated[to_play][c] = b->moves;
+		ps->gamma[to_play][c] = 0;
+		if (!board_is_valid_play_no_suicide(b, to_play, c) ||
+		    board_is_one_point_eye(b, c, to_play))
+			continue;
+
+		move_t m = move(c, to_play);
+		pattern_t pat;
+		pattern_match(&pp->pc, &pat, b, &m, ownermap, true);
+		floating_t gamma = ps->gamma[to_play][c] = pattern_gamma(&pp->pc, &pat);
+		cands[n] = c;  gammas[n++] = gamma;
+		if (gamma > max)  max = gamma;
+	} foreach_8neighbor_end;
+
+	/* And whatever is still valid from our previous turn. */
+	coord_t last3 = last_move3(b).coord;
+	if (b->moves >= 3 && !is_pass(last3)) {
+		foreach_8neighbor(b, last3) {
+			if (ps->rated[to_play][c] != b->moves - 2)	continue;
+			if (board_at(b, c) != S_NONE)			continue;
+			if (!is_pass(last2) && coord_is_8adjecent(c, last2))  continue;
+			if (coord_is_8adjecent(c, last))		continue;  /* Rated already */
+			floating_t gamma = ps->gamma[to_play][c];
+			if (!gamma)  continue;
+			cands[n] = c;  gammas[n++] = gamma;
+			if (gamma > max)  max = gamma;
+		} foreach_8neighbor_end;
+	}
+
+	if (!n || !max)
+		return pass;
+
+	/* Gammas can be anything, scale them to fixp range. */
+	move_gamma_queue_t q;  mgq_init(&q);
+	for (int i = 0; i < n; i++)
+		mgq_add(&q, cands[i], double_to_fixp(gammas[i] / max));
+
+	if (PLDEBUGL(5))
+		mgq_print(&q, "Pattern");
+	return mgq_pick(&q);
+}
+
+playout_policy_t *
+playout_pattern_init(char *arg, board_t *b)
+{
+	playout_policy_t *p = calloc2(1, playout_policy_t);
+	pattern_policy_t *pp = calloc2(1, pattern_policy_t);
+	p->data = pp;
+	p->setboard = playout_pattern_setboard;
+	p->setboard_randomok = true;
+	p->choose = playout_pattern_choose;
+
+	pp->tenukirate = 10;
+	char *patternsarg = NULL;
+
+	if (arg) {
+		char *optspec, *next = arg;
+		while (*next) {
+			optspec = next;
+			next += strcspn(next, ":");
+			if (*next) { *next++ = 0; } else { *next = 0; }
+
+			char *optname = optspec;
+			char *optval = strchr(optspec, '=');
+			if (optval) { *optval++ = 0; }
+
+			if (!strcasecmp(optname, "debug")) {
+				if (optval)  p->debug_level = atoi(optval);
+				else         p->debug_level++;
+			} else if (!strcasecmp(optname, "tenukirate") && optval) {
+				/* Percentage of moves picked uniformly at random. */
+				pp->tenukirate = atoi(optval);
+			} else if (!strcasecmp(optname, "patterns") && optval) {
+				/* Pattern config, '+' separated (see patterns_init()). */
+				patternsarg = optval;
+				for (char *c = patternsarg; *c; c++)
+					if (*c == '+')  *c = ':';
+			} else
+				die("playout-pattern: Invalid policy argument %s or missing value\n", optname);
+		}
+	}
+
+	patterns_init(&pp->pc, patternsarg, false, true);
+	if (!using_patterns())
+		die("playout-pattern: Couldn't load patterns (patterns_mm.spat, patterns_mm.gamma)\n");
+	ownermap_init(&pp->unknown_ownermap);
+	pp->unknown_ownermap.playouts = GJ_MINGAMES;
+
+	return p;
+}
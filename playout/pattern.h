@@ -0,0 +1,8 @@
+#ifndef PACHI_PLAYOUT_PATTERN_H
+#define PACHI_PLAYOUT_PATTERN_H
+
+#include "playout.h"
+
+playout_policy_t *playout_pattern_init(char *arg, board_t *b);
+
+#endif
@@ -1,9 +1,31 @@
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "random.h"
 
 
-/* Simple Park-Miller for floating point; LCG as used in glibc and other places */
+/* xoshiro256**, see http://prng.di.unimi.it/
+ * Seeding with splitmix64 as recommended by the authors. */
+
+#define DEFAULT_SEED 29264
+
+static uint64_t
+splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static void
+fast_random_seed(fast_random_t *r, unsigned long seed)
+{
+	uint64_t x = seed;
+	for (int i = 0; i < 4; i++)
+		r->s[i] = splitmix64(&x);
+	r->seed = seed;
+}
 
 
 /********************************************************************************************/
@@ -19,67 +41,31 @@ static void __attribute__((constructor))
 init_fast_random()
 {
 	tls_index = TlsAlloc();
-	fast_srandom(29264);
 }
 
-void
-fast_srandom(unsigned long seed_)
+fast_random_t *
+fast_random_state(void)
 {
-	TlsSetValue(tls_index, (void*)(intptr_t)seed_);
+	fast_random_t *r = TlsGetValue(tls_index);
+	if (unlikely(!r)) {
+		r = malloc2(fast_random_t);
+		fast_random_seed(r, DEFAULT_SEED);
+		TlsSetValue(tls_index, r);
+	}
+	return r;
 }
 
-unsigned long
-fast_getseed(void)
-{
-	return (unsigned long)(intptr_t)TlsGetValue(tls_index);
-}
-
-uint16_t
-fast_random(unsigned int max)
-{
-	unsigned long pmseed = fast_getseed();
-	pmseed = ((pmseed * 1103515245) + 12345) & 0x7fffffff;
-	fast_srandom(pmseed);
-	return ((pmseed & 0xffff) * max) >> 16;
-}
-
-
 #else
 
 
 /********************************************************************************************/
 #ifndef NO_THREAD_LOCAL
 
-static __thread unsigned long pmseed = 29264;
-
-void
-fast_srandom(unsigned long seed_)
-{
-	pmseed = seed_;
-}
-
-unsigned long
-fast_getseed(void)
-{
-	return pmseed;
-}
-
-uint16_t
-fast_random(unsigned int max)
-{
-	pmseed = ((pmseed * 1103515245) + 12345) & 0x7fffffff;
-	return ((pmseed & 0xffff) * max) >> 16;
-}
-
-float
-fast_frandom(void)
-{
-	/* Construct (1,2) IEEE floating_t from our random integer */
-	/* http://rgba.org/articles/sfrand/sfrand.htm */
-	union { unsigned long ul; floating_t f; } p;
-	p.ul = (((pmseed *= 16807) & 0x007fffff) - 1) | 0x3f800000;
-	return p.f - 1.0f;
-}
+/* Same state as fast_random_seed(DEFAULT_SEED) */
+__thread fast_random_t fast_random_tls = {
+	{ 0xd77f80bdf45ea0efULL, 0x3b80ea921a2d4308ULL, 0x2b0b6ff148e10370ULL, 0xc58517fe6ad13fe6ULL },
+	DEFAULT_SEED
+};
 
 #else
 
@@ -91,48 +77,67 @@ fast_frandom(void)
 
 #include <pthread.h>
 
-static pthread_key_t seed_key;
+static pthread_key_t state_key;
 
 static void __attribute__((constructor))
 random_init(void)
 {
-	pthread_key_create(&seed_key, NULL);
-	fast_srandom(29264UL);
+	pthread_key_create(&state_key, free);
+}
+
+fast_random_t *
+fast_random_state(void)
+{
+	fast_random_t *r = pthread_getspecific(state_key);
+	if (unlikely(!r)) {
+		r = malloc2(fast_random_t);
+		fast_random_seed(r, DEFAULT_SEED);
+		pthread_setspecific(state_key, r);
+	}
+	return r;
 }
 
+#endif
+#endif
+
+
+/********************************************************************************************/
+
 void
-fast_srandom(unsigned long seed_)
+fast_srandom(unsigned long seed)
 {
-	pthread_setspecific(seed_key, (void *)seed_);
+	fast_random_seed(fast_random_state(), seed);
 }
 
 unsigned long
 fast_getseed(void)
 {
-	return (unsigned long)pthread_getspecific(seed_key);
+	return fast_random_state()->seed;
 }
 
-uint16_t
-fast_random(unsigned int max)
+/* Equivalent to 2^128 calls to fast_random64() on current thread's state. */
+static void
+fast_random_jump(void)
 {
-	unsigned long pmseed = (unsigned long)pthread_getspecific(seed_key);
-	pmseed = ((pmseed * 1103515245) + 12345) & 0x7fffffff;
-	pthread_setspecific(seed_key, (void *)pmseed);
-	return ((pmseed & 0xffff) * max) >> 16;
+	fast_random_t *r = fast_random_state();
+	static const uint64_t jump[] = { 0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+					 0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL };
+	uint64_t s[4] = { 0, 0, 0, 0 };
+	for (int i = 0; i < 4; i++)
+		for (int b = 0; b < 64; b++) {
+			if (jump[i] & (1ULL << b))
+				for (int j = 0; j < 4; j++)
+					s[j] ^= r->s[j];
+			fast_random64();
+		}
+	for (int j = 0; j < 4; j++)
+		r->s[j] = s[j];
 }
 
-float
-fast_frandom(void)
+void
+fast_srandom_stream(unsigned long seed, unsigned int stream)
 {
-	/* Construct (1,2) IEEE floating_t from our random integer */
-	/* http://rgba.org/articles/sfrand/sfrand.htm */
-	unsigned long pmseed = (unsigned long)pthread_getspecific(seed_key);
-	pmseed *= 16807;
-	union { unsigned long ul; floating_t f; } p;
-	p.ul = ((pmseed & 0x007fffff) - 1) | 0x3f800000;
-	pthread_setspecific(seed_key, (void *)pmseed);
-	return p.f - 1.0f;
+	fast_srandom(seed);
+	for (unsigned int i = 0; i < stream; i++)
+		fast_random_jump();
 }
-
-#endif
-#endif
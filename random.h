@@ -5,26 +5,86 @@
 
 #include "util.h"
 
+/* Per-thread xoshiro256** generator (Blackman & Vigna), seeded with
+ * splitmix64 so small / consecutive seeds still give unrelated states. */
+
+typedef struct {
+	uint64_t s[4];
+	unsigned long seed;	/* Last seed set, for fast_getseed() */
+} fast_random_t;
+
 void fast_srandom(unsigned long seed);
 unsigned long fast_getseed(void);
 
-/* Note that only 16bit numbers can be returned. */
-uint16_t fast_random(unsigned int max);
-/* Use this one if you want larger numbers. */
+/* Seed current thread with substream @stream of @seed: same sequence as
+ * fast_srandom(seed) advanced by @stream * 2^128 numbers, so streams of
+ * the same seed never overlap. This is what search threads use, sequence
+ * of each thread can be reproduced from main seed and thread id. */
+void fast_srandom_stream(unsigned long seed, unsigned int stream);
+
+/* Get random number in [0..max) range. */
+static uint16_t fast_random(unsigned int max);	/* max <= 65536 */
 static uint32_t fast_irandom(unsigned int max);
 
-/* Get random number in [0..1] range. */
-float fast_frandom();
+/* Get random number in [0..1) range. */
+static float fast_frandom(void);
+
+/* Raw 64 bits */
+static uint64_t fast_random64(void);
+
+
+#if defined(_WIN32) || defined(NO_THREAD_LOCAL)
+fast_random_t *fast_random_state(void);
+#else
+extern __thread fast_random_t fast_random_tls;
+static inline fast_random_t *fast_random_state(void)  {  return &fast_random_tls;  }
+#endif
+
+static inline uint64_t
+fast_random_rotl(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
 
+static inline uint64_t
+fast_random64(void)
+{
+	uint64_t *s = fast_random_state()->s;
+	uint64_t r = fast_random_rotl(s[1] * 5, 7) * 9;
+	uint64_t t = s[1] << 17;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = fast_random_rotl(s[3], 45);
+	return r;
+}
 
+/* Lemire's multiply-shift with rejection, so no modulo bias.
+ * Division only happens in the rare case we might have to reject. */
 static inline uint32_t
 fast_irandom(unsigned int max)
 {
-	if (max <= 65536)
-		return fast_random(max);
-	int himax = (max - 1) / 65536;
-	uint16_t hi = fast_random(himax + 1);
-	return ((uint32_t)hi << 16) | fast_random(hi < himax ? 65536 : max % 65536);
+	uint64_t m = (fast_random64() >> 32) * (uint64_t)max;
+	if (unlikely((uint32_t)m < max)) {
+		uint32_t threshold = -max % max;
+		while ((uint32_t)m < threshold)
+			m = (fast_random64() >> 32) * (uint64_t)max;
+	}
+	return m >> 32;
+}
+
+static inline uint16_t
+fast_random(unsigned int max)
+{
+	return fast_irandom(max);
+}
+
+static inline float
+fast_frandom(void)
+{
+	return (fast_random64() >> 40) * (1.0f / 16777216.0f);
 }
 
 #endif
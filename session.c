@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEBUG
+#include "debug.h"
+#include "ownermap.h"
+#include "util.h"
+#include "session.h"
+
+static FILE *record_file = NULL;
+
+void
+session_record_start(char *filename, int seed, int argc, char *argv[])
+{
+	record_file = fopen(filename, "w");
+	if (!record_file)  fail(filename);
+	fprintf(record_file, "# pachi session, seed %i\n", seed);
+	fprintf(record_file, "# cmdline:");
+	for (int i = 1; i < argc; i++)
+		fprintf(record_file, " %s", argv[i]);
+	fprintf(record_file, "\n");
+	fflush(record_file);
+}
+
+/* Command part of gtp line @line (comment and trailing space dropped). */
+static void
+session_command_text(char *line, char *cmd, int size)
+{
+	snprintf(cmd, size, "%s", line);
+	if (strchr(cmd, '#'))  *strchr(cmd, '#') = 0;
+	for (int n = strlen(cmd); n > 0 && (cmd[n - 1] == '\n' || cmd[n - 1] == ' ' || cmd[n - 1] == '\t'); n--)
+		cmd[n - 1] = 0;
+}
+
+void
+session_replay_start(session_replay_t *r, char *filename)
+{
+	memset(r, 0, sizeof(*r));
+	r->f = fopen(filename, "r");
+	if (!r->f)  fail(filename);
+	r->filename = filename;
+	r->seed = -1;
+
+	char line[4096];
+	if (fgets(line, sizeof(line), r->f))
+		sscanf(line, "# pachi session, seed %i", &r->seed);
+	if (r->seed < 0)  die("%s: not a pachi session record\n", filename);
+}
+
+char *
+session_replay_next(session_replay_t *r, char *buf, int size)
+{
+	char line[4096];
+	while (fgets(line, sizeof(line), r->f)) {
+		session_command_text(line, buf, size - 1);
+		if (!*buf)  continue;
+		strcat(buf, "\n");
+
+		r->rec_time = 0;
+		r->rec_playouts = r->rec_root = 0;
+		char *stats = strstr(line, "# time ");
+		if (stats && sscanf(stats, "# time %lf playouts %i root %i", &r->rec_time, &r->rec_playouts, &r->rec_root) < 3)
+			r->rec_playouts = r->rec_root = 0;
+		return buf;
+	}
+	return NULL;
+}
+
+bool
+session_replay_ti(session_replay_t *r, time_info_t *ti)
+{
+	/* Search stops once root playouts go past ti->games */
+	int games = r->rec_root - 1;
+	if (!r->rec_playouts || games < GJ_MINGAMES)  return false;
+	time_info_t fixed = { .type = TT_MOVE, .dim = TD_GAMES, .games = games, .ignore_gtp = true };
+	*ti = fixed;
+	return true;
+}
+
+void
+session_command(session_replay_t *r, char *line, double elapsed, int playouts, int root)
+{
+	char cmd[4096];
+	session_command_text(line, cmd, sizeof(cmd));
+	if (!*cmd)  return;
+
+	if (record_file) {
+		fprintf(record_file, "%s\t# time %.6f", cmd, elapsed);
+		if (playouts)  fprintf(record_file, " playouts %i root %i", playouts, root);
+		fprintf(record_file, "\n");
+		fflush(record_file);
+	}
+
+	if (!r)  return;
+	r->commands++;
+	r->total_rec += r->rec_time;
+	r->total_replay += elapsed;
+	/* Fixed playouts searches overshoot a little with several threads. */
+	bool diff = (r->rec_playouts && abs(root - r->rec_root) > r->rec_root / 100 + 16);
+	if (diff)  r->playouts_diff++;
+	if (r->rec_time < 0.01 && elapsed < 0.01 && !diff)  return;
+
+	if (strlen(cmd) > 30)  strcpy(cmd + 27, "...");
+	fprintf(stderr, "replay: %-30s %9.3fs -> %9.3fs  %+6.1f%%", cmd, r->rec_time, elapsed,
+		(r->rec_time > 0 ? 100 * (elapsed - r->rec_time) / r->rec_time : 0));
+	if (diff)  fprintf(stderr, "  (playouts %i -> %i)", r->rec_root, root);
+	fprintf(stderr, "\n");
+}
+
+void
+session_replay_done(session_replay_t *r)
+{
+	fclose(r->f);
+	fprintf(stderr, "replay: %i commands, recorded %.3fs, replay %.3fs (%+.1f%%)\n",
+		r->commands, r->total_rec, r->total_replay,
+		(r->total_rec > 0 ? 100 * (r->total_replay - r->total_rec) / r->total_rec : 0));
+	if (r->playouts_diff)
+		fprintf(stderr, "replay: %i searches didn't play the recorded playouts\n", r->playouts_diff);
+}
@@ -0,0 +1,52 @@
+#ifndef PACHI_SESSION_H
+#define PACHI_SESSION_H
+
+/* Gtp session record / replay, for performance regression testing.
+ *
+ * --record FILE saves the gtp command stream along with random seed and
+ * command line. Each command line gets its time and the playouts its search
+ * did (if any) appended as gtp comment, so record is a valid gtp file:
+ *
+ *   # pachi session, seed 1234
+ *   # cmdline: -t 10 threads=4
+ *   boardsize 19		# time 0.000011
+ *   genmove b		# time 9.871263 playouts 123456 root 123456
+ *
+ * --replay FILE runs recorded commands instead of reading stdin, with the
+ * recorded seed (unless -s is given) and searches fixed to the playouts
+ * they had (root playouts, as with -t =N). Worker threads seeds derive from
+ * the main one so single threaded searches come out the same. Time
+ * differences are reported for each command, and a summary at the end. */
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "timeinfo.h"
+
+void session_record_start(char *filename, int seed, int argc, char *argv[]);
+
+typedef struct {
+	FILE  *f;
+	char  *filename;
+	int    seed;		/* -1 if not found */
+	double rec_time;	/* Recorded time of current command */
+	int    rec_playouts;	/* Playouts of its search, 0: no search */
+	int    rec_root;	/* Root playouts after search */
+	int    commands;
+	double total_rec, total_replay;
+	int    playouts_diff;	/* Searches which didn't do the same playouts */
+} session_replay_t;
+
+/* Open record, read seed. Dies if it can't. */
+void session_replay_start(session_replay_t *r, char *filename);
+/* Next command line into @buf, NULL at end. */
+char *session_replay_next(session_replay_t *r, char *buf, int size);
+/* Time info for current command: fixed playouts if recorded one searched.
+ * Returns false if it didn't, @ti is left alone then. */
+bool session_replay_ti(session_replay_t *r, time_info_t *ti);
+void session_replay_done(session_replay_t *r);
+
+/* Gtp command @cmd took @elapsed seconds, recording or replaying. */
+void session_command(session_replay_t *r, char *cmd, double elapsed, int playouts, int root);
+
+#endif
@@ -0,0 +1,314 @@
+#include <assert.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DEBUG
+#include "board.h"
+#include "debug.h"
+#include "sgf.h"
+
+#define SGF_VALUE_MAX 256
+
+void
+sgf_game_init(sgf_game_t *g)
+{
+	memset(g, 0, sizeof(*g));
+}
+
+void
+sgf_game_done(sgf_game_t *g)
+{
+	free(g->setup);
+	free(g->moves);
+	memset(g, 0, sizeof(*g));
+}
+
+static void
+sgf_game_reset(sgf_game_t *g)
+{
+	g->size = 19;
+	g->komi = 0;
+	g->has_komi = false;
+	g->handicap = 0;
+	g->rules[0] = g->result[0] = g->black[0] = g->white[0] = 0;
+	g->nsetup = g->nmoves = 0;
+}
+
+static void
+sgf_add(sgf_move_t **moves, int *n, int *alloc, int x, int y, enum stone color)
+{
+	if (*n == *alloc) {
+		*alloc = (*alloc ? *alloc * 2 : 512);
+		*moves = crealloc(*moves, *alloc * sizeof(sgf_move_t));
+	}
+	sgf_move_t *m = &(*moves)[(*n)++];
+	m->x = x;  m->y = y;  m->color = color;
+}
+
+/* sgf point, 'a'..'z' then 'A'..'Z' */
+static int
+sgf_coord(char c)
+{
+	if (c >= 'a' && c <= 'z')  return c - 'a';
+	if (c >= 'A' && c <= 'Z')  return c - 'A' + 26;
+	return -1;
+}
+
+static void
+sgf_copy_value(char *to, size_t len, char *val)
+{
+	size_t n = MIN(strlen(val), len - 1);
+	memcpy(to, val, n);
+	to[n] = 0;
+}
+
+/* Setup stones, handles compressed point lists (rectangles: "aa:cc"). */
+static bool
+sgf_setup(sgf_game_t *g, char *val, enum stone color)
+{
+	if (strlen(val) != 2 && (strlen(val) != 5 || val[2] != ':'))  return false;
+	int x1 = sgf_coord(val[0]), y1 = sgf_coord(val[1]);
+	int x2 = x1, y2 = y1;
+	if (val[2] == ':') {  x2 = sgf_coord(val[3]);  y2 = sgf_coord(val[4]);  }
+	if (x1 < 0 || y1 < 0 || x2 < x1 || y2 < y1)  return false;
+	for (int x = x1; x <= x2; x++)
+		for (int y = y1; y <= y2; y++)
+			sgf_add(&g->setup, &g->nsetup, &g->setup_alloc, x, y, color);
+	return true;
+}
+
+/* Handle property @id value @val. Returns false if game can't be used. */
+static bool
+sgf_property(sgf_game_t *g, char *id, char *val)
+{
+	if (!strcmp(id, "B") || !strcmp(id, "W")) {
+		enum stone color = (id[0] == 'B' ? S_BLACK : S_WHITE);
+		int x = -1, y = -1;	/* pass: "" or "tt" (checked once we know board size) */
+		if (*val) {
+			if (strlen(val) != 2)  return false;
+			x = sgf_coord(val[0]);  y = sgf_coord(val[1]);
+			if (x < 0 || y < 0)  return false;
+		}
+		sgf_add(&g->moves, &g->nmoves, &g->moves_alloc, x, y, color);
+		return true;
+	}
+	if (!strcmp(id, "AB") || !strcmp(id, "AW")) {
+		if (g->nmoves)  return false;	/* Setup stones in the middle of the game, not handled */
+		return sgf_setup(g, val, (id[1] == 'B' ? S_BLACK : S_WHITE));
+	}
+	if (!strcmp(id, "AE"))  return !g->nmoves;
+
+	if      (!strcmp(id, "SZ"))  g->size = atoi(val);
+	else if (!strcmp(id, "KM"))  {  g->komi = atof(val);  g->has_komi = true;  }
+	else if (!strcmp(id, "HA"))  g->handicap = atoi(val);
+	else if (!strcmp(id, "RU"))  sgf_copy_value(g->rules, sizeof(g->rules), val);
+	else if (!strcmp(id, "RE"))  sgf_copy_value(g->result, sizeof(g->result), val);
+	else if (!strcmp(id, "PB"))  sgf_copy_value(g->black, sizeof(g->black), val);
+	else if (!strcmp(id, "PW"))  sgf_copy_value(g->white, sizeof(g->white), val);
+	return true;
+}
+
+/* Read property value (opening '[' already read). Escapes are
+ * resolved, value gets truncated if too long. */
+static bool
+sgf_read_value(FILE *f, char *buf, int len)
+{
+	int n = 0;
+	for (int c = getc(f); c != EOF; c = getc(f)) {
+		if (c == ']') {  buf[n] = 0;  return true;  }
+		if (c == '\\' && (c = getc(f)) == EOF)  break;
+		if (n < len - 1)  buf[n++] = c;
+	}
+	buf[n] = 0;
+	return false;
+}
+
+static int
+sgf_skip_space(FILE *f, int c)
+{
+	while (c != EOF && isspace(c))  c = getc(f);
+	return c;
+}
+
+/* Check moves fit on the board, now that we know board size. */
+static bool
+sgf_check_game(sgf_game_t *g)
+{
+	if (g->size < 1 || g->size > BOARD_MAX_SIZE)  return false;
+	for (int i = 0; i < g->nsetup; i++)
+		if (g->setup[i].x >= g->size || g->setup[i].y >= g->size)  return false;
+	for (int i = 0; i < g->nmoves; i++) {
+		sgf_move_t *m = &g->moves[i];
+		if (m->x == 19 && m->y == 19 && g->size <= 19)  m->x = m->y = -1;  /* "tt" pass */
+		if (m->x >= g->size || m->y >= g->size)  return false;
+	}
+	return true;
+}
+
+bool
+sgf_read_game(FILE *f, sgf_game_t *g, bool *error)
+{
+	sgf_game_reset(g);
+	*error = false;
+
+	/* Find game start */
+	int c;
+	while ((c = getc(f)) != EOF && c != '(')
+		;
+	if (c == EOF)  return false;
+
+	int depth = 1;
+	bool main_line = true;	/* Still in main line ? Rest is skipped once it ends. */
+	char id[8];
+	char val[SGF_VALUE_MAX];
+	while (depth > 0 && (c = getc(f)) != EOF) {
+		if (c == '[') {  if (!sgf_read_value(f, val, sizeof(val)))  break;  continue;  }
+		if (c == '(') {  depth++;  continue;  }
+		if (c == ')') {  depth--;  main_line = false;  continue;  }
+		if (!main_line || !isalpha(c))  continue;
+
+		/* Property, lowercase letters in identifier are ignored (FF[3]) */
+		int n = 0;
+		for (; c != EOF && isalpha(c); c = getc(f))
+			if (isupper(c) && n < (int)sizeof(id) - 1)  id[n++] = c;
+		id[n] = 0;
+		for (c = sgf_skip_space(f, c); c == '['; c = sgf_skip_space(f, getc(f))) {
+			if (!sgf_read_value(f, val, sizeof(val)))  {  c = EOF;  break;  }
+			if (!sgf_property(g, id, val))  *error = true;
+		}
+		if (c == EOF)  break;
+		ungetc(c, f);
+	}
+
+	if (depth > 0)  *error = true;	/* Truncated */
+	if (!*error && !sgf_check_game(g))  *error = true;
+	return true;
+}
+
+move_t
+sgf_move(sgf_move_t *m, int size)
+{
+	coord_t c = (m->x < 0 ? pass : coord_xy(m->x + 1, size - m->y));
+	move_t mv = move(c, m->color);
+	return mv;
+}
+
+
+/**********************************************************************************/
+/* Index */
+
+#define SGF_INDEX_MAGIC  0x5849464753484350ULL	/* "PCHSGFIX" */
+
+typedef struct {
+	uint64_t magic;
+	uint64_t size;		/* sgf file size */
+	int64_t  mtime;		/* and modification time */
+	uint64_t games;
+} sgf_index_header_t;
+
+static void
+sgf_index_add(sgf_index_t *idx, int *alloc, uint64_t offset)
+{
+	if (idx->games == *alloc) {
+		*alloc = (*alloc ? *alloc * 2 : 1024);
+		idx->offsets = crealloc(idx->offsets, *alloc * sizeof(uint64_t));
+	}
+	idx->offsets[idx->games++] = offset;
+}
+
+/* Find start of each game in @f */
+static sgf_index_t *
+sgf_index_scan(FILE *f)
+{
+	sgf_index_t *idx = calloc2(1, sgf_index_t);
+	int alloc = 0;
+	int depth = 0;
+	bool in_value = false;
+	uint64_t offset = 0;
+	for (int c = getc(f); c != EOF; c = getc(f), offset++) {
+		if (in_value) {
+			if (c == '\\') {  if (getc(f) == EOF)  break;  offset++;  }
+			else if (c == ']')  in_value = false;
+			continue;
+		}
+		if (c == '[')  in_value = true;
+		else if (c == '(' && !depth++)  sgf_index_add(idx, &alloc, offset);
+		else if (c == ')' && depth)  depth--;
+	}
+	return idx;
+}
+
+static bool
+sgf_index_read(char *name, struct stat *st, sgf_index_t *idx)
+{
+	FILE *f = fopen(name, "rb");
+	if (!f)  return false;
+
+	sgf_index_header_t h;
+	bool ok = (fread(&h, sizeof(h), 1, f) == 1 && h.magic == SGF_INDEX_MAGIC &&
+		   h.size == (uint64_t)st->st_size && h.mtime == (int64_t)st->st_mtime && h.games < INT32_MAX);
+	if (ok) {
+		idx->games = h.games;
+		idx->offsets = cmalloc((h.games + 1) * sizeof(uint64_t));
+		ok = (fread(idx->offsets, sizeof(uint64_t), h.games, f) == h.games);
+		for (int i = 0; ok && i < idx->games; i++)
+			ok = (idx->offsets[i] < h.size);
+	}
+	fclose(f);
+	if (!ok) {  free(idx->offsets);  idx->offsets = NULL;  idx->games = 0;  }
+	return ok;
+}
+
+/* Written to temp file first, parallel jobs may be indexing the same file. */
+static void
+sgf_index_write(char *name, struct stat *st, sgf_index_t *idx)
+{
+	char tmp[1100];  snprintf(tmp, sizeof(tmp), "%s.%i", name, (int)getpid());
+	FILE *f = fopen(tmp, "wb");
+	if (!f)  return;
+
+	sgf_index_header_t h = { SGF_INDEX_MAGIC, (uint64_t)st->st_size, (int64_t)st->st_mtime, (uint64_t)idx->games };
+	bool ok = (fwrite(&h, sizeof(h), 1, f) == 1 &&
+		   fwrite(idx->offsets, sizeof(uint64_t), idx->games, f) == (size_t)idx->games);
+	ok = (!fclose(f) && ok);
+	if (!ok || rename(tmp, name))  remove(tmp);
+}
+
+sgf_index_t *
+sgf_index(char *filename)
+{
+	FILE *f = fopen(filename, "rb");
+	if (!f)  return NULL;
+	struct stat st;
+	if (fstat(fileno(f), &st)) {  fclose(f);  return NULL;  }
+
+	char name[1024];  snprintf(name, sizeof(name), "%s.idx", filename);
+	sgf_index_t *idx = calloc2(1, sgf_index_t);
+	if (sgf_index_read(name, &st, idx)) {  fclose(f);  return idx;  }
+	free(idx);
+
+	if (DEBUGL(2))  fprintf(stderr, "indexing %s ...\n", filename);
+	idx = sgf_index_scan(f);
+	fclose(f);
+	sgf_index_write(name, &st, idx);
+	return idx;
+}
+
+void
+sgf_index_free(sgf_index_t *idx)
+{
+	if (!idx)  return;
+	free(idx->offsets);
+	free(idx);
+}
+
+bool
+sgf_seek_game(FILE *f, sgf_index_t *idx, int n)
+{
+	if (n < 0 || n >= idx->games)  return false;
+	return !fseeko(f, idx->offsets[n], SEEK_SET);
+}
@@ -0,0 +1,61 @@
+#ifndef PACHI_SGF_H
+#define PACHI_SGF_H
+
+#include <stdio.h>
+#include "move.h"
+
+/* Native sgf reader, for feeding game records to the engine without
+ * going through sgf2gtp and gtp text. Streaming: games are read one
+ * at a time from collections (several games per file). Only the main
+ * line is kept (first variation at each branch). */
+
+/* Move in sgf coordinates: column / row from top left, 0-based.
+ * x = -1 for pass. Board size needed to get actual coord. */
+typedef struct {
+	int8_t  x, y;
+	uint8_t color;
+} sgf_move_t;
+
+typedef struct {
+	int   size;			/* SZ, 19 if missing */
+	float komi;			/* KM */
+	bool  has_komi;
+	int   handicap;			/* HA */
+	char  rules[32];		/* RU, empty if missing */
+	char  result[32];		/* RE */
+	char  black[64], white[64];	/* PB, PW */
+
+	sgf_move_t *setup;		/* AB / AW stones */
+	int         nsetup;
+	sgf_move_t *moves;		/* main line */
+	int         nmoves;
+	int setup_alloc, moves_alloc;
+} sgf_game_t;
+
+void sgf_game_init(sgf_game_t *g);
+void sgf_game_done(sgf_game_t *g);
+
+/* Read next game from @f, returns false at end of file.
+ * @error is set if game is malformed or truncated (caller should skip it). */
+bool sgf_read_game(FILE *f, sgf_game_t *g, bool *error);
+
+/* Board move for sgf move @m. Board statics must be set for @size. */
+move_t sgf_move(sgf_move_t *m, int size);
+
+
+/* Game index for random access into large collections.
+ * Stored in FILE.idx next to the sgf file, rebuilt when sgf file
+ * changes (size / mtime). If it can't be written we just index in
+ * memory every time. */
+typedef struct {
+	int       games;
+	uint64_t *offsets;		/* start of each game in file */
+} sgf_index_t;
+
+sgf_index_t *sgf_index(char *filename);
+void         sgf_index_free(sgf_index_t *idx);
+
+/* Position @f at start of game @n, false if no such game. */
+bool sgf_seek_game(FILE *f, sgf_index_t *idx, int n);
+
+#endif
@@ -2,6 +2,7 @@
 #define PACHI_STATS_H
 
 #include <math.h>
+#include <stdint.h>
 
 /* Move statistics; we track how good value each move has. */
 /* These operations are supposed to be atomic - reasonably
@@ -9,10 +10,22 @@
  * What this means in practice is that perhaps the value will get
  * slightly wrong, but not drastically corrupted. */
 
+/* With LOCKFREE_STATS value and playouts are packed in a single 64-bit word
+ * and updates are done with compare-and-swap instead: no barriers, and both
+ * fields always change together. Needs single precision floating_t. */
+#ifdef LOCKFREE_STATS
+#ifdef DOUBLE_FLOATING
+#error "LOCKFREE_STATS doesn't work with DOUBLE_FLOATING"
+#endif
+#define STATS_ALIGN  __attribute__((aligned(8)))
+#else
+#define STATS_ALIGN
+#endif
+
 typedef struct {
 	floating_t value; // BLACK wins/playouts
 	int playouts; // # of playouts
-} move_stats_t;
+} STATS_ALIGN move_stats_t;
 
 #define move_stats(value, playouts)  { value, playouts }
 
@@ -29,6 +42,45 @@ static void stats_merge(move_stats_t *dest, move_stats_t *src);
 static void stats_reverse_parity(move_stats_t *s);
 
 
+#ifdef LOCKFREE_STATS
+
+typedef uint64_t __attribute__((__may_alias__)) stats_word_t;
+typedef union {
+	move_stats_t s;
+	stats_word_t w;
+} move_stats_word_t;
+
+static inline void
+stats_add_result(move_stats_t *s, floating_t result, int playouts)
+{
+	stats_word_t *p = (stats_word_t *)s;
+	move_stats_word_t old, upd;
+	old.w = __atomic_load_n(p, __ATOMIC_RELAXED);
+	do {
+		upd.s.playouts = old.s.playouts + playouts;
+		upd.s.value = old.s.value + (result - old.s.value) * playouts / upd.s.playouts;
+	} while (!__atomic_compare_exchange_n(p, &old.w, upd.w, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static inline void
+stats_rm_result(move_stats_t *s, floating_t result, int playouts)
+{
+	stats_word_t *p = (stats_word_t *)s;
+	move_stats_word_t old, upd;
+	old.w = __atomic_load_n(p, __ATOMIC_RELAXED);
+	do {
+		if (old.s.playouts > playouts) {
+			upd.s.playouts = old.s.playouts - playouts;
+			upd.s.value = old.s.value + (old.s.value - result) * playouts / upd.s.playouts;
+		} else {  /* Keep value, see non lock-free version below. */
+			upd.s.value = old.s.value;
+			upd.s.playouts = 0;
+		}
+	} while (!__atomic_compare_exchange_n(p, &old.w, upd.w, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+#else /* !LOCKFREE_STATS */
+
 /* We actually do the atomicity in a pretty hackish way - we simply
  * rely on the fact that int,floating_t operations should be atomic with
  * reasonable compilers (gcc) on reasonable architectures (i386,
@@ -37,42 +89,41 @@ static void stats_reverse_parity(move_stats_t *s);
  * our value must be already correct, otherwise the node will receive
  * invalid evaluation if that's made in parallel, esp. when
  * current s->playouts is zero. */
+/* Acquire / release ordering is all we need for that: free on x86,
+ * much cheaper than full barriers on ARM (ldar / stlr vs dmb). */
 
 static inline void
 stats_add_result(move_stats_t *s, floating_t result, int playouts)
 {
-	int s_playouts = s->playouts;
-	floating_t s_value = s->value;
 	/* Force the load, another thread can work on the
-	 * values in parallel. */
-	__sync_synchronize(); /* full memory barrier */
+	 * values in parallel. Value is read after playouts. */
+	int s_playouts = __atomic_load_n(&s->playouts, __ATOMIC_ACQUIRE);
+	floating_t s_value = s->value;
 
 	s_playouts += playouts;
 	s_value += (result - s_value) * playouts / s_playouts;
 
-	/* We rely on the fact that these two assignments are atomic. */
+	/* We rely on the fact that these two assignments are atomic.
+	 * Value is visible before playouts. */
 	s->value = s_value;
-	__sync_synchronize(); /* full memory barrier */
-	s->playouts = s_playouts;
+	__atomic_store_n(&s->playouts, s_playouts, __ATOMIC_RELEASE);
 }
 
 static inline void
 stats_rm_result(move_stats_t *s, floating_t result, int playouts)
 {
-	if (s->playouts > playouts) {
-		int s_playouts = s->playouts;
-		floating_t s_value = s->value;
+	int s_playouts = __atomic_load_n(&s->playouts, __ATOMIC_ACQUIRE);
+	if (s_playouts > playouts) {
 		/* Force the load, another thread can work on the
 		 * values in parallel. */
-		__sync_synchronize(); /* full memory barrier */
+		floating_t s_value = s->value;
 
 		s_playouts -= playouts;
 		s_value += (s_value - result) * playouts / s_playouts;
 
 		/* We rely on the fact that these two assignments are atomic. */
 		s->value = s_value;
-		__sync_synchronize(); /* full memory barrier */
-		s->playouts = s_playouts;
+		__atomic_store_n(&s->playouts, s_playouts, __ATOMIC_RELEASE);
 
 	} else {
 		/* We don't touch the value, since in parallel, another
@@ -84,6 +135,8 @@ stats_rm_result(move_stats_t *s, floating_t result, int playouts)
 	}
 }
 
+#endif /* LOCKFREE_STATS */
+
 static inline void
 stats_merge(move_stats_t *dest, move_stats_t *src)
 {
@@ -11,12 +11,15 @@
 #define USE_STD_DEVIATION 1
 //#define USE_MEAN_ABS_DEVIATION 1
 
+/* Std deviation is computed from sum of squares so stats from
+ * different runs can be merged exactly. Mean absolute deviation
+ * uses running average, merged stats are approximate. */
 #ifdef USE_STD_DEVIATION
-  #define DEVIATION_TERM(val, avg)      ( (val - avg) * (val - avg) )
-  #define DEVIATION(sq_devs_sum, total) ( sqrt(sq_devs_sum / total) )
+  #define DEVIATION_TERM(val, avg)           ( (val) * (val) )
+  #define DEVIATION(sq_sum, avg, total)      ( sqrt(fmax(sq_sum / total - (avg) * (avg), 0)) )
 #else /* Mean absolute deviation */
-  #define DEVIATION_TERM(val, avg)      ( fabs(val - avg) )
-  #define DEVIATION(devs_sum, total)    ( devs_sum / total )
+  #define DEVIATION_TERM(val, avg)           ( fabs(val - avg) )
+  #define DEVIATION(devs_sum, avg, total)    ( devs_sum / total )
 #endif
 
 #define PREDICT_TOPN 20
@@ -26,6 +29,25 @@
 
 static char *stars = "****************************************************************************************************";
 
+typedef struct {
+	int    total;				/* Positions */
+	int    games;
+	double time;				/* Wall time since first position */
+
+	int    guessed_move[PREDICT_MOVE_MAX/10];	/* Stats by move number */
+	int    total_move[PREDICT_MOVE_MAX/10];
+	double probs_sum[PREDICT_TOPN];		/* Average values */
+	double devs_sum[PREDICT_TOPN];
+	double log_probs_sum[PREDICT_TOPN];	/* Average log values */
+	double log_devs_sum[PREDICT_TOPN];
+	int    guessed_by_prob[PREDICT_PROBS];	/* Check probabilities */
+	int    total_by_prob[PREDICT_PROBS];
+	int    guessed_top[PREDICT_TOPN];	/* Topn stats */
+} predict_stats_t;
+
+static predict_stats_t stats = { 0, };
+static double start_time = 0;
+
 
 /* Make average + deviation diagram */
 static void
@@ -91,7 +113,7 @@ collect_topn_stats(move_t *m, coord_t *best_c, int *guessed_top)
 }
 
 static void
-collect_avg_val(int i, float val, float prob_max, float *probs_sum, float *devs_sum, int total)
+collect_avg_val(int i, float val, float prob_max, double *probs_sum, double *devs_sum, int total)
 {
 	if (!(0 <= val && val <= prob_max)) {
 		fprintf(stderr, "predict: prob for top%i not in [0.0 - %.1f]: %.2f\n", 
@@ -99,12 +121,11 @@ collect_avg_val(int i, float val, float prob_max, float *probs_sum, float *devs_
 		assert(0);
 	}
 	probs_sum[i] += val;
-	float avg = probs_sum[i] / total;
-	devs_sum[i] += DEVIATION_TERM(val, avg);
+	devs_sum[i] += DEVIATION_TERM(val, probs_sum[i] / total);
 }
 
 static void
-collect_avg_stats(float *best_r, float *probs_sum, float *devs_sum, int total)
+collect_avg_stats(float *best_r, double *probs_sum, double *devs_sum, int total)
 {
 	for (int i = 0; i < PREDICT_TOPN; i++)
 		collect_avg_val(i, best_r[i], PROB_MAX, probs_sum, devs_sum, total);
@@ -113,7 +134,7 @@ collect_avg_stats(float *best_r, float *probs_sum, float *devs_sum, int total)
 #define RESCALE_LOG(p)  (log(1 + p * 1000))
 
 static void
-collect_avg_log_stats(float *best_r, float *probs_sum, float *devs_sum, int total)
+collect_avg_log_stats(float *best_r, double *probs_sum, double *devs_sum, int total)
 {
 	for (int i = 0; i < PREDICT_TOPN; i++)
 		collect_avg_val(i, RESCALE_LOG(best_r[i]), RESCALE_LOG(PROB_MAX), probs_sum, devs_sum, total);
@@ -153,12 +174,12 @@ print_predict_move_stats_short(strbuf_t *buf, int *guessed_move, int *total_move
 
 static void
 print_avg_stats(strbuf_t *buf, char *title, int scale,
-		float prob_max, float *probs_sum, float *devs_sum, int total)
+		float prob_max, double *probs_sum, double *devs_sum, int total)
 {
 	sbprintf(buf, "%s\n", title);
 	for (int i = 0; i < PREDICT_TOPN; i++) {
 		float avg = probs_sum[i] / total;
-		float dev = DEVIATION(devs_sum[i], total);
+		float dev = DEVIATION(devs_sum[i], avg, total);
 		char diag[scale];
 		avg_dev_diagram(diag, sizeof(diag), avg, dev, prob_max);
 		
@@ -210,55 +231,152 @@ print_prob_stats(strbuf_t *buf, int *guessed_by_prob, int *total_by_prob)
 }
 
 
+static void
+print_speed_stats(strbuf_t *buf, predict_stats_t *st)
+{
+	sbprintf(buf, "Positions: %i  (%.1f positions/s)", st->total,
+		 (st->time > 0 ? st->total / st->time : 0));
+}
+
+static char *
+predict_stats_str(predict_stats_t *st)
+{
+	strbuf_t strbuf;
+	strbuf_t *buf = strbuf_init_alloc(&strbuf, 16384);
+	int total = st->total;
+
+	sbprintf(buf, " \n");
+	print_predict_move_stats(buf, st->guessed_move, st->total_move);
+	print_predict_move_stats_short(buf, st->guessed_move, st->total_move);
+	print_prob_stats(buf, st->guessed_by_prob, st->total_by_prob);
+	print_avg_stats(buf, "Average log values:", 50, RESCALE_LOG(PROB_MAX), st->log_probs_sum, st->log_devs_sum, total);
+	print_avg_stats(buf, "Average values:",     50, PROB_MAX,              st->probs_sum,     st->devs_sum,     total);
+	print_topn_stats(buf, st->guessed_top, total, st->games);
+	print_speed_stats(buf, st);
+	return buf->str;
+}
+
 static char *
 predict_stats(board_t *b, move_t *m, coord_t *best_c, float *best_r, int games)
 {
-	static int total_ = 0;
-	int total = ++total_;
+	predict_stats_t *st = &stats;
+	int total = ++st->total;
+	st->games = games;
+	st->time = time_now() - start_time;
 
-	/* Stats by move number */
-	static int guessed_move[PREDICT_MOVE_MAX/10] = {0, };
-	static int total_move[PREDICT_MOVE_MAX/10] = {0, };
-	collect_move_stats(b, m, best_c, guessed_move, total_move);
+	collect_move_stats(b, m, best_c, st->guessed_move, st->total_move);
 
-	/* Average values */
 	/* Assumes properly scaled probs in [0.0 - PROB_MAX] */
-	static float probs_sum[PREDICT_TOPN] = {0, };
-	static float devs_sum[PREDICT_TOPN] = {0, };
-	collect_avg_stats(best_r, probs_sum, devs_sum, total);
-
-	/* Average log values */
-	static float log_probs_sum[PREDICT_TOPN] = {0, };
-	static float log_devs_sum[PREDICT_TOPN] = {0, };
-	collect_avg_log_stats(best_r, log_probs_sum, log_devs_sum, total);
+	collect_avg_stats(best_r, st->probs_sum, st->devs_sum, total);
+	collect_avg_log_stats(best_r, st->log_probs_sum, st->log_devs_sum, total);
 
-	/* Check Probabilities */
+	collect_prob_stats(m, best_c, best_r, st->guessed_by_prob, st->total_by_prob);
+	collect_topn_stats(m, best_c, st->guessed_top);
 
-	static int guessed_by_prob[PREDICT_PROBS] = {0, };
-	static int total_by_prob[PREDICT_PROBS] = {0, };
-	collect_prob_stats(m, best_c, best_r, guessed_by_prob, total_by_prob);
+	/* Dump stats from time to time */
+	if (total % 200 == 0)
+		return predict_stats_str(st);
+	return NULL;
+}
 
-	/* Topn stats */
-	static int guessed_top[PREDICT_TOPN] = {0, };
-	collect_topn_stats(m, best_c, guessed_top);
 
+/* Raw stats file: one "name values..." line per field. */
+
+#define foreach_stats_field(st, f) do {  \
+	f(st, "total",           int,    &(st)->total, 1);  \
+	f(st, "games",           int,    &(st)->games, 1);  \
+	f(st, "time",            double, &(st)->time,  1);  \
+	f(st, "guessed_move",    int,    (st)->guessed_move,    PREDICT_MOVE_MAX/10);  \
+	f(st, "total_move",      int,    (st)->total_move,      PREDICT_MOVE_MAX/10);  \
+	f(st, "probs_sum",       double, (st)->probs_sum,       PREDICT_TOPN);  \
+	f(st, "devs_sum",        double, (st)->devs_sum,        PREDICT_TOPN);  \
+	f(st, "log_probs_sum",   double, (st)->log_probs_sum,   PREDICT_TOPN);  \
+	f(st, "log_devs_sum",    double, (st)->log_devs_sum,    PREDICT_TOPN);  \
+	f(st, "guessed_by_prob", int,    (st)->guessed_by_prob, PREDICT_PROBS);  \
+	f(st, "total_by_prob",   int,    (st)->total_by_prob,   PREDICT_PROBS);  \
+	f(st, "guessed_top",     int,    (st)->guessed_top,     PREDICT_TOPN);  \
+} while (0)
+
+#define save_field(st, name, type, vals, n)  do {  \
+	fprintf(f, "%s", name);  \
+	for (int i_ = 0; i_ < (n); i_++)  \
+		fprintf(f, " %.17g", (double)(vals)[i_]);  \
+	fprintf(f, "\n");  \
+} while (0)
+
+bool
+predict_stats_save(char *filename)
+{
+	FILE *f = fopen(filename, "w");
+	if (!f)  {  perror(filename);  return false;  }
+	foreach_stats_field(&stats, save_field);
+	fclose(f);
+	return true;
+}
 
-	/* Dump stats from time to time */
-	if (total % 200 == 0) {
-		strbuf_t strbuf;
-		strbuf_t *buf = strbuf_init_alloc(&strbuf, 16384);
-
-		sbprintf(buf, " \n");
-		print_predict_move_stats(buf, guessed_move, total_move);
-		print_predict_move_stats_short(buf, guessed_move, total_move);
-		print_prob_stats(buf, guessed_by_prob, total_by_prob);
-		print_avg_stats(buf, "Average log values:", 50, RESCALE_LOG(PROB_MAX), log_probs_sum, log_devs_sum, total);
-		print_avg_stats(buf, "Average values:",     50, PROB_MAX,              probs_sum,     devs_sum,     total);
-		print_topn_stats(buf, guessed_top, total, games);
-		
-		return buf->str;
+/* Add stats from file @filename to @st. Times are wall times of
+ * runs made in parallel, keep the longest. */
+#define merge_field(st, name, type, vals, n)  do {  \
+	if (strcmp(key, name))  break;  \
+	char *s_ = line + strlen(name);  \
+	for (int i_ = 0; i_ < (n); i_++) {  \
+		char *end_;  \
+		double v_ = strtod(s_, &end_);  \
+		if (end_ == s_)  {  ok = false;  break;  }  \
+		s_ = end_;  \
+		if (!strcmp(name, "time"))  (vals)[i_] = fmax((vals)[i_], v_);  \
+		else                        (vals)[i_] += (type)v_;  \
+	}  \
+	found = true;  \
+} while (0)
+
+static bool
+predict_stats_add(predict_stats_t *st, char *filename)
+{
+	FILE *f = fopen(filename, "r");
+	if (!f)  {  perror(filename);  return false;  }
+
+	bool ok = true;
+	char line[8192];
+	while (ok && fgets(line, sizeof(line), f)) {
+		char key[64];
+		if (sscanf(line, "%63s", key) != 1)  continue;
+		bool found = false;
+		foreach_stats_field(st, merge_field);
+		if (!found)  ok = false;
 	}
-	return NULL;
+	fclose(f);
+	if (!ok)  fprintf(stderr, "%s: bad predict stats file\n", filename);
+	return ok;
+}
+
+char *
+predict_stats_merge(char **files, int n)
+{
+	predict_stats_t st;
+	memset(&st, 0, sizeof(st));
+	for (int i = 0; i < n; i++)
+		if (!predict_stats_add(&st, files[i]))
+			return NULL;
+	if (!st.total)  return NULL;
+	return predict_stats_str(&st);
+}
+
+char *
+predict_stats_report(void)
+{
+	if (!stats.total)  return NULL;
+	return predict_stats_str(&stats);
+}
+
+/* Engine must know about moves played, uct keeps its tree after
+ * best_moves() and promotes it on next play. */
+static void
+notify_play(board_t *b, engine_t *e, move_t *m)
+{
+	bool print = false;
+	if (e->notify_play)
+		e->notify_play(e, b, m, NULL, &print);
 }
 
 char *
@@ -267,10 +385,12 @@ predict_move(board_t *b, engine_t *e, time_info_t *ti, move_t *m, int games)
 	enum stone color = m->color;
 	
 	if (m->coord == pass || m->coord == resign) {
+		notify_play(b, e, m);
 		int r = board_play(b, m);  assert(r >= 0);
 		return NULL;
 	}
 
+	if (!stats.total && !start_time)  start_time = time_now();
 	if (DEBUGL(5))  fprintf(stderr, "predict move %d,%d,%d\n", m->color, coord_x(m->coord), coord_y(m->coord));
 	if (DEBUGL(1) && debug_boardprint)  engine_board_print(e, b, stderr);
 
@@ -285,6 +405,7 @@ predict_move(board_t *b, engine_t *e, time_info_t *ti, move_t *m, int games)
 	//print_dcnn_best_moves(b, best_c, best_r, PREDICT_TOPN);
 
 	// Play correct expected move
+	notify_play(b, e, m);
 	if (board_play(b, m) < 0)
 		die("ILLEGAL EXPECTED MOVE: [%s, %s]\n", coord2sstr(m->coord), stone2str(m->color));
 
@@ -5,4 +5,15 @@
  * Returned string must be freed */
 char *predict_move(board_t *b, engine_t *e, time_info_t *ti, move_t *m, int games);
 
+/* Full stats report for positions seen so far, NULL if none.
+ * Returned string must be freed */
+char *predict_stats_report(void);
+
+/* Save raw stats to @filename, for merging stats of parallel runs. */
+bool  predict_stats_save(char *filename);
+
+/* Report for stats saved by predict_stats_save() in @files, combined.
+ * NULL on error. Returned string must be freed */
+char *predict_stats_merge(char **files, int n);
+
 #endif
@@ -0,0 +1,64 @@
+#define DEBUG
+#include <assert.h>
+#include "board.h"
+#include "debug.h"
+#include "timeinfo.h"
+#include "engine.h"
+#include "t-predict/review.h"
+
+/* Game review: for each move of a game record get engine's best moves
+ * and how the actual move compares. Output is one line per move:
+ *
+ *   <move> <color> <played> <best> <best_value> <played_value> <rank>
+ *
+ * Values are whatever engine's best_moves() returns (winrates for uct).
+ * If played move isn't among the candidates its value is '-' and rank 0,
+ * otherwise rank 1 is best move. Passes are just played. */
+
+#define REVIEW_TOPN 10
+
+static void
+review_play(board_t *b, engine_t *e, move_t *m)
+{
+	/* Notify engine first, that's how uct promotes the tree. */
+	bool print = false;
+	if (e->notify_play)
+		e->notify_play(e, b, m, NULL, &print);
+	if (board_play(b, m) < 0)
+		die("ILLEGAL EXPECTED MOVE: [%s, %s]\n", coord2sstr(m->coord), stone2str(m->color));
+}
+
+char *
+review_move(board_t *b, engine_t *e, time_info_t *ti, move_t *m)
+{
+	enum stone color = m->color;
+
+	if (is_pass(m->coord) || is_resign(m->coord)) {
+		review_play(b, e, m);
+		return NULL;
+	}
+
+	float   best_r[REVIEW_TOPN];
+	coord_t best_c[REVIEW_TOPN];
+	for (int i = 0; i < REVIEW_TOPN; i++)
+		best_c[i] = pass;
+	time_info_t *ti_genmove = time_info_genmove(b, ti, color);
+	engine_best_moves(e, b, ti_genmove, color, best_c, best_r, REVIEW_TOPN);
+
+	int rank = 0;
+	for (int i = 0; i < REVIEW_TOPN && !rank; i++)
+		if (best_c[i] == m->coord)
+			rank = i + 1;
+
+	int move = b->moves + 1;
+	review_play(b, e, m);
+
+	char *str = cmalloc(64);
+	char played_val[16] = "-";
+	if (rank)  snprintf(played_val, sizeof(played_val), "%.3f", best_r[rank - 1]);
+	snprintf(str, 64, "%i %s %s %s %.3f %s %i", move,
+		 (color == S_BLACK ? "b" : "w"), coord2sstr(m->coord),
+		 coord2sstr(best_c[0]), best_r[0], played_val, rank);
+	if (DEBUGL(2))  fprintf(stderr, "review: %s\n", str);
+	return str;
+}
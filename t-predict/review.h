@@ -0,0 +1,9 @@
+#ifndef PACHI_PREDICT_REVIEW_H
+#define PACHI_PREDICT_REVIEW_H
+
+/* Search position before move m and play it, returns one line of results.
+ * Engine gets notified of the move so search tree carries over to the
+ * next position. Returned string must be freed */
+char *review_move(board_t *b, engine_t *e, time_info_t *ti, move_t *m);
+
+#endif
@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# perf-session: Performance regression check with recorded gtp sessions
+#
+# Usage: perf-session.sh record FILENAME.sgf SESSION
+#        perf-session.sh replay SESSION
+#
+# record: Search every position of a game record (genmove before each
+# move, undone, then game move is played), saving gtp session to SESSION.
+# replay: Replay SESSION with the current Pachi, searches get the playouts
+# they had in the recording. Time differences are shown per command and
+# in total.
+#
+# Pass any extra Pachi parameters in PACHIARGS. E.g.
+#	PACHIARGS='-t 5 threads=1' perf-session.sh record ...
+# Use threads=1 for searches that come out identical.
+
+die()  {  echo "$@" >&2;  exit 1;  }
+
+case "$1" in
+    record)
+	sgf="$2";  session="$3"
+	[ -n "$sgf" ] && [ -n "$session" ] || die "usage: $0 record FILENAME.sgf SESSION"
+	tools/sgf2gtp.pl < "$sgf" |
+	    awk '/^play/ { print "genmove " $2;  print "undo" }  { print }' |
+	    ./pachi -d0 $PACHIARGS --record "$session" >/dev/null
+	;;
+    replay)
+	session="$2"
+	[ -n "$session" ] || die "usage: $0 replay SESSION"
+	./pachi -d0 $PACHIARGS --replay "$session" >/dev/null
+	;;
+    *)
+	die "usage: $0 record FILENAME.sgf SESSION | replay SESSION"
+	;;
+esac
@@ -0,0 +1,322 @@
+#define DEBUG
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "board.h"
+#include "debug.h"
+#include "engine.h"
+#include "timeinfo.h"
+#include "dcnn.h"
+#include "uct/internal.h"
+#include "uct/tree.h"
+#include "t-unit/bench.h"
+
+
+/* Search benchmark: fixed seed single-thread uct searches on reference
+ * positions, so that results only depend on build and machine.
+ * Each position gets two genmoves (second one reuses the tree, and
+ * tree gc kicks in as tree size is limited). */
+
+#define BENCH_THRESHOLD  0.25
+#define BENCH_MAX        256
+
+#define BENCH_ENGINE_ARGS  "threads=1,force_seed=1234,max_tree_size=64,no_tbook"
+
+typedef struct {
+	char *name;
+	int   size;
+	int   games;	/* per genmove */
+	char *moves;	/* black first */
+} bench_position_t;
+
+static bench_position_t positions[] = {
+	{ "9x9-empty",     9, 20000, "" },
+	{ "9x9-midgame",   9, 20000, "F3 F4 E4 G3 E3 F5 G2 E5 D5 D6 C6 C5 D4 C7 B6 D7 B7 B8 G4 H5 G5 G6 H3 H4" },
+	{ "9x9-ko",        9, 20000, "E6 F6 D5 E5 E4 F4 C6 G5 C4 G6 C3 G4 F5" },
+	{ "9x9-endgame",   9, 20000, "D4 E6 C6 C7 B7 D7 B8 F4 F3 G3 E3 G4 F8 H7 E7 D6 F6 C5 E5 D5 E4 C4 C3 B3 B6 F7 G7 F5 C2 G6 F7 B2 D2 B5 H6 F2 E2 H5 G5 H2 A5 D8 H4 G6" },
+	{ "19x19-empty",  19,  5000, "" },
+	{ "19x19-midgame",19,  5000, "Q4 D16 Q17 D4 C6 F3 B4 C3 C9 Q15 R15 R14 R16 Q14 O17 R10 C14 F17 B16 C17 C11 O3 M3 R3 R4 Q3 P4 O2 N5 M2 L2 L3 K3 L4 N2 M4 M1 N3 M2 N4 S3 S2 S4 O5 O6 P6 O7 P7 O8 P8 P9 Q9 P10 O9 N9 O10 P11 N6 P5 O4" },
+	{ NULL }
+};
+
+/* Results for one position */
+typedef struct {
+	double time;
+	long   games;
+	size_t nodes;
+	double gc_time;
+	long   expand_races;
+	int    dcnn_evals;
+} bench_result_t;
+
+/* Node bytes allocated so far by tree (including what gc reclaimed) */
+#define tree_allocated(t)  ((t)->nodes_size + (t)->gc_freed)
+
+static coord_t
+bench_search(engine_t *e, board_t *b, enum stone color, int games, bench_result_t *r)
+{
+	uct_t *u = (uct_t*)e->data;
+	tree_t *t = u->t;
+	size_t allocated = (t ? tree_allocated(t) : 0);
+	double gc_time = (t ? t->gc_time : 0);
+	long played = u->games_played;
+	long races = u->expand_races;
+	int evals = dcnn_eval_count();
+
+	time_info_t ti;
+	char buf[32];  sprintf(buf, "=%d", games);
+	if (!time_parse(&ti, buf))  die("bench: bad games count %d\n", games);
+
+	double start = time_now();
+	coord_t c = e->genmove(e, b, &ti, color, false);
+	r->time += time_now() - start;
+
+	t = u->t;
+	if (t) {  /* Tree is reused, unless reset */
+		size_t now = tree_allocated(t);
+		r->nodes += (now >= allocated ? now - allocated : now) / TREE_NODE_SIZE;
+		r->gc_time += (t->gc_time >= gc_time ? t->gc_time - gc_time : t->gc_time);
+	}
+	r->games += u->games_played - played;
+	r->expand_races += u->expand_races - races;
+	r->dcnn_evals += dcnn_eval_count() - evals;
+	return c;
+}
+
+static void
+bench_genmove(engine_t *e, board_t *b, enum stone color, int games, bench_result_t *r)
+{
+	coord_t c = bench_search(e, b, color, games, r);
+	if (!is_resign(c)) {
+		move_t m = move(c, color);
+		if (board_play(b, &m) < 0)
+			die("bench: engine played illegal move %s\n", coord2sstr(c));
+	}
+}
+
+/* Board for position @p, returns color to play. */
+static board_t *
+bench_board(bench_position_t *p, enum stone *to_play)
+{
+	board_t *b = board_new(p->size, NULL);
+	b->komi = 7.5;
+
+	enum stone color = S_BLACK;
+	char *moves = strdup(p->moves);
+	for (char *s = strtok(moves, " "); s; s = strtok(NULL, " ")) {
+		move_t m = move(str2coord(s), color);
+		if (board_play(b, &m) < 0)
+			die("bench: %s: illegal move %s\n", p->name, s);
+		color = stone_other(color);
+	}
+	free(moves);
+	*to_play = color;
+	return b;
+}
+
+static void
+bench_position(bench_position_t *p, char *engine_args, bench_result_t *r)
+{
+	memset(r, 0, sizeof(*r));
+	enum stone color;
+	board_t *b = bench_board(p, &color);
+
+	engine_t e;  engine_init(&e, E_UCT, engine_args, b);
+	for (int i = 0; i < 2; i++) {
+		bench_genmove(&e, b, color, p->games, r);
+		color = stone_other(color);
+	}
+	engine_done(&e);
+	board_delete(&b);
+}
+
+/* Single search from position @p, returns best move. */
+static coord_t
+bench_position_search(bench_position_t *p, char *engine_args, int games, bench_result_t *r)
+{
+	memset(r, 0, sizeof(*r));
+	enum stone color;
+	board_t *b = bench_board(p, &color);
+
+	engine_t e;  engine_init(&e, E_UCT, engine_args, b);
+	coord_t c = bench_search(&e, b, color, games, r);
+	engine_done(&e);
+	board_delete(&b);
+	return c;
+}
+
+/* Baseline entries: "value key" lines, like t-unit/bench.ref */
+static int
+read_baseline(char *filename, char **keys, double *vals)
+{
+	FILE *f = (filename ? fopen(filename, "r") : NULL);
+	int n = 0;
+	if (!f)  return 0;
+	char buf[256], key[256];
+	double v;
+	while (n < BENCH_MAX && fgets(buf, sizeof(buf), f))
+		if (sscanf(buf, "%lf %255[^\n]", &v, key) == 2) {
+			keys[n] = strdup(key);  vals[n++] = v;
+		}
+	fclose(f);
+	return n;
+}
+
+/* Compare with baseline, rates must not get slower, node size must
+ * not grow. Other values are informative. */
+static bool
+compare(char *key, double v, char **keys, double *vals, int nbase)
+{
+	int j;
+	for (j = 0; j < nbase && strcmp(keys[j], key); j++)
+		;
+	if (j == nbase || !vals[j]) {  printf("\n");  return true;  }
+
+	double diff = (v - vals[j]) / vals[j];
+	bool rate = !strcmp(key + strlen(key) - 2, "/s");
+	bool worse = ((rate && diff < -BENCH_THRESHOLD) ||
+		      (strstr(key, "bytes/node") && diff > 0));
+	printf("   baseline %12.0f  %+4.0f%%%s\n", vals[j], diff * 100, (worse ? "  WORSE" : ""));
+	return !worse;
+}
+
+typedef struct {
+	FILE   *out;
+	FILE   *base;
+	char   *keys[BENCH_MAX];
+	double  vals[BENCH_MAX];
+	int     nbase;
+	bool    ok;
+} bench_output_t;
+
+static void
+bench_output_init(bench_output_t *o, char *filename, char *baseline, char *args)
+{
+	memset(o, 0, sizeof(*o));
+	o->nbase = read_baseline(baseline, o->keys, o->vals);
+	o->out = fopen(filename, "w");
+	if (!o->out)  die("%s: couldn't open\n", filename);
+	o->base = (baseline ? fopen(baseline, "a") : NULL);
+	o->ok = true;
+	fprintf(o->out, "# pachi --bench, engine args: %s\n", args);
+}
+
+static int
+bench_output_done(bench_output_t *o)
+{
+	fclose(o->out);
+	if (o->base)  fclose(o->base);
+	for (int j = 0; j < o->nbase; j++)
+		free(o->keys[j]);
+	return (o->ok ? 0 : 1);
+}
+
+/* Write stat, show it and compare with baseline */
+static void
+bench_stat(bench_output_t *o, char *prefix, char *name, double val)
+{
+	char key[256];
+	snprintf(key, sizeof(key), "%s %s", prefix, name);
+	fprintf(o->out, "%.0f %s\n", val, key);
+	printf("  %-16s %12.0f", name, val);
+	if (!compare(key, val, o->keys, o->vals, o->nbase))
+		o->ok = false;
+
+	/* Add new entries to baseline */
+	int j;
+	for (j = 0; j < o->nbase && strcmp(o->keys[j], key); j++)
+		;
+	if (o->base && j == o->nbase)
+		fprintf(o->base, "%.0f %s\n", val, key);
+}
+
+static void
+bench_args(char *args, int size, char *engine_args)
+{
+	snprintf(args, size, "%s%s%s", BENCH_ENGINE_ARGS, (*engine_args ? "," : ""), engine_args);
+}
+
+int
+pachi_bench(char *filename, char *baseline, char *engine_args)
+{
+	char args[1024];
+	bench_args(args, sizeof(args), engine_args);
+	bench_output_t o;
+	bench_output_init(&o, filename, baseline, args);
+
+	for (bench_position_t *p = positions; p->name; p++) {
+		bench_result_t r;
+		bench_position(p, args, &r);
+
+		printf("%s:\n", p->name);
+		bench_stat(&o, p->name, "games",        r.games);
+		bench_stat(&o, p->name, "playouts/s",   r.games / r.time);
+		bench_stat(&o, p->name, "nodes",        r.nodes);
+		bench_stat(&o, p->name, "nodes/s",      r.nodes / r.time);
+		bench_stat(&o, p->name, "bytes/node",   TREE_NODE_SIZE);
+		bench_stat(&o, p->name, "gc_ms",        r.gc_time * 1000);
+		bench_stat(&o, p->name, "dcnn_evals/s", r.dcnn_evals / r.time);
+	}
+
+	return bench_output_done(&o);
+}
+
+
+/* Thread scaling: same positions and budgets searched with 1, 2, 4 ...
+ * @max_threads threads, for each thread model. Reports playouts/s,
+ * scaling efficiency (playouts/s per thread relative to 1 thread),
+ * expansion races per 1000 games (threads meeting on the same leaf,
+ * contention indicator) and best move agreement with a reference
+ * search (single thread, BENCH_REF_GAMES times the budget). */
+
+#define BENCH_REF_GAMES 4
+
+static char *thread_models[] = { "tree", "treevl", NULL };
+
+int
+pachi_bench_threads(char *filename, char *baseline, int max_threads, char *engine_args)
+{
+	char args[1024];
+	bench_args(args, sizeof(args), engine_args);
+	bench_output_t o;
+	bench_output_init(&o, filename, baseline, args);
+
+	int npos = 0;
+	coord_t ref[BENCH_MAX];
+	for (bench_position_t *p = positions; p->name; p++, npos++) {
+		bench_result_t r;
+		ref[npos] = bench_position_search(p, args, p->games * BENCH_REF_GAMES, &r);
+		if (DEBUGL(1))  fprintf(stderr, "bench: %s reference move %s\n", p->name, coord2sstr(ref[npos]));
+	}
+
+	for (char **model = thread_models; *model; model++) {
+		double pps1 = 0;
+		for (int threads = 1; threads <= max_threads; threads *= 2) {
+			char targs[1100];
+			snprintf(targs, sizeof(targs), "%s,threads=%i,thread_model=%s", args, threads, *model);
+
+			long games = 0, races = 0;
+			double time = 0;
+			int agree = 0, i = 0;
+			for (bench_position_t *p = positions; p->name; p++, i++) {
+				bench_result_t r;
+				coord_t c = bench_position_search(p, targs, p->games, &r);
+				games += r.games;  races += r.expand_races;  time += r.time;
+				agree += (c == ref[i]);
+			}
+
+			double pps = games / time;
+			if (threads == 1)  pps1 = pps;
+			char prefix[64];  sprintf(prefix, "%s t%i", *model, threads);
+			printf("%s:\n", prefix);
+			bench_stat(&o, prefix, "playouts/s",    pps);
+			bench_stat(&o, prefix, "efficiency%",   pps * 100 / (pps1 * threads));
+			bench_stat(&o, prefix, "races/1000",    races * 1000.0 / games);
+			bench_stat(&o, prefix, "agreement%",    agree * 100.0 / npos);
+		}
+	}
+
+	return bench_output_done(&o);
+}
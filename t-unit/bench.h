@@ -0,0 +1,12 @@
+#ifndef PACHI_T_UNIT_BENCH_H
+#define PACHI_T_UNIT_BENCH_H
+
+/* search benchmark: results go to @filename, compared with @baseline
+ * if not NULL (missing entries get added). returns non-zero if slower. */
+int pachi_bench(char *filename, char *baseline, char *engine_args);
+
+/* thread scaling benchmark: 1, 2, 4 ... @max_threads threads for each
+ * thread model, same output / baseline handling as pachi_bench() */
+int pachi_bench_threads(char *filename, char *baseline, int max_threads, char *engine_args);
+
+#endif
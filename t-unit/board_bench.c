@@ -0,0 +1,239 @@
+#define DEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "board.h"
+#include "board_undo.h"
+#include "debug.h"
+#include "random.h"
+#include "timeinfo.h"
+#include "pattern3.h"
+#include "version.h"
+
+/* Board primitives micro-benchmarks: ns/op for board_play(), quick_play()
+ * + quick_undo(), board_copy(), board_play_random(), scoring and pattern3
+ * hashes over recorded games (regtest.gtp format: boardsize / clear_board /
+ * play lines on stdin), for each board size. Results go to stderr as csv:
+ *
+ *   git,size,op,ns/op,ops
+ *
+ * Usage: tunit board_bench [REPS]   (see 'make bench_board') */
+
+#define SNAPSHOT_EVERY  10	/* Keep one position every n moves */
+
+typedef struct {
+	int     size;
+	int     nmoves;
+	move_t *moves;
+	char  (*coords)[8];	/* as read, str2coord() needs board size */
+} bench_game_t;
+
+static int        ngames = 0;
+static bench_game_t *games = NULL;
+
+static bench_game_t *
+new_game(int size)
+{
+	games = crealloc(games, (ngames + 1) * sizeof(*games));
+	bench_game_t *g = &games[ngames++];
+	g->size = size;
+	g->nmoves = 0;
+	g->moves = NULL;
+	g->coords = NULL;
+	return g;
+}
+
+static void
+read_games(void)
+{
+	char buf[4096];
+	int size = 19;
+	bench_game_t *g = NULL;
+	while (fgets(buf, sizeof(buf), stdin)) {
+		char color[32], coord[8];
+		if (buf[0] == '#')  continue;
+		if (sscanf(buf, "boardsize %i", &size) == 1)  {  g = NULL;  continue;  }
+		if (!strncmp(buf, "clear_board", 11))         {  g = new_game(size);  continue;  }
+		if (sscanf(buf, "play %31s %7s", color, coord) != 2)  continue;
+
+		if (!g)  g = new_game(size);
+		g->moves = crealloc(g->moves, (g->nmoves + 1) * sizeof(move_t));
+		g->coords = crealloc(g->coords, (g->nmoves + 1) * sizeof(*g->coords));
+		move_t m = move(pass, str2stone(color));
+		g->moves[g->nmoves] = m;
+		snprintf(g->coords[g->nmoves++], sizeof(*g->coords), "%s", coord);
+	}
+}
+
+static void
+print_result(board_t *b, char *op, double time, long ops)
+{
+	double ns = (ops ? time * 1e9 / ops : 0);
+	fprintf(stderr, "%s,%i,%s,%.1f,%li\n", PACHI_GIT_HASH, board_rsize(b), op, ns, ops);
+}
+
+/* Replay games of board size, keep snapshots if @snapshots not NULL.
+ * First replay sets move coords and drops illegal moves (regtest.gtp
+ * has some). */
+static long
+replay_games(board_t *b, board_t *snapshots, int *nsnapshots)
+{
+	long ops = 0;
+	for (int i = 0; i < ngames; i++) {
+		bench_game_t *g = &games[i];
+		if (g->size != board_rsize(b))  continue;
+		board_clear(b);
+		int n = 0;
+		for (int j = 0; j < g->nmoves; j++) {
+			move_t m = g->moves[j];
+			if (snapshots)  m.coord = str2coord(g->coords[j]);
+			if (board_play(b, &m) < 0) {
+				if (!snapshots)  die("board_bench: game %i: illegal move %s\n", i + 1, coord2sstr(m.coord));
+				continue;
+			}
+			b->superko_violation = false;
+			g->moves[n++] = m;
+			ops++;
+			if (snapshots && !(j % SNAPSHOT_EVERY)) {
+				board_copy(&snapshots[*nsnapshots], b);
+				/* Gets freed by next board_clear() */
+				snapshots[(*nsnapshots)++].superko_set = NULL;
+			}
+		}
+		g->nmoves = n;
+	}
+	return ops;
+}
+
+/* Snapshots are taken after a move */
+#define to_play(b)  stone_other(last_move(b).color)
+
+/* Board statics are per board size, can only have boards of one size at a time. */
+static void
+bench_size(int size, int reps)
+{
+	long total_moves = 0;
+	for (int i = 0; i < ngames; i++)
+		if (games[i].size == size)
+			total_moves += games[i].nmoves;
+
+	board_t *b = board_new(size, NULL);
+	int nsnapshots = 0;
+	board_t *snapshots = cmalloc((total_moves / SNAPSHOT_EVERY + ngames + 1) * sizeof(board_t));
+	replay_games(b, snapshots, &nsnapshots);
+	fast_srandom(1234);
+
+	/* board_play() */
+	double start = time_now();
+	long ops = 0;
+	for (int r = 0; r < reps; r++)
+		ops += replay_games(b, NULL, NULL);
+	print_result(b, "board_play", time_now() - start, ops);
+
+	/* board_quick_play() + board_quick_undo(), all valid moves */
+	start = time_now();  ops = 0;
+	for (int r = 0; r < reps; r++)
+		for (int i = 0; i < nsnapshots; i++) {
+			board_t *s = &snapshots[i];
+			enum stone color = to_play(s);
+			foreach_free_point(s) {
+				if (!board_is_valid_play(s, color, c))  continue;
+				move_t m = move(c, color);
+				board_undo_t u;
+				if (board_quick_play(s, &m, &u) >= 0) {
+					board_quick_undo(s, &m, &u);
+					ops++;
+				}
+			} foreach_free_point_end;
+		}
+	print_result(b, "board_quick_play+undo", time_now() - start, ops);
+
+	/* board_copy() */
+	start = time_now();  ops = 0;
+	for (int r = 0; r < reps; r++)
+		for (int i = 0; i < nsnapshots; i++, ops++)
+			board_copy(b, &snapshots[i]);
+	print_result(b, "board_copy", time_now() - start, ops);
+
+	/* pattern3_hash(), all free points */
+	start = time_now();  ops = 0;
+	hash3_t h = 0;
+	for (int r = 0; r < reps; r++)
+		for (int i = 0; i < nsnapshots; i++) {
+			board_t *s = &snapshots[i];
+			foreach_free_point(s) {
+				h ^= pattern3_hash(s, c);
+				ops++;
+			} foreach_free_point_end;
+		}
+	print_result(b, "pattern3_hash", time_now() - start, ops);
+
+	/* board_fast_score() / board_official_score() */
+	floating_t score = 0;
+	start = time_now();  ops = 0;
+	for (int r = 0; r < reps; r++)
+		for (int i = 0; i < nsnapshots; i++, ops++)
+			score += board_fast_score(&snapshots[i]);
+	print_result(b, "board_fast_score", time_now() - start, ops);
+
+	start = time_now();  ops = 0;
+	for (int r = 0; r < reps; r++)
+		for (int i = 0; i < nsnapshots; i++, ops++) {
+			move_queue_t dead;  mq_init(&dead);
+			score += board_official_score(&snapshots[i], &dead);
+		}
+	print_result(b, "board_official_score", time_now() - start, ops);
+
+	/* board_play_random(), random playout from each snapshot
+	 * (copy time included, amortized over playout moves) */
+	start = time_now();  ops = 0;
+	for (int r = 0; r < reps; r++)
+		for (int i = 0; i < nsnapshots; i++) {
+			board_copy(b, &snapshots[i]);
+			enum stone color = to_play(b);
+			int passes = 0;
+			for (int n = 0; passes < 2 && n < 3 * board_rsize2(b); n++, ops++) {
+				coord_t c;
+				board_play_random(b, color, &c, NULL, NULL);
+				passes = (is_pass(c) ? passes + 1 : 0);
+				color = stone_other(color);
+			}
+		}
+	print_result(b, "board_play_random", time_now() - start, ops);
+
+	if (DEBUGL(3))  fprintf(stderr, "(%x %f)\n", (unsigned int)h, score);
+
+	for (int i = 0; i < nsnapshots; i++)
+		board_done(&snapshots[i]);
+	free(snapshots);
+	board_delete(&b);
+}
+
+bool
+board_bench(board_t *orig, char *arg)
+{
+	int reps = (arg && *arg ? atoi(arg) : 10);
+	if (reps < 1)  reps = 1;
+	read_games();
+	if (!ngames)  die("board_bench: no games on stdin\n");
+
+	fprintf(stderr, "git,size,op,ns/op,ops\n");
+	bool done[BOARD_MAX_SIZE + 1] = { 0, };
+	for (int i = 0; i < ngames; i++) {
+		int size = games[i].size;
+		if (size < 1 || size > BOARD_MAX_SIZE)
+			die("board_bench: bad board size %i\n", size);
+		if (done[size])  continue;
+		bench_size(size, reps);
+		done[size] = true;
+	}
+
+	for (int i = 0; i < ngames; i++) {
+		free(games[i].moves);
+		free(games[i].coords);
+	}
+	free(games);  games = NULL;  ngames = 0;
+	return true;
+}
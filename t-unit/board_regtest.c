@@ -118,6 +118,12 @@ hash_board(board_t *b)
 		hash_int(c);
 		for (int i = 0; i < board_group_info(b, g).libs; i++)
 			hash_int(board_group_info(b, g).lib[i]);
+#ifdef BOARD_EXACT_LIBS
+		/* sanity check ... */
+		assert(board_group_exact_libs(b, g) == board_group_count_libs(b, g));
+		for (int i = 0; i < board_group_info(b, g).libs; i++)
+			assert(libset_test(&board_group_info(b, g), board_group_info(b, g).lib[i]));
+#endif
 	} foreach_point_end;
 
 
@@ -130,6 +136,9 @@ hash_board(board_t *b)
 		coord_t c = b->f[i];
 		hash_int(c);
 		assert(b->fmap[c] == i);  /* sanity check ... */
+		for (enum stone color = S_BLACK; color <= S_WHITE; color++)
+			if ((b->eyes[color - 1][c / 64] >> (c % 64)) & 1)
+				assert(board_is_one_point_eye(b, c, color));
 	}
 
 	foreach_point(b) {
@@ -0,0 +1,59 @@
+
+% 2 eyes
+boardsize 5
+. . . . .
+X X . . .
+. X . . .
+X X . . .
+. X . . .
+
+pass_alive b1 1
+
+
+% 1 eye
+boardsize 5
+. . . . .
+X X . . .
+. X . . .
+. X . . .
+. X . . .
+
+pass_alive b1 0
+
+
+% 2pt eye with prisoner
+boardsize 5
+. . . . .
+X X X . .
+X O X . .
+X . X . .
+. X X . .
+
+pass_alive b1 1
+pass_alive b3 0
+
+
+% Eyes shared by 2 chains
+boardsize 5
+. . . . .
+O O O . .
+. X O . .
+O . O . .
+. O O . .
+
+pass_alive a4 1
+pass_alive a2 1
+pass_alive b3 0
+
+
+% Big eye, inside points aren't liberties
+boardsize 7
+. . . . . . .
+X X X X X . .
+. . . . X . .
+. . . . X . .
+. . . . X . .
+X X X X X . .
+. . . . . . .
+
+pass_alive a2 0
@@ -0,0 +1,48 @@
+% 2 stones seki
+boardsize 6
+. . O X . O
+. O O X . O
+. O X O O O
+. O X X X X
+. O X . X .
+. O X . X .
+
+seki d6 1
+seki e6 1
+seki e5 1
+seki f5 1
+seki c3 0
+seki d2 0
+
+
+% Semeai, black has outside liberty
+boardsize 6
+. . O X . O
+. O O X . O
+. O . O O O
+. O X X X X
+. O X . X .
+. O X . X .
+
+seki d6 0
+seki e6 0
+
+
+% Seki in the corner
+boardsize 9
+O O O O . X X X O
+. O O O X X X O O
+O O O X X X O O O
+X X X X O O . O O
+. X X O O . O O .
+X X X O O O . O O
+X X O O . O O O O
+X O O O O O . O O
+O O . O O . O . O
+
+seki e9 1
+seki f9 1
+seki a5 1
+seki b5 1
+seki a8 1
+seki g6 0
@@ -0,0 +1,51 @@
+% Plain race, same liberties: player to move wins
+boardsize 6
+X X O X O O
+X . O X . O
+X . O X . O
+. X X)O O .
+X . X O . .
+. X . . . .
+
+semeai w c6 d6 w e5
+semeai b c6 d6 b
+
+
+% Plain race, same liberties
+boardsize 6
+. . . . . .
+X)O O X X O
+X X X O O O
+. . X O . .
+X X X O O O
+. . X O . .
+
+semeai w b5 d5 w
+semeai b b5 d5 b
+
+
+% Shared liberties only: seki
+boardsize 7
+. . . . . . .
+. . . . . . .
+. . . . . . .
+. . . . . . .
+O O O O O O O
+X X X X X X X
+. O O O O O .
+
+semeai b c1 c2 none
+semeai w c1 c2 none
+
+
+% One more liberty: black doesn't need to play
+boardsize 6
+. . . . . .
+X)O O X X .
+X X X O O O
+. . X O . .
+X X X O O O
+. . X O . .
+
+semeai b b5 d5 b pass
+semeai w b5 d5 b
@@ -12,7 +12,9 @@
 #include "tactics/ladder.h"
 #include "tactics/1lib.h"
 #include "tactics/2lib.h"
+#include "tactics/benson.h"
 #include "tactics/seki.h"
+#include "tactics/semeai.h"
 #include "util.h"
 #include "random.h"
 #include "playout.h"
@@ -466,6 +468,39 @@ test_can_countercap(board_t *b, char *arg)
 	return   (rres == eres);
 }
 
+/* syntax: semeai to_play group1 group2 winner [move]
+ * winner is b, w or none (seki or can't tell) */
+static bool
+test_semeai(board_t *b, char *arg)
+{
+	next_arg(arg);
+	enum stone to_play = str2stone(arg);
+	next_arg(arg);
+	coord_t c1 = str2coord(arg);
+	next_arg(arg);
+	coord_t c2 = str2coord(arg);
+	next_arg(arg);
+	enum stone ewinner = str2stone(arg);
+	next_arg_opt(arg);
+	bool check_move = *arg;
+	coord_t emove = (check_move ? str2coord(arg) : pass);
+	args_end();
+
+	PRINT_TEST(b, "semeai %s %s %s %s %s...\t", stone2str(to_play), coord2sstr(c1), coord2sstr(c2),
+		   stone2str(ewinner), (check_move ? coord2sstr(emove) : ""));
+
+	assert(board_at(b, c1) == S_BLACK || board_at(b, c1) == S_WHITE);
+	assert(board_at(b, c2) == stone_other(board_at(b, c1)));
+	coord_t move;
+	enum stone winner = semeai_solve(b, group_at(b, c1), group_at(b, c2), to_play, 1000, &move);
+	int rres = (winner == ewinner && (!check_move || move == emove));
+	int eres = 1;
+
+	if (rres != eres && DEBUGL(0))  fprintf(stderr, "got %s %s  ", stone2str(winner), coord2sstr(move));
+	PRINT_RES();
+	return   (rres == eres);
+}
+
 static bool
 test_two_eyes(board_t *b, char *arg)
 {
@@ -485,6 +520,48 @@ test_two_eyes(board_t *b, char *arg)
 	return   (rres == eres);
 }
 
+static bool
+test_pass_alive(board_t *b, char *arg)
+{
+	next_arg(arg);
+	coord_t c = str2coord(arg);
+	next_arg(arg);
+	int eres = atoi(arg);
+	args_end();
+
+	PRINT_TEST(b, "pass_alive %s %d...\t", coord2sstr(c), eres);
+
+	enum stone color = board_at(b, c);
+	assert(color == S_BLACK || color == S_WHITE);
+	bool safe[BOARD_MAX_COORDS] = { 0, };
+	benson_safe_area(b, color, safe);
+	int rres = safe[c];
+
+	PRINT_RES();
+	return   (rres == eres);
+}
+
+/* syntax: seki coord expected_result
+ * coord is a stone or liberty of a group in local seki */
+static bool
+test_seki(board_t *b, char *arg)
+{
+	next_arg(arg);
+	coord_t c = str2coord(arg);
+	next_arg(arg);
+	int eres = atoi(arg);
+	args_end();
+
+	PRINT_TEST(b, "seki %s %d...\t", coord2sstr(c), eres);
+
+	bool seki[BOARD_MAX_COORDS] = { 0, };
+	seki_find(b, seki);
+	int rres = seki[c];
+
+	PRINT_RES();
+	return   (rres == eres);
+}
+
 
 /* syntax: pass_is_safe color expected_result */
 static bool
@@ -712,6 +789,7 @@ bool board_undo_stress_test(board_t *orig, char *arg);
 bool board_regression_test(board_t *orig, char *arg);
 bool moggy_regression_test(board_t *orig, char *arg);
 bool spatial_regression_test(board_t *orig, char *arg);
+bool board_bench(board_t *orig, char *arg);
 
 typedef bool (*t_unit_func)(board_t *board, char *arg);
 
@@ -729,12 +807,16 @@ static t_unit_cmd commands[] = {
 	{ "wouldbe_ladder_any",     test_wouldbe_ladder_any,    },
 	{ "useful_ladder",          test_useful_ladder,         },
 	{ "can_countercap",         test_can_countercap,        },
+	{ "semeai",                 test_semeai,                },
 	{ "two_eyes",               test_two_eyes,              },
+	{ "pass_alive",             test_pass_alive,            },
+	{ "seki",                   test_seki,                  },
 	{ "moggy moves",            test_moggy_moves,           },
 	{ "moggy status",           test_moggy_status,          },
 	{ "false_eye_seki",         test_false_eye_seki,        },
 	{ "pass_is_safe",           test_pass_is_safe,          },
 	{ "final_score",            test_final_score,           },
+	{ "board_bench",            board_bench,                },
 #ifdef BOARD_TESTS
 	{ "board_undo_stress_test", board_undo_stress_test,     },
 	{ "board_regtest",          board_regression_test,      },
@@ -749,13 +831,9 @@ static t_unit_cmd commands[] = {
 	{ 0, 0 }
 };
 
-int
-unit_test_cmd(board_t *b, char *line)
+static int
+find_cmd(char *line)
 {
-	board_printed = false;
-	chomp(line);
-	remove_comments(line);
-	
 	for (int i = 0; commands[i].cmd; i++) {
 		char *cmd = commands[i].cmd;
 		if (!str_prefix(cmd, line))
@@ -763,14 +841,126 @@ unit_test_cmd(board_t *b, char *line)
 		char c = line[strlen(cmd)];
 		if (c && c != ' ' && c != '\t')
 			continue;
-
-		init_arg_len(line, strlen(cmd));
-		return commands[i].f(b, next);
+		return i;
 	}
 
 	die("Syntax error: %s\n", line);
 }
 
+int
+unit_test_cmd(board_t *b, char *line)
+{
+	board_printed = false;
+	chomp(line);
+	remove_comments(line);
+	
+	int i = find_cmd(line);
+	init_arg_len(line, strlen(commands[i].cmd));
+	return commands[i].f(b, next);
+}
+
+
+/* Benchmark mode: after each test, run it @bench_runs times more (quietly)
+ * and report time per query for each test command. With a baseline file,
+ * fail if some command got more than BENCH_THRESHOLD slower. Commands
+ * missing from the baseline are added to it (remove it to start over). */
+
+#define BENCH_THRESHOLD  0.25
+#define BENCH_MAX        256
+
+static int   bench_runs = 0;
+static char *bench_baseline = NULL;
+static double bench_time[sizeof(commands) / sizeof(*commands)];
+static int    bench_queries[sizeof(commands) / sizeof(*commands)];
+
+void
+set_unit_bench(int runs)
+{
+	bench_runs = runs;
+}
+
+void
+set_unit_baseline(char *filename)
+{
+	bench_baseline = filename;
+}
+
+static void
+bench_cmd(board_t *b, char *orig)
+{
+	int i = find_cmd(orig);
+	int saved_debug_level = debug_level;
+	debug_level = 0;
+
+	char line[256];
+	double start = time_now();
+	for (int k = 0; k < bench_runs; k++) {
+		strcpy(line, orig);
+		unit_test_cmd(b, line);
+	}
+	bench_time[i] += time_now() - start;
+	bench_queries[i] += bench_runs;
+
+	debug_level = saved_debug_level;
+}
+
+/* Report timings, compare with baseline. Returns false if slower. */
+static bool
+bench_report(char *filename)
+{
+	char *name = (strrchr(filename, '/') ? strrchr(filename, '/') + 1 : filename);
+	char *keys[BENCH_MAX];
+	double ns[BENCH_MAX];
+	int n = 0, nbase = 0;
+	bool ok = true;
+
+	FILE *f = (bench_baseline ? fopen(bench_baseline, "r") : NULL);
+	if (f) {
+		char buf[256], key[256];
+		double t;
+		while (n < BENCH_MAX && fgets(buf, sizeof(buf), f))
+			if (sscanf(buf, "%lf %255[^\n]", &t, key) == 2) {
+				keys[n] = strdup(key);  ns[n++] = t;
+			}
+		fclose(f);
+	}
+	nbase = n;
+
+	printf("\nTimings (%i runs):\n", bench_runs);
+	for (int i = 0; commands[i].cmd; i++) {
+		if (!bench_queries[i])  continue;
+		double t = bench_time[i] * 1e9 / bench_queries[i];
+		char key[256];
+		snprintf(key, sizeof(key), "%s %s", name, commands[i].cmd);
+
+		int j;
+		for (j = 0; j < n && strcmp(keys[j], key); j++)
+			;
+		printf("  %-24s %12.0f ns/query", commands[i].cmd, t);
+		if (j < nbase) {
+			double diff = (t - ns[j]) / ns[j];
+			bool slower = (diff > BENCH_THRESHOLD);
+			printf("   baseline %12.0f  %+4.0f%%%s", ns[j], diff * 100, (slower ? "  SLOWER" : ""));
+			if (slower)  ok = false;
+		} else if (n < BENCH_MAX) {
+			keys[n] = strdup(key);  ns[n++] = t;
+		}
+		printf("\n");
+	}
+
+	/* Add new entries */
+	if (bench_baseline && n > nbase) {
+		f = fopen(bench_baseline, "a");
+		if (!f)  fail(bench_baseline);
+		for (int j = nbase; j < n; j++)
+			fprintf(f, "%.0f %s\n", ns[j], keys[j]);
+		fclose(f);
+	}
+	for (int j = 0; j < n; j++)
+		free(keys[j]);
+	return ok;
+}
+
 
 int
 unit_test(char *filename)
@@ -782,6 +972,10 @@ unit_test(char *filename)
 	
 	int total = 0, passed = 0;
 	int total_opt = 0, passed_opt = 0;
+#ifdef BOARD_SIZE
+	int skipped = 0;
+	bool skip = false;	/* Board size not supported by this build */
+#endif
 	
 	board_t *b = board_new(19, NULL);
 	b->komi = 7.5;
@@ -805,20 +999,38 @@ unit_test(char *filename)
 			case  0 : continue;
 		}
 
+#ifdef BOARD_SIZE
+		if (str_prefix("boardsize ", line))  skip = (atoi(line + 10) != BOARD_SIZE);
+		if (skip) {   /* Skip board diagram and tests */
+			if ('a' <= line[0] && line[0] <= 'z' && !str_prefix("boardsize ", line) &&
+			    !str_prefix("rules ", line) && !str_prefix("komi ", line) && !str_prefix("ko ", line) &&
+			    !str_prefix("passes ", line) && !str_prefix("handicap ", line))
+				skipped++;
+			continue;
+		}
+#endif
 		if (str_prefix("boardsize ", line)) {  init_arg(line); board_load(b, f, next); continue;  }
 		if (str_prefix("rules ", line))     {  init_arg(line); set_rules(b, next); continue;  }
 		if (str_prefix("komi ", line))      {  init_arg(line); set_komi(b, next); continue;  }
 		if (str_prefix("ko ", line))	    {  init_arg(line); set_ko(b, next); continue;  }
 		
+		char orig[256];
+		strcpy(orig, line);
 		if (optional)  {  total_opt++;  passed_opt += unit_test_cmd(b, line); }
 		else           {  total++;      passed     += unit_test_cmd(b, line); }
+		if (bench_runs)  bench_cmd(b, orig);
 	}
 
 	fclose(f);
 	board_delete(&b);
 
 	printf("\n\n");
+	if (total)
 	printf("----------- [  %3i/%-3i mandatory tests passed (%i%%)  ] -----------\n", passed, total, passed * 100 / total);
+#ifdef BOARD_SIZE
+	if (skipped)
+	printf("               %3i tests skipped (board size != %i)            \n\n", skipped, BOARD_SIZE);
+#endif
 	if (total_opt)
 	printf("               %3i/%-3i  optional tests passed (%i%%)               \n\n", passed_opt, total_opt, passed_opt * 100 / total_opt);
 
@@ -828,5 +1040,10 @@ unit_test(char *filename)
 	if (passed_opt != total_opt)
 		printf(", %d optional test(s) IGNORED", total_opt - passed_opt);
 	printf("\n");
+
+	if (bench_runs && !bench_report(filename)) {
+		printf("\nSome tests got SLOWER\n");
+		ret = EXIT_FAILURE;
+	}
 	return ret;
 }
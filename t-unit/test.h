@@ -7,4 +7,10 @@ int unit_test_cmd(struct board *b, char *line);
 /* run all unit tests in file */
 int unit_test(char *filename);
 
+/* benchmark mode: run each test @runs more times and show timings */
+void set_unit_bench(int runs);
+
+/* compare timings with baseline @filename */
+void set_unit_baseline(char *filename);
+
 #endif
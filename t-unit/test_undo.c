@@ -151,8 +151,22 @@ test_undo(board_t *orig, coord_t c, enum stone color)
 		assert(0);
 	}
 
+	// Same with board_play_undoable() / board_undo_move(): all fields must match
+	board_t b3;
+	board_copy(&b3, orig);
+	board_undo_t u;
+	r = board_play_undoable(&b3, &m, &u);  assert(r >= 0);
+	assert(!board_cmp(&b3, &b));
+	board_undo_move(&b3, &m, &u);
+	if (board_cmp(&b3, orig)) {
+		board_dump(orig);
+		board_dump(&b3);
+		assert(0);
+	}
+
 	board_done(&b);
 	board_done(&b2);
+	board_done(&b3);
 	
 	return c;
 }
@@ -165,6 +179,13 @@ permit_hook(playout_policy_t *playout_policy, board_t *b, move_t *m, bool alt, b
 {
 	test_undo(b, m->coord, m->color);
 
+	/* Check board_play_random() eyes cache while we're at it */
+	foreach_free_point(b) {
+		for (enum stone color = S_BLACK; color <= S_WHITE; color++)
+			if ((b->eyes[color - 1][c / 64] >> (c % 64)) & 1)
+				assert(board_is_one_point_eye(b, c, color));
+	} foreach_free_point_end;
+
 	/* Also test pass, permit() never gets called on pass ... */
 	if (fast_random(100) < 5)
 		test_undo(b, pass, m->color);
@@ -10,6 +10,7 @@
 #include "mq.h"
 #include "tactics/1lib.h"
 #include "tactics/ladder.h"
+#include "tactics/memo.h"
 #include "tactics/selfatari.h"
 
 
@@ -74,11 +75,9 @@ can_play_on_lib(board_t *b, group_t g, enum stone to_play)
 	return false;
 }
 
-/* Checks snapbacks */
-bool
-can_countercapture(board_t *b, group_t group, move_queue_t *q)
+static bool
+countercapture_read(board_t *b, group_t group, move_queue_t *q)
 {
-	if (q) mq_init(q);
 	enum stone color = board_at(b, group);
 	enum stone other = stone_other(color);
 	assert(color == S_BLACK || color == S_WHITE);	
@@ -104,6 +103,28 @@ can_countercapture(board_t *b, group_t group, move_queue_t *q)
 	return can;
 }
 
+/* Checks snapbacks.
+ * Yes / no answer gets asked for the same group by ladder, selfatari,
+ * moggy and pattern code for every candidate: cache it per position. */
+bool
+can_countercapture(board_t *b, group_t group, move_queue_t *q)
+{
+	if (q) {
+		mq_init(q);
+		return countercapture_read(b, group, q);
+	}
+
+	if (!tactics_memo_valid(b))
+		return countercapture_read(b, group, NULL);
+
+	tactics_memo_t *m = &tactics_memo;
+	if (m->countercap_gen[group] != m->gen) {
+		m->countercap[group] = countercapture_read(b, group, NULL);
+		m->countercap_gen[group] = m->gen;
+	}
+	return m->countercap[group];
+}
+
 /* Same as can_countercapture() but returns capturable groups instead of moves,
  * queue may not be NULL, and is always cleared. */
 bool
@@ -0,0 +1,138 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "board.h"
+#include "tactics/benson.h"
+
+/* See http://senseis.xmp.net/?BensonsAlgorithm
+ *
+ * Regions are the connected sets of points not occupied by @color.
+ * A region is vital to a chain if all its empty points are liberties of
+ * the chain. Then repeatedly:
+ *   - drop chains with less than 2 vital regions left,
+ *   - drop regions next to a dropped chain,
+ * until nothing changes. Remaining chains are pass-alive.
+ *
+ * We run in playouts so this needs to be fast: everything is driven from
+ * the free points list (each region has some empty points, and each chain
+ * some liberties) and dropping is done with a worklist.
+ * A chain vital to a region must be next to each of its empty points, so
+ * there can be at most 4 candidates: neighbors of the first empty point. */
+
+typedef struct {
+	group_t	vital[4];		/* Chains this region is vital to */
+	int	nvital;
+	bool	dropped;
+} benson_region_t;
+
+int
+benson_safe_area(board_t *b, enum stone color, bool *safe)
+{
+	int16_t region_at[BOARD_MAX_COORDS];
+	benson_region_t regions[BOARD_MAX_COORDS];
+	coord_t stack[BOARD_MAX_COORDS];
+	int nregions = 0;
+
+	/* Find regions. */
+	memset(region_at, -1, sizeof(region_at));
+	foreach_free_point(b) {
+		if (region_at[c] != -1)  continue;
+
+		int r = nregions++;
+		benson_region_t *reg = &regions[r];
+		reg->nvital = 0;  reg->dropped = false;
+		int sp = 0;
+		stack[sp++] = c;  region_at[c] = r;
+		while (sp) {
+			coord_t p = stack[--sp];
+			foreach_neighbor(b, p, {
+				enum stone s = board_at(b, c);
+				if (s == S_OFFBOARD || s == color || region_at[c] != -1)  continue;
+				region_at[c] = r;
+				stack[sp++] = c;
+			});
+		}
+
+		/* Vital to which chains ? */
+		foreach_neighbor(b, c, {
+			if (board_at(b, c) != color)  continue;
+			group_t g = group_at(b, c);
+			bool dup = false;
+			for (int i = 0; i < reg->nvital; i++)
+				if (reg->vital[i] == g)  dup = true;
+			if (!dup)  reg->vital[reg->nvital++] = g;
+		});
+	} foreach_free_point_end;
+
+	/* Check candidates against other empty points. */
+	foreach_free_point(b) {
+		coord_t p = c;
+		benson_region_t *reg = &regions[region_at[p]];
+		for (int i = 0; i < reg->nvital; i++) {
+			group_t g = reg->vital[i];
+			bool lib = false;
+			foreach_neighbor(b, p, {
+				if (group_at(b, c) == g)  lib = true;
+			});
+			if (lib)  continue;
+			reg->vital[i--] = reg->vital[--reg->nvital];
+		}
+	} foreach_free_point_end;
+
+	/* Drop chains with less than 2 vital regions, then regions next
+	 * to dropped chains, which may drop more chains ... */
+	uint8_t nvital[BOARD_MAX_COORDS];
+	bool dropped[BOARD_MAX_COORDS];
+	group_t todrop[BOARD_MAX_COORDS];
+	int ntodrop = 0;
+	memset(nvital, 0, sizeof(nvital));
+	memset(dropped, 0, sizeof(dropped));
+	for (int r = 0; r < nregions; r++)
+		for (int i = 0; i < regions[r].nvital; i++)
+			nvital[regions[r].vital[i]]++;
+	foreach_free_point(b) {
+		foreach_neighbor(b, c, {
+			if (board_at(b, c) != color)  continue;
+			group_t g = group_at(b, c);
+			if (dropped[g] || nvital[g] >= 2)  continue;
+			dropped[g] = true;
+			todrop[ntodrop++] = g;
+		});
+	} foreach_free_point_end;
+
+	while (ntodrop) {
+		group_t g = todrop[--ntodrop];
+		foreach_in_group(b, g) {
+			foreach_neighbor(b, c, {
+				int r = region_at[c];
+				if (r == -1 || regions[r].dropped)  continue;
+				regions[r].dropped = true;
+				for (int i = 0; i < regions[r].nvital; i++) {
+					group_t g2 = regions[r].vital[i];
+					if (--nvital[g2] >= 2 || dropped[g2])  continue;
+					dropped[g2] = true;
+					todrop[ntodrop++] = g2;
+				}
+			});
+		} foreach_in_group_end;
+	}
+
+	/* Collect results. */
+	int n = 0;
+	foreach_point(b) {
+		enum stone s = board_at(b, c);
+		if (s == color) {
+			if (dropped[group_at(b, c)])  continue;
+		} else {
+			if (s == S_OFFBOARD)  continue;
+			benson_region_t *reg = &regions[region_at[c]];
+			if (reg->dropped || !reg->nvital)  continue;
+		}
+		safe[c] = true;
+		n++;
+	} foreach_point_end;
+
+	return n;
+}
@@ -0,0 +1,15 @@
+#ifndef PACHI_TACTICS_BENSON_H
+#define PACHI_TACTICS_BENSON_H
+
+/* Benson's algorithm: find unconditionally alive (pass-alive) groups,
+ * groups which can't be captured even if their owner keeps passing. */
+
+#include "board.h"
+
+/* Mark stones of pass-alive groups of @color in @safe as well as points of
+ * regions vital to them (opponent can't live in there, so that's @color's
+ * territory for sure). @safe[] must be cleared by the caller, other
+ * points are left untouched. Returns number of points marked. */
+int benson_safe_area(board_t *b, enum stone color, bool *safe);
+
+#endif /* PACHI_TACTICS_BENSON_H */
@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define QUICK_BOARD_CODE
 
@@ -9,6 +10,7 @@
 #include "board_undo.h"
 #include "debug.h"
 #include "tactics/dragon.h"
+#include "tactics/memo.h"
 
 static char*
 print_handler(board_t *board, coord_t c, void *data)
@@ -145,122 +147,108 @@ virtual_connection_at(board_t *b, enum stone color, coord_t lib, coord_t c2, gro
 
 
 
-/* Handler should return -1 to stop iterating */
-typedef int (*foreach_in_connected_groups_t)(board_t *b, enum stone color, coord_t c, void *data);
+/* Dragon graph: groups are nodes, virtual connections edges. A dragon
+ * is walked once to get its groups (in the order a depth-first walk from
+ * @to finds them), queries then work off the group list instead of
+ * rediscovering connections each time. Visited marks are generation
+ * stamps, no need to clear anything between walks. */
 
-static int
-foreach_in_connected_groups_(board_t *b, enum stone color, group_t g, 
-			     foreach_in_connected_groups_t f, void *data, int *visited)
-{
-	if (visited[group_base(g)])
-		return 0;
-	visited[group_base(g)] = 1;
+typedef struct {
+	int      ngroups;
+	group_t  groups[BOARD_MAX_GROUPS];
+} dragon_groups_t;
 
-	foreach_in_group(b, g) {
-		if (f(b, color, c, data) == -1)
-			return -1;
-	} foreach_in_group_end;	
+static __thread uint32_t walk_gen = 0;
+static __thread uint32_t walk_stamp[BOARD_MAX_COORDS];
 
-	// Look for virtually connected groups
-	for (int i = 0; i < board_group_info(b, g).libs; i++) {
-		coord_t lib = board_group_info(b, g).lib[i];	
-		// TODO could mark liberties visited, more efficient ?
-		foreach_neighbor(b, lib, {
-				if (board_at(b, c) != color)
-					continue;
-				group_t g2 = group_at(b, c);
-				if (visited[g2] || !virtual_connection_at(b, color, lib, c, g, g2))
-					continue;
-				if (foreach_in_connected_groups_(b, color, g2, f, data, visited) == -1)
-					return -1;
-			});
-	}
-	return 0;
-}
-
-/* Call f() for each stone in dragon at @to. */
-static void 
-foreach_in_connected_groups(board_t *b, enum stone color, coord_t to, 
-			    foreach_in_connected_groups_t f, void *data)
+static inline void
+walk_start(void)
 {
-	int visited[BOARD_MAX_COORDS] = {0, };
-	assert(board_at(b, to) == color);
-	group_t g = group_at(b, to);
-	foreach_in_connected_groups_(b, color, g, f, data, visited);
+	if (unlikely(!++walk_gen)) {
+		memset(walk_stamp, 0, sizeof(walk_stamp));
+		walk_gen = 1;
+	}
 }
 
-
-/* Handler should return -1 to stop iterating. */
-typedef int (*foreach_connected_group_t)(board_t *b, enum stone color, group_t g, void *data);
-
-static int
-foreach_connected_group_(board_t *b, enum stone color, group_t g, 
-			 foreach_connected_group_t f, void *data, int *visited)
+static void
+dragon_walk(board_t *b, enum stone color, group_t g, dragon_groups_t *d)
 {
-	if (visited[group_base(g)])
-		return 0;
-
-	visited[group_base(g)] = 1;
-	if (f(b, color, g, data) == -1)
-		return -1;
+	walk_stamp[g] = walk_gen;
+	d->groups[d->ngroups++] = g;
 
 	// Look for virtually connected groups
 	for (int i = 0; i < board_group_info(b, g).libs; i++) {
-		coord_t lib = board_group_info(b, g).lib[i];	
-		// TODO could mark liberties visited, more efficient ?
+		coord_t lib = board_group_info(b, g).lib[i];
 		foreach_neighbor(b, lib, {
-				if (board_at(b, c) != color)
-					continue;
-				group_t g2 = group_at(b, c);
-				if (visited[g2] || !virtual_connection_at(b, color, lib, c, g, g2))
-					continue;
-				if (foreach_connected_group_(b, color, g2, f, data, visited) == -1)
-					return -1;
-			});
+			if (board_at(b, c) != color)
+				continue;
+			group_t g2 = group_at(b, c);
+			if (walk_stamp[g2] == walk_gen || !virtual_connection_at(b, color, lib, c, g, g2))
+				continue;
+			dragon_walk(b, color, g2, d);
+		});
 	}
-	return 0;
 }
 
-/* Call f() for each group in dragon at @to. */
-static void 
-foreach_connected_group(board_t *b, enum stone color, coord_t to,
-			foreach_connected_group_t f, void *data)
+/* Get groups of dragon at @to. */
+static void
+dragon_groups(board_t *b, enum stone color, coord_t to, dragon_groups_t *d)
 {
-	int visited[BOARD_MAX_COORDS] = {0, };
 	assert(board_at(b, to) == color);
-	group_t g = group_at(b, to);
-	foreach_connected_group_(b, color, g, f, data, visited);
+	walk_start();
+	d->ngroups = 0;
+	dragon_walk(b, color, group_at(b, to), d);
 }
 
-typedef struct {
-	int *visited;
-	foreach_in_connected_groups_t f;
-	void *data;
-} foreach_lib_data_t;
+/* Get liberties of dragon @d, returns how many. */
+static int
+dragon_libs(board_t *b, dragon_groups_t *d, coord_t *libs)
+{
+	int n = 0;
+	walk_start();
+	for (int i = 0; i < d->ngroups; i++) {
+		group_t g = d->groups[i];
+		for (int j = 0; j < board_group_info(b, g).libs; j++) {
+			coord_t lib = board_group_info(b, g).lib[j];
+			if (walk_stamp[lib] == walk_gen)
+				continue;
+			walk_stamp[lib] = walk_gen;
+			libs[n++] = lib;
+		}
+	}
+	return n;
+}
 
-static int 
-foreach_lib_handler(board_t *b, enum stone color, group_t g, void *data)
+/* Handler should return -1 to stop iterating */
+typedef int (*foreach_in_connected_groups_t)(board_t *b, enum stone color, coord_t c, void *data);
+
+/* Call f() for each stone in dragon at @to. */
+static void 
+foreach_in_connected_groups(board_t *b, enum stone color, coord_t to, 
+			    foreach_in_connected_groups_t f, void *data)
 {
-	foreach_lib_data_t *d = (foreach_lib_data_t*)data;
-	for (int i = 0; i < board_group_info(b, g).libs; i++) {
-		coord_t lib = board_group_info(b, g).lib[i];
-		if (d->visited[lib])
-			continue;
-		d->visited[lib] = 1;
-		if (d->f(b, color, lib, d->data) == -1)
-			return -1;
-	}
-	return 0;			
+	dragon_groups_t d;
+	dragon_groups(b, color, to, &d);
+	for (int i = 0; i < d.ngroups; i++)
+		foreach_in_group(b, d.groups[i]) {
+			if (f(b, color, c, data) == -1)
+				return;
+		} foreach_in_group_end;
 }
 
-/* Call f() for each liberty of dragon at @to. */
+/* Call f() for each liberty of dragon at @to.
+ * Liberties are collected first, f() can play moves. */
 static void
 foreach_lib_in_connected_groups(board_t *b, enum stone color, coord_t to,
 				foreach_in_connected_groups_t f, void *data)
 {
-	int visited[BOARD_MAX_COORDS] = {0, };
-	foreach_lib_data_t d = { visited, f, data };	
-	foreach_connected_group(b, color, to, foreach_lib_handler, &d);
+	dragon_groups_t d;
+	dragon_groups(b, color, to, &d);
+	coord_t libs[BOARD_MAX_COORDS];
+	int n = dragon_libs(b, &d, libs);
+	for (int i = 0; i < n; i++)
+		if (f(b, color, libs[i], data) == -1)
+			return;
 }
 
 
@@ -546,40 +534,50 @@ neighbor_is_safe(board_t *b, group_t g)
 }
 
 
-static int
-count_libs(board_t *b, enum stone color, coord_t c, void *data)
-{	
-	int *libs = (int*)data;
-	(*libs)++;  return 0;
-}
-
 int
 dragon_liberties(board_t *b, enum stone color, coord_t to)
 {
-	int libs = 0;	
-	foreach_lib_in_connected_groups(b, color, to, count_libs, &libs);
+	dragon_groups_t d;
+	dragon_groups(b, color, to, &d);
+#ifdef BOARD_EXACT_LIBS
+	/* Union of groups liberty sets */
+	group_info_t gi = { 0, };
+	for (int j = 0; j < d.ngroups; j++)
+		for (int i = 0; i < (board_max_coords(b) + 63) / 64; i++)
+			gi.libset[i] |= board_group_info(b, d.groups[j]).libset[i];
+	int libs = 0;
+	for (int i = 0; i < (board_max_coords(b) + 63) / 64; i++)
+		libs += __builtin_popcountll(gi.libset[i]);
 	return libs;
+#else
+	coord_t libs[BOARD_MAX_COORDS];
+	return dragon_libs(b, &d, libs);
+#endif
 }
 
 
-static int
-dragon_at_handler(board_t *b, enum stone color, group_t g, void *data)
-{
-	group_t *d = (group_t*)data;
-	*d = (*d > g ? *d : g);  return 0;		
-}
-
 group_t
 dragon_at(board_t *b, coord_t to)
 {
 	group_t g = group_at(b, to);
-	group_t d = 0;
 	enum stone color = board_at(b, to);
 	if (!g)
 		return 0;
-	
-	foreach_connected_group(b, color, to, dragon_at_handler, &d);
-	return d;
+
+	/* Same position as last time ? */
+	tactics_memo_t *m = &tactics_memo;
+	bool memo = tactics_memo_valid(b);
+	if (memo && m->dragon_gen[g] == m->gen)
+		return m->dragon[g];
+
+	dragon_groups_t d;
+	dragon_groups(b, color, to, &d);
+	group_t dragon = 0;
+	for (int i = 0; i < d.ngroups; i++)
+		dragon = (dragon > d.groups[i] ? dragon : d.groups[i]);
+
+	if (memo) {  m->dragon_gen[g] = m->gen;  m->dragon[g] = dragon;  }
+	return dragon;
 }
 
 
@@ -656,13 +654,6 @@ two_stones_gap(board_t *b, enum stone color, coord_t lib, int *connected)
 	return false;
 }
 
-static int
-mark_connected(board_t *b,  enum stone color, coord_t c, void *data)
-{
-	int *connected = (int*)data;
-	connected[c] = 1;  return 0;
-}
-
 typedef struct {
 	int *connected;
 	bool surrounded;
@@ -695,12 +686,22 @@ dragon_is_surrounded(board_t *b, coord_t to)
 	enum stone color = board_at(b, to);
 	assert(color == S_BLACK || color == S_WHITE);
 	int connected[BOARD_MAX_COORDS] = {0, };
+	dragon_groups_t dg;
+	dragon_groups(b, color, to, &dg);
 
 	/* Mark connected stones */
-	foreach_in_connected_groups(b, color, to, mark_connected, connected);
-	
+	for (int i = 0; i < dg.ngroups; i++)
+		foreach_in_group(b, dg.groups[i]) {
+			connected[c] = 1;
+		} foreach_in_group_end;
+
+	/* Libs first, surrounded_check() plays moves. */
+	coord_t libs[BOARD_MAX_COORDS];
+	int n = dragon_libs(b, &dg, libs);
 	surrounded_data_t d = { connected, 1 };
-	foreach_lib_in_connected_groups(b, color, to, surrounded_check, &d);
+	for (int i = 0; i < n; i++)
+		if (surrounded_check(b, color, libs[i], &d) == -1)
+			break;
 	return d.surrounded;
 }
 
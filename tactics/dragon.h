@@ -4,8 +4,9 @@
 /* Functions for dealing with dragons, ie virtually connected groups of stones.
  * Used for some high-level tactics decisions, like trying to detect useful lost
  * ladders or whether breaking a 3-stones seki is safe.
- * Currently these are fairly expensive (dragon data is not cached) so shouldn't be
- * called by low-level / perf-critical code. */
+ * A dragon is walked once per query (groups as nodes, virtual connections as
+ * edges), dragon_at() is cached for the current playout position (tactics memo).
+ * Still fairly expensive so shouldn't be called by low-level / perf-critical code. */
 
 
 /* Like group_at() but returns unique id for all stones in a dragon.
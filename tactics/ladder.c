@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define QUICK_BOARD_CODE
 
@@ -13,12 +14,16 @@
 #include "tactics/selfatari.h"
 #include "tactics/dragon.h"
 #include "tactics/ladder.h"
+#include "tactics/memo.h"
 
 
 /* Read out middle ladder countercap sequences ? Otherwise we just
  * assume ladder doesn't work if countercapturing is possible. */
 #define MIDDLE_LADDER_CHECK_COUNTERCAP 1
 
+/* Check fast_ladder_length() answers against full reading. */
+//#define FAST_LADDER_CHECK 1
+
 
 bool
 is_border_ladder(board_t *b, group_t laddered)
@@ -201,8 +206,300 @@ middle_ladder_walk(board_t *b, group_t laddered, enum stone lcolor, coord_t prev
 	return len;
 }
 
+/* Fast path for middle ladder reading.
+ *
+ * Most middle ladders are clean: laddered group runs along a staircase,
+ * chaser stones never get short of liberties and there's only ever one
+ * sensible atari. Then the whole ladder can be read out on a virtual
+ * overlay of the board without playing any moves: laddered group only
+ * ever has the liberties of its last stone, and chaser groups only need
+ * to be checked when a stone is put next to them.
+ *
+ * Anything unusual (ko, countercaptures, chaser groups getting short of
+ * liberties, connecting to groups without plenty of liberties, two
+ * candidate ataris) and we
+ * bail out, caller does the full reading then. Answer is always the
+ * same as middle_ladder_walk()'s, length included. */
+
+#define FAST_LADDER_MAX_STONES 64	/* Chaser groups and stones we track */
+#define FAST_LADDER_MAX_LEN    (BOARD_MAX_SIZE * 2)
+
+static __thread uint32_t fl_gen = 0;
+static __thread uint32_t fl_stamp[BOARD_MAX_COORDS];	/* Virtual stone if == fl_gen */
+static __thread uint8_t  fl_color[BOARD_MAX_COORDS];
+static __thread uint32_t fl_mark_gen = 0;
+static __thread uint32_t fl_mark[BOARD_MAX_COORDS];	/* Liberty counting */
+
+typedef struct {
+	board_t *b;
+	group_t laddered;
+	enum stone lcolor;
+	int n, nblocks;
+	coord_t member[FAST_LADDER_MAX_STONES];	/* Chaser group (base) or virtual stone */
+	int     block[FAST_LADDER_MAX_STONES];	/* Chaser block it belongs to */
+} fast_ladder_t;
+
+static inline bool
+fl_virtual(coord_t c)
+{
+	return (fl_stamp[c] == fl_gen);
+}
+
+static inline enum stone
+fl_at(fast_ladder_t *f, coord_t c)
+{
+	return (fl_virtual(c) ? fl_color[c] : board_at(f->b, c));
+}
+
+static inline void
+fl_play(coord_t c, enum stone color)
+{
+	fl_stamp[c] = fl_gen;
+	fl_color[c] = color;
+}
+
+static int
+fl_empty_neighbors(fast_ladder_t *f, coord_t coord)
+{
+	int n = 0;
+	foreach_neighbor(f->b, coord, {
+		n += (fl_at(f, c) == S_NONE);
+	});
+	return n;
+}
+
+/* Laddered group stone ? (real or virtual) */
+static inline bool
+fl_laddered(fast_ladder_t *f, coord_t c)
+{
+	return (fl_virtual(c) || group_at(f->b, c) == f->laddered);
+}
+
+static void
+fl_mark_reset(void)
+{
+	if (unlikely(!++fl_mark_gen)) {
+		memset(fl_mark, 0, sizeof(fl_mark));
+		fl_mark_gen = 1;
+	}
+}
+
+/* Does chaser block still have 2 liberties ? Real groups only
+ * give lower bound if they have many, good enough for that. */
+static bool
+fl_block_safe(fast_ladder_t *f, int block)
+{
+	board_t *b = f->b;
+	int libs = 0;
+	fl_mark_reset();
+	
+	for (int i = 0; i < f->n; i++) {
+		if (f->block[i] != block)  continue;
+		coord_t m = f->member[i];
+		if (fl_virtual(m)) {
+			foreach_neighbor(b, m, {
+				if (fl_at(f, c) != S_NONE || fl_mark[c] == fl_mark_gen)  continue;
+				fl_mark[c] = fl_mark_gen;
+				if (++libs >= 2)  return true;
+			});
+			continue;
+		}
+		for (int j = 0; j < board_group_info(b, m).libs; j++) {
+			coord_t c = board_group_info(b, m).lib[j];
+			if (fl_at(f, c) != S_NONE || fl_mark[c] == fl_mark_gen)  continue;
+			fl_mark[c] = fl_mark_gen;
+			if (++libs >= 2)  return true;
+		}
+	}
+	return false;
+}
+
+/* Block of chaser stone at @c, starts tracking its group if needed.
+ * -1 if we're out of space. */
+static int
+fl_block_of(fast_ladder_t *f, coord_t c)
+{
+	coord_t m = (fl_virtual(c) ? c : group_at(f->b, c));
+	for (int i = 0; i < f->n; i++)
+		if (f->member[i] == m)
+			return f->block[i];
+
+	if (f->n == FAST_LADDER_MAX_STONES)  return -1;
+	f->member[f->n] = m;
+	f->block[f->n++] = f->nblocks;
+	return f->nblocks++;
+}
+
+/* Chaser blocks next to @coord still have 2 liberties ? */
+static bool
+fl_neighbors_safe(fast_ladder_t *f, coord_t coord)
+{
+	enum stone other = stone_other(f->lcolor);
+	foreach_neighbor(f->b, coord, {
+		if (fl_at(f, c) != other)  continue;
+		int block = fl_block_of(f, c);
+		if (block < 0 || !fl_block_safe(f, block))
+			return false;
+	});
+	return true;
+}
+
+/* Chaser ataris at @coord, merging with neighbor blocks. */
+static bool
+fl_atari(fast_ladder_t *f, coord_t coord)
+{
+	enum stone other = stone_other(f->lcolor);
+	if (f->n == FAST_LADDER_MAX_STONES)  return false;
+
+	int block = f->nblocks++;
+	foreach_neighbor(f->b, coord, {
+		enum stone s = fl_at(f, c);
+		if (s == f->lcolor && !fl_laddered(f, c))  return false;  /* Could capture something */
+		if (s != other)  continue;
+		int old = fl_block_of(f, c);
+		if (old < 0)  return false;
+		for (int i = 0; i < f->n; i++)
+			if (f->block[i] == old)
+				f->block[i] = block;
+	});
+	
+	fl_play(coord, other);
+	f->member[f->n] = coord;
+	f->block[f->n++] = block;
+	return fl_block_safe(f, block);
+}
+
+/* Escape at @coord connects to another group ? */
+static bool
+fl_connects(fast_ladder_t *f, coord_t coord)
+{
+	foreach_neighbor(f->b, coord, {
+		if (fl_at(f, c) == f->lcolor && !fl_laddered(f, c))
+			return true;
+	});
+	return false;
+}
+
+/* Connected group has 3 liberties at least ? */
+static bool
+fl_connect_free(fast_ladder_t *f, coord_t coord)
+{
+	board_t *b = f->b;
+	int libs = 0;
+	fl_mark_reset();
+
+	foreach_neighbor(b, coord, {
+		if (fl_at(f, c) != S_NONE)  continue;
+		fl_mark[c] = fl_mark_gen;
+		libs++;
+	});
+	foreach_neighbor(b, coord, {
+		if (fl_at(f, c) != f->lcolor || fl_laddered(f, c))  continue;
+		group_t g = group_at(b, c);
+		for (int j = 0; j < board_group_info(b, g).libs; j++) {
+			coord_t l = board_group_info(b, g).lib[j];
+			if (fl_at(f, l) != S_NONE || fl_mark[l] == fl_mark_gen)  continue;
+			fl_mark[l] = fl_mark_gen;
+			if (++libs >= 3)  return true;
+		}
+	});
+	return (libs >= 3);
+}
+
+/* Returns ladder length like middle_ladder_walk(), 0 if group escapes,
+ * -1 if the ladder isn't simple enough and we need to play it out. */
+static int
+fast_ladder_length(board_t *b, group_t laddered, enum stone lcolor)
+{
+	if (b->ko.coord != pass)  return -1;
+
+	/* Countercaptures ? Chaser groups get tracked once we play next to them. */
+	enum stone other = stone_other(lcolor);
+	foreach_in_group(b, laddered) {
+		foreach_neighbor(b, c, {
+			if (board_at(b, c) == other && board_group_info(b, group_at(b, c)).libs < 2)
+				return -1;
+		});
+	} foreach_in_group_end;
+
+	fast_ladder_t f;	/* No initializer, don't clear the arrays */
+	f.b = b;  f.laddered = laddered;  f.lcolor = lcolor;
+	f.n = f.nblocks = 0;
+	if (unlikely(!++fl_gen)) {
+		memset(fl_stamp, 0, sizeof(fl_stamp));
+		fl_gen = 1;
+	}
+
+	coord_t escape = board_group_info(b, laddered).lib[0];
+	for (int len = 1; len <= FAST_LADDER_MAX_LEN; len++) {
+		/* Escape */
+		fl_play(escape, lcolor);
+		if (!fl_neighbors_safe(&f, escape))
+			return -1;
+		if (fl_connects(&f, escape))
+			return (fl_connect_free(&f, escape) ? 0 : -1);
+
+		/* All its other stones are surrounded, liberties are the new stone's. */
+		coord_t lib[2];
+		int libs = 0;
+		foreach_neighbor(b, escape, {
+			if (fl_at(&f, c) != S_NONE)  continue;
+			if (libs < 2)  lib[libs] = c;
+			libs++;
+		});
+		if (libs <= 1)  return len;	/* Captured (or suicide) */
+		if (libs > 2)   return 0;	/* Free */
+
+		/* Same filter as middle_ladder_chase(), give up if both ataris make sense. */
+		int atari = -1;
+		for (int i = 0; i < 2; i++) {
+			if (fl_empty_neighbors(&f, lib[1 - i]) > 2 + coord_is_adjecent(lib[i], lib[1 - i]))
+				continue;
+			if (atari >= 0)  return -1;
+			atari = i;
+		}
+		if (atari < 0)  return 0;
+
+		if (!fl_atari(&f, lib[atari]))
+			return -1;
+		escape = lib[1 - atari];
+	}
+	return -1;
+}
+
+/* Middle ladder reading, try the fast path first. */
+static int
+middle_ladder_read(board_t *b, group_t laddered, enum stone lcolor)
+{
+	int len = fast_ladder_length(b, laddered, lcolor);
+#ifdef FAST_LADDER_CHECK
+	if (len >= 0)  assert(len == middle_ladder_walk(b, laddered, lcolor, pass, 0));
+#endif
+	if (len < 0)
+		len = middle_ladder_walk(b, laddered, lcolor, pass, 0);
+	return len;
+}
+
 static __thread int length = 0;
 
+/* Middle ladder reading is the expensive part, and callers (moggy, pattern
+ * features, priors) often ask about the same group in the same position.
+ * Result is the same for is_middle_ladder() and is_middle_ladder_any(),
+ * chaser is always the other color. */
+static int
+middle_ladder_length(board_t *b, group_t laddered, enum stone lcolor)
+{
+	if (!tactics_memo_valid(b))
+		return middle_ladder_read(b, laddered, lcolor);
+
+	tactics_memo_t *m = &tactics_memo;
+	if (m->middle_gen[laddered] != m->gen) {
+		m->middle_len[laddered] = middle_ladder_read(b, laddered, lcolor);
+		m->middle_gen[laddered] = m->gen;
+	}
+	return m->middle_len[laddered];
+}
+
 bool
 is_middle_ladder(board_t *b, group_t laddered)
 {
@@ -219,7 +516,7 @@ is_middle_ladder(board_t *b, group_t laddered)
 	/* A fair chance for a ladder. Group in atari, with some but limited
 	 * space to escape. Time for the expensive stuff - play it out and
 	 * start selective 2-liberty search. */
-	length = middle_ladder_walk(b, laddered, lcolor, pass, 0);
+	length = middle_ladder_length(b, laddered, lcolor);
 
 	if (DEBUGL(6) && length)  fprintf(stderr, "is_ladder(): stones: %i  length: %i\n",
 					  group_stone_count(b, laddered, 50), length);
@@ -232,12 +529,12 @@ is_middle_ladder_any(board_t *b, group_t laddered)
 {
 	enum stone lcolor = board_at(b, group_base(laddered));
 	
-	length = middle_ladder_walk(b, laddered, lcolor, pass, 0);
+	length = middle_ladder_length(b, laddered, lcolor);
 	return (length != 0);
 }
 
-bool
-wouldbe_ladder(board_t *b, group_t group, coord_t chaselib)
+static bool
+wouldbe_ladder_(board_t *b, group_t group, coord_t chaselib)
 {
 	assert(board_group_info(b, group).libs == 2);
 	
@@ -267,9 +564,24 @@ wouldbe_ladder(board_t *b, group_t group, coord_t chaselib)
 	return ladder;
 }
 
-
 bool
-wouldbe_ladder_any(board_t *b, group_t group, coord_t chaselib)
+wouldbe_ladder(board_t *b, group_t group, coord_t chaselib)
+{
+	if (!tactics_memo_valid(b))
+		return wouldbe_ladder_(b, group, chaselib);
+
+	tactics_memo_t *m = &tactics_memo;
+	if (m->ladder_gen[chaselib] != m->gen || m->ladder_group[chaselib] != group) {
+		m->ladder[chaselib] = wouldbe_ladder_(b, group, chaselib);
+		m->ladder_group[chaselib] = group;
+		m->ladder_gen[chaselib] = m->gen;
+	}
+	return m->ladder[chaselib];
+}
+
+
+static bool
+wouldbe_ladder_any_(board_t *b, group_t group, coord_t chaselib)
 {
 	assert(board_group_info(b, group).libs == 2);
 	
@@ -288,6 +600,21 @@ wouldbe_ladder_any(board_t *b, group_t group, coord_t chaselib)
 	return ladder;
 }
 
+bool
+wouldbe_ladder_any(board_t *b, group_t group, coord_t chaselib)
+{
+	if (!tactics_memo_valid(b))
+		return wouldbe_ladder_any_(b, group, chaselib);
+
+	tactics_memo_t *m = &tactics_memo;
+	if (m->ladder_any_gen[chaselib] != m->gen || m->ladder_any_group[chaselib] != group) {
+		m->ladder_any[chaselib] = wouldbe_ladder_any_(b, group, chaselib);
+		m->ladder_any_group[chaselib] = group;
+		m->ladder_any_gen[chaselib] = m->gen;
+	}
+	return m->ladder_any[chaselib];
+}
+
 /* Laddered group can't escape, but playing it out could still be useful.
  *
  *      . . . * . . .    For example, life & death:
@@ -0,0 +1,20 @@
+#include <string.h>
+
+#include "board.h"
+#include "tactics/memo.h"
+
+__thread tactics_memo_t tactics_memo;
+
+/* Generation counter wrapped around, old stamps could look valid again. */
+void
+tactics_memo_wrap(void)
+{
+	tactics_memo_t *m = &tactics_memo;
+	memset(m->selfatari_gen, 0, sizeof(m->selfatari_gen));
+	memset(m->ladder_gen, 0, sizeof(m->ladder_gen));
+	memset(m->ladder_any_gen, 0, sizeof(m->ladder_any_gen));
+	memset(m->middle_gen, 0, sizeof(m->middle_gen));
+	memset(m->dragon_gen, 0, sizeof(m->dragon_gen));
+	memset(m->countercap_gen, 0, sizeof(m->countercap_gen));
+	m->gen = 1;
+}
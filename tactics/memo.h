@@ -0,0 +1,79 @@
+#ifndef PACHI_TACTICS_MEMO_H
+#define PACHI_TACTICS_MEMO_H
+
+/* Per-thread cache of tactical query results for one position.
+ *
+ * Move choice in playouts asks the same questions several times for the
+ * same candidate (policy choose(), then permit(), tactics checking the
+ * same libs...). Callers bracket the part where board doesn't change with
+ * tactics_memo_start() / tactics_memo_stop() and queries made on that
+ * position in between get cached.
+ *
+ * Queries on other boards, or on the same board with moves played on
+ * top (with_move() etc) bypass the cache: entries are only valid for
+ * board @b with @b->moves moves, and positions reached by quick play /
+ * undo from there always have more moves. */
+
+#include "board.h"
+
+typedef struct {
+	board_t  *b;		/* Position we cache, NULL if inactive */
+	int       moves;
+	uint32_t  gen;		/* Entries with other gen are stale */
+
+	uint32_t  selfatari_gen[S_MAX][BOARD_MAX_COORDS];
+	bool      selfatari[S_MAX][BOARD_MAX_COORDS];		/* is_bad_selfatari() */
+
+	uint32_t  ladder_gen[BOARD_MAX_COORDS];			/* By chaselib */
+	group_t   ladder_group[BOARD_MAX_COORDS];
+	bool      ladder[BOARD_MAX_COORDS];			/* wouldbe_ladder() */
+
+	uint32_t  ladder_any_gen[BOARD_MAX_COORDS];		/* By chaselib */
+	group_t   ladder_any_group[BOARD_MAX_COORDS];
+	bool      ladder_any[BOARD_MAX_COORDS];			/* wouldbe_ladder_any() */
+
+	uint32_t  middle_gen[BOARD_MAX_COORDS];			/* By laddered group */
+	int       middle_len[BOARD_MAX_COORDS];			/* Middle ladder length */
+
+	uint32_t  dragon_gen[BOARD_MAX_COORDS];			/* By group */
+	group_t   dragon[BOARD_MAX_COORDS];			/* dragon_at() */
+
+	uint32_t  countercap_gen[BOARD_MAX_COORDS];		/* By group */
+	bool      countercap[BOARD_MAX_COORDS];			/* can_countercapture() */
+} tactics_memo_t;
+
+extern __thread tactics_memo_t tactics_memo;
+
+void tactics_memo_wrap(void);
+
+static inline bool
+tactics_memo_valid(board_t *b)
+{
+	return (tactics_memo.b == b && tactics_memo.moves == b->moves);
+}
+
+/* Start caching queries for current position of @b.
+ * Returns false if we're caching it already (nested call),
+ * pass that on to tactics_memo_stop(). */
+static inline bool
+tactics_memo_start(board_t *b)
+{
+	tactics_memo_t *m = &tactics_memo;
+	if (tactics_memo_valid(b))
+		return false;
+	if (unlikely(!++m->gen))
+		tactics_memo_wrap();
+	m->b = b;
+	m->moves = b->moves;
+	return true;
+}
+
+/* Board is about to change. */
+static inline void
+tactics_memo_stop(bool started)
+{
+	if (started)
+		tactics_memo.b = NULL;
+}
+
+#endif
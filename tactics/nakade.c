@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define QUICK_BOARD_CODE
 
@@ -46,52 +47,128 @@ nakade_area(board_t *b, coord_t around, enum stone color, coord_t *area)
 	return area_n;
 }
 
-static inline void
-get_neighbors(board_t *b, coord_t *area, int area_n, int *neighbors, int *ptbynei)
+/* Shape table: all nakade area shapes (fixed polyominoes up to NAKADE_MAX
+ * points, so every rotation / reflection has its own entry), keyed by
+ * bitmask of the area within its bounding box. Computed at startup, so
+ * queries don't need to look at neighbors within the area anymore. */
+
+#define SHAPE_W        NAKADE_MAX
+#define SHAPE_BIT(x, y)  ((uint64_t)1 << ((y) * SHAPE_W + (x)))
+#define SHAPE_SLOTS    1024	/* 307 shapes */
+
+typedef struct {
+	uint64_t mask;		/* 0 if empty slot */
+	int8_t   vital;		/* Vital point bit index, -1 if none */
+	bool     dead;		/* Can be reduced to one eye */
+} nakade_shape_t;
+
+static nakade_shape_t shapes[SHAPE_SLOTS];
+
+static inline nakade_shape_t *
+shape_slot(uint64_t mask)
 {
-	/* We also collect adjecency information - how many neighbors
-	 * we have for each area point, and histogram of this. This helps
-	 * us verify the appropriate bulkiness of the shape. */
-        memset(neighbors, 0, area_n * sizeof(int));
-	for (int i = 0; i < area_n; i++) {
-		for (int j = i + 1; j < area_n; j++)
-			if (coord_is_adjecent(area[i], area[j])) {
-				ptbynei[neighbors[i]]--;
+	unsigned int h = (mask * 0x9E3779B97F4A7C15ULL) >> 54;
+	while (shapes[h].mask && shapes[h].mask != mask)
+		h = (h + 1) & (SHAPE_SLOTS - 1);
+	return &shapes[h];
+}
+
+/* Vital point and deadness as if looking at it on the board:
+ * classify by neighbor count histogram. */
+static void
+shape_classify(int *xs, int *ys, int n, nakade_shape_t *s)
+{
+	int neighbors[NAKADE_MAX] = { 0, };
+	int ptbynei[9] = { 0, };
+	for (int i = 0; i < n; i++)
+		for (int j = 0; j < n; j++)
+			if (abs(xs[i] - xs[j]) + abs(ys[i] - ys[j]) == 1)
 				neighbors[i]++;
-				ptbynei[neighbors[i]]++;
-				ptbynei[neighbors[j]]--;
-				neighbors[j]++;
-				ptbynei[neighbors[j]]++;
-			}
+	for (int i = 0; i < n; i++)
+		ptbynei[neighbors[i]]++;
+
+	int vital = -1;
+	int which = -1;  /* Neighbor count of vital point */
+	switch (n) {
+		case 3: which = 2;  break;  // middle point
+		case 4: if (ptbynei[3] == 1)  which = 3;  break;  // tetris four
+		case 5: if (ptbynei[3] == 1 && ptbynei[1] == 1)  which = 3;  // bulky five
+			else if (ptbynei[4] == 1)  which = 4;  // cross five
+			break;
+		case 6: if (ptbynei[4] == 1 && ptbynei[2] == 3)  which = 4;  // rabbity six
+			break;
 	}
+	for (int i = 0; which != -1 && i < n; i++)
+		if (neighbors[i] == which)
+			vital = ys[i] * SHAPE_W + xs[i];
+
+	s->vital = vital;
+	s->dead = (n <= 3 || (n == 4 && ptbynei[2] == 4) ||  // square 4
+		   vital != -1);
 }
 
-static inline coord_t
-nakade_point_(coord_t *area, int area_n, int *neighbors, int *ptbynei)
+/* Add shape and all shapes one point bigger. */
+static void
+shapes_grow(int *xs, int *ys, int n)
 {
-	/* For each given neighbor count, arbitrary one coordinate
-	 * featuring that. */
-	coord_t coordbynei[9];
-	for (int i = 0; i < area_n; i++)
-		coordbynei[neighbors[i]] = area[i];
-
-	switch (area_n) {
-		case 1: return pass;
-		case 2: return pass;
-		case 3: assert(ptbynei[2] == 1);
-			return coordbynei[2]; // middle point
-		case 4: if (ptbynei[3] != 1) return pass; // long line, L shape, or square
-			return coordbynei[3]; // tetris four
-		case 5: if (ptbynei[3] == 1 && ptbynei[1] == 1) return coordbynei[3]; // bulky five
-			if (ptbynei[4] == 1) return coordbynei[4]; // cross five
-			return pass; // long line
-		case 6: if (ptbynei[4] == 1 && ptbynei[2] == 3)
-				return coordbynei[4]; // rabbity six
-			return pass; // anything else
-		default: assert(0);
+	/* Normalize to bounding box */
+	int minx = SHAPE_W, miny = SHAPE_W;
+	for (int i = 0; i < n; i++) {
+		if (xs[i] < minx)  minx = xs[i];
+		if (ys[i] < miny)  miny = ys[i];
+	}
+	int nx[NAKADE_MAX + 1], ny[NAKADE_MAX + 1];
+	uint64_t mask = 0;
+	for (int i = 0; i < n; i++) {
+		nx[i] = xs[i] - minx;  ny[i] = ys[i] - miny;
+		mask |= SHAPE_BIT(nx[i], ny[i]);
 	}
 
-	return 0; /* NOTREACHED */
+	nakade_shape_t *s = shape_slot(mask);
+	if (s->mask)  return;  /* Seen already */
+	s->mask = mask;
+	shape_classify(nx, ny, n, s);
+	if (n == NAKADE_MAX)  return;
+
+	int dx[4] = { -1, 1, 0, 0 }, dy[4] = { 0, 0, -1, 1 };
+	for (int i = 0; i < n; i++)
+		for (int d = 0; d < 4; d++) {
+			int x = nx[i] + dx[d], y = ny[i] + dy[d];
+			bool dup = false;
+			for (int j = 0; j < n; j++)
+				if (nx[j] == x && ny[j] == y)  dup = true;
+			if (dup)  continue;
+			nx[n] = x;  ny[n] = y;
+			shapes_grow(nx, ny, n + 1);
+		}
+}
+
+void
+nakade_init(void)
+{
+	static bool done = false;
+	if (done)  return;
+	done = true;
+	int x = 0, y = 0;
+	shapes_grow(&x, &y, 1);
+}
+
+/* Look up shape of @area. */
+static inline nakade_shape_t *
+nakade_shape(board_t *b, coord_t *area, int area_n, int *minx, int *miny)
+{
+	*minx = *miny = board_stride(b);
+	for (int i = 0; i < area_n; i++) {
+		if (coord_x(area[i]) < *minx)  *minx = coord_x(area[i]);
+		if (coord_y(area[i]) < *miny)  *miny = coord_y(area[i]);
+	}
+	uint64_t mask = 0;
+	for (int i = 0; i < area_n; i++)
+		mask |= SHAPE_BIT(coord_x(area[i]) - *minx, coord_y(area[i]) - *miny);
+
+	nakade_shape_t *s = shape_slot(mask);
+	assert(s->mask);  /* nakade_init() not called ? */
+	return s;
 }
 
 coord_t
@@ -103,10 +180,11 @@ nakade_point(board_t *b, coord_t around, enum stone color)
 	if (area_n == -1)
 		return pass;
 
-	int neighbors[area_n]; int ptbynei[9] = {area_n, 0};
-	get_neighbors(b, area, area_n, neighbors, ptbynei);
-	
-	return nakade_point_(area, area_n, neighbors, ptbynei);
+	int minx, miny;
+	nakade_shape_t *s = nakade_shape(b, area, area_n, &minx, &miny);
+	if (s->vital == -1)
+		return pass;
+	return coord_xy(minx + s->vital % SHAPE_W, miny + s->vital / SHAPE_W);
 }
 
 
@@ -117,15 +195,7 @@ nakade_dead_shape(board_t *b, coord_t around, enum stone color)
 	coord_t area[NAKADE_MAX]; int area_n = 0;
 	area_n = nakade_area(b, around, color, area);
 	if (area_n == -1)	return false;
-	if (area_n <= 3)	return true;
-	
-	int neighbors[area_n]; int ptbynei[9] = {area_n, 0};
-	get_neighbors(b, area, area_n, neighbors, ptbynei);
-	
-	if (area_n == 4 && ptbynei[2] == 4)  // square 4
-		return true;
-	
-	/* nakade_point() should be able to deal with the rest ... */
-	coord_t nakade = nakade_point_(area, area_n, neighbors, ptbynei);
-	return  nakade != pass;
+
+	int minx, miny;
+	return nakade_shape(b, area, area_n, &minx, &miny)->dead;
 }
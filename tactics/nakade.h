@@ -6,6 +6,9 @@
 #include "board.h"
 #include "debug.h"
 
+/* Build shape table, call once at startup. */
+void nakade_init(void);
+
 /* Find an eye-piercing point within the @around area of empty board
  * internal to group of color @color.
  * Returns pass if the area is not a nakade shape or not internal. */
@@ -203,3 +203,70 @@ breaking_3_stone_seki(board_t *b, coord_t coord, enum stone color)
 
 	return true;
 }
+
+
+/* Local seki between @g1 and @g2 (opposite colors, 2 libs each, some
+ * shared): every liberty is selfatari for both sides, and neither side
+ * can get out by capturing something. Same as breaking_local_seki()
+ * but looking at the groups, not a move. */
+static bool
+is_local_seki(board_t *b, group_t g1, group_t g2)
+{
+	if (board_group_info(b, g2).libs != 2)
+		return false;
+
+	group_t g[2] = { g1, g2 };
+	for (int i = 0; i < 2; i++)
+		for (int j = 0; j < 2; j++) {
+			coord_t lib = board_group_info(b, g[i]).lib[j];
+			if (!is_selfatari(b, S_BLACK, lib) ||
+			    !is_selfatari(b, S_WHITE, lib))
+				return false;
+		}
+
+	return (!can_countercapture(b, g1, NULL) &&
+		!can_countercapture(b, g2, NULL));
+}
+
+static int
+seki_mark(board_t *b, group_t g, bool *seki)
+{
+	int n = 0;
+	foreach_in_group(b, g) {
+		n += !seki[c];  seki[c] = true;
+	} foreach_in_group_end;
+	for (int i = 0; i < 2; i++) {
+		coord_t lib = board_group_info(b, g).lib[i];
+		n += !seki[lib];  seki[lib] = true;
+	}
+	return n;
+}
+
+/* Sekis @g (black, 2 libs) is part of through shared liberty @lib. */
+static int
+seki_find_at(board_t *b, group_t g, coord_t lib, bool *seki)
+{
+	int n = 0;
+	foreach_neighbor(b, lib, {
+		if (board_at(b, c) != S_WHITE)  continue;
+		group_t g2 = group_at(b, c);
+		if (!is_local_seki(b, g, g2))  continue;
+		n += seki_mark(b, g, seki);
+		n += seki_mark(b, g2, seki);
+	});
+	return n;
+}
+
+int
+seki_find(board_t *b, bool *seki)
+{
+	int n = 0;
+	foreach_point(b) {
+		if (board_at(b, c) != S_BLACK || group_base(group_at(b, c)) != c ||
+		    board_group_info(b, c).libs != 2)
+			continue;
+		for (int i = 0; i < 2; i++)
+			n += seki_find_at(b, c, board_group_info(b, c).lib[i], seki);
+	} foreach_point_end;
+	return n;
+}
@@ -14,4 +14,10 @@ bool breaking_local_seki(board_t *b, selfatari_state_t *s, group_t c);
 bool breaking_false_eye_seki(board_t *b, coord_t coord, enum stone color);
 bool breaking_3_stone_seki(board_t *b, coord_t coord, enum stone color);
 
+/* Mark stones and liberties of groups in local seki (two opposing groups
+ * with 2 libs, all selfatari for both sides) in @seki, which must be
+ * cleared by the caller. Returns number of points marked: these are
+ * alive stones and dame as long as nobody plays there. */
+int seki_find(board_t *b, bool *seki);
+
 #endif /* PACHI_TACTICS_SEKI_H */
@@ -764,6 +764,57 @@ is_bad_selfatari_slow(board_t *b, enum stone color, coord_t to, int flags)
 }
 
 
+/* Liberties we'd have after playing @to, without playing it: own empty
+ * neighbors, other libs of friendly groups, and captured stones touching
+ * the new group. Only need to know if there's more than one. */
+bool
+is_selfatari_slow(board_t *b, enum stone color, coord_t to)
+{
+	/* Ko recapture is illegal, fine as selfatari. */
+	if (b->ko.coord == to && b->ko.color == color)
+		return true;
+
+	group_t friends[4];  int nfriends = 0;
+	coord_t lib = pass;
+	int libs = 0;
+#define add_lib(c_)  do {  if (libs && (c_) == lib)  break;				   if (++libs > 1)  return false;				   lib = (c_);  } while (0)
+
+	foreach_neighbor(b, to, {
+		if (board_at(b, c) == S_NONE) {  add_lib(c);  continue;  }
+		if (board_at(b, c) != color)  continue;
+		group_t g = group_at(b, c);
+		if (board_group_info(b, g).libs > 2)  return false;
+		friends[nfriends++] = g;
+		for (int i = 0; i < board_group_info(b, g).libs; i++)
+			if (board_group_info(b, g).lib[i] != to)
+				add_lib(board_group_info(b, g).lib[i]);
+	});
+
+	/* Captures */
+	group_t captured[4];  int ncaptured = 0;
+	foreach_neighbor(b, to, {
+		if (board_at(b, c) == stone_other(color) &&
+		    board_group_info(b, group_at(b, c)).libs == 1)
+			captured[ncaptured++] = group_at(b, c);
+	});
+	for (int j = 0; j < ncaptured; j++) {
+		foreach_in_group(b, captured[j]) {
+			coord_t stone = c;
+			bool touching = false;
+			foreach_neighbor(b, stone, {
+				if (c == to)  touching = true;
+				for (int i = 0; i < nfriends; i++)
+					if (group_at(b, c) == friends[i])  touching = true;
+			});
+			if (touching)  add_lib(stone);
+		} foreach_in_group_end;
+	}
+#undef add_lib
+
+	return true;
+}
+
+
 coord_t
 selfatari_cousin(board_t *b, enum stone color, coord_t coord, group_t *bygroup)
 {
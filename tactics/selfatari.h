@@ -6,6 +6,7 @@
 #include "board.h"
 #include "board_undo.h"
 #include "debug.h"
+#include "tactics/memo.h"
 
 typedef struct {
 	int     groupcts[S_MAX];	/* number of neighbor groups for each color */
@@ -51,6 +52,7 @@ coord_t selfatari_cousin(board_t *b, enum stone color, coord_t coord, group_t *b
 #define SELFATARI_BIG_GROUPS_ONLY	2
 
 bool is_bad_selfatari_slow(board_t *b, enum stone color, coord_t to, int flags);
+bool is_selfatari_slow(board_t *b, enum stone color, coord_t to);
 
 static inline bool
 is_bad_selfatari(board_t *b, enum stone color, coord_t to)
@@ -59,7 +61,15 @@ is_bad_selfatari(board_t *b, enum stone color, coord_t to)
 	if (immediate_liberty_count(b, to) > 1)
 		return false;
 
-	return is_bad_selfatari_slow(b, color, to, SELFATARI_3LIB_SUICIDE);
+	if (!tactics_memo_valid(b))
+		return is_bad_selfatari_slow(b, color, to, SELFATARI_3LIB_SUICIDE);
+
+	tactics_memo_t *m = &tactics_memo;
+	if (m->selfatari_gen[color][to] != m->gen) {
+		m->selfatari[color][to] = is_bad_selfatari_slow(b, color, to, SELFATARI_3LIB_SUICIDE);
+		m->selfatari_gen[color][to] = m->gen;
+	}
+	return m->selfatari[color][to];
 }
 
 static inline bool
@@ -79,14 +89,7 @@ is_selfatari(board_t *b, enum stone color, coord_t to)
         if (immediate_liberty_count(b, to) > 1)
                 return false;
 
-        bool r = true;
-        with_move(b, to, color, {
-                group_t g = group_at(b, to);
-                if (g && board_group_info(b, g).libs > 1)
-                        r = false;
-        });
-
-        return r;
+        return is_selfatari_slow(b, color, to);
 }
 
 
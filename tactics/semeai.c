@@ -0,0 +1,260 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define QUICK_BOARD_CODE
+
+#define DEBUG
+#include "board.h"
+#include "board_undo.h"
+#include "debug.h"
+#include "mq.h"
+#include "tactics/1lib.h"
+#include "tactics/semeai.h"
+
+
+/* Capturing race reading. Moves considered are restricted to what matters
+ * in a race: capturing stones around our group (gains liberties), extending
+ * out of atari, taking outside then shared liberties of the opponent (eye
+ * liberties can only be filled last, when it captures), and tenuki. Only one
+ * or two candidates of each kind are tried, most liberties for the new stone
+ * first. Plain races (no shared liberties, no eyes, nothing to capture) are
+ * decided by counting, no need to read those out. */
+
+#define SEMEAI_MAX_MOVES 8
+
+typedef struct {
+	coord_t    stone[2];	/* A stone of each group, groups get renumbered as they grow */
+	enum stone color[2];
+	int        budget;	/* Positions left to read */
+	int        max_depth;
+	int        escape_libs;	/* Group with that many libs won */
+} semeai_t;
+
+static inline group_t
+semeai_group(semeai_t *s, board_t *b, int i)
+{
+	return (board_at(b, s->stone[i]) == s->color[i] ? group_at(b, s->stone[i]) : 0);
+}
+
+static bool
+is_group_lib(board_t *b, coord_t lib, group_t g)
+{
+	foreach_neighbor(b, lib, {
+		if (group_at(b, c) == g)  return true;
+	});
+	return false;
+}
+
+void
+semeai_count_libs(board_t *b, group_t g1, group_t g2, semeai_libs_t *l)
+{
+	group_t g[2] = { g1, g2 };
+	l->shared = 0;
+	for (int i = 0; i < 2; i++) {
+		enum stone color = board_at(b, g[i]);
+		l->outside[i] = l->eyes[i] = 0;
+		for (int j = 0; j < board_group_info(b, g[i]).libs; j++) {
+			coord_t lib = board_group_info(b, g[i]).lib[j];
+			if (is_group_lib(b, lib, g[1 - i]))
+				l->shared += (i == 0);
+			else if (board_is_one_point_eye(b, lib, color))
+				l->eyes[i]++;
+			else
+				l->outside[i]++;
+		}
+	}
+}
+
+static void
+add_move(coord_t *moves, int *n, coord_t c)
+{
+	for (int i = 0; i < *n; i++)
+		if (moves[i] == c)  return;
+	if (*n < SEMEAI_MAX_MOVES)
+		moves[(*n)++] = c;
+}
+
+/* Add liberty with most free space around it, and the next one
+ * if that's cramped (could be self-atari). */
+static void
+add_best_libs(board_t *b, coord_t *libs, int nlibs, coord_t *moves, int *n)
+{
+	for (int k = 0; k < 2 && nlibs; k++) {
+		int best = 0;
+		for (int i = 1; i < nlibs; i++)
+			if (immediate_liberty_count(b, libs[i]) > immediate_liberty_count(b, libs[best]))
+				best = i;
+		add_move(moves, n, libs[best]);
+		if (immediate_liberty_count(b, libs[best]) >= 2)
+			break;
+		libs[best] = libs[--nlibs];
+	}
+}
+
+static int
+semeai_moves(board_t *b, group_t gm, group_t go, enum stone to_play, coord_t *moves, bool *shared_libs)
+{
+	enum stone other = stone_other(to_play);
+	int n = 0;
+
+	/* Capture something, gains liberties. */
+	foreach_in_group(b, gm) {
+		foreach_neighbor(b, c, {
+			if (board_at(b, c) == other && board_group_info(b, group_at(b, c)).libs == 1)
+				add_move(moves, &n, board_group_info(b, group_at(b, c)).lib[0]);
+		});
+	} foreach_in_group_end;
+
+	*shared_libs = false;
+	if (board_group_info(b, gm).libs == 1) {
+		add_move(moves, &n, board_group_info(b, gm).lib[0]);
+		return n;
+	}
+
+	/* Take opponent liberties, outside ones first. */
+	coord_t outside[GROUP_KEEP_LIBS], shared[GROUP_KEEP_LIBS];
+	int nout = 0, nshared = 0;
+	for (int i = 0; i < board_group_info(b, go).libs; i++) {
+		coord_t lib = board_group_info(b, go).lib[i];
+		if (is_group_lib(b, lib, gm))
+			shared[nshared++] = lib;
+		else if (!board_is_one_point_eye(b, lib, other))
+			outside[nout++] = lib;
+	}
+	add_best_libs(b, outside, nout, moves, &n);
+	add_best_libs(b, shared, nshared, moves, &n);
+	*shared_libs = (nshared > 0);
+	return n;
+}
+
+/* Plain race: player to move wins if it has as many liberties. */
+static bool
+plain_race(board_t *b, group_t gm, group_t go)
+{
+	semeai_libs_t l;
+	semeai_count_libs(b, gm, go, &l);
+	return (!l.shared && !l.eyes[0] && !l.eyes[1] &&
+		!can_countercapture(b, gm, NULL) && !can_countercapture(b, go, NULL));
+}
+
+/* Returns winner's color, S_NONE if seki or out of budget. */
+static enum stone
+semeai_read(semeai_t *s, board_t *b, enum stone to_play, int depth, bool passed, coord_t *move)
+{
+	enum stone other = stone_other(to_play);
+	int me = (s->color[0] == to_play ? 0 : 1);
+	group_t gm = semeai_group(s, b, me);
+	group_t go = semeai_group(s, b, 1 - me);
+	*move = pass;
+
+	if (!go)  return to_play;
+	if (!gm)  return other;
+	if (--s->budget < 0 || depth > s->max_depth)
+		return S_NONE;
+
+	int lm = board_group_info(b, gm).libs;
+	int lo = board_group_info(b, go).libs;
+	if (lo == 1 && board_is_valid_play(b, to_play, board_group_info(b, go).lib[0])) {
+		*move = board_group_info(b, go).lib[0];
+		return to_play;
+	}
+	if (lo >= s->escape_libs)  return other;
+	if (lm >= s->escape_libs)  return to_play;
+	bool plain = plain_race(b, gm, go);
+	if (plain && lm != lo)
+		return (lm > lo ? to_play : other);
+
+	/* Tenuki first at the top so we only play urgent moves. Deeper down
+	 * it only makes sense if there might be a seki. */
+	coord_t moves[SEMEAI_MAX_MOVES + 1];
+	bool shared_libs;
+	int n = 0;
+	if (!depth)  moves[n++] = pass;
+	n += semeai_moves(b, gm, go, to_play, moves + n, &shared_libs);
+	if (depth && (shared_libs || n == 0))
+		moves[n++] = pass;
+
+	/* Plain race, same liberties: taking one wins. */
+	if (plain && n > !depth) {
+		*move = moves[!depth];
+		return to_play;
+	}
+
+	enum stone best = other;
+	for (int i = 0; i < n; i++) {
+		coord_t c = moves[i];
+		coord_t reply;
+		enum stone r = S_OFFBOARD;
+
+		if (is_pass(c))	/* Both passing is seki */
+			r = (passed ? S_NONE : semeai_read(s, b, other, depth + 1, true, &reply));
+		else if (board_is_valid_play_no_suicide(b, to_play, c))
+			with_move(b, c, to_play, {
+				r = semeai_read(s, b, other, depth + 1, false, &reply);
+			});
+
+		if (r == to_play) {  *move = c;  return to_play;  }
+		if (r == S_NONE)  best = S_NONE;
+		if (s->budget < 0)  return S_NONE;
+	}
+	return best;
+}
+
+enum stone
+semeai_solve(board_t *b, group_t g1, group_t g2, enum stone to_play, int budget, coord_t *move)
+{
+	assert(board_at(b, g1) == stone_other(board_at(b, g2)));
+	*move = pass;
+
+	int libs1 = board_group_info(b, g1).libs;
+	int libs2 = board_group_info(b, g2).libs;
+	if (libs1 > SEMEAI_MAX_LIBS || libs2 > SEMEAI_MAX_LIBS)
+		return S_NONE;
+
+	semeai_t s;
+	s.stone[0] = g1;  s.color[0] = board_at(b, g1);
+	s.stone[1] = g2;  s.color[1] = board_at(b, g2);
+	s.budget = budget;
+	s.max_depth = 2 * (libs1 + libs2) + 6;
+	s.escape_libs = (libs1 > libs2 ? libs1 : libs2) + 2;
+
+	enum stone winner = semeai_read(&s, b, to_play, 0, false, move);
+	if (winner != to_play)  *move = pass;
+
+	if (DEBUGL(6))  fprintf(stderr, "semeai %s vs %s, %s to play: %s wins %s (%d nodes left)\n",
+				coord2sstr(g1), coord2sstr(g2), stone2str(to_play), stone2str(winner),
+				coord2sstr(*move), s.budget);
+	return winner;
+}
+
+void
+group_semeai_check(board_t *b, group_t group, enum stone to_play, move_queue_t *q, int tag, int budget)
+{
+	enum stone other = stone_other(to_play);
+	assert(board_at(b, group) == to_play);
+	if (board_group_info(b, group).libs > SEMEAI_MAX_LIBS)
+		return;
+
+	/* Collect neighbors first, reading plays moves. */
+	move_queue_t ng;  mq_init(&ng);
+	foreach_in_group(b, group) {
+		foreach_neighbor(b, c, {
+			if (board_at(b, c) != other)  continue;
+			/* Only close races are worth reading. */
+			int libs = board_group_info(b, group_at(b, c)).libs;
+			if (libs < 2 || libs > SEMEAI_MAX_LIBS || abs(libs - board_group_info(b, group).libs) > 1)
+				continue;
+			mq_add(&ng, group_at(b, c), 0);
+			mq_nodup(&ng);
+		});
+	} foreach_in_group_end;
+
+	for (unsigned int i = 0; i < ng.moves; i++) {
+		coord_t move;
+		if (semeai_solve(b, group, ng.move[i], to_play, budget, &move) == to_play && !is_pass(move)) {
+			mq_add(q, move, tag);
+			mq_nodup(q);
+		}
+	}
+}
@@ -0,0 +1,34 @@
+#ifndef PACHI_TACTICS_SEMEAI_H
+#define PACHI_TACTICS_SEMEAI_H
+
+/* Capturing race solver. */
+
+#include "board.h"
+#include "debug.h"
+#include "mq.h"
+
+/* Groups with more liberties than this are not semeai material. */
+#define SEMEAI_MAX_LIBS 5
+
+/* Liberties of semeai groups, by kind. Shared liberties are liberties
+ * of both groups, eye liberties one-point eyes of the group's own. */
+typedef struct {
+	int outside[2];
+	int shared;
+	int eyes[2];
+} semeai_libs_t;
+
+void semeai_count_libs(board_t *b, group_t g1, group_t g2, semeai_libs_t *l);
+
+/* Read out capturing race between adjacent groups @g1 and @g2 (opposite
+ * colors), @to_play moving first. Reads at most @budget positions.
+ * Returns winner's color, S_NONE if it's seki or we couldn't tell within
+ * budget. If @to_play wins, @move is set to the winning move (pass if it
+ * doesn't need to play there). */
+enum stone semeai_solve(board_t *b, group_t g1, group_t g2, enum stone to_play, int budget, coord_t *move);
+
+/* Add moves winning capturing races between @group (of @to_play) and its
+ * neighbors to @q. @budget is per neighbor. */
+void group_semeai_check(board_t *b, group_t group, enum stone to_play, move_queue_t *q, int tag, int budget);
+
+#endif
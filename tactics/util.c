@@ -41,9 +41,12 @@ cfg_distances(board_t *b, coord_t start, int *distances, int maxdist)
 #define qinc(x) (x = ((x + 1) >= board_max_coords(b) ? ((x) + 1 - board_max_coords(b)) : (x) + 1))
 	coord_t queue[board_max_coords(b)]; int qstart = 0, qstop = 0;
 
-	foreach_point(b) {
-		distances[c] = board_at(b, c) == S_OFFBOARD ? maxdist + 1 : -1;
-	} foreach_point_end;
+	/* Search is bounded by maxdist, so only a few points get visited:
+	 * Unvisited points have maxdist + 1 already, no board passes. */
+	int far = maxdist + 1;
+	for (int i = 0; i < board_max_coords(b); i++)
+		distances[i] = far;
+#define unvisited(c)  (distances[c] == far && board_at(b, c) != S_OFFBOARD)
 
 	queue[qstop++] = start;
 	for (int d = 0; d <= maxdist; d++) {
@@ -54,19 +57,21 @@ cfg_distances(board_t *b, coord_t start, int *distances, int maxdist)
 		for (int q = qa; q < qb; qinc(q)) {
 #define cfg_one(coord, grp) do {\
 	distances[coord] = d; \
+	if (d == maxdist)  break;  /* Neighbors are far anyway */ \
 	foreach_neighbor (b, coord, { \
-		if (distances[c] < 0 && (!grp || group_at(b, coord) != grp)) { \
+		if (unvisited(c) && (!grp || group_at(b, c) != grp)) { \
 			queue[qstop] = c; \
 			qinc(qstop); \
 		} \
 	}); \
 } while (0)
 			coord_t cq = queue[q];
-			if (distances[cq] >= 0)
+			if (!unvisited(cq))
 				continue; /* We already looked here. */
 			if (board_at(b, cq) == S_NONE) {
 				cfg_one(cq, 0);
 			} else {
+				/* Whole group at once, through the group stone list. */
 				group_t g = group_at(b, cq);
 				foreach_in_group(b, g) {
 					cfg_one(c, g);
@@ -75,11 +80,8 @@ cfg_distances(board_t *b, coord_t start, int *distances, int maxdist)
 #undef cfg_one
 		}
 	}
-
-	foreach_point(b) {
-		if (distances[c] < 0)
-			distances[c] = maxdist + 1;
-	} foreach_point_end;
+#undef unvisited
+#undef qinc
 }
 
 
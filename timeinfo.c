@@ -92,6 +92,7 @@ time_settings(time_info_t *ti, int main_time, int byoyomi_time, int byoyomi_ston
 	} else {
 		ti->type = (main_time > 0 ? TT_TOTAL : TT_MOVE);
 		ti->dim = TD_WALLTIME;
+		ti->can_stop_early = true;
 		ti->timer_start = 0;
 		ti->main_time = (double) main_time;
 		ti->byoyomi_time = (double) byoyomi_time;
@@ -207,10 +208,32 @@ time_sub(time_info_t *ti, double interval, bool new_move)
 }
 
 /* Returns the current time. */
+#ifdef _WIN32
+/* QueryPerformanceCounter(): high resolution and monotonic, unlike
+ * the emulated gettimeofday(). Anchored to wall clock time at startup. */
+static double        qpc_start_time;
+static LARGE_INTEGER qpc_start, qpc_freq;
+
+static __attribute__((constructor)) void
+qpc_init(void)
+{
+	FILETIME ft;
+	GetSystemTimeAsFileTime(&ft);
+	uint64_t t = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+	qpc_start_time = t / 10000000.0 - 11644473600.0;	/* 100ns units since 1601 */
+	QueryPerformanceFrequency(&qpc_freq);
+	QueryPerformanceCounter(&qpc_start);
+}
+#endif
+
 double
 time_now(void)
 {
-#if _POSIX_TIMERS > 0
+#ifdef _WIN32
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return qpc_start_time + (double)(now.QuadPart - qpc_start.QuadPart) / qpc_freq.QuadPart;
+#elif _POSIX_TIMERS > 0
 	struct timespec now;
 	clock_gettime(CLOCK_REALTIME, &now);
 	return now.tv_sec + now.tv_nsec/1000000000.0;
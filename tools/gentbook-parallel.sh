@@ -0,0 +1,62 @@
+#!/bin/sh
+# Build tbook with several pachi processes in parallel:
+# Root tbook is made first (if there's none), then each opening position
+# listed in POSFILE (one per line, moves from empty board, black first:
+# "E5" "E5 C4" ...) is searched by a separate worker and the subtrees
+# are merged into the tbook. Positions must be in the tbook already
+# except for their last move, so go breadth first.
+
+if [ $# -lt 3 ]; then
+	echo "Usage: $0 SIZE JOBS POSFILE [UCT_OPTS]" >&2
+	exit 1
+fi
+size="$1" # board size
+jobs="$2" # number of workers
+posfile="$3"
+opts="$4" # UCT engine options
+pachi=${PACHI:-./pachi}
+
+if [ -n "$GAMES" ]; then
+	games=$GAMES
+elif [ "$size" -le 13 ]; then
+	games=400000
+else
+	games=200000
+fi
+
+setup()
+{
+	printf 'boardsize %s\nclear_board\nkomi 7.5\n' $size
+}
+
+if [ ! -e ucttbook-$size-7.5.pachitree ]; then
+	echo "[root]"
+	{ setup; echo 'pachi-gentbook b'; } | $pachi -t =$games $opts
+fi
+
+work=$(mktemp -d)
+n=0
+while read moves; do
+	[ -n "$moves" ] || continue
+	color=b
+	{
+		setup
+		for m in $moves; do
+			echo "play $color $m"
+			if [ $color = b ]; then color=w; else color=b; fi
+		done
+		echo "pachi-gentbook $color $work/$n"
+	} > $work/$n.gtp
+	echo "[#$n: $moves]"
+	$pachi -t =$games $opts < $work/$n.gtp > /dev/null 2> $work/$n.log &
+	n=$((n+1))
+	[ $((n % jobs)) -ne 0 ] || wait
+done < "$posfile"
+wait
+
+files=""
+for i in $(seq 0 $((n-1))); do
+	[ -e $work/$i ] && files="$files $work/$i"
+done
+{ setup; echo "pachi-mergetbook$files"; } | $pachi $opts
+rm -rf $work
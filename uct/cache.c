@@ -0,0 +1,125 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEBUG
+
+#include "debug.h"
+#include "board.h"
+#include "uct/cache.h"
+#include "uct/tree.h"
+
+typedef struct {
+	hash_t       key;
+	tree_t      *t;
+	size_t       size;
+	unsigned int used;	/* lru clock */
+} tree_cache_entry_t;
+
+static tree_cache_entry_t *entries = NULL;
+static int    nentries = 0, entries_alloc = 0;
+static size_t cache_size = 0, cache_max_size = 0;
+static unsigned int cache_clock = 0;
+
+hash_t
+tree_cache_key(board_t *b, enum stone color)
+{
+	/* Last move too: tree root must match it (and ko mostly depends on it). */
+	hash_t h = b->hash ^ ((hash_t)(last_move(b).coord + 1) << 8 ^ color) * 0x9e3779b97f4a7c15ULL;
+	return h;
+}
+
+static void
+tree_cache_remove(int i)
+{
+	tree_done(entries[i].t);
+	cache_size -= entries[i].size;
+	entries[i] = entries[--nentries];
+}
+
+static int
+tree_cache_find(hash_t key)
+{
+	for (int i = 0; i < nentries; i++)
+		if (entries[i].key == key)  return i;
+	return -1;
+}
+
+/* Drop least recently used trees until @size more fits. */
+static void
+tree_cache_evict(size_t size)
+{
+	while (nentries && cache_size + size > cache_max_size) {
+		int lru = 0;
+		for (int i = 1; i < nentries; i++)
+			if (entries[i].used < entries[lru].used)  lru = i;
+		if (DEBUGL(3))  fprintf(stderr, "tree cache: dropping %i playouts tree (%.1f Mb)\n",
+					entries[lru].t->root->u.playouts, (float)entries[lru].size / (1024*1024));
+		tree_cache_remove(lru);
+	}
+}
+
+void
+tree_cache_set_size(size_t max_size)
+{
+	cache_max_size = max_size;
+	tree_cache_evict(0);
+	if (!max_size) {
+		free(entries);
+		entries = NULL;  entries_alloc = 0;
+	}
+}
+
+void
+tree_cache_save(hash_t key, tree_t *t)
+{
+	if (!cache_max_size || !t->root)  return;
+
+	/* Copy is compact, nodes_size is an upper bound. */
+	size_t size = t->nodes_size;
+	if (size > cache_max_size)  return;
+
+	int i = tree_cache_find(key);
+	if (i >= 0)  tree_cache_remove(i);
+	tree_cache_evict(size);
+
+	/* Small tree has small slabs, big children blocks can waste a lot
+	 * of space in there. Untouched memory is free, give it room. */
+	tree_t *t2 = tree_init(t->root_color, size * 2, 0);
+	if (!t2)  return;
+	tree_copy(t2, t);
+
+	if (nentries == entries_alloc) {
+		entries_alloc = (entries_alloc ? entries_alloc * 2 : 16);
+		entries = crealloc(entries, entries_alloc * sizeof(*entries));
+	}
+	tree_cache_entry_t *e = &entries[nentries++];
+	e->key = key;  e->t = t2;  e->used = ++cache_clock;
+	e->size = t2->nodes_size;
+	cache_size += e->size;
+	if (DEBUGL(3))  fprintf(stderr, "tree cache: saved %i playouts tree (%.1f Mb, %i trees, %.1f Mb total)\n",
+				t->root->u.playouts, (float)e->size / (1024*1024), nentries, (float)cache_size / (1024*1024));
+}
+
+bool
+tree_cache_restore(hash_t key, board_t *b, tree_t *t)
+{
+	int i = tree_cache_find(key);
+	if (i < 0)  return false;
+
+	tree_t *t2 = entries[i].t;
+	if (t2->root_color != t->root_color) {
+		tree_cache_remove(i);	/* Hash collision */
+		return false;
+	}
+	bool better = (!t->root || t2->root->u.playouts > t->root->u.playouts);
+	if (t2->nodes_size * 2 > t->max_tree_size)
+		return false;		/* Doesn't fit, keep it for later */
+	if (better) {
+		if (DEBUGL(2))  fprintf(stderr, "tree cache: restoring %i playouts tree\n", t2->root->u.playouts);
+		tree_copy(t, t2);
+	}
+	tree_cache_remove(i);
+	return better;
+}
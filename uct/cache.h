@@ -0,0 +1,29 @@
+#ifndef PACHI_UCT_CACHE_H
+#define PACHI_UCT_CACHE_H
+
+/* Analysis subtree cache: frontends browsing variations keep coming back
+ * to positions analysed a moment ago. Trees of positions we leave are
+ * copied in here (compact copies, like after tree gc), keyed by position
+ * and color to play, and restored when we get there again.
+ * Process-wide so that it survives engine resets (clear_board + replay).
+ * Least recently used trees get dropped when over memory budget. */
+
+#include "board.h"
+#include "uct/tree.h"
+
+/* Cache key for position @b with @color to play. */
+hash_t tree_cache_key(board_t *b, enum stone color);
+
+/* Set memory budget, 0 disables cache (and frees everything). */
+void tree_cache_set_size(size_t max_size);
+
+/* Save copy of tree @t under @key (search must be stopped).
+ * Replaces older entry for same position. */
+void tree_cache_save(hash_t key, tree_t *t);
+
+/* Restore cached tree for @key (position @b) into @t if it has more
+ * playouts than current content. Entry is removed from cache.
+ * Returns true if restored. */
+bool tree_cache_restore(hash_t key, board_t *b, tree_t *t);
+
+#endif
@@ -31,8 +31,19 @@ typedef enum uct_reporting {
 typedef enum uct_thread_model {
 	TM_TREE, /* Tree parallelization w/o virtual loss. */
 	TM_TREEVL, /* Tree parallelization with virtual loss. */
+	TM_ROOT, /* Root parallelization: one tree per thread group, merged periodically. */
+	TM_LEAF, /* Leaf parallelization: several playouts from each leaf. */
 } uct_thread_model_t;
 
+/* Root parallelization: merge top levels of group trees into the main
+ * tree every ROOT_MERGE_INTERVAL playouts (per thread). */
+#define ROOT_MERGE_INTERVAL	100
+#define ROOT_MERGE_DEPTH	3
+
+/* Adaptive virtual loss: tree depths tuned separately, deeper nodes
+ * share the last one. See uct_vloss_adapt(). */
+#define VLOSS_DEPTHS		8
+
 /* Internal engine state. */
 typedef struct uct {
 	int debug_level;
@@ -46,10 +57,19 @@ typedef struct uct {
 	floating_t resign_threshold, sure_win_threshold;
 	double best2_ratio, bestr_ratio;
 	floating_t max_maintime_ratio;
+	double stable_stop, unstable_window;
+	bool emergency;			/* Emergency moves when nearly out of time, see uct_genmove_emergency() */
+	double emergency_time, emergency_cap;
 	bool pass_all_alive; /* Current value */
 	bool allow_losing_pass;
+	double scoring_time;
 	bool territory_scoring;
 	int expand_p;
+	int lazy_expand;        /* Lazy expansion: children created on expansion, 0: all */
+	int widen_playouts;     /* Playouts before first widening, see uct_widen() */
+	floating_t settled_prune;  /* Ownermap confidence for settled points, 0: off */
+	bitboard_t settled;        /* Settled points for current search (set on search start) */
+	int settled_points;
 	bool playout_amaf;
 	bool amaf_prior;
 	int playout_amaf_cutoff;
@@ -59,26 +79,61 @@ typedef struct uct {
 
 	/* Memory management */
 	bool auto_alloc;
+	int tree_recycle;	/* Recycle nodes when tree is full, % of memory kept (0: off) */
 	size_t tree_size;
 	size_t max_tree_size_opt;
 	size_t max_mem;
+	bool background_gc;
+	size_t tree_hugepages;
+	int tree_numa;
+	int tt_bits;
+	int tt_eqex;
 	
 	int mercymin;
+	int cutoff;
 	int significant_threshold;
 	bool genmove_reset_tree;
 
 	int threads;
 	enum uct_thread_model thread_model;
 	int virtual_loss;
+	int root_groups;
+	bool pin_threads;	/* Worker threads cpu placement, see uct_pin_init() */
+	int pin_node;
+	int *pin_cpus;		/* Cpu of worker tid: pin_cpus[tid % pin_ncpus] */
+	int pin_ncpus;
+	int leaf_playouts;
+	floating_t value_weight;	/* Value network leaf evaluation weight, see leaf_value_start() */
+	int batch_backprop;
+	int dcnn_async;
+	int dcnn_visits;	/* Inner nodes dcnn priors, see uct_prior_dcnn_visits() */
+	int dcnn_rate;		/* dcnn_visits requests per second, 0: no limit */
+	floating_t dcnn_select;	/* Several dcnns: max share of move time for an evaluation */
+	int pattern_lazy;
 	enum stone my_color;
 
 	/* Current search flags */
 	int search_flags;
 	
 	bool pondering_opt;                /* User wants pondering */
+	int     ponder_threads;            /* Pondering: max threads, 0: all */
+	bool    ponder_load;               /* Pondering: leave cpus other processes need */
+	volatile int active_threads;       /* Running search threads, see uct_search_set_threads() */
 	int     dcnn_pondering_prior;      /* Prior next move guesses */
 	int     dcnn_pondering_mcts;       /* Genmove next move guesses */
 	coord_t dcnn_pondering_mcts_c[20];
+	int     pondering_spread;          /* Genmove pondering: opponent replies to cover */
+	long    pondering_reused;          /* Playouts kept from pondering / total */
+	long    pondering_total;
+	long    games_played;              /* Games played by own searches, for --bench */
+	long    expand_races;              /* Expansions lost to another thread, for --bench */
+
+	int        vloss_adapt;                     /* Adaptive virtual loss: target collision rate (%), 0: off */
+	floating_t vloss_scale[VLOSS_DEPTHS];       /* Virtual loss multiplier per depth */
+	long       vloss_visits[VLOSS_DEPTHS];      /* Descents through nodes at each depth ... */
+	long       vloss_collisions[VLOSS_DEPTHS];  /* ... with another descent in progress */
+	long       vloss_last[VLOSS_DEPTHS][2];     /* Counts at last adaptation */
+	long       vloss_races;                     /* expand_races at search start */
 	
 	int fuseki_end;
 	int yose_start;
@@ -113,6 +168,10 @@ typedef struct uct {
 
 	/* Used within frame of single genmove. */
 	ownermap_t ownermap;
+	volatile int mcowner_claimed;  /* mcowner playouts started, see uct_mcowner_playouts() */
+	hash_t ownermap_hash;          /* Position ownermap is for */
+	int    ownermap_moves;
+	int    score_est_playouts;     /* Incremental ownermap updates, see uct_ownermap_refresh() */
 	bool allow_pass;    /* allow pass in uct descent */
 
 	/* Distributed engine */
@@ -125,14 +184,29 @@ typedef struct uct {
 	int stats_hbits;
 	int shared_nodes;
 	int shared_levels;
+	int shared_pv_levels;
 	double stats_delay; /* stored in seconds */
 	int played_own;
 	int played_all; /* games played by all slaves */
+
+	/* Root dcnn policy from the master (pachi-dcnn_priors), by coord. */
+	float root_policy[BOARD_MAX_COORDS];
+	int root_policy_moves; /* move number it's for, -1 if none */
+	enum stone root_policy_color;
 #endif
 
 	/* Saved dead groups, for final_status_list dead */
 	move_queue_t dead_groups;
 	int pass_moveno;
+
+	/* Analysis: tree root position key, root was analysed ?
+	 * Tree gets saved in subtree cache when we leave it, see uct/cache.h */
+	hash_t t_key;
+	bool t_analyzed;
+
+	/* Undo: previous roots kept in tree once we've seen an undo. */
+	int undo_history;
+	bool undo_seen;
 	
 	/* Timing */
 	double mcts_time;
@@ -169,6 +243,7 @@ void uct_get_best_moves(uct_t *u, coord_t *best_c, float *best_r, int nbest, boo
 void uct_get_best_moves_at(uct_t *u, tree_node_t *n, coord_t *best_c, float *best_r, int nbest, bool winrates, int min_playouts);
 void uct_mcowner_playouts(uct_t *u, board_t *b, enum stone color);
 void uct_tree_size_init(uct_t *u, size_t tree_size);
+void uct_tree_limits(uct_t *u, size_t *max_tree_size, size_t *max_mem);
 
 
 /* This is the state used for descending the tree; we use this wrapper
@@ -15,13 +15,13 @@
 tree_node_t *
 uctp_generic_choose(uct_policy_t *p, tree_node_t *node, board_t *b, enum stone color, coord_t exclude)
 {
-	tree_node_t *nbest = node->children;
+	tree_node_t *end, *nbest = node_children_range(node, &end);
 	if (!nbest) return NULL;
-	tree_node_t *nbest2 = nbest->sibling;
+	tree_node_t *nbest2 = (nbest + 1 < end ? nbest + 1 : NULL);
 
 	/* This function is called while the tree is updated by other threads.
 	 * We rely on node->children being set only after the node has been fully expanded. */
-	for (tree_node_t *ni = nbest2; ni; ni = ni->sibling) {
+	for (tree_node_t *ni = nbest2; ni && ni < end; ni++) {
 		// we compare playouts and choose the best-explored
 		// child; comparing values is more brittle
 		if (node_coord(ni) == exclude || ni->hints & TREE_HINT_INVALID)
@@ -25,12 +25,15 @@ void uctp_generic_winner(uct_policy_t *p, tree_t *tree, uct_descent_t *descent);
 #define uctd_try_node_children(tree, descent, allow_pass, parity, tenuki_d, di, urgency) \
 	/* Information abound best children. */ \
 	/* XXX: We assume board <=25x25. */ \
-	uct_descent_t dbest[BOARD_MAX_MOVES + 1] = { uct_descent(descent->node->children) }; int dbests = 1; \
+	tree_node_t *dci_end, *dci_start = node_children_range(descent->node, &dci_end); \
+	/* Not zeroing the whole array, that's a few kb for every node descended. */ \
+	uct_descent_t dbest[BOARD_MAX_MOVES + 1]; int dbests = 1; \
+	dbest[0] = (uct_descent_t) uct_descent(dci_start); \
 	floating_t best_urgency = -9999; \
 	/* Descent children iterator. */ \
-	uct_descent_t dci = uct_descent(descent->node->children); \
+	uct_descent_t dci = uct_descent(dci_start); \
 	\
-	for (; dci.node; dci.node = dci.node->sibling) { \
+	for (; dci.node < dci_end; dci.node++) { \
 		floating_t urgency; \
 		/* Do not consider passing early. */ \
 		if (unlikely((!allow_pass && is_pass(node_coord(dci.node))) || (dci.node->hints & TREE_HINT_INVALID))) \
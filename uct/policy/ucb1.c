@@ -10,6 +10,7 @@
 #include "random.h"
 #include "uct/internal.h"
 #include "uct/tree.h"
+#include "uct/walk.h"
 #include "uct/policy/generic.h"
 
 /* This implements the basic UCB1 policy. */
@@ -46,7 +47,7 @@ ucb1_descend(uct_policy_t *p, tree_t *tree, uct_descent_t *descent, int parity,
 
 		if (uct_playouts) {
 			urgency = (ni->u.playouts * tree_node_get_value(tree, parity, ni->u.value)
-				   + ni->prior.playouts * tree_node_get_value(tree, parity, ni->prior.value))
+				   + ni->prior.playouts * tree_node_get_value(tree, parity, node_prior(ni).value))
 				   + (parity > 0 ? 0 : ni->descents)
 				  / uct_playouts;
 			urgency += b->explore_p * sqrt(xpl / uct_playouts);
@@ -67,12 +68,12 @@ ucb1_update(uct_policy_t *p, tree_t *tree, tree_node_t *node, enum stone node_co
 	 * different order. */
 	enum stone winner_color = result > 0.5 ? S_BLACK : S_WHITE;
 
-	for (; node; node = node->parent) {
-		stats_add_result(&node->u, result, 1);
+	for (; node; node = node_parent(node)) {
+		uct_stats_add_result(&node->u, result, 1);
 
 		if (!is_pass(node_coord(node))) {
-			stats_add_result(&node->winner_owner, board_at(final_board, node_coord(node)) == winner_color ? 1.0 : 0.0, 1);
-			stats_add_result(&node->black_owner, board_at(final_board, node_coord(node)) == S_BLACK ? 1.0 : 0.0, 1);
+			uct_stats_add_result(&tree_node_cold(tree, node)->winner_owner, board_at(final_board, node_coord(node)) == winner_color ? 1.0 : 0.0, 1);
+			uct_stats_add_result(&tree_node_cold(tree, node)->black_owner, board_at(final_board, node_coord(node)) == S_BLACK ? 1.0 : 0.0, 1);
 		}
 	}
 }
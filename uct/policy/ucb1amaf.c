@@ -14,6 +14,7 @@
 #include "tactics/util.h"
 #include "uct/internal.h"
 #include "uct/tree.h"
+#include "uct/walk.h"
 #include "uct/policy/generic.h"
 
 /* This implements the UCB1 policy with an extra AMAF heuristics. */
@@ -99,33 +100,54 @@ static inline floating_t fast_sqrt(unsigned int x)
 	}
 }
 
+/* Terms that only depend on the parent node, computed once per descent
+ * instead of once per child. */
+typedef struct {
+	floating_t vloss_coeff;
+	bool       crit;		/* criticality heuristics on */
+	floating_t crit_playouts;	/* only for children with more playouts */
+	floating_t beta;		/* !sylvain_rave */
+} ucb1rave_parent_t;
+
+static inline void
+ucb1rave_parent_init(uct_policy_t *p, tree_t *tree, tree_node_t *parent, ucb1rave_parent_t *pt)
+{
+	ucb1_policy_amaf_t *b = (ucb1_policy_amaf_t*)p->data;
+	pt->vloss_coeff = b->vloss_sqrt ? sqrt(p->uct->threads) / p->uct->threads : 1.;
+	if (p->uct->vloss_adapt && parent) {
+		int d = tree_node_depth(tree, parent) - tree_node_depth(tree, tree->root);
+		pt->vloss_coeff *= p->uct->vloss_scale[(d < VLOSS_DEPTHS ? d : VLOSS_DEPTHS - 1)];
+	}
+	pt->crit = (b->crit_rave > 0);
+	pt->crit_playouts = (b->crit_plthres_coef > 0 ? tree->root->u.playouts * b->crit_plthres_coef : b->crit_min_playouts);
+	/* XXX: Not used by default. */
+	pt->beta = (!b->sylvain_rave && parent ? sqrt(b->equiv_rave / (3 * parent->u.playouts + b->equiv_rave)) : 0);
+}
+
 #define URAVE_DEBUG if (0)
 static inline floating_t
-ucb1rave_evaluate(uct_policy_t *p, tree_t *tree, uct_descent_t *descent, int parity)
+ucb1rave_evaluate_child(uct_policy_t *p, tree_t *tree, uct_descent_t *descent, int parity, ucb1rave_parent_t *pt)
 {
 	ucb1_policy_amaf_t *b = (ucb1_policy_amaf_t*)p->data;
 	tree_node_t *node = descent->node;
 
-	move_stats_t n = node->u, r = node->amaf;
+	move_stats_t n = node->u, r = node->amaf, prior = node_prior(node);
 	if (p->uct->amaf_prior) {
-		stats_merge(&r, &node->prior);
+		stats_merge(&r, &prior);
 	} else {
-		stats_merge(&n, &node->prior);
+		stats_merge(&n, &prior);
 	}
 
 	if (p->uct->virtual_loss) {
 		/* Add virtual loss if we need to; this is used to discourage
 		 * other threads from visiting this node in case of multiple
 		 * threads doing the tree search. */
-		floating_t vloss_coeff = b->vloss_sqrt ? sqrt(p->uct->threads) / p->uct->threads : 1.;
-		move_stats_t c = move_stats((parity > 0 ? 0. : 1.), node->descents * vloss_coeff);
+		move_stats_t c = move_stats((parity > 0 ? 0. : 1.), node->descents * pt->vloss_coeff);
 		stats_merge(&n, &c);
 	}
 
 	/* Criticality heuristics. */
-	if (b->crit_rave > 0 && (b->crit_plthres_coef > 0
-				 ? node->u.playouts > tree->root->u.playouts * b->crit_plthres_coef
-				 : node->u.playouts > b->crit_min_playouts)) {
+	if (pt->crit && node->u.playouts > pt->crit_playouts) {
 		floating_t crit = tree_node_criticality(tree, node);
 		if (b->crit_negative || crit > 0) {
 			floating_t val = 1.0f;
@@ -147,27 +169,23 @@ ucb1rave_evaluate(uct_policy_t *p, tree_t *tree, uct_descent_t *descent, int par
 		if (r.playouts) {
 			/* At the beginning, beta is at 1 and RAVE is used.
 			 * At b->equiv_rate, beta is at 1/3 and gets steeper on. */
-			floating_t beta;
-			if (b->sylvain_rave) {
+			floating_t beta = pt->beta;
+			if (b->sylvain_rave)
 				beta = (floating_t) r.playouts / (r.playouts + n.playouts
 					+ (floating_t) n.playouts * r.playouts / b->equiv_rave);
-			} else {
-				/* XXX: This can be cached in descend; but we don't use this by default. */
-				beta = sqrt(b->equiv_rave / (3 * node->parent->u.playouts + b->equiv_rave));
-			}
 
 			value = beta * r.value + (1.f - beta) * n.value;
 			URAVE_DEBUG fprintf(stderr, "\t%s value = %f * %f + (1 - %f) * %f (prior %f)\n",
-			        coord2sstr(node_coord(node)), beta, r.value, beta, n.value, node->prior.value);
+			        coord2sstr(node_coord(node)), beta, r.value, beta, n.value, prior.value);
 		} else {
 			value = n.value;
 			URAVE_DEBUG fprintf(stderr, "\t%s value = %f (prior %f)\n",
-			        coord2sstr(node_coord(node)), n.value, node->prior.value);
+			        coord2sstr(node_coord(node)), n.value, prior.value);
 		}
 	} else if (r.playouts) {
 		value = r.value;
 		URAVE_DEBUG fprintf(stderr, "\t%s value = rave %f (prior %f)\n",
-			coord2sstr(node_coord(node)), r.value, node->prior.value);
+			coord2sstr(node_coord(node)), r.value, prior.value);
 	}
 	descent->value.playouts = r.playouts + n.playouts;
 	descent->value.value = value;
@@ -175,10 +193,20 @@ ucb1rave_evaluate(uct_policy_t *p, tree_t *tree, uct_descent_t *descent, int par
 	return tree_node_get_value(tree, parity, value);
 }
 
+static floating_t
+ucb1rave_evaluate(uct_policy_t *p, tree_t *tree, uct_descent_t *descent, int parity)
+{
+	ucb1rave_parent_t pt;
+	ucb1rave_parent_init(p, tree, node_parent(descent->node), &pt);
+	return ucb1rave_evaluate_child(p, tree, descent, parity, &pt);
+}
+
 void
 ucb1rave_descend(uct_policy_t *p, tree_t *tree, uct_descent_t *descent, int parity, bool allow_pass)
 {
 	ucb1_policy_amaf_t *b = (ucb1_policy_amaf_t*)p->data;
+	ucb1rave_parent_t pt;
+	ucb1rave_parent_init(p, tree, descent->node, &pt);
 	floating_t nconf = 1.f;
 	if (b->explore_p > 0)
 		nconf = sqrt(log(descent->node->u.playouts + descent->node->prior.playouts));
@@ -192,7 +220,7 @@ ucb1rave_descend(uct_policy_t *p, tree_t *tree, uct_descent_t *descent, int pari
 
 	uctd_try_node_children(tree, descent, allow_pass, parity, u->tenuki_d, di, urgency) {
 		tree_node_t *ni = di.node;
-		urgency = ucb1rave_evaluate(p, tree, &di, parity);
+		urgency = ucb1rave_evaluate_child(p, tree, &di, parity, &pt);
 
 #ifdef DISTRIBUTED
 		/* In distributed mode, encourage different slaves to work on different
@@ -241,45 +269,43 @@ ucb1amaf_update(uct_policy_t *p, tree_t *tree, tree_node_t *node,
 	enum stone winner_color = result > 0.5 ? S_BLACK : S_WHITE;
 
 	/* Record of the random playout - for each intersection coord,
-	 * first_move[coord] is the index map->game of the first move
+	 * amafmap_first_move() is the index in map->game of the first move
 	 * at this coordinate, or INT_MAX if the move was not played.
-	 * The parity gives the color of this move.
-	 */
-	int first_map[board_max_coords(final_board)+1];
-	int *first_move = &first_map[1]; // +1 for pass
+	 * The parity gives the color of this move. Playout keeps it
+	 * up-to-date as it goes, we just have to add tree moves while
+	 * walking up (this modifies @map). */
 
 #if 0
-	for (tree_node_t *ni = node; ni; ni = ni->parent)
+	for (tree_node_t *ni = node; ni; ni = node_parent(ni))
 		fprintf(stderr, "%s ", coord2sstr(node_coord(ni)));
 	fprintf(stderr, "[color %d] update result %d (color %d)\n",
 			node_color, result, player_color);
 #endif
 
-	/* Initialize first_move */
-	for (int i = pass; i < board_max_coords(final_board); i++) first_move[i] = INT_MAX;
-	int move;
 	assert(map->gamelen > 0);
-	for (move = map->gamelen - 1; move >= map->game_baselen; move--)
-		first_move[map->game[move]] = move;
+	int move = map->game_baselen - 1;
+	/* Criticality stats only needed if we use them. */
+	bool crit = (b->crit_rave > 0);
 
 	while (node) {
-		if (!b->crit_amaf && !is_pass(node_coord(node))) {
-			stats_add_result(&node->winner_owner, board_local_value(b->crit_lvalue, final_board, node_coord(node), winner_color), 1);
-			stats_add_result(&node->black_owner, board_local_value(b->crit_lvalue, final_board, node_coord(node), S_BLACK), 1);
+		if (crit && !b->crit_amaf && !is_pass(node_coord(node))) {
+			uct_stats_add_result(&tree_node_cold(tree, node)->winner_owner, board_local_value(b->crit_lvalue, final_board, node_coord(node), winner_color), 1);
+			uct_stats_add_result(&tree_node_cold(tree, node)->black_owner, board_local_value(b->crit_lvalue, final_board, node_coord(node), S_BLACK), 1);
 		}
-		stats_add_result(&node->u, result, 1);
+		uct_stats_add_result(&node->u, result, 1);
 
 		bool *ko_capture_map = &map->is_ko_capture[move+1];
 		int max_threat_dist = b->threat_rave <= 0 ? ko_length(ko_capture_map, map->gamelen - (move+1)) : -1;
 
 		assert(map->game_baselen >= 0);
-		for (tree_node_t *ni = node->children; ni; ni = ni->sibling) {
+		foreach_child(node, ni) {
 			if (is_pass(node_coord(ni))) continue;
 
 			/* Use the child move only if it was first played by the same color. */
-			int first = first_move[node_coord(ni)];
-			if (first == INT_MAX) continue;
-			assert(first > move && first < map->gamelen);
+			/* Moves past gamelen got cut off (playout_amaf_cutoff) */
+			int first = amafmap_first_move(map, node_coord(ni));
+			if (first >= map->gamelen) continue;
+			assert(first > move);
 			int distance = first - (move + 1);
 			if (distance & 1) continue;
 
@@ -296,26 +322,26 @@ ucb1amaf_update(uct_policy_t *p, tree_t *tree, tree_node_t *node,
 				/* Give more weight to moves played earlier */
 				weight += b->distance_rave * (map->gamelen - first) / (map->gamelen - move);
 			}
-			stats_add_result(&ni->amaf, res, weight);
+			uct_stats_add_result(&ni->amaf, res, weight);
 
-			if (b->crit_amaf) {
-				stats_add_result(&ni->winner_owner, board_local_value(b->crit_lvalue, final_board, node_coord(ni), winner_color), 1);
-				stats_add_result(&ni->black_owner, board_local_value(b->crit_lvalue, final_board, node_coord(ni), S_BLACK), 1);
+			if (crit && b->crit_amaf) {
+				uct_stats_add_result(&tree_node_cold(tree, ni)->winner_owner, board_local_value(b->crit_lvalue, final_board, node_coord(ni), winner_color), 1);
+				uct_stats_add_result(&tree_node_cold(tree, ni)->black_owner, board_local_value(b->crit_lvalue, final_board, node_coord(ni), S_BLACK), 1);
 			}
 #if 0
 			board_t bb; bb.size = 9+2;
 			fprintf(stderr, "* %s<%" PRIhash "> -> %s<%" PRIhash "> [%d/%f => %d/%f]\n",
-				coord2sstr(node_coord(node)), node->hash,
-				coord2sstr(node_coord(ni)), ni->hash,
+				coord2sstr(node_coord(node)), tree_node_cold(tree, node)->hash,
+				coord2sstr(node_coord(ni)), tree_node_cold(tree, ni)->hash,
 				player_color, result, move, res);
 #endif
 		}
-		if (node->parent) {
-			assert(move >= 0 && map->game[move] == node_coord(node) && first_move[node_coord(node)] > move);
-			first_move[node_coord(node)] = move;
+		if (node_parent(node)) {
+			assert(move >= 0 && map->game[move] == node_coord(node) && amafmap_first_move(map, node_coord(node)) > move);
+			amafmap_set_first_move(map, node_coord(node), move);
 			move--;
 		}
-		node = node->parent;
+		node = node_parent(node);
 	}
 }
 
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #define DEBUG
 #include "board.h"
@@ -13,12 +14,17 @@
 #include "engine.h"
 #include "tactics/1lib.h"
 #include "tactics/ladder.h"
+#include "tactics/memo.h"
+#include "tactics/semeai.h"
 #include "tactics/util.h"
 #include "uct/internal.h"
 #include "uct/plugins.h"
 #include "uct/prior.h"
 #include "uct/tree.h"
 #include "dcnn.h"
+#ifdef DISTRIBUTED
+#include "uct/slave.h"
+#endif
 
 #define PRIOR_BEST_N 20
 
@@ -30,10 +36,10 @@ get_node_prior_best_moves(tree_node_t *parent, coord_t *best_c, float *best_r, i
 	}
 	
 	float max = 0.0;
-	for (tree_node_t *n = parent->children; n; n = n->sibling)
+	foreach_child(parent, n)
 		max = MAX(max, n->prior.playouts);
 
-	for (tree_node_t *n = parent->children; n; n = n->sibling)
+	foreach_child(parent, n)
 		best_moves_add(node_coord(n), (float)n->prior.playouts / max, best_c, best_r, nbest);
 }
 
@@ -130,11 +136,11 @@ uct_prior_dcnn(uct_t *u, tree_node_t *node, prior_map_t *map)
 	float   r[19 * 19];
 	coord_t best_c[DCNN_BEST_N];
 	float   best_r[DCNN_BEST_N];
-	if (!node->parent)  dcnn_evaluate(map->b, map->to_play, r);
+	if (!node_parent(node))  dcnn_evaluate(map->b, map->to_play, r);
 	else                dcnn_evaluate_quiet(map->b, map->to_play, r);
 	get_dcnn_best_moves(map->b, r, best_c, best_r, DCNN_BEST_N);
 	
-	if (UDEBUGL(2) && !node->parent)
+	if (UDEBUGL(2) && !node_parent(node))
 		print_dcnn_best_moves(map->b, best_c, best_r, DCNN_BEST_N);
 	
 	foreach_free_point(map->b) {
@@ -153,6 +159,108 @@ uct_prior_dcnn(uct_t *u, tree_node_t *node, prior_map_t *map)
 #endif
 }
 
+/* Distributed slave without dcnn: root priors from the policy of
+ * another slave, sent by the master. */
+static void
+uct_prior_remote_dcnn(uct_t *u, tree_node_t *node, prior_map_t *map)
+{
+#ifdef DISTRIBUTED
+	float *r = uct_slave_root_policy(u, map->b, map->to_play);
+	if (!r)  return;
+	
+	foreach_free_point(map->b) {
+		if (!map->consider[c] || r[c] < 0.001)
+			continue;
+		add_prior_value(map, c, 1, sqrt(r[c]) * u->prior->remote_dcnn_eqex);
+	} foreach_free_point_end;
+
+	node->hints |= TREE_HINT_DCNN;
+#endif
+}
+
+#ifdef DCNN
+/* Asynchronous dcnn priors: node gets expanded with regular priors,
+ * dcnn priors are added on top when evaluation comes back. */
+static void
+uct_prior_dcnn_async_done(void *ctx, void *data, int parity, float r[], float value)
+{
+	uct_t *u = (uct_t*)ctx;
+	tree_node_t *node = (tree_node_t*)data;
+	
+	foreach_child(node, ni) {
+		coord_t c = node_coord(ni);
+		if (is_pass(c))
+			continue;
+		
+		float val = r[coord2dcnn_idx(c)];
+		if (isnan(val) || val < 0.001)
+			continue;
+		move_stats_t prior = node_prior(ni);
+		stats_add_result(&prior, (parity > 0 ? 1 : 0), sqrt(val) * u->prior->dcnn_eqex);
+		node_set_prior(ni, prior);
+	}
+
+	node->hints |= TREE_HINT_DCNN;
+	if (u->virtual_loss)
+		__sync_fetch_and_sub(&node->descents, u->virtual_loss);
+}
+
+/* dcnn_visits without dcnn_async: batch size */
+#define DCNN_VISITS_BATCH 16
+
+void
+uct_prior_dcnn_async_init(uct_t *u, board_t *b)
+{
+	int batch = (u->dcnn_async ? u->dcnn_async : DCNN_VISITS_BATCH);
+	dcnn_queue_start(b, batch, uct_prior_dcnn_async_done, u);
+}
+
+/* Inner nodes dcnn priors: node has been searched for a while with
+ * regular priors, dcnn priors replace them (only even priors are kept). */
+static void
+uct_prior_dcnn_visits_done(void *ctx, void *data, int parity, float r[], float value)
+{
+	uct_t *u = (uct_t*)ctx;
+	tree_node_t *node = (tree_node_t*)data;
+	
+	foreach_child(node, ni) {
+		coord_t c = node_coord(ni);
+		if (is_pass(c))
+			continue;
+
+		move_stats_t prior = move_stats(0.5, u->prior->even_eqex);
+		float val = r[coord2dcnn_idx(c)];
+		if (!isnan(val) && val >= 0.001)
+			stats_add_result(&prior, (parity > 0 ? 1 : 0), sqrt(val) * u->prior->dcnn_eqex);
+		node_set_prior(ni, prior);
+	}
+
+	node->hints |= TREE_HINT_DCNN;
+}
+
+/* Queue dcnn evaluation of @node, searched enough to deserve it.
+ * Descents carry on meanwhile. Returns false if queue is full. */
+bool
+uct_prior_dcnn_visits(uct_t *u, tree_node_t *node, board_t *b, enum stone color, int parity)
+{
+	return dcnn_queue_submit_cb(b, color, uct_prior_dcnn_visits_done, node, parity);
+}
+
+/* Queue dcnn evaluation of freshly expanded @node.
+ * Virtual loss keeps other threads away until it's done. */
+void
+uct_prior_dcnn_async(uct_t *u, tree_node_t *node, board_t *b, enum stone color, int parity)
+{
+	if (u->virtual_loss)
+		__sync_fetch_and_add(&node->descents, u->virtual_loss);
+	if (dcnn_queue_submit(b, color, node, parity))
+		return;
+	/* Queue full, node keeps regular priors. */
+	if (u->virtual_loss)
+		__sync_fetch_and_sub(&node->descents, u->virtual_loss);
+}
+#endif
+
 static void
 uct_prior_ko(uct_t *u, tree_node_t *node, prior_map_t *map)
 {
@@ -228,7 +336,7 @@ uct_prior_joseki(uct_t *u, tree_node_t *node, prior_map_t *map)
 	for (int i = 0; i < matches; i++)
 		add_prior_value(map, coords[i], 1.0, ratings[i] * u->prior->joseki_eqex);
 
-	if (DEBUGL(2) && !node->parent && matches) {
+	if (DEBUGL(2) && !node_parent(node) && matches) {
 		float best_r[20];
 		coord_t best_c[20];
 		get_joseki_best_moves(b, coords, ratings, matches, best_c, best_r, 20);
@@ -236,6 +344,35 @@ uct_prior_joseki(uct_t *u, tree_node_t *node, prior_map_t *map)
 	}
 }
 
+static void
+uct_prior_semeai(uct_t *u, tree_node_t *node, prior_map_t *map)
+{
+	/* Q_{semeai} */
+	/* Moves winning capturing races around last move. */
+	board_t *b = map->b;
+	if (is_pass(last_move(b).coord))
+		return;
+
+	move_queue_t q;  mq_init(&q);
+	group_t group2 = 0;
+	foreach_8neighbor(b, last_move(b).coord) {
+		group_t g = group_at(b, c);
+		if (!g || g == group2 || board_at(b, c) != map->to_play)
+			continue;
+		if (board_group_info(b, g).libs < 2 || board_group_info(b, g).libs > SEMEAI_MAX_LIBS)
+			continue;
+		group_semeai_check(b, g, map->to_play, &q, 0, u->prior->semeai_budget);
+		group2 = g;
+	} foreach_8neighbor_end;
+
+	for (unsigned int i = 0; i < q.moves; i++)
+		if (map->consider[q.move[i]])
+			add_prior_value(map, q.move[i], 1, u->prior->semeai_eqex);
+}
+
+/* Moves below that don't get pattern prior. */
+#define PATTERN_PRIOR_MIN_PROB 0.001
+
 static void
 uct_prior_pattern(uct_t *u, tree_node_t *node, prior_map_t *map)
 {
@@ -243,10 +380,10 @@ uct_prior_pattern(uct_t *u, tree_node_t *node, prior_map_t *map)
 
 	board_t *b = map->b;
 	floating_t probs[b->flen];
-	pattern_rate_moves_fast(&u->pc, b, map->to_play, probs, &u->ownermap);
+	pattern_rate_moves_fast(&u->pc, b, map->to_play, probs, &u->ownermap, PATTERN_PRIOR_MIN_PROB, map->legal);
 
 	/* Show patterns best moves for root node if not using dcnn. */
-	if (DEBUGL(2) && !node->parent && !using_dcnn(b)) {
+	if (DEBUGL(2) && !node_parent(node) && !using_dcnn(b)) {
 		float best_r[20];
 		coord_t best_c[20];
 		get_pattern_best_moves(b, probs, best_c, best_r, 20);
@@ -259,17 +396,124 @@ uct_prior_pattern(uct_t *u, tree_node_t *node, prior_map_t *map)
 	}
 
 	for (int f = 0; f < b->flen; f++) {
-		if (isnan(probs[f]) || probs[f] < 0.001)
+		if (isnan(probs[f]) || probs[f] < PATTERN_PRIOR_MIN_PROB)
 			continue;
 		assert(!is_pass(b->f[f]));
 		add_prior_value(map, b->f[f], 1.0, sqrt(probs[f]) * u->prior->pattern_eqex);
 	}
+
+	node->hints |= TREE_HINT_PATTERNS;
+}
+
+/* Lazy pattern priors: nodes get expanded with cheap priors only so that
+ * descent doesn't stall on pattern matching, pattern priors are added on
+ * top once node has been visited enough to be worth it (@b is the node's
+ * position). Caller makes sure only one thread does it. */
+void
+uct_prior_pattern_lazy(uct_t *u, tree_node_t *node, board_t *b, enum stone color, int parity)
+{
+	floating_t probs[b->flen];
+	pattern_rate_moves_fast(&u->pc, b, color, probs, &u->ownermap, PATTERN_PRIOR_MIN_PROB, NULL);
+
+	floating_t prob[board_max_coords(b)];
+	foreach_point(b) {  prob[c] = 0;  } foreach_point_end;
+	for (int f = 0; f < b->flen; f++)
+		if (!isnan(probs[f]))  prob[b->f[f]] = probs[f];
+
+	foreach_child(node, ni) {
+		coord_t c = node_coord(ni);
+		if (is_pass(c) || prob[c] < PATTERN_PRIOR_MIN_PROB)
+			continue;
+		move_stats_t prior = node_prior(ni);
+		stats_add_result(&prior, (parity > 0 ? 1 : 0), sqrt(prob[c]) * u->prior->pattern_eqex);
+		node_set_prior(ni, prior);
+	}
+}
+
+static void
+uct_prior_plugins(uct_t *u, tree_node_t *node, prior_map_t *map)
+{
+#ifdef PACHI_PLUGINS
+	plugin_prior(u->plugins, node, map, u->prior->plugin_eqex);
+#endif
+}
+
+typedef void (*prior_provider_func_t)(uct_t *u, tree_node_t *node, prior_map_t *map);
+
+static struct {
+	const char *name;
+	prior_provider_func_t prior;
+} prior_providers[PRIOR_PROVIDERS] = {
+	[PRIOR_EVEN]        = { "even",        uct_prior_even },
+	[PRIOR_DCNN]        = { "dcnn",        uct_prior_dcnn },
+	[PRIOR_REMOTE_DCNN] = { "remote_dcnn", uct_prior_remote_dcnn },
+	[PRIOR_PATTERN]     = { "pattern",     uct_prior_pattern },
+	[PRIOR_EYE]         = { "eye",         uct_prior_eye },
+	[PRIOR_KO]          = { "ko",          uct_prior_ko },
+	[PRIOR_B19]         = { "b19",         uct_prior_b19 },
+	[PRIOR_PLAYOUT]     = { "policy",      uct_prior_playout },
+	[PRIOR_CFGD]        = { "cfgd",        uct_prior_cfgd },
+	[PRIOR_JOSEKI]      = { "joseki",      uct_prior_joseki },
+	[PRIOR_SEMEAI]      = { "semeai",      uct_prior_semeai },
+	[PRIOR_PLUGINS]     = { "plugins",     uct_prior_plugins },
+};
+
+/* Don't judge providers on less calls than that. */
+#define PRIOR_BUDGET_MIN_CALLS 100
+
+static uint64_t
+prior_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Run prior provider @id, with time accounting if enabled. */
+static void
+uct_prior_provider(uct_t *u, enum prior_provider id, tree_node_t *node, prior_map_t *map)
+{
+	uct_prior_t *p = u->prior;
+	prior_provider_stats_t *s = &p->stats[id];
+	if (!p->timing) {  prior_providers[id].prior(u, node, map);  return;  }
+	if (s->disabled)  return;
+
+	uint64_t start = prior_clock();
+	prior_providers[id].prior(u, node, map);
+	uint64_t nsecs = __sync_add_and_fetch(&s->nsecs, prior_clock() - start);
+	uint64_t calls = __sync_add_and_fetch(&s->calls, 1);
+
+	if (p->budget && calls >= PRIOR_BUDGET_MIN_CALLS &&
+	    nsecs / calls > (uint64_t)p->budget * 1000 && !s->disabled) {
+		s->disabled = true;
+		if (UDEBUGL(1))  fprintf(stderr, "prior: %s takes %.1fus per call (budget %ius), disabled\n",
+					 prior_providers[id].name, nsecs / calls / 1000.0, p->budget);
+	}
+}
+
+void
+uct_prior_print_stats(uct_prior_t *p)
+{
+	if (!p->timing)  return;
+	uint64_t total = 0;
+	for (int i = 0; i < PRIOR_PROVIDERS; i++)
+		total += p->stats[i].nsecs;
+
+	fprintf(stderr, "prior providers:\n");
+	for (int i = 0; i < PRIOR_PROVIDERS; i++) {
+		prior_provider_stats_t *s = &p->stats[i];
+		if (!s->calls)  continue;
+		fprintf(stderr, "  %-12s %9" PRIu64 " calls  %8.1fus/call  %7.2fs  %5.1f%%%s\n",
+			prior_providers[i].name, s->calls, s->nsecs / s->calls / 1000.0,
+			s->nsecs / 1e9, s->nsecs * 100.0 / total, (s->disabled ? "  (disabled)" : ""));
+	}
 }
 
 void
 uct_prior(uct_t *u, tree_node_t *node, prior_map_t *map)
 {
 	board_t *b = map->b;
+	bool memo = tactics_memo_start(b);	/* Ladders get read by several priors */
 	
 	if (u->prior->prune_ladders && !board_playing_ko_threat(b)) {
 		foreach_free_point(b) {
@@ -294,28 +538,36 @@ uct_prior(uct_t *u, tree_node_t *node, prior_map_t *map)
 	if (u->prior->boost_pass)  /* Endgame with japanese rules, pass can be hard to find. */
 		add_prior_value(map, pass, 1.0, u->prior->pattern_eqex * 3 / 4);
 
-	if (u->prior->even_eqex)			uct_prior_even(u, node, map);
+	if (u->prior->even_eqex)			uct_prior_provider(u, PRIOR_EVEN, node, map);
 	
 	/* Use dcnn for root priors */
-	if (u->prior->dcnn_eqex && !u->tree_ready)	uct_prior_dcnn(u, node, map);
+	if (u->prior->dcnn_eqex && !u->tree_ready)	uct_prior_provider(u, PRIOR_DCNN, node, map);
+	else if (u->prior->remote_dcnn_eqex && !u->tree_ready && u->slave)
+							uct_prior_provider(u, PRIOR_REMOTE_DCNN, node, map);
+
+	/* Lazy pattern priors: only cheap ones for now, patterns come later. */
+	bool lazy_patterns = (u->pattern_lazy && node_parent(node));
 
-	if (u->prior->pattern_eqex)			uct_prior_pattern(u, node, map);
+	if (u->prior->pattern_eqex && !lazy_patterns)	uct_prior_provider(u, PRIOR_PATTERN, node, map);
 	else {  /* Fallback to old prior features if patterns are off. */
-		if (u->prior->eye_eqex)			uct_prior_eye(u, node, map);
-		if (u->prior->ko_eqex)			uct_prior_ko(u, node, map);
-		if (u->prior->b19_eqex)			uct_prior_b19(u, node, map);		
-		if (u->prior->policy_eqex)		uct_prior_playout(u, node, map);
-		if (u->prior->cfgd_eqex)		uct_prior_cfgd(u, node, map);
+		if (u->prior->eye_eqex)			uct_prior_provider(u, PRIOR_EYE, node, map);
+		if (u->prior->ko_eqex)			uct_prior_provider(u, PRIOR_KO, node, map);
+		if (u->prior->b19_eqex)			uct_prior_provider(u, PRIOR_B19, node, map);
+		if (u->prior->policy_eqex)		uct_prior_provider(u, PRIOR_PLAYOUT, node, map);
+		if (u->prior->cfgd_eqex)		uct_prior_provider(u, PRIOR_CFGD, node, map);
 	}
 
-	if (u->prior->joseki_eqex)			uct_prior_joseki(u, node, map);
+	if (u->prior->joseki_eqex)			uct_prior_provider(u, PRIOR_JOSEKI, node, map);
+	if (u->prior->semeai_eqex)			uct_prior_provider(u, PRIOR_SEMEAI, node, map);
 
 #ifdef PACHI_PLUGINS
-	if (u->prior->plugin_eqex)			plugin_prior(u->plugins, node, map, u->prior->plugin_eqex);
+	if (u->prior->plugin_eqex)			uct_prior_provider(u, PRIOR_PLUGINS, node, map);
 #endif
 
+	tactics_memo_stop(memo);
+
 	/* Show final prior mix. */
-	if (DEBUGL(3) && !node->parent)                 print_prior_best_moves(map->b, map);
+	if (DEBUGL(3) && !node_parent(node))              print_prior_best_moves(map->b, map);
 }
 
 uct_prior_t *
@@ -336,8 +588,13 @@ uct_prior_init(char *arg, board_t *b, uct_t *u)
 	 * against regular pachi. Below 1200 is bad (50% winrate and worse), more
 	 * gives diminishing returns (1500 -> 78%, 2000 -> 70% ...) */
 	p->dcnn_eqex       = 1300;
+	p->remote_dcnn_eqex = 1300;
 	p->cfgdn = -1;
 
+	/* Capturing race reading is off by default, needs tuning. */
+	p->semeai_eqex     = 0;
+	p->semeai_budget   = 500;
+
 	/* Even number! */
 	p->eqex = board_large(b) ? 20 : 14;
 
@@ -398,8 +655,23 @@ uct_prior_init(char *arg, board_t *b, uct_t *u)
 			} else if (!strcasecmp(optname, "plugin") && optval) {
 				/* Unlike others, this is just a *recommendation*. */
 				p->plugin_eqex = atoi(optval);
+			} else if (!strcasecmp(optname, "semeai") && optval) {
+				p->semeai_eqex = atoi(optval);
+			} else if (!strcasecmp(optname, "semeai_budget") && optval) {
+				p->semeai_budget = atoi(optval);
 			} else if (!strcasecmp(optname, "prune_ladders")) {
 				p->prune_ladders = !optval || atoi(optval);
+			} else if (!strcasecmp(optname, "timing")) {
+				/* Account time spent in each prior provider,
+				 * shown after genmove. */
+				p->timing = !optval || atoi(optval);
+			} else if (!strcasecmp(optname, "budget") && optval) {
+				/* Disable providers taking more than that many
+				 * usecs per call on average. Implies timing. */
+				p->budget = atoi(optval);
+				p->timing = true;
+			} else if (!strcasecmp(optname, "remote_dcnn") && optval) {
+				p->remote_dcnn_eqex = atoi(optval);
 #ifdef DCNN
 			} else if (!strcasecmp(optname, "dcnn") && optval) {
 				p->dcnn_eqex = atoi(optval);
@@ -418,6 +690,8 @@ uct_prior_init(char *arg, board_t *b, uct_t *u)
 	if (p->pattern_eqex < 0) p->pattern_eqex = p->eqex * -p->pattern_eqex / 100;
 	if (p->plugin_eqex < 0) p->plugin_eqex = p->eqex * -p->plugin_eqex / 100;
 	if (p->dcnn_eqex < 0) p->dcnn_eqex = p->eqex * -p->dcnn_eqex / 100;
+	if (p->remote_dcnn_eqex < 0) p->remote_dcnn_eqex = p->eqex * -p->remote_dcnn_eqex / 100;
+	if (p->semeai_eqex < 0) p->semeai_eqex = p->eqex * -p->semeai_eqex / 100;
 
 	if (!using_joseki(b))   p->joseki_eqex = 0;
 	if (!using_dcnn(b))     p->dcnn_eqex = 0;
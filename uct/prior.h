@@ -1,6 +1,7 @@
 #ifndef PACHI_UCT_PRIOR_H
 #define PACHI_UCT_PRIOR_H
 
+#include "bitboard.h"
 #include "move.h"
 #include "uct/tree.h"
 
@@ -12,6 +13,19 @@ struct board;
 /* Applying heuristic values to the tree nodes, skewing the reading in
  * most interesting directions. */
 
+/* Prior providers, each one is accounted for separately. */
+enum prior_provider {
+	PRIOR_EVEN, PRIOR_DCNN, PRIOR_REMOTE_DCNN, PRIOR_PATTERN, PRIOR_EYE, PRIOR_KO,
+	PRIOR_B19, PRIOR_PLAYOUT, PRIOR_CFGD, PRIOR_JOSEKI, PRIOR_SEMEAI, PRIOR_PLUGINS,
+	PRIOR_PROVIDERS
+};
+
+typedef struct {
+	uint64_t calls;
+	uint64_t nsecs;
+	bool disabled;			/* Over budget */
+} prior_provider_stats_t;
+
 typedef struct {
 	/* Equivalent experience for prior knowledge. MoGo paper recommends
 	 * 50 playouts per source; in practice, esp. with RAVE, about 6
@@ -19,9 +33,18 @@ typedef struct {
 	int eqex;
 	int even_eqex, policy_eqex, b19_eqex, eye_eqex, ko_eqex, plugin_eqex;
 	int joseki_eqex, joseki_eqex_far, pattern_eqex, dcnn_eqex;
+	int remote_dcnn_eqex;			/* Distributed slaves without dcnn */
+	int semeai_eqex, semeai_budget;		/* Capturing races near last move */
 	int cfgdn; int *cfgd_eqex;
 	bool prune_ladders;
 	bool boost_pass;
+
+	/* Time accounting per provider (timing prior option). With budget
+	 * providers taking more than that many usecs per call on average
+	 * get disabled. */
+	bool timing;
+	int budget;
+	prior_provider_stats_t stats[PRIOR_PROVIDERS];
 } uct_prior_t;
 
 typedef struct prior_map {
@@ -30,13 +53,16 @@ typedef struct prior_map {
 	int parity;
 	/* [board_size2(b)] array, move_stats are the prior
 	 * values to be assigned to individual moves;
-	 * move_stats.value is not updated. */
+	 * move_stats.value is not updated.
+	 * Only free points and pass are valid. */
 	move_stats_t *prior;
 	/* [board_size2(b)] array, whether to compute
 	 * prior for the given value. */
 	bool *consider;
 	/* [board_size2(b)] array from cfg_distances() */
 	int *distances;
+	/* Legal moves, from board_legal_moves() */
+	bitboard_t *legal;
 } prior_map_t;
 
 /* @value is the value, @playouts is its weight. */
@@ -44,9 +70,21 @@ static void add_prior_value(prior_map_t *map, coord_t c, floating_t value, int p
 
 void uct_prior(struct uct *u, tree_node_t *node, prior_map_t *map);
 
+/* Asynchronous dcnn priors (dcnn_async uct option) */
+void uct_prior_dcnn_async_init(struct uct *u, board_t *b);
+void uct_prior_dcnn_async(struct uct *u, tree_node_t *node, board_t *b, enum stone color, int parity);
+/* Inner nodes dcnn priors (dcnn_visits uct option) */
+bool uct_prior_dcnn_visits(struct uct *u, tree_node_t *node, board_t *b, enum stone color, int parity);
+
+/* Lazy pattern priors (pattern_lazy uct option) */
+void uct_prior_pattern_lazy(struct uct *u, tree_node_t *node, board_t *b, enum stone color, int parity);
+
 uct_prior_t *uct_prior_init(char *arg, board_t *b, struct uct *u);
 void uct_prior_done(uct_prior_t *p);
 
+/* Show time spent in each prior provider so far (timing prior option). */
+void uct_prior_print_stats(uct_prior_t *p);
+
 
 static inline void
 add_prior_value(prior_map_t *map, coord_t c, floating_t value, int playouts)
@@ -12,8 +12,12 @@
 #define DEBUG
 
 #include "debug.h"
+#include "affinity.h"
+#include "fifo.h"
 #include "board.h"
 #include "joseki.h"
+#include "logring.h"
+#include "metrics.h"
 #include "random.h"
 #include "timeinfo.h"
 #include "tactics/1lib.h"
@@ -28,6 +32,10 @@
 #include "dcnn.h"
 #include "pachi.h"
 
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
 static int
 checked_pthread_join(pthread_t thread, void **retval)
 {
@@ -69,7 +77,7 @@ default_ti_init(void)
  *   |         starts and stops the search managed by thread_manager
  *   |
  * thread_manager
- *   |         spawns and collects worker threads
+ *   |         starts and collects worker threads (persistent, see pool_worker_thread())
  *   |
  * worker0
  * worker1
@@ -98,6 +106,34 @@ static pthread_cond_t finish_cond = PTHREAD_COND_INITIALIZER;
 static volatile int finish_thread;
 static pthread_mutex_t finish_serializer = PTHREAD_MUTEX_INITIALIZER;
 
+/* Worker coordination locks: native slim locks and condition variables on
+ * windows, winpthreads emulates pthreads ones on top of heavier primitives.
+ * They must be released by the thread that took them, so finish_mutex /
+ * finish_serializer (handed over between caller and thread manager) stay
+ * pthreads ones. */
+#ifdef _WIN32
+typedef SRWLOCK            worker_lock_t;
+typedef CONDITION_VARIABLE worker_cond_t;
+#define WORKER_LOCK_INITIALIZER       SRWLOCK_INIT
+#define WORKER_COND_INITIALIZER       CONDITION_VARIABLE_INIT
+#define worker_lock(l)                AcquireSRWLockExclusive(l)
+#define worker_unlock(l)              ReleaseSRWLockExclusive(l)
+#define worker_cond_wait(c, l)        SleepConditionVariableSRW((c), (l), INFINITE, 0)
+#define worker_cond_broadcast(c)      WakeAllConditionVariable(c)
+#else
+typedef pthread_mutex_t    worker_lock_t;
+typedef pthread_cond_t     worker_cond_t;
+#define WORKER_LOCK_INITIALIZER       PTHREAD_MUTEX_INITIALIZER
+#define WORKER_COND_INITIALIZER       PTHREAD_COND_INITIALIZER
+#define worker_lock(l)                pthread_mutex_lock(l)
+#define worker_unlock(l)              pthread_mutex_unlock(l)
+#define worker_cond_wait(c, l)        pthread_cond_wait((c), (l))
+#define worker_cond_broadcast(c)      pthread_cond_broadcast(c)
+#endif
+
+static worker_lock_t tree_ready_mutex = WORKER_LOCK_INITIALIZER;
+static worker_cond_t tree_ready_cond = WORKER_COND_INITIALIZER;
+
 static void  uct_expand_next_best_moves(uct_t *u, tree_t *t, board_t *b, enum stone color);
 static void *logger_thread(void *ctx_);
 
@@ -110,11 +146,11 @@ worker_thread(void *ctx_)
 	uct_t *u = ctx->u;
 	board_t *b = ctx->b;
 	enum stone color = ctx->color;
-	fast_srandom(ctx->seed);
+	fast_srandom_stream(ctx->seed, ctx->tid);
 	int restarted = search_restarted(u);
 
-	/* Fill ownermap for mcowner pattern feature. */
-	if (using_patterns()) {
+	/* Fill ownermap for mcowner pattern feature (and settled_prune). */
+	if (using_patterns() || u->settled_prune) {
 		double time_start = time_now();
 		uct_mcowner_playouts(u, b, color);
 		
@@ -126,6 +162,10 @@ worker_thread(void *ctx_)
 	}
 
 	/* Stuff that depends on ownermap. */
+	if (!ctx->tid && u->settled_prune) {
+		u->settled_points = ownermap_settled(b, &u->ownermap, u->settled_prune, &u->settled);
+		if (DEBUGL(2) && !restarted)  fprintf(stderr, "settled: %i points\n", u->settled_points);
+	}
 	if (!ctx->tid && using_patterns()) {
 		int dames = ownermap_dames(b, &u->ownermap);
 		float score = ownermap_score_est(b, &u->ownermap);
@@ -156,14 +196,20 @@ worker_thread(void *ctx_)
 			print_joseki_moves(joseki_dict, b, color);
 			print_node_prior_best_moves(b, n);
 		}
+		worker_lock(&tree_ready_mutex);
 		u->tree_ready = true;
+		worker_cond_broadcast(&tree_ready_cond);
+		worker_unlock(&tree_ready_mutex);
+	} else {
+		worker_lock(&tree_ready_mutex);
+		while (!u->tree_ready)
+			worker_cond_wait(&tree_ready_cond, &tree_ready_mutex);
+		worker_unlock(&tree_ready_mutex);
 	}
-	else while (!u->tree_ready)
-		     usleep(100 * 1000);
 
 	/* Run */
 	if (!ctx->tid)  s->mcts_time_start = s->last_print_time = time_now();
-	ctx->games = uct_playouts(ctx->u, ctx->b, ctx->color, ctx->t, ctx->ti);
+	ctx->games = uct_playouts(ctx->u, ctx->b, ctx->color, ctx->t, ctx->ti, ctx->tid);
 	
 	/* Finish */
 	pthread_mutex_lock(&finish_serializer);
@@ -174,6 +220,167 @@ worker_thread(void *ctx_)
 	return ctx;
 }
 
+/* Worker threads pool:
+ * Worker threads are persistent, they sleep between searches waiting for the
+ * thread manager to hand them some work. Saves thread creation / teardown
+ * every time search starts (pondering restarts, tree reallocs...) */
+typedef struct {
+	pthread_t id;
+	uct_thread_ctx_t *ctx;	/* Work to do, NULL if idle. */
+	int cpu;		/* Cpu we're pinned to, -1 if none. */
+} pool_worker_t;
+
+static worker_lock_t pool_mutex = WORKER_LOCK_INITIALIZER;
+static worker_cond_t pool_cond = WORKER_COND_INITIALIZER;
+static pool_worker_t **pool = NULL;
+static int pool_size = 0;
+
+static void *
+pool_worker_thread(void *arg)
+{
+	pool_worker_t *w = (pool_worker_t*)arg;
+
+	worker_lock(&pool_mutex);
+	while (1) {
+		while (!w->ctx)
+			worker_cond_wait(&pool_cond, &pool_mutex);
+		uct_thread_ctx_t *ctx = w->ctx;
+		w->ctx = NULL;
+		worker_unlock(&pool_mutex);
+
+		/* Manager owns ctx again once we signal finish. */
+		worker_thread(ctx);
+
+		worker_lock(&pool_mutex);
+	}
+	return NULL;
+}
+
+/* Hand search context to worker @tid, spawning it if needed. */
+static void
+pool_start_worker(int tid, uct_thread_ctx_t *ctx)
+{
+	worker_lock(&pool_mutex);
+	if (tid >= pool_size) {
+		pool = crealloc(pool, (tid + 1) * sizeof(*pool));
+		for (; pool_size <= tid; pool_size++) {
+			pool_worker_t *w = pool[pool_size] = calloc2(1, pool_worker_t);
+			w->cpu = -1;
+			pthread_attr_t a;
+			pthread_attr_init(&a);
+			pthread_attr_setstacksize(&a, 1048576);
+			pthread_create(&w->id, &a, pool_worker_thread, w);
+			pthread_attr_destroy(&a);
+			thread_spread(w->id, pool_size);
+		}
+	}
+	assert(!pool[tid]->ctx);
+	uct_t *u = ctx->u;
+	int cpu = (u->pin_ncpus ? u->pin_cpus[tid % u->pin_ncpus] : -1);
+	if (cpu != pool[tid]->cpu) {
+		if (cpu == -1 ? thread_unpin(pool[tid]->id) : thread_pin(pool[tid]->id, cpu))
+			pool[tid]->cpu = cpu;
+	}
+	pool[tid]->ctx = ctx;
+	worker_cond_broadcast(&pool_cond);
+	worker_unlock(&pool_mutex);
+}
+
+/* Pinning is off or cpus were given back: let workers run anywhere. */
+void
+uct_search_unpin_workers(void)
+{
+	worker_lock(&pool_mutex);
+	for (int i = 0; i < pool_size; i++)
+		if (pool[i]->cpu != -1 && thread_unpin(pool[i]->id))
+			pool[i]->cpu = -1;
+	worker_unlock(&pool_mutex);
+}
+
+/* Dynamic thread count:
+ * Search always starts u->threads workers, those with tid >= u->active_threads
+ * wait (see uct_playouts()), so a running search can be scaled down and up
+ * again without restarting it. Thinking uses all threads, pondering at most
+ * u->ponder_threads, fewer with ponder_load if other processes need the cpus.
+ * Core broker grants (fifo) still apply on top of this. */
+
+#define PONDER_LOAD_INTERVAL 1.0
+
+static double load_time, load_busy, load_self;	/* Last ponder_load sample */
+static int    load_free = INT_MAX;		/* Cpus left to us then */
+
+static int
+uct_search_threads_wanted(uct_t *u)
+{
+	if (!pondering(u))  return u->threads;
+	int n = (u->ponder_threads ? u->ponder_threads : u->threads);
+	if (u->ponder_load && load_free < n)  n = load_free;
+	return n;
+}
+
+void
+uct_search_set_threads(uct_t *u, int n)
+{
+	if (n > u->threads)  n = u->threads;
+	if (n < 1)           n = 1;
+	if (n == u->active_threads)  return;
+	if (UDEBUGL(3) && u->active_threads)
+		fprintf(stderr, "search threads: %i -> %i\n", u->active_threads, n);
+	u->active_threads = n;
+	/* Let the broker give the rest to other instances. */
+	fifo_cores_request((pondering(u) ? FIFO_PONDER : FIFO_THINK), n);
+}
+
+void
+uct_search_update_threads(uct_t *u)
+{
+	if (thread_manager_running)
+		uct_search_set_threads(u, uct_search_threads_wanted(u));
+}
+
+/* ponder_load: see how many cpus other processes used since last sample
+ * (everyone's cpu time minus ours) and leave them these. */
+static void
+uct_search_check_load(uct_t *u)
+{
+	double now = time_now(), busy, self;
+	if (now - load_time < PONDER_LOAD_INTERVAL)  return;
+	if (!get_cpu_times(&busy, &self))  return;
+	if (load_time) {
+		double others = (busy - load_busy - (self - load_self)) / (now - load_time);
+		int free = get_nprocessors() - (int)(others + 0.5);
+		load_free = (free > 1 ? free : 1);
+	}
+	load_time = now;  load_busy = busy;  load_self = self;
+	uct_search_update_threads(u);
+}
+
+/* Number of thread groups (trees) for root parallelization, 1 otherwise. */
+int
+uct_search_root_groups(uct_t *u)
+{
+	if (u->thread_model != TM_ROOT)  return 1;
+	int groups = (u->root_groups ? u->root_groups : u->threads / 8);
+	if (groups < 2)		  groups = 2;
+	if (groups > u->threads)  groups = u->threads;
+	return groups;
+}
+
+/* Create private tree for a root parallelization thread group.
+ * Main tree size is limited so that group trees fit in memory limits,
+ * see uct_tree_limits(). Falls back to main tree if out of memory. */
+static tree_t *
+uct_search_group_tree(uct_t *u, tree_t *t, int groups)
+{
+	tree_t *gt = tree_init(stone_other(t->root_color), t->max_tree_size / groups, 0);
+	if (!gt)  return t;
+	gt->root->coord = t->root->coord;
+	gt->use_extra_komi = t->use_extra_komi;
+	gt->extra_komi = t->extra_komi;
+	gt->merge_into = t;
+	return gt;
+}
+
 /* Thread manager, controlling worker threads. It must be called with
  * finish_mutex lock held, but it will unlock it itself before exiting;
  * this is necessary to be completely deadlock-free. */
@@ -190,37 +397,45 @@ thread_manager(void *ctx_)
 	uct_t *u = mctx->u;
 	tree_t *t = mctx->t;
 	fast_srandom(mctx->seed);
+	unsigned long seed = fast_random64();
 
 	int played_games = 0;
-	pthread_t threads[u->threads + 1];
+	uct_thread_ctx_t *ctxs[u->threads];
+	pthread_t logger;
 	int joined = 0;
 
 	uct_halt = 0;
 	u->tree_ready = false;
 
-	/* Garbage collect the tree by preference when pondering. */
-	if (pondering(u) && search_want_gc(u) && t->nodes && tree_gc_needed(u->t))
+	/* Garbage collect the tree by preference when pondering.
+	 * This runs in the background, genmove has already replied. */
+	if (pondering(u) && search_want_gc(u) && t->nodes && tree_gc_wanted(u->t))
 		tree_garbage_collect(t);
 	clear_search_want_gc(u);
 
 	/* Logging thread for pondering */
 	if (pondering(u))
-		pthread_create(&threads[u->threads], NULL, logger_thread, mctx);
+		pthread_create(&logger, NULL, logger_thread, mctx);
 	
-	/* Spawn threads... */
+	/* Root parallelization: group trees, group 0 uses main tree. */
+	int groups = uct_search_root_groups(u);
+	tree_t *group_trees[groups];
+	group_trees[0] = t;
+	for (int g = 1; g < groups; g++)
+		group_trees[g] = uct_search_group_tree(u, t, groups);
+
+	/* Start workers... */
 	for (int ti = 0; ti < u->threads; ti++) {
-		uct_thread_ctx_t *ctx = calloc2(1, uct_thread_ctx_t);
+		uct_thread_ctx_t *ctx = ctxs[ti] = calloc2(1, uct_thread_ctx_t);
 		ctx->u = u; ctx->b = mctx->b; ctx->color = mctx->color;
-		mctx->t = ctx->t = t;
-		ctx->tid = ti; ctx->seed = fast_random(65536) + ti;
+		mctx->t = t;
+		ctx->t = group_trees[ti * groups / u->threads];
+		ctx->tid = ti; ctx->seed = seed;
 		ctx->ti = mctx->ti;
 		ctx->s = mctx->s;
-		pthread_attr_t a;
-		pthread_attr_init(&a);
-		pthread_attr_setstacksize(&a, 1048576);
-		pthread_create(&threads[ti], &a, worker_thread, ctx);
+		pool_start_worker(ti, ctx);
 		if (UDEBUGL(4))
-			fprintf(stderr, "Spawned worker %d\n", ti);
+			fprintf(stderr, "Started worker %d\n", ti);
 	}
 
 	/* ...and collect them back: */
@@ -239,18 +454,27 @@ thread_manager(void *ctx_)
 			continue;
 		}
 		/* ...and gather its remnants. */
-		uct_thread_ctx_t *ctx;
-		pthread_join(threads[finish_thread], (void **) &ctx);
+		uct_thread_ctx_t *ctx = ctxs[finish_thread];
 		played_games += ctx->games;
 		joined++;
 		free(ctx);
 		if (UDEBUGL(4))
-			fprintf(stderr, "Joined worker %d\n", finish_thread);
+			fprintf(stderr, "Collected worker %d\n", finish_thread);
 		pthread_mutex_unlock(&finish_serializer);
 	}
 
 	if (pondering(u))
-		pthread_join(threads[u->threads], NULL);
+		pthread_join(logger, NULL);
+
+	/* Pending dcnn evaluations reference tree nodes. */
+	if (u->dcnn_async || u->dcnn_visits)
+		dcnn_queue_drain();
+
+	for (int g = 1; g < groups; g++) {
+		if (group_trees[g] == t)  continue;
+		tree_merge(t, group_trees[g], ROOT_MERGE_DEPTH);
+		tree_done(group_trees[g]);
+	}
 	
 	pthread_mutex_unlock(&finish_mutex);
 
@@ -259,7 +483,7 @@ thread_manager(void *ctx_)
 }
 
 /* Detached thread to deal with memory full while pondering:
- * Stop search or realloc tree if u->auto_alloc. */
+ * Stop search, realloc tree or recycle nodes (see uct_search_fullmem()). */
 static void *
 pondering_fullmem_handler(void *ctx_)
 {
@@ -275,7 +499,7 @@ pondering_fullmem_handler(void *ctx_)
 
 	if (!thread_manager_running)  return NULL;
 
-	if (!u->auto_alloc || !uct_search_realloc_tree(u, b, color, ti, s))
+	if (!uct_search_fullmem(u, b, color, ti, s))
 	    uct_pondering_stop(u);
 	
 	return NULL;
@@ -303,6 +527,8 @@ logger_thread(void *ctx_)
 		int i = uct_search_games(s);
 		/* Print notifications etc. */
 		uct_search_progress(u, b, color, t, ti, s, i);
+		if (u->ponder_load)
+			uct_search_check_load(u);
 		
 		if (s->fullmem) {
 			/* Stop search / Realloc tree.
@@ -401,6 +627,13 @@ uct_search_start(uct_t *u, board_t *b, enum stone color,
 	/* Set up search state. */
 	s->base_playouts = s->last_dynkomi = s->last_print_playouts = t->root->u.playouts;
 	s->fullmem = false;
+	if (!search_restarted(u)) {
+		s->best_coord = pass;
+		s->best_changes = s->sample_played = s->sample_gap = 0;
+		s->best_change_time = s->sample_time = s->pps = s->gap_rate = 0;
+		tree_shape_reset(t);
+	}
+	tree_topk_rebuild(t);	/* Root or nodes may have moved */
 
 	/* If restarted timers are already setup, reuse stop condition in s */
 	if (ti && !search_restarted(u)) {
@@ -411,12 +644,17 @@ uct_search_start(uct_t *u, board_t *b, enum stone color,
 		time_stop_conditions(ti, b, u->fuseki_end, u->yose_start, u->max_maintime_ratio, &s->stop);
 	}
 
+	/* Threads beyond what we want to use (pondering) or beyond our
+	 * share of cores (multiple instances) wait.  */
+	u->active_threads = 0;
+	uct_search_set_threads(u, uct_search_threads_wanted(u));
+
 	/* Fire up the tree search thread manager, which will in turn
 	 * spawn the searching threads. */
 	assert(u->threads > 0);
 	assert(!thread_manager_running);
 	static uct_thread_ctx_t mctx;
-	mctx = (uct_thread_ctx_t) { 0, u, b, color, t, fast_random(65536), 0, ti, s };
+	mctx = (uct_thread_ctx_t) { 0, u, b, color, t, fast_random64(), 0, ti, s };
 	s->ctx = &mctx;
 	pthread_mutex_lock(&finish_serializer);
 	pthread_mutex_lock(&finish_mutex);
@@ -444,7 +682,9 @@ uct_search_stop(void)
 	uct_t *u = pctx->u;
 	uct_search_state_t *s = pctx->s;
 	u->mcts_time += time_now() - s->mcts_time_start;
+	log_flush();  /* Before anyone prints search results */
 	u->search_flags = 0;  /* Reset search flags */
+	fifo_cores_request(FIFO_IDLE, 0);
 	
 	return pctx;
 }
@@ -455,14 +695,38 @@ fullmem_warning(uct_t *u, char *msg)
 	if (UDEBUGL(2))  fprintf(stderr, "%s", msg);
 }
 
-/* Stop search, realloc tree and resume search */
+/* Grow tree in place if we reserved memory for it.
+ * No copy, search keeps running. */
+static int
+uct_search_grow_tree(uct_t *u, uct_search_state_t *s)
+{
+	size_t old_size = u->tree_size;
+	size_t new_size = old_size * 2;
+	if (new_size > u->t->reserved_size)  new_size = u->t->reserved_size;
+
+	/* Don't bother growing for a few % */
+	if (new_size < old_size + old_size / 10)  return 0;
+	if (!tree_grow(u->t, new_size))  return 0;
+	metric_add(METRIC_TREE_REALLOCS, 1);
+
+	if (UDEBUGL(2)) fprintf(stderr, "Tree memory full, growing in place (%i -> %i Mb)\n",
+				(int)(old_size / (1024*1024)), (int)(new_size / (1024*1024)));
+	uct_tree_size_init(u, new_size);
+	s->fullmem = false;
+	return 1;
+}
+
+/* Grow tree memory if possible, otherwise stop search,
+ * realloc tree and resume search */
 int
 uct_search_realloc_tree(uct_t *u, board_t *b, enum stone color, time_info_t *ti, uct_search_state_t *s)
 {
+	if (uct_search_grow_tree(u, s))  return 1;
+
 	size_t old_size = u->tree_size;
 	size_t new_size = old_size * 2;
-	size_t max_tree_size = (u->max_tree_size_opt ? u->max_tree_size_opt : (size_t)-1);
-	size_t max_mem = (u->max_mem ? u->max_mem : (size_t)-1);
+	size_t max_tree_size, max_mem;
+	uct_tree_limits(u, &max_tree_size, &max_mem);
 
 	/* Use all available memory if needed but don't bother reallocating for a few % */
 	size_t minimum_new_size = old_size + old_size / 10;
@@ -474,7 +738,8 @@ uct_search_realloc_tree(uct_t *u, board_t *b, enum stone color, time_info_t *ti,
 	
 	/* Don't go over memory limits */
 	if (new_size > max_tree_size || (old_size + new_size) > max_mem) {
-		fullmem_warning(u, "WARNING: Max memory limit reached, stopping search.\n");
+		if (!u->tree_recycle)
+			fullmem_warning(u, "WARNING: Max memory limit reached, stopping search.\n");
 		return 0;
 	}
 	
@@ -495,6 +760,7 @@ uct_search_realloc_tree(uct_t *u, board_t *b, enum stone color, time_info_t *ti,
 	double time_start = time_now();
 	tree_copy(t2, t);	assert(t2->root_color == t->root_color);
 	tree_replace(t, t2);
+	metric_add(METRIC_TREE_REALLOCS, 1);
 	if (UDEBUGL(2)) fprintf(stderr, "tree realloc in %.1fs\n", time_now() - time_start);
 
 	/* Restart search (preserve timers...) */
@@ -503,6 +769,40 @@ uct_search_realloc_tree(uct_t *u, board_t *b, enum stone color, time_info_t *ti,
 	return 1;
 }
 
+/* Tree can't grow: stop search, drop least visited subtrees
+ * and resume search (tree_recycle option). */
+static int
+uct_search_recycle_tree(uct_t *u, board_t *b, enum stone color, time_info_t *ti, uct_search_state_t *s)
+{
+	if (!u->tree_recycle)  return 0;
+
+	/* Temp tree first, can't recover if it fails once search is stopped. */
+	tree_t *t  = u->t;
+	tree_t *t2 = tree_init(t->root_color, t->max_tree_size / 100 * u->tree_recycle, 0);
+	if (!t2)  return 0;		/* Not enough memory */
+
+	int flags = u->search_flags;	/* Save flags ! */
+	uct_search_stop();
+
+	if (UDEBUGL(2))  fprintf(stderr, "Tree memory full, recycling nodes\n");
+	tree_recycle(t, t2);
+	tree_done(t2);
+
+	s->fullmem = false;
+	uct_search_start(u, b, color, u->t, ti, s, flags | UCT_SEARCH_RESTARTED);
+	return 1;
+}
+
+/* Tree memory full: grow / realloc tree if u->auto_alloc,
+ * recycle nodes if u->tree_recycle. Returns 0 if search must stop. */
+int
+uct_search_fullmem(uct_t *u, board_t *b, enum stone color, time_info_t *ti, uct_search_state_t *s)
+{
+	if (u->auto_alloc && uct_search_realloc_tree(u, b, color, ti, s))
+		return 1;
+	return uct_search_recycle_tree(u, b, color, ti, s);
+}
+
 void
 uct_search_progress(uct_t *u, board_t *b, enum stone color,
 		    tree_t *t, time_info_t *ti,
@@ -519,7 +819,7 @@ uct_search_progress(uct_t *u, board_t *b, enum stone color,
 		floating_t old_dynkomi = ctx->t->extra_komi;
 		ctx->t->extra_komi = u->dynkomi->permove(u->dynkomi, b, ctx->t);
 		if (UDEBUGL(3) && old_dynkomi != ctx->t->extra_komi)
-			fprintf(stderr, "dynkomi adjusted (%f -> %f)\n", old_dynkomi, ctx->t->extra_komi);
+			log_printf("dynkomi adjusted (%f -> %f)\n", old_dynkomi, ctx->t->extra_komi);
 	}
 
 	/* Print progress ? */
@@ -537,26 +837,95 @@ uct_search_progress(uct_t *u, board_t *b, enum stone color,
 
         if (!s->fullmem && ctx->t->nodes_size > ctx->t->max_tree_size) {
 		s->fullmem = true;
-		if (!u->auto_alloc)
+		if (!u->auto_alloc && !u->tree_recycle)
 			fullmem_warning(u, "WARNING: Tree memory limit reached, stopping search.\n");
 	}
 }
 
 
+/* Walltime: keep track of how stable the search is. Best move changes,
+ * measured playouts/s for this machine and position, and how fast the
+ * gap between best and second best moves changes. */
+#define STABILITY_SAMPLE_INTERVAL 0.5
+#define STABILITY_SMOOTHING 0.3
+
+static void
+uct_search_sample(uct_search_state_t *s, tree_node_t *best, tree_node_t *best2,
+		  int played, double elapsed)
+{
+	if (best && node_coord(best) != s->best_coord) {
+		s->best_coord = node_coord(best);
+		s->best_changes++;
+		s->best_change_time = elapsed;
+	}
+
+	double dt = elapsed - s->sample_time;
+	if (dt < STABILITY_SAMPLE_INTERVAL)  return;
+
+	int gap = (best && best2 ? best->u.playouts - best2->u.playouts : 0);
+	double pps = (played - s->sample_played) / dt;
+	double gap_rate = (gap - s->sample_gap) / dt;
+	bool first = (s->sample_time == 0);
+	s->pps      = (first ? pps      : s->pps      + STABILITY_SMOOTHING * (pps - s->pps));
+	s->gap_rate = (first ? gap_rate : s->gap_rate + STABILITY_SMOOTHING * (gap_rate - s->gap_rate));
+	s->sample_time = elapsed;
+	s->sample_played = played;
+	s->sample_gap = gap;
+}
+
+/* Walltime: time second best move needs to catch up at current rate,
+ * +inf if gap isn't shrinking. */
+static double
+uct_search_overtake_time(uct_search_state_t *s, tree_node_t *best, tree_node_t *best2)
+{
+	if (!best2 || s->gap_rate >= 0)  return INFINITY;
+	return (best->u.playouts - best2->u.playouts) / -s->gap_rate;
+}
+
+/* Walltime: best move hasn't changed for a while and second best isn't
+ * going to catch up before desired time, no need to wait until then. */
+static bool
+uct_search_stable(uct_t *u, uct_search_state_t *s, time_info_t *ti, time_stop_t *stop,
+		  tree_node_t *best, tree_node_t *best2, double elapsed)
+{
+	if (!u->stable_stop || ti->dim != TD_WALLTIME || !ti->can_stop_early ||
+	    !best2 || !best2->u.playouts || !s->sample_time)
+		return false;
+	if (elapsed < stop->desired.time * u->stable_stop ||
+	    elapsed >= stop->desired.time)  return false;	/* Past desired time uct_search_keep_looking() decides */
+	if (elapsed - s->best_change_time < elapsed / 2)    return false;   /* Stable for last half of search */
+	if ((double)best->u.playouts / best2->u.playouts < u->best2_ratio)  return false;
+	return (uct_search_overtake_time(s, best, best2) > 2 * (stop->desired.time - elapsed));
+}
+
+/* Walltime: best move changed recently or second best is catching up
+ * before worst time. */
+static bool
+uct_search_unstable(uct_t *u, uct_search_state_t *s, time_info_t *ti, time_stop_t *stop,
+		    tree_node_t *best, tree_node_t *best2, double elapsed)
+{
+	if (!u->unstable_window || ti->dim != TD_WALLTIME || !s->sample_time)
+		return false;
+	if (s->best_changes > 1 && elapsed - s->best_change_time < elapsed * u->unstable_window)
+		return true;
+	return (uct_search_overtake_time(s, best, best2) < stop->worst.time - elapsed);
+}
+
 /* Determine whether we should terminate the search early. */
 static bool
 uct_search_stop_early(uct_t *u, tree_t *t, board_t *b,
-		time_info_t *ti, time_stop_t *stop,
+		time_info_t *ti, uct_search_state_t *s,
 		tree_node_t *best, tree_node_t *best2,
 		int played, bool fullmem)
 {
+	time_stop_t *stop = &s->stop;
+
 	/* If the memory is full, stop immediately. Since the tree
 	 * cannot grow anymore, some non-well-expanded nodes will
 	 * quickly take over with extremely high ratio since the
 	 * counters are not properly simulated (just as if we use
 	 * non-UCT MonteCarlo). */
-	/* (XXX: A proper solution would be to prune the tree
-	 * on the spot.) */
+	/* (tree_recycle option prunes the tree on the spot instead.) */
 	if (fullmem)
 		return true;
 
@@ -589,16 +958,23 @@ uct_search_stop_early(uct_t *u, tree_t *t, board_t *b,
 	    !keep_looking &&
 	    played >= PLAYOUT_EARLY_BREAK_MIN && best2) {
 		double remaining = stop->worst.time - elapsed;
-		double pps = ((double)played) / elapsed;
+		double pps = (s->pps ? s->pps : ((double)played) / elapsed);
 		double estplayouts = remaining * pps + PLAYOUT_DELTA_SAFEMARGIN;
 		if (best->u.playouts > best2->u.playouts + estplayouts) {
 			if (UDEBUGL(2))  fprintf(stderr, "Early stop, result cannot change\n");
-			if (UDEBUGL(3))  fprintf(stderr, "best %d, best2 %d, estimated %i sims to go (%d/%.1f=%i pps)\n",
-						 best->u.playouts, best2->u.playouts, (int)estplayouts, played, elapsed, (int)pps);
+			if (UDEBUGL(3))  fprintf(stderr, "best %d, best2 %d, estimated %i sims to go (%i pps)\n",
+						 best->u.playouts, best2->u.playouts, (int)estplayouts, (int)pps);
 			return true;
 		}
 	}
 
+	/* Walltime: Stop early if best move is stable. */
+	if (!keep_looking && uct_search_stable(u, s, ti, stop, best, best2, elapsed)) {
+		if (UDEBUGL(2))  fprintf(stderr, "Early stop, best move stable for %.1fs (%d changes)\n",
+					 elapsed - s->best_change_time, s->best_changes);
+		return true;
+	}
+
 	/* Early break in won situation. */
 	if (best->u.playouts >= PLAYOUT_EARLY_BREAK_MIN
 	    && (ti->dim != TD_WALLTIME || elapsed > TIME_EARLY_BREAK_MIN)
@@ -612,10 +988,12 @@ uct_search_stop_early(uct_t *u, tree_t *t, board_t *b,
 /* Determine whether we should terminate the search later than expected. */
 static bool
 uct_search_keep_looking(uct_t *u, tree_t *t, board_t *b,
-		time_info_t *ti, time_stop_t *stop,
+		time_info_t *ti, uct_search_state_t *s,
 		tree_node_t *best, tree_node_t *best2,
 		tree_node_t *bestr, tree_node_t *winner, int i)
 {
+	time_stop_t *stop = &s->stop;
+
 	if (!best) {
 		if (UDEBUGL(2))
 			fprintf(stderr, "Did not find best move, still trying...\n");
@@ -659,6 +1037,15 @@ uct_search_keep_looking(uct_t *u, tree_t *t, board_t *b,
 		}
 	}
 
+	/* Keep simulating if best move keeps changing or
+	 * second best is catching up. */
+	if (uct_search_unstable(u, s, ti, stop, best, best2, time_now() - ti->timer_start)) {
+		if (UDEBUGL(3))
+			fprintf(stderr, "Unstable search, best changed %.1fs ago (%d changes), gap %+.0f/s\n",
+				time_now() - ti->timer_start - s->best_change_time, s->best_changes, s->gap_rate);
+		return true;
+	}
+
 	if (winner && winner != best) {
 		/* Keep simulating if best explored
 		 * does not have also highest value. */
@@ -701,7 +1088,9 @@ uct_search_check_stop(uct_t *u, board_t *b, enum stone color,
 
 	/* Possibly stop search early if it's no use to try on. */
 	int played = played_all(u) + i - s->base_playouts;
-	if (best && uct_search_stop_early(u, ctx->t, b, ti, &s->stop, best, best2, played, s->fullmem))
+	if (ti->dim == TD_WALLTIME)
+		uct_search_sample(s, best, best2, played, time_now() - ti->timer_start);
+	if (best && uct_search_stop_early(u, ctx->t, b, ti, s, best, best2, played, s->fullmem))
 		return true;
 
 	/* Check against time settings. */
@@ -726,7 +1115,7 @@ uct_search_check_stop(uct_t *u, board_t *b, enum stone color,
 		}
 		if (best)
 			bestr = u->policy->choose(u->policy, best, b, stone_other(color), resign);
-		if (!uct_search_keep_looking(u, ctx->t, b, ti, &s->stop, best, best2, bestr, winner, i))
+		if (!uct_search_keep_looking(u, ctx->t, b, ti, s, best, best2, bestr, winner, i))
 			return true;
 	}
 
@@ -69,6 +69,16 @@ typedef struct uct_search_state {
 	double last_print_time;   /* Last progress print (time) */
 	bool fullmem;		  /* Printed notification about full memory? */
 
+	/* Walltime search stability, see uct_search_sample() */
+	coord_t best_coord;	  /* Best move at last check */
+	int    best_changes;	  /* Times best move changed */
+	double best_change_time;  /* Elapsed time at last best move change */
+	double sample_time;	  /* Last sample (elapsed time) */
+	int    sample_played;	  /* Playouts at last sample */
+	int    sample_gap;	  /* best - best2 playouts at last sample */
+	double pps;		  /* Measured playouts/s (smoothed) */
+	double gap_rate;	  /* best - best2 playouts gap change /s (smoothed) */
+
 	time_stop_t stop;
 	uct_thread_ctx_t *ctx;
 } uct_search_state_t;
@@ -78,8 +88,16 @@ int uct_search_games(uct_search_state_t *s);
 
 void uct_search_start(uct_t *u, board_t *b, enum stone color, tree_t *t, time_info_t *ti, uct_search_state_t *s, int flags);
 uct_thread_ctx_t *uct_search_stop(void);
+int uct_search_root_groups(uct_t *u);
+/* Let worker threads run on any cpu again (pinning off / cpus released). */
+void uct_search_unpin_workers(void);
+/* Resize running search: only @n threads keep searching (1..u->threads). */
+void uct_search_set_threads(uct_t *u, int n);
+/* Options changed: rescale running search to what they ask for. */
+void uct_search_update_threads(uct_t *u);
 
 int uct_search_realloc_tree(uct_t *u, board_t *b, enum stone color, time_info_t *ti, uct_search_state_t *s);
+int uct_search_fullmem(uct_t *u, board_t *b, enum stone color, time_info_t *ti, uct_search_state_t *s);
 
 void uct_search_progress(uct_t *u, board_t *b, enum stone color, tree_t *t, time_info_t *ti, uct_search_state_t *s, int playouts);
 
@@ -4,8 +4,8 @@
  * master. When receiving stats the hash table gives a pointer to the
  * tree node to update. When sending stats we remember in the tree
  * what was previously sent so that only the incremental part has to
- * be sent.  The incremental part is smaller and can be compressed.
- * The compression is not yet done in this version. */
+ * be sent.  The incremental part is smaller and gets compressed
+ * (see distributed/encode.h). */
 
 /* Similarly the master only sends stats increments.
  * They include only contributions from other slaves. */
@@ -23,7 +23,11 @@
  * and distributed.c for the port arguments) :
  *  slave                   required to indicate slave mode
  *  max_nodes=MAX_NODES     default 80K
- *  stats_hbits=STATS_HBITS default 24. 2^stats_bits = hash table size
+ *  stats_hbits=STATS_HBITS default 18. 2^stats_bits = initial hash table size
+ *  shared_pv_levels=N      default 4. Along the principal variation, share
+ *                          nodes down to level N even if below shared_levels
+ *  prior=remote_dcnn=N     eqex for root dcnn priors sent by the master (see
+ *                          dcnn_priors option in distributed.c), default 1300
  */
 
 #include <assert.h>
@@ -37,6 +41,7 @@
 
 #include "debug.h"
 #include "board.h"
+#include "distributed/encode.h"
 #include "fbook.h"
 #include "gtp.h"
 #include "move.h"
@@ -60,10 +65,35 @@ typedef struct tree_hash {
 	tree_node_t *node;
 } tree_hash_t;
 
-tree_hash_t *
-uct_htable_alloc(int hbits)
+void
+uct_htable_alloc(tree_t *t, int hbits)
+{
+	t->hbits = hbits;
+	t->htable = calloc2(1 << hbits, tree_hash_t);
+	hash_gen_init(&t->hgen, hbits);
+}
+
+/* Double the hash table size, keeping entries in use. */
+static void
+uct_htable_grow(tree_t *t)
 {
-	return calloc2(1 << hbits, tree_hash_t);
+	int old_bits = t->hbits;
+	tree_hash_t *old = t->htable;
+	hash_gen_t old_gen = t->hgen;
+
+	uct_htable_alloc(t, old_bits + 1);
+	for (int i = 0; i < (1 << old_bits); i++) {
+		if (!hash_live(&old_gen, i) || !old[i].coord_path) continue;
+		int hash;
+		bool found;
+		find_hash(hash, t->htable, t->hbits, old[i].coord_path, found, h_counts, &t->hgen);
+		assert(!found);
+		t->htable[hash] = old[i];
+		hash_gen_insert(&t->hgen, hash);
+	}
+	free(old);
+	free(old_gen.gen);
+	if (DEBUGL(3))  fprintf(stderr, "tree hash table grown to %d bits, %d used\n", t->hbits, t->hgen.used);
 }
 
 /* Clear the hash table. Used only when running as slave for the distributed engine. */
@@ -71,7 +101,7 @@ void uct_htable_reset(tree_t *t)
 {
 	if (!t->htable) return;
 	double start = time_now();
-	memset(t->htable, 0, (1 << t->hbits) * sizeof(t->htable[0]));
+	hash_gen_clear(&t->hgen, t->hbits);
 	if (DEBUGL(3))
 		fprintf(stderr, "tree occupied %ld %.1f%% inserts %ld collisions %ld/%ld %.1f%% clear %.3fms\n"
 			"parent_not_found %.1f%% parent_leaf %.1f%% node_not_found %.1f%%\n",
@@ -85,70 +115,97 @@ void uct_htable_reset(tree_t *t)
 	if (DEBUG_MODE) h_counts.occupied = 0;
 }
 
+/* Find @parent's child with coord @c, looking at children from @from on
+ * (NULL: first child). Return the child, or NULL if it cannot be found.
+ * The tree is modified in background while this function is running. */
+static tree_node_t *
+tree_find_child(tree_node_t *parent, tree_node_t *from, coord_t c)
+{
+	tree_node_t *node = (from ? from : node_children(parent));
+	tree_node_t *end = (node ? node_children(parent) + parent->nchildren : NULL);
+	while (node < end && node_coord(node) != c) node++;
+	if (DEBUG_MODE) parent_leaf += !parent->is_expanded;
+	return (node < end ? node : NULL);
+}
+
 /* Find a node given its coord path from root. Insert it in the
  * hash table if it is not already there.
  * Return the tree node, or NULL if the node cannot be found.
- * The tree is modified in background while this function is running.
- * prev is only used to optimize the tree search, given that calls to
- * tree_find_node are made with sorted coordinates (increasing levels
- * and increasing coord within a level). */
+ * Only used for nodes whose parent is not part of the stats being
+ * received, resolve_stats_nodes() takes care of the rest. The hash table
+ * keeps these across receive_stats() calls for the current move. */
 static tree_node_t *
-tree_find_node(tree_t *t, incr_stats_t *is, tree_node_t *prev)
+tree_find_node(tree_t *t, path_t path)
 {
 	assert(t && t->htable);
-	path_t path = is->coord_path;
 	/* pass and resign must never be inserted in the hash table. */
 	assert(path > 0);
 
-	int hash, parent_hash;
+	int hash;
 	bool found;
-	find_hash(hash, t->htable, t->hbits, path, found, h_counts);
-	tree_hash_t *hnode = &t->htable[hash];
+	find_hash(hash, t->htable, t->hbits, path, found, h_counts, &t->hgen);
 
 	if (DEBUGVV(7))
-		fprintf(stderr,
-			"find_node %" PRIpath " %s found %d hash %d playouts %d node %p\n", path,
-			path2sstr(path), found, hash, is->incr.playouts, hnode->node);
+		fprintf(stderr, "find_node %" PRIpath " %s found %d hash %d node %p\n",
+			path, path2sstr(path), found, hash, t->htable[hash].node);
 
-	if (found) return hnode->node;
+	if (found) return t->htable[hash].node;
 
-	/* The master sends parents before children so the parent should
-	 * already be in the hash table. */
 	path_t parent_p = parent_path(path);
-	tree_node_t *parent;
-	if (parent_p) {
-		find_hash(parent_hash, t->htable, t->hbits,
-			  parent_p, found, h_counts);
-		parent = t->htable[parent_hash].node;
-	} else {
-		parent = t->root;
-	}
-	tree_node_t *node = NULL;
-	if (parent) {
-		/* Search for the node in parent's children. */
-		coord_t leaf = leaf_coord(path);
-		node = (prev && prev->parent == parent ? prev->sibling : parent->children);
-		while (node && node_coord(node) != leaf) node = node->sibling;
-
-		if (DEBUG_MODE) parent_leaf += !parent->is_expanded;
-	} else {
-		if (DEBUG_MODE) parent_not_found++;
-		if (DEBUGVV(7))
-			fprintf(stderr, "parent of %" PRIpath " %s not found\n",
-				path, path2sstr(path));
-	}
+	tree_node_t *parent = (parent_p ? tree_find_node(t, parent_p) : t->root);
+	tree_node_t *node = (parent ? tree_find_child(parent, NULL, leaf_coord(path)) : NULL);
+	if (DEBUG_MODE && !parent) parent_not_found++;
+	if (DEBUG_MODE && !node) node_not_found++;
 
-	/* Insert the node in the hash table. */
+	/* Insert the node in the hash table. Recursive call above may have
+	 * moved things around, find slot again. */
+	find_hash(hash, t->htable, t->hbits, path, found, h_counts, &t->hgen);
+	tree_hash_t *hnode = &t->htable[hash];
 	hnode->node = node;
+	hnode->coord_path = path;
+	hash_gen_insert(&t->hgen, hash);
 	if (DEBUG_MODE) h_counts.inserts++, h_counts.occupied++;
 	if (DEBUGVV(7))
-		fprintf(stderr, "insert path %" PRIpath " %s hash %d playouts %d node %p\n",
-			path, path2sstr(path), hash, is->incr.playouts, node);
+		fprintf(stderr, "insert path %" PRIpath " %s hash %d node %p\n",
+			path, path2sstr(path), hash, node);
+	return node;
+}
 
-	if (DEBUG_MODE && !node) node_not_found++;
+/* Find tree nodes for the @n stats records, without going through the
+ * hash table most of the time: records are sorted by coord path (increasing
+ * levels, increasing coords within a level), so the parent of a record is
+ * usually an earlier record and siblings come in children order. Walk the
+ * batch as a trie then, parent record index only moves forward and each
+ * children list gets scanned once.
+ * @nodes[i] is set to stats[i] node, NULL if not found. */
+static void
+resolve_stats_nodes(tree_t *t, incr_stats_t *stats, tree_node_t **nodes, int n)
+{
+	int p = 0;  /* parent record candidate */
+	tree_node_t *prev = NULL;
+	for (int i = 0; i < n; i++) {
+		path_t path = stats[i].coord_path;
+		path_t parent_p = parent_path(path);
+		tree_node_t *parent = t->root;
+		if (parent_p) {
+			while (p < i && stats[p].coord_path < parent_p) p++;
+			parent = (p < i && stats[p].coord_path == parent_p ? nodes[p] : tree_find_node(t, parent_p));
+		}
+		if (!parent) {
+			if (DEBUG_MODE) parent_not_found++, node_not_found++;
+			if (DEBUGVV(7))
+				fprintf(stderr, "parent of %" PRIpath " %s not found\n",
+					path, path2sstr(path));
+			nodes[i] = NULL;
+			continue;
+		}
 
-	hnode->coord_path = path;
-	return node;
+		tree_node_t *from = (prev && node_parent(prev) == parent ? prev + 1 : NULL);
+		tree_node_t *node = tree_find_child(parent, from, leaf_coord(path));
+		if (DEBUG_MODE && !node) node_not_found++;
+		nodes[i] = node;
+		if (node)  prev = node;
+	}
 }
 
 
@@ -170,6 +227,29 @@ discard_bin_args(char *args)
 	}
 }
 
+/* pachi-dcnn_priors gets "color coord prob coord prob ..." with the
+ * dcnn policy of another slave, see distributed.c:share_dcnn_policy() */
+static void
+receive_root_policy(uct_t *u, board_t *b, char *args)
+{
+	char str[8];
+	float prob;
+	int n;
+	u->root_policy_moves = -1;
+	if (sscanf(args, "%7s%n", str, &n) != 1)  return;
+	u->root_policy_color = str2stone(str);
+	args += n;
+
+	memset(u->root_policy, 0, sizeof(u->root_policy));
+	while (sscanf(args, " %7s %f%n", str, &prob, &n) == 2) {
+		coord_t c = str2coord(str);
+		if (c > 0 && c < board_max_coords(b))
+			u->root_policy[c] = prob;
+		args += n;
+	}
+	u->root_policy_moves = b->moves;
+}
+
 enum parse_code
 uct_notify(engine_t *e, board_t *b, int id, char *cmd, char *args, gtp_t *gtp)
 {
@@ -193,48 +273,88 @@ uct_notify(engine_t *e, board_t *b, int id, char *cmd, char *args, gtp_t *gtp)
 		gtp_error_printf(gtp, "Out of sync, %d %s, move %d expected\n", id, cmd, b->moves);
 		return P_OK;
 	}
+
+	if (!strcasecmp(cmd, "pachi-dcnn_priors")) {
+		receive_root_policy(u, b, args);
+		if (reply_disabled(id))  gtp->quiet = true;
+		return P_DONE_OK;
+	}
 	return (reply_disabled(id) ? P_NOREPLY : P_OK);
 }
 
+/* Root dcnn policy for @color at current move if the master sent one. */
+float *
+uct_slave_root_policy(uct_t *u, board_t *b, enum stone color)
+{
+	if (!u->slave || u->root_policy_moves != b->moves || u->root_policy_color != color)
+		return NULL;
+	return u->root_policy;
+}
+
 
-/* Read the move stats sent by the master, as a binary array of
- * incr_stats structs. The stats come sorted by increasing coord path.
- * To simplify the code, we assume that master and slave have the same
- * architecture (store values identically).
+/* How many nodes ahead receive_stats() prefetches. */
+#define STATS_PREFETCH 8
+
+/* Read the move stats sent by the master, as an encoded array of
+ * incr_stats structs (see distributed/encode.h). The stats come sorted
+ * by increasing coord path.
  * Keep this code in sync with distributed/merge.c:output_stats()
  * Return true if ok, false if error. */
 static bool
 receive_stats(uct_t *u, int size)
 {
-	if (size % sizeof(incr_stats_t)) return false;
-	int nodes = size / sizeof(incr_stats_t);
-	if (nodes > (1 << u->stats_hbits)) return false;
+	static unsigned char *buf = NULL;
+	static incr_stats_t *stats = NULL;
+	static tree_node_t **nodes_found = NULL;
+	static int buf_size = 0, max_nodes = 0;
+	if (size > buf_size) {
+		buf_size = size;
+		buf = crealloc(buf, buf_size);
+	}
+	if (fread(buf, 1, size, stdin) != (size_t)size)
+		return false;
+
+	int nodes = incr_stats_encoded_nodes(buf, size);
+	if (nodes <= 0 || nodes > (1 << HASH_MAX_BITS)) return false;
+	if (nodes > max_nodes) {
+		max_nodes = nodes;
+		stats = crealloc(stats, max_nodes * sizeof(incr_stats_t));
+		nodes_found = crealloc(nodes_found, max_nodes * sizeof(tree_node_t*));
+	}
+	if (incr_stats_decode(buf, size, stats, max_nodes) != nodes)
+		return false;
 
 	tree_t *t = u->t;
-	assert(nodes && t->htable);
-	tree_node_t *prev = NULL;
+	assert(t->htable);
+	while (hash_needs_grow(&t->hgen, t->hbits, nodes))
+		uct_htable_grow(t);
 	double start_time = time_now();
 
+	resolve_stats_nodes(t, stats, nodes_found, nodes);
+
+	/* Nodes are all over the tree, fetch a few ahead. */
+	for (int n = 0; n < nodes && n < STATS_PREFETCH; n++)
+		if (nodes_found[n])  __builtin_prefetch(&nodes_found[n]->u, 1);
+
 	for (int n = 0; n < nodes; n++) {
-		incr_stats_t is;
-		if (fread(&is, sizeof(incr_stats_t), 1, stdin) != 1)
-			return false;
+		incr_stats_t *is = &stats[n];
+		tree_node_t *ahead = (n + STATS_PREFETCH < nodes ? nodes_found[n + STATS_PREFETCH] : NULL);
+		if (ahead)  __builtin_prefetch(&ahead->u, 1);
 
 		if (UDEBUGL(7))
 			fprintf(stderr, "read %5d/%d %6d %.3f %" PRIpath " %s\n", n, nodes,
-				is.incr.playouts, is.incr.value, is.coord_path,
-				path2sstr(is.coord_path));
+				is->incr.playouts, is->incr.value, is->coord_path,
+				path2sstr(is->coord_path));
 
-		tree_node_t *node = tree_find_node(t, &is, prev);
+		tree_node_t *node = nodes_found[n];
 		if (!node) continue;
 
 		/* node_total += others_incr */
-		stats_add_result(&node->u, is.incr.value, is.incr.playouts);
+		stats_add_result(&node->u, is->incr.value, is->incr.playouts);
+		tree_topk_update(t, node);
 
 		/* last_total += others_incr */
-		stats_add_result(&node->pu, is.incr.value, is.incr.playouts);
-
-		prev = node;
+		stats_add_result(&tree_node_cold(t, node)->pu, is->incr.value, is->incr.playouts);
 	}
 	if (DEBUGVV(3))
 		fprintf(stderr, "read args for %d nodes in %.4fms\n", nodes,
@@ -261,19 +381,29 @@ static int bucket_count[MAX_BUCKETS];
  * for children to stats_queue. start_path is the coordinate path
  * for the top node. Stats for a node are only appended if enough playouts
  * have been made since the last send, and the level is not too deep.
+ * If node is on the principal variation (@pv) its most visited child
+ * is too, and we recurse into it down to max_pv_path instead of max_path:
+ * deep nodes there get most playouts but would never be shared otherwise.
  * Return the updated stats count. */
 static int
-append_stats(stats_candidate_t *stats_queue, tree_node_t *node, int stats_count,
-	     int max_count, path_t start_path, path_t max_path, int min_increment)
+append_stats(tree_t *t, stats_candidate_t *stats_queue, tree_node_t *node, int stats_count,
+	     int max_count, path_t start_path, path_t max_path, path_t max_pv_path,
+	     bool pv, int min_increment)
 {
+	tree_node_t *best = NULL;
+	if (pv)
+		foreach_child(node, ni) {
+			if (!best || ni->u.playouts > best->u.playouts)  best = ni;
+		}
+
 	/* The children field is set only after all children are created
 	 * so we can traverse the the tree while it is updated. */
-	for (tree_node_t *ni = node->children; ni; ni = ni->sibling) {
+	foreach_child(node, ni) {
 
 		if (is_pass(node_coord(ni))) continue;
 		if (ni->hints & TREE_HINT_INVALID) continue;
 
-		int incr = ni->u.playouts - ni->pu.playouts;
+		int incr = ni->u.playouts - tree_node_cold(t, ni)->pu.playouts;
 		if (incr < min_increment) continue;
 
 		/* min_increment should be tuned to avoid overflow. */
@@ -291,10 +421,11 @@ append_stats(stats_candidate_t *stats_queue, tree_node_t *node, int stats_count,
 		bucket_count[incr]++;
 
 		/* Do not recurse if level deep enough. */
-		if (child_path >= max_path) continue;
+		if (child_path >= (ni == best ? max_pv_path : max_path)) continue;
 
-		stats_count = append_stats(stats_queue, ni, stats_count, max_count,
-					   child_path, max_path, min_increment);
+		stats_count = append_stats(t, stats_queue, ni, stats_count, max_count,
+					   child_path, max_path, max_pv_path, ni == best,
+					   min_increment);
 	}
 	return stats_count;
 }
@@ -311,7 +442,7 @@ coord_cmp(const void *p1, const void *p2)
 /* Select from stats_queue at most shared_nodes candidates with
  * biggest increments. Return a binary array sorted by coord path. */
 static incr_stats_t *
-select_best_stats(stats_candidate_t *stats_queue, int stats_count,
+select_best_stats(tree_t *t, stats_candidate_t *stats_queue, int stats_count,
 		  int shared_nodes, int *byte_size)
 {
 	static incr_stats_t *out_stats = NULL;
@@ -335,8 +466,9 @@ select_best_stats(stats_candidate_t *stats_queue, int stats_count,
 		if (delta < 0 || (delta == 0 && --min_count < 0)) continue;
 
 		tree_node_t *node = stats_queue[count].node;
+		move_stats_t *pu = &tree_node_cold(t, node)->pu;
 		os->incr = node->u;
-		stats_rm_result(&os->incr, node->pu.value, node->pu.playouts);
+		stats_rm_result(&os->incr, pu->value, pu->playouts);
 
 		/* With virtual loss os->incr.playouts might be <= 0; we only
 		 * send positive increments to other slaves so a virtual loss
@@ -344,7 +476,7 @@ select_best_stats(stats_candidate_t *stats_queue, int stats_count,
 		 * virtual loss will be propagated later when node->u gets
 		 * above node->pu. */
 		if (os->incr.playouts > 0) {
-			node->pu = node->u;
+			*pu = node->u;
 			os->coord_path = stats_queue[count].coord_path;
 			assert(os->coord_path > 0);
 			os++;
@@ -360,8 +492,18 @@ select_best_stats(stats_candidate_t *stats_queue, int stats_count,
 	return out_stats;
 }
 
+/* Binary replies: encoded stats go after room for the root stats
+ * (see report_stats()), so both can be sent without copying. */
+static unsigned char *
+reply_buf(uct_t *u)
+{
+	static unsigned char *buf = NULL;
+	if (!buf)  buf = cmalloc(ROOT_STATS_MAX_SIZE + incr_stats_max_encoded_size(u->shared_nodes));
+	return buf + ROOT_STATS_MAX_SIZE;
+}
+
 /* Get incremental stats updates for the distributed engine.
- * Return a binary array of incr_stats structs in coordinate order
+ * Return an encoded array of incr_stats structs in coordinate order
  * (increasing levels and increasing coordinates within a level).
  * This function is called only by the main thread, but may be
  * called while the tree is updated by the worker threads. Keep this
@@ -399,40 +541,41 @@ report_incr_stats(uct_t *u, int *stats_size)
 		min_increment--;
 	}
 
-	stats_count = append_stats(stats_queue, root, 0, max_nodes, 0,
-				   max_parent_path(u), min_increment);
+	/* Deepest level that fits in a path. */
+	int pv_levels = u->shared_pv_levels;
+	if (pv_levels > 63 / board_bits2())  pv_levels = 63 / board_bits2();
+	path_t max_path = max_parent_path(u);
+	path_t max_pv_path = ((path_t)1) << ((pv_levels - 1) * board_bits2());
+	if (max_pv_path < max_path)  max_pv_path = max_path;
+
+	stats_count = append_stats(u->t, stats_queue, root, 0, max_nodes, 0,
+				   max_path, max_pv_path, true, min_increment);
 
-	void *buf = select_best_stats(stats_queue, stats_count, u->shared_nodes, stats_size);
+	int raw_size;
+	incr_stats_t *stats = select_best_stats(u->t, stats_queue, stats_count, u->shared_nodes, &raw_size);
+	int nodes = raw_size / sizeof(incr_stats_t);
+
+	unsigned char *buf = reply_buf(u);
+	*stats_size = incr_stats_encode(stats, nodes, buf);
 
 	if (DEBUGVV(3))
 		fprintf(stderr,
-			"min_incr %d games %d stats_queue %d/%d sending %d/%d in %.3fms\n",
-			min_increment, root->u.playouts - root->pu.playouts, stats_count,
-			max_nodes, *stats_size / (int)sizeof(incr_stats_t), u->shared_nodes,
+			"min_incr %d games %d stats_queue %d/%d sending %d/%d (%d bytes) in %.3fms\n",
+			min_increment, root->u.playouts - tree_node_cold(u->t, root)->pu.playouts, stats_count,
+			max_nodes, nodes, u->shared_nodes, *stats_size,
 			(time_now() - start_time)*1000);
-	root->pu = root->u;
+	tree_node_cold(u->t, root)->pu = root->u;
 	return buf;
 }
 
-/* Get stats for the distributed engine. Return a buffer with one
- * line "played_own root_playouts threads keep_looking @size", then
- * a list of lines "coord playouts value" with absolute counts for
- * children of the root node (including contributions from other
- * slaves). The last line must not end with \n.
- * If @force is non-zero, add this move with a large weight.
- * This function is called only by the main thread, but may be
- * called while the tree is updated by the worker threads. Keep this
- * code in sync with distributed/distributed.c:select_best_move(). */
-static char *
-report_stats(uct_t *u, board_t *b, coord_t force,
-	     bool keep_looking, int bin_size)
+/* Get absolute stats of the best children of the root node (including
+ * contributions from other slaves) into @rs, return their number.
+ * If @force is non-zero, add this move with a large weight. */
+static int
+root_stats(uct_t *u, board_t *b, coord_t force, root_stats_t *rs)
 {
-	static char reply[10240];
-	char *r = reply;
-	char *end = reply + sizeof(reply);
 	tree_node_t *root = u->t->root;
-	r += snprintf(r, end - r, "%d %d %d %d @%d", u->played_own, root->u.playouts,
-		      u->threads, keep_looking, bin_size);
+	int n = 0;
 	int min_playouts = root->u.playouts / 100;
 	if (min_playouts < GJ_MINGAMES)
 		min_playouts = GJ_MINGAMES;
@@ -440,7 +583,7 @@ report_stats(uct_t *u, board_t *b, coord_t force,
 
 	/* We rely on the fact that root->children is set only
 	 * after all children are created. */
-	for (tree_node_t *ni = root->children; ni; ni = ni->sibling) {
+	foreach_child(root, ni) {
 
 		if (is_pass(node_coord(ni))) continue;
 		assert(node_coord(ni) > 0 && node_coord(ni) < board_max_coords(b));
@@ -452,18 +595,60 @@ report_stats(uct_t *u, board_t *b, coord_t force,
 		/* A book move is only added at the end: */
 		if (node_coord(ni) == force) continue;
 
-		char buf[4];
 		/* We return the values as stored in the tree, so from black's view. */
-		r += snprintf(r, end - r, "\n%s %d %.16f", coord2bstr(buf, node_coord(ni)),
-			      ni->u.playouts, ni->u.value);
+		rs[n].coord = node_coord(ni);
+		rs[n++].stats = ni->u;
 	}
 	/* Give a large but not infinite weight to pass, resign or book move, to avoid
 	 * forcing resign if other slaves don't like it. */
 	if (force) {
-		double resign_value = u->t->root_color == S_WHITE ? 0.0 : 1.0;
-		double value = is_resign(force) ? resign_value : 1.0 - resign_value;
-		r += snprintf(r, end - r, "\n%s %d %.1f", coord2sstr(force), 2 * max_playouts, value);
+		floating_t resign_value = u->t->root_color == S_WHITE ? 0.0 : 1.0;
+		rs[n].coord = force;
+		rs[n].stats.playouts = 2 * max_playouts;
+		rs[n++].stats.value = is_resign(force) ? resign_value : 1.0 - resign_value;
 	}
+	return n;
+}
+
+/* Get stats for the distributed engine. Return a buffer with one
+ * line "played_own root_playouts threads keep_looking @size", then
+ * a list of lines "coord playouts value" with the root stats (see
+ * root_stats()). The last line must not end with \n.
+ * With @binary_root the root stats are sent as binary array instead,
+ * in front of the @stats_size bytes in @stats_buf (which are in
+ * reply_buf() if any), and the first line is
+ * "played_own root_playouts threads keep_looking #root_size @size".
+ * This function is called only by the main thread, but may be
+ * called while the tree is updated by the worker threads. Keep this
+ * code in sync with distributed/distributed.c:select_best_move(). */
+static char *
+report_stats(uct_t *u, board_t *b, coord_t force, bool keep_looking,
+	     bool binary_root, void **stats_buf, int *stats_size)
+{
+	static char reply[10240];
+	char *r = reply;
+	char *end = reply + sizeof(reply);
+	tree_node_t *root = u->t->root;
+	r += snprintf(r, end - r, "%d %d %d %d", u->played_own, root->u.playouts,
+		      u->threads, keep_looking);
+
+	root_stats_t rs[BOARD_MAX_COORDS + 1];
+	int n = root_stats(u, b, force, rs);
+
+	if (binary_root) {
+		int size = n * sizeof(rs[0]);
+		unsigned char *buf = reply_buf(u) - size;
+		memcpy(buf, rs, size);
+		*stats_buf = buf;
+		*stats_size += size;
+		snprintf(r, end - r, " #%d @%d", size, *stats_size);
+		return reply;
+	}
+
+	r += snprintf(r, end - r, " @%d", *stats_size);
+	for (int i = 0; i < n; i++)
+		r += snprintf(r, end - r, "\n%s %d %.16f", coord2sstr(rs[i].coord),
+			      rs[i].stats.playouts, (double)rs[i].stats.value);
 	return reply;
 }
 
@@ -498,8 +683,8 @@ slave_check_progress(uct_t *u, board_t *b, enum stone color, time_info_t *ti,
 	u->played_own = played_games - s->base_playouts;
 
 	if (s->fullmem) {
-		/* Stop search, realloc tree and restart search */
-		if (!u->auto_alloc || !uct_search_realloc_tree(u, b, color, ti, s))
+		/* Stop search, realloc tree / recycle nodes and restart search */
+		if (!uct_search_fullmem(u, b, color, ti, s))
 			uct_search_stop();
 	}
 
@@ -523,10 +708,11 @@ slave_check_progress(uct_t *u, board_t *b, enum stone color, time_info_t *ti,
  * returns. It is stopped by receiving a play GTP command, triggering
  * uct_pondering_stop(). */
 /* genmoves gets in the args parameter
- * "played_games nodes main_time byoyomi_time byoyomi_periods byoyomi_stones @size"
- * and reads a binary array of coord, playouts, value to get stats of other slaves,
+ * "played_games nodes main_time byoyomi_time byoyomi_periods byoyomi_stones [+root] @size"
+ * and reads an encoded array of coord, playouts, value to get stats of other slaves,
  * except possibly for the first call at a given move number.
- * See report_stats() for the description of the return value. */
+ * See report_stats() for the description of the return value, +root
+ * asks for binary root stats. */
 char *
 uct_genmoves(engine_t *e, board_t *b, time_info_t *ti, enum stone color,
 	     char *args, bool pass_all_alive, void **stats_buf, int *stats_size)
@@ -586,6 +772,7 @@ uct_genmoves(engine_t *e, board_t *b, time_info_t *ti, enum stone color,
 			*stats_buf = report_incr_stats(u, stats_size);
 	}
 
-	char *reply = report_stats(u, b, force, keep_looking, *stats_size);
+	bool binary_root = strstr(args, "+root");
+	char *reply = report_stats(u, b, force, keep_looking, binary_root, stats_buf, stats_size);
 	return reply;
 }
@@ -1,5 +1,7 @@
 #include <assert.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -10,6 +12,7 @@
 #include "board.h"
 #include "debug.h"
 #include "engine.h"
+#include "metrics.h"
 #include "move.h"
 #include "playout.h"
 #include "tactics/util.h"
@@ -23,6 +26,45 @@
 #include "uct/slave.h"
 #endif
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#else
+#include <windows.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+
+/* Per-thread node allocation slabs:
+ * Each thread carves large chunks out of the nodes buffer and allocates
+ * nodes from there, so that expanding nodes doesn't hit the shared nodes_size
+ * cache line every time. nodes_size counts whole slabs, so tree full accounting
+ * works as before (at most one partially used slab per thread).
+ * A slab is valid only for the tree allocation generation it was carved in,
+ * generation changes whenever a tree is created or its nodes are discarded. */
+#define TREE_SLAB_MAX_SIZE	(1024 * 1024)
+
+typedef struct {
+	unsigned int gen;
+	size_t next;	/* byte offset of next free node */
+	size_t end;
+} tree_slab_t;
+
+static __thread tree_slab_t slab = { 0, };
+static volatile unsigned int tree_alloc_gen = 0;
+
+/* Discard all tree nodes, start allocating from scratch. */
+static void
+tree_clear_nodes(tree_t *t)
+{
+	t->nodes_size = 0;
+	t->alloc_gen = __sync_add_and_fetch(&tree_alloc_gen, 1);
+	t->undo_n = 0;		/* previous roots are gone */
+	if (t->tt)
+		memset(t->tt, 0, ((size_t)1 << t->tt_bits) * sizeof(*t->tt));
+}
 
 /* Allocate tree node(s). The returned nodes are initialized with zeroes.
  * Returns NULL if not enough memory.
@@ -33,15 +75,32 @@
 static tree_node_t *
 tree_alloc_node(tree_t *t, int count)
 {
-	tree_node_t *n = NULL;
-	size_t nsize = count * sizeof(*n);
-	size_t old_size = __sync_fetch_and_add(&t->nodes_size, nsize);
+	size_t nsize = count * TREE_NODE_SIZE;
+	size_t offset = slab.next;
+
+	if (slab.gen != t->alloc_gen || offset + nsize > slab.end) {
+		/* Carve new slab */
+		size_t slab_size = t->max_tree_size / 1024;
+		if (slab_size > TREE_SLAB_MAX_SIZE)  slab_size = TREE_SLAB_MAX_SIZE;
+		slab_size -= slab_size % TREE_NODE_SIZE;
+		if (slab_size < nsize)  slab_size = nsize;
+
+		size_t old_size = __sync_fetch_and_add(&t->nodes_size, slab_size);
+		if (old_size + nsize > t->max_tree_size)
+			return NULL;  /* Not reverting nodes_size, see above */
+
+		offset = old_size;
+		slab.gen = t->alloc_gen;
+		slab.end = old_size + slab_size;
+		if (slab.end > t->max_tree_size)  slab.end = t->max_tree_size;
+	}
+	slab.next = offset + nsize;
 
-	if (old_size + nsize > t->max_tree_size)
-		return NULL;  /* Not reverting nodes_size, see above */
 	assert(t->nodes != NULL);
-	n = (tree_node_t *)((char*)t->nodes + old_size);
-	memset(n, 0, nsize);
+	size_t index = offset / TREE_NODE_SIZE;
+	tree_node_t *n = (tree_node_t *)t->nodes + index;
+	memset(n, 0, count * sizeof(tree_node_t));
+	memset(&t->cold[index], 0, count * sizeof(tree_node_cold_t));
 	return n;
 }
 
@@ -51,12 +110,13 @@ static void
 tree_setup_node(tree_t *t, tree_node_t *n, coord_t coord, int depth)
 {
 	static volatile unsigned int hash = 0;
+	tree_node_cold_t *cold = tree_node_cold(t, n);
 	n->coord = coord;
-	n->depth = depth;
-	/* n->hash is used only for debugging. It is very likely (but not
+	cold->depth = depth;
+	/* cold->hash is used only for debugging. It is very likely (but not
 	 * guaranteed) to be unique. */
-	hash_t h = n - (tree_node_t *)0;
-	n->hash = (h << 32) + (hash++ & 0xffffffff);
+	hash_t h = n - (tree_node_t *)t->nodes;
+	cold->hash = (h << 32) + (hash++ & 0xffffffff);
 	if (depth > t->max_depth)
 		t->max_depth = depth;
 }
@@ -73,44 +133,284 @@ tree_init_node(tree_t *t, coord_t coord, int depth)
 	return n;
 }
 
+/* Lazy expansion pending moves, see tree_expand_node().
+ * Lists live in the nodes buffer: a list takes a few node slots, filling
+ * both hot and cold parts, so they're garbage collected with the nodes. */
+typedef struct {
+	short    coord;
+	unsigned char d;
+	node_prior_t prior;
+} tree_pending_t;
+
+#define PENDING_PER_HOT		(sizeof(tree_node_t) / sizeof(tree_pending_t))
+#define PENDING_PER_SLOT	(PENDING_PER_HOT + sizeof(tree_node_cold_t) / sizeof(tree_pending_t))
+#define pending_slots(n)	(((n) + PENDING_PER_SLOT - 1) / PENDING_PER_SLOT)
+
+/* Pending move @i of list starting at nodes buffer slot @slot */
+static tree_pending_t *
+tree_pending(tree_t *t, uint32_t slot, int i)
+{
+	slot += i / PENDING_PER_SLOT;
+	unsigned int r = i % PENDING_PER_SLOT;
+	if (r < PENDING_PER_HOT)
+		return (tree_pending_t *)((tree_node_t *)t->nodes + slot) + r;
+	return (tree_pending_t *)&t->cold[slot] + (r - PENDING_PER_HOT);
+}
+
+/* Allocate pending list for @n moves, returns first slot or -1 if tree is full. */
+static int64_t
+tree_alloc_pending(tree_t *t, int n)
+{
+	tree_node_t *slots = tree_alloc_node(t, pending_slots(n));
+	return (slots ? slots - (tree_node_t *)t->nodes : -1);
+}
+
+static size_t
+tree_clamp_size(size_t size)
+{
+#ifdef TREE_COMPACT_INDEX
+	/* Node offsets must fit in 32 bits. */
+	if (size / TREE_NODE_SIZE > INT32_MAX) {
+		size = (size_t)INT32_MAX * TREE_NODE_SIZE;
+		if (DEBUGL(1))  fprintf(stderr, "Tree size limited to %lu Mb in compact index build.\n",
+					(unsigned long)(size / (1024 * 1024)));
+	}
+#endif
+	return size;
+}
+
+/* Nodes buffer memory placement, see tree_set_mem_options(). */
+static size_t tree_hugepages = 0;
+static int    tree_numa = TREE_NUMA_DEFAULT;
+
+/* Set memory options for trees created from now on:
+ * @hugepages: 0 (regular pages), TREE_HUGEPAGES_THP (ask for transparent huge
+ *             pages) or huge page size to map explicit huge pages (2M, 1G).
+ *             Falls back to transparent huge pages if none are available.
+ * @numa:      TREE_NUMA_DEFAULT, TREE_NUMA_INTERLEAVE (spread nodes buffer
+ *             over all memory nodes) or memory node to allocate from. */
+void
+tree_set_mem_options(size_t hugepages, int numa)
+{
+	tree_hugepages = hugepages;
+	tree_numa = numa;
+}
+
+static bool
+tree_mem_options(void)
+{
+	return (tree_hugepages || tree_numa != TREE_NUMA_DEFAULT);
+}
+
+/* Apply numa policy to nodes buffer. No libnuma dependency, mbind() is
+ * simple enough to call directly. */
+static void
+tree_numa_policy(void *p, size_t size)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+	enum { MPOL_PREFERRED_ = 1, MPOL_INTERLEAVE_ = 3 };
+	unsigned long mask[16];  memset(mask, 0, sizeof(mask));
+	int mode;
+	if (tree_numa == TREE_NUMA_DEFAULT)
+		return;
+	if (tree_numa == TREE_NUMA_INTERLEAVE) {
+		/* Kernel restricts it to nodes we're allowed to use. */
+		mode = MPOL_INTERLEAVE_;
+		memset(mask, 0xff, sizeof(mask));
+	} else {
+		mode = MPOL_PREFERRED_;
+		if (tree_numa >= (int)(sizeof(mask) * 8))  return;
+		mask[tree_numa / (sizeof(long) * 8)] = 1UL << (tree_numa % (sizeof(long) * 8));
+	}
+	if (syscall(SYS_mbind, p, size, mode, mask, sizeof(mask) * 8, 0) && DEBUGL(2))
+		perror("mbind");
+#endif
+}
+
+#ifdef _WIN32
+/* Large pages need SeLockMemoryPrivilege ("Lock pages in memory" user right),
+ * it must be enabled in our token too. */
+static bool
+win_enable_large_pages(void)
+{
+	HANDLE token;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+		return false;
+	TOKEN_PRIVILEGES tp;
+	tp.PrivilegeCount = 1;
+	tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	bool ok = (LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &tp.Privileges[0].Luid) &&
+		   AdjustTokenPrivileges(token, FALSE, &tp, 0, NULL, NULL) &&
+		   GetLastError() == ERROR_SUCCESS);
+	CloseHandle(token);
+	return ok;
+}
+
+/* Preferred memory node if tree_numa says so (no interleave on windows). */
+static void *
+win_alloc(size_t size, DWORD flags)
+{
+	if (tree_numa >= 0)
+		return VirtualAllocExNuma(GetCurrentProcess(), NULL, size, flags, PAGE_READWRITE, tree_numa);
+	return VirtualAlloc(NULL, size, flags, PAGE_READWRITE);
+}
+
+/* Windows has no transparent huge pages, any tree_hugepages setting
+ * asks for large pages (committed and locked upfront), falls back
+ * to regular pages. */
+static void *
+win_map_nodes(size_t size)
+{
+	void *p = NULL;
+	size_t large = GetLargePageMinimum();
+	if (tree_hugepages && large && win_enable_large_pages()) {
+		size_t lsize = (size + large - 1) / large * large;
+		p = win_alloc(lsize, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES);
+		if (!p && DEBUGL(2))
+			fprintf(stderr, "Couldn't get %lu Mb of large pages (error %lu), using regular pages.\n",
+				(unsigned long)(lsize / (1024 * 1024)), (unsigned long)GetLastError());
+	}
+	/* Committed pages are only backed by actual memory once touched. */
+	if (!p)
+		p = win_alloc(size, MEM_RESERVE | MEM_COMMIT);
+	return p;
+}
+#endif
+
+/* Map nodes buffer (@size bytes).
+ * Pages are only backed by actual memory once nodes get allocated there,
+ * unless using explicit huge pages which are taken from the pool upfront. */
+static void *
+tree_map_nodes(size_t size)
+{
+#ifdef _WIN32
+	return win_map_nodes(size);
+#else
+	void *p = MAP_FAILED;
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+	if (tree_hugepages > TREE_HUGEPAGES_THP) {
+		int shift = __builtin_ctzll(tree_hugepages);
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT), -1, 0);
+		if (p == MAP_FAILED && DEBUGL(2))
+			fprintf(stderr, "Couldn't get %lu Mb of %lu Mb huge pages, using regular pages.\n",
+				(unsigned long)(size / (1024 * 1024)), (unsigned long)(tree_hugepages / (1024 * 1024)));
+	}
+#endif
+	if (p == MAP_FAILED) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (p == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		if (tree_hugepages)
+			madvise(p, size, MADV_HUGEPAGE);
+#endif
+	}
+	tree_numa_policy(p, size);
+	return p;
+#endif
+}
+
 /* Create a tree structure and pre-allocate all nodes.
+ * If @reserve_size > @max_tree_size try to reserve that much address space
+ * so that tree_grow() can later grow the tree in place.
  * Returns NULL if out of memory */
 tree_t *
-tree_init(enum stone color, size_t max_tree_size, int hbits)
+tree_init_growable(enum stone color, size_t max_tree_size, size_t reserve_size, int hbits)
 {
-	tree_node_t *nodes = NULL;
+	void *nodes = NULL;
+	bool mmapped = false;
 	assert (max_tree_size != 0);
+
+	max_tree_size = tree_clamp_size(max_tree_size);
+	reserve_size = tree_clamp_size(reserve_size);
+	if (reserve_size < max_tree_size)
+		reserve_size = max_tree_size;
+	/* Explicit huge pages: mapping must be a multiple of huge page size. */
+	if (tree_hugepages > TREE_HUGEPAGES_THP)
+		reserve_size = (reserve_size + tree_hugepages - 1) / tree_hugepages * tree_hugepages;
+	if ((reserve_size > max_tree_size || tree_mem_options()) && (nodes = tree_map_nodes(reserve_size)))
+		mmapped = true;
+	else
+		reserve_size = max_tree_size;
 	
 	/* The nodes buffer doesn't need initialization. This is currently
 	 * done by tree_init_node to spread the load. Doing a memset for the
 	 * entire buffer here would be too slow for large trees (>10 GB). */
-	if (!(nodes = malloc(max_tree_size))) {
+	if (!nodes && !(nodes = malloc(max_tree_size))) {
 		if (DEBUGL(2))  fprintf(stderr, "Out of memory.\n");
 		return NULL;
 	}
 	
+	/* Hot nodes first, then cold nodes array. */
+	size_t max_nodes = reserve_size / TREE_NODE_SIZE;
 	tree_t *t = calloc2(1, tree_t);
 	t->max_tree_size = max_tree_size;
+	t->reserved_size = reserve_size;
+	t->nodes_mmapped = mmapped;
 	t->nodes = nodes;
+	t->cold = (tree_node_cold_t *)((tree_node_t *)nodes + max_nodes);
+	tree_clear_nodes(t);
 	/* The root PASS move is only virtual, we never play it. */
 	t->root = tree_init_node(t, pass, 0);
 	t->root_color = stone_other(color); // to research black moves, root will be white
 
 #ifdef DISTRIBUTED
 	t->hbits = hbits;
-	if (hbits) t->htable = uct_htable_alloc(hbits);
+	if (hbits) uct_htable_alloc(t, hbits);
 #endif
 	return t;
 }
 
+tree_t *
+tree_init(enum stone color, size_t max_tree_size, int hbits)
+{
+	return tree_init_growable(color, max_tree_size, 0, hbits);
+}
+
+/* Grow tree memory in place, up to reserved size.
+ * Doesn't move anything so this can be called while search is running.
+ * Returns true if tree got bigger. */
+bool
+tree_grow(tree_t *t, size_t max_tree_size)
+{
+	if (max_tree_size > t->reserved_size)
+		max_tree_size = t->reserved_size;
+	if (max_tree_size <= t->max_tree_size)
+		return false;
+
+	t->max_tree_size = max_tree_size;
+	__sync_synchronize();
+	return true;
+}
+
+/* Enable transposition table with 2^@bits entries. */
+void
+tree_tt_init(tree_t *t, int bits, int eqex)
+{
+	assert(!t->tt && bits > 0);
+	t->tt_bits = bits;
+	t->tt_eqex = eqex;
+	t->tt = calloc2((size_t)1 << bits, tree_tt_entry_t);
+}
+
 void
 tree_done(tree_t *t)
 {
 #ifdef DISTRIBUTED
-	if (t->htable) free(t->htable);
+	if (t->htable) {  free(t->htable);  free(t->hgen.gen);  }
 #endif
+	if (t->tt) free(t->tt);
 	assert(t->nodes);
-	free(t->nodes);
+	if (t->nodes_mmapped)
+#ifndef _WIN32
+		munmap(t->nodes, t->reserved_size);
+#else
+		VirtualFree(t->nodes, 0, MEM_RELEASE);
+#endif
+	else
+		free(t->nodes);
 	free(t);
 }
 
@@ -119,23 +419,21 @@ static void
 tree_node_dump(tree_t *tree, tree_node_t *node, int treeparity, int l, int thres)
 {
 	for (int i = 0; i < l; i++) fputc(' ', stderr);
-	int children = 0;
-	for (tree_node_t *ni = node->children; ni; ni = ni->sibling)
-		children++;
+	int children = (node_children(node) ? node->nchildren : 0);
 	/* We use 1 as parity, since for all nodes we want to know the
 	 * win probability of _us_, not the node color. */
 	fprintf(stderr, "[%s] %.3f/%d [prior %.3f/%d amaf %.3f/%d crit %.3f vloss %d] h=%x c#=%d <%" PRIhash ">\n",
 		coord2sstr(node_coord(node)),
 		tree_node_get_value(tree, treeparity, node->u.value), node->u.playouts,
-		tree_node_get_value(tree, treeparity, node->prior.value), node->prior.playouts,
+		tree_node_get_value(tree, treeparity, node_prior(node).value), node->prior.playouts,
 		tree_node_get_value(tree, treeparity, node->amaf.value), node->amaf.playouts,
 		tree_node_criticality(tree, node), node->descents,
-		node->hints, children, node->hash);
+		node->hints, children, tree_node_cold(tree, node)->hash);
 
 	/* Print nodes sorted by #playouts. */
 
 	tree_node_t *nbox[1000]; int nboxl = 0;
-	for (tree_node_t *ni = node->children; ni; ni = ni->sibling)
+	foreach_child(node, ni)
 		if (ni->u.playouts > thres)
 			nbox[nboxl++] = ni;
 
@@ -157,16 +455,16 @@ tree_dump(tree_t *tree, double thres)
 	int thres_abs = thres > 0 ? tree->root->u.playouts * thres : thres;
 	fprintf(stderr, "(UCT tree; root %s; extra komi %f; max depth %d)\n",
 	        stone2str(tree->root_color), tree->extra_komi,
-		tree->max_depth - tree->root->depth);
+		tree->max_depth - tree_node_depth(tree, tree->root));
 	tree_node_dump(tree, tree->root, 1, 0, thres_abs);
 }
 
 static void
 tree_actual_size_node(tree_t *t, tree_node_t *node, size_t *size)
 {
-	*size += sizeof(*node);
+	*size += TREE_NODE_SIZE;
 
-	for (tree_node_t *ni = node->children;  ni;  ni = ni->sibling)
+	foreach_child(node, ni)
 		tree_actual_size_node(t, ni, size);
 }
 
@@ -184,6 +482,233 @@ tree_actual_size(tree_t *t)
 }
 
 
+/**********************************************************************************/
+/* Tree shape statistics */
+
+void
+tree_shape_reset(tree_t *t)
+{
+	memset(&t->shape, 0, sizeof(t->shape));
+	t->shape.start = time_now();
+}
+
+/* Record @count new children of @node. */
+static void
+tree_shape_add(tree_t *t, tree_node_t *node, int count, bool expansion)
+{
+	int d = tree_node_depth(t, node) - tree_node_depth(t, t->root);
+	d = (d < 0 ? 0 : (d >= TREE_SHAPE_DEPTHS ? TREE_SHAPE_DEPTHS - 1 : d));
+	__sync_fetch_and_add(&t->shape.nodes[d], count);
+	if (expansion)
+		__sync_fetch_and_add(&t->shape.expansions, 1);
+}
+
+typedef struct {
+	long       nodes;
+	long       unvisited;
+	floating_t rate;		/* Expansions per second */
+	floating_t branching;		/* Children per expansion */
+	floating_t spread;		/* Root children effectively searched */
+	int        depths;
+	int        pv_len;
+	floating_t pv[TREE_SHAPE_PV];	/* Share of node visits going to pv move */
+} tree_shape_summary_t;
+
+static void
+tree_shape_summary(tree_t *t, tree_shape_summary_t *s)
+{
+	tree_shape_t *sh = &t->shape;
+	memset(s, 0, sizeof(*s));
+	for (int d = 0; d < TREE_SHAPE_DEPTHS; d++) {
+		s->nodes += sh->nodes[d];
+		if (sh->nodes[d])  s->depths = d + 1;
+	}
+	s->unvisited = (s->nodes > sh->visited ? s->nodes - sh->visited : 0);
+	double elapsed = time_now() - sh->start;
+	s->rate = (elapsed > 0 ? sh->expansions / elapsed : 0);
+	s->branching = (sh->expansions ? (floating_t)s->nodes / sh->expansions : 0);
+
+	/* Root spread: exp(entropy) of root children visits. */
+	tree_node_t *root = t->root;
+	if (root->u.playouts > 0) {
+		floating_t entropy = 0;
+		foreach_child(root, ni) {
+			if (ni->u.playouts <= 0)  continue;
+			floating_t p = (floating_t)ni->u.playouts / root->u.playouts;
+			entropy -= p * log(p);
+		}
+		s->spread = exp(entropy);
+	}
+
+	/* Visit concentration along the principal variation. */
+	for (tree_node_t *n = root; s->pv_len < TREE_SHAPE_PV && n->u.playouts > 0; ) {
+		tree_node_t *best = NULL;
+		foreach_child(n, ni)
+			if (!best || ni->u.playouts > best->u.playouts)  best = ni;
+		if (!best || best->u.playouts <= 0)  break;
+		s->pv[s->pv_len++] = (floating_t)best->u.playouts / n->u.playouts;
+		n = best;
+	}
+}
+
+void
+tree_shape_print(tree_t *t, strbuf_t *buf)
+{
+	tree_shape_summary_t s;
+	tree_shape_summary(t, &s);
+	sbprintf(buf, "tree shape: %li nodes, %li expansions (%.0f/s), branching %.1f, unvisited %li (%.0f%%), root spread %.1f\n",
+		 s.nodes, t->shape.expansions, s.rate, s.branching,
+		 s.unvisited, (s.nodes ? 100.0 * s.unvisited / s.nodes : 0), s.spread);
+	sbprintf(buf, "  depth:");
+	for (int d = 0; d < s.depths; d++)
+		sbprintf(buf, " %i%s%li", d + 1, (d == TREE_SHAPE_DEPTHS - 1 ? "+:" : ":"), t->shape.nodes[d]);
+	sbprintf(buf, "\n  pv visits:");
+	for (int i = 0; i < s.pv_len; i++)
+		sbprintf(buf, " %i:%.0f%%", i + 1, 100 * s.pv[i]);
+	sbprintf(buf, "\n");
+}
+
+void
+tree_shape_json(tree_t *t, strbuf_t *buf)
+{
+	tree_shape_summary_t s;
+	tree_shape_summary(t, &s);
+	sbprintf(buf, "{\"nodes\": %li, \"expansions\": %li, \"rate\": %.1f, \"branching\": %.2f, "
+		 "\"unvisited\": %li, \"spread\": %.2f, \"depth\": [",
+		 s.nodes, t->shape.expansions, s.rate, s.branching, s.unvisited, s.spread);
+	for (int d = 0; d < s.depths; d++)
+		sbprintf(buf, "%s%li", (d ? "," : ""), t->shape.nodes[d]);
+	sbprintf(buf, "], \"pv\": [");
+	for (int i = 0; i < s.pv_len; i++)
+		sbprintf(buf, "%s%.3f", (i ? "," : ""), s.pv[i]);
+	sbprintf(buf, "]}");
+}
+
+
+/**********************************************************************************/
+/* Root top list */
+
+/* Least visited entry (empty: -1 playouts) */
+static int
+tree_topk_min(tree_topk_t *k, int *min)
+{
+	int m = 0;
+	*min = INT_MAX;
+	for (int i = 0; i < TREE_TOPK; i++) {
+		tree_node_t *e = k->n[i];
+		int p = (e ? e->u.playouts : -1);
+		if (p < *min) {  *min = p;  m = i;  }
+	}
+	return m;
+}
+
+/* Replace least visited entry with @n if it has more playouts.
+ * Membership is claimed with TREE_HINT_TOPK first so that a node can't
+ * get in twice. Entries' playouts only go up, so a @min seen by anyone
+ * is never above the real one: nodes left out can't have more playouts
+ * than entries. */
+void
+tree_topk_insert(tree_t *t, tree_node_t *n)
+{
+	tree_topk_t *k = &t->topk;
+	if (__sync_fetch_and_or(&n->hints, TREE_HINT_TOPK) & TREE_HINT_TOPK)
+		return;		/* In already, or being inserted */
+
+	int min, m;
+	tree_node_t *old;
+	do {
+		m = tree_topk_min(k, &min);
+		old = k->n[m];
+		if (min >= n->u.playouts) {
+			__sync_fetch_and_and(&n->hints, ~TREE_HINT_TOPK);
+			return;
+		}
+	} while (!__sync_bool_compare_and_swap(&k->n[m], old, n));
+
+	if (old)  __sync_fetch_and_and(&old->hints, ~TREE_HINT_TOPK);
+	tree_topk_min(k, &min);
+	k->min = min;
+}
+
+/* Set up top list for current root. Not thread safe. */
+void
+tree_topk_rebuild(tree_t *t)
+{
+	tree_topk_t *k = &t->topk;
+	memset(k, 0, sizeof(*k));
+	k->min = -1;
+	foreach_child(t->root, n)
+		n->hints &= ~TREE_HINT_TOPK;
+	k->root = t->root;
+	foreach_child(t->root, n)
+		tree_topk_update(t, n);
+}
+
+/* Copy top list entries (unordered) to @n, returns number of entries.
+ * -1 if there's no top list for @parent. */
+int
+tree_topk_get(tree_t *t, tree_node_t *parent, tree_node_t **n)
+{
+	tree_topk_t *k = &t->topk;
+	if (!parent || parent != k->root || parent != t->root)  return -1;
+	int count = 0;
+	for (int i = 0; i < TREE_TOPK; i++) {
+		tree_node_t *e = k->n[i];
+		bool dup = false;	/* Moved to another slot while we read */
+		for (int j = 0; j < count && !dup; j++)
+			dup = (n[j] == e);
+		if (e && !dup)  n[count++] = e;
+	}
+	return count;
+}
+
+/* Priors don't change once root is expanded, look them up once. */
+float
+tree_root_max_prior(tree_t *t)
+{
+	tree_topk_t *k = &t->topk;
+	if (k->max_prior || t->topk.root != t->root)  return k->max_prior;
+	float max_prior = 0;
+	foreach_child(t->root, n)
+		if (n->prior.playouts > max_prior)  max_prior = n->prior.playouts;
+	k->max_prior = max_prior;
+	return max_prior;
+}
+
+/* Insert @ni in @n (@found nodes, most visited first, at most @k). */
+static void
+tree_top_add(tree_node_t **n, int *found, int k, tree_node_t *ni)
+{
+	int playouts = ni->u.playouts;
+	if (playouts <= 0)  return;
+	int i = *found;
+	if (i == k && n[k - 1]->u.playouts >= playouts)  return;
+	if (i == k)  i--;
+	for (; i > 0 && n[i - 1]->u.playouts < playouts; i--)
+		n[i] = n[i - 1];
+	n[i] = ni;
+	if (*found < k)  (*found)++;
+}
+
+/* Up to @k most visited children of @parent (with playouts), most visited
+ * first. For root that's O(k) with the top list, if @k <= TREE_TOPK.
+ * Returns number of nodes found. */
+int
+tree_top_children(tree_t *t, tree_node_t *parent, tree_node_t **n, int k)
+{
+	tree_node_t *top[TREE_TOPK];
+	int count = (k <= TREE_TOPK ? tree_topk_get(t, parent, top) : -1);
+	int found = 0;
+	if (count >= 0)
+		for (int i = 0; i < count; i++)
+			tree_top_add(n, &found, k, top[i]);
+	else
+		foreach_child(parent, ni)
+			tree_top_add(n, &found, k, ni);
+	return found;
+}
+
+
 static char *
 tree_book_name(board_t *b)
 {
@@ -196,53 +721,214 @@ tree_book_name(board_t *b)
 	return buf;
 }
 
+/* Opening tbook file format:
+ * Header followed by node records, depth-first (children follow their parent).
+ * Fixed-size records, so file can be mapped and walked in place: pages are
+ * shared between pachi instances and we don't read it again on every
+ * clear_board.
+ * Since version 2 a tbook can hold the subtree of some opening position
+ * (path moves from the empty board, black first), these are only used
+ * to build the real one with tree_merge_tbooks(). */
+#define TBOOK_MAGIC	"PACHITBK"
+#define TBOOK_VERSION	2
+
+typedef struct {
+	char     magic[8];
+	uint32_t version;
+	uint32_t record_size;  // sizeof(tree_node_record_t)
+	uint64_t nodes;
+	/* Version 2: */
+	uint16_t bsize;
+	uint16_t handicap;
+	float    komi;
+	uint32_t path_len;
+	int16_t  path[TBOOK_MAX_PATH];
+} tbook_header_t;
+
+#define TBOOK_V1_HEADER_SIZE  offsetof(tbook_header_t, bsize)
+
+/* Node data saved/loaded from opening tbook. */
+typedef struct {
+	move_stats_t u;
+	move_stats_t prior;
+	move_stats_t amaf;
+	move_stats_t winner_owner;
+	move_stats_t black_owner;
+	short coord;
+	unsigned short depth;
+	unsigned short nchildren;  // number of saved children
+	unsigned char d;
+	unsigned char hints;
+	bool is_expanded;
+} tree_node_record_t;
+
+/* Mapped tbook, kept around between tree_load() calls. */
+static struct {
+	char filename[256];
+	void *data;
+	size_t size;
+	bool mmapped;
+} tbook = { "", NULL, 0, false };
+
 static void
-tree_node_save(FILE *f, tree_node_t *node, int thres)
+tbook_unmap(void)
 {
-	bool save_children = node->u.playouts >= thres;
-
-	if (!save_children)
-		node->is_expanded = 0;
+	if (!tbook.data)  return;
+#ifndef _WIN32
+	if (tbook.mmapped)  munmap(tbook.data, tbook.size);
+	else
+#endif
+		free(tbook.data);
+	tbook.data = NULL;
+	tbook.filename[0] = 0;
+}
 
-	fputc(1, f);
-	fwrite(((int *) node) + offsetof(tree_node_t, u),
-	       sizeof(tree_node_t) - offsetof(tree_node_t, u),
-	       1, f);
+/* Map tbook file read-only (falls back to reading it if mmap() unavailable).
+ * Returns false if there's no tbook. */
+static bool
+tbook_map(char *filename)
+{
+	if (tbook.data && !strcmp(tbook.filename, filename))
+		return true;
+	tbook_unmap();
 
-	if (save_children) {
-		for (tree_node_t *ni = node->children; ni; ni = ni->sibling)
-			tree_node_save(f, ni, thres);
-	} else {
-		if (node->children)
-			node->is_expanded = 1;
+	FILE *f = fopen(filename, "rb");
+	if (!f)  return false;
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	if (size <= 0) {  fclose(f);  return false;  }
+
+	void *data = NULL;
+	bool mmapped = false;
+#ifndef _WIN32
+	data = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(f), 0);
+	if (data == MAP_FAILED)  data = NULL;
+	else                     mmapped = true;
+#endif
+	if (!data) {
+		data = cmalloc(size);
+		rewind(f);
+		if (fread(data, size, 1, f) != 1) {  free(data);  fclose(f);  return false;  }
 	}
+	fclose(f);
 
-	fputc(0, f);
+	tbook.data = data;
+	tbook.size = size;
+	tbook.mmapped = mmapped;
+	snprintf(tbook.filename, sizeof(tbook.filename), "%s", filename);
+	return true;
+}
+
+static void
+tree_node_save(FILE *f, tree_t *tree, tree_node_t *node, int thres, uint64_t *nodes)
+{
+	bool save_children = node->u.playouts >= thres;
+	tree_node_cold_t *cold = tree_node_cold(tree, node);
+
+	tree_node_record_t r;  memset(&r, 0, sizeof(r));
+	r.u = node->u;  r.prior = node_prior(node);  r.amaf = node->amaf;
+	r.winner_owner = cold->winner_owner;  r.black_owner = cold->black_owner;
+	r.coord = node->coord;  r.depth = cold->depth;
+	r.d = node->d;  r.hints = node->hints & ~(TREE_HINT_PENDING | TREE_HINT_WIDENING);
+	r.is_expanded = (save_children ? node->is_expanded : false);
+	r.nchildren = (save_children && node_children(node) ? node->nchildren : 0);
+
+	/* Children follow their parent record, depth-first. */
+	fwrite(&r, sizeof(r), 1, f);
+	(*nodes)++;
+
+	if (r.nchildren)
+		foreach_child(node, ni)
+			tree_node_save(f, tree, ni, thres, nodes);
+}
+
+/* Lazy expansion: saved nodes get all their moves. */
+static void
+tree_widen_saved(tree_t *tree, tree_node_t *node, int thres)
+{
+	if (node->u.playouts < thres)
+		return;
+	tree_widen_node(tree, node, INT_MAX);
+	foreach_child(node, ni)
+		tree_widen_saved(tree, ni, thres);
+}
+
+static void
+tbook_header_init(tbook_header_t *h, board_t *b, coord_t *path, int path_len)
+{
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, TBOOK_MAGIC, sizeof(h->magic));
+	h->version = TBOOK_VERSION;
+	h->record_size = sizeof(tree_node_record_t);
+	h->bsize = board_rsize(b);
+	h->handicap = b->handicap;
+	h->komi = b->komi;
+	assert(path_len <= TBOOK_MAX_PATH);
+	h->path_len = path_len;
+	for (int i = 0; i < path_len; i++)
+		h->path[i] = path[i];
 }
 
 void
-tree_save(tree_t *tree, board_t *b, int thres)
+tree_save(tree_t *tree, board_t *b, int thres, char *filename, coord_t *path, int path_len)
 {
-	char *filename = tree_book_name(b);
+	if (!filename)  filename = tree_book_name(b);
+	if (!strcmp(tbook.filename, filename))
+		tbook_unmap();
+
 	FILE *f = fopen(filename, "wb");
 	if (!f) {
 		perror("fopen");
 		return;
 	}
-	tree_node_save(f, tree->root, thres);
-	fputc(0, f);
+
+	tbook_header_t h;
+	tbook_header_init(&h, b, path, path_len);
+	fwrite(&h, sizeof(h), 1, f);
+
+	tree_widen_saved(tree, tree->root, thres);
+	tree_node_save(f, tree, tree->root, thres, &h.nodes);
+
+	/* Now that we know node count */
+	rewind(f);
+	fwrite(&h, sizeof(h), 1, f);
 	fclose(f);
 }
 
-
-void
-tree_node_load(FILE *f, tree_node_t *node, int *num)
+/* Check tbook header, returns first node record or NULL if bad.
+ * Version 1 tbooks are still fine, header is just shorter. */
+static const tree_node_record_t *
+tbook_records(void *data, size_t size, tbook_header_t *h)
 {
-	(*num)++;
+	tbook_header_t *fh = data;
+	if (size < TBOOK_V1_HEADER_SIZE)
+		return NULL;
+	size_t hsize = (fh->version == 1 ? TBOOK_V1_HEADER_SIZE : sizeof(*h));
+	if (size < hsize || memcmp(fh->magic, TBOOK_MAGIC, sizeof(fh->magic)) ||
+	    (fh->version != 1 && fh->version != TBOOK_VERSION) ||
+	    fh->record_size != sizeof(tree_node_record_t) ||
+	    size != hsize + fh->nodes * sizeof(tree_node_record_t))
+		return NULL;
 
-	checked_fread(((int *) node) + offsetof(tree_node_t, u),
-		      sizeof(tree_node_t) - offsetof(tree_node_t, u),
-		      1, f);
+	memset(h, 0, sizeof(*h));
+	memcpy(h, fh, hsize);
+	return (const tree_node_record_t *)((char *)data + hsize);
+}
+
+static void
+tree_node_load(tree_t *tree, tree_node_t *node, const tree_node_record_t **rec, const tree_node_record_t *end)
+{
+	if (*rec >= end)  die("tree_load(): truncated tbook\n");
+	const tree_node_record_t *r = (*rec)++;
+
+	tree_node_cold_t *cold = tree_node_cold(tree, node);
+	node->u = r->u;  node_set_prior(node, r->prior);  node->amaf = r->amaf;
+	cold->winner_owner = r->winner_owner;  cold->black_owner = r->black_owner;
+	node->coord = r->coord;  cold->depth = r->depth;
+	node->d = r->d;  node->hints = r->hints;
+	node->is_expanded = r->is_expanded;
+	if (cold->depth > tree->max_depth)
+		tree->max_depth = cold->depth;
 
 	/* Keep values in sane scale, otherwise we start overflowing. */
 #define MAX_PLAYOUTS	10000000
@@ -252,55 +938,412 @@ tree_node_load(FILE *f, tree_node_t *node, int *num)
 	if (node->amaf.playouts > MAX_PLAYOUTS) {
 		node->amaf.playouts = MAX_PLAYOUTS;
 	}
-	memcpy(&node->pu, &node->u, sizeof(node->u));
+	cold->pu = node->u;
 
-	tree_node_t *ni = NULL, *ni_prev = NULL;
-	while (fgetc(f)) {
-		ni_prev = ni; ni = calloc2(1, tree_node_t);
-		if (!node->children)
-			node->children = ni;
-		else
-			ni_prev->sibling = ni;
-		ni->parent = node;
-		tree_node_load(f, ni, num);
+	if (!r->nchildren)
+		return;
+
+	tree_node_t *children = tree_alloc_node(tree, r->nchildren);
+	if (!children)  die("tree_load(): tree too small for tbook\n");
+	for (int i = 0; i < r->nchildren; i++) {
+		node_set_parent(&children[i], node);
+		tree_node_load(tree, &children[i], rec, end);
 	}
+	node->nchildren = r->nchildren;
+	node_set_children(node, children);
 }
 
 void
 tree_load(tree_t *tree, board_t *b)
 {
 	char *filename = tree_book_name(b);
-	FILE *f = fopen(filename, "rb");
-	if (!f)
+	if (!tbook_map(filename))
 		return;
 
 	fprintf(stderr, "Loading opening tbook %s...\n", filename);
 
-	int num = 0;
-	if (fgetc(f))
-		tree_node_load(f, tree->root, &num);
-	fprintf(stderr, "Loaded %d nodes.\n", num);
+	tbook_header_t h;
+	const tree_node_record_t *start = tbook_records(tbook.data, tbook.size, &h);
+	if (!start) {
+		fprintf(stderr, "Bad tbook %s (wrong version or corrupt ?), ignoring.\n", filename);
+		tbook_unmap();
+		return;
+	}
+	if (h.path_len) {
+		fprintf(stderr, "%s: subtree tbook, must be merged first. ignoring.\n", filename);
+		tbook_unmap();
+		return;
+	}
+
+	const tree_node_record_t *rec = start;
+	const tree_node_record_t *end = rec + h.nodes;
+	tree_node_load(tree, tree->root, &rec, end);
+	fprintf(stderr, "Loaded %d nodes.\n", (int)(rec - start));
+}
+
+
+/************************************************************************/
+/* Merging tbooks */
+
+/* To build a tbook in parallel, search different opening positions in
+ * separate pachi processes (pachi-gentbook with a filename after some
+ * moves) and merge their subtrees in the root tbook. Stats of nodes found
+ * in both are merged, and ancestors of a subtree get its playouts too. */
+
+typedef struct tbook_node {
+	tree_node_record_t r;
+	int nchildren;
+	struct tbook_node *children;
+} tbook_node_t;
+
+static void
+tbook_node_read(tbook_node_t *node, const tree_node_record_t **rec, const tree_node_record_t *end)
+{
+	if (*rec >= end)  die("tree_merge_tbooks(): truncated tbook\n");
+	node->r = *(*rec)++;
+	node->nchildren = node->r.nchildren;
+	node->children = (node->nchildren ? calloc2(node->nchildren, tbook_node_t) : NULL);
+	for (int i = 0; i < node->nchildren; i++)
+		tbook_node_read(&node->children[i], rec, end);
+}
+
+static void
+tbook_node_free(tbook_node_t *node)
+{
+	for (int i = 0; i < node->nchildren; i++)
+		tbook_node_free(&node->children[i]);
+	free(node->children);
+}
+
+static void
+tbook_node_shift_depth(tbook_node_t *node, int offset)
+{
+	node->r.depth += offset;
+	for (int i = 0; i < node->nchildren; i++)
+		tbook_node_shift_depth(&node->children[i], offset);
+}
+
+static tbook_node_t *
+tbook_node_child(tbook_node_t *node, coord_t c)
+{
+	for (int i = 0; i < node->nchildren; i++)
+		if (node->children[i].r.coord == c)
+			return &node->children[i];
+	return NULL;
+}
+
+/* Merge @src into @dest, @src is consumed. */
+static void
+tbook_node_merge(tbook_node_t *dest, tbook_node_t *src)
+{
+	stats_merge(&dest->r.u, &src->r.u);
+	stats_merge(&dest->r.amaf, &src->r.amaf);
+	stats_merge(&dest->r.winner_owner, &src->r.winner_owner);
+	stats_merge(&dest->r.black_owner, &src->r.black_owner);
+	if (!dest->r.prior.playouts)  dest->r.prior = src->r.prior;  /* Same position, same priors. */
+	dest->r.hints |= src->r.hints;
+	dest->r.is_expanded |= src->r.is_expanded;
+
+	for (int i = 0; i < src->nchildren; i++) {
+		tbook_node_t *sc = &src->children[i];
+		tbook_node_t *dc = tbook_node_child(dest, sc->r.coord);
+		if (dc) {
+			tbook_node_merge(dc, sc);
+			continue;
+		}
+		dest->children = crealloc(dest->children, (dest->nchildren + 1) * sizeof(tbook_node_t));
+		dest->children[dest->nchildren++] = *sc;  /* Takes over its subtree */
+		sc->nchildren = 0;  sc->children = NULL;
+	}
+	tbook_node_free(src);
+	src->nchildren = 0;  src->children = NULL;
+}
+
+static void
+tbook_node_write(FILE *f, tbook_node_t *node, uint64_t *nodes)
+{
+	node->r.nchildren = node->nchildren;
+	fwrite(&node->r, sizeof(node->r), 1, f);
+	(*nodes)++;
+	for (int i = 0; i < node->nchildren; i++)
+		tbook_node_write(f, &node->children[i], nodes);
+}
 
+/* Read tbook @filename for board @b into @node. */
+static bool
+tbook_read(char *filename, board_t *b, tbook_node_t *node, tbook_header_t *h)
+{
+	FILE *f = fopen(filename, "rb");
+	if (!f)  {  perror(filename);  return false;  }
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	void *data = (size > 0 ? cmalloc(size) : NULL);
+	rewind(f);
+	bool ok = (data && fread(data, size, 1, f) == 1);
 	fclose(f);
+
+	const tree_node_record_t *rec = (ok ? tbook_records(data, size, h) : NULL);
+	if (!rec)
+		fprintf(stderr, "Bad tbook %s (wrong version or corrupt ?), skipping.\n", filename);
+	else if (h->version > 1 && (h->bsize != board_rsize(b) || h->handicap != b->handicap || h->komi != b->komi)) {
+		fprintf(stderr, "%s: different board size, komi or handicap, skipping.\n", filename);
+		rec = NULL;
+	}
+	if (rec)
+		tbook_node_read(node, &rec, rec + h->nodes);
+	free(data);
+	return (rec != NULL);
 }
 
+/* Merge subtree tbooks @files into tbook for board @b (created from
+ * the first root tbook given if it doesn't exist yet). */
+bool
+tree_merge_tbooks(board_t *b, char **files, int nfiles)
+{
+	char *filename = tree_book_name(b);
+	tbook_header_t h;
+	tbook_node_t root;
+	bool have_root = false;
+	FILE *f = fopen(filename, "rb");
+	if (f) {
+		fclose(f);
+		if (!tbook_read(filename, b, &root, &h))
+			return false;
+		if (h.path_len) {
+			fprintf(stderr, "%s: subtree tbook, can't merge into it.\n", filename);
+			tbook_node_free(&root);
+			return false;
+		}
+		have_root = true;
+	}
+
+	int merged = 0;
+	for (int i = 0; i < nfiles; i++) {
+		tbook_node_t sub;
+		if (!tbook_read(files[i], b, &sub, &h))
+			continue;
+		if (!h.path_len) {
+			if (have_root)  tbook_node_merge(&root, &sub);
+			else            root = sub;
+			have_root = true;
+			merged++;
+			continue;
+		}
+		if (!have_root) {
+			fprintf(stderr, "%s: no root tbook to merge into, skipping.\n", files[i]);
+			tbook_node_free(&sub);
+			continue;
+		}
+
+		/* Path must be in the tree already but the last move,
+		 * a node with just one child would restrict search. */
+		tbook_node_t *ancestors[TBOOK_MAX_PATH];
+		tbook_node_t *node = &root;
+		unsigned int d;
+		for (d = 0; node && d < h.path_len - 1; d++) {
+			ancestors[d] = node;
+			node = tbook_node_child(node, h.path[d]);
+		}
+		ancestors[d] = node;
+		if (!node) {
+			fprintf(stderr, "%s: position not in tbook, skipping.\n", files[i]);
+			tbook_node_free(&sub);
+			continue;
+		}
+
+		for (d = 0; d < h.path_len; d++)
+			stats_merge(&ancestors[d]->r.u, &sub.r.u);
+		sub.r.coord = h.path[h.path_len - 1];
+		tbook_node_shift_depth(&sub, h.path_len - sub.r.depth);
+		tbook_node_t *dest = tbook_node_child(node, sub.r.coord);
+		if (dest)
+			tbook_node_merge(dest, &sub);
+		else {
+			node->children = crealloc(node->children, (node->nchildren + 1) * sizeof(tbook_node_t));
+			node->children[node->nchildren++] = sub;
+		}
+		merged++;
+	}
+	if (!merged) {
+		if (have_root)  tbook_node_free(&root);
+		return false;
+	}
+
+	if (!strcmp(tbook.filename, filename))
+		tbook_unmap();
+	f = fopen(filename, "wb");
+	if (!f) {
+		perror(filename);
+		tbook_node_free(&root);
+		return false;
+	}
+	tbook_header_init(&h, b, NULL, 0);
+	fwrite(&h, sizeof(h), 1, f);
+	tbook_node_write(f, &root, &h.nodes);
+	rewind(f);
+	fwrite(&h, sizeof(h), 1, f);
+	fclose(f);
+	tbook_node_free(&root);
+
+	fprintf(stderr, "Merged %d tbooks into %s (%d nodes).\n", merged, filename, (int)h.nodes);
+	return true;
+}
 
 /************************************************************************/
-/* Tree garbage collection */
+/* Tree snapshots */
+
+/* Unlike the tbook, a snapshot is a raw dump of the nodes buffer: it can be
+ * restored with two bulk reads instead of rebuilding the tree node by node.
+ * Node layout is build specific, snapshots are only meant to be loaded
+ * by the same binary (restarting pachi in the middle of a game). */
+
+#define SNAPSHOT_MAGIC		"PACHITRE"
+#define SNAPSHOT_VERSION	2
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t node_size;	/* sizeof(tree_node_t) */
+	uint32_t cold_size;	/* sizeof(tree_node_cold_t) */
+	int32_t root_color;
+	uint64_t nodes;		/* number of node slots in the dump */
+	uint64_t root;		/* index of root node */
+	uint64_t base;		/* nodes buffer address, for relocation */
+	int32_t use_extra_komi;
+	int32_t untrustworthy_tree;
+	int32_t max_depth;
+	int32_t reserved;
+	double extra_komi;
+	move_stats_t avg_score;
+} tree_snapshot_header_t;
+
+bool
+tree_save_snapshot(tree_t *t, FILE *f)
+{
+	size_t size = (t->nodes_size < t->max_tree_size ? t->nodes_size : t->max_tree_size);
+
+	tree_snapshot_header_t h;  memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+	h.version = SNAPSHOT_VERSION;
+	h.node_size = sizeof(tree_node_t);
+	h.cold_size = sizeof(tree_node_cold_t);
+	h.root_color = t->root_color;
+	h.nodes = size / TREE_NODE_SIZE;
+	h.root = t->root - (tree_node_t *)t->nodes;
+	h.base = (uintptr_t)t->nodes;
+	h.use_extra_komi = t->use_extra_komi;
+	h.untrustworthy_tree = t->untrustworthy_tree;
+	h.max_depth = t->max_depth;
+	h.extra_komi = t->extra_komi;
+	h.avg_score = t->avg_score;
+
+	/* Includes unused parts of thread slabs, harmless. */
+	return (fwrite(&h, sizeof(h), 1, f) == 1 &&
+		fwrite(t->nodes, sizeof(tree_node_t), h.nodes, f) == h.nodes &&
+		fwrite(t->cold, sizeof(tree_node_cold_t), h.nodes, f) == h.nodes);
+}
 
-static tree_node_t*
-tree_prune_dup_node(tree_t *dest, tree_t *src, tree_node_t *node,
-		    int threshold, int depth)
+/* Fix node links after loading a snapshot saved at a different address.
+ * Nothing to do with TREE_COMPACT_INDEX, links are relative. */
+static void
+tree_relocate_node(tree_node_t *node, uintptr_t old_base, tree_node_t *base)
+{
+#ifndef TREE_COMPACT_INDEX
+	if (node->parent)    node->parent   = base + ((uintptr_t)node->parent   - old_base) / sizeof(tree_node_t);
+	if (node->children)  node->children = base + ((uintptr_t)node->children - old_base) / sizeof(tree_node_t);
+#endif
+	foreach_child(node, ni)
+		tree_relocate_node(ni, old_base, base);
+}
+
+/* Restore tree saved with tree_save_snapshot().
+ * Tree gets at least @max_tree_size bytes, more if snapshot doesn't fit.
+ * Returns NULL if snapshot is invalid or out of memory. */
+tree_t *
+tree_load_snapshot(FILE *f, size_t max_tree_size, size_t reserve_size, int hbits)
 {
-	tree_node_t *n2 = tree_alloc_node(dest, 1);
-	if (!n2)
+	tree_snapshot_header_t h;
+	if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) ||
+	    h.version != SNAPSHOT_VERSION || h.node_size != sizeof(tree_node_t) ||
+	    h.cold_size != sizeof(tree_node_cold_t) || h.root >= h.nodes) {
+		if (DEBUGL(1))  fprintf(stderr, "Bad tree snapshot (wrong version or corrupt ?)\n");
+		return NULL;
+	}
+
+	/* Leave some room for search. */
+	size_t size = h.nodes * TREE_NODE_SIZE;
+	if (max_tree_size < size + size / 2)
+		max_tree_size = size + size / 2;
+	tree_t *t = tree_init_growable(stone_other(h.root_color), max_tree_size, reserve_size, hbits);
+	if (!t)  return NULL;
+	if (size > t->max_tree_size)  {  tree_done(t);  return NULL;  }
+
+	tree_clear_nodes(t);
+	if (fread(t->nodes, sizeof(tree_node_t), h.nodes, f) != h.nodes ||
+	    fread(t->cold, sizeof(tree_node_cold_t), h.nodes, f) != h.nodes) {
+		if (DEBUGL(1))  fprintf(stderr, "Truncated tree snapshot\n");
+		tree_done(t);
 		return NULL;
+	}
+	t->nodes_size = size;
+
+	t->root = (tree_node_t *)t->nodes + h.root;
+	t->root_color = h.root_color;
+	t->use_extra_komi = h.use_extra_komi;
+	t->untrustworthy_tree = h.untrustworthy_tree;
+	t->max_depth = h.max_depth;
+	t->extra_komi = h.extra_komi;
+	t->avg_score = h.avg_score;
+	tree_relocate_node(t->root, h.base, t->nodes);
+	return t;
+}
+
+
+/************************************************************************/
+/* Tree garbage collection */
+
+/* Copy src node into dest node n2 (children not copied). */
+static void
+tree_dup_node(tree_t *dest, tree_t *src, tree_node_t *n2, tree_node_t *node)
+{
 	*n2 = *node;
-	if (n2->depth > dest->max_depth)
-		dest->max_depth = n2->depth;
-	n2->children = NULL;
+	*tree_node_cold(dest, n2) = *tree_node_cold(src, node);
+	if (tree_node_depth(dest, n2) > dest->max_depth)
+		dest->max_depth = tree_node_depth(dest, n2);
+	node_set_parent(n2, NULL);
+	node_set_children(n2, NULL);
+	n2->nchildren = 0;
 	n2->is_expanded = false;
-	return n2;
+	n2->hints &= ~(TREE_HINT_PENDING | TREE_HINT_WIDENING);
+	tree_node_cold(dest, n2)->npending = 0;
+}
+
+/* Pending moves of expanded node: room to keep in its children block. */
+static int
+node_npending(tree_t *t, tree_node_t *node)
+{
+	return ((node->hints & TREE_HINT_PENDING) ? tree_node_cold(t, node)->npending : 0);
+}
+
+/* Copy pending moves of expanded src node into dest node n2.
+ * Returns false if dest is full, n2 then keeps its children only. */
+static bool
+tree_copy_pending(tree_t *dest, tree_t *src, tree_node_t *n2, tree_node_t *node)
+{
+	if (!(node->hints & TREE_HINT_PENDING))
+		return true;
+
+	tree_node_cold_t *cold = tree_node_cold(src, node);
+	int64_t slot = tree_alloc_pending(dest, cold->npending);
+	if (slot < 0)  return false;
+	for (int i = 0; i < cold->npending; i++)
+		*tree_pending(dest, slot, i) = *tree_pending(src, cold->pending, i);
+
+	tree_node_cold_t *cold2 = tree_node_cold(dest, n2);
+	cold2->pending = slot;
+	cold2->npending = cold->npending;
+	n2->hints |= TREE_HINT_PENDING;
+	return true;
 }
 
 /* breadth-first tree pruning queue */
@@ -342,28 +1385,123 @@ pruning_queue_push(pruning_queue_t *q, tree_node_t *src, tree_node_t *dst)
 }
 
 static void
-pruning_queue_pop(pruning_queue_t *q)
+pruning_queue_append(pruning_queue_t *q, pruning_queue_t *q2)
 {
-	assert(q->n);
-	q->n--;
+	for (unsigned int i = 0; i < q2->n; i++)
+		pruning_queue_push(q, q2->src_nodes[i], q2->dst_nodes[i]);
+}
+
+/* Tree gc threads: levels or subtrees with fewer nodes than this
+ * are processed by the calling thread only. */
+#define GC_PARALLEL_MIN_NODES 4096
+
+/* Helper threads working level by level along with the calling thread
+ * (thread 0): Each level starts when thread 0 bumps level and is done
+ * when all helpers are idle again. */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int level;
+	int busy;
+	int threads;
+	void (*work)(void *data, int id);
+	void *data;
+} gc_threads_t;
+
+typedef struct {
+	gc_threads_t *g;
+	int id;
+	pthread_t thread;
+} gc_helper_t;
+
+static void *
+gc_helper_thread(void *arg)
+{
+	gc_helper_t *h = arg;
+	gc_threads_t *g = h->g;
+	int level = 0;
+	while (true) {
+		pthread_mutex_lock(&g->lock);
+		while (g->level == level)
+			pthread_cond_wait(&g->cond, &g->lock);
+		level = g->level;
+		pthread_mutex_unlock(&g->lock);
+		if (level < 0)  break;
+
+		g->work(g->data, h->id);
+
+		pthread_mutex_lock(&g->lock);
+		if (!--g->busy)  pthread_cond_broadcast(&g->cond);
+		pthread_mutex_unlock(&g->lock);
+	}
+	return NULL;
+}
+
+static void
+gc_threads_start(gc_threads_t *g, gc_helper_t *helpers, int threads, void (*work)(void *data, int id), void *data)
+{
+	pthread_mutex_init(&g->lock, NULL);
+	pthread_cond_init(&g->cond, NULL);
+	g->level = g->busy = 0;
+	g->threads = threads;
+	g->work = work;
+	g->data = data;
+	for (int i = 1; i < threads; i++) {
+		helpers[i].g = g;
+		helpers[i].id = i;
+		pthread_create(&helpers[i].thread, NULL, gc_helper_thread, &helpers[i]);
+	}
+}
+
+/* Run next level on all threads, returns when all are done. */
+static void
+gc_threads_run(gc_threads_t *g)
+{
+	if (g->threads > 1) {
+		pthread_mutex_lock(&g->lock);
+		g->busy = g->threads - 1;
+		g->level++;
+		pthread_cond_broadcast(&g->cond);
+		pthread_mutex_unlock(&g->lock);
+	}
+
+	g->work(g->data, 0);
+
+	if (g->threads > 1) {
+		pthread_mutex_lock(&g->lock);
+		while (g->busy)
+			pthread_cond_wait(&g->cond, &g->lock);
+		pthread_mutex_unlock(&g->lock);
+	}
+}
+
+static void
+gc_threads_stop(gc_threads_t *g, gc_helper_t *helpers)
+{
+	pthread_mutex_lock(&g->lock);
+	g->level = -1;
+	pthread_cond_broadcast(&g->cond);
+	pthread_mutex_unlock(&g->lock);
+	for (int i = 1; i < g->threads; i++)
+		pthread_join(helpers[i].thread, NULL);
+	pthread_cond_destroy(&g->cond);
+	pthread_mutex_destroy(&g->lock);
 }
 
 /* Prune children of given node.
  * Queue them since we're going breadth-first. */
 static void
 tree_prune_node(tree_t *dest, tree_t *src,
-		pruning_queue_t *queue, unsigned int node_index,
+		tree_node_t *node, tree_node_t *n2, pruning_queue_t *next,
 		int threshold, int depth)
 {
-	tree_node_t *node = queue->src_nodes[node_index];
-	tree_node_t *n2	  = queue->dst_nodes[node_index];
 	assert(n2);
 	assert(node);
 
-	if (node->depth >= depth && node->u.playouts < threshold)
+	if (tree_node_depth(src, node) >= depth && node->u.playouts < threshold)
 		return;
 	
-	if (!node->children)
+	if (!node_children(node))
 		return;
 
 	/* Prune children:
@@ -373,25 +1511,45 @@ tree_prune_node(tree_t *dest, tree_t *src,
 	 * would degrade the playing strength. The only exception is
 	 * when dest becomes full, but this should never happen in practice
 	 * if threshold is chosen to limit the number of nodes traversed. */
-	int added = 0;	
-	tree_node_t **prev2 = &(n2->children);
-	tree_node_t *ni;
-	for (ni = node->children;  ni;  ni = ni->sibling, added++) {
-		tree_node_t *ni2 = tree_prune_dup_node(dest, src, ni, threshold, depth);
-		if (!ni2)  break;
-		*prev2 = ni2;
-		prev2 = &(ni2->sibling);
-		ni2->parent = n2;
-		
-		pruning_queue_push(queue, ni, ni2);
-	}
-	
-	if (!ni)
-		n2->is_expanded = true;
-	else {
-		n2->children = NULL;  // avoid partially expanded nodes
-		for (int i = 0; i < added; i++)  pruning_queue_pop(queue);
+	tree_node_t *ni2 = tree_alloc_node(dest, node->nchildren + node_npending(src, node));
+	if (!ni2)  return;  // dest full, leave node unexpanded
+
+	node_set_children(n2, ni2);
+	n2->nchildren = node->nchildren;
+	n2->is_expanded = true;
+
+	foreach_child(node, ni) {
+		tree_dup_node(dest, src, ni2, ni);
+		node_set_parent(ni2, n2);
+		pruning_queue_push(next, ni, ni2++);
 	}
+	tree_copy_pending(dest, src, n2, node);
+}
+
+typedef struct {
+	tree_t *dest, *src;
+	int threshold, depth;
+	int threads;
+	pruning_queue_t queue;	/* Current level */
+	pruning_queue_t *next;	/* Next level, one queue per thread */
+} tree_prune_t;
+
+/* Prune thread @id's share of current level. */
+static void
+tree_prune_level(void *data, int id)
+{
+	tree_prune_t *p = data;
+	unsigned int n = p->queue.n;
+	unsigned int start = 0, end = n;
+	if (n >= GC_PARALLEL_MIN_NODES) {
+		start = (unsigned long)n * id / p->threads;
+		end = (unsigned long)n * (id + 1) / p->threads;
+	} else if (id)
+		return;
+
+	for (unsigned int i = start; i < end; i++)
+		tree_prune_node(p->dest, p->src, p->queue.src_nodes[i], p->queue.dst_nodes[i],
+				&p->next[id], p->threshold, p->depth);
 }
 
 /* Prune src tree into dest (nodes are copied).
@@ -399,9 +1557,10 @@ tree_prune_node(tree_t *dest, tree_t *src,
  * The relative order of children of a given node is preserved
  * (assumed by tree_get_node() in particular).
  * Process nodes breadth-first so that we don't drop toplevel nodes !
+ * Large levels are split among @threads threads.
  * Note: Only for fast_alloc. */
 static void
-tree_prune(tree_t *dest, tree_t *src, int threshold, int depth)
+tree_prune(tree_t *dest, tree_t *src, int threshold, int depth, int threads)
 {
 	tree_node_t *node = src->root;
 	assert(dest->nodes && node);
@@ -411,29 +1570,40 @@ tree_prune(tree_t *dest, tree_t *src, int threshold, int depth)
 	dest->extra_komi = src->extra_komi;
 	dest->avg_score = src->avg_score;
 	/* DISTRIBUTED htable not copied, gets rebuilt as needed */
-	dest->nodes_size = 0;	/* we do not want the dummy pass node */
+	tree_clear_nodes(dest);	/* we do not want the dummy pass node */
 	dest->max_depth = 0;	/* gets recomputed */
  	dest->root_color = src->root_color;
-	dest->root = tree_prune_dup_node(dest, src, node, threshold, depth);
+	dest->root = tree_alloc_node(dest, 1);
 	assert(dest->root);
-
-	unsigned int pruning_queue_len = 32768;
-	pruning_queue_t queue;   pruning_queue_init(&queue, pruning_queue_len);
-	pruning_queue_t queue2;  pruning_queue_init(&queue2, pruning_queue_len);
-	pruning_queue_push(&queue, node, dest->root);
-
-	//int cur_depth = 1;
-	while(queue.n) {
-		// if (DEBUGL(1)) fprintf(stderr, "processing depth %i\n", cur_depth++);
-		for (unsigned int i = 0; i < queue.n; i++)
-			tree_prune_node(dest, src, &queue, i, threshold, depth);
-		
-		swap(queue, queue2);
-		queue2.n = 0;
+	tree_dup_node(dest, src, dest->root, node);
+
+	tree_prune_t p = { dest, src, threshold, depth, threads };
+	p.next = calloc2(threads, pruning_queue_t);
+	pruning_queue_init(&p.queue, 32768);
+	for (int i = 0; i < threads; i++)
+		pruning_queue_init(&p.next[i], 32768 / threads);
+	pruning_queue_push(&p.queue, node, dest->root);
+
+	/* Levels are processed in turn, children of a level go in the
+	 * next level in thread order, most of it parallel for big trees. */
+	gc_threads_t g;
+	gc_helper_t helpers[threads];
+	gc_threads_start(&g, helpers, threads, tree_prune_level, &p);
+	while (p.queue.n) {
+		gc_threads_run(&g);
+
+		p.queue.n = 0;
+		for (int i = 0; i < threads; i++) {
+			pruning_queue_append(&p.queue, &p.next[i]);
+			p.next[i].n = 0;
+		}
 	}
+	gc_threads_stop(&g, helpers);
 
-	pruning_queue_free(&queue);
-	pruning_queue_free(&queue2);
+	pruning_queue_free(&p.queue);
+	for (int i = 0; i < threads; i++)
+		pruning_queue_free(&p.next[i]);
+	free(p.next);
 }
 
 static void
@@ -455,7 +1625,7 @@ log_temp_tree_overflow(tree_t *t, tree_t *t2, int threshold, int max_depth)
 #if 0
 	else {  /* Debugging only, super expensive if tree is huge */
 		tree_t *t3 = tree_init(t->root_color, t->max_tree_size, 0);
-		tree_prune(t3, t, threshold, max_depth);
+		tree_prune(t3, t, threshold, max_depth, 1);
 		
 		float orig = tree_actual_size(t3);
 		float pruned = t2->max_tree_size;
@@ -468,6 +1638,72 @@ log_temp_tree_overflow(tree_t *t, tree_t *t2, int threshold, int max_depth)
 	fprintf(stderr, "\n");
 }
 
+static void tree_copy_threads(tree_t *dst, tree_t *src, int threads);
+
+/* Account for tree gc / recycle that took @elapsed seconds. */
+static void
+tree_gc_stats(tree_t *t, double elapsed, size_t orig_size)
+{
+	t->gc_time += elapsed;
+	if (orig_size > t->nodes_size)
+		t->gc_freed += orig_size - t->nodes_size;
+	metric_add(METRIC_TREE_GC, 1);
+	metric_add(METRIC_TREE_GC_SECONDS, elapsed);
+	metric_max(METRIC_TREE_GC_SECONDS_MAX, elapsed);
+}
+
+/* Tree recycling: memory taken by children of expanded nodes,
+ * by playouts bucket (bucket k: playouts in [2^(k-1), 2^k) ). */
+#define RECYCLE_BUCKETS 32
+
+static void
+tree_recycle_scan(tree_t *t, tree_node_t *node, int depth, size_t *hist)
+{
+	if (!node_children(node))  return;
+	if (tree_node_depth(t, node) >= depth) {
+		int k = 0;
+		for (unsigned int p = node->u.playouts; p; p >>= 1)  k++;
+		hist[k] += (node->nchildren + node_npending(t, node)) * TREE_NODE_SIZE;
+	}
+	foreach_child(node, ni)
+		tree_recycle_scan(t, ni, depth, hist);
+}
+
+/* Bounded memory: make room in full tree by dropping least valuable subtrees.
+ * Children of nodes with few playouts get dropped (deep nodes mostly),
+ * threshold is the smallest power of 2 for which the rest fits in @tmp.
+ * Root children are always kept. Search must be stopped.
+ * Returns playouts threshold used.
+ * Note: Only for fast_alloc. */
+int
+tree_recycle(tree_t *t, tree_t *tmp)
+{
+	double time_start = time_now();
+	size_t orig_size = t->nodes_size;
+	int depth = tree_node_depth(t, t->root) + 1;
+
+	size_t hist[RECYCLE_BUCKETS] = { 0, };
+	tree_recycle_scan(t, t->root, depth, hist);
+
+	/* Leave some room for root children and partially used slabs. */
+	size_t target = tmp->max_tree_size - tmp->max_tree_size / 8;
+	size_t kept = 0;
+	int k = RECYCLE_BUCKETS;
+	while (k > 0 && kept + hist[k - 1] <= target)
+		kept += hist[--k];
+	int threshold = (k == RECYCLE_BUCKETS ? INT_MAX : (k ? 1 << (k - 1) : 0));
+
+	int threads = (t->gc_threads > 1 ? t->gc_threads : 1);
+	tree_prune(tmp, t, threshold, depth, threads);
+	tree_copy_threads(t, tmp, threads);
+	tree_gc_stats(t, time_now() - time_start, orig_size);
+
+	if (DEBUGL(2))  fprintf(stderr, "tree recycle in %0.1fs (%0.1f -> %0.1f Mb, threshold %i)\n",
+				time_now() - time_start, (float)orig_size / (1024*1024),
+				(float)t->nodes_size / (1024*1024), threshold);
+	return threshold;
+}
+
 /* The following constants are used for garbage collection of nodes.
  * A tree is considered large if the top node has >= 40K playouts.
  * For such trees, we copy deep nodes only if they have enough
@@ -496,12 +1732,13 @@ log_temp_tree_overflow(tree_t *t, tree_t *t2, int threshold, int max_depth)
  * - prune tree down to max 20% capacity      (>300Mb)
  * - keep only nodes with enough playouts.    (>40k playouts)
  * See also LARGE_TREE_PLAYOUTS, DEEP_PLAYOUTS_THRESHOLD above, tree_max_pruned_size()
- * Expensive, especially for huge trees, needs to copy the whole tree twice. */
+ * Expensive, especially for huge trees, needs to copy the whole tree twice.
+ * Both copies use t->gc_threads threads. */
 void
 tree_garbage_collect(tree_t *t)
 {
 	tree_node_t *node = t->root;
-	assert(t->nodes && !node->parent && !node->sibling);
+	assert(t->nodes && !node_parent(node));
 	double time_start = time_now();
 	size_t orig_size = t->nodes_size;
 	size_t orig_content_size = (DEBUGL(3) ? tree_actual_size(t) : 0);
@@ -514,11 +1751,9 @@ tree_garbage_collect(tree_t *t)
 	tree_t *t2 = tree_init(t->root_color, max_pruned_size, 0);
 
 	/* Find the maximum depth at which we can copy all nodes. */
-	int max_nodes = 1;
-	for (tree_node_t *ni = node->children; ni; ni = ni->sibling)
-		max_nodes++;
-	size_t nodes_size = max_nodes * sizeof(*node);
-	int max_depth = node->depth;
+	int max_nodes = 1 + (node_children(node) ? node->nchildren : 0);
+	size_t nodes_size = max_nodes * TREE_NODE_SIZE;
+	int max_depth = tree_node_depth(t, node);
 	for (;  nodes_size < max_pruned_size && max_nodes > 1;  max_depth++) {
 		max_nodes--;
 		nodes_size += max_nodes * nodes_size;
@@ -534,7 +1769,8 @@ tree_garbage_collect(tree_t *t)
 	int threshold = (node->u.playouts - LARGE_TREE_PLAYOUTS) * DEEP_PLAYOUTS_THRESHOLD / LARGE_TREE_PLAYOUTS;
 	if (threshold < 0) threshold = 0;
 	if (threshold > DEEP_PLAYOUTS_THRESHOLD) threshold = DEEP_PLAYOUTS_THRESHOLD;
-	tree_prune(t2, t, threshold, max_depth);
+	int threads = (t->gc_threads > 1 ? t->gc_threads : 1);
+	tree_prune(t2, t, threshold, max_depth, threads);
 
 	/* Temp tree overflow ?
 	 * This is not a serious problem, we will simply recompute the discarded nodes
@@ -543,7 +1779,8 @@ tree_garbage_collect(tree_t *t)
 		log_temp_tree_overflow(t, t2, threshold, max_depth);
 	
 	/* Now copy back to original tree. */
-	tree_copy(t, t2);
+	tree_copy_threads(t, t2, threads);
+	tree_gc_stats(t, time_now() - time_start, orig_size);
 
 	if (DEBUGL(1)) {
 		fprintf(stderr, "tree gc in %0.1fs ", time_now() - time_start);
@@ -556,7 +1793,7 @@ tree_garbage_collect(tree_t *t)
 				(float)orig_content_size / (1024*1024),
 				(float)t->nodes_size / (1024*1024));
 			fprintf(stderr, "pruned %lu nodes (%i%%), dest depth %d, wanted %d",
-				(unsigned long)((orig_size - t->nodes_size) / sizeof(tree_node_t)),
+				(unsigned long)((orig_size - t->nodes_size) / TREE_NODE_SIZE),
 				(int)((orig_size - t->nodes_size) * 100 / orig_size),
 				t2->max_depth, max_depth);
 		}
@@ -570,38 +1807,171 @@ tree_garbage_collect(tree_t *t)
 /*********************************************************************************/
 /* Tree copy */
 
-/* Copy subtree rooted at node in src to dest.
- * Same logic as tree_prune_node() but simpler since we can go
- * depth-first and both trees are same size.
- * Returns the copy of node in the destination tree. */
 static tree_node_t *
-tree_copy_node(tree_t *dest, tree_t *src, tree_node_t *node)
+tree_copy_alloc(tree_t *dest, int count)
 {
-	assert(dest->nodes && node);
-	tree_node_t *n2 = tree_alloc_node(dest, 1);
-	if (!n2)  die("tree_copy(): tree_alloc_node() failed. dest tree too small ?\n");
-	*n2 = *node;
-	n2->children = NULL;
-	n2->is_expanded = false;
+	tree_node_t *n = tree_alloc_node(dest, count);
+	if (!n)  die("tree_copy(): tree_alloc_node() failed. dest tree too small ?\n");
+	return n;
+}
 
-	if (!node->children)
-		return n2;
+/* Copy subtree rooted at node in src to dest node n2 (node itself
+ * already copied). Same logic as tree_prune_node() but simpler since
+ * we can go depth-first and both trees are same size. */
+static void
+tree_copy_children(tree_t *dest, tree_t *src, tree_node_t *n2, tree_node_t *node)
+{
+	assert(dest->nodes && node);
+	if (!node_children(node))
+		return;
 
 	/* Copy children */
-	tree_node_t **prev2 = &(n2->children);
-	tree_node_t *ni;
-	for (ni = node->children;  ni;  ni = ni->sibling) {
-		tree_node_t *ni2 = tree_copy_node(dest, src, ni);
-		assert(ni2);
-		*prev2 = ni2;
-		prev2 = &(ni2->sibling);
-		ni2->parent = n2;
+	tree_node_t *ni2 = tree_copy_alloc(dest, node->nchildren + node_npending(src, node));
+	node_set_children(n2, ni2);
+	n2->nchildren = node->nchildren;
+	n2->is_expanded = true;
+
+	foreach_child(node, ni) {
+		tree_dup_node(dest, src, ni2, ni);
+		node_set_parent(ni2, n2);
+		tree_copy_children(dest, src, ni2, ni);
+		ni2++;
 	}
-	
-	if (!ni)  n2->is_expanded = true;
-	else      n2->children = NULL;     // avoid partially expanded nodes
-	
-	return n2;
+	if (!tree_copy_pending(dest, src, n2, node))
+		die("tree_copy(): tree_alloc_node() failed. dest tree too small ?\n");
+}
+
+/* Node slots needed to copy subtree below @node (node itself excluded). */
+static size_t
+tree_copy_size(tree_t *src, tree_node_t *node)
+{
+	if (!node_children(node))
+		return 0;
+	size_t size = node->nchildren + pending_slots(node_npending(src, node));
+	foreach_child(node, ni)
+		size += tree_copy_size(src, ni);
+	return size;
+}
+
+/* Same as tree_copy_children() but children blocks are taken from
+ * range reserved for this subtree (@next: next free slot). */
+static void
+tree_copy_children_range(tree_t *dest, tree_t *src, tree_node_t *n2, tree_node_t *node, tree_node_t **next)
+{
+	if (!node_children(node))
+		return;
+
+	tree_node_t *ni2 = *next;
+	*next += node->nchildren;
+	node_set_children(n2, ni2);
+	n2->nchildren = node->nchildren;
+	n2->is_expanded = true;
+
+	foreach_child(node, ni) {
+		tree_dup_node(dest, src, ni2, ni);
+		node_set_parent(ni2, n2);
+		tree_copy_children_range(dest, src, ni2, ni, next);
+		ni2++;
+	}
+
+	if (node->hints & TREE_HINT_PENDING) {
+		tree_node_cold_t *cold = tree_node_cold(src, node);
+		tree_node_cold_t *cold2 = tree_node_cold(dest, n2);
+		cold2->pending = *next - (tree_node_t *)dest->nodes;
+		cold2->npending = cold->npending;
+		*next += pending_slots(cold->npending);
+		for (int i = 0; i < cold->npending; i++)
+			*tree_pending(dest, cold2->pending, i) = *tree_pending(src, cold->pending, i);
+		n2->hints |= TREE_HINT_PENDING;
+	}
+}
+
+typedef struct {
+	tree_t *dest, *src;
+	pruning_queue_t queue;	/* Subtrees left to copy */
+	size_t *start;		/* Subtree i gets dest slots [start[i], start[i+1]) */
+	bool sized;		/* Sizes known, copying */
+	volatile unsigned int next;
+} tree_copy_t;
+
+/* Size subtrees, then copy them into their ranges, one pass each. */
+static void
+tree_copy_subtrees(void *data, int id)
+{
+	tree_copy_t *c = data;
+	for (unsigned int i; (i = __sync_fetch_and_add(&c->next, 1)) < c->queue.n; ) {
+		if (!c->sized) {
+			c->start[i + 1] = tree_copy_size(c->src, c->queue.src_nodes[i]);
+			continue;
+		}
+		tree_node_t *next = (tree_node_t *)c->dest->nodes + c->start[i];
+		tree_copy_children_range(c->dest, c->src, c->queue.dst_nodes[i], c->queue.src_nodes[i], &next);
+		assert(next == (tree_node_t *)c->dest->nodes + c->start[i + 1]);
+	}
+}
+
+/* Copy the whole tree (all reachable nodes) using @threads threads.
+ * Top of the tree is split breadth-first until there are enough subtrees
+ * to keep all threads busy. These are sized first, so that each one gets
+ * its own range in dst, and then copied in parallel: dst ends up as
+ * compact as with a single thread. */
+static void
+tree_copy_threads(tree_t *dst, tree_t *src, int threads)
+{
+	dst->use_extra_komi = src->use_extra_komi;
+	dst->untrustworthy_tree = src->untrustworthy_tree;
+	dst->extra_komi = src->extra_komi;
+	dst->avg_score = src->avg_score;
+	/* DISTRIBUTED htable not copied, gets rebuilt as needed */
+	tree_clear_nodes(dst);		  /* we do not want the dummy pass node */
+	dst->max_depth = src->max_depth;  /* same depths */
+	dst->root_color = src->root_color;
+	dst->root = tree_copy_alloc(dst, 1);
+	tree_dup_node(dst, src, dst->root, src->root);
+
+	if (threads <= 1 || src->nodes_size / TREE_NODE_SIZE < GC_PARALLEL_MIN_NODES) {
+		tree_copy_children(dst, src, dst->root, src->root);
+		return;
+	}
+
+	tree_copy_t c = { dst, src };
+	pruning_queue_t next;
+	pruning_queue_init(&c.queue, 1024);
+	pruning_queue_init(&next, 1024);
+	pruning_queue_push(&c.queue, src->root, dst->root);
+	while (c.queue.n && c.queue.n < (unsigned int)threads * 64) {
+		for (unsigned int i = 0; i < c.queue.n; i++)
+			tree_prune_node(dst, src, c.queue.src_nodes[i], c.queue.dst_nodes[i], &next, 0, 0);
+		swap(c.queue, next);
+		next.n = 0;
+	}
+
+	gc_threads_t g;
+	gc_helper_t helpers[threads];
+	gc_threads_start(&g, helpers, threads, tree_copy_subtrees, &c);
+
+	c.start = cmalloc((c.queue.n + 1) * sizeof(size_t));
+	gc_threads_run(&g);
+
+	/* Reserve everything at once, past the slab used for the top. */
+	size_t total = 0;
+	for (unsigned int i = 0; i < c.queue.n; i++)
+		total += c.start[i + 1];
+	size_t offset = __sync_fetch_and_add(&dst->nodes_size, total * TREE_NODE_SIZE);
+	if (offset + total * TREE_NODE_SIZE > dst->max_tree_size)
+		die("tree_copy(): dest tree too small\n");
+	c.start[0] = offset / TREE_NODE_SIZE;
+	for (unsigned int i = 0; i < c.queue.n; i++)
+		c.start[i + 1] += c.start[i];
+
+	c.sized = true;
+	c.next = 0;
+	gc_threads_run(&g);
+	gc_threads_stop(&g, helpers);
+
+	free(c.start);
+	pruning_queue_free(&c.queue);
+	pruning_queue_free(&next);
 }
 
 /* Copy the whole tree (all reachable nodes)
@@ -613,18 +1983,66 @@ tree_copy_node(tree_t *dest, tree_t *src, tree_node_t *node)
 void
 tree_copy(tree_t *dst, tree_t *src)
 {
-	dst->use_extra_komi = src->use_extra_komi;
-	dst->untrustworthy_tree = src->untrustworthy_tree;
-	dst->extra_komi = src->extra_komi;
-	dst->avg_score = src->avg_score;
-	/* DISTRIBUTED htable not copied, gets rebuilt as needed */
-	dst->nodes_size = 0;		  /* we do not want the dummy pass node */
-	dst->max_depth = src->max_depth;  /* same depths */
-	dst->root_color = src->root_color;
-	dst->root = tree_copy_node(dst, src, src->root);
-	assert(dst->root);
+	tree_copy_threads(dst, src, (src->gc_threads > 1 ? src->gc_threads : 1));
+}
+
+
+/************************************************************************/
+/* Tree merge (root parallelization) */
+
+/* New playouts of src node @n since last merge (value sum in @value).
+ * cold->pu keeps track of stats already merged. */
+static int
+tree_merge_delta(tree_t *src, tree_node_t *n, floating_t *value)
+{
+	tree_node_cold_t *cold = tree_node_cold(src, n);
+	move_stats_t cur = n->u;
+	*value = cur.value * cur.playouts - cold->pu.value * cold->pu.playouts;
+	return cur.playouts - cold->pu.playouts;
 }
 
+/* Add playouts @n got since last merge to @dest. */
+static void
+tree_merge_node(tree_t *dest, tree_t *src, tree_node_t *dn, tree_node_t *n, int depth, int max_depth)
+{
+	floating_t value;
+	int playouts = tree_merge_delta(src, n, &value);
+	if (playouts <= 0)
+		return;
+
+	/* Playouts of children missing in dest are left out (and kept
+	 * for next merge) so that dest parent and children counts agree. */
+	if (depth < max_depth && node_children(dn))
+		foreach_child(n, ni) {
+			tree_node_t *dni = tree_get_node(dn, node_coord(ni));
+			if (dni) {
+				tree_merge_node(dest, src, dni, ni, depth + 1, max_depth);
+				continue;
+			}
+			floating_t v;
+			int p = tree_merge_delta(src, ni, &v);
+			if (p <= 0)  continue;
+			if (p > playouts) {  v = v * playouts / p;  p = playouts;  }  /* Search going on in src */
+			playouts -= p;  value -= v;
+		}
+	if (playouts <= 0)
+		return;
+
+	stats_add_result(&dn->u, value / playouts, playouts);
+	stats_add_result(&tree_node_cold(src, n)->pu, value / playouts, playouts);
+	if (depth == 1)  tree_topk_update(dest, dn);
+}
+
+/* Merge stats of @src top @max_depth levels into @dest (new playouts since
+ * last merge only). Nodes missing in @dest are skipped.
+ * Can run while search is going on in both trees, but only one thread
+ * may merge a given @src at a time. */
+void
+tree_merge(tree_t *dest, tree_t *src, int max_depth)
+{
+	assert(node_coord(dest->root) == node_coord(src->root));
+	tree_merge_node(dest, src, dest->root, src->root, 0, max_depth);
+}
 
 /* Realloc internal tree memory so it can accomodate bigger search tree
  * Expensive: needs to allocate a new tree and copy it over.
@@ -650,6 +2068,17 @@ tree_realloc(tree_t *t, size_t max_tree_size)
 void
 tree_replace(tree_t *tree, tree_t *content)
 {
+	/* Keep transposition table, entries point to old nodes though. */
+	if (tree->tt && !content->tt) {
+		content->tt = tree->tt;  tree->tt = NULL;
+		content->tt_bits = tree->tt_bits;
+		content->tt_eqex = tree->tt_eqex;
+		memset(content->tt, 0, ((size_t)1 << content->tt_bits) * sizeof(*content->tt));
+	}
+
+	content->gc_threads = tree->gc_threads;
+	content->undo_max = tree->undo_max;
+	content->shape = tree->shape;
 	tree_t *tmp = malloc2(tree_t);
 	*tmp = *tree;      tree_done(tmp);
 	*tree = *content;  free(content);
@@ -660,13 +2089,106 @@ tree_replace(tree_t *tree, tree_t *content)
 tree_node_t *
 tree_get_node(tree_node_t *parent, coord_t c)
 {
-	for (tree_node_t *n = parent->children; n; n = n->sibling)
+	foreach_child(parent, n)
 		if (node_coord(n) == c)
 			return n;
 	return NULL;
 }
 
 
+/************************************************************************/
+/* Transpositions */
+
+#define tree_tt_key(b, color)		((b)->hash ^ ((color) == S_WHITE ? 0x9e3779b97f4a7c15ULL : 0))
+#define tree_tt_entry(t, key)		(&(t)->tt[(key) & (((hash_t)1 << (t)->tt_bits) - 1)])
+
+/* Find expanded node for the same position (and same color to play). */
+static tree_node_t *
+tree_tt_lookup(tree_t *t, hash_t key)
+{
+	tree_tt_entry_t *e = tree_tt_entry(t, key);
+	tree_node_t *n = e->node;
+	hash_t check = e->check;
+	if (!n || (check ^ (hash_t)(uintptr_t)n) != key)
+		return NULL;
+	return n;
+}
+
+/* Remember @node is expanded for this position.
+ * Keep the most searched node if there's a collision. */
+static void
+tree_tt_store(tree_t *t, hash_t key, tree_node_t *node)
+{
+	tree_tt_entry_t *e = tree_tt_entry(t, key);
+	tree_node_t *n = e->node;
+	if (n && (e->check ^ (hash_t)(uintptr_t)n) == key &&
+	    n->u.playouts > node->u.playouts)
+		return;
+	e->node = node;
+	e->check = key ^ (hash_t)(uintptr_t)node;
+}
+
+/* Seed priors from children of a transposed node: Moves are the same,
+ * and values are not relative to tree depth so we can use them directly. */
+static void
+tree_tt_prior(tree_t *t, tree_node_t *tn, prior_map_t *map)
+{
+	foreach_child(tn, ni) {
+		coord_t c = node_coord(ni);
+		if (!map->consider[c] || !ni->u.playouts)
+			continue;
+		int playouts = (ni->u.playouts < t->tt_eqex ? ni->u.playouts : t->tt_eqex);
+		move_stats_t s = move_stats(ni->u.value, playouts);
+		stats_merge(&map->prior[c], &s);
+	}
+}
+
+
+typedef struct {
+	float key;
+	tree_pending_t p;
+} pending_cand_t;
+
+static int
+pending_cand_cmp(const void *a, const void *b)
+{
+	const pending_cand_t *x = a, *y = b;
+	if (x->key != y->key)  return (x->key < y->key ? -1 : 1);
+	return x->p.coord - y->p.coord;
+}
+
+/* Lazy expansion: move all but the @keep best candidates (by prior, pass
+ * is always kept) from @map to a pending list, best last. Returns number
+ * of pending moves (list first slot in @slot), -1 if tree is full. */
+static int
+tree_lazy_pending(tree_t *t, prior_map_t *map, int keep, int64_t *slot)
+{
+	board_t *b = map->b;
+	pending_cand_t cand[board_max_coords(b)];
+	int n = 0;
+	foreach_free_point(b) {
+		if (!map->consider[c])  continue;
+		move_stats_t *s = &map->prior[c];
+		floating_t v = (map->parity > 0 ? s->value : 1 - s->value);
+		pending_cand_t *e = &cand[n++];
+		e->key = v * s->playouts;
+		e->p.coord = c;
+		e->p.d = (map->distances[c] > TREE_NODE_D_MAX ? TREE_NODE_D_MAX + 1 : map->distances[c]);
+		e->p.prior = node_prior_pack(*s);
+	} foreach_free_point_end;
+	if (n <= keep)  return 0;
+
+	qsort(cand, n, sizeof(*cand), pending_cand_cmp);
+	int npending = n - keep;
+	*slot = tree_alloc_pending(t, npending);
+	if (*slot < 0)  return -1;
+	for (int i = 0; i < npending; i++) {
+		*tree_pending(t, *slot, i) = cand[i].p;
+		map->consider[cand[i].p.coord] = false;
+	}
+	return npending;
+}
+
 /* This function must be thread safe, given that board b is only modified by the calling thread. */
 void
 tree_expand_node(tree_t *t, tree_node_t *node, board_t *b, enum stone color, uct_t *u, int parity)
@@ -678,64 +2200,171 @@ tree_expand_node(tree_t *t, tree_node_t *node, board_t *b, enum stone color, uct
 	else    // Pass - everything is too far.
 		foreach_point(b) { distances[c] = TREE_NODE_D_MAX + 1; } foreach_point_end;
 
-	/* Include pass in the prior map. */
-	move_stats_t map_prior[board_max_coords(b) + 1];      memset(map_prior, 0, sizeof(map_prior));
+	/* Include pass in the prior map.
+	 * Priors are only used for free points, only these get cleared. */
+	move_stats_t map_prior[board_max_coords(b) + 1];
 	bool         map_consider[board_max_coords(b) + 1];   memset(map_consider, 0, sizeof(map_consider));
 	
 	/* Get a map of prior values to initialize the new nodes with. */
-	prior_map_t map = { b, color, tree_parity(t, parity), &map_prior[1], &map_consider[1], distances };
+	bitboard_t legal;  board_legal_moves(b, color, &legal);
+	prior_map_t map = { b, color, tree_parity(t, parity), &map_prior[1], &map_consider[1], distances, &legal };
 	
+	/* Settled points (settled_prune): leave them out. */
+	bitboard_t *settled = (u->settled_points ? &u->settled : NULL);
+
 	map.consider[pass] = true;
+	memset(&map.prior[pass], 0, sizeof(move_stats_t));
 	int child_count = 1; // for pass
 	foreach_free_point(b) {
 		assert(board_at(b, c) == S_NONE);
-		if (!board_is_valid_play_no_suicide(b, color, c))
+		memset(&map.prior[c], 0, sizeof(move_stats_t));
+		if (!bitboard_test(&legal, c))
+			continue;
+		if (settled && bitboard_test(settled, c) && ownermap_settled_quiet(b, c))
 			continue;
 		map.consider[c] = true;
 		child_count++;
 	} foreach_free_point_end;
 	uct_prior(u, node, &map);
 
-	/* Now, create the nodes (all at once) */
-	tree_node_t *ni = tree_alloc_node(t, child_count);
+	/* Same position already searched elsewhere ? */
+	hash_t tt_key = (t->tt ? tree_tt_key(b, color) : 0);
+	if (t->tt) {
+		tree_node_t *tn = tree_tt_lookup(t, tt_key);
+		if (tn && tn != node && node_children(tn))
+			tree_tt_prior(t, tn, &map);
+	}
+
+	/* Lazy expansion: keep all but the best moves pending. */
+	int64_t pending = -1;
+	int npending = 0;
+	if (u->lazy_expand && node != t->root) {
+		npending = tree_lazy_pending(t, &map, u->lazy_expand, &pending);
+		if (npending < 0) {
+			node->is_expanded = false;
+			return;
+		}
+		child_count -= npending;
+	}
+
+	/* Now, create the nodes (all at once). Lazy expansion: block has
+	 * room for pending moves, see tree_widen_node(). */
+	tree_node_t *ni = tree_alloc_node(t, child_count + npending);
 	/* We might temporarily run out of nodes but this should be rare. */
 	if (!ni) {
 		node->is_expanded = false;
 		return;
 	}
-	tree_setup_node(t, ni, pass, node->depth + 1);
+	int depth = tree_node_depth(t, node) + 1;
+	tree_setup_node(t, ni, pass, depth);
 
 	tree_node_t *first_child = ni;
-	ni->parent = node;
-	ni->prior = map.prior[pass]; ni->d = TREE_NODE_D_MAX + 1;
+	node_set_parent(ni, node);
+	node_set_prior(ni, map.prior[pass]); ni->d = TREE_NODE_D_MAX + 1;
 
-	int child = 1;
 	foreach_point(board) {
 		if (!map.consider[c]) // Filter out invalid moves
 			continue;
 		assert(c != node_coord(node)); // I have spotted "C3 C3" in some sequence...
 		
-		tree_node_t *nj = first_child + child++;
-		tree_setup_node(t, nj, c, node->depth + 1);
-		nj->parent = node; ni->sibling = nj; ni = nj;
-		
-		ni->prior = map.prior[c];
+		ni++;
+		tree_setup_node(t, ni, c, depth);
+		node_set_parent(ni, node);
+		node_set_prior(ni, map.prior[c]);
 		ni->d = distances[c];
 	} foreach_point_end;
-	node->children = first_child; // must be done at the end to avoid race
+
+	/* Priors may have filtered out some moves, don't use child_count. */
+	node->nchildren = ni - first_child + 1;
+	if (npending) {
+		tree_node_cold_t *cold = tree_node_cold(t, node);
+		cold->pending = pending;
+		cold->npending = npending;
+		__sync_fetch_and_or(&node->hints, TREE_HINT_PENDING);
+	}
+	/* children must be set last to avoid race (see foreach_child()) */
+	__sync_synchronize();
+	node_set_children(node, first_child);
+	tree_shape_add(t, node, node->nchildren, true);
+
+	if (t->tt)
+		tree_tt_store(t, tt_key, node);
+
+#ifdef DCNN
+	/* Root node gets synchronous dcnn priors. */
+	if (u->dcnn_async && !u->dcnn_visits && node != t->root && u->tree_ready)
+		uct_prior_dcnn_async(u, node, b, color, tree_parity(t, parity));
+#endif
+}
+
+/* Lazy expansion: add up to @count pending moves to expanded node children.
+ * Children block has room for all pending moves (see tree_expand_node()),
+ * new children are set up in place after the existing ones so nodes never
+ * move: threads in the middle of a descent, virtual loss and transposition
+ * table entries are unaffected. Returns false if node has no pending moves
+ * or another thread is widening it.
+ * This function must be thread safe. */
+bool
+tree_widen_node(tree_t *t, tree_node_t *node, int count)
+{
+	if (!(node->hints & TREE_HINT_PENDING))
+		return false;
+	if (__sync_fetch_and_or(&node->hints, TREE_HINT_WIDENING) & TREE_HINT_WIDENING)
+		return false;
+
+	tree_node_cold_t *cold = tree_node_cold(t, node);
+	int m = node->nchildren;
+	int add = (count < cold->npending ? count : cold->npending);
+	if (!(node->hints & TREE_HINT_PENDING) || !add) {
+		__sync_fetch_and_and(&node->hints, ~TREE_HINT_WIDENING);
+		return false;
+	}
+
+	tree_node_t *ni = node_children(node) + m;
+	int depth = tree_node_depth(t, node) + 1;
+	for (int i = 0; i < add; i++) {
+		tree_pending_t *e = tree_pending(t, cold->pending, cold->npending - 1 - i);
+		tree_node_t *n = &ni[i];
+		tree_setup_node(t, n, e->coord, depth);
+		node_set_parent(n, node);
+		n->prior = e->prior;
+		n->d = e->d;
+	}
+
+	/* New children must be ready before they're visible, see node_children_range() */
+	__sync_synchronize();
+	node->nchildren = m + add;
+	cold->npending -= add;
+	if (!cold->npending)
+		__sync_fetch_and_and(&node->hints, ~TREE_HINT_PENDING);
+	__sync_fetch_and_and(&node->hints, ~TREE_HINT_WIDENING);
+	tree_shape_add(t, node, add, false);
+	return true;
 }
 
 #define set_reason(val)		do {  if (reason) *reason = val;       } while(0)
 #define promote_fail(val)	do {  set_reason(val);  return false;  } while(0)
 
+/* Garbage collect if we run out of memory, or it is cheap to do so now. */
+bool
+tree_gc_wanted(tree_t *t)
+{
+	/* Keeping undo history: only collect when memory is needed. */
+	if (t->undo_max)
+		return tree_gc_urgent(t);
+	return (tree_gc_needed(t) ||
+		(t->nodes_size >= t->max_tree_size / 10 && t->root->u.playouts < SMALL_TREE_PLAYOUTS));
+}
+
 /* Promotes the given node as the root of the tree.
- * May trigger tree garbage collection:
+ * May trigger tree garbage collection if @gc is set:
  * The node may be moved and some of its subtree may be pruned.
+ * Caller can check tree_gc_wanted() and collect later otherwise.
  * Returns true on success, false otherwise (@reason tells why) */
 bool
-tree_promote_node(tree_t *t, tree_node_t *node, board_t *b, enum promote_reason *reason)
+tree_promote_node(tree_t *t, tree_node_t *node, board_t *b, bool gc, enum promote_reason *reason)
 {
-	assert(node->parent == t->root);
+	assert(node_parent(node) == t->root);
 	set_reason(PROMOTE_REASON_NONE);
 
 	if (t->untrustworthy_tree)
@@ -744,17 +2373,24 @@ tree_promote_node(tree_t *t, tree_node_t *node, board_t *b, enum promote_reason
 	if (using_dcnn(b) && !(node->hints & TREE_HINT_DCNN))
 		promote_fail(PROMOTE_DCNN_MISSING);
 	
-	node->parent = NULL;
-	node->sibling = NULL;
+	/* Keep old root around for undo, oldest gets dropped when full. */
+	if (t->undo_max) {
+		if (t->undo_n == t->undo_max)
+			memmove(t->undo, t->undo + 1, --t->undo_n * sizeof(t->undo[0]));
+		t->undo[t->undo_n++] = t->root;
+	}
+
+	node_set_parent(node, NULL);
 
 	t->root = node;
 	t->root_color = stone_other(t->root_color);
 	
-	/* Garbage collect if we run out of memory, or it is cheap to do so now: */
-	if (tree_gc_needed(t) ||
-	    (t->nodes_size >= t->max_tree_size / 10 && node->u.playouts < SMALL_TREE_PLAYOUTS))
+	if (gc && tree_gc_wanted(t))
 		tree_garbage_collect(t);
 
+	/* Lazy expansion: root gets all its moves. */
+	tree_widen_node(t, t->root, INT_MAX);
+
 	t->avg_score.playouts = 0;
 
 	/* If the tree deepest node was under node, or if we called tree_garbage_collect,
@@ -764,12 +2400,27 @@ tree_promote_node(tree_t *t, tree_node_t *node, board_t *b, enum promote_reason
 	return true;
 }
 
+/* Undo last promotion: previous root becomes tree root again, promoted
+ * node stays in there with its subtree so playing it again loses nothing.
+ * Returns false if previous root is gone (tree got collected ...) */
+bool
+tree_undo(tree_t *t)
+{
+	if (!t->undo_n)  return false;
+
+	tree_node_t *node = t->undo[--t->undo_n];
+	node_set_parent(t->root, node);
+	t->root = node;
+	t->root_color = stone_other(t->root_color);
+	t->avg_score.playouts = 0;
+	return true;
+}
+
 /* Promote node for given move as the root of the tree.
- * May trigger tree garbage collection:
- * The node may be moved and some of its subtree may be pruned.
+ * May trigger tree garbage collection if @gc is set, see tree_promote_node().
  * Returns true on success, false otherwise (@reason tells why) */
 bool
-tree_promote_move(tree_t *t, move_t *m, board_t *b, enum promote_reason *reason)
+tree_promote_move(tree_t *t, move_t *m, board_t *b, bool gc, enum promote_reason *reason)
 {
 	set_reason(PROMOTE_REASON_NONE);
 
@@ -777,7 +2428,9 @@ tree_promote_move(tree_t *t, move_t *m, board_t *b, enum promote_reason *reason)
 		return false;	/* Bad color */
 	
 	tree_node_t *n = tree_get_node(t->root, m->coord);
+	if (!n && tree_widen_node(t, t->root, INT_MAX))  /* Lazy expansion */
+		n = tree_get_node(t->root, m->coord);
 	if (!n)  return false;	/* Not found */
 
-	return tree_promote_node(t, n, b, reason);
+	return tree_promote_node(t, n, b, gc, reason);
 }
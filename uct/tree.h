@@ -15,9 +15,15 @@
  *   buffer, which has now plenty of space. */
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <pthread.h>
 #include "move.h"
 #include "stats.h"
+#include "util.h"
+#ifdef DISTRIBUTED
+#include "distributed/distributed.h"
+#endif
 
 struct uct;
 
@@ -26,44 +32,64 @@ struct uct;
  *            | node |
  *            +------+
  *          / <- parent
- * +------+   v- sibling +------+
- * | node | ------------ | node |
- * +------+              +------+
+ * +------+--------------+------+
+ * | node |     ...      | node |   <- children[0 .. nchildren-1]
+ * +------+--------------+------+
  *    | <- children          |
- * +------+   +------+   +------+   +------+
- * | node | - | node |   | node | - | node |
- * +------+   +------+   +------+   +------+
- */
+ * +------+------+       +------+------+
+ * | node | node |       | node | node |
+ * +------+------+       +------+------+
+ *
+ * Children of a node are allocated all at once and stored contiguously,
+ * use foreach_child() to iterate over them.
+ * With lazy expansion (lazy_expand uct option) only the best children by
+ * prior are created at first, the other moves are kept in a compact list
+ * of (coord, prior) pairs (pending moves) and the node gets widened as its
+ * playouts grow. Children block has room for pending moves which are set
+ * up in place, nodes never move, see tree_widen_node().
+ *
+ * Links between nodes should be accessed with node_parent() / node_children()
+ * and set with node_set_parent() / node_set_children(): With TREE_COMPACT_INDEX
+ * they are stored as 32-bit offsets relative to the node itself instead of
+ * pointers (all nodes live in the same buffer), 0 meaning no link. */
+
+/* Node memory layout:
+ * Node data is split in two parts living in parallel arrays inside the
+ * tree nodes buffer. tree_node_t holds hot data, everything read on tree
+ * descent (ucb1rave_evaluate() is top source of cache misses, so we want
+ * as many children as possible per cache line). tree_node_cold_t holds
+ * the rest: data needed only at backprop, by the distributed engine or for
+ * statistics. Cold part of a node is at the same index in the cold array,
+ * use tree_node_cold() to get it. */
+
+/* Priors don't need full stats precision: value in [0, 1] stored as fixed
+ * point (value * PRIOR_VALUE_SCALE), playouts are a few hundred at most
+ * (capped at 65535). Use node_prior() / node_set_prior() to access them. */
+typedef struct {
+	uint16_t value;
+	uint16_t playouts;
+} node_prior_t;
 
-/* TODO: Performance would benefit from a reorganization:
- * (i) Allocate all children of a node within a single block.
- * (ii) Keep all u stats together, and all amaf stats together.
- * Currently, rave_update is top source of cache misses, and
- * there is large memory overhead for having all nodes separate. */
+#define PRIOR_VALUE_SCALE	65535
 
 typedef struct tree_node {
-	hash_t hash;
-	struct tree_node *parent, *sibling, *children;
-
-	/*** From here on, struct is saved/loaded from opening tbook */
-
 	move_stats_t u;
-	move_stats_t prior;
 	/* XXX: Should be way for policies to add their own stats */
 	move_stats_t amaf;
-	/* Stats before starting playout; used for distributed engine. */
-	move_stats_t pu;
-	/* Criticality information; information about final board owner
-	 * of the tree coordinate corresponding to the node */
-	move_stats_t winner_owner; // owner == winner
-	move_stats_t black_owner; // owner == black
+	node_prior_t prior;
+
+#ifdef TREE_COMPACT_INDEX
+	int32_t parent, children;
+#else
+	struct tree_node *parent, *children;
+#endif
+	/* Number of children, only valid if children != NULL. */
+	unsigned short nchildren;
 
 	/* coord is usually coord_t, but this is very space-sensitive. */
 #define node_coord(n) ((int) (n)->coord)
 	short coord;
 
-	unsigned short depth; // just for statistics
-
 	/* Number of parallel descents going through this node at the moment.
 	* Used for virtual loss computation. */
 	signed char descents;
@@ -74,6 +100,12 @@ typedef struct tree_node {
 
 #define TREE_HINT_INVALID 1 // don't go to this node, invalid move
 #define TREE_HINT_DCNN    2 // node has dcnn priors
+#define TREE_HINT_PATTERNS 4 // node has pattern priors
+#define TREE_HINT_PENDING  8 // lazy expansion: node has pending moves
+#define TREE_HINT_WIDENING 16 // one thread currently widening node
+#define TREE_HINT_DCNN_QUEUED 32 // dcnn priors requested (dcnn_visits)
+#define TREE_HINT_VISITED  64 // node got visited by a descent, see tree_shape_t
+#define TREE_HINT_TOPK    128 // root child in tree_topk_t
 	unsigned char hints;
 
 	/* In case multiple threads walk the tree, is_expanded is set
@@ -85,9 +117,125 @@ typedef struct tree_node {
 	bool is_expanded;
 } tree_node_t;
 
+typedef struct {
+	/* Used only for debugging. */
+	hash_t hash;
+
+	/* Stats before starting playout; used for distributed engine. */
+	move_stats_t pu;
+	/* Criticality information; information about final board owner
+	 * of the tree coordinate corresponding to the node */
+	move_stats_t winner_owner; // owner == winner
+	move_stats_t black_owner; // owner == black
+
+	unsigned short depth; // just for statistics
+
+	/* Lazy expansion: moves not materialized yet, best last.
+	 * Only valid with TREE_HINT_PENDING. */
+	unsigned short npending;
+	uint32_t pending;  // first nodes buffer slot of the list
+} tree_node_cold_t;
+
+static inline node_prior_t
+node_prior_pack(move_stats_t s)
+{
+	node_prior_t p = { s.value * PRIOR_VALUE_SCALE + 0.5, (s.playouts < 65535 ? s.playouts : 65535) };
+	return p;
+}
+
+static inline move_stats_t
+node_prior_unpack(node_prior_t p)
+{
+	move_stats_t s = move_stats(p.value * ((floating_t)1 / PRIOR_VALUE_SCALE), p.playouts);
+	return s;
+}
+
+#define node_prior(n)		node_prior_unpack((n)->prior)
+#define node_set_prior(n, s)	((n)->prior = node_prior_pack(s))
+
+#ifdef TREE_COMPACT_INDEX
+static inline tree_node_t *node_parent(tree_node_t *n)    {  return (n->parent ? n + n->parent : NULL);  }
+static inline tree_node_t *node_children(tree_node_t *n)  {  return (n->children ? n + n->children : NULL);  }
+static inline void node_set_parent(tree_node_t *n, tree_node_t *p)    {  n->parent = (p ? p - n : 0);  }
+static inline void node_set_children(tree_node_t *n, tree_node_t *c)  {  n->children = (c ? c - n : 0);  }
+#else
+#define node_parent(n)			((n)->parent)
+#define node_children(n)		((n)->children)
+#define node_set_parent(n, p)		((n)->parent = (p))
+#define node_set_children(n, c)		((n)->children = (c))
+#endif
+
+/* Get node children and end of children.
+ * Can be used while the tree is updated by other threads: node->nchildren
+ * is set before node->children on expansion, and after it when node gets
+ * widened (children move), so children is read again to check we didn't
+ * pick old children with new nchildren. */
+static inline tree_node_t *
+node_children_range(tree_node_t *n, tree_node_t **end)
+{
+	while (1) {
+		tree_node_t *c = node_children(n);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		unsigned short nc = n->nchildren;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (c == node_children(n)) {
+			*end = (c ? c + nc : NULL);
+			return c;
+		}
+	}
+}
+
+/* Iterate over node children.
+ * Can be used while the tree is updated by other threads. */
+#define foreach_child(node, ni) \
+	for (tree_node_t *ni##_end, *ni = node_children_range((node), &ni##_end); \
+	     ni < ni##_end;  ni++)
+
+/* Memory used by one node (hot + cold parts) */
+#define TREE_NODE_SIZE  (sizeof(tree_node_t) + sizeof(tree_node_cold_t))
+
+/* Max previous roots kept for undo (see uct undo_history option) */
+#define TREE_UNDO_MAX 64
+
 struct tree_hash;
 
+/* Transposition table entry. Lock-free: check is key ^ node so that
+ * entries torn by concurrent writes are detected and ignored. */
 typedef struct {
+	hash_t check;
+	tree_node_t *node;
+} tree_tt_entry_t;
+
+/* Tree shape statistics, updated as the search goes (expansions and first
+ * visits) so they're cheap to get at any time. Counts are since last
+ * tree_shape_reset() (search start), depths relative to root.
+ * Nodes visited before the reset and first visited after it still count
+ * as visited, so unvisited count is a lower bound when the tree is reused. */
+#define TREE_SHAPE_DEPTHS  24	/* Deeper nodes share last slot */
+#define TREE_SHAPE_PV       8	/* PV plies shown */
+
+typedef struct {
+	double start;				/* Time of last reset */
+	long   expansions;			/* Nodes expanded */
+	long   nodes[TREE_SHAPE_DEPTHS];	/* Nodes created at each depth (expansion or widening) */
+	long   visited;				/* Nodes visited for the first time */
+} tree_shape_t;
+
+/* Most visited root children, so that reporting / stop checks don't need
+ * to go through all of them. Kept up to date during backprop: a child
+ * gets in once its playouts go past the least visited one's (@min).
+ * Lock-free, entries are unordered and readers sort their copy.
+ * Only valid for @root, set up at search start (tree_topk_rebuild()). */
+#define TREE_TOPK  24
+
+typedef struct {
+	tree_node_t * volatile root;
+	tree_node_t * volatile n[TREE_TOPK];
+	volatile int min;		/* Playouts of least visited entry (can lag behind) */
+	float max_prior;		/* Best root child prior, 0 until computed (tree_root_max_prior()) */
+} tree_topk_t;
+
+typedef struct tree {
 	tree_node_t *root;
 	enum stone root_color;
 
@@ -113,14 +261,43 @@ typedef struct {
 	 * Maps coordinate path to tree node. */
 	struct tree_hash *htable;
 	int hbits;
+	hash_gen_t hgen;
 #endif
 
+	/* Transposition table: maps board position to an expanded node.
+	 * Used to seed priors of transposed positions, see tree_expand_node().
+	 * Cleared whenever nodes move. */
+	tree_tt_entry_t *tt;
+	int tt_bits;
+	int tt_eqex;  // max prior weight of transposed stats
+
+	/* Root parallelization: private tree of a thread group, stats get
+	 * merged into main tree periodically, see tree_merge(). */
+	struct tree *merge_into;
+	volatile int merging;
+
+	int gc_threads;	// threads used by tree_garbage_collect()
+
+	/* Undo history: previous roots, still in the tree until nodes move
+	 * (tree gc ...), see tree_undo(). Off if undo_max is 0. */
+	tree_node_t *undo[TREE_UNDO_MAX];
+	int undo_n;
+	int undo_max;
+
 	// Statistics
 	int max_depth;
-	volatile size_t nodes_size; // byte size of all allocated nodes
+	tree_shape_t shape;         // see tree_shape_t, kept across tree_replace()
+	tree_topk_t topk;           // see tree_topk_t
+	volatile size_t nodes_size; // byte size of all allocated nodes (and thread slabs)
 	                            // beware failed allocs still bump nodes_size
+	unsigned int alloc_gen;     // node allocation generation, see tree_alloc_node()
+	double gc_time;             // time spent in tree_garbage_collect()
+	size_t gc_freed;            // bytes reclaimed by it
 	size_t max_tree_size; // maximum byte size for entire tree
-	void *nodes; // nodes buffer
+	size_t reserved_size; // nodes buffer size, tree can grow in place up to this
+	bool nodes_mmapped;   // nodes buffer is a reserved mapping
+	void *nodes; // nodes buffer (hot nodes followed by cold nodes)
+	tree_node_cold_t *cold; // cold nodes array, parallel to hot nodes
 } tree_t;
 
 /* Tree garbage collection:
@@ -131,15 +308,43 @@ typedef struct {
 					 (t)->max_tree_size * 20 / 100)
 #define tree_gc_threshold(t)		((t)->max_tree_size * 10 / 100)
 #define tree_gc_needed(t)		((t)->nodes_size >= tree_gc_threshold((t)))
+/* Tree getting full, can't wait for background gc. */
+#define tree_gc_urgent(t)		((t)->nodes_size >= (t)->max_tree_size / 2)
+
+/* Nodes buffer memory options, see tree_set_mem_options() */
+#define TREE_HUGEPAGES_THP	1
+#define TREE_NUMA_DEFAULT	-1
+#define TREE_NUMA_INTERLEAVE	-2
 
-/* Warning: all functions below except tree_expand_node & tree_leaf_node are THREAD-UNSAFE! */
+/* Warning: all functions below except tree_expand_node, tree_widen_node & tree_leaf_node are THREAD-UNSAFE! */
+void tree_set_mem_options(size_t hugepages, int numa);
 tree_t *tree_init(enum stone color, size_t max_tree_size, int hbits);
+tree_t *tree_init_growable(enum stone color, size_t max_tree_size, size_t reserve_size, int hbits);
+bool tree_grow(tree_t *t, size_t max_tree_size);
+void tree_tt_init(tree_t *t, int bits, int eqex);
 void tree_done(tree_t *tree);
 void tree_dump(tree_t *tree, double thres);
+bool tree_gc_wanted(tree_t *t);
 size_t tree_actual_size(tree_t *t);
-void tree_save(tree_t *tree, board_t *b, int thres);
+void tree_shape_reset(tree_t *t);
+void tree_shape_print(tree_t *t, strbuf_t *buf);
+void tree_shape_json(tree_t *t, strbuf_t *buf);
+void tree_topk_rebuild(tree_t *t);
+void tree_topk_insert(tree_t *t, tree_node_t *n);
+int  tree_topk_get(tree_t *t, tree_node_t *parent, tree_node_t **n);
+float tree_root_max_prior(tree_t *t);
+int  tree_top_children(tree_t *t, tree_node_t *parent, tree_node_t **n, int k);
+static void tree_topk_update(tree_t *t, tree_node_t *n);
+/* Save tbook, to default tbook file if @filename is NULL.
+ * @path: moves leading to tree root if not empty board. */
+#define TBOOK_MAX_PATH 32
+void tree_save(tree_t *tree, board_t *b, int thres, char *filename, coord_t *path, int path_len);
 void tree_load(tree_t *tree, board_t *b);
+bool tree_merge_tbooks(board_t *b, char **files, int nfiles);
+bool tree_save_snapshot(tree_t *t, FILE *f);
+tree_t *tree_load_snapshot(FILE *f, size_t max_tree_size, size_t reserve_size, int hbits);
 void tree_copy(tree_t *dst, tree_t *src);
+void tree_merge(tree_t *dest, tree_t *src, int max_depth);
 void tree_replace(tree_t *tree, tree_t *content);
 int  tree_realloc(tree_t *t, size_t max_tree_size);
 
@@ -148,19 +353,27 @@ enum promote_reason {
 	PROMOTE_UNTRUSTWORTHY,
 	PROMOTE_DCNN_MISSING,
 };
-bool tree_promote_node(tree_t *tree, tree_node_t *node, board_t *b, enum promote_reason *reason);
-bool tree_promote_move(tree_t *tree, move_t *m, board_t *b, enum promote_reason *reason);
+bool tree_promote_node(tree_t *tree, tree_node_t *node, board_t *b, bool gc, enum promote_reason *reason);
+bool tree_promote_move(tree_t *tree, move_t *m, board_t *b, bool gc, enum promote_reason *reason);
+bool tree_undo(tree_t *tree);
 
 tree_node_t *tree_get_node(tree_node_t *parent, coord_t c);
 void tree_garbage_collect(tree_t *tree);
+int  tree_recycle(tree_t *t, tree_t *tmp);
 
 void tree_expand_node(tree_t *tree, tree_node_t *node, board_t *b, enum stone color, struct uct *u, int parity);
+bool tree_widen_node(tree_t *tree, tree_node_t *node, int count);
 
 static bool tree_leaf_node(tree_node_t *node);
 
 
+/* Get cold part of node @n */
+#define tree_node_cold(t, n)	(&(t)->cold[(n) - (tree_node_t*)(t)->nodes])
+
+#define tree_node_depth(t, n)	(tree_node_cold((t), (n))->depth)
+
 #define tree_node_parity(tree, node) \
-	((((node)->depth ^ (tree)->root->depth) & 1) ? -1 : 1)
+	(((tree_node_depth(tree, node) ^ tree_node_depth(tree, (tree)->root)) & 1) ? -1 : 1)
 
 /* Get black parity from parity within the tree. */
 #define tree_parity(tree, parity) \
@@ -180,7 +393,17 @@ static bool tree_leaf_node(tree_node_t *node);
 static inline bool
 tree_leaf_node(tree_node_t *node)
 {
-	return !(node->children);
+	return !node_children(node);
+}
+
+/* Root child @n got more playouts (can be any node). */
+static inline void
+tree_topk_update(tree_t *t, tree_node_t *n)
+{
+	tree_node_t *root = t->topk.root;
+	if (n->u.playouts > t->topk.min && !(n->hints & TREE_HINT_TOPK) &&
+	    root && node_parent(n) == root)
+		tree_topk_insert(t, n);
 }
 
 static inline floating_t
@@ -194,9 +417,10 @@ tree_node_criticality(const tree_t *t, const tree_node_t *node)
 	 * = winner_gets - (b_gets * b_wins + (1 - b_gets) * (1 - b_wins))
 	 * = winner_gets - (b_gets * b_wins + 1 - b_gets - b_wins + b_gets * b_wins)
 	 * = winner_gets - (2 * b_gets * b_wins - b_gets - b_wins + 1) */
-	return node->winner_owner.value
-		- (2 * node->black_owner.value * node->u.value
-		   - node->black_owner.value - node->u.value + 1);
+	tree_node_cold_t *cold = tree_node_cold(t, node);
+	return cold->winner_owner.value
+		- (2 * cold->black_owner.value * node->u.value
+		   - cold->black_owner.value - node->u.value + 1);
 }
 
 #endif
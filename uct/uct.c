@@ -1,5 +1,7 @@
 #include <assert.h>
+#include <ctype.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,6 +10,8 @@
 #define DEBUG
 
 #include "debug.h"
+#include "affinity.h"
+#include "fifo.h"
 #include "pachi.h"
 #include "board.h"
 #include "gtp.h"
@@ -15,11 +19,15 @@
 #include "move.h"
 #include "mq.h"
 #include "joseki.h"
+#include "metrics.h"
+#include "perfstats.h"
 #include "playout.h"
 #include "playout/moggy.h"
 #include "playout/light.h"
+#include "playout/pattern.h"
 #include "tactics/util.h"
 #include "timeinfo.h"
+#include "uct/cache.h"
 #include "uct/dynkomi.h"
 #include "uct/internal.h"
 #include "uct/plugins.h"
@@ -43,13 +51,34 @@ static void uct_genmove_pondering_start(uct_t *u, board_t *b, enum stone color,
 /* Maximal simulation length. */
 #define MC_GAMELEN	MAX_GAMELEN
 
+/* With auto_alloc, reserve address space for the tree so it can grow in place:
+ * as much as we're allowed to use but no more than physical memory.
+ * Only on 64-bit, address space is too scarce otherwise. */
+static size_t
+uct_tree_reserve_size(uct_t *u)
+{
+	if (!u->auto_alloc || sizeof(void*) == 4)  return 0;
+
+	size_t size = get_physical_mem();
+	size_t max_tree_size, max_mem;
+	uct_tree_limits(u, &max_tree_size, &max_mem);
+	if (max_tree_size < size)  size = max_tree_size;
+	if (max_mem < size)        size = max_mem;
+	return size;
+}
+
 static void
 setup_state(uct_t *u, board_t *b, enum stone color)
 {
 	size_t size = u->tree_size;
 	if (DEBUGL(3)) fprintf(stderr, "allocating %i Mb for search tree\n", (int)(size / (1024*1024)));
 	u->main_board = b;
-	u->t = tree_init(color, size, stats_hbits(u));
+	u->t = tree_init_growable(color, size, uct_tree_reserve_size(u), stats_hbits(u));
+	u->t->gc_threads = u->threads;
+	if (u->undo_seen)
+		u->t->undo_max = u->undo_history;
+	if (u->tt_bits)
+		tree_tt_init(u->t, u->tt_bits, u->tt_eqex);
 	if (u->initial_extra_komi)
 		u->t->extra_komi = u->initial_extra_komi;
 	if (u->force_seed)
@@ -65,11 +94,21 @@ setup_state(uct_t *u, board_t *b, enum stone color)
 	}
 }
 
+/* Leaving analysed position: save tree in subtree cache. */
+static void
+uct_cache_save(uct_t *u)
+{
+	if (u->t_analyzed)
+		tree_cache_save(u->t_key, u->t);
+	u->t_analyzed = false;
+}
+
 static void
 reset_state(uct_t *u)
 {
 	if (UDEBUGL(3)) fprintf(stderr, "resetting tree\n");
 	assert(u->t);
+	uct_cache_save(u);
 	tree_done(u->t);
 	u->t = NULL;
 	u->main_board = NULL;
@@ -100,6 +139,10 @@ uct_prepare_move(uct_t *u, board_t *b, enum stone color)
 		setup_state(u, b, color);
 
 	ownermap_init(&u->ownermap);
+	u->mcowner_claimed = 0;
+	u->settled_points = 0;
+	u->ownermap_hash = b->hash;
+	u->ownermap_moves = b->moves;
 	u->allow_pass = (b->moves > board_earliest_pass(b));  /* && dames < 10  if using patterns */
 #ifdef DISTRIBUTED
 	u->played_own = u->played_all = 0;
@@ -285,20 +328,159 @@ uct_board_print(engine_t *e, board_t *b, FILE *f)
 }
 
 /* Fill ownermap for mcowner pattern feature (no tree search)
- * ownermap must be initialized already. */
+ * ownermap must be initialized already.
+ * Worker threads call this in parallel at search start and split the work:
+ * each thread claims playouts and fills a private ownermap which gets merged
+ * at the end (no contention on shared ownermap meanwhile). Returns once all
+ * playouts are in. */
 void
 uct_mcowner_playouts(uct_t *u, board_t *b, enum stone color)
 {
 	playout_setup_t ps = playout_setup(u->gamelen, u->mercymin);
+	ps.cutoff = u->cutoff;
+	ownermap_t ownermap;
+	ownermap_init(&ownermap);
 	
 	/* TODO pick random last move, better playouts randomness */
 
-	while (u->ownermap.playouts < GJ_MINGAMES) {
+	while (u->ownermap.playouts < GJ_MINGAMES &&
+	       __sync_fetch_and_add(&u->mcowner_claimed, 1) < GJ_MINGAMES) {
 		board_t b2;
 		board_copy(&b2, b);
-		playout_play_game(&ps, &b2, color, NULL, &u->ownermap, u->playout);
+		playout_play_game(&ps, &b2, color, NULL, &ownermap, u->playout);
 		board_done(&b2);
 	}
+	ownermap_merge(&u->ownermap, &ownermap);
+
+	/* Wait for other threads' last playouts. */
+	while (u->ownermap.playouts < GJ_MINGAMES)
+		time_sleep(0.001);
+}
+
+/* Points whose owner may have changed after a move at @m:
+ * close ones and groups next to it. */
+static void
+mark_changed_area(board_t *b, coord_t m, bool *changed)
+{
+	foreach_point(b) {
+		if (abs(coord_dx(m, c)) + abs(coord_dy(m, c)) <= 2)
+			changed[c] = true;
+	} foreach_point_end;
+
+	foreach_neighbor(b, m, {
+		group_t g = group_at(b, c);
+		if (!g)  continue;
+		foreach_in_group(b, g) {
+			changed[c] = true;
+		} foreach_in_group_end;
+	});
+}
+
+/* Ownermap is for an earlier position, bring it up to date.
+ * With score_est_playouts=N and only a few moves played since, we keep
+ * the map and only play N playouts: Points around the new moves take
+ * owners from those, elsewhere they add to (aged) previous counts.
+ * Otherwise ownermap gets reset and refilled as usual.
+ * Not while searching, search threads are filling it. */
+static void
+uct_ownermap_refresh(uct_t *u, board_t *b, enum stone color)
+{
+	ownermap_t *o = &u->ownermap;
+	if (thread_manager_running || u->ownermap_hash == b->hash)
+		return;
+
+	int n = b->moves - u->ownermap_moves;
+	u->ownermap_hash = b->hash;
+	u->ownermap_moves = b->moves;
+	if (!o->playouts)  /* Empty, gets filled for this position */
+		return;
+	if (!u->score_est_playouts || o->playouts < GJ_MINGAMES || n <= 0 || n > BOARD_LAST_N) {
+		ownermap_init(o);
+		u->mcowner_claimed = 0;
+		return;
+	}
+
+	bool changed[BOARD_MAX_COORDS] = { false, };
+	for (int i = 0; i < n; i++) {
+		coord_t m = last_moven(b, i).coord;
+		if (!is_pass(m) && !is_resign(m))
+			mark_changed_area(b, m, changed);
+	}
+
+	playout_setup_t ps = playout_setup(u->gamelen, u->mercymin);
+	ps.cutoff = u->cutoff;
+	ownermap_t fresh;
+	ownermap_init(&fresh);
+	for (int i = 0; i < u->score_est_playouts; i++) {
+		board_t b2;
+		board_copy(&b2, b);
+		playout_play_game(&ps, &b2, color, NULL, &fresh, u->playout);
+		board_done(&b2);
+	}
+
+	/* Old counts weigh GJ_MINGAMES playouts at most. */
+	int old = (o->playouts > GJ_MINGAMES ? GJ_MINGAMES : o->playouts);
+	int total = old + fresh.playouts;
+	foreach_point(b) {
+		for (int j = 0; j < S_MAX; j++) {
+			if (changed[c])  o->map[c][j] = fresh.map[c][j] * total / fresh.playouts;
+			else             o->map[c][j] = o->map[c][j] * old / o->playouts + fresh.map[c][j];
+		}
+	} foreach_point_end;
+	o->playouts = total;
+}
+
+/* Fast scoring playouts, see scoring_time option. */
+#define SCORING_MIN_PLAYOUTS	64
+#define SCORING_BATCH		16
+
+/* All groups needing playouts clearly dead or alive ? */
+static bool
+scoring_settled(board_t *b, ownermap_t *ownermap, enum gj_state *fixed)
+{
+	enum gj_state gs[board_max_coords(b)];
+	group_judgement_t gj = { GJ_THRES, gs };
+	ownermap_judge_groups(b, ownermap, &gj);
+
+	foreach_point(b) {
+		group_t g = group_at(b, c);
+		if (!g || g != c)  continue;
+		if (fixed[g] == GS_NONE && gs[g] == GS_UNKNOWN)
+			return false;
+	} foreach_point_end;
+	return true;
+}
+
+/* Fill ownermap for scoring with as few playouts as possible:
+ * Pass-alive groups and local sekis don't need playouts, stop as soon as
+ * other groups are clearly dead or alive, or when out of time.
+ * Single-threaded, no search must be running. */
+static void
+uct_scoring_playouts(uct_t *u, board_t *b, enum stone color)
+{
+	if (u->ownermap.playouts >= GJ_MINGAMES)  return;
+
+	enum gj_state fixed[board_max_coords(b)];
+	group_judgement_t gj = { GJ_THRES, fixed };
+	static_judge_groups(b, &gj);
+
+	playout_setup_t ps = playout_setup(u->gamelen, u->mercymin);
+	ps.cutoff = u->cutoff;
+	double time_start = time_now();
+	while (u->ownermap.playouts < GJ_MINGAMES) {
+		if (u->ownermap.playouts >= SCORING_MIN_PLAYOUTS &&
+		    (time_now() - time_start > u->scoring_time ||
+		     scoring_settled(b, &u->ownermap, fixed)))
+			break;
+		for (int i = 0; i < SCORING_BATCH; i++) {
+			board_t b2;
+			board_copy(&b2, b);
+			playout_play_game(&ps, &b2, color, NULL, &u->ownermap, u->playout);
+			board_done(&b2);
+		}
+	}
+	if (UDEBUGL(3))  fprintf(stderr, "scoring: %i playouts in %0.2fs\n",
+				 u->ownermap.playouts, time_now() - time_start);
 }
 
 static ownermap_t*
@@ -307,7 +489,9 @@ uct_ownermap(engine_t *e, board_t *b)
 	uct_t *u = (uct_t*)e->data;
 	
 	/* Make sure ownermap is well-seeded. */
-	uct_mcowner_playouts(u, b, board_to_play(b));
+	uct_ownermap_refresh(u, b, board_to_play(b));
+	if (u->scoring_time)  uct_scoring_playouts(u, b, board_to_play(b));
+	else                  uct_mcowner_playouts(u, b, board_to_play(b));
 	
 	return &u->ownermap;
 }
@@ -317,10 +501,15 @@ uct_notify_play(engine_t *e, board_t *b, move_t *m, char *enginearg, bool *print
 {
 	uct_t *u = (uct_t*)e->data;
 	bool was_searching = thread_manager_running;
+	bool was_pondering = was_searching && genmove_pondering(u);
 	
 	if (!u->t) {
-		/* No state, create one - this is probably game beginning
-		 * and we need to load the opening tbook right now. */
+		/* No state: nothing to promote, a fresh tree would get thrown
+		 * away right after (replaying a game, play sequences ...).
+		 * Create one only at game beginning, we need to load the opening
+		 * tbook right now, or if we're a slave (pondering). */
+		if (b->moves && !u->slave)
+			return NULL;
 		uct_prepare_move(u, b, m->color);
 		assert(u->t);
 	}
@@ -348,7 +537,16 @@ uct_notify_play(engine_t *e, board_t *b, move_t *m, char *enginearg, bool *print
 	 * if we started searching without dcnn data better start from scratch. */
 	enum promote_reason reason;
 	assert(u->t->root);
-	if (!tree_promote_move(u->t, m, b, &reason)) {
+	uct_cache_save(u);
+	/* If pondering, leave tree gc to the pondering thread manager after
+	 * our next genmove, unless tree is getting full: no need to delay
+	 * the search we're about to start. */
+	bool gc = !(u->pondering_opt && u->background_gc) || tree_gc_urgent(u->t);
+	tree_node_t *reply = (was_pondering ? tree_get_node(u->t->root, m->coord) : NULL);
+	int reused = (reply ? reply->u.playouts : 0);
+	int total = u->t->root->u.playouts;
+	if (!tree_promote_move(u->t, m, b, gc, &reason)) {
+		reused = 0;
 		if (UDEBUGL(3)) {
 			if      (reason == PROMOTE_UNTRUSTWORTHY)  fprintf(stderr, "Not promoting move node in untrustworthy tree.\n");
 			else if (reason == PROMOTE_DCNN_MISSING)   fprintf(stderr, "Played move has no dcnn priors, resetting tree.\n");
@@ -360,6 +558,20 @@ uct_notify_play(engine_t *e, board_t *b, move_t *m, char *enginearg, bool *print
 		reset_state(u);
 	}
 
+	/* How much of the pondering search is still useful. */
+	if (was_pondering) {
+		u->pondering_reused += reused;
+		u->pondering_total += total;
+		metric_add(METRIC_PONDER_MOVES, 1);
+		metric_add(METRIC_PONDER_HITS, (reused > 0));
+		metric_add(METRIC_PONDER_PLAYOUTS, total);
+		metric_add(METRIC_PONDER_REUSED_PLAYOUTS, reused);
+		if (UDEBUGL(2))
+			fprintf(stderr, "pondering: reused %i/%i playouts (%.0f%%), %.0f%% this game\n",
+				reused, total, (total ? 100.0 * reused / total : 0),
+				(u->pondering_total ? 100.0 * u->pondering_reused / u->pondering_total : 0));
+	}
+
 	/* If we are a slave in a distributed engine, start pondering once
 	 * we know which move we actually played. See uct_genmove() about
 	 * the check for pass. */
@@ -425,12 +637,42 @@ uct_dead_groups(engine_t *e, board_t *b, move_queue_t *dead)
 	if (UDEBUGL(1)) fprintf(stderr, "WARNING: Recomputing dead groups\n");
 
 	/* Make sure the ownermap is well-seeded. */
-	uct_mcowner_playouts(u, b, S_BLACK);
+	uct_ownermap_refresh(u, b, S_BLACK);
+	if (u->scoring_time)  uct_scoring_playouts(u, b, S_BLACK);
+	else                  uct_mcowner_playouts(u, b, S_BLACK);
 	if (UDEBUGL(2))  board_print_ownermap(b, stderr, &u->ownermap);
 
 	ownermap_dead_groups(b, &u->ownermap, dead, NULL);
 }
 
+/* Undo: re-root tree to previous position if we still have it,
+ * otherwise start from scratch at next genmove. From now on we keep
+ * previous roots in the tree (frontends stepping through variations). */
+static bool
+uct_undo(engine_t *e, board_t *b)
+{
+	uct_t *u = (uct_t*)e->data;
+	if (u->slave)  return false;	/* Distributed: let the master handle it */
+
+	uct_pondering_stop(u);
+	u->pass_moveno = 0;		/* Saved dead groups are for another position */
+	u->undo_seen = true;
+	if (!u->t)  return true;
+
+	u->t->undo_max = u->undo_history;
+	uct_cache_save(u);
+	if (tree_undo(u->t) &&
+	    (!b->moves || (node_coord(u->t->root) == last_move(b).coord &&
+			   u->t->root_color == last_move(b).color))) {
+		if (UDEBUGL(3))  fprintf(stderr, "undo: back to previous root (%i playouts)\n", u->t->root->u.playouts);
+		return true;
+	}
+
+	if (UDEBUGL(3))  fprintf(stderr, "undo: previous root gone\n");
+	reset_state(u);
+	return true;
+}
+
 static void
 uct_stop(engine_t *e)
 {
@@ -456,6 +698,14 @@ uct_done(engine_t *e)
 	if (u->random_policy) u->random_policy->done(u->random_policy);
 	playout_policy_done(u->playout);
 	uct_prior_done(u->prior);
+#ifdef DCNN
+	dcnn_queue_stop();
+#endif
+	if (u->pin_cpus) {
+		uct_search_unpin_workers();
+		fifo_release_cpus();
+		free(u->pin_cpus);
+	}
 #ifdef PACHI_PLUGINS
 	pluginset_done(u->plugins);
 #endif
@@ -468,6 +718,12 @@ static int
 uct_search(uct_t *u, board_t *b, time_info_t *ti, enum stone color, tree_t *t, bool print_progress)
 {
 	uct_search_state_t s;
+#ifdef PERFSTATS
+	perfstats_t perf;  perfstats_get(&perf);
+	perfstats_set_game_phases(u->fuseki_end, u->yose_start);
+#endif
+	double time_start = time_now();
+	if (u->vloss_adapt)  uct_vloss_reset(u);
 	uct_search_start(u, b, color, t, ti, &s, 0);
 	if (UDEBUGL(2) && s.base_playouts > 0)
 		fprintf(stderr, "<pre-simulated %d games>\n", s.base_playouts);
@@ -478,9 +734,14 @@ uct_search(uct_t *u, board_t *b, time_info_t *ti, enum stone color, tree_t *t, b
 
 	/* Now, just periodically poll the search tree. */
 	/* Note that in case of TD_GAMES, threads will not wait for
-	 * the uct_search_check_stop() signalization. */
+	 * the uct_search_check_stop() signalization, and we don't
+	 * wait around either once they're done. */
 	while (1) {
-		time_sleep(TREE_BUSYWAIT_INTERVAL);
+		if (ti->dim == TD_GAMES)
+			for (int k = 0; k < 100 && uct_search_games(&s) <= s.stop.worst.playouts; k++)
+				time_sleep(TREE_BUSYWAIT_INTERVAL / 100);
+		else
+			time_sleep(TREE_BUSYWAIT_INTERVAL);
 		/* TREE_BUSYWAIT_INTERVAL should never be less than desired time, or the
 		 * time control is broken. But if it happens to be less, we still search
 		 * at least 100ms otherwise the move is completely random. */
@@ -488,10 +749,11 @@ uct_search(uct_t *u, board_t *b, time_info_t *ti, enum stone color, tree_t *t, b
 		int i = uct_search_games(&s);
 		/* Print notifications etc. */
 		uct_search_progress(u, b, color, t, ti, &s, i);
+		if (u->vloss_adapt)  uct_vloss_adapt(u);
 
-		if (s.fullmem && u->auto_alloc) {
-			/* Stop search, realloc tree and restart search */
-			if (uct_search_realloc_tree(u, b, color, ti, &s))  continue;
+		if (s.fullmem && (u->auto_alloc || u->tree_recycle)) {
+			/* Stop search, realloc tree / recycle nodes and restart search */
+			if (uct_search_fullmem(u, b, color, ti, &s))  continue;
 			break;
 		}
 		
@@ -507,6 +769,21 @@ uct_search(uct_t *u, board_t *b, time_info_t *ti, enum stone color, tree_t *t, b
 			t->avg_score.value, t->avg_score.playouts,
 			u->dynkomi->score.value, u->dynkomi->score.playouts,
 			u->dynkomi->value.value, u->dynkomi->value.playouts);
+	if (UDEBUGL(2) && u->vloss_adapt)
+		uct_vloss_print(u, stderr);
+	if (UDEBUGL(3)) {
+		strbuf(buf, 2048);
+		tree_shape_print(t, buf);
+		fprintf(stderr, "%s", buf->str);
+	}
+#ifdef PERFSTATS
+	if (UDEBUGL(2)) {
+		perfstats_t base = perf;
+		perfstats_get(&perf);
+		perfstats_sub(&perf, &base);
+		perfstats_fprint(stderr, &perf);
+	}
+#endif
 	if (print_progress)
 		uct_progress_status(u, t, b, color, 0, NULL);
 
@@ -529,7 +806,7 @@ uct_search(uct_t *u, board_t *b, time_info_t *ti, enum stone color, tree_t *t, b
 		u->playout->debug_level = u->debug_after.level;
 		uct_halt = false;
 
-		uct_playouts(u, b, color, t, &debug_ti);
+		uct_playouts(u, b, color, t, &debug_ti, 0);
 		tree_dump(t, u->dumpthres);
 
 		uct_halt = true;
@@ -540,6 +817,15 @@ uct_search(uct_t *u, board_t *b, time_info_t *ti, enum stone color, tree_t *t, b
 		fprintf(stderr, "--8<-- UCT debug post-run finished --8<--\n");
 	}
 
+	double elapsed = time_now() - time_start;
+	metric_add(METRIC_PLAYOUTS, ctx->games);
+	metric_add(METRIC_SEARCH_SECONDS, elapsed);
+	metric_set(METRIC_PLAYOUTS_RATE, (elapsed > 0 ? ctx->games / elapsed : 0));
+	metric_set(METRIC_ROOT_PLAYOUTS, u->t->root->u.playouts);
+	metric_set(METRIC_TREE_BYTES, u->t->nodes_size);
+	metric_set(METRIC_TREE_MAX_BYTES, u->t->max_tree_size);
+
+	u->games_played += ctx->games;
 #ifdef DISTRIBUTED
 	u->played_own += ctx->games;
 #endif
@@ -647,6 +933,14 @@ uct_genmove_setup(uct_t *u, board_t *b, enum stone color)
 		b->superko_violation = false;
 	}
 
+#ifdef DISTRIBUTED
+	/* Got dcnn priors from the master but the tree was built without. */
+	if (u->t && uct_slave_root_policy(u, b, color) && !(u->t->root->hints & TREE_HINT_DCNN)) {
+		u->initial_extra_komi = u->t->extra_komi;
+		reset_state(u);
+	}
+#endif
+
 	uct_prepare_move(u, b, color);
 
 	assert(u->t);
@@ -659,6 +953,136 @@ uct_genmove_setup(uct_t *u, board_t *b, enum stone color)
 	setup_dynkomi(u, b, color);
 }
 
+/* Several dcnns loaded: pick one for this move, a net evaluation may
+ * take dcnn_select of the time we want to spend on it. Game phase comes
+ * in through time allocation. Fixed playouts / no time limit: strongest. */
+static void
+uct_dcnn_select(uct_t *u, board_t *b, time_info_t *ti)
+{
+	double budget = -1;
+	if (ti->type != TT_NULL && ti->dim == TD_WALLTIME) {
+		time_info_t t = *ti;
+		time_stop_t stop;
+		time_stop_conditions(&t, b, u->fuseki_end, u->yose_start, u->max_maintime_ratio, &stop);
+		budget = stop.desired.time * u->dcnn_select;
+	}
+	dcnn_select(b, budget);
+}
+
+/* Nearly out of time ? Less than emergency_time left for this move once
+ * net lag is accounted for (negative: severe time shortage). */
+static bool
+uct_emergency(uct_t *u, board_t *b, time_info_t *ti)
+{
+	if (!u->emergency || ti->type == TT_NULL || ti->dim != TD_WALLTIME)
+		return false;
+	time_info_t t = *ti;
+	time_stop_t stop;
+	time_stop_conditions(&t, b, u->fuseki_end, u->yose_start, u->max_maintime_ratio, &stop);
+	return (stop.worst.time < u->emergency_time);
+}
+
+/* Minimum playouts for tree's best move to be trusted in emergency mode. */
+#define EMERGENCY_TREE_PLAYOUTS 100
+
+static bool
+emergency_move_ok(board_t *b, enum stone color, coord_t c)
+{
+	return (!is_pass(c) && board_is_valid_play_no_suicide(b, color, c) &&
+		!board_is_one_point_eye(b, c, color));
+}
+
+/* Best move from the tree if it's clear already (pondering), @best_node
+ * set then. No search, tree must be for this position. */
+static coord_t
+emergency_tree_move(uct_t *u, board_t *b, enum stone color, tree_node_t **best_node)
+{
+	if (!u->t || u->t->untrustworthy_tree || color != board_to_play(b))
+		return pass;
+
+	tree_node_t *best = NULL, *best2 = NULL;
+	foreach_child(u->t->root, ni) {
+		if (!best || ni->u.playouts > best->u.playouts)  {  best2 = best;  best = ni;  }
+		else if (!best2 || ni->u.playouts > best2->u.playouts)  best2 = ni;
+	}
+	if (!best || best->u.playouts < EMERGENCY_TREE_PLAYOUTS ||
+	    (best2 && best->u.playouts < u->best2_ratio * best2->u.playouts) ||
+	    !emergency_move_ok(b, color, node_coord(best)))
+		return pass;
+
+	*best_node = best;
+	return node_coord(best);
+}
+
+/* Best move according to dcnn if an evaluation fits in emergency_cap,
+ * or patterns. */
+static coord_t
+emergency_prior_move(uct_t *u, board_t *b, enum stone color, char **source)
+{
+#ifdef DCNN
+	if (using_dcnn(b) && dcnn_latency() && dcnn_latency() <= u->emergency_cap) {
+		float r[board_rsize(b) * board_rsize(b)];
+		float best_r[DCNN_BEST_N];
+		coord_t best_c[DCNN_BEST_N];
+		dcnn_evaluate_quiet(b, color, r);
+		get_dcnn_best_moves(b, r, best_c, best_r, DCNN_BEST_N);
+		*source = "dcnn";
+		for (int i = 0; i < DCNN_BEST_N; i++)
+			if (emergency_move_ok(b, color, best_c[i]))
+				return best_c[i];
+	}
+#endif
+
+	if (using_patterns()) {
+		/* Last search's ownermap, no time for mcowner playouts. */
+		ownermap_t blank, *ownermap = &u->ownermap;
+		if (ownermap->playouts < GJ_MINGAMES) {
+			ownermap_init(&blank);
+			blank.playouts = GJ_MINGAMES;
+			ownermap = &blank;
+		}
+		floating_t probs[b->flen];
+		pattern_rate_moves_fast(&u->pc, b, color, probs, ownermap, 0.001, NULL);
+		coord_t best = pass;
+		floating_t best_prob = 0;
+		for (int f = 0; f < b->flen; f++)
+			if (!isnan(probs[f]) && probs[f] > best_prob && emergency_move_ok(b, color, b->f[f])) {
+				best = b->f[f];  best_prob = probs[f];
+			}
+		*source = "patterns";
+		if (!is_pass(best))  return best;
+	}
+
+	/* Nothing else, any sensible move. */
+	*source = "random";
+	int start = (b->flen ? fast_random(b->flen) : 0);
+	for (int i = 0; i < b->flen; i++) {
+		coord_t c = b->f[(start + i) % b->flen];
+		if (emergency_move_ok(b, color, c))  return c;
+	}
+	return pass;
+}
+
+/* Emergency move when the clock is nearly out: guaranteed latency, no tree
+ * setup, mcowner or thread startup. Tree's best move if it's clear already,
+ * priors only otherwise. @best_node set if move is from the tree. */
+static coord_t
+uct_genmove_emergency(uct_t *u, board_t *b, enum stone color, tree_node_t **best_node)
+{
+	double time_start = time_now();
+	*best_node = NULL;
+	uct_pondering_stop(u);
+
+	char *source = "tree";
+	coord_t c = emergency_tree_move(u, b, color, best_node);
+	if (!*best_node)
+		c = emergency_prior_move(u, b, color, &source);
+
+	if (UDEBUGL(1))
+		fprintf(stderr, "emergency move %s (%s) in %0.3fs\n", coord2sstr(c), source, time_now() - time_start);
+	return c;
+}
+
 static tree_node_t *
 genmove(engine_t *e, board_t *b, time_info_t *ti, enum stone color, bool pass_all_alive, coord_t *best_coord)
 {
@@ -668,6 +1092,7 @@ genmove(engine_t *e, board_t *b, time_info_t *ti, enum stone color, bool pass_al
 	u->mcts_time = 0;
 
 	uct_pondering_stop(u);
+	uct_dcnn_select(u, b, ti);
 
 	if (u->t) {
 		bool unexpected_color = (color != board_to_play(b));  /* playing twice in a row ?? */
@@ -693,6 +1118,7 @@ genmove(engine_t *e, board_t *b, time_info_t *ti, enum stone color, bool pass_al
 		double mcts_time  = u->mcts_time + 0.000001; /* avoid divide by zero */
 		fprintf(stderr, "genmove in %0.2fs, mcts %0.2fs (%d games/s, %d games/s/thread)\n",
 			total_time, mcts_time, (int)(played_games/mcts_time), (int)(played_games/mcts_time/u->threads));
+		uct_prior_print_stats(u->prior);
 	}
 
 	uct_progress_status(u, u->t, b, color, 0, best_coord);
@@ -706,7 +1132,16 @@ uct_genmove(engine_t *e, board_t *b, time_info_t *ti, enum stone color, bool pas
 	uct_t *u = (uct_t*)e->data;
 
 	coord_t best;
-	tree_node_t *best_node = genmove(e, b, ti, color, pass_all_alive, &best);
+	tree_node_t *best_node = NULL;
+	if (uct_emergency(u, b, ti)) {
+		best = uct_genmove_emergency(u, b, color, &best_node);
+		/* Not from the tree, it's no good for next move. */
+		if (!best_node) {
+			if (u->t)  {  u->initial_extra_komi = u->t->extra_komi;  reset_state(u);  }
+			return best;
+		}
+	} else
+		best_node = genmove(e, b, ti, color, pass_all_alive, &best);
 
 	/* Pass or resign.
 	 * After a pass, pondering is harmful for two reasons:
@@ -726,9 +1161,12 @@ uct_genmove(engine_t *e, board_t *b, time_info_t *ti, enum stone color, bool pas
 		uct_genmove_pondering_save_replies(u, b, color, best);
 	
 	/* Promote node or throw away tree as needed.
-	 * Reset now if we don't reuse tree, avoids unnecessary tree gc. */
+	 * Reset now if we don't reuse tree, avoids unnecessary tree gc.
+	 * If pondering, leave tree gc to the pondering thread manager so
+	 * we can reply right away. */
+	bool gc = !(u->pondering_opt && u->background_gc);
 	if (!reusing_tree(u, b) ||
-	    !tree_promote_node(u->t, best_node, b, NULL)) {
+	    !tree_promote_node(u->t, best_node, b, gc, NULL)) {
 		/* Preserve dynamic komi information though, that is important. */
 		u->initial_extra_komi = u->t->extra_komi;
 		reset_state(u);
@@ -758,13 +1196,20 @@ uct_genmove_analyze(engine_t *e, board_t *b, time_info_t *ti, enum stone color,
 
 /* Start tree search in the background and output stats for the sake of
  * frontend running Pachi: sortof like pondering without a genmove.
- * Stop processing if @start is 0. */
+ * Stop processing if @start is 0, stop output only if @start is -1. */
 static void
 uct_analyze(engine_t *e, board_t *b, enum stone color, int start)
 {
 	uct_t *u = (uct_t*)e->data;
 	int flags = (pondering(u) ? u->search_flags : 0);
 	bool genmove_pondering = genmove_pondering(u);
+
+	if (start < 0) {
+		if (!pondering(u))  return;
+		uct_pondering_stop(u);		/* resets reporting */
+		uct_pondering_start(u, b, u->t, stone_other(u->t->root_color), 0, flags);
+		return;
+	}
 	
 	if (!start) {
 		if (pondering(u))  uct_pondering_stop(u);	/* clears flags ! */
@@ -788,6 +1233,11 @@ uct_analyze(engine_t *e, board_t *b, enum stone color, int start)
 	u->reporting = UR_LEELA_ZERO;
 	u->report_fh = stdout;          /* Reset in uct_pondering_stop() */
 	if (!u->t)  uct_prepare_move(u, b, color);
+
+	/* Analysed this position before ? */
+	u->t_key = tree_cache_key(b, color);
+	tree_cache_restore(u->t_key, b, u->t);
+	u->t_analyzed = true;
 	uct_pondering_start(u, b, u->t, color, 0, flags);
 }
 
@@ -803,10 +1253,14 @@ uct_get_best_moves_at(uct_t *u, tree_node_t *parent, coord_t *best_c, float *bes
 		best_c[i] = pass;  best_r[i] = 0;  best_n[i] = NULL;
 	}
 	
-	/* Find best moves */
-	for (tree_node_t *n = parent->children; n; n = n->sibling)
-		if (n->u.playouts >= min_playouts)
-			best_moves_add_full(node_coord(n), n->u.playouts, n, best_c, best_r, (void**)best_n, nbest);
+	/* Find best moves (root: top list, see tree_topk_t) */
+	tree_node_t *top[nbest];
+	int found = tree_top_children(u->t, parent, top, nbest);
+	for (int i = 0; i < found && top[i]->u.playouts >= min_playouts; i++) {
+		best_c[i] = node_coord(top[i]);
+		best_r[i] = top[i]->u.playouts;
+		best_n[i] = top[i];
+	}
 
 	if (winrates)  /* Get winrates */
 		for (int i = 0; i < nbest && best_n[i]; i++)
@@ -822,28 +1276,54 @@ uct_get_best_moves(uct_t *u, coord_t *best_c, float *best_r, int nbest, bool win
 	uct_get_best_moves_at(u, u->t->root, best_c, best_r, nbest, winrates, min_playouts);
 }
 
-/* Kindof like uct_genmove() but find the best candidates */
+/* Whether search tree root is current position, @color to play. */
+#define tree_at_position(u, b, color) \
+	((u)->t && (u)->t->root_color == stone_other(color) && \
+	 node_coord((u)->t->root) == last_move(b).coord)
+
+/* Kindof like uct_genmove() but find the best candidates.
+ * If we're searching this position in the background already
+ * (pondering, lz-analyze) just read them from the live tree.
+ * Tree is kept afterwards if we reuse trees: next play promotes it
+ * so reviewing a game move after move (pachi-review) doesn't start
+ * from scratch at each position. */
 static void
 uct_best_moves(engine_t *e, board_t *b, time_info_t *ti, enum stone color,
 	       coord_t *best_c, float *best_r, int nbest)
 {
 	uct_t *u = (uct_t*)e->data;
+	if (pondering(u) && tree_at_position(u, b, color)) {
+		uct_get_best_moves(u, best_c, best_r, nbest, true, 100);
+		return;
+	}
+
 	uct_pondering_stop(u);
-	if (u->t)
+	if (u->t && !tree_at_position(u, b, color))
 		reset_state(u);	
 	
 	coord_t best_coord;
 	genmove(e, b, ti, color, 0, &best_coord);
 	uct_get_best_moves(u, best_c, best_r, nbest, true, 100);
 
-	if (u->t)	
+	if (u->t && !reusing_tree(u, b))
 		reset_state(u);
 }
 
 bool
-uct_gentbook(engine_t *e, board_t *b, time_info_t *ti, enum stone color)
+uct_gentbook(engine_t *e, board_t *b, time_info_t *ti, enum stone color, char *filename, coord_t *path, int path_len)
 {
 	uct_t *u = (uct_t*)e->data;
+	if (path_len > TBOOK_MAX_PATH)
+		return false;
+	if (filename) {
+		/* Worker for tree_merge_tbooks(): search from scratch,
+		 * stats from the tbook would get counted twice. */
+		if (u->t)  reset_state(u);
+		bool no_tbook = u->no_tbook;
+		u->no_tbook = true;
+		uct_prepare_move(u, b, color);
+		u->no_tbook = no_tbook;
+	}
 	if (!u->t) uct_prepare_move(u, b, color);
 	assert(u->t);
 
@@ -854,11 +1334,17 @@ uct_gentbook(engine_t *e, board_t *b, time_info_t *ti, enum stone color)
 	uct_search(u, b, ti, color, u->t, true);
 
 	assert(ti->dim == TD_GAMES);
-	tree_save(u->t, b, ti->games / 100);
+	tree_save(u->t, b, ti->games / 100, filename, path, path_len);
 
 	return true;
 }
 
+bool
+uct_mergetbook(engine_t *e, board_t *b, char **files, int nfiles)
+{
+	return tree_merge_tbooks(b, files, nfiles);
+}
+
 void
 uct_dumptbook(engine_t *e, board_t *b, enum stone color)
 {
@@ -870,6 +1356,63 @@ uct_dumptbook(engine_t *e, board_t *b, enum stone color)
 	tree_done(t);
 }
 
+/* Save search tree snapshot, game record is saved by caller.
+ * Pondering is stopped, resumes at next genmove. */
+bool
+uct_savetree(engine_t *e, board_t *b, FILE *f)
+{
+	uct_t *u = (uct_t*)e->data;
+	if (!u->t || !b->moves)
+		return false;
+	uct_pondering_stop(u);
+
+	hash_t hash = b->hash;
+	return (fwrite(&hash, sizeof(hash), 1, f) == 1 &&
+		tree_save_snapshot(u->t, f));
+}
+
+/* Tree shape stats of current search tree (see tree_shape_t).
+ * Returns false if there's no tree. */
+bool
+uct_tree_shape(engine_t *e, strbuf_t *buf)
+{
+	uct_t *u = (uct_t*)e->data;
+	if (!u->t)
+		return false;
+	tree_shape_print(u->t, buf);
+	return true;
+}
+
+/* Restore search tree snapshot saved by uct_savetree().
+ * Board must be in the position the snapshot was saved in. */
+bool
+uct_loadtree(engine_t *e, board_t *b, FILE *f)
+{
+	uct_t *u = (uct_t*)e->data;
+	hash_t hash;
+	if (fread(&hash, sizeof(hash), 1, f) != 1 || hash != b->hash || !b->moves)
+		return false;
+	uct_pondering_stop(u);
+
+	tree_t *t = tree_load_snapshot(f, u->tree_size, uct_tree_reserve_size(u), stats_hbits(u));
+	if (!t)
+		return false;
+	if (node_coord(t->root) != last_move(b).coord || t->root_color != last_move(b).color) {
+		tree_done(t);
+		return false;
+	}
+	if (u->tt_bits)
+		tree_tt_init(t, u->tt_bits, u->tt_eqex);
+	t->gc_threads = u->threads;
+
+	if (u->t)  reset_state(u);
+	u->t = t;
+	u->main_board = b;
+	if (UDEBUGL(2))  fprintf(stderr, "Loaded tree snapshot, %i Mb, %i playouts.\n",
+				 (int)(t->nodes_size / (1024 * 1024)), t->root->u.playouts);
+	return true;
+}
+
 
 floating_t
 uct_evaluate_one(engine_t *e, board_t *b, time_info_t *ti, coord_t c, enum stone color)
@@ -920,6 +1463,34 @@ log_nthreads(uct_t *u)
 	if (DEBUGL(0) && !logged++)  fprintf(stderr, "Threads: %i\n", u->threads);
 }
 
+/* Worker threads cpu placement, see "pin_threads". Cpus are claimed through
+ * the fifo if possible so that instances on the same host don't share them. */
+static void
+uct_pin_init(uct_t *u)
+{
+	int cpus[1024];
+	int n = cpu_placement(cpus, 1024, u->pin_node);
+	if (!n) {
+		if (DEBUGL(1))  fprintf(stderr, "uct: cpu topology unknown, threads not pinned\n");
+		return;
+	}
+	int claimed = fifo_claim_cpus(cpus, n, u->threads);
+	if (claimed)  n = claimed;
+
+	u->pin_ncpus = n;
+	u->pin_cpus = cmalloc(n * sizeof(int));
+	memcpy(u->pin_cpus, cpus, n * sizeof(int));
+	if (u->pin_node >= 0 && u->tree_numa == TREE_NUMA_DEFAULT)
+		u->tree_numa = u->pin_node;
+
+	if (DEBUGL(2)) {
+		fprintf(stderr, "uct: pinning threads to cpus");
+		for (int i = 0; i < n && i < u->threads; i++)
+			fprintf(stderr, " %i", cpus[i]);
+		fprintf(stderr, "%s\n", (u->threads > n ? " (shared)" : ""));
+	}
+}
+
 size_t
 uct_default_tree_size()
 {
@@ -930,12 +1501,74 @@ uct_default_tree_size()
 	return (size_t)100 * mult * 1048576;
 }
 
+#define CONTAINER_MEM_PERCENT 75
+
+/* Running in a container with memory limit: derive max_mem from it unless
+ * set, and start with a smaller tree if limit is tight. Host memory is
+ * what we'd see otherwise, and we'd get killed growing the tree. Tree gc
+ * thresholds follow tree size. (Default thread count honors container cpu
+ * quota, see get_default_threads()) */
+static void
+uct_container_mem_init(uct_t *u)
+{
+	size_t limit = get_container_mem();
+	if (!limit || u->max_mem)  return;
+
+	/* Leave room for the rest: dcnn, patterns, temp tree during gc ... */
+	u->max_mem = limit / 100 * CONTAINER_MEM_PERCENT;
+	if (u->tree_size > u->max_mem / 4)
+		u->tree_size = u->max_mem / 4;
+	if (DEBUGL(2))  fprintf(stderr, "uct: container memory limit %i Mb, max_mem %i Mb\n",
+				(int)(limit / (1024 * 1024)), (int)(u->max_mem / (1024 * 1024)));
+}
+
+static void *
+uct_patterns_load_thread(void *arg)
+{
+	uct_t *u = (uct_t*)arg;
+	patterns_init(&u->pc, NULL, false, true);
+	return NULL;
+}
+
+/* Load data files. Patterns load in the background meanwhile dcnn weights
+ * or joseki get read. Joseki only if dcnn isn't going to be used.
+ * Joseki loading quiets debug output at high debug levels, patterns
+ * must be done by then. */
+static void
+uct_data_init(uct_t *u, board_t *b, bool pat_setup)
+{
+	pthread_t thread;
+	bool background = (!pat_setup && !pthread_create(&thread, NULL, uct_patterns_load_thread, u));
+	if (!pat_setup && !background)  patterns_init(&u->pc, NULL, false, true);
+
+	dcnn_init(b);
+	if (background && DEBUGL(2)) {  pthread_join(thread, NULL);  background = false;  }
+	if (!using_dcnn(b))  joseki_load(board_rsize(b));
+	if (background)  pthread_join(thread, NULL);
+}
+
+/* Memory limits for main tree, (size_t)-1 if none.
+ * With root parallelization group trees come out of the same budget: each
+ * one gets 1/groups of main tree size (see uct_search_group_tree()) so main
+ * tree gets groups / (2 * groups - 1) of the limits. */
+void
+uct_tree_limits(uct_t *u, size_t *max_tree_size, size_t *max_mem)
+{
+	*max_tree_size = (u->max_tree_size_opt ? u->max_tree_size_opt : (size_t)-1);
+	*max_mem = (u->max_mem ? u->max_mem : (size_t)-1);
+	if (u->thread_model != TM_ROOT)  return;
+
+	int groups = uct_search_root_groups(u);
+	if (u->max_tree_size_opt)  *max_tree_size = *max_tree_size / (2 * groups - 1) * groups;
+	if (u->max_mem)            *max_mem = *max_mem / (2 * groups - 1) * groups;
+}
+
 /* Set current tree size to use taking memory limits into account */
 void
 uct_tree_size_init(uct_t *u, size_t tree_size)
 {
-	size_t max_tree_size = (u->max_tree_size_opt ? u->max_tree_size_opt : (size_t)-1);
-	size_t max_mem = (u->max_mem ? u->max_mem : (size_t)-1);
+	size_t max_tree_size, max_mem;
+	uct_tree_limits(u, &max_tree_size, &max_mem);
 
 	/* fixed_mem: can use either "tree_size" or "max_tree_size"
 	 * to set amount of memory to allocate.
@@ -1047,6 +1680,23 @@ uct_setoption(engine_t *e, board_t *b, const char *optname, char *optval,
 		 * for us. */
 		u->allow_losing_pass = !optval || atoi(optval);
 	}
+	else if (!strcasecmp(optname, "score_est_playouts") && optval) {
+		/* Incremental score estimation (pachi-score_est, live game
+		 * commentary): keep ownermap across moves and only play this
+		 * many playouts to update it, points around the new moves
+		 * get refreshed. Much faster than the usual 500 playouts per
+		 * position. Default: 0 (off) */
+		u->score_est_playouts = atoi(optval);
+	}
+	else if (!strcasecmp(optname, "scoring_time") && optval) {
+		/* Fast scoring of finished games (final_score,
+		 * final_status_list): instead of the usual 500 playouts
+		 * to find dead stones, only play as many as needed to
+		 * settle groups which are not pass-alive or in seki,
+		 * for at most this many seconds (64 playouts minimum).
+		 * Useful to score lots of games. Default: 0 (off) */
+		u->scoring_time = atof(optval);
+	}
 	else if (!strcasecmp(optname, "stones_only")) {
 		/* Do not count eyes. Nice to teach go to kids.
 		 * http://strasbourg.jeudego.org/regle_strasbourgeoise.htm */
@@ -1114,12 +1764,15 @@ uct_setoption(engine_t *e, board_t *b, const char *optname, char *optval,
 		 * moggy is the default policy with large
 		 * amount of domain-specific knowledge and
 		 * heuristics. light is a simple uniformly
-		 * random move selection policy. */
+		 * random move selection policy. pattern picks
+		 * moves around last move according to mm
+		 * pattern gammas (slow, but smarter). */
 		char *playoutarg = strchr(optval, ':');
 		if (playoutarg)
 			*playoutarg++ = 0;
 		if      (!strcasecmp(optval, "moggy"))  u->playout = playout_moggy_init(playoutarg, b);
 		else if (!strcasecmp(optval, "light"))  u->playout = playout_light_init(playoutarg, b);
+		else if (!strcasecmp(optval, "pattern"))  u->playout = playout_pattern_init(playoutarg, b);
 		else    option_error("UCT: Invalid playout policy %s\n", optval);
 	}
 	else if (!strcasecmp(optname, "prior") && optval) {  NEED_RESET
@@ -1128,7 +1781,9 @@ uct_setoption(engine_t *e, board_t *b, const char *optname, char *optval,
 		 * (most importantly, based on playout policy
 		 * opinion, but also with regard to other
 		 * things). See uct/prior.c for details.
-		 * Use prior=eqex=0 to disable priors. */
+		 * Use prior=eqex=0 to disable priors.
+		 * prior=timing shows time spent in each prior provider,
+		 * prior=budget=USECS disables providers slower than that. */
 		u->prior = uct_prior_init(optval, b, u);
 	}
 	else if (!strcasecmp(optname, "mercy") && optval) {
@@ -1138,6 +1793,13 @@ uct_setoption(engine_t *e, board_t *b, const char *optname, char *optval,
 		 * accuracy. */
 		u->mercymin = atoi(optval);
 	}
+	else if (!strcasecmp(optname, "cutoff") && optval) {
+		/* Check every n moves if playout result is
+		 * decided already (pass-alive groups and their
+		 * territory are enough to win) and stop early.
+		 * 0: play all playouts to the end. */
+		u->cutoff = atoi(optval);
+	}
 	else if (!strcasecmp(optname, "gamelen") && optval) {
 		/* Maximum length of single simulation
 		 * in moves. */
@@ -1148,6 +1810,40 @@ uct_setoption(engine_t *e, board_t *b, const char *optname, char *optval,
 		 * visited this many times. */
 		u->expand_p = atoi(optval);
 	}
+	else if (!strcasecmp(optname, "lazy_expand") && optval) {
+		/* Lazy expansion (progressive widening): Only create this
+		 * many children (best ones by prior, plus pass) when a node
+		 * is expanded, remaining moves are kept in a compact list
+		 * and get added as node playouts grow. Much less memory per
+		 * expansion, so deeper trees within max_tree_size.
+		 * Default: 0 (off, all moves get a node on expansion).
+		 * Pending moves keep their expansion-time priors (dcnn_async
+		 * and pattern_lazy only update created children). */
+		u->lazy_expand = atoi(optval);
+		if (u->lazy_expand < 0)
+			option_error("UCT: Invalid lazy_expand value %s\n", optval);
+	}
+	else if (!strcasecmp(optname, "widen_playouts") && optval) {
+		/* Lazy expansion: node children get doubled once node has
+		 * widen_playouts * (children / lazy_expand)^2 playouts,
+		 * so about lazy_expand * sqrt(playouts / widen_playouts)
+		 * children. Default: 40 */
+		u->widen_playouts = atoi(optval);
+		if (u->widen_playouts < 1)
+			option_error("UCT: Invalid widen_playouts value %s\n", optval);
+	}
+	else if (!strcasecmp(optname, "settled_prune")) {
+		/* Leave points settled according to ownermap alone: with
+		 * ownermap confidence above this (default 0.95) they don't
+		 * get a node on expansion and random playout moves there are
+		 * mostly rejected. Shrinks branching (and memory) in the
+		 * late middle game and endgame. Points next to last move, to
+		 * groups short of liberties or while there's a ko are kept.
+		 * Needs ownermap: mcowner playouts get played if needed. */
+		u->settled_prune = (optval ? atof(optval) : 0.95);
+		if (u->settled_prune && (u->settled_prune <= 0.5 || u->settled_prune > 1))
+			option_error("UCT: Invalid settled_prune value %s\n", optval);
+	}
 	else if (!strcasecmp(optname, "random_policy_chance") && optval) {
 		/* If specified (N), with probability 1/N, random_policy policy
 		 * descend is used instead of main policy descend; useful
@@ -1185,7 +1881,7 @@ uct_setoption(engine_t *e, board_t *b, const char *optname, char *optval,
 	/** Performance and memory management */
 
 	else if (!strcasecmp(optname, "threads") && optval) {
-		/* Default: 1 thread per core. */
+		/* Default: 1 thread per core (container cpu quota if lower). */
 		u->threads = atoi(optval);
 	}
 	else if (!strcasecmp(optname, "thread_model") && optval) {
@@ -1200,13 +1896,138 @@ uct_setoption(engine_t *e, board_t *b, const char *optname, char *optval,
 			 * rages most threads choosing the
 			 * same tree branches to read. */
 			u->thread_model = TM_TREEVL;
+		} else if (!strcasecmp(optval, "root")) {
+			/* Root parallelization - each group of threads
+			 * searches its own tree, stats of top levels are
+			 * merged into main tree periodically. Avoids
+			 * contention near the root with many threads.
+			 * Group trees share the memory limits with main
+			 * tree. See "root_groups". */
+			u->thread_model = TM_ROOT;
+		} else if (!strcasecmp(optval, "leaf")) {
+			/* Tree parallelization with several playouts
+			 * from each leaf, see "leaf_playouts". */
+			u->thread_model = TM_LEAF;
 		} else
 			option_error("UCT: Invalid thread model %s\n", optval);
 	}
+	else if (!strcasecmp(optname, "root_groups") && optval) {
+		/* Number of trees for root parallelization.
+		 * Default: 1 tree per 8 threads (at least 2) */
+		u->root_groups = atoi(optval);
+	}
+	else if (!strcasecmp(optname, "pin_threads")) {  NEED_RESET
+		/* Pin worker threads to cpus (Linux and Windows). Default: off
+		 * Threads go one per physical core first, SMT siblings are used
+		 * only once every core has one. With a FIFO build, instances
+		 * claim disjoint cpu sets and stop queuing for their turn if
+		 * there are enough free cpus for all their threads. */
+		u->pin_threads = !optval || atoi(optval);
+	}
+	else if (!strcasecmp(optname, "pin_node") && optval) {  NEED_RESET
+		/* With pin_threads, keep worker threads on this NUMA node, tree
+		 * memory is allocated there as well (unless tree_numa is set).
+		 * Default: use all nodes */
+		if (!isdigit(*optval))
+			option_error("UCT: Invalid pin_node value %s\n", optval);
+		u->pin_node = atoi(optval);
+		u->pin_threads = true;
+	}
+	else if (!strcasecmp(optname, "leaf_playouts") && optval) {
+		/* Number of playouts from each leaf. Default: 1, 4 for leaf
+		 * parallelization. They run one after another on the thread
+		 * that reached the leaf: saves descents (and contention near
+		 * the root), doesn't run anything more in parallel. */
+		u->leaf_playouts = atoi(optval);
+		if (u->leaf_playouts < 1)
+			option_error("UCT: Invalid leaf_playouts value %s\n", optval);
+	}
+	else if (!strcasecmp(optname, "value_weight") && optval) {
+		/* Evaluate leaves with the dcnn value head (if net has one)
+		 * and mix it with playout results: this is the weight of the
+		 * value (0-1). Default: 0 (off, playouts only)
+		 * 1: value replaces playouts (no amaf / score stats from leaves
+		 * then). With several threads evaluations are batched through
+		 * the dcnn queue (batch size: threads, or dcnn_async if set),
+		 * playouts run meanwhile. Value nets are trained for a given
+		 * komi, board sizes are those the net supports (fully
+		 * convolutional nets can do smaller boards). */
+		u->value_weight = atof(optval);
+		if (u->value_weight < 0 || u->value_weight > 1)
+			option_error("UCT: Invalid value_weight value %s\n", optval);
+	}
 	else if (!strcasecmp(optname, "virtual_loss") && optval) {
 		/* Number of virtual losses added before evaluating a node. */
 		u->virtual_loss = atoi(optval);
 	}
+	else if (!strcasecmp(optname, "vloss_adapt")) {
+		/* Adaptive virtual loss (treevl thread model): measure how
+		 * often descents collide (go through a node another thread
+		 * is already in) at each tree depth, and scale virtual loss
+		 * at runtime to keep collisions around target rate.
+		 * vloss_adapt=N: target collision rate in percent (default 10).
+		 * Adaptation is shown in search summary (-d2). */
+		u->vloss_adapt = (optval ? atoi(optval) : 10);
+		if (u->vloss_adapt < 0 || u->vloss_adapt > 100)
+			option_error("UCT: Invalid vloss_adapt value %s\n", optval);
+	}
+	else if (!strcasecmp(optname, "batch_backprop") && optval) {
+		/* Number of playouts each thread keeps results locally before
+		 * updating the tree. Default: 0 (update after each playout)
+		 * Reduces contention on nodes near the root with many threads,
+		 * virtual loss of pending playouts is kept meanwhile. */
+		u->batch_backprop = atoi(optval);
+		if (u->batch_backprop < 0 || u->batch_backprop > 10000)
+			option_error("UCT: Invalid batch_backprop value %s\n", optval);
+	}
+	else if (!strcasecmp(optname, "dcnn_async") && optval) {  NEED_RESET
+		/* Evaluate tree nodes with dcnn asynchronously, in batches of
+		 * this size. Default: 0 (off, only root node gets dcnn priors)
+		 * Expanded nodes start with regular priors and get dcnn priors
+		 * added when evaluation is done. Virtual loss is applied
+		 * meanwhile. */
+		u->dcnn_async = atoi(optval);
+		if (u->dcnn_async < 0 || u->dcnn_async > 256)
+			option_error("UCT: Invalid dcnn_async value %s\n", optval);
+	}
+	else if (!strcasecmp(optname, "dcnn_visits") && optval) {  NEED_RESET
+		/* Inner tree nodes get dcnn priors once they have this many
+		 * playouts. Default: 0 (off) Requests go through the dcnn_async
+		 * queue (batch size: dcnn_async, or 16), when results come back
+		 * dcnn priors replace node children priors (patterns etc).
+		 * Descents don't wait for them. Expansion-time dcnn_async
+		 * requests are off then. See also dcnn_rate. */
+		u->dcnn_visits = atoi(optval);
+		if (u->dcnn_visits < 0)
+			option_error("UCT: Invalid dcnn_visits value %s\n", optval);
+	}
+	else if (!strcasecmp(optname, "dcnn_rate") && optval) {
+		/* dcnn_visits: max dcnn requests per second, nodes wait for
+		 * their turn once budget is spent. Size it so that the net
+		 * is kept busy. Default: 0 (no limit) */
+		u->dcnn_rate = atoi(optval);
+		if (u->dcnn_rate < 0)
+			option_error("UCT: Invalid dcnn_rate value %s\n", optval);
+	}
+	else if (!strcasecmp(optname, "dcnn_select") && optval) {
+		/* Several dcnns loaded (--dcnn=name1,name2...): each move use
+		 * strongest net whose evaluation takes at most this share of
+		 * the time for the move (measured latency), fastest net if
+		 * none fits. Default: 0.1 */
+		u->dcnn_select = atof(optval);
+		if (u->dcnn_select < 0)
+			option_error("UCT: Invalid dcnn_select value %s\n", optval);
+	}
+	else if (!strcasecmp(optname, "pattern_lazy") && optval) {
+		/* Add pattern priors to tree nodes lazily, once they've been
+		 * visited this many times. Default: 0 (off, pattern priors at
+		 * expansion time). Nodes get expanded with cheap priors (3x3
+		 * patterns, eyes, ko ...) meanwhile, keeps expensive pattern
+		 * matching out of the descent path. Root always gets patterns. */
+		u->pattern_lazy = atoi(optval);
+		if (u->pattern_lazy < 0)
+			option_error("UCT: Invalid pattern_lazy value %s\n", optval);
+	}
 	else if (!strcasecmp(optname, "auto_alloc")) {  NEED_RESET
 	        /* Automatically grow tree memory during search (default)
 		 * If tree memory runs out will allocate bigger space and resume
@@ -1222,9 +2043,35 @@ uct_setoption(engine_t *e, board_t *b, const char *optname, char *optval,
 		 * or "max_tree_size" to control how much memory is allocated. */
 		u->auto_alloc = false;
 	}
+	else if (!strcasecmp(optname, "analyze_cache") && optval) {
+		/* Memory budget [MiB] for analysis subtree cache (default: 0, off)
+		 * Frontends browsing variations: trees of positions analysed with
+		 * lz-analyze are kept when we leave them and restored when we
+		 * come back, instead of starting from scratch. Process-wide,
+		 * survives engine resets. See uct/cache.h */
+		tree_cache_set_size((size_t)atoll(optval) * 1048576);
+	}
+	else if (!strcasecmp(optname, "undo_history") && optval) {
+		/* Previous tree roots kept for undo (default 16, 0: off)
+		 * Once we get an undo, old roots are kept in the tree so that
+		 * undo / replay don't lose search (tree gets collected less
+		 * often then). Gone after tree gc, we start from scratch then. */
+		u->undo_history = atoi(optval);
+		if (u->undo_history < 0 || u->undo_history > TREE_UNDO_MAX)
+			option_error("UCT: Invalid undo_history value %s\n", optval);
+	}
+	else if (!strcasecmp(optname, "tree_recycle")) {  NEED_RESET
+		/* Bounded memory: when tree memory is full and can't grow
+		 * (max_tree_size / max_mem reached, or fixed_mem) drop least
+		 * visited subtrees and keep searching instead of stopping.
+		 * Value: percent of tree memory kept, default 50. */
+		u->tree_recycle = (optval ? atoi(optval) : 50);
+		if (u->tree_recycle < 0 || u->tree_recycle > 90)
+			option_error("UCT: Invalid tree_recycle value %s\n", optval);
+	}
 	else if (!strcasecmp(optname, "max_mem") && optval) {  NEED_RESET
 		/* Maximum amount of memory [MiB] used
-		 * Default: Unlimited
+		 * Default: Unlimited (75% of memory limit in a container)
 		 * By default tree memory grows automatically, use this to limit
 		 * global memory usage when using long thinking times (unlike
 		 * "max_tree_size" takes temp tree into account when reallocating). */
@@ -1247,12 +2094,58 @@ uct_setoption(engine_t *e, board_t *b, const char *optname, char *optval,
 		 * limit global memory usage instead. */
 		u->max_tree_size_opt = (size_t)atoll(optval) * 1048576;  /* long is 4 bytes on windows! */
 	}
+	else if (!strcasecmp(optname, "background_gc")) {
+		/* When pondering, garbage collect the tree in the background
+		 * after genmove instead of before replying. Default: on
+		 * Tree gc can take seconds with huge trees, this way it doesn't
+		 * eat our time. */
+		u->background_gc = !optval || atoi(optval);
+	}
+	else if (!strcasecmp(optname, "tree_hugepages")) {  NEED_RESET
+		/* Back tree memory with huge pages, reduces TLB misses during descent.
+		 * Default: off
+		 * "tree_hugepages" or "tree_hugepages=thp" uses transparent huge pages,
+		 * "tree_hugepages=2M" / "tree_hugepages=1G" maps explicit huge pages of that
+		 * size (must be reserved in /sys/kernel/mm/hugepages/ beforehand, best
+		 * used with "fixed_mem", falls back to transparent huge pages).
+		 * Windows: any setting uses large pages, needs "Lock pages in memory"
+		 * user right. */
+		if      (!optval || !strcasecmp(optval, "thp"))  u->tree_hugepages = TREE_HUGEPAGES_THP;
+		else if (!strcasecmp(optval, "2M"))		  u->tree_hugepages = 2 * 1024 * 1024;
+		else if (!strcasecmp(optval, "1G"))		  u->tree_hugepages = 1024 * 1024 * 1024;
+		else if (!strcmp(optval, "0"))			  u->tree_hugepages = 0;
+		else    option_error("UCT: Invalid tree_hugepages value %s\n", optval);
+	}
+	else if (!strcasecmp(optname, "tree_numa") && optval) {  NEED_RESET
+		/* Tree memory NUMA placement (Linux, only "tree_numa=N" on Windows).
+		 * Default: system policy
+		 * "tree_numa=interleave" spreads tree memory over all memory nodes,
+		 * helps on multi-socket machines where threads on all sockets search
+		 * the same tree. "tree_numa=N" allocates from memory node N if possible. */
+		if      (!strcasecmp(optval, "interleave"))  u->tree_numa = TREE_NUMA_INTERLEAVE;
+		else if (isdigit(*optval))		      u->tree_numa = atoi(optval);
+		else    option_error("UCT: Invalid tree_numa value %s\n", optval);
+	}
 	else if (!strcasecmp(optname, "reset_tree")) {
 		/* Reset tree before each genmove ?
 		 * Default is to reuse previous tree when not using dcnn. 
 		 * When using dcnn tree is always reset (unless pondering). */
 		u->genmove_reset_tree = !optval || atoi(optval);
 	}
+	else if (!strcasecmp(optname, "transpositions")) {  NEED_RESET
+		/* Use a transposition table with 2^transpositions entries (default 20 if
+		 * no value given, off by default). When expanding a node, if the same
+		 * position was already expanded elsewhere in the tree its children
+		 * stats are used as priors for the new node (see also "tt_eqex"). */
+		u->tt_bits = (optval ? atoi(optval) : 20);
+		if (u->tt_bits < 0 || u->tt_bits > 32)
+			option_error("UCT: Invalid transpositions value %s\n", optval);
+	}
+	else if (!strcasecmp(optname, "tt_eqex") && optval) {
+		/* Max equivalent experience given to transposed node stats
+		 * when used as priors. Default: 40 */
+		u->tt_eqex = atoi(optval);
+	}
 
 	/* Pondering */
 
@@ -1260,6 +2153,25 @@ uct_setoption(engine_t *e, board_t *b, const char *optname, char *optval,
 		/* Keep searching even during opponent's turn. */
 		u->pondering_opt = !optval || atoi(optval);
 	}
+	else if (!strcasecmp(optname, "ponder_threads") && optval) {
+		/* Max threads used for pondering (default: 0, all)
+		 * Pondering is worth less than thinking, on hosts running several
+		 * games it's better to leave cores to the others. Can be changed
+		 * while pondering (pachi-setoption), search keeps going with the
+		 * new thread count. */
+		u->ponder_threads = atoi(optval);
+		if (u->ponder_threads < 0)
+			option_error("UCT: Invalid ponder_threads value %s\n", optval);
+		if (!setup)  uct_search_update_threads(u);
+	}
+	else if (!strcasecmp(optname, "ponder_load")) {
+		/* Scale pondering threads with host load (linux only, default: off)
+		 * Every second check how many cpus other processes used and leave
+		 * them these: we ponder with fewer threads when the host is busy
+		 * and scale up again once we're the only one running. */
+		u->ponder_load = !optval || atoi(optval);
+		if (!setup)  uct_search_update_threads(u);
+	}
 	else if (!strcasecmp(optname, "dcnn_pondering_prior") && optval) {
 		/* Dcnn pondering: prior guesses for next move.
 		 * When pondering with dcnn we need to guess opponent's next move:
@@ -1282,6 +2194,18 @@ uct_setoption(engine_t *e, board_t *b, const char *optname, char *optval,
 		size_t n = u->dcnn_pondering_mcts = atoi(optval);
 		assert(n <= sizeof(u->dcnn_pondering_mcts_c) / sizeof(u->dcnn_pondering_mcts_c[0]));
 	}
+	else if (!strcasecmp(optname, "pondering_spread") && optval) {
+		/* Genmove pondering: spread search over opponent's top-N replies.
+		 * Left alone the tree mostly explores opponent's best reply and
+		 * pondering is wasted whenever he plays something else. With this
+		 * half the descents from root go to the least explored of the
+		 * N most explored replies, so the others get a decent subtree
+		 * too. Only the branch actually played is kept, the log shows
+		 * how many playouts were reused (see uct_notify_play()).
+		 * Default is 0 (plain search). */
+		u->pondering_spread = atoi(optval);
+		assert(u->pondering_spread >= 0 && u->pondering_spread <= 20);
+	}
 
 	/** Time control */
 
@@ -1302,6 +2226,41 @@ uct_setoption(engine_t *e, board_t *b, const char *optname, char *optval,
 		 * max_maintime_ratio times the normal desired thinking time. */
 		u->max_maintime_ratio = atof(optval);
 	}
+	else if (!strcasecmp(optname, "stable_stop") && optval) {
+		/* Walltime: stop after stable_stop times desired time if the
+		 * best move hasn't changed for the last half of the search and
+		 * second best isn't catching up quickly enough (measured rate)
+		 * to overtake it before desired time. 0 disables. */
+		u->stable_stop = atof(optval);
+	}
+	else if (!strcasecmp(optname, "unstable_window") && optval) {
+		/* Walltime: keep simulating past desired time (up to worst time)
+		 * if best move changed during the last unstable_window fraction
+		 * of the search, or second best is catching up fast enough to
+		 * overtake it before worst time. 0 disables. */
+		u->unstable_window = atof(optval);
+	}
+	else if (!strcasecmp(optname, "emergency")) {
+		/* Walltime: play emergency moves when nearly out of time
+		 * (less than emergency_time left for the move once net lag
+		 * is accounted for): no search, tree's best move if it's
+		 * clear already (pondering), dcnn or pattern priors only
+		 * otherwise. Guards against losing on time on overloaded
+		 * hosts or with bad network lag. Off by default, short
+		 * fixed time per move (-t 0.5) would trigger it. */
+		u->emergency = !optval || atoi(optval);
+	}
+	else if (!strcasecmp(optname, "emergency_time") && optval) {
+		/* Implies emergency. Default 0: only when time allocation
+		 * reports severe time shortage. */
+		u->emergency = true;
+		u->emergency_time = atof(optval);
+	}
+	else if (!strcasecmp(optname, "emergency_cap") && optval) {
+		/* Emergency moves use dcnn only if an evaluation takes less
+		 * than emergency_cap seconds. */
+		u->emergency_cap = atof(optval);
+	}
 	else if (!strcasecmp(optname, "fuseki_end") && optval) {
 		/* At the very beginning it's not worth thinking
 		 * too long because the playout evaluations are
@@ -1450,6 +2409,10 @@ uct_setoption(engine_t *e, board_t *b, const char *optname, char *optval,
 		/* Share only nodes of level <= shared_levels. */
 		u->shared_levels = atoi(optval);
 	}
+	else if (!strcasecmp(optname, "shared_pv_levels") && optval) {
+		/* Along the principal variation share nodes of level <= shared_pv_levels. */
+		u->shared_pv_levels = atoi(optval);
+	}
 	else if (!strcasecmp(optname, "stats_hbits") && optval) {
 		/* Set hash table size to 2^stats_hbits for the shared stats. */
 		u->stats_hbits = atoi(optval);
@@ -1520,21 +2483,31 @@ uct_state_init(engine_t *e, board_t *b)
 	u->mercymin = 0;
 	u->significant_threshold = 50;
 	u->expand_p = 8;
+	u->widen_playouts = 40;
 	u->dumpthres = 0.01;
 	u->playout_amaf = true;
 	u->amaf_prior = false;
 	u->auto_alloc = true;
+	u->undo_history = 16;
 	u->tree_size = uct_default_tree_size();
 	u->max_tree_size_opt = 0;   /* unlimited */
+	u->background_gc = true;
+	u->tree_numa = TREE_NUMA_DEFAULT;
+	u->pin_node = -1;
+	u->tt_eqex = 40;
 	u->genmove_reset_tree = false;
 
-	u->threads = get_nprocessors();
+	u->threads = get_default_threads();
 	u->thread_model = TM_TREEVL;
 	u->virtual_loss = 1;
+	for (int d = 0; d < VLOSS_DEPTHS; d++)
+		u->vloss_scale[d] = 1.0;
+	u->leaf_playouts = 0;	/* Set in uct_state_init() */
 
 	u->pondering_opt = false;
 	u->dcnn_pondering_prior = 5;
 	u->dcnn_pondering_mcts = 3;
+	u->dcnn_select = 0.1;
 
 	u->fuseki_end = 20; // max time at 361*20% = 72 moves (our 36th move, still 99 to play)
 	u->yose_start = 40; // (100-40-25)*361/100/2 = 63 moves still to play by us then
@@ -1545,6 +2518,11 @@ uct_state_init(engine_t *e, board_t *b)
 	// Higher values of max_maintime_ratio sometimes cause severe time trouble in tournaments
 	// It might be necessary to reduce it to 1.5 on large board, but more tuning is needed.
 	u->max_maintime_ratio = 2.0;
+	u->stable_stop = 0.5;
+	u->unstable_window = 0.2;
+	u->emergency = false;
+	u->emergency_time = 0;
+	u->emergency_cap = 0.1;
 
 	u->val_scale = 0; u->val_points = 40;
 	u->dynkomi_interval = 100;
@@ -1555,6 +2533,8 @@ uct_state_init(engine_t *e, board_t *b)
 	u->slave_index = -1;
 	u->stats_delay = 0.01; // 10 ms
 	u->shared_levels = 1;
+	u->shared_pv_levels = 4;
+	u->root_policy_moves = -1;
 #endif
 
 #ifdef PACHI_PLUGINS
@@ -1576,13 +2556,30 @@ uct_state_init(engine_t *e, board_t *b)
 	if (!!u->random_policy_chance ^ !!u->random_policy)
 		die("uct: Only one of random_policy and random_policy_chance is set\n");
 
+	if (!u->leaf_playouts)		u->leaf_playouts = (u->thread_model == TM_LEAF ? 4 : 1);
+	if (u->pin_threads)		uct_pin_init(u);
+	tree_set_mem_options(u->tree_hugepages, u->tree_numa);
+	uct_container_mem_init(u);
 	uct_tree_size_init(u, u->tree_size);
 
-	dcnn_init(b);
-	if (!using_dcnn(b))		joseki_load(board_rsize(b));
-	if (!pat_setup)			patterns_init(&u->pc, NULL, false, true);
+	uct_data_init(u, b, pat_setup);
 	log_nthreads(u);
 	if (!u->prior)			u->prior = uct_prior_init(NULL, b, u);
+#ifdef DCNN
+	if (u->dcnn_async && !u->prior->dcnn_eqex)  u->dcnn_async = 0;
+	if (u->dcnn_visits && !u->prior->dcnn_eqex)  u->dcnn_visits = 0;
+	if (u->dcnn_async || u->dcnn_visits)	uct_prior_dcnn_async_init(u, b);
+	else if (u->value_weight && dcnn_has_value() && u->threads > 1)
+		dcnn_queue_start(b, u->threads, NULL, u);  /* Leaf values only */
+#endif
+	if (u->value_weight && !dcnn_has_value()) {
+		if (DEBUGL(1))  fprintf(stderr, "uct: dcnn has no value head, value_weight ignored\n");
+		u->value_weight = 0;
+	}
+	if (!u->prior->pattern_eqex)	u->pattern_lazy = 0;
+	/* Root parallelization merges stats by node, slaves keep pointers
+	 * to nodes: children can't move. */
+	if (u->thread_model == TM_ROOT || u->slave)  u->lazy_expand = 0;
 	if (!u->playout)		u->playout = playout_moggy_init(NULL, b);
 	if (!u->playout->debug_level)	u->playout->debug_level = u->debug_level;
 #ifdef DISTRIBUTED
@@ -1607,6 +2604,7 @@ uct_engine_init(engine_t *e, board_t *b)
 	e->setoption = uct_setoption;
 	e->board_print = uct_board_print;
 	e->notify_play = uct_notify_play;
+	e->undo = uct_undo;
 	e->chat = uct_chat;
 	e->result = uct_result;
 	e->genmove = uct_genmove;
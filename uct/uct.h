@@ -5,8 +5,12 @@
 
 void uct_engine_init(engine_t *e, board_t *b);
 
-bool   uct_gentbook(engine_t *e, board_t *b, time_info_t *ti, enum stone color);
+bool   uct_gentbook(engine_t *e, board_t *b, time_info_t *ti, enum stone color, char *filename, coord_t *path, int path_len);
 void   uct_dumptbook(engine_t *e, board_t *b, enum stone color);
+bool   uct_mergetbook(engine_t *e, board_t *b, char **files, int nfiles);
+bool   uct_savetree(engine_t *e, board_t *b, FILE *f);
+bool   uct_loadtree(engine_t *e, board_t *b, FILE *f);
+bool   uct_tree_shape(engine_t *e, strbuf_t *buf);
 size_t uct_default_tree_size(void);
 
 #endif
@@ -1,16 +1,22 @@
 #include <assert.h>
+#include <limits.h>
 #include <math.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #define DEBUG
 
 #include "debug.h"
 #include "board.h"
+#include "dcnn.h"
+#include "fifo.h"
 #include "move.h"
+#include "perfstats.h"
 #include "playout.h"
 #include "random.h"
 #include "tactics/util.h"
@@ -22,6 +28,7 @@
 #include "uct/walk.h"
 #include "uct/prior.h"
 #include "gogui.h"
+#include "logring.h"
 
 #define DESCENT_DLEN 512
 
@@ -38,21 +45,22 @@ uct_progress_text(FILE *fh, uct_t *u, tree_t *t, board_t *b, enum stone color, i
 		fprintf(fh, "... No moves left\n");
 		return;
 	}
-	fprintf(fh, "[%d] ", playouts);
-	fprintf(fh, "best %.1f%% ", 100 * tree_node_get_value(t, 1, best->u.value));
+	strbuf(buf, 1024);
+	sbprintf(buf, "[%d] ", playouts);
+	sbprintf(buf, "best %.1f%% ", 100 * tree_node_get_value(t, 1, best->u.value));
 
 	/* Dynamic komi */
 	if (t->use_extra_komi)
-		fprintf(fh, "xkomi %.1f ", t->extra_komi);
+		sbprintf(buf, "xkomi %.1f ", t->extra_komi);
 
 	/* Best sequence */
-	fprintf(fh, "| seq ");
+	sbprintf(buf, "| seq ");
 	for (int depth = 0; depth < 4; depth++) {
 		if (best && best->u.playouts >= 25) {
-			fprintf(fh, "%3s ", coord2sstr(node_coord(best)));
+			sbprintf(buf, "%3s ", coord2sstr(node_coord(best)));
 			best = u->policy->choose(u->policy, best, b, color, resign);
 		}
-		else    fprintf(fh, "    ");
+		else    sbprintf(buf, "    ");
 	}
 
 	/* Best candidates */
@@ -61,53 +69,62 @@ uct_progress_text(FILE *fh, uct_t *u, tree_t *t, board_t *b, enum stone color, i
 	coord_t best_c[nbest];
 	uct_get_best_moves(u, best_c, best_r, nbest, true, 100);
 
-	fprintf(fh, "| can %c ", color == S_BLACK ? 'b' : 'w');
+	sbprintf(buf, "| can %c ", color == S_BLACK ? 'b' : 'w');
 	for (int i = 0; i < nbest; i++)
 		if (!is_pass(best_c[i]))
-			fprintf(fh, "%3s(%.1f) ", coord2sstr(best_c[i]), 100 * best_r[i]);
+			sbprintf(buf, "%3s(%.1f) ", coord2sstr(best_c[i]), 100 * best_r[i]);
 		else
-			fprintf(fh, "          ");
+			sbprintf(buf, "          ");
 
 	/* Tree memory usage */
 	if (UDEBUGL(3))
-		fprintf(fh, " | %.1fMb", (float)t->nodes_size / 1024 / 1024);
+		sbprintf(buf, " | %.1fMb", (float)t->nodes_size / 1024 / 1024);
 	
-	fprintf(fh, "\n");
+	sbprintf(buf, "\n");
+
+	/* Whole line at once, search threads may be logging too. */
+	if (fh == stderr)  log_printf("%s", buf->str);
+	else               fputs(buf->str, fh);
 }
 
 /* Leela-zero format:
- * info move Q16 visits 1 winrate 4687 prior 2198 order 0 pv Q16 [...] */
+ * info move Q16 visits 1 winrate 4687 prior 2198 order 0 pv Q16 [...]
+ * Called at every report tick, frontends ask for updates every 100ms or so:
+ * candidates come from the root top list and priors are looked up once,
+ * everything else read from the nodes found, no lookups. */
 static void
 uct_progress_lz(FILE *fh, uct_t *u, tree_t *t, board_t *b, enum stone color)
 {
-	tree_node_t *node = u->t->root;
-
 	/* Best candidates */
 	int nbest = 20;
-	float   best_pl[nbest];	
-	float   best_wr[nbest];
+	float   best_pl[nbest];
 	coord_t best_c[nbest];
-	uct_get_best_moves(u, best_c, best_pl, nbest, false, 500);
-	uct_get_best_moves(u, best_c, best_wr, nbest, true,  500);
+	tree_node_t *best_n[nbest];
+	for (int i = 0; i < nbest; i++)  {
+		best_c[i] = pass;  best_pl[i] = 0;  best_n[i] = NULL;
+	}
+
+	tree_node_t *top[nbest];
+	int found = tree_top_children(t, t->root, top, nbest);
+	for (int i = 0; i < found && top[i]->u.playouts >= 500; i++) {
+		best_c[i] = node_coord(top[i]);
+		best_pl[i] = top[i]->u.playouts;
+		best_n[i] = top[i];
+	}
 	if (is_pass(best_c[0]))  return;
 
-	/* Priors */
-	float   best_pr[19 * 19];
-	coord_t best_cpr[19 * 19];
-	float   priors[BOARD_MAX_COORDS];  memset(priors, 0, sizeof(priors));
-	get_node_prior_best_moves(node, best_cpr, best_pr, 19 * 19);
-	for (int i = 0; i < 19 * 19; i++)
-		if (best_cpr[i] > 0)
-			priors[best_cpr[i]] = best_pr[i];
+	float max_prior = tree_root_max_prior(t);
 
 	for (int i = 0; i < nbest && !is_pass(best_c[i]); i++) {
+		tree_node_t *n = best_n[i];
+		float winrate = tree_node_get_value(t, 1, n->u.value);
+		float prior = (max_prior ? n->prior.playouts / max_prior : 0);
 		fprintf(fh, "info move %s visits %i winrate %i prior %i order %i ",
-			coord2sstr(best_c[i]), (int)best_pl[i], (int)(best_wr[i] * 10000),
-			(int)(priors[best_c[i]] * 10000), i);
+			coord2sstr(best_c[i]), (int)best_pl[i], (int)(winrate * 10000),
+			(int)(prior * 10000), i);
 
 		/* Dump best variation */
 		fprintf(fh, "pv %s ", coord2sstr(best_c[i]));
-		tree_node_t *n = tree_get_node(node, best_c[i]);
 		while (1) {
 			n = u->policy->choose(u->policy, n, b, color, resign);
 			if (!n || n->u.playouts < 100) break;
@@ -186,18 +203,10 @@ uct_progress_json(FILE *fh, uct_t *u, tree_t *t, board_t *b, enum stone color, i
 	/* Best candidates */
 	int cans = 20;
 	tree_node_t *can[cans];
-	memset(can, 0, sizeof(can));
-	tree_node_t *best = t->root->children;
-	while (best) {        /* XXX clean this up, use uct_get_best_moves() instead */
-		int c = 0;
-		while ((!can[c] || best->u.playouts > can[c]->u.playouts) && ++c < cans);
-		for (int d = 0; d < c; d++) can[d] = can[d + 1];
-		if (c > 0) can[c - 1] = best;
-		best = best->sibling;
-	}
+	int found = tree_top_children(t, t->root, can, cans);
 	fprintf(fh, ", \"can\": [");
 	bool first = true;
-	while (--cans >= 0 && can[cans]) {
+	for (int i = 0; i < found; i++) {
 		/* Best sequence */
 		if (first == true) {
 			first = false;
@@ -205,7 +214,7 @@ uct_progress_json(FILE *fh, uct_t *u, tree_t *t, board_t *b, enum stone color, i
 		} else {
 			fprintf(fh, ", [");
 		}
-		best = can[cans];
+		tree_node_t *best = can[i];
 		for (int depth = 0; depth < 20; depth++) {
 			if (!best || best->u.playouts < 1) break;
 			fprintf(fh, "%s{\"%s\": [%.3f, %i]}", depth > 0 ? "," : "",
@@ -222,6 +231,10 @@ uct_progress_json(FILE *fh, uct_t *u, tree_t *t, board_t *b, enum stone color, i
 		/* Average score. */
 		if (t->avg_score.playouts > 0)
 			fprintf(fh, ", \"avg\": {\"score\": %.3f}", t->avg_score.value);
+		/* Tree shape stats. */
+		strbuf(shape, 1024);
+		tree_shape_json(t, shape);
+		fprintf(fh, ", \"shape\": %s", shape->str);
 		/* Per-intersection information. */
 		fprintf(fh, ", \"boards\": {");
 		/* Position coloring information. */
@@ -280,16 +293,24 @@ uct_progress_status(uct_t *u, tree_t *t, board_t *b, enum stone color, int playo
 	else if (u->reporting == UR_JSON_BIG)    uct_progress_json(u->report_fh, u, t, b, color, playouts, final, true);
 	else if (u->reporting == UR_LEELA_ZERO)  uct_progress_lz(u->report_fh, u, t, b, color);
 	else    assert(0);
+	fflush(u->report_fh);	/* stdout is fully buffered */
 	
 	uct_progress_gogui_livegfx(u, t, b, color, playouts, final);
 }
 
-static inline void
-record_amaf_move(playout_amafmap_t *amaf, coord_t coord, bool is_ko_capture)
+/* Search threads fill a private ownermap, merged into u->ownermap every
+ * OWNERMAP_MERGE_INTERVAL playouts. All threads incrementing the shared
+ * map at every playout end means lots of cache line bouncing. Readers
+ * just see the shared map a few playouts behind. */
+#define OWNERMAP_MERGE_INTERVAL 64
+
+static __thread ownermap_t *thread_ownermap = NULL;
+
+static void
+thread_ownermap_merge(uct_t *u)
 {
-	assert(amaf->gamelen < MAX_GAMELEN);
-	amaf->is_ko_capture[amaf->gamelen] = is_ko_capture;
-	amaf->game[amaf->gamelen++] = coord;
+	ownermap_merge(&u->ownermap, thread_ownermap);
+	ownermap_init(thread_ownermap);
 }
 
 static int
@@ -304,20 +325,25 @@ uct_leaf_node(uct_t *u, board_t *b, enum stone player_color,
 	int parity = (next_color == player_color ? 1 : -1);
 
 	if (UDEBUGL(7))
-		fprintf(stderr, "%s*-- UCT playout #%d start [%s] %f\n",
+		log_printf("%s*-- UCT playout #%d start [%s] %f\n",
 			spaces, n->u.playouts, coord2sstr(node_coord(n)),
 			tree_node_get_value(t, -parity, n->u.value));
 
 	playout_setup_t ps = playout_setup(u->gamelen, u->mercymin);
+	ps.cutoff = u->cutoff;
+	ps.ownermap = &u->ownermap;
+	ps.settled = (u->settled_points ? &u->settled : NULL);
+	perf_start(playout);
 	int result = playout_play_game(&ps, b, next_color,
 				       u->playout_amaf ? amaf : NULL,
-				       &u->ownermap, u->playout);
+				       (thread_ownermap ? thread_ownermap : &u->ownermap), u->playout);
+	perf_phase(PERF_PLAYOUT, playout);
 	if (next_color == S_WHITE) {
 		/* We need the result from black's perspective. */
 		result = - result;
 	}
 	if (UDEBUGL(7))
-		fprintf(stderr, "%s -- [%d..%d] %s random playout result %d\n",
+		log_printf("%s -- [%d..%d] %s random playout result %d\n",
 		        spaces, player_color, next_color, coord2sstr(node_coord(n)), result);
 
 	return result;
@@ -359,11 +385,347 @@ scale_value(uct_t *u, board_t *b, enum stone node_color, tree_node_t *significan
 	return rval;
 }
 
+/* Search threads sum up playout results for tree avg_score and dynkomi
+ * stats locally, and add them every RESULTS_FLUSH_INTERVAL playouts:
+ * Each of these gets updated by all threads at every playout otherwise.
+ * Dynkomi adaptation sees them a few playouts behind. */
+#define RESULTS_FLUSH_INTERVAL 64
+
+typedef struct {
+	tree_t *t;
+	floating_t score;	  /* Sum of scores */
+	int playouts;
+	floating_t dk_score;	  /* Same, dynkomi stats */
+	floating_t dk_value;
+	int dk_playouts;
+	int vloss_visits[VLOSS_DEPTHS];	    /* Adaptive virtual loss stats */
+	int vloss_collisions[VLOSS_DEPTHS];
+	int first_visits;		  /* Tree shape stats */
+} thread_results_t;
+
+static __thread thread_results_t *thread_results = NULL;
+
+static void
+thread_results_flush(uct_t *u)
+{
+	thread_results_t *r = thread_results;
+	if (r->playouts)
+		uct_stats_add_result(&r->t->avg_score, r->score / r->playouts, r->playouts);
+	if (r->dk_playouts) {
+		uct_stats_add_result(&u->dynkomi->score, r->dk_score / r->dk_playouts, r->dk_playouts);
+		uct_stats_add_result(&u->dynkomi->value, r->dk_value / r->dk_playouts, r->dk_playouts);
+	}
+	r->score = r->dk_score = r->dk_value = 0;
+	r->playouts = r->dk_playouts = 0;
+
+	for (int d = 0; d < VLOSS_DEPTHS; d++) {
+		if (!r->vloss_visits[d])  continue;
+		__sync_fetch_and_add(&u->vloss_visits[d], r->vloss_visits[d]);
+		__sync_fetch_and_add(&u->vloss_collisions[d], r->vloss_collisions[d]);
+		r->vloss_visits[d] = r->vloss_collisions[d] = 0;
+	}
+
+	if (r->first_visits)
+		__sync_fetch_and_add(&r->t->shape.visited, r->first_visits);
+	r->first_visits = 0;
+}
+
+
+/* Adaptive virtual loss (vloss_adapt uct option):
+ * Threads count descents through nodes at each depth, and how many of
+ * them met another descent going through the same node (collisions).
+ * The manager thread periodically scales virtual loss at each depth to
+ * keep collision rate around target: more virtual loss spreads threads
+ * more, less keeps them closer to the principal variation.
+ * With batch_backprop, pending playouts of the thread itself count as
+ * collisions too (their virtual loss is still there). */
+
+#define VLOSS_MIN_VISITS	200	/* Visits needed at a depth before adapting */
+#define VLOSS_STEP		1.25
+#define VLOSS_SCALE_MAX		16.0
+
+void
+uct_vloss_reset(uct_t *u)
+{
+	memset(u->vloss_visits, 0, sizeof(u->vloss_visits));
+	memset(u->vloss_collisions, 0, sizeof(u->vloss_collisions));
+	memset(u->vloss_last, 0, sizeof(u->vloss_last));
+	u->vloss_races = u->expand_races;
+}
+
+void
+uct_vloss_adapt(uct_t *u)
+{
+	floating_t target = u->vloss_adapt / 100.0;
+	for (int d = 0; d < VLOSS_DEPTHS; d++) {
+		long visits = u->vloss_visits[d] - u->vloss_last[d][0];
+		long collisions = u->vloss_collisions[d] - u->vloss_last[d][1];
+		if (visits < VLOSS_MIN_VISITS)  continue;
+		u->vloss_last[d][0] += visits;
+		u->vloss_last[d][1] += collisions;
+
+		floating_t rate = (floating_t)collisions / visits;
+		floating_t *scale = &u->vloss_scale[d];
+		if (rate > target * VLOSS_STEP && *scale * VLOSS_STEP <= VLOSS_SCALE_MAX)
+			*scale *= VLOSS_STEP;
+		else if (rate < target / VLOSS_STEP && *scale / VLOSS_STEP >= 1 / VLOSS_SCALE_MAX)
+			*scale /= VLOSS_STEP;
+	}
+}
+
+void
+uct_vloss_print(uct_t *u, FILE *f)
+{
+	strbuf(buf, 1024);
+	sbprintf(buf, "vloss adapt: target %i%%, expand races %li |", u->vloss_adapt, u->expand_races - u->vloss_races);
+	for (int d = 0; d < VLOSS_DEPTHS; d++) {
+		if (!u->vloss_visits[d])  break;
+		sbprintf(buf, " %i%s %.0f%% x%.2f", d + 1, (d == VLOSS_DEPTHS - 1 ? "+" : ":"),
+			 100.0 * u->vloss_collisions[d] / u->vloss_visits[d], u->vloss_scale[d]);
+	}
+	fprintf(f, "%s\n", buf->str);
+}
+
+/* Record playout result, mixed with leaf @value (black's win rate) from
+ * value network if not negative. */
+static void
+uct_playout_record(uct_t *u, board_t *b, tree_t *t, tree_node_t *n, enum stone node_color, enum stone player_color,
+		   playout_amafmap_t *amaf, tree_node_t *significant[2], int result, floating_t value)
+{
+	if (u->policy->wants_amaf && u->playout_amaf_cutoff) {
+		unsigned int cutoff = amaf->game_baselen;
+		cutoff += (amaf->gamelen - amaf->game_baselen) * u->playout_amaf_cutoff / 100;
+		amaf->gamelen = cutoff;
+	}
+
+	assert(n == t->root || node_parent(n));
+	perf_start(backprop);
+	floating_t rval = scale_value(u, b, node_color, significant, result);
+	if (value >= 0)
+		rval = (1 - u->value_weight) * rval + u->value_weight * value;
+	u->policy->update(u->policy, t, n, node_color, player_color, amaf, b, rval);
+
+	/* No playout, no score. */
+	if (value >= 0 && u->value_weight == 1.0) {
+		perf_phase(PERF_BACKPROP, backprop);
+		return;
+	}
+
+	thread_results_t *r = thread_results;
+	if (r && r->t == t) {
+		r->score += (float)result / 2;
+		r->playouts++;
+		if (t->use_extra_komi) {
+			r->dk_score += (float)result / 2;
+			r->dk_value += rval;
+			r->dk_playouts++;
+		}
+	} else {
+		uct_stats_add_result(&t->avg_score, (float)result / 2, 1);
+		if (t->use_extra_komi) {
+			uct_stats_add_result(&u->dynkomi->score, (float)result / 2, 1);
+			uct_stats_add_result(&u->dynkomi->value, rval, 1);
+		}
+	}
+	perf_phase(PERF_BACKPROP, backprop);
+}
+
+/* Value network leaf evaluation (value_weight uct option):
+ * Leaf value request is sent before the playout and mixed with its result
+ * afterwards. With several threads requests go through the dcnn queue so
+ * that they get evaluated in batches, the playout runs meanwhile. */
+
+#ifdef DCNN
+typedef struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;
+	bool  done;
+	float value;		/* black's win rate, -1 if none */
+} leaf_value_t;
+
+static __thread leaf_value_t *thread_leaf_value = NULL;
+
+static void
+leaf_value_set(leaf_value_t *lv, enum stone color, float value)
+{
+	pthread_mutex_lock(&lv->mutex);
+	lv->value = (value < 0 ? -1 : color == S_BLACK ? value : 1 - value);
+	lv->done = true;
+	pthread_cond_signal(&lv->cond);
+	pthread_mutex_unlock(&lv->mutex);
+}
+
+/* From dcnn queue thread */
+static void
+leaf_value_done(void *ctx, void *data, int color, float r[], float value)
+{
+	leaf_value_set((leaf_value_t*)data, (enum stone)color, value);
+}
+
+/* Start evaluation of leaf position @b, @color to play.
+ * Returns false if there's nothing to evaluate with. */
+static bool
+leaf_value_start(uct_t *u, board_t *b, enum stone color)
+{
+	leaf_value_t *lv = thread_leaf_value;
+	if (!lv || !using_dcnn(b))
+		return false;
+
+	lv->done = false;
+	if (dcnn_queue_running() && dcnn_queue_submit_cb(b, color, leaf_value_done, lv, color))
+		return true;
+
+	/* Single thread or queue full: evaluate right away. */
+	float r[board_rsize2(b)], value;
+	dcnn_evaluate_value(b, color, r, &value);
+	leaf_value_set(lv, color, value);
+	return true;
+}
+
+static floating_t
+leaf_value_wait(void)
+{
+	leaf_value_t *lv = thread_leaf_value;
+	pthread_mutex_lock(&lv->mutex);
+	while (!lv->done)
+		pthread_cond_wait(&lv->cond, &lv->mutex);
+	pthread_mutex_unlock(&lv->mutex);
+	return lv->value;
+}
+
+static void
+leaf_value_init(uct_t *u)
+{
+	if (!u->value_weight)  return;
+	leaf_value_t *lv = thread_leaf_value = calloc2(1, leaf_value_t);
+	pthread_mutex_init(&lv->mutex, NULL);
+	pthread_cond_init(&lv->cond, NULL);
+}
+
+static void
+leaf_value_done_thread(void)
+{
+	leaf_value_t *lv = thread_leaf_value;
+	if (!lv)  return;
+	pthread_mutex_destroy(&lv->mutex);
+	pthread_cond_destroy(&lv->cond);
+	free(lv);
+	thread_leaf_value = NULL;
+}
+#else
+#define leaf_value_start(u, b, color)	false
+#define leaf_value_wait()		(-1)
+#define leaf_value_init(u)		((void)0)
+#define leaf_value_done_thread()	((void)0)
+#endif
+
+#ifdef DCNN
+/* dcnn_visits requests budget: at most dcnn_rate per second (roughly). */
+static double dcnn_window = 0;
+static volatile int dcnn_window_requests = 0;
+
+static bool
+dcnn_budget(uct_t *u)
+{
+	if (!u->dcnn_rate)  return true;
+	double now = time_now();
+	if (now - dcnn_window >= 1.0) {
+		dcnn_window = now;
+		dcnn_window_requests = 0;
+	}
+	return (__sync_fetch_and_add(&dcnn_window_requests, 1) < u->dcnn_rate);
+}
+
+/* Request dcnn priors for inner node @n once it's been visited enough
+ * (dcnn_visits), @b is node's position. */
+static void
+lazy_dcnn_priors(uct_t *u, tree_t *t, tree_node_t *n, board_t *b, enum stone color, int parity)
+{
+	if (!u->dcnn_visits || n->u.playouts < u->dcnn_visits || tree_leaf_node(n) ||
+	    (n->hints & (TREE_HINT_DCNN | TREE_HINT_DCNN_QUEUED)) || !using_dcnn(b))
+		return;
+	if (!dcnn_budget(u))
+		return;
+	/* Only one thread gets to do it. */
+	if (__sync_fetch_and_or(&n->hints, TREE_HINT_DCNN_QUEUED) & TREE_HINT_DCNN_QUEUED)
+		return;
+	if (!uct_prior_dcnn_visits(u, n, b, color, tree_parity(t, parity)))
+		__sync_fetch_and_and(&n->hints, ~TREE_HINT_DCNN_QUEUED);  /* Queue full, try again later */
+}
+#else
+#define lazy_dcnn_priors(u, t, n, b, color, parity)  ((void)0)
+#endif
+
+/* Add lazy pattern priors to @n once it's been visited enough,
+ * @b is node's position. Root gets them right away. */
+static void
+lazy_pattern_priors(uct_t *u, tree_t *t, tree_node_t *n, board_t *b, enum stone color, int parity)
+{
+	if (!u->pattern_lazy || tree_leaf_node(n) || (n->hints & TREE_HINT_PATTERNS))
+		return;
+	if (n != t->root && n->u.playouts < u->pattern_lazy)
+		return;
+	/* Only one thread gets to do it. */
+	if (__sync_fetch_and_or(&n->hints, TREE_HINT_PATTERNS) & TREE_HINT_PATTERNS)
+		return;
+
+	perf_start(expand);
+	uct_prior_pattern_lazy(u, n, b, color, tree_parity(t, parity));
+	perf_phase(PERF_EXPAND, expand);
+}
+
+/* Lazy expansion: double @n children (not counting pass) once it has
+ * widen_playouts * (children / lazy_expand)^2 playouts. */
+static void
+uct_widen(uct_t *u, tree_t *t, tree_node_t *n)
+{
+	if (!(n->hints & TREE_HINT_PENDING))
+		return;
+	int m = n->nchildren - 1;
+	float r = (float)m / u->lazy_expand;
+	if (n->u.playouts < u->widen_playouts * r * r)
+		return;
+
+	perf_start(expand);
+	tree_widen_node(t, n, (m > 1 ? m : 1));
+	perf_phase(PERF_EXPAND, expand);
+}
+
+/* Genmove pondering: descend to the least explored of opponent's
+ * top-N replies (most explored ones), see pondering_spread option. */
+static void
+pondering_spread_descend(uct_t *u, tree_t *t, uct_descent_t *descent, int parity, bool allow_pass)
+{
+	int nbest = u->pondering_spread;
+	coord_t best_c[nbest];
+	float   best_r[nbest];
+	void   *best_d[nbest];
+	for (int i = 0; i < nbest; i++) {
+		best_c[i] = pass;  best_r[i] = -1;  best_d[i] = NULL;
+	}
+
+	foreach_child(t->root, ni) {
+		if ((!allow_pass && is_pass(node_coord(ni))) || (ni->hints & TREE_HINT_INVALID))
+			continue;
+		/* Prior breaks ties while replies are unexplored. */
+		float r = ni->u.playouts + tree_node_get_value(t, parity, node_prior(ni).value);
+		best_moves_add_full(node_coord(ni), r, ni, best_c, best_r, best_d, nbest);
+	}
+
+	tree_node_t *n = NULL;
+	for (int i = 0; i < nbest && best_d[i]; i++)
+		if (!n || ((tree_node_t*)best_d[i])->u.playouts < n->u.playouts)
+			n = best_d[i];
+	if (!n)  return;
+	descent->node = n;
+	descent->value = n->u;
+}
+
 static tree_node_t *
 uct_playout_descent(uct_t *u, board_t *b, enum stone player_color, tree_t *t, int *presult)
 {
 	playout_amafmap_t amaf;
-	amaf.gamelen = amaf.game_baselen = 0;
+	amafmap_init(&amaf);
 
 	/* Walk the tree until we find a leaf, then expand it and do
 	 * a random playout. */
@@ -373,8 +735,12 @@ uct_playout_descent(uct_t *u, board_t *b, enum stone player_color, tree_t *t, in
 
 	/* Make sure root node is expanded. Normally that's the case,
 	 * except direct calls to uct_playout() */
-	if (tree_leaf_node(n) && !__sync_lock_test_and_set(&n->is_expanded, 1))
+	if (tree_leaf_node(n) && !__sync_lock_test_and_set(&n->is_expanded, 1)) {
+		perf_start(expand);
 		tree_expand_node(t, n, b, player_color, u, 1);
+		perf_phase(PERF_EXPAND, expand);
+	}
+	lazy_pattern_priors(u, t, n, b, player_color, 1);
 	
 	/* Tree descent history. */
 	/* XXX: This is somewhat messy since @n and descent[dlen-1].node are
@@ -398,10 +764,11 @@ uct_playout_descent(uct_t *u, board_t *b, enum stone player_color, tree_t *t, in
 	static char spaces[] = "\0                                                      ";
 	/* /debug */
 	if (UDEBUGL(8))
-		fprintf(stderr, "--- (#%d) UCT walk with color %d\n", t->root->u.playouts, player_color);
+		log_printf("--- (#%d) UCT walk with color %d\n", t->root->u.playouts, player_color);
 
 	while (!tree_leaf_node(n) && passes < 2) {
-		spaces[dlen - 1] = ' '; spaces[dlen] = 0;
+		if (dlen < (int)sizeof(spaces)) {  spaces[dlen - 1] = ' '; spaces[dlen] = 0;  }  /* deep descents: indent capped */
+		perf_start(descent);
 
 
 		/*** Choose a node to descend to: */
@@ -412,12 +779,15 @@ uct_playout_descent(uct_t *u, board_t *b, enum stone player_color, tree_t *t, in
 		int parity = (node_color == player_color ? 1 : -1);
 
 		assert(dlen < DESCENT_DLEN);
+		uct_widen(u, t, n);
 		descent[dlen] = descent[dlen - 1];
 
 		if (!u->random_policy_chance || fast_random(u->random_policy_chance))
 			u->policy->descend(u->policy, t, &descent[dlen], parity, u->allow_pass);
 		else
 			u->random_policy->descend(u->random_policy, t, &descent[dlen], parity, u->allow_pass);
+		if (dlen == 1 && u->pondering_spread && genmove_pondering(u) && fast_random(2))
+			pondering_spread_descend(u, t, &descent[dlen], parity, u->allow_pass);
 
 
 		/*** Perform the descent: */
@@ -428,27 +798,38 @@ uct_playout_descent(uct_t *u, board_t *b, enum stone player_color, tree_t *t, in
 		seq_value.playouts += descent[dlen].value.playouts;
 		seq_value.value += descent[dlen].value.value * descent[dlen].value.playouts;
 		n = descent[dlen++].node;
-		assert(n == t->root || n->parent);
+		assert(n == t->root || node_parent(n));
+		if (!(n->hints & TREE_HINT_VISITED) && thread_results &&
+		    !(__sync_fetch_and_or(&n->hints, TREE_HINT_VISITED) & TREE_HINT_VISITED))
+			thread_results->first_visits++;
 		if (UDEBUGL(7))
-			fprintf(stderr, "%s+-- UCT sent us to [%s:%d] %d,%f\n",
+			log_printf("%s+-- UCT sent us to [%s:%d] %d,%f\n",
 			        spaces, coord2sstr(node_coord(n)),
 				node_coord(n), n->u.playouts,
 				tree_node_get_value(t, parity, n->u.value));
 
-		if (u->virtual_loss)
-			__sync_fetch_and_add(&n->descents, u->virtual_loss);
+		if (u->virtual_loss) {
+			int busy = __sync_fetch_and_add(&n->descents, u->virtual_loss);
+			if (u->vloss_adapt && thread_results) {
+				int d = (dlen - 2 < VLOSS_DEPTHS ? dlen - 2 : VLOSS_DEPTHS - 1);
+				thread_results->vloss_visits[d]++;
+				thread_results->vloss_collisions[d] += (busy > 0);
+			}
+		}
 
 		move_t m = { node_coord(n), node_color };
 		int res = board_play(b, &m);
+		perf_phase(PERF_DESCENT, descent);
 
 		if (res < 0 || (!is_pass(m.coord) && !group_at(b, m.coord)) /* suicide */
 		    || b->superko_violation) {
 			if (UDEBUGL(4)) {
-				for (tree_node_t *ni = n; ni; ni = ni->parent)
-					fprintf(stderr, "%s<%" PRIhash "> ", coord2sstr(node_coord(ni)), ni->hash);
-				fprintf(stderr, "marking invalid %s node %d,%d res %d group %d spk %d\n",
-				        stone2str(node_color), coord_x(node_coord(n)), coord_y(node_coord(n)),
-					res, group_at(b, m.coord), b->superko_violation);
+				strbuf(buf, 4096);
+				for (tree_node_t *ni = n; ni; ni = node_parent(ni))
+					sbprintf(buf, "%s<%" PRIhash "> ", coord2sstr(node_coord(ni)), tree_node_cold(t, ni)->hash);
+				log_printf("%smarking invalid %s node %d,%d res %d group %d spk %d\n", buf->str,
+					   stone2str(node_color), coord_x(node_coord(n)), coord_y(node_coord(n)),
+					   res, group_at(b, m.coord), b->superko_violation);
 			}
 			n->hints |= TREE_HINT_INVALID;
 			*presult = 0;
@@ -456,7 +837,7 @@ uct_playout_descent(uct_t *u, board_t *b, enum stone player_color, tree_t *t, in
 		}
 
 		assert(node_coord(n) >= -1);
-		record_amaf_move(&amaf, node_coord(n), board_playing_ko_threat(b));
+		amafmap_record(&amaf, node_coord(n), board_playing_ko_threat(b));
 
 		if (is_pass(node_coord(n)))  passes++;
 		else                         passes = 0;
@@ -470,12 +851,20 @@ uct_playout_descent(uct_t *u, board_t *b, enum stone player_color, tree_t *t, in
 		 * The size test must be before the test&set not after, to allow
 		 * expansion of the node later if enough nodes have been freed. */
 		if (tree_leaf_node(n)
-		    && n->u.playouts - u->virtual_loss >= u->expand_p && t->nodes_size < t->max_tree_size
-		    && !__sync_lock_test_and_set(&n->is_expanded, 1))
-			tree_expand_node(t, n, b, next_color, u, -parity);
+		    && n->u.playouts - u->virtual_loss >= u->expand_p && t->nodes_size < t->max_tree_size) {
+			if (!__sync_lock_test_and_set(&n->is_expanded, 1)) {
+				perf_start(expand);
+				tree_expand_node(t, n, b, next_color, u, -parity);
+				perf_phase(PERF_EXPAND, expand);
+			} else  /* Another thread is expanding it */
+				__sync_fetch_and_add(&u->expand_races, 1);
+		}
+
+		lazy_pattern_priors(u, t, n, b, next_color, -parity);
+		lazy_dcnn_priors(u, t, n, b, next_color, -parity);
 	}
 
-	amaf.game_baselen = amaf.gamelen;
+	amafmap_start(&amaf);
 
 	if (t->use_extra_komi && u->dynkomi->persim)
 		b->komi += round(u->dynkomi->persim(u->dynkomi, b, t, n));
@@ -489,30 +878,140 @@ uct_playout_descent(uct_t *u, board_t *b, enum stone player_color, tree_t *t, in
 	// assert(tree_leaf_node(n));
 	/* In case of parallel tree search, the assertion might
 	 * not hold if two threads chew on the same node. */
+
+	/* Value network evaluation runs while we play out. */
+	bool value = leaf_value_start(u, b, stone_other(node_color));
+
+	/* Value network replaces playouts */
+	if (value && u->value_weight == 1.0) {
+		result = 0;
+		uct_playout_record(u, b, t, n, node_color, player_color, &amaf, significant, result, leaf_value_wait());
+		*presult = result;
+		return n;
+	}
+
+	/* Leaf parallelization: more playouts from the same leaf,
+	 * amortizes descent cost. */
+	for (int i = 1; i < u->leaf_playouts; i++) {
+		board_t b2;
+		board_copy(&b2, b);
+		playout_amafmap_t amaf2 = amaf;
+		result = uct_leaf_node(u, &b2, player_color, &amaf2, descent, &dlen, significant, t, n, node_color, spaces);
+		uct_playout_record(u, &b2, t, n, node_color, player_color, &amaf2, significant, result,
+				   (value ? leaf_value_wait() : -1));
+		board_done(&b2);
+	}
+
 	result = uct_leaf_node(u, b, player_color, &amaf, descent, &dlen, significant, t, n, node_color, spaces);
+	uct_playout_record(u, b, t, n, node_color, player_color, &amaf, significant, result,
+			   (value ? leaf_value_wait() : -1));
 
-	if (u->policy->wants_amaf && u->playout_amaf_cutoff) {
-		unsigned int cutoff = amaf.game_baselen;
-		cutoff += (amaf.gamelen - amaf.game_baselen) * u->playout_amaf_cutoff / 100;
-		amaf.gamelen = cutoff;
+	*presult = result;
+	return n;
+}
+
+
+/************************************************************************/
+/* Batched backpropagation */
+
+/* With "batch_backprop=N" each worker accumulates stats updates in a
+ * thread-local buffer and flushes them to the tree every N playouts.
+ * Nodes near the root are updated by all threads all the time, this cuts
+ * down cache line bouncing on them. Virtual loss of pending playouts stays
+ * in until flush so that threads don't pile up in the same branch meanwhile. */
+
+#define STATS_BATCH_BITS	14
+#define STATS_BATCH_SIZE	(1 << STATS_BATCH_BITS)
+
+typedef struct {
+	move_stats_t *s;
+	floating_t value;	/* sum of weighted results */
+	int playouts;
+} stats_batch_entry_t;
+
+struct stats_batch {
+	int entries;			/* used slots */
+	int pending;			/* playouts since last flush */
+	tree_node_t **leaves;		/* leaf node of pending playouts */
+	int used[STATS_BATCH_SIZE];	/* used slots, for flushing */
+	stats_batch_entry_t slot[STATS_BATCH_SIZE];
+};
+
+__thread stats_batch_t *stats_batch = NULL;
+
+void
+stats_batch_add(stats_batch_t *sb, move_stats_t *s, floating_t result, int playouts)
+{
+	/* Keep table sparse, do it the usual way if it's getting full. */
+	if (sb->entries >= STATS_BATCH_SIZE * 3 / 4) {
+		stats_add_result(s, result, playouts);
+		return;
 	}
 
-	/* Record the result. */
+	unsigned int h = ((uintptr_t)s >> 3) * 2654435761U;
+	h >>= 32 - STATS_BATCH_BITS;
+	stats_batch_entry_t *e = &sb->slot[h];
+	while (e->s != s) {
+		if (!e->s) {
+			e->s = s;  e->value = 0;  e->playouts = 0;
+			sb->used[sb->entries++] = h;
+			break;
+		}
+		h = (h + 1) & (STATS_BATCH_SIZE - 1);
+		e = &sb->slot[h];
+	}
+	e->value += result * playouts;
+	e->playouts += playouts;
+}
 
-	assert(n == t->root || n->parent);
-	floating_t rval = scale_value(u, b, node_color, significant, result);
-	u->policy->update(u->policy, t, n, node_color, player_color, &amaf, b, rval);
+static stats_batch_t *
+stats_batch_init(uct_t *u)
+{
+	stats_batch_t *sb = calloc2(1, stats_batch_t);
+	sb->leaves = calloc2(u->batch_backprop, tree_node_t *);
+	return sb;
+}
+
+/* Playout from leaf @n is in: undo virtual loss along the way,
+ * root child may be a top one now (see tree_topk_t). */
+static void
+uct_playout_done(uct_t *u, tree_t *t, tree_node_t *n)
+{
+	tree_node_t *child = NULL;
+	for (; node_parent(n); child = n, n = node_parent(n))
+		if (u->virtual_loss)
+			__sync_fetch_and_sub(&n->descents, u->virtual_loss);
+	if (child)  tree_topk_update(t, child);
+}
 
-	stats_add_result(&t->avg_score, (float)result / 2, 1);
-	if (t->use_extra_komi) {
-		stats_add_result(&u->dynkomi->score, (float)result / 2, 1);
-		stats_add_result(&u->dynkomi->value, rval, 1);
+static void
+stats_batch_flush(stats_batch_t *sb, uct_t *u, tree_t *t)
+{
+	/* Sequential updates end up at the weighted average of results,
+	 * merged result is the same. */
+	for (int i = 0; i < sb->entries; i++) {
+		stats_batch_entry_t *e = &sb->slot[sb->used[i]];
+		if (e->playouts)
+			stats_add_result(e->s, e->value / e->playouts, e->playouts);
+		e->s = NULL;
 	}
+	sb->entries = 0;
 
-	*presult = result;
-	return n;
+	/* Stats are in, now we can drop virtual loss. */
+	for (int i = 0; i < sb->pending; i++)
+		uct_playout_done(u, t, sb->leaves[i]);
+	sb->pending = 0;
 }
 
+static void
+stats_batch_done(stats_batch_t *sb, uct_t *u, tree_t *t)
+{
+	stats_batch_flush(sb, u, t);
+	free(sb->leaves);
+	free(sb);
+}
+
+
 int
 uct_playout(uct_t *u, board_t *b, enum stone player_color, tree_t *t)
 {
@@ -522,22 +1021,72 @@ uct_playout(uct_t *u, board_t *b, enum stone player_color, tree_t *t)
 	int result;
 	tree_node_t *n = uct_playout_descent(u, &b2, player_color, t, &result);
 	
-	/* We need to undo the virtual loss we added during descend. */
-	if (u->virtual_loss) {
-		for (; n->parent; n = n->parent) {
-			__sync_fetch_and_sub(&n->descents, u->virtual_loss);
-		}
-	}
+	/* We need to undo the virtual loss we added during descend.
+	 * When batching this is done at flush time. */
+	if (stats_batch)
+		stats_batch->leaves[stats_batch->pending++] = n;
+	else
+		uct_playout_done(u, t, n);
 
 	board_done(&b2);
 	return result;
 }
 
 int
-uct_playouts(uct_t *u, board_t *b, enum stone color, tree_t *t, time_info_t *ti)
+uct_playouts(uct_t *u, board_t *b, enum stone color, tree_t *t, time_info_t *ti, int tid)
 {
+	if (u->batch_backprop)
+		stats_batch = stats_batch_init(u);
+	thread_ownermap = malloc2(ownermap_t);
+	ownermap_init(thread_ownermap);
+	thread_results = calloc2(1, thread_results_t);
+	thread_results->t = t;
+	leaf_value_init(u);
+
+	/* Searching for a number of games: stop by ourselves when we get
+	 * there rather than whenever the manager polls, so that single
+	 * threaded searches with fixed seed are reproducible. */
+	int max_games = INT_MAX;
+	if (ti && ti->dim == TD_GAMES)
+		max_games = (ti->games_max ? ti->games_max : ti->games);
+
 	int i;
-	for (i = 0; !uct_halt; i++)
+	for (i = 0; !uct_halt && t->root->u.playouts <= max_games; i++) {
+		/* Search scaled down (uct_search_set_threads()) or other instances
+		 * thinking, we're only granted a few cores: wait, doesn't count as games. */
+		if (tid && (tid >= u->active_threads || tid >= fifo_cores_granted())) {
+			while ((tid >= u->active_threads || tid >= fifo_cores_granted()) && !uct_halt)
+				usleep(10000);
+			if (uct_halt || t->root->u.playouts > max_games)  break;
+		}
 		uct_playout(u, b, color, t);
-	return i;
+		if (thread_ownermap->playouts >= OWNERMAP_MERGE_INTERVAL)
+			thread_ownermap_merge(u);
+		if (thread_results->playouts >= RESULTS_FLUSH_INTERVAL)
+			thread_results_flush(u);
+		if (t->merge_into && !(i % ROOT_MERGE_INTERVAL) &&
+		    !__sync_lock_test_and_set(&t->merging, 1)) {
+			tree_merge(t->merge_into, t, ROOT_MERGE_DEPTH);
+			__sync_lock_release(&t->merging);
+		}
+		if (stats_batch && (stats_batch->pending >= u->batch_backprop ||
+				    stats_batch->entries >= STATS_BATCH_SIZE / 2)) {
+			perf_start(flush);
+			stats_batch_flush(stats_batch, u, t);
+			perf_phase(PERF_BACKPROP, flush);
+		}
+	}
+
+	if (stats_batch) {
+		stats_batch_done(stats_batch, u, t);
+		stats_batch = NULL;
+	}
+	thread_ownermap_merge(u);
+	free(thread_ownermap);
+	thread_ownermap = NULL;
+	thread_results_flush(u);
+	free(thread_results);
+	thread_results = NULL;
+	leaf_value_done_thread();
+	return i * u->leaf_playouts;
 }
@@ -1,11 +1,30 @@
 #ifndef PACHI_UCT_WALK_H
 #define PACHI_UCT_WALK_H
 
+#include "timeinfo.h"
 #include "uct/internal.h"
 
 void uct_progress_status(uct_t *u, tree_t *t, board_t *b, enum stone color, int playouts, coord_t *final);
 
 int uct_playout(uct_t *u, board_t *b, enum stone player_color, tree_t *t);
-int uct_playouts(uct_t *u, board_t *b, enum stone color, tree_t *t, time_info_t *ti);
+
+/* Adaptive virtual loss, see walk.c */
+void uct_vloss_reset(uct_t *u);
+void uct_vloss_adapt(uct_t *u);
+void uct_vloss_print(uct_t *u, FILE *f);
+int uct_playouts(uct_t *u, board_t *b, enum stone color, tree_t *t, time_info_t *ti, int tid);
+
+/* Batched backpropagation ("batch_backprop" option), see walk.c */
+typedef struct stats_batch stats_batch_t;
+extern __thread stats_batch_t *stats_batch;
+void stats_batch_add(stats_batch_t *sb, move_stats_t *s, floating_t result, int playouts);
+
+/* Add result to tree stats. Goes to thread's update buffer if batching. */
+static inline void
+uct_stats_add_result(move_stats_t *s, floating_t result, int playouts)
+{
+	if (stats_batch)  stats_batch_add(stats_batch, s, result, playouts);
+	else              stats_add_result(s, result, playouts);
+}
 
 #endif
@@ -4,11 +4,17 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <math.h>
 #include <assert.h>
 #include <errno.h>
 #include <libgen.h>
 #include <sys/stat.h>
 #include <stdbool.h>
+#include <string.h>
+#ifdef __linux__
+#include <sched.h>
+#include <time.h>
+#endif
 
 #include "pachi.h"
 #include "debug.h"
@@ -30,18 +36,225 @@ win_set_pachi_cwd(char *pachi)
 #endif
 }
 
+#ifdef __linux__
+
+/* Cgroup limits (containers): cgroup v2 files live in unified hierarchy,
+ * v1 files in controller's hierarchy. Limits of parent cgroups apply as
+ * well so we look all the way up, smallest limit wins. */
+
+/* Our cgroup path in hierarchy of controller @ctrl (v1), unified hierarchy
+ * if @ctrl is NULL (v2). */
+static bool
+cgroup_path(const char *ctrl, char *path, int size)
+{
+	FILE *f = fopen("/proc/self/cgroup", "r");
+	if (!f)  return false;
+	char line[1024];
+	bool found = false;
+	while (!found && fgets(line, sizeof(line), f)) {
+		/* "hierarchy-id:controller-list:path" */
+		char *c1 = strchr(line, ':');
+		char *c2 = (c1 ? strchr(c1 + 1, ':') : NULL);
+		if (!c2)  continue;
+		*c2 = 0;
+		c2[1 + strcspn(c2 + 1, "\n")] = 0;
+		if (!ctrl)
+			found = !c1[1];
+		else
+			for (char *tok = strtok(c1 + 1, ","); tok && !found; tok = strtok(NULL, ","))
+				found = !strcmp(tok, ctrl);
+		if (found)  snprintf(path, size, "%s", c2 + 1);
+	}
+	fclose(f);
+	return found;
+}
+
+/* Read 2 values from cgroup file, "max" counts as unlimited (0). */
+static int
+cgroup_read(const char *root, const char *dir, const char *file, double *v1, double *v2)
+{
+	char name[1280];
+	snprintf(name, sizeof(name), "%s%s/%s", root, dir, file);
+	FILE *f = fopen(name, "r");
+	if (!f)  return 0;
+	char s1[64] = "", s2[64] = "";
+	int n = fscanf(f, "%63s %63s", s1, s2);
+	fclose(f);
+	if (n < 1)  return 0;
+	*v1 = (strcmp(s1, "max") ? atof(s1) : 0);
+	if (v2)  *v2 = (n == 2 ? atof(s2) : 0);
+	return n;
+}
+
+/* Go to parent cgroup. Returns false if we were at the top already. */
+static bool
+cgroup_parent(char *dir)
+{
+	if (!*dir)  return false;
+	char *s = strrchr(dir, '/');
+	if (s)  *s = 0;
+	else    *dir = 0;
+	return true;
+}
+
+static size_t
+cgroup_mem_limit(void)
+{
+	char dir[1024];
+	double limit = 0, v;
+	if (cgroup_path(NULL, dir, sizeof(dir)))
+		do
+			if (cgroup_read("/sys/fs/cgroup", dir, "memory.max", &v, NULL) && v > 0 && (!limit || v < limit))
+				limit = v;
+		while (cgroup_parent(dir));
+	if (cgroup_path("memory", dir, sizeof(dir)))
+		do	/* Unlimited is some huge value */
+			if (cgroup_read("/sys/fs/cgroup/memory", dir, "memory.limit_in_bytes", &v, NULL) &&
+			    v > 0 && v < (double)(1ULL << 60) && (!limit || v < limit))
+				limit = v;
+		while (cgroup_parent(dir));
+	return (size_t)limit;
+}
+
+static double
+cgroup_cpu_limit(void)
+{
+	char dir[1024];
+	double limit = 0, quota, period;
+	if (cgroup_path(NULL, dir, sizeof(dir)))
+		do	/* "quota period" */
+			if (cgroup_read("/sys/fs/cgroup", dir, "cpu.max", &quota, &period) == 2 &&
+			    quota > 0 && period > 0 && (!limit || quota / period < limit))
+				limit = quota / period;
+		while (cgroup_parent(dir));
+	if (cgroup_path("cpu", dir, sizeof(dir)))
+		do	/* quota -1: unlimited */
+			if (cgroup_read("/sys/fs/cgroup/cpu", dir, "cpu.cfs_quota_us", &quota, NULL) &&
+			    cgroup_read("/sys/fs/cgroup/cpu", dir, "cpu.cfs_period_us", &period, NULL) &&
+			    quota > 0 && period > 0 && (!limit || quota / period < limit))
+				limit = quota / period;
+		while (cgroup_parent(dir));
+	return limit;
+}
+
+/* big.LITTLE: cpu_capacity gives relative speed of each cpu (arm).
+ * Returns number of fast cpus we may run on, 0 if they're all the same
+ * (or unknown). */
+static int
+linux_big_cpus(void)
+{
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set))  return 0;
+
+	int cap[CPU_SETSIZE];
+	int n = 0, max = 0, big = 0;
+	for (int i = 0; i < CPU_SETSIZE; i++) {
+		cap[i] = 0;
+		if (!CPU_ISSET(i, &set))  continue;
+		char name[128];
+		snprintf(name, sizeof(name), "/sys/devices/system/cpu/cpu%i/cpu_capacity", i);
+		FILE *f = fopen(name, "r");
+		if (!f)  return 0;
+		if (fscanf(f, "%i", &cap[i]) != 1)  cap[i] = 0;
+		fclose(f);
+		if (cap[i] > max)  max = cap[i];
+		n++;
+	}
+	for (int i = 0; i < CPU_SETSIZE; i++)
+		if (cap[i] && cap[i] >= max * 3 / 4)  big++;
+	return (big < n ? big : 0);
+}
+
+#endif /* __linux__ */
+
 int
 get_nprocessors()
 {
 #ifdef _WIN32
-	SYSTEM_INFO info;
-	GetSystemInfo(&info);
-	return info.dwNumberOfProcessors;
+	/* All processor groups, GetSystemInfo() only knows about ours
+	 * (64 cpus max). */
+	int n = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+	return (n > 0 ? n : 1);
 #else
-	return sysconf(_SC_NPROCESSORS_ONLN);
+	int n = sysconf(_SC_NPROCESSORS_ONLN);
+#ifdef __linux__
+	/* Only count cpus we may run on and honor container cpu quota. */
+	cpu_set_t set;
+	if (!sched_getaffinity(0, sizeof(set), &set) && CPU_COUNT(&set) < n)
+		n = CPU_COUNT(&set);
+	double quota = cgroup_cpu_limit();
+	if (quota > 0 && quota < n)
+		n = (int)ceil(quota);
+#endif
+	return (n > 0 ? n : 1);
 #endif	
 }
 
+int
+get_default_threads()
+{
+	int n = get_nprocessors();
+#ifdef __linux__
+	int big = linux_big_cpus();
+	if (big && big < n) {
+		if (DEBUGL(3))  fprintf(stderr, "big.LITTLE: using %i fast cpus\n", big);
+		n = big;
+	}
+#endif
+	return n;
+}
+
+bool
+get_cpu_times(double *busy, double *self)
+{
+#ifdef __linux__
+	FILE *f = fopen("/proc/stat", "r");
+	if (!f)  return false;
+	unsigned long long user, nice, sys, idle, iowait, irq, softirq, steal = 0;
+	int n = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+		       &user, &nice, &sys, &idle, &iowait, &irq, &softirq, &steal);
+	fclose(f);
+	if (n < 7)  return false;
+	long hz = sysconf(_SC_CLK_TCK);
+	*busy = (double)(user + nice + sys + irq + softirq + steal) / (hz > 0 ? hz : 100);
+
+	struct timespec ts;
+	if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts))  return false;
+	*self = ts.tv_sec + ts.tv_nsec / 1e9;
+	return true;
+#else
+	return false;
+#endif
+}
+
+size_t
+get_container_mem()
+{
+#ifdef __linux__
+	return cgroup_mem_limit();
+#else
+	return 0;
+#endif
+}
+
+size_t
+get_physical_mem()
+{
+#ifdef _WIN32
+	MEMORYSTATUSEX status;
+	status.dwLength = sizeof(status);
+	if (!GlobalMemoryStatusEx(&status))  return 0;
+	return status.ullTotalPhys;
+#else
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long page_size = sysconf(_SC_PAGESIZE);
+	if (pages <= 0 || page_size <= 0)  return 0;
+	size_t mem = (size_t)pages * page_size;
+	size_t limit = get_container_mem();
+	return (limit && limit < mem ? limit : mem);
+#endif
+}
+
 int
 file_exists(const char *name)
 {
@@ -1,6 +1,7 @@
 #ifndef PACHI_UTIL_H
 #define PACHI_UTIL_H
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -40,9 +41,26 @@ int file_exists(const char *name);
 /* windows: cd to pachi directory to avoid cwd issues. */
 void win_set_pachi_cwd(char *pachi);
 
-/* Get number of processors. */
+/* Get number of processors we can use
+ * (takes cpu affinity and container cpu quota into account). */
 int get_nprocessors();
 
+/* Default number of search threads: number of processors, only fast
+ * ones on big.LITTLE systems. Little cores add few playouts but hold
+ * virtual loss in the tree much longer, and run hot on phones. */
+int get_default_threads();
+
+/* Cpu time used so far [s], by everyone on the host (@busy) and by
+ * this process (@self). Returns false if not available (linux only). */
+bool get_cpu_times(double *busy, double *self);
+
+/* Get amount of physical memory in bytes, 0 if unknown.
+ * (container memory limit if lower) */
+size_t get_physical_mem();
+
+/* Container (cgroup) memory limit in bytes, 0 if none. */
+size_t get_container_mem();
+
 
 /**************************************************************************************************/
 /* Data files */